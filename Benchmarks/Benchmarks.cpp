@@ -0,0 +1,229 @@
+#include "Benchmarks.h"
+#include <algorithm>
+#include <cstring>
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+/*
+
+Usage: Benchmarks [options] [names...]
+
+Runs every benchmark, or only the named ones, and returns non-zero if any of them deviates from its
+reference or ground truth. The pipeline benchmarks (createshift, ctffit, ctfscore, ctfgridfit,
+projectforward, initprojector, backprojector, reconstruction, tomoalign, precision) work on deterministic
+synthetic data and additionally go into the JSON report.
+
+--preset ci|4k|8k   Problem sizes; ci (default) is small enough for continuous integration
+--frame N           Movie frame size
+--frames N          Movie frames
+--volume N          Volume size
+--batch N           Projections per ProjectForward call
+--repeats N         Timed runs per stage
+--json PATH         Write a machine-readable report
+
+*/
+
+BenchmarkSettings Settings = { 1024, 16, 64, 64, 5 };
+
+struct BenchmarkEntry
+{
+    const char* name;
+    bool (*run)();
+};
+
+static const BenchmarkEntry Entries[] =
+{
+    { "cubic", BenchmarkCubic },
+    { "cubicweights", BenchmarkCubicWeights },
+    { "movieio", BenchmarkMovieIO },
+    { "memorypool", BenchmarkMemoryPool },
+    { "shiftdiffgrad", BenchmarkShiftDiffGrad },
+    { "scheduler", BenchmarkScheduler },
+    { "createshift", BenchmarkCreateShift },
+    { "ctffit", BenchmarkCTFFit },
+    { "ctfscore", BenchmarkCTFScore },
+    { "ctfgridfit", BenchmarkCTFGridFit },
+    { "projectforward", BenchmarkProjectForward },
+    { "initprojector", BenchmarkInitProjector },
+    { "backprojector", BenchmarkBackprojector },
+    { "reconstruction", BenchmarkReconstruction },
+    { "tomoalign", BenchmarkTomoAlign },
+    { "precision", BenchmarkPrecision },
+    { "fftplancache", BenchmarkFFTPlanCache },
+    { "weightoptimization", BenchmarkWeightOptimization },
+    { "shiftaverage", BenchmarkShiftAverage },
+    { "eventmovie", BenchmarkEventMovie },
+    { "tomorealspace", BenchmarkTomoRealspace }
+};
+
+namespace
+{
+    std::vector<StageReport> Reports;
+
+    void SetSizes(int framesize, int nframes, int volumesize, int batch)
+    {
+        Settings.framesize = framesize;
+        Settings.nframes = nframes;
+        Settings.volumesize = volumesize;
+        Settings.batch = batch;
+    }
+
+    // Nearest-rank percentile
+    double Percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+            return 0;
+
+        std::sort(values.begin(), values.end());
+        size_t rank = (size_t)ceil(p / 100.0 * values.size());
+        return values[gtom::tmin(values.size() - 1, rank > 0 ? rank - 1 : 0)];
+    }
+
+    long long PeakResidentBytes()
+    {
+#ifdef _MSC_VER
+        PROCESS_MEMORY_COUNTERS counters;
+        if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+            return (long long)counters.PeakWorkingSetSize;
+        return 0;
+#else
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (long long)usage.ru_maxrss * 1024;
+#endif
+    }
+
+    bool WriteJSON(const char* path, const std::vector<std::pair<std::string, bool>> &results)
+    {
+        FILE* file = fopen(path, "w");
+        if (!file)
+            return false;
+
+        fprintf(file, "{\n");
+        fprintf(file, "  \"settings\": { \"framesize\": %d, \"nframes\": %d, \"volumesize\": %d, \"batch\": %d, \"repeats\": %d, \"threads\": %d },\n",
+                Settings.framesize, Settings.nframes, Settings.volumesize, Settings.batch, Settings.repeats, omp_get_max_threads());
+
+        fprintf(file, "  \"benchmarks\": [");
+        for (size_t i = 0; i < results.size(); i++)
+            fprintf(file, "%s\n    { \"name\": \"%s\", \"passed\": %s }", i > 0 ? "," : "", results[i].first.c_str(), results[i].second ? "true" : "false");
+        fprintf(file, "\n  ],\n");
+
+        fprintf(file, "  \"stages\": [");
+        for (size_t i = 0; i < Reports.size(); i++)
+        {
+            const StageReport &r = Reports[i];
+            double p50 = Percentile(r.latencies, 50);
+
+            fprintf(file, "%s\n    {\n", i > 0 ? "," : "");
+            fprintf(file, "      \"name\": \"%s\",\n", r.name.c_str());
+            fprintf(file, "      \"size\": \"%s\",\n", r.size.c_str());
+            fprintf(file, "      \"runs\": %d,\n", (int)r.latencies.size());
+            fprintf(file, "      \"latency_ms\": { \"min\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f },\n",
+                    Percentile(r.latencies, 0) * 1e3, p50 * 1e3, Percentile(r.latencies, 90) * 1e3, Percentile(r.latencies, 99) * 1e3, Percentile(r.latencies, 100) * 1e3);
+            fprintf(file, "      \"throughput\": { \"value\": %.6g, \"unit\": \"%s/s\" },\n", p50 > 0 ? r.work / p50 : 0.0, r.workunit.c_str());
+            fprintf(file, "      \"peak_scratch_bytes\": %lld,\n", r.peakscratch);
+            fprintf(file, "      \"error\": { \"name\": \"%s\", \"value\": %.6g, \"tolerance\": %.6g, \"passed\": %s }\n",
+                    r.errorname.c_str(), r.error, r.tolerance, r.error <= r.tolerance ? "true" : "false");
+            fprintf(file, "    }");
+        }
+        fprintf(file, "\n  ],\n");
+
+        fprintf(file, "  \"peak_resident_bytes\": %lld\n", PeakResidentBytes());
+        fprintf(file, "}\n");
+
+        fclose(file);
+        return true;
+    }
+}
+
+void ReportStage(const StageReport &report)
+{
+    Reports.push_back(report);
+
+    double p50 = Percentile(report.latencies, 50);
+    printf("%-16s %-16s p50 %9.2f ms  p90 %9.2f ms  %10.4g %s/s  scratch %8.1f MB  %s %.3g (<= %.3g)\n",
+           report.name.c_str(), report.size.c_str(), p50 * 1e3, Percentile(report.latencies, 90) * 1e3,
+           p50 > 0 ? report.work / p50 : 0.0, report.workunit.c_str(), report.peakscratch / 1048576.0,
+           report.errorname.c_str(), report.error, report.tolerance);
+}
+
+int main(int argc, char** argv)
+{
+    const char* jsonpath = NULL;
+    std::vector<std::string> selected;
+
+    for (int a = 1; a < argc; a++)
+    {
+        std::string arg = argv[a];
+        bool hasvalue = a + 1 < argc;
+
+        if (arg == "--preset" && hasvalue)
+        {
+            std::string preset = argv[++a];
+            if (preset == "4k")
+                SetSizes(4096, 40, 256, 256);
+            else if (preset == "8k")
+                SetSizes(8192, 40, 512, 512);
+            else if (preset == "ci")
+                SetSizes(1024, 16, 64, 64);
+            else
+            {
+                printf("Unknown preset %s\n", preset.c_str());
+                return 2;
+            }
+        }
+        else if (arg == "--frame" && hasvalue)
+            Settings.framesize = atoi(argv[++a]);
+        else if (arg == "--frames" && hasvalue)
+            Settings.nframes = atoi(argv[++a]);
+        else if (arg == "--volume" && hasvalue)
+            Settings.volumesize = atoi(argv[++a]);
+        else if (arg == "--batch" && hasvalue)
+            Settings.batch = atoi(argv[++a]);
+        else if (arg == "--repeats" && hasvalue)
+            Settings.repeats = gtom::tmax(1, atoi(argv[++a]));
+        else if (arg == "--json" && hasvalue)
+            jsonpath = argv[++a];
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            printf("Unknown option %s\n", arg.c_str());
+            return 2;
+        }
+        else
+            selected.push_back(arg);
+    }
+
+    int nfailed = 0;
+    std::vector<std::pair<std::string, bool>> results;
+
+    for (const BenchmarkEntry &entry : Entries)
+    {
+        // Run everything, or only the benchmarks named on the command line
+        if (!selected.empty() && std::find(selected.begin(), selected.end(), std::string(entry.name)) == selected.end())
+            continue;
+
+        printf("== %s\n", entry.name);
+        bool passed = entry.run();
+        if (!passed)
+        {
+            printf("!! %s deviates from the reference\n", entry.name);
+            nfailed++;
+        }
+
+        results.push_back(std::make_pair(std::string(entry.name), passed));
+    }
+
+    if (jsonpath != NULL && !WriteJSON(jsonpath, results))
+    {
+        printf("Couldn't write %s\n", jsonpath);
+        return 2;
+    }
+
+    return nfailed > 0 ? 1 : 0;
+}
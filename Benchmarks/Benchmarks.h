@@ -0,0 +1,174 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include "../CPUAcceleration/Functions.h"
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+// Command line settings shared by the pipeline benchmarks, see Benchmarks.cpp for the presets
+struct BenchmarkSettings
+{
+    int framesize;      // Synthetic movies are framesize x framesize x nframes
+    int nframes;
+    int volumesize;     // Synthetic volumes are volumesize^3
+    int batch;          // Projections per ProjectForward call
+    int repeats;        // Timed runs per stage, for the latency percentiles
+};
+
+extern BenchmarkSettings Settings;
+
+// One pipeline stage in the JSON report
+struct StageReport
+{
+    std::string name;
+    std::string size;               // Human-readable problem size, e.g. "1024x1024x16"
+    std::vector<double> latencies;  // Seconds per timed run
+    double work;                    // Units of work per run, e.g. frames
+    std::string workunit;
+    long long peakscratch;          // Peak bytes in use in the memory pool during the timed runs
+    std::string errorname;          // Deviation from the synthetic ground truth
+    double error;
+    double tolerance;
+};
+
+void ReportStage(const StageReport &report);
+
+// Best wall time in seconds over several repeats, after one warm-up run
+inline double BenchmarkSeconds(std::function<void()> f, int repeats = 5)
+{
+    f();
+
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        best = gtom::tmin(best, std::chrono::duration<double>(end - start).count());
+    }
+
+    return best;
+}
+
+// Wall time in seconds of every run after one warm-up run
+inline std::vector<double> BenchmarkLatencies(std::function<void()> f, int repeats)
+{
+    f();
+
+    std::vector<double> latencies;
+    for (int r = 0; r < repeats; r++)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        f();
+        auto end = std::chrono::high_resolution_clock::now();
+
+        latencies.push_back(std::chrono::duration<double>(end - start).count());
+    }
+
+    return latencies;
+}
+
+inline std::vector<float> RandomValues(size_t n, float min, float max, unsigned int seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> distribution(min, max);
+
+    std::vector<float> values(n);
+    for (size_t i = 0; i < n; i++)
+        values[i] = distribution(generator);
+
+    return values;
+}
+
+// Latencies of f over Settings.repeats runs, and the memory pool's peak during them
+template<class F> StageReport TimeStage(const char* name, F f)
+{
+    MemoryPoolStats before, after;
+    MemoryPoolGetStats(&before);
+    MemoryPoolResetStats();
+
+    StageReport report;
+    report.name = name;
+    report.latencies = BenchmarkLatencies(f, Settings.repeats);
+
+    MemoryPoolGetStats(&after);
+    report.peakscratch = after.peakinuse - before.bytesinuse;
+
+    return report;
+}
+
+inline std::string SizeString(int x, int y, int z)
+{
+    char buffer[64];
+    sprintf(buffer, "%dx%dx%d", x, y, z);
+    return std::string(buffer);
+}
+
+inline double NormalizedCorrelation(const std::vector<float> &a, const std::vector<float> &b)
+{
+    double sum1 = 0, sum2 = 0, sum11 = 0, sum22 = 0, sum12 = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        sum1 += a[i];
+        sum2 += b[i];
+        sum11 += (double)a[i] * a[i];
+        sum22 += (double)b[i] * b[i];
+        sum12 += (double)a[i] * b[i];
+    }
+
+    double n = (double)a.size();
+    double covariance = sum12 / n - sum1 / n * sum2 / n;
+    double std1 = sqrt(gtom::tmax(0.0, sum11 / n - sum1 / n * sum1 / n));
+    double std2 = sqrt(gtom::tmax(0.0, sum22 / n - sum2 / n * sum2 / n));
+
+    return std1 > 0 && std2 > 0 ? covariance / (std1 * std2) : 0;
+}
+
+// Synthetic.cpp:
+
+// Movie of a random specimen drifting by h_shifts[frame] pixels, with Gaussian noise of the given standard
+// deviation relative to the specimen's
+std::vector<float> SyntheticMovie(int2 dims, int nframes, const float2* h_shifts, float noise, unsigned int seed);
+
+// Background-subtracted power spectrum |CTF| * envelope + noise on a half-plane of sidelength^2 pixels,
+// with coordinates for CTFFitMean (cycles per pixel, angle)
+void SyntheticCTFSpectrum(int sidelength, gtom::CTFParams params, float noise, unsigned int seed, std::vector<float> &ps, std::vector<float2> &coords);
+
+// Gaussian blob of the given radius (standard deviation) in pixels, centered at 'center' relative to the box center
+std::vector<float> SyntheticBlobVolume(int size, float3 center, float sigma);
+
+// Analytic Fourier transform of SyntheticBlobVolume in RELION's projector layout with the given oversampling
+std::vector<float2> SyntheticBlobProjector(int size, int oversampling, float3 center, float sigma, int3 &dimsprojector);
+
+// Fourier transform of SyntheticBlobVolume at frequency k (in cycles per box)
+float2 SyntheticBlobFT(int size, float3 center, float sigma, float3 k);
+
+// Returns false if the benchmark's results deviate from the reference beyond the documented tolerance
+bool BenchmarkCubic();
+bool BenchmarkCubicWeights();
+bool BenchmarkMovieIO();
+bool BenchmarkMemoryPool();
+bool BenchmarkShiftDiffGrad();
+bool BenchmarkScheduler();
+bool BenchmarkCreateShift();
+bool BenchmarkCTFFit();
+bool BenchmarkCTFScore();
+bool BenchmarkCTFGridFit();
+bool BenchmarkProjectForward();
+bool BenchmarkInitProjector();
+bool BenchmarkBackprojector();
+bool BenchmarkReconstruction();
+bool BenchmarkTomoAlign();
+bool BenchmarkPrecision();
+bool BenchmarkFFTPlanCache();
+bool BenchmarkWeightOptimization();
+bool BenchmarkShiftAverage();
+bool BenchmarkEventMovie();
+bool BenchmarkTomoRealspace();
+
+#endif
@@ -0,0 +1,380 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+Reference: the per-sample implementation CubicInterpOnGrid and CubicInterpIrregular used before the
+coefficients were tabulated. Every sample builds its own window of points and derives the spline slopes
+from scratch, dispatching on the window size at runtime.
+
+*/
+
+namespace
+{
+    template<int N> float ReferenceCubicInterp(float2* data, float x)
+    {
+        float Breaks[N];
+        float4 Coefficients[N - 1];
+
+        for (int i = 0; i < N; i++)
+            Breaks[i] = data[i].x;
+
+        float h[N - 1];
+        for (int i = 0; i < N - 1; i++)
+            h[i] = data[i + 1].x - data[i].x;
+
+        float del[N - 1];
+        for (int i = 0; i < N - 1; i++)
+            del[i] = (data[i + 1].y - data[i].y) / h[i];
+
+        float slopes[N] = { 0 };
+        {
+            if (N == 2)
+                slopes[0] = slopes[1] = del[0];
+            else
+            {
+                for (int k = 0; k < N - 2; k++)
+                {
+                    if (del[k] * del[k + 1] <= 0.0f)
+                        continue;
+
+                    float hs = h[k] + h[k + 1];
+                    float w1 = (h[k] + hs) / (3.0f * hs);
+                    float w2 = (hs + h[k + 1]) / (3.0f * hs);
+                    float dmax = tmax(abs(del[k]), abs(del[k + 1]));
+                    float dmin = tmin(abs(del[k]), abs(del[k + 1]));
+                    slopes[k + 1] = dmin / (w1 * (del[k] / dmax) + w2 * (del[k + 1] / dmax));
+                }
+
+                slopes[0] = ((2.0f * h[0] + h[1]) * del[0] - h[0] * del[1]) / (h[0] + h[1]);
+                if (sgn(slopes[0]) != sgn(del[0]))
+                    slopes[0] = 0;
+                else if (sgn(del[0]) != sgn(del[1]) && abs(slopes[0]) > abs(3.0f * del[0]))
+                    slopes[0] = 3.0f * del[0];
+
+                int n = N - 1;
+                slopes[n] = ((2 * h[n - 1] + h[n - 2]) * del[n - 1] - h[n - 1] * del[n - 2]) / (h[n - 1] + h[n - 2]);
+                if (sgn(slopes[n]) != sgn(del[n - 1]))
+                    slopes[n] = 0;
+                else if (sgn(del[n - 1]) != sgn(del[n - 2]) && abs(slopes[n]) > abs(3.0f * del[n - 1]))
+                    slopes[n] = 3.0f * del[n - 1];
+            }
+        }
+
+        float dzzdx[N - 1];
+        for (int i = 0; i < N - 1; i++)
+            dzzdx[i] = (del[i] - slopes[i]) / h[i];
+
+        float dzdxdx[N - 1];
+        for (int i = 0; i < N - 1; i++)
+            dzdxdx[i] = (slopes[i + 1] - del[i]) / h[i];
+
+        for (int i = 0; i < N - 1; i++)
+            Coefficients[i] = make_float4((dzdxdx[i] - dzzdx[i]) / h[i],
+                                          2.0f * dzzdx[i] - dzdxdx[i],
+                                          slopes[i],
+                                          data[i].y);
+
+        int index = 0;
+        if (x < Breaks[1])
+            index = 0;
+        else if (x >= Breaks[N - 2])
+            index = N - 2;
+        else
+            for (int j = 2; j < N - 1; j++)
+                if (x < Breaks[j])
+                {
+                    index = j - 1;
+                    break;
+                }
+
+        float xs = x - Breaks[index];
+
+        float v = Coefficients[index].x;
+        v = xs * v + Coefficients[index].y;
+        v = xs * v + Coefficients[index].z;
+        v = xs * v + Coefficients[index].w;
+
+        return v;
+    }
+
+    float ReferenceCubicInterpShort(float2* data, float x, int n)
+    {
+        if (n == 4)
+            return ReferenceCubicInterp<4>(data, x);
+        if (n == 3)
+            return ReferenceCubicInterp<3>(data, x);
+
+        return ReferenceCubicInterp<2>(data, x);
+    }
+
+    float ReferenceCubicPoint(int3 dimensions, const float* values, float3 coords)
+    {
+        float3 index = make_float3(floor(coords.x), floor(coords.y), floor(coords.z));
+
+        int MinX = tmax(0, (int)index.x - 1), MaxX = tmin((int)index.x + 2, dimensions.x - 1);
+        int MinY = tmax(0, (int)index.y - 1), MaxY = tmin((int)index.y + 2, dimensions.y - 1);
+        int MinZ = tmax(0, (int)index.z - 1), MaxZ = tmin((int)index.z + 2, dimensions.z - 1);
+
+        int nz = MaxZ - MinZ + 1;
+        int ny = MaxY - MinY + 1;
+        int nx = MaxX - MinX + 1;
+
+        float InterpX[16];
+        for (int z = MinZ; z <= MaxZ; z++)
+            for (int y = MinY; y <= MaxY; y++)
+            {
+                float2 Points[4];
+                if (nx == 1)
+                    InterpX[(z - MinZ) * ny + y - MinY] = values[(z * dimensions.y + y) * 1];
+                else
+                {
+                    for (int x = MinX; x <= MaxX; x++)
+                        Points[x - MinX] = make_float2(x, values[(z * dimensions.y + y) * dimensions.x + x]);
+
+                    InterpX[(z - MinZ) * ny + y - MinY] = ReferenceCubicInterpShort(Points, coords.x, nx);
+                }
+            }
+
+        float InterpXY[4];
+        for (int z = MinZ; z <= MaxZ; z++)
+        {
+            float2 Points[4];
+            if (ny == 1)
+                InterpXY[z - MinZ] = InterpX[(z - MinZ) * ny];
+            else
+            {
+                for (int y = MinY; y <= MaxY; y++)
+                    Points[y - MinY] = make_float2(y, InterpX[(z - MinZ) * ny + y - MinY]);
+
+                InterpXY[z - MinZ] = ReferenceCubicInterpShort(Points, coords.y, ny);
+            }
+        }
+
+        if (nz == 1)
+            return InterpXY[0];
+
+        float2 Points[4];
+        for (int z = MinZ; z <= MaxZ; z++)
+            Points[z - MinZ] = make_float2(z, InterpXY[z - MinZ]);
+
+        return ReferenceCubicInterpShort(Points, coords.z, nz);
+    }
+
+    void ReferenceCubicInterpOnGrid(int3 dimensions, float* values, float3 spacing, int3 valueGrid, float3 step, float3 offset, float* output)
+    {
+        #pragma omp parallel for
+        for (int valueZ = 0; valueZ < valueGrid.z; valueZ++)
+            for (int valueY = 0; valueY < valueGrid.y; valueY++)
+                for (int valueX = 0; valueX < valueGrid.x; valueX++)
+                {
+                    float3 coords = make_float3(valueX * step.x + offset.x, valueY * step.y + offset.y, valueZ * step.z + offset.z);
+                    coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);
+
+                    output[(valueZ * valueGrid.y + valueY) * valueGrid.x + valueX] = ReferenceCubicPoint(dimensions, values, coords);
+                }
+    }
+
+    void ReferenceCubicInterpIrregular(int3 dimensions, float* values, float3* positions, int npositions, float3 spacing, float* output)
+    {
+        #pragma omp parallel for
+        for (int p = 0; p < npositions; p++)
+        {
+            float3 coords = positions[p];
+            coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);
+
+            output[p] = ReferenceCubicPoint(dimensions, values, coords);
+        }
+    }
+
+    // Same as CubicGrid.cs
+    float3 GridSpacing(int3 dims)
+    {
+        return make_float3(1.0f / tmax(1, dims.x - 1), 1.0f / tmax(1, dims.y - 1), 1.0f / tmax(1, dims.z - 1));
+    }
+
+    struct Deviation
+    {
+        float maxabs;
+        size_t nidentical;
+    };
+
+    Deviation Compare(const std::vector<float> &a, const std::vector<float> &b)
+    {
+        Deviation d = { 0.0f, 0 };
+        for (size_t i = 0; i < a.size(); i++)
+        {
+            d.maxabs = tmax(d.maxabs, abs(a[i] - b[i]));
+            d.nidentical += a[i] == b[i] ? 1 : 0;
+        }
+
+        return d;
+    }
+}
+
+/*
+
+Compares the tabulated, lane-batched implementation to the reference on grids the size of what CubicGrid.cs
+uses for movie alignment (XY grid over many frames) and tomography (few nodes, 3D), both on regular output
+grids and at random positions. Positions stay within the grid, where results must be identical; a tolerance
+of 1e-6 relative to the value range accommodates compilers contracting the polynomial into FMAs differently.
+
+*/
+
+bool BenchmarkCubic()
+{
+    const int3 Grids[] = { toInt3(1, 1, 40), toInt3(5, 5, 1), toInt3(5, 5, 40), toInt3(8, 8, 60), toInt3(3, 3, 3), toInt3(16, 16, 16) };
+    const int3 OutputGrid = toInt3(64, 64, 40);
+    const int NPositions = 1 << 20;
+    const float Tolerance = 1e-6f;
+
+    bool passed = true;
+
+    printf("%-12s %-10s %12s %12s %9s %12s %10s\n", "grid", "mode", "reference", "tabulated", "speedup", "max |diff|", "identical");
+
+    for (int3 dims : Grids)
+    {
+        std::vector<float> values = RandomValues(Elements(dims), -1.0f, 1.0f, 123);
+        float3 spacing = GridSpacing(dims);
+
+        char gridname[32];
+        sprintf(gridname, "%dx%dx%d", dims.x, dims.y, dims.z);
+
+        // Regular output grid, laid out like CubicGrid.GetInterpolatedNative(int3, float3)
+        {
+            int3 valueGrid = make_int3(OutputGrid.x, OutputGrid.y, dims.z > 1 ? OutputGrid.z : 1);
+            float3 step = make_float3(1.0f / (valueGrid.x - 1), 1.0f / (valueGrid.y - 1), 1.0f / tmax(1, valueGrid.z - 1));
+            float3 offset = make_float3(0, 0, valueGrid.z == 1 ? 0.5f : 0.0f);
+
+            std::vector<float> reference(Elements(valueGrid)), tabulated(Elements(valueGrid));
+
+            double treference = BenchmarkSeconds([&]() { ReferenceCubicInterpOnGrid(dims, values.data(), spacing, valueGrid, step, offset, reference.data()); });
+            double ttabulated = BenchmarkSeconds([&]() { CubicInterpOnGrid(dims, values.data(), spacing, valueGrid, step, offset, tabulated.data()); });
+
+            Deviation d = Compare(reference, tabulated);
+            passed = passed && d.maxabs <= Tolerance;
+
+            printf("%-12s %-10s %10.3f ms %10.3f ms %8.2fx %12.3g %9.5f\n", gridname, "ongrid", treference * 1e3, ttabulated * 1e3, treference / ttabulated, d.maxabs, (double)d.nidentical / reference.size());
+        }
+
+        // Random positions
+        {
+            std::vector<float> positions = RandomValues(NPositions * 3, 0.0f, 1.0f, 456);
+            std::vector<float> reference(NPositions), tabulated(NPositions);
+
+            double treference = BenchmarkSeconds([&]() { ReferenceCubicInterpIrregular(dims, values.data(), (float3*)positions.data(), NPositions, spacing, reference.data()); });
+            double ttabulated = BenchmarkSeconds([&]() { CubicInterpIrregular(dims, values.data(), (float3*)positions.data(), NPositions, spacing, tabulated.data()); });
+
+            Deviation d = Compare(reference, tabulated);
+            passed = passed && d.maxabs <= Tolerance;
+
+            printf("%-12s %-10s %10.3f ms %10.3f ms %8.2fx %12.3g %9.5f\n", gridname, "irregular", treference * 1e3, ttabulated * 1e3, treference / ttabulated, d.maxabs, (double)d.nidentical / reference.size());
+        }
+    }
+
+    return passed;
+}
+
+/*
+
+Gradient of a weighted sum of interpolated values w.r.t. all grid nodes, the way Warp's optimizers need it:
+once through central finite differences (2 CubicInterpIrregular calls per node), once through the CSR Jacobian
+returned by CubicInterpIrregularWithWeights. Finite differences in single precision are only good to ~1e-3
+relative to the gradient's magnitude, and break down where a perturbation flips the sign of a secant, so the grid
+is a smooth field increasing monotonically along every axis.
+
+*/
+
+bool BenchmarkCubicWeights()
+{
+    const int3 Grids[] = { toInt3(5, 5, 20), toInt3(8, 8, 40), toInt3(3, 3, 3) };
+    const int NPositions = 1 << 14;
+    const float Delta = 1e-2f;
+
+    bool passed = true;
+
+    printf("%-12s %14s %14s %9s %14s\n", "grid", "finite diff", "jacobian", "speedup", "max rel diff");
+
+    for (int3 dims : Grids)
+    {
+        size_t nnodes = Elements(dims);
+        std::vector<float> values(nnodes);
+        for (int z = 0; z < dims.z; z++)
+            for (int y = 0; y < dims.y; y++)
+                for (int x = 0; x < dims.x; x++)
+                    values[(z * dims.y + y) * dims.x + x] = x + 0.5f * sin(x) + 2.0f * y + 0.3f * cos(z) + z;
+        std::vector<float> positions = RandomValues(NPositions * 3, 0.0f, 1.0f, 1011);
+        std::vector<float> lossweights = RandomValues(NPositions, -1.0f, 1.0f, 1213);
+        float3 spacing = GridSpacing(dims);
+
+        char gridname[32];
+        sprintf(gridname, "%dx%dx%d", dims.x, dims.y, dims.z);
+
+        std::vector<double> gradfinite(nnodes), gradjacobian(nnodes);
+
+        double tfinite = BenchmarkSeconds([&]()
+        {
+            std::vector<float> perturbed(values), plus(NPositions), minus(NPositions);
+            for (size_t n = 0; n < nnodes; n++)
+            {
+                perturbed[n] = values[n] + Delta;
+                CubicInterpIrregular(dims, perturbed.data(), (float3*)positions.data(), NPositions, spacing, plus.data());
+                perturbed[n] = values[n] - Delta;
+                CubicInterpIrregular(dims, perturbed.data(), (float3*)positions.data(), NPositions, spacing, minus.data());
+                perturbed[n] = values[n];
+
+                double sum = 0;
+                for (int p = 0; p < NPositions; p++)
+                    sum += (double)lossweights[p] * (plus[p] - minus[p]);
+                gradfinite[n] = sum / (2.0 * Delta);
+            }
+        }, 1);
+
+        double tjacobian = BenchmarkSeconds([&]()
+        {
+            std::vector<float> output(NPositions);
+            std::vector<int> rowoffsets(NPositions + 1), columns(NPositions * 64);
+            std::vector<float> weights(NPositions * 64);
+
+            CubicInterpIrregularWithWeights(dims, values.data(), (float3*)positions.data(), NPositions, spacing, output.data(), rowoffsets.data(), columns.data(), weights.data());
+
+            for (size_t n = 0; n < nnodes; n++)
+                gradjacobian[n] = 0;
+            for (int p = 0; p < NPositions; p++)
+                for (int i = rowoffsets[p]; i < rowoffsets[p + 1]; i++)
+                    gradjacobian[columns[i]] += (double)lossweights[p] * weights[i];
+        }, 1);
+
+        double maxgrad = 0, maxdiff = 0;
+        for (size_t n = 0; n < nnodes; n++)
+        {
+            maxgrad = tmax(maxgrad, abs(gradfinite[n]));
+            maxdiff = tmax(maxdiff, abs(gradfinite[n] - gradjacobian[n]));
+        }
+        double reldiff = maxdiff / tmax(1e-10, maxgrad);
+        passed = passed && reldiff < 1e-2;
+
+        printf("%-12s %11.3f ms %11.3f ms %8.1fx %14.3g\n", gridname, tfinite * 1e3, tjacobian * 1e3, tfinite / tjacobian, reldiff);
+    }
+
+    // Values returned alongside the weights must be those of CubicInterpIrregular
+    {
+        int3 dims = toInt3(5, 5, 20);
+        std::vector<float> values = RandomValues(Elements(dims), -1.0f, 1.0f, 1415);
+        std::vector<float> positions = RandomValues(NPositions * 3, 0.0f, 1.0f, 1617);
+        float3 spacing = GridSpacing(dims);
+
+        std::vector<float> plain(NPositions), withweights(NPositions), weights(NPositions * 64);
+        std::vector<int> rowoffsets(NPositions + 1), columns(NPositions * 64);
+
+        CubicInterpIrregular(dims, values.data(), (float3*)positions.data(), NPositions, spacing, plain.data());
+        CubicInterpIrregularWithWeights(dims, values.data(), (float3*)positions.data(), NPositions, spacing, withweights.data(), rowoffsets.data(), columns.data(), weights.data());
+
+        Deviation d = Compare(plain, withweights);
+        passed = passed && d.maxabs <= 1e-6f;
+
+        printf("values vs CubicInterpIrregular: max |diff| %g\n", d.maxabs);
+    }
+
+    return passed;
+}
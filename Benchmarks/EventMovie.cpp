@@ -0,0 +1,301 @@
+#include "Benchmarks.h"
+#include <algorithm>
+using namespace gtom;
+
+/*
+
+A synthetic event movie with hundreds of sparse fractions is written as EER, with 7 and 8 bit runs, and read
+back through MovieReaderOpenGroups in groups of fractions at 1x, 2x and 4x super-resolution. Every group must
+hold exactly the counts of its fractions' events at the requested resolution. The ring only ever holds a few
+groups, compared to what all fractions would take as floats. A legacy 8 bit fraction built byte by byte checks
+the decoder against the format itself rather than against this file's encoder.
+
+*/
+
+namespace
+{
+    struct Event
+    {
+        uint position;          // Pixel index on the sensor
+        unsigned char subpixel; // x in the low 2 bits, y in the high 2 bits
+    };
+
+    // Bits go in LSB first
+    struct BitWriter
+    {
+        std::vector<unsigned char> bytes;
+        size_t nbits = 0;
+
+        void Put(uint value, int bits)
+        {
+            for (int b = 0; b < bits; b++, nbits++)
+            {
+                if (nbits % 8 == 0)
+                    bytes.push_back(0);
+                bytes.back() |= (unsigned char)(((value >> b) & 1) << (nbits % 8));
+            }
+        }
+    };
+
+    // 7 bit: a nibble only follows runs that end in an event. 8 bit (legacy): every symbol is a run and a nibble.
+    std::vector<unsigned char> EncodeEvents(const std::vector<Event> &events, size_t npixels, int compression)
+    {
+        bool fixedsymbols = compression == 65000;
+        int runbits = fixedsymbols ? 8 : 7;
+        uint maxrun = (1u << runbits) - 1;
+        BitWriter writer;
+
+        auto putrun = [&](size_t &gap)
+        {
+            for (; gap >= maxrun; gap -= maxrun)
+            {
+                writer.Put(maxrun, runbits);
+                if (fixedsymbols)
+                    writer.Put(0, 4);
+            }
+            writer.Put((uint)gap, runbits);
+        };
+
+        size_t next = 0;
+        for (const Event &e : events)
+        {
+            size_t gap = e.position - next;
+            putrun(gap);
+            writer.Put(e.subpixel ^ 0xA, 4);
+            next = e.position + 1;
+        }
+
+        // Run to the end of the sensor
+        size_t gap = npixels - next;
+        putrun(gap);
+        if (fixedsymbols)
+            writer.Put(0, 4);
+
+        return writer.bytes;
+    }
+
+    void WriteEER(const char* path, const std::vector<std::vector<unsigned char>> &streams, int2 dims, int compression)
+    {
+        FILE* file = fopen(path, "wb");
+        auto put16 = [&](int v) { unsigned char b[2] = { (unsigned char)v, (unsigned char)(v >> 8) }; fwrite(b, 1, 2, file); };
+        auto put32 = [&](long long v) { unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) }; fwrite(b, 1, 4, file); };
+        auto entry = [&](int tag, int type, int count, long long value)
+        {
+            put16(tag);
+            put16(type);
+            put32(count);
+            if (type == 3 && count == 1)
+            {
+                put16((int)value);
+                put16(0);
+            }
+            else
+                put32(value);
+        };
+
+        fwrite("II", 1, 2, file);
+        put16(42);
+        put32(0);    // Patched below
+
+        std::vector<long long> ifdoffsets;
+        for (const std::vector<unsigned char> &stream : streams)
+        {
+
+            // Two strips, split anywhere: the stream continues across them
+            long long split = stream.size() / 2;
+            long long offsets[2] = { ftell(file), ftell(file) + split };
+            long long bytecounts[2] = { split, (long long)stream.size() - split };
+            fwrite(stream.data(), 1, stream.size(), file);
+
+            long long offsetsat = ftell(file);
+            put32(offsets[0]);
+            put32(offsets[1]);
+            long long bytecountsat = ftell(file);
+            put32(bytecounts[0]);
+            put32(bytecounts[1]);
+
+            if (ftell(file) % 2)
+                fputc(0, file);
+            ifdoffsets.push_back(ftell(file));
+
+            put16(7);
+            entry(256, 4, 1, dims.x);
+            entry(257, 4, 1, dims.y);
+            entry(258, 3, 1, 1);
+            entry(259, 3, 1, compression);
+            entry(273, 4, 2, offsetsat);
+            entry(278, 4, 1, dims.y);
+            entry(279, 4, 2, bytecountsat);
+            put32(0);    // Patched with the next directory's offset
+        }
+
+        // Chain the directories
+        fseek(file, 4, SEEK_SET);
+        put32(ifdoffsets[0]);
+        for (size_t z = 0; z + 1 < ifdoffsets.size(); z++)
+        {
+            fseek(file, (long)(ifdoffsets[z] + 2 + 7 * 12), SEEK_SET);
+            put32(ifdoffsets[z + 1]);
+        }
+
+        fclose(file);
+    }
+
+    // One legacy 8 bit fraction on a 32x16 sensor, written out by hand: two 12 bit symbols per 3 bytes, each an
+    // 8 bit run in the low bits and the sub-pixel nibble (XOR 0xA) in the high bits
+    bool CheckLegacyLayout()
+    {
+        const int2 Dims = toInt2(32, 16);
+        const std::vector<unsigned char> Bytes =
+        {
+            0x03, 0xF0, 0x0F,   // Run 3, nibble 0: event at pixel 3 | run 255, nibble 0 present but ignored
+            0x0A, 0x27, 0x0F    // Run 10, nibble 7: event at pixel 269 | run 242 to the end of the sensor
+        };
+
+        const char* path = "eventmovie_legacy.eer";
+        WriteEER(path, { Bytes }, Dims, 65000);
+
+        int first = 0, length = 1;
+        int3 dims;
+        void* reader = MovieReaderOpenGroups((char*)path, 1, &first, &length, 1, 4, &dims);
+        bool passed = reader != NULL;
+
+        if (passed)
+        {
+            // Nibble 0 is sub-pixel (2, 2), nibble 7 is (1, 3)
+            std::vector<float> expected(Elements2(Dims) * 16, 0.0f);
+            expected[(0 * 4 + 2) * (Dims.x * 4) + (3 * 4 + 2)] = 1.0f;
+            expected[(8 * 4 + 3) * (Dims.x * 4) + (13 * 4 + 1)] = 1.0f;
+
+            float* h_frame;
+            passed = MovieReaderAcquire(reader, &h_frame) == 0 &&
+                     memcmp(h_frame, expected.data(), expected.size() * sizeof(float)) == 0;
+            MovieReaderRelease(reader);
+            MovieReaderClose(reader);
+        }
+
+        remove(path);
+        return passed;
+    }
+}
+
+bool BenchmarkEventMovie()
+{
+    const int2 Dims = toInt2(512, 512);
+    const int NFractions = 600, FractionsPerGroup = 20;
+    const float Dose = 0.02f;    // Events per pixel per fraction
+    const int RingSize = 3;
+
+    size_t npixels = Elements2(Dims);
+    std::vector<std::vector<Event>> fractions(NFractions);
+    size_t nevents = 0;
+    {
+        std::mt19937 generator(2468);
+        std::uniform_int_distribution<uint> position(0, (uint)npixels - 1);
+        std::uniform_int_distribution<int> subpixel(0, 15);
+
+        for (std::vector<Event> &events : fractions)
+        {
+            std::vector<uint> positions((size_t)(npixels * Dose));
+            for (uint &p : positions)
+                p = position(generator);
+            std::sort(positions.begin(), positions.end());
+            positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+
+            for (uint p : positions)
+                events.push_back({ p, (unsigned char)subpixel(generator) });
+            nevents += events.size();
+        }
+    }
+
+    int ngroups = NFractions / FractionsPerGroup;
+    std::vector<int> groupfirst(ngroups), grouplength(ngroups, FractionsPerGroup);
+    for (int g = 0; g < ngroups; g++)
+        groupfirst[g] = g * FractionsPerGroup;
+
+    struct EventFormat
+    {
+        const char* name;
+        const char* path;
+        int compression;
+    };
+    const EventFormat Formats[] = { { "eer 7 bit", "eventmovie_7bit.eer", 65001 }, { "eer 8 bit", "eventmovie_8bit.eer", 65000 } };
+
+    bool passed = true;
+
+    printf("%dx%d sensor, %d fractions of %.1f events per 100 pixels, %d groups of %d\n", Dims.x, Dims.y, NFractions, Dose * 100, ngroups, FractionsPerGroup);
+    printf("%-10s %8s %9s %11s %12s %10s %12s\n", "format", "upsample", "identical", "read+check", "Mevents/s", "ring MB", "fractions MB");
+
+    for (const EventFormat &format : Formats)
+    {
+        std::vector<std::vector<unsigned char>> streams;
+        for (const std::vector<Event> &events : fractions)
+            streams.push_back(EncodeEvents(events, npixels, format.compression));
+        WriteEER(format.path, streams, Dims, format.compression);
+
+        int3 dimsstored;
+        passed = passed && MovieGetDims((char*)format.path, &dimsstored) && dimsstored.z == NFractions;
+
+        for (int upsampling = 1; upsampling <= 4; upsampling *= 2)
+        {
+            int subshift = upsampling == 4 ? 0 : (upsampling == 2 ? 1 : 2);
+            int2 dimsout = toInt2(Dims.x * upsampling, Dims.y * upsampling);
+
+            bool identical = true;
+            std::vector<float> reference(Elements2(dimsout));
+
+            double tdecode = BenchmarkSeconds([&]()
+            {
+                int3 dims;
+                void* reader = MovieReaderOpenGroups((char*)format.path, RingSize, groupfirst.data(), grouplength.data(), ngroups, upsampling, &dims);
+                if (!reader)
+                {
+                    identical = false;
+                    return;
+                }
+                identical = identical && dims.x == dimsout.x && dims.y == dimsout.y && dims.z == ngroups;
+
+                int g, nread = 0;
+                float* h_frame;
+                while ((g = MovieReaderAcquire(reader, &h_frame)) >= 0)
+                {
+                    std::fill(reference.begin(), reference.end(), 0.0f);
+                    for (int f = groupfirst[g]; f < groupfirst[g] + grouplength[g]; f++)
+                        for (const Event &e : fractions[f])
+                        {
+                            size_t x = ((e.position % Dims.x) * 4 + (e.subpixel & 3)) >> subshift;
+                            size_t y = ((e.position / Dims.x) * 4 + (e.subpixel >> 2)) >> subshift;
+                            reference[y * dimsout.x + x] += 1.0f;
+                        }
+
+                    identical = identical && memcmp(h_frame, reference.data(), reference.size() * sizeof(float)) == 0;
+                    MovieReaderRelease(reader);
+                    nread++;
+                }
+                MovieReaderClose(reader);
+
+                identical = identical && nread == ngroups;
+            }, 2);
+
+            passed = passed && identical;
+
+            double ringmb = (double)tmin(RingSize, ngroups) * Elements2(dimsout) * sizeof(float) / 1048576.0;
+            double fractionsmb = (double)NFractions * Elements2(dimsout) * sizeof(float) / 1048576.0;
+
+            printf("%-10s %7dx %9s %8.1f ms %12.1f %10.1f %12.1f\n", format.name, upsampling, identical ? "yes" : "NO",
+                   tdecode * 1e3, nevents / tdecode * 1e-6, ringmb, fractionsmb);
+        }
+
+        // Event movies can't be upsampled by 3, frame stacks not at all
+        int3 dims;
+        void* invalid = MovieReaderOpenGroups((char*)format.path, RingSize, groupfirst.data(), grouplength.data(), ngroups, 3, &dims);
+        passed = passed && invalid == NULL;
+
+        remove(format.path);
+    }
+
+    bool legacy = CheckLegacyLayout();
+    printf("legacy 8 bit layout: %s\n", legacy ? "ok" : "WRONG");
+
+    return passed && legacy;
+}
@@ -0,0 +1,154 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+FFT and IFFT on the shapes a movie pipeline cycles through, once with the plan cache emptied before
+every call, and once warm. Cached plans must give the same bits as fresh ones, also when many threads
+share them, every warm call must be a hit, a small budget must evict idle plans down to it, and destroyed
+plan handles must be handed out again.
+
+*/
+
+namespace
+{
+    struct Shape
+    {
+        int3 dims;
+        uint batch;
+    };
+
+    const Shape Shapes[] =
+    {
+        { { 256, 256, 1 }, 9 },       // CreateShift regions
+        { { 512, 512, 1 }, 16 },      // CreateSpectra
+        { { 1024, 1024, 1 }, 1 },     // Whole frame
+        { { 64, 64, 64 }, 1 },        // Reconstruction
+        { { 1000, 1, 1 }, 32 }
+    };
+    const int NShapes = sizeof(Shapes) / sizeof(Shape);
+
+    size_t ElementsFFTBatch(const Shape &shape)
+    {
+        return ElementsFFT(shape.dims) * shape.batch;
+    }
+
+    // Forward and back, returns the spectrum
+    std::vector<float2> RoundTrip(std::vector<float> &data, const Shape &shape)
+    {
+        std::vector<float2> spectrum(ElementsFFTBatch(shape));
+        FFT(data.data(), spectrum.data(), shape.dims, shape.batch);
+
+        std::vector<float2> copy = spectrum;    // IFFT destroys its input
+        IFFT(copy.data(), data.data(), shape.dims, shape.batch);
+
+        return spectrum;
+    }
+}
+
+bool BenchmarkFFTPlanCache()
+{
+    const int NIterations = 20;
+    bool passed = true;
+
+    std::vector<std::vector<float>> inputs;
+    for (int s = 0; s < NShapes; s++)
+        inputs.push_back(RandomValues(Elements(Shapes[s].dims) * Shapes[s].batch, -1.0f, 1.0f, 100 + s));
+
+    // Reference from fresh plans
+    FFTPlanCacheTrim();
+    std::vector<std::vector<float2>> reference;
+    for (int s = 0; s < NShapes; s++)
+    {
+        std::vector<float> data = inputs[s];
+        reference.push_back(RoundTrip(data, Shapes[s]));
+
+        float maxerror = 0;
+        for (size_t i = 0; i < data.size(); i++)
+            maxerror = tmax(maxerror, std::abs(data[i] - inputs[s][i]));
+        passed = passed && maxerror < 1e-4f;
+    }
+
+    double tcold = BenchmarkSeconds([&]()
+    {
+        for (int s = 0; s < NShapes; s++)
+        {
+            FFTPlanCacheTrim();
+            std::vector<float> data = inputs[s];
+            RoundTrip(data, Shapes[s]);
+        }
+    }, 3);
+
+    for (int s = 0; s < NShapes; s++)
+    {
+        std::vector<float> data = inputs[s];
+        RoundTrip(data, Shapes[s]);
+    }
+    FFTPlanCacheResetStats();
+
+    double twarm = BenchmarkSeconds([&]()
+    {
+        for (int s = 0; s < NShapes; s++)
+        {
+            std::vector<float> data = inputs[s];
+            RoundTrip(data, Shapes[s]);
+        }
+    }, 3);
+
+    // Warm, bit for bit, and from many threads at once
+    size_t mismatches = 0;
+    #pragma omp parallel for schedule(dynamic, 1) reduction(+:mismatches)
+    for (int i = 0; i < NIterations * NShapes; i++)
+    {
+        int s = i % NShapes;
+        std::vector<float> data = inputs[s];
+        std::vector<float2> spectrum = RoundTrip(data, Shapes[s]);
+
+        mismatches += memcmp(spectrum.data(), reference[s].data(), spectrum.size() * sizeof(float2)) != 0;
+    }
+
+    FFTPlanCacheStats warm;
+    FFTPlanCacheGetStats(&warm);
+
+    // With a quarter of the memory all shapes need, idle plans are evicted down to the budget
+    long long budget = warm.bytescached / 4;
+    FFTPlanCacheSetBudget(budget);
+    for (int s = 0; s < NShapes; s++)
+    {
+        std::vector<float> data = inputs[s];
+        RoundTrip(data, Shapes[s]);
+    }
+
+    FFTPlanCacheStats evicted;
+    FFTPlanCacheGetStats(&evicted);
+    FFTPlanCacheSetBudget(warm.budget);
+
+    // Handles given back with DestroyFFTPlan are handed out again, so create/destroy cycles don't grow the handle table
+    int firsthandle = CreateFFTPlan(Shapes[0].dims, Shapes[0].batch);
+    DestroyFFTPlan(firsthandle);
+    bool reused = true;
+    for (int i = 0; i < NIterations; i++)
+    {
+        int forward = CreateFFTPlan(Shapes[i % NShapes].dims, Shapes[i % NShapes].batch);
+        int backward = CreateIFFTPlan(Shapes[i % NShapes].dims, Shapes[i % NShapes].batch);
+        reused = reused && tmin(forward, backward) == firsthandle && tmax(forward, backward) == firsthandle + 1;
+        DestroyFFTPlan(backward);
+        DestroyFFTPlan(forward);
+    }
+
+    printf("%-10s %12s %12s %9s\n", "", "cold", "warm", "speedup");
+    printf("%-10s %9.3f ms %9.3f ms %8.2fx\n", "per shape", tcold * 1e3 / NShapes, twarm * 1e3 / NShapes, tcold / twarm);
+    printf("requests %lld, hit rate %.4f, plans created %lld in %.3f ms (max %.3f ms), %lld cached, %.1f MB\n",
+           warm.nrequests, (double)warm.nhits / tmax(1LL, warm.nrequests), warm.ncreated,
+           warm.creationseconds * 1e3, warm.maxcreationseconds * 1e3, warm.nplans, warm.bytescached / 1048576.0);
+    printf("budget %.1f MB: %lld evicted, %lld cached, %.1f MB; %zu mismatches with fresh plans\n",
+           budget / 1048576.0, evicted.nevicted - warm.nevicted, evicted.nplans, evicted.bytescached / 1048576.0, mismatches);
+    printf("plan handles %s\n", reused ? "reused" : "NOT reused");
+
+    // Every plan in the warm runs was already there, concurrent callers share the CPU plans
+    passed = passed && mismatches == 0 &&
+             warm.ncreated == 0 && warm.nhits == warm.nrequests && warm.nplansinuse == 0 &&
+             evicted.bytescached <= budget && evicted.nevicted > warm.nevicted && evicted.nplansinuse == 0 && reused;
+
+    return passed;
+}
@@ -0,0 +1,86 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+Allocation pattern of an optimizer loop around ShiftGetDiff/ShiftGetGrad: every evaluation allocates
+a few temporaries of the same sizes, writes them, and frees them again. Once through the system heap,
+once through MallocDevice/FreeDevice inside a pool scope. After the warm-up iteration, every pooled
+allocation must be served from the cache, and the pool's books must balance.
+
+*/
+
+namespace
+{
+    const size_t LoopSizes[] = { 40 << 10, 400 << 10, 4 << 20, 16 << 20 };
+
+    void Touch(float* buffer, size_t bytes)
+    {
+        memset(buffer, 0, bytes);
+    }
+}
+
+bool BenchmarkMemoryPool()
+{
+    const int NIterations = 200;
+
+    MemoryPoolStats before;
+    MemoryPoolGetStats(&before);
+
+    double tsystem = BenchmarkSeconds([&]()
+    {
+        for (int i = 0; i < NIterations; i++)
+        {
+            float* buffers[4];
+            for (int b = 0; b < 4; b++)
+            {
+                buffers[b] = new float[LoopSizes[b] / sizeof(float)];
+                Touch(buffers[b], LoopSizes[b]);
+            }
+            for (int b = 3; b >= 0; b--)
+                delete[] buffers[b];
+        }
+    }, 3);
+
+    MemoryPoolResetStats();
+    MemoryPoolBeginScope();
+
+    double tpool = BenchmarkSeconds([&]()
+    {
+        for (int i = 0; i < NIterations; i++)
+        {
+            float* buffers[4];
+            for (int b = 0; b < 4; b++)
+            {
+                buffers[b] = MallocDevice((long)(LoopSizes[b] / sizeof(float)));
+                Touch(buffers[b], LoopSizes[b]);
+            }
+            for (int b = 3; b >= 0; b--)
+                FreeDevice(buffers[b]);
+        }
+    }, 3);
+
+    MemoryPoolStats scoped;
+    MemoryPoolGetStats(&scoped);
+    MemoryPoolEndScope();
+
+    MemoryPoolTrim();
+    MemoryPoolStats trimmed;
+    MemoryPoolGetStats(&trimmed);
+
+    double hitratio = (double)scoped.ncachehits / tmax(1LL, scoped.nallocations);
+
+    printf("%-8s %12s %12s %9s\n", "", "system", "pool", "speedup");
+    printf("%-8s %9.3f ms %9.3f ms %8.2fx\n", "per iter", tsystem * 1e3 / NIterations, tpool * 1e3 / NIterations, tsystem / tpool);
+    printf("allocations %lld, cache hits %.4f, system allocations %lld\n", scoped.nallocations, hitratio, scoped.nsystemallocations);
+    printf("peak in use %.1f MB, peak reserved %.1f MB, cached after trim %.1f MB\n",
+           scoped.peakinuse / 1048576.0, scoped.peakreserved / 1048576.0, trimmed.bytescached / 1048576.0);
+
+    // 4 system allocations in the warm-up run, everything after that comes from the cache
+    bool passed = scoped.nsystemallocations <= 4 &&
+                  scoped.bytesinuse == before.bytesinuse &&
+                  scoped.bytesreserved == scoped.bytesinuse + scoped.bytescached &&
+                  trimmed.bytesreserved == trimmed.bytesinuse + trimmed.bytescached;
+
+    return passed;
+}
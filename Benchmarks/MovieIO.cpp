@@ -0,0 +1,304 @@
+#include "Benchmarks.h"
+#include <map>
+using namespace gtom;
+
+/*
+
+Synthetic counting-mode movies are written to disk as 8 and 4 bit MRC, and as 8 bit LZW-compressed TIFF
+with several strips per frame. Every file is read back through MovieReader and must reproduce the source
+exactly. Then the time to decode the movie, the time to push it through a SpectrumAccumulator, and the time
+MovieIngest needs for both together are compared: with decoding overlapped, the pipeline should take close
+to max(decode, compute) rather than their sum.
+
+*/
+
+namespace
+{
+    // TIFF flavor of LZW, the way libtiff writes it
+    std::vector<unsigned char> EncodeLZW(const unsigned char* input, size_t length)
+    {
+        const int ClearCode = 256, EndCode = 257;
+
+        std::vector<unsigned char> output;
+        unsigned int buffer = 0;
+        int nbuffered = 0, width = 9, nextcode = 258;
+
+        auto put = [&](int code)
+        {
+            buffer = (buffer << width) | (unsigned int)code;
+            nbuffered += width;
+            while (nbuffered >= 8)
+            {
+                output.push_back((unsigned char)(buffer >> (nbuffered - 8)));
+                nbuffered -= 8;
+            }
+        };
+        auto grow = [&]()
+        {
+            nextcode++;
+            if (nextcode > (1 << width) - 1)
+                width++;
+        };
+
+        std::map<int, int> table;    // (prefix << 8 | byte) -> code
+        put(ClearCode);
+
+        int current = length > 0 ? input[0] : -1;
+        for (size_t i = 1; i < length; i++)
+        {
+            int key = (current << 8) | input[i];
+            auto found = table.find(key);
+            if (found != table.end())
+            {
+                current = found->second;
+                continue;
+            }
+
+            put(current);
+            table[key] = nextcode;
+            grow();
+            current = input[i];
+
+            if (nextcode == 4094)
+            {
+                put(ClearCode);
+                table.clear();
+                width = 9;
+                nextcode = 258;
+            }
+        }
+
+        if (current >= 0)
+        {
+            put(current);
+            grow();
+        }
+        put(EndCode);
+        if (nbuffered > 0)
+            output.push_back((unsigned char)(buffer << (8 - nbuffered)));
+
+        return output;
+    }
+
+    void WriteMRC(const char* path, const std::vector<unsigned char> &frames, int3 dims, int mode)
+    {
+        int32_t header[256] = { 0 };
+        header[0] = dims.x;
+        header[1] = dims.y;
+        header[2] = dims.z;
+        header[3] = mode;
+
+        FILE* file = fopen(path, "wb");
+        fwrite(header, sizeof(header), 1, file);
+
+        if (mode == 0)
+            fwrite(frames.data(), 1, frames.size(), file);
+        else
+        {
+            // Two pixels per byte, low nibble first, rows padded to whole bytes
+            size_t bytesperrow = (dims.x + 1) / 2;
+            std::vector<unsigned char> row(bytesperrow);
+            for (int y = 0; y < dims.y * dims.z; y++)
+            {
+                std::fill(row.begin(), row.end(), 0);
+                for (int x = 0; x < dims.x; x++)
+                    row[x / 2] |= frames[(size_t)y * dims.x + x] << (x % 2 * 4);
+                fwrite(row.data(), 1, bytesperrow, file);
+            }
+        }
+
+        fclose(file);
+    }
+
+    void WriteTIFF(const char* path, const std::vector<unsigned char> &frames, int3 dims, int rowsperstrip)
+    {
+        FILE* file = fopen(path, "wb");
+        auto put16 = [&](int v) { unsigned char b[2] = { (unsigned char)v, (unsigned char)(v >> 8) }; fwrite(b, 1, 2, file); };
+        auto put32 = [&](long long v) { unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) }; fwrite(b, 1, 4, file); };
+        auto entry = [&](int tag, int type, int count, long long value)
+        {
+            put16(tag);
+            put16(type);
+            put32(count);
+            if (type == 3 && count == 1)
+            {
+                put16((int)value);
+                put16(0);
+            }
+            else
+                put32(value);
+        };
+
+        fwrite("II", 1, 2, file);
+        put16(42);
+        put32(0);    // Patched below
+
+        int nstrips = (dims.y + rowsperstrip - 1) / rowsperstrip;
+        std::vector<long long> ifdoffsets;
+
+        for (int z = 0; z < dims.z; z++)
+        {
+            std::vector<long long> offsets, bytecounts;
+            for (int s = 0; s < nstrips; s++)
+            {
+                int rows = tmin(rowsperstrip, dims.y - s * rowsperstrip);
+                std::vector<unsigned char> compressed = EncodeLZW(frames.data() + ((size_t)z * dims.y + (size_t)s * rowsperstrip) * dims.x, (size_t)rows * dims.x);
+
+                offsets.push_back(ftell(file));
+                bytecounts.push_back(compressed.size());
+                fwrite(compressed.data(), 1, compressed.size(), file);
+            }
+
+            long long offsetsat = ftell(file);
+            for (long long o : offsets)
+                put32(o);
+            long long bytecountsat = ftell(file);
+            for (long long b : bytecounts)
+                put32(b);
+
+            if (ftell(file) % 2)
+                fputc(0, file);
+            ifdoffsets.push_back(ftell(file));
+
+            put16(10);
+            entry(256, 4, 1, dims.x);
+            entry(257, 4, 1, dims.y);
+            entry(258, 3, 1, 8);
+            entry(259, 3, 1, 5);
+            entry(262, 3, 1, 1);
+            entry(273, 4, nstrips, nstrips > 1 ? offsetsat : offsets[0]);
+            entry(277, 3, 1, 1);
+            entry(278, 4, 1, rowsperstrip);
+            entry(279, 4, nstrips, nstrips > 1 ? bytecountsat : bytecounts[0]);
+            entry(339, 3, 1, 1);
+            put32(0);    // Patched with the next directory's offset
+        }
+
+        // Chain the directories
+        fseek(file, 4, SEEK_SET);
+        put32(ifdoffsets[0]);
+        for (int z = 0; z < dims.z - 1; z++)
+        {
+            fseek(file, (long)(ifdoffsets[z] + 2 + 10 * 12), SEEK_SET);
+            put32(ifdoffsets[z + 1]);
+        }
+
+        fclose(file);
+    }
+
+    bool ReadsBackExactly(const char* path, const std::vector<unsigned char> &frames, int3 dims)
+    {
+        int3 dimsread;
+        void* reader = MovieReaderOpen((char*)path, 3, &dimsread);
+        if (!reader)
+            return false;
+
+        bool identical = dimsread.x == dims.x && dimsread.y == dims.y && dimsread.z == dims.z;
+
+        int z, nread = 0;
+        float* h_frame;
+        while (identical && (z = MovieReaderAcquire(reader, &h_frame)) >= 0)
+        {
+            for (size_t i = 0; i < Elements2(dims); i++)
+                identical = identical && h_frame[i] == (float)frames[Elements2(dims) * z + i];
+            MovieReaderRelease(reader);
+            nread++;
+        }
+        MovieReaderClose(reader);
+
+        return identical && nread == dims.z;
+    }
+}
+
+bool BenchmarkMovieIO()
+{
+    const int3 Dims = toInt3(1024, 1024, 24);
+    const int2 DimsRegion = toInt2(256, 256);
+    const int RingSize = 4;
+
+    // Sparse counts, as recorded by a counting detector
+    std::vector<unsigned char> frames(Elements(Dims));
+    {
+        std::mt19937 generator(789);
+        std::poisson_distribution<int> distribution(0.8);
+        for (size_t i = 0; i < frames.size(); i++)
+            frames[i] = (unsigned char)tmin(15, distribution(generator));
+    }
+
+    std::vector<int3> origins;
+    for (int y = 0; y + DimsRegion.y <= Dims.y; y += DimsRegion.y / 2)
+        for (int x = 0; x + DimsRegion.x <= Dims.x; x += DimsRegion.x / 2)
+            origins.push_back(toInt3(x, y, 0));
+
+    struct MovieFormat
+    {
+        const char* name;
+        const char* path;
+    };
+    const MovieFormat Formats[] = { { "mrc 8 bit", "movieio_8bit.mrc" }, { "mrc 4 bit", "movieio_4bit.mrc" }, { "tiff lzw", "movieio_lzw.tif" } };
+
+    WriteMRC(Formats[0].path, frames, Dims, 0);
+    WriteMRC(Formats[1].path, frames, Dims, 101);
+    WriteTIFF(Formats[2].path, frames, Dims, 128);
+
+    std::vector<float> stack(frames.begin(), frames.end());
+    size_t elementsspectrum = ElementsFFT2(DimsRegion);
+    std::vector<float> spectra(elementsspectrum), spectrummean(elementsspectrum);
+
+    auto accumulate = [&](std::function<void(void*)> add)
+    {
+        void* accumulator = CreateSpectrumAccumulator(DimsRegion, origins.data(), (int)origins.size(), Dims.z, toInt3(1, 1, 1), 256LL << 20);
+        add(accumulator);
+        SpectrumAccumulatorFinish(accumulator, spectra.data(), spectrummean.data(), STORAGE_FP32);
+        DestroySpectrumAccumulator(accumulator);
+    };
+
+    double tcompute = BenchmarkSeconds([&]() { accumulate([&](void* a) { SpectrumAccumulatorAdd(a, stack.data(), toInt2(Dims.x, Dims.y), Dims.z); }); }, 3);
+    std::vector<float> reference = spectrummean;
+
+    bool passed = true;
+
+    printf("%dx%dx%d movie, %d regions of %dx%d, compute alone %.1f ms\n", Dims.x, Dims.y, Dims.z, (int)origins.size(), DimsRegion.x, DimsRegion.y, tcompute * 1e3);
+    printf("%-10s %9s %11s %11s %11s %11s %9s\n", "format", "identical", "decode", "serial", "pipelined", "bound", "overlap");
+
+    for (const MovieFormat &format : Formats)
+    {
+        bool identical = ReadsBackExactly(format.path, frames, Dims);
+
+        double tdecode = BenchmarkSeconds([&]()
+        {
+            int3 dims;
+            void* reader = MovieReaderOpen((char*)format.path, RingSize, &dims);
+            float* h_frame;
+            while (MovieReaderAcquire(reader, &h_frame) >= 0)
+                MovieReaderRelease(reader);
+            MovieReaderClose(reader);
+        }, 3);
+
+        double tpipelined = BenchmarkSeconds([&]()
+        {
+            accumulate([&](void* a) { identical = MovieIngest((char*)format.path, RingSize, NULL, NULL, 0, 1, NULL, NULL, 0, toInt2(0, 0), NULL, 0, NULL, a) && identical; });
+        }, 3);
+
+        // Spectra from the ingested movie must match those computed from memory
+        float maxdiff = 0;
+        for (size_t i = 0; i < elementsspectrum; i++)
+            maxdiff = tmax(maxdiff, std::abs(spectrummean[i] - reference[i]));
+        identical = identical && maxdiff == 0;
+
+        passed = passed && identical;
+
+        double tserial = tdecode + tcompute;
+        double tbound = tmax(tdecode, tcompute);
+
+        // 1 = fully overlapped, 0 = no better than running decode and compute one after the other
+        double overlap = (tserial - tpipelined) / tmax(1e-9, tserial - tbound);
+
+        printf("%-10s %9s %8.1f ms %8.1f ms %8.1f ms %8.1f ms %8.2f\n", format.name, identical ? "yes" : "NO", tdecode * 1e3, tserial * 1e3, tpipelined * 1e3, tbound * 1e3, overlap);
+    }
+
+    for (const MovieFormat &format : Formats)
+        remove(format.path);
+
+    return passed;
+}
@@ -0,0 +1,619 @@
+#include "Benchmarks.h"
+#include <algorithm>
+using namespace gtom;
+
+/*
+
+Exported pipeline stages on synthetic data, at the sizes given on the command line:
+
+-createshift: Fourier components of a 3x3 grid of regions in a drifting movie. Frame shifts are recovered
+ from them by maximizing the cross-correlation with the first frame, and compared to the drift.
+-ctffit: CTFFitMean on a noisy astigmatic spectrum, starting 0.23 um off; compared to the true defocus.
+-ctfscore: CreateCTFGrid and CTFScoreCandidates on the ctffit spectrum for a batch of defocus and astigmatism
+ candidates, compared to evaluating every pixel of every candidate from scratch.
+-ctfgridfit: CTFCompareToSimGradients against central differences of CTFCompareToSim, and CTFFitGrid on
+ a 3x3 grid of spectra whose defocus varies linearly, starting 0.15 um off; compared to the true anchors.
+-projectforward: central slices through an off-center Gaussian blob at random angles, compared to the
+ blob's analytic Fourier transform.
+-initprojector: InitProjector on an off-center Gaussian blob, compared to the blob's analytic Fourier
+ transform on the oversampled grid by normalized complex correlation.
+-backprojector: InitProjector followed by BackprojectorReconstruct with unit weights must give back the
+ original volume, compared by normalized cross-correlation.
+
+*/
+
+namespace
+{
+    // Shift s maximizing Re sum_k w_k * exp(i * 2pi/N * (kx * s.x + ky * s.y)), where w lives on the lattice
+    // kx in [kxmin, kxmin + nkx), ky in [kymin, kymin + nky). Evaluated on successively finer grids, each
+    // separable: first all kx for every candidate s.x, then all ky for every (s.x, s.y).
+    float2 MaximizeCorrelation(const std::vector<float2> &w, int kxmin, int nkx, int kymin, int nky, int boxsize, float maxshift)
+    {
+        const int NSteps = 16;
+        float2 best = make_float2(0, 0);
+        float extent = maxshift, step = maxshift / NSteps;
+
+        std::vector<float2> rows((size_t)nky * (2 * NSteps + 1));
+
+        for (int level = 0; level < 4; level++)
+        {
+            float2 center = best;
+            float bestvalue = -1e30f;
+
+            for (int a = 0; a <= 2 * NSteps; a++)
+            {
+                double sx = center.x - extent + step * a;
+                for (int ky = 0; ky < nky; ky++)
+                {
+                    double sumre = 0, sumim = 0;
+                    for (int kx = 0; kx < nkx; kx++)
+                    {
+                        double angle = 2.0 * PI / boxsize * (kx + kxmin) * sx;
+                        float2 v = w[(size_t)ky * nkx + kx];
+                        sumre += v.x * cos(angle) - v.y * sin(angle);
+                        sumim += v.x * sin(angle) + v.y * cos(angle);
+                    }
+                    rows[(size_t)a * nky + ky] = make_float2((float)sumre, (float)sumim);
+                }
+            }
+
+            for (int a = 0; a <= 2 * NSteps; a++)
+                for (int b = 0; b <= 2 * NSteps; b++)
+                {
+                    double sy = center.y - extent + step * b;
+                    double sum = 0;
+                    for (int ky = 0; ky < nky; ky++)
+                    {
+                        double angle = 2.0 * PI / boxsize * (ky + kymin) * sy;
+                        float2 v = rows[(size_t)a * nky + ky];
+                        sum += v.x * cos(angle) - v.y * sin(angle);
+                    }
+
+                    if (sum > bestvalue)
+                    {
+                        bestvalue = (float)sum;
+                        best = make_float2((float)(center.x - extent + step * a), (float)sy);
+                    }
+                }
+
+            extent = step;
+            step = extent / NSteps;
+        }
+
+        return best;
+    }
+
+    // Same ZYZ convention as the projector: columns of the result are the rotated x, y, z axes in the volume
+    void RotationTransposed(float3 angles, float m[3][3])
+    {
+        float ca = cos(angles.x), sa = sin(angles.x);
+        float cb = cos(angles.y), sb = sin(angles.y);
+        float cg = cos(angles.z), sg = sin(angles.z);
+        float cc = cb * ca, cs = cb * sa, sc = sb * ca, ss = sb * sa;
+
+        float A[3][3] = { { cg * cc - sg * sa, cg * cs + sg * ca, -cg * sb },
+                          { -sg * cc - cg * sa, -sg * cs + cg * ca, sg * sb },
+                          { sc, ss, cb } };
+
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                m[i][j] = A[j][i];
+    }
+}
+
+bool BenchmarkCreateShift()
+{
+    const int GridSize = 3;
+    int2 dims = toInt2(Settings.framesize, Settings.framesize);
+    int nframes = Settings.nframes;
+    int regionsize = tmin(512, Settings.framesize / 4);
+    int2 dimsregion = toInt2(regionsize, regionsize);
+
+    // Linear drift with some wobble, in pixels
+    std::vector<float2> shifts(nframes);
+    float maxshift = 0;
+    for (int z = 0; z < nframes; z++)
+    {
+        shifts[z] = make_float2(0.7f * z + 0.3f * sin(0.9f * z), -0.45f * z + 0.2f * cos(1.3f * z) - 0.2f);
+        maxshift = tmax(maxshift, tmax(abs(shifts[z].x - shifts[0].x), abs(shifts[z].y - shifts[0].y)));
+    }
+
+    std::vector<float> movie = SyntheticMovie(dims, nframes, shifts.data(), 2.0f, 1234);
+
+    std::vector<int3> origins;
+    for (int y = 0; y < GridSize; y++)
+        for (int x = 0; x < GridSize; x++)
+            origins.push_back(toInt3((dims.x - regionsize) * x / (GridSize - 1), (dims.y - regionsize) * y / (GridSize - 1), 0));
+    int norigins = (int)origins.size();
+
+    // Ring mask in the remapped half-plane, like Movie.cs builds it; (xx, yy) is the frequency's mirror image
+    int minfreq = regionsize / 20, maxfreq = regionsize / 4;
+    std::vector<size_t> mask;
+    std::vector<int2> frequencies;
+    for (int y = 0; y < regionsize; y++)
+    {
+        int yy = y - regionsize / 2;
+        for (int x = 0; x < regionsize / 2 + 1; x++)
+        {
+            int xx = x - regionsize / 2;
+            int r2 = xx * xx + yy * yy;
+            if (r2 >= minfreq * minfreq && r2 < maxfreq * maxfreq)
+            {
+                mask.push_back((size_t)y * (regionsize / 2 + 1) + x);
+                frequencies.push_back(toInt2(xx, yy));
+            }
+        }
+    }
+    uint masklength = (uint)mask.size();
+
+    std::vector<float2> phases((size_t)masklength * norigins * nframes);
+
+    StageReport report = TimeStage("createshift", [&]()
+    {
+        CreateShift(movie.data(), dims, nframes, origins.data(), norigins, dimsregion, mask.data(), masklength, phases.data(), STORAGE_FP32);
+    });
+
+    // Cross-correlate every frame with the first one, summed over all regions
+    int kxmin = -regionsize / 2, nkx = regionsize / 2 + 1;
+    int kymin = -regionsize / 2, nky = regionsize;
+    float maxerror = 0;
+
+    for (int z = 1; z < nframes; z++)
+    {
+        std::vector<float2> w((size_t)nkx * nky, make_float2(0, 0));
+        for (int p = 0; p < norigins; p++)
+        {
+            float2* h_first = phases.data() + (size_t)masklength * p;
+            float2* h_frame = phases.data() + (size_t)masklength * (norigins * z + p);
+            for (uint i = 0; i < masklength; i++)
+                w[(size_t)(frequencies[i].y - kymin) * nkx + frequencies[i].x - kxmin] += cmul(cconj(h_first[i]), h_frame[i]);
+        }
+
+        // The phase factor that aligns frame z with the first one undoes the drift between them
+        float2 recovered = MaximizeCorrelation(w, kxmin, nkx, kymin, nky, regionsize, ceil(maxshift) + 4) * -1.0f;
+        float2 truth = shifts[z] - shifts[0];
+        maxerror = tmax(maxerror, sqrt(dotp2(recovered - truth, recovered - truth)));
+    }
+
+    report.size = SizeString(dims.x, dims.y, nframes);
+    report.work = nframes;
+    report.workunit = "frames";
+    report.errorname = "max shift error (px)";
+    report.error = maxerror;
+    report.tolerance = 0.05;
+    ReportStage(report);
+
+    return report.error <= report.tolerance;
+}
+
+bool BenchmarkCTFFit()
+{
+    const int SideLength = 512;
+
+    CTFParams truth;
+    memset(&truth, 0, sizeof(CTFParams));
+    truth.pixelsize = 1.35e-10f;
+    truth.Cs = 2.7e-3f;
+    truth.voltage = 300e3f;
+    truth.defocus = 1.83e-6f;
+    truth.defocusdelta = 0.12e-6f;
+    truth.astigmatismangle = 0.6f;
+    truth.amplitude = 0.07f;
+    truth.Bfactor = -60e-20f;
+    truth.scale = 1.0f;
+
+    std::vector<float> ps;
+    std::vector<float2> coords;
+    SyntheticCTFSpectrum(SideLength, truth, 1.0f, 4321, ps, coords);
+    int2 dimsps = toInt2((int)ps.size(), 1);
+
+    CTFParams start = truth;
+    start.defocus = truth.defocus + 0.23e-6f;
+    start.defocusdelta = 0;
+    start.astigmatismangle = 0;
+    start.Bfactor = 0;
+
+    CTFFitParams fp;
+    memset(&fp, 0, sizeof(CTFFitParams));
+    fp.defocus = make_float3(-0.5e-6f, 0.5e-6f, 0.025e-6f);
+    fp.defocusdelta = make_float3(0, 0.2e-6f, 0.1e-6f);
+    fp.astigmatismangle = make_float3(0, 0.75f * PI, 0.25f * PI);
+    fp.dimsperiodogram = toInt2(SideLength, SideLength);
+
+    CTFParams fitted;
+    StageReport report = TimeStage("ctffit", [&]()
+    {
+        fitted = CTFFitMean(ps.data(), coords.data(), dimsps, start, fp, true);
+    });
+
+    report.size = SizeString(SideLength, SideLength, 1);
+    report.work = 1;
+    report.workunit = "fits";
+    report.errorname = "defocus error (um)";
+    report.error = abs(fitted.defocus - truth.defocus) * 1e6;
+    report.tolerance = 0.02;
+    ReportStage(report);
+
+    return report.error <= report.tolerance;
+}
+
+bool BenchmarkCTFScore()
+{
+    const int SideLength = 512;
+    const int NCandidates = 512;
+
+    CTFParams truth;
+    memset(&truth, 0, sizeof(CTFParams));
+    truth.pixelsize = 1.35e-10f;
+    truth.pixeldelta = 0.01e-10f;
+    truth.pixelangle = 0.3f;
+    truth.Cs = 2.7e-3f;
+    truth.voltage = 300e3f;
+    truth.defocus = 1.83e-6f;
+    truth.defocusdelta = 0.12e-6f;
+    truth.astigmatismangle = 0.6f;
+    truth.amplitude = 0.07f;
+    truth.Bfactor = -60e-20f;
+    truth.scale = 1.0f;
+
+    std::vector<float> ps;
+    std::vector<float2> coords;
+    SyntheticCTFSpectrum(SideLength, truth, 1.0f, 4321, ps, coords);
+    uint length = (uint)ps.size();
+
+    // 32 defocus values x 16 astigmatism angles around the truth
+    std::vector<CTFParams> candidates(NCandidates, truth);
+    for (int c = 0; c < NCandidates; c++)
+    {
+        candidates[c].defocus = truth.defocus + (c % 32 - 16) * 0.02e-6f;
+        candidates[c].astigmatismangle = (c / 32) * PI / 16;
+    }
+
+    // Every pixel from scratch, like h_CTFCorrelate used to
+    std::vector<float> reference(NCandidates);
+    StageReport scalar = TimeStage("ctfscore scalar", [&]()
+    {
+        #pragma omp parallel for
+        for (int c = 0; c < NCandidates; c++)
+        {
+            CTFParamsLean p(candidates[c], toInt3(1, 1, 1));
+
+            double sum1 = 0, sum2 = 0, sumps = 0, sumps2 = 0, sumcross = 0;
+            for (uint i = 0; i < length; i++)
+            {
+                float sim = h_GetCTF(h_CTFFrequency(coords[i], p), coords[i].y, p, true);
+                sum1 += sim;
+                sum2 += (double)sim * sim;
+                sumps += ps[i];
+                sumps2 += (double)ps[i] * ps[i];
+                sumcross += (double)sim * ps[i];
+            }
+
+            double n = (double)length;
+            double covariance = sumcross / n - (sum1 / n) * (sumps / n);
+            double stdsim = sqrt(tmax(0.0, sum2 / n - (sum1 / n) * (sum1 / n)));
+            double stdps = sqrt(tmax(0.0, sumps2 / n - (sumps / n) * (sumps / n)));
+            reference[c] = (float)(covariance / (stdsim * stdps));
+        }
+    });
+
+    std::vector<float> scores(NCandidates);
+    void* grid = CreateCTFGrid(coords.data(), length);
+    StageReport batched = TimeStage("ctfscore batched", [&]()
+    {
+        CTFScoreCandidates(grid, ps.data(), candidates.data(), NCandidates, scores.data());
+    });
+    DestroyCTFGrid(grid);
+
+    double maxdiff = 0;
+    int bestreference = 0, bestbatched = 0;
+    for (int c = 0; c < NCandidates; c++)
+    {
+        maxdiff = tmax(maxdiff, (double)abs(scores[c] - reference[c]));
+        bestreference = reference[c] > reference[bestreference] ? c : bestreference;
+        bestbatched = scores[c] > scores[bestbatched] ? c : bestbatched;
+    }
+
+    for (StageReport* report : { &scalar, &batched })
+    {
+        report->size = SizeString(SideLength, SideLength, 1) + ", " + std::to_string(NCandidates) + " candidates";
+        report->work = (double)NCandidates;
+        report->workunit = "candidates";
+        report->errorname = "max score difference";
+    }
+
+    scalar.error = 0;
+    scalar.tolerance = 0;
+    ReportStage(scalar);
+
+    batched.error = bestbatched == bestreference ? maxdiff : 1.0;
+    batched.tolerance = 1e-4;
+    ReportStage(batched);
+
+    printf("batched evaluation: %.1fx the scalar speed\n", scalar.latencies[0] / batched.latencies[0]);
+
+    return batched.error <= batched.tolerance;
+}
+
+bool BenchmarkCTFGridFit()
+{
+    const int SideLength = 256;
+    const int NAnchors = 2, NSpectra = 9;     // Defocus is linear over a 3x3 grid of spectra, 2 anchors along x
+
+    CTFParams base;
+    memset(&base, 0, sizeof(CTFParams));
+    base.pixelsize = 1.35e-10f;
+    base.Cs = 2.7e-3f;
+    base.voltage = 300e3f;
+    base.amplitude = 0.07f;
+    base.scale = 1.0f;
+
+    // Values in CTFFitGrid's layout: defocus anchors (um), phase anchor (pi), defocus delta (um), angle (rad), B-factor
+    const float Truth[] = { 1.75f, 1.95f, 0.0f, 0.08f, 0.6f, 0.0f };
+    std::vector<float> weights((size_t)NAnchors * NSpectra), phaseweights(NSpectra, 1.0f);
+
+    std::vector<half> ps, scale;
+    std::vector<half2> coords;
+    uint length = 0;
+    for (int s = 0; s < NSpectra; s++)
+    {
+        float x = (s % 3) / 2.0f;
+        weights[s] = 1.0f - x;
+        weights[NSpectra + s] = x;
+
+        CTFParams truth = base;
+        truth.defocus = -(Truth[0] * (1.0f - x) + Truth[1] * x) * 1e-6f;
+        truth.defocusdelta = -Truth[3] * 1e-6f;
+        truth.astigmatismangle = Truth[4];
+
+        std::vector<float> spectrum;
+        std::vector<float2> spectrumcoords;
+        SyntheticCTFSpectrum(SideLength, truth, 1.0f, 100 + s, spectrum, spectrumcoords);
+        length = (uint)spectrum.size();
+
+        for (uint i = 0; i < length; i++)
+            ps.push_back(__float2half(spectrum[i]));
+        if (s == 0)
+            for (uint i = 0; i < length; i++)
+            {
+                coords.push_back(__float22half2_rn(spectrumcoords[i]));
+                scale.push_back(__float2half(1.0f));
+            }
+    }
+
+    // Analytic gradient of every spectrum's score against central differences, somewhat off the truth
+    std::vector<CTFParams> params(NSpectra, base);
+    for (int s = 0; s < NSpectra; s++)
+    {
+        params[s].defocus = -(1.7f + 0.05f * s) * 1e-6f;
+        params[s].defocusdelta = -0.05e-6f;
+        params[s].astigmatismangle = 0.4f;
+        params[s].phaseshift = 0.1f * PI;
+        params[s].Bfactor = -20e-20f;
+    }
+
+    std::vector<float> scores(NSpectra), gradients(NSpectra * CTF_GRADIENT_PARAMS);
+    StageReport gradient = TimeStage("ctfgridfit gradient", [&]()
+    {
+        CTFCompareToSimGradients(ps.data(), coords.data(), scale.data(), length, params.data(), scores.data(), gradients.data(), NSpectra);
+    });
+
+    float CTFParams::* Fields[CTF_GRADIENT_PARAMS] = { &CTFParams::defocus, &CTFParams::defocusdelta, &CTFParams::astigmatismangle, &CTFParams::phaseshift, &CTFParams::Bfactor };
+    const float Steps[CTF_GRADIENT_PARAMS] = { 1e-10f, 1e-10f, 1e-3f, 1e-3f, 1e-20f };
+
+    double maxgradienterror = 0;
+    for (int p = 0; p < CTF_GRADIENT_PARAMS; p++)
+    {
+        std::vector<CTFParams> plus = params, minus = params;
+        for (int s = 0; s < NSpectra; s++)
+        {
+            plus[s].*Fields[p] += Steps[p];
+            minus[s].*Fields[p] -= Steps[p];
+        }
+
+        std::vector<float> scoresplus(NSpectra), scoresminus(NSpectra);
+        CTFCompareToSim(ps.data(), coords.data(), scale.data(), length, plus.data(), scoresplus.data(), NSpectra);
+        CTFCompareToSim(ps.data(), coords.data(), scale.data(), length, minus.data(), scoresminus.data(), NSpectra);
+
+        double maxnumeric = 0, maxdiff = 0;
+        for (int s = 0; s < NSpectra; s++)
+        {
+            double numeric = (scoresplus[s] - scoresminus[s]) / (2.0 * Steps[p]);
+            maxnumeric = tmax(maxnumeric, abs(numeric));
+            maxdiff = tmax(maxdiff, abs(numeric - gradients[s * CTF_GRADIENT_PARAMS + p]));
+        }
+
+        maxgradienterror = tmax(maxgradienterror, maxdiff / tmax(1e-30, maxnumeric));
+    }
+
+    // Full fit from where Movie.cs starts it: every anchor at the mean defocus CTFFitMean's 0.025 um search found,
+    // without astigmatism
+    float meandefocus = round((Truth[0] + Truth[1]) * 0.5f / 0.025f) * 0.025f;
+    std::vector<float> values(6);
+    float score = 0;
+    int npasses = 0;
+    StageReport fit = TimeStage("ctfgridfit fit", [&]()
+    {
+        values = { meandefocus, meandefocus, 0.0f, 0.0f, 0.0f, 0.0f };
+        npasses = CTFFitGrid(ps.data(), coords.data(), scale.data(), length, NSpectra, base, weights.data(), NAnchors, phaseweights.data(), 1,
+                             false, true, false, 100, values.data(), &score);
+    });
+
+    double maxdefocuserror = tmax(abs(values[0] - Truth[0]), abs(values[1] - Truth[1]));
+
+    for (StageReport* report : { &gradient, &fit })
+    {
+        report->size = SizeString(SideLength, SideLength / 2 + 1, 1) + " x " + std::to_string(NSpectra);
+        report->work = NSpectra;
+        report->workunit = "spectra";
+    }
+
+    gradient.errorname = "relative gradient error";
+    gradient.error = maxgradienterror;
+    gradient.tolerance = 0.05;     // Central differences of float scores are good to about 1%
+    ReportStage(gradient);
+
+    fit.errorname = "defocus error (um)";
+    fit.error = maxdefocuserror;
+    fit.tolerance = 0.01;
+    ReportStage(fit);
+
+    // Central differences would need two more passes per fitted parameter for every gradient
+    printf("fit took %d passes, %d with finite-difference gradients\n", npasses, npasses * (1 + 2 * (NAnchors + 2)));
+
+    return gradient.error <= gradient.tolerance && fit.error <= fit.tolerance;
+}
+
+bool BenchmarkProjectForward()
+{
+    const int Oversampling = 2;
+    const float Sigma = 2.0f;
+    int size = Settings.volumesize;
+    int batch = Settings.batch;
+    float3 center = make_float3(3.0f, -2.0f, 1.5f);
+
+    int3 dimsprojector;
+    std::vector<float2> projector = SyntheticBlobProjector(size, Oversampling, center, Sigma, dimsprojector);
+
+    std::vector<float> anglevalues = RandomValues((size_t)batch * 3, 0.0f, 2.0f * PI, 99);
+    float3* angles = (float3*)anglevalues.data();
+
+    int2 dimsproj = toInt2(size, size);
+    std::vector<float2> projections(ElementsFFT2(dimsproj) * batch);
+
+    StageReport report = TimeStage("projectforward", [&]()
+    {
+        ProjectForward(projector.data(), projections.data(), dimsprojector, dimsproj, angles, (float)Oversampling, (uint)batch);
+    });
+
+    // Relative L2 deviation from the analytic slices, worst projection
+    float maxerror = 0;
+    int xhalf = size / 2 + 1, rmax2 = (size / 2) * (size / 2);
+    for (int b = 0; b < batch; b++)
+    {
+        float m[3][3];
+        RotationTransposed(angles[b], m);
+
+        double sumdiff = 0, sumtruth = 0;
+        for (int y = 0; y < size; y++)
+        {
+            int ky = y < (size + 1) / 2 ? y : y - size;
+            for (int x = 0; x < xhalf; x++)
+            {
+                if (x * x + ky * ky > rmax2)
+                    continue;
+
+                float3 k = make_float3(m[0][0] * x + m[0][1] * ky, m[1][0] * x + m[1][1] * ky, m[2][0] * x + m[2][1] * ky);
+                float2 expected = SyntheticBlobFT(size, center, Sigma, k);
+                float2 actual = projections[ElementsFFT2(dimsproj) * b + y * xhalf + x];
+
+                sumdiff += dotp2(actual - expected, actual - expected);
+                sumtruth += dotp2(expected, expected);
+            }
+        }
+
+        maxerror = tmax(maxerror, (float)sqrt(sumdiff / tmax(1e-30, sumtruth)));
+    }
+
+    report.size = SizeString(size, size, size) + " x " + std::to_string(batch);
+    report.work = batch;
+    report.workunit = "projections";
+    report.errorname = "max relative L2 error";
+    report.error = maxerror;
+    report.tolerance = 0.02;
+    ReportStage(report);
+
+    return report.error <= report.tolerance;
+}
+
+bool BenchmarkInitProjector()
+{
+    const int Oversampling = 2;
+    int size = Settings.volumesize;
+    int3 dims = toInt3(size, size, size);
+    float3 center = make_float3(size / 7.0f, -size / 9.0f, size / 11.0f);
+    float sigma = size / 12.0f;
+
+    std::vector<float> volume = SyntheticBlobVolume(size, center, sigma);
+
+    int3 dimsprojector;
+    std::vector<float2> expected = SyntheticBlobProjector(size, Oversampling, center, sigma, dimsprojector);
+    std::vector<float2> data(expected.size());
+
+    StageReport report = TimeStage("initprojector", [&]()
+    {
+        InitProjector(dims, Oversampling, volume.data(), (float*)data.data());
+    });
+
+    // The gridding pre-correction barely touches a blob this compact, so only the scale may differ
+    int n = dimsprojector.x, xhalf = n / 2 + 1, h = n / 2;
+    int rmax = Oversampling * (size / 2) - 1;
+    double sumproduct = 0, sumdata = 0, sumexpected = 0;
+    for (int z = 0; z < n; z++)
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < xhalf; x++)
+            {
+                int r2 = x * x + (y - h) * (y - h) + (z - h) * (z - h);
+                if (r2 > rmax * rmax)
+                    continue;
+
+                float2 a = data[((size_t)z * n + y) * xhalf + x], b = expected[((size_t)z * n + y) * xhalf + x];
+                sumproduct += dotp2(a, b);
+                sumdata += dotp2(a, a);
+                sumexpected += dotp2(b, b);
+            }
+
+    report.size = SizeString(size, size, size) + ", " + std::to_string(Oversampling) + "x oversampled";
+    report.work = (double)Elements(dims);
+    report.workunit = "voxels";
+    report.errorname = "1 - correlation";
+    report.error = 1.0 - sumproduct / tmax(1e-30, sqrt(sumdata * sumexpected));
+    report.tolerance = 0.01;
+    ReportStage(report);
+
+    return report.error <= report.tolerance;
+}
+
+bool BenchmarkBackprojector()
+{
+    const int Oversampling = 2;
+    int size = Settings.volumesize;
+    int3 dims = toInt3(size, size, size);
+
+    // A few blobs of different sizes, so a misplaced or mis-scaled reconstruction can't correlate well
+    std::vector<float> volume(Elements(dims), 0.0f);
+    const float3 Centers[] = { make_float3(0, 0, 0), make_float3(size / 5.0f, -size / 8.0f, size / 10.0f), make_float3(-size / 6.0f, size / 7.0f, -size / 9.0f) };
+    const float Sigmas[] = { size / 12.0f, size / 20.0f, size / 16.0f };
+    for (int i = 0; i < 3; i++)
+    {
+        std::vector<float> blob = SyntheticBlobVolume(size, Centers[i], Sigmas[i]);
+        for (size_t j = 0; j < volume.size(); j++)
+            volume[j] += blob[j];
+    }
+
+    int n = 2 * (Oversampling * (size / 2) + 1) + 1;
+    size_t elementsprojector = (size_t)(n / 2 + 1) * n * n;
+    std::vector<float2> data(elementsprojector);
+    std::vector<float> weights(elementsprojector, 1.0f);
+    InitProjector(dims, Oversampling, volume.data(), (float*)data.data());
+
+    std::vector<float> reconstruction(Elements(dims));
+    char symmetry[] = "C1";
+
+    StageReport report = TimeStage("backprojector", [&]()
+    {
+        BackprojectorReconstruct(dims, Oversampling, (float*)data.data(), weights.data(), symmetry, false, reconstruction.data());
+    });
+
+    double correlation = NormalizedCorrelation(volume, reconstruction);
+
+    report.size = SizeString(size, size, size);
+    report.work = (double)Elements(dims);
+    report.workunit = "voxels";
+    report.errorname = "1 - correlation";
+    report.error = 1.0 - correlation;
+    report.tolerance = 0.05;
+    ReportStage(report);
+
+    return report.error <= report.tolerance;
+}
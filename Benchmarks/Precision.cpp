@@ -0,0 +1,212 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+fp16 and bf16 storage against fp32. First the conversion kernels: the vectorized paths must give the same
+bits as the scalar conversions, including NaN, infinities, subnormals and overflow, and the round trip error
+must stay within half an ulp of the format. Then the frame alignment and spectra on a synthetic movie:
+CreateShift, ShiftGetAverage and ShiftGetDiffAndGrad, and CreateSpectra, are run with each storage precision
+and compared to fp32.
+
+*/
+
+namespace
+{
+    const int Precisions[] = { STORAGE_FP16, STORAGE_BF16 };
+    const char* PrecisionNames[] = { "fp32", "fp16", "bf16" };
+
+    // Half an ulp, relative, for normal values
+    const float RoundTripBound[] = { 0.0f, 1.0f / 2048, 1.0f / 256 };
+
+    unsigned short ScalarConversion(float value, int precision)
+    {
+        return precision == STORAGE_FP16 ? __float2half(value).x : __float2bfloat16(value).x;
+    }
+
+    float RelativeDeviation(const float* reference, const float* values, size_t n)
+    {
+        double sumdiff = 0, sumref = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            sumdiff += ((double)values[i] - reference[i]) * ((double)values[i] - reference[i]);
+            sumref += (double)reference[i] * reference[i];
+        }
+
+        return (float)sqrt(sumdiff / tmax(1e-30, sumref));
+    }
+
+    bool CheckConversions()
+    {
+        const size_t N = 1 << 22;
+
+        // Wide dynamic range, plus the values that need special handling
+        std::vector<float> values = RandomValues(N, -1.0f, 1.0f, 42);
+        std::vector<float> exponents = RandomValues(N, -30.0f, 30.0f, 43);
+        for (size_t i = 0; i < N; i++)
+            values[i] *= exp2f(exponents[i]);
+
+        const float Special[] = { 0.0f, -0.0f, 65504.0f, 65520.0f, -70000.0f, 6.1e-5f, 5.96e-8f, 2.98e-8f, 3e-8f, 1e-45f,
+                                  3.4e38f, INFINITY, -INFINITY, NAN, -NAN, 1.00048828125f, 1.001953125f, 1.0f + 1.0f / 512 };
+        for (size_t i = 0; i < sizeof(Special) / sizeof(float); i++)
+            values[i * 997] = Special[i];
+
+        std::vector<unsigned short> stored(N);
+        std::vector<float> restored(N);
+        bool passed = true;
+
+        printf("%-6s %12s %12s %14s %14s\n", "", "mismatches", "round trip", "to GB/s", "from GB/s");
+
+        for (int precision : Precisions)
+        {
+            double tto = BenchmarkSeconds([&]() { SingleToStorage(values.data(), stored.data(), (long)N, precision); }, 3);
+            double tfrom = BenchmarkSeconds([&]() { StorageToSingle(stored.data(), restored.data(), (long)N, precision); }, 3);
+
+            size_t mismatches = 0;
+            float maxerror = 0;
+            for (size_t i = 0; i < N; i++)
+            {
+                unsigned short scalar = ScalarConversion(values[i], precision);
+                bool bothnan = values[i] != values[i] && restored[i] != restored[i];
+                mismatches += stored[i] != scalar && !bothnan;
+
+                // Round trip error on values that are normal in the storage format
+                float magnitude = std::abs(values[i]);
+                bool normal = precision == STORAGE_FP16 ? magnitude >= 6.2e-5f && magnitude <= 65504.0f : magnitude >= 1.2e-38f && magnitude <= 3.3e38f;
+                if (normal)
+                    maxerror = tmax(maxerror, std::abs(restored[i] - values[i]) / magnitude);
+            }
+
+            passed = passed && mismatches == 0 && maxerror <= RoundTripBound[precision];
+
+            double bytes = (double)N * (sizeof(float) + sizeof(unsigned short));
+            printf("%-6s %12zu %12.2e %14.2f %14.2f\n", PrecisionNames[precision], mismatches, maxerror, bytes / tto * 1e-9, bytes / tfrom * 1e-9);
+        }
+
+        return passed;
+    }
+}
+
+bool BenchmarkPrecision()
+{
+    bool passed = CheckConversions();
+
+    const int GridSize = 3;
+    int2 dims = toInt2(Settings.framesize, Settings.framesize);
+    int nframes = Settings.nframes;
+    int regionsize = tmin(256, Settings.framesize / 4);
+    int2 dimsregion = toInt2(regionsize, regionsize);
+
+    std::vector<float2> shifts(nframes);
+    for (int z = 0; z < nframes; z++)
+        shifts[z] = make_float2(0.6f * z + 0.3f * sin(0.7f * z), -0.4f * z + 0.2f * cos(1.1f * z));
+    std::vector<float> movie = SyntheticMovie(dims, nframes, shifts.data(), 2.0f, 4321);
+
+    std::vector<int3> origins;
+    for (int y = 0; y < GridSize; y++)
+        for (int x = 0; x < GridSize; x++)
+            origins.push_back(toInt3((dims.x - regionsize) * x / (GridSize - 1), (dims.y - regionsize) * y / (GridSize - 1), 0));
+    uint npositions = (uint)origins.size();
+
+    // Ring of components between 1/20 and 1/4 of the region, in the remapped half-plane, with shift factors
+    std::vector<size_t> mask;
+    std::vector<float2> factors;
+    for (int y = 0; y < regionsize; y++)
+        for (int x = 0; x < regionsize / 2 + 1; x++)
+        {
+            int xx = x - regionsize / 2, yy = y - regionsize / 2;
+            int r2 = xx * xx + yy * yy;
+            if (r2 < (regionsize / 20) * (regionsize / 20) || r2 >= (regionsize / 4) * (regionsize / 4))
+                continue;
+
+            mask.push_back((size_t)y * (regionsize / 2 + 1) + x);
+            factors.push_back(make_float2((float)xx / regionsize * 2.0f * PI, (float)yy / regionsize * 2.0f * PI));
+        }
+    uint masklength = (uint)mask.size();
+    size_t nphase = (size_t)masklength * npositions * nframes * 2;
+
+    // Per-spectrum shifts near, but not at, the truth, so the objective and its gradient aren't trivial
+    std::vector<float2> alignment((size_t)npositions * nframes);
+    for (int z = 0; z < nframes; z++)
+        for (uint p = 0; p < npositions; p++)
+            alignment[(size_t)z * npositions + p] = (shifts[z] - shifts[0]) * -1.0f + make_float2(0.1f * sin(1.7f * (z + p)), 0.1f * cos(2.3f * (z + p)));
+
+    float maxfactor = 0;
+    for (float2 f : factors)
+        maxfactor = tmax(maxfactor, tmax(std::abs(f.x), std::abs(f.y)));
+
+    // 1D temporal spectra, one per frame
+    int3 ctfgrid = toInt3(1, 1, nframes);
+    size_t nspectrum = ElementsFFT2(dimsregion) * nframes;
+
+    std::vector<float> phasesrestored[3], diff[3], grad[3], spectra[3];
+    std::vector<unsigned char> phases(nphase * sizeof(float));
+    std::vector<unsigned char> spectrastorage(nspectrum * sizeof(float)), meanstorage(ElementsFFT2(dimsregion) * sizeof(float));
+    std::vector<float2> average((size_t)npositions * masklength);
+
+    printf("%u positions x %d frames, %u components\n", npositions, nframes, masklength);
+
+    for (int precision = STORAGE_FP32; precision <= STORAGE_BF16; precision++)
+    {
+        std::string name = PrecisionNames[precision];
+        phasesrestored[precision].resize(nphase);
+        diff[precision].resize((size_t)npositions * nframes);
+        grad[precision].resize((size_t)npositions * nframes * 2);
+        spectra[precision].resize(nspectrum);
+
+        StageReport createshift = TimeStage(("createshift " + name).c_str(), [&]()
+        {
+            CreateShift(movie.data(), dims, nframes, origins.data(), npositions, dimsregion, mask.data(), masklength, phases.data(), precision);
+        });
+        StorageToSingle(phases.data(), phasesrestored[precision].data(), (long)nphase, precision);
+
+        StageReport diffgrad = TimeStage(("shiftdiffgrad " + name).c_str(), [&]()
+        {
+            ShiftGetAverage(phases.data(), average.data(), factors.data(), masklength, masklength, alignment.data(), npositions, nframes, precision);
+            ShiftGetDiffAndGrad(phases.data(), average.data(), factors.data(), masklength, masklength, alignment.data(),
+                                diff[precision].data(), (float2*)grad[precision].data(), npositions, nframes, precision);
+        });
+
+        StageReport createspectra = TimeStage(("createspectra " + name).c_str(), [&]()
+        {
+            CreateSpectra(movie.data(), dims, nframes, origins.data(), npositions, dimsregion, ctfgrid, spectrastorage.data(), meanstorage.data(), precision);
+        });
+        StorageToSingle(spectrastorage.data(), spectra[precision].data(), (long)nspectrum, precision);
+
+        // Deviation from fp32; the gradient only counts signs, so it's measured against its bound, max |factor|
+        float graddev = 0;
+        for (size_t i = 0; i < grad[precision].size(); i++)
+            graddev = tmax(graddev, std::abs(grad[precision][i] - grad[STORAGE_FP32][i]) / maxfactor);
+
+        std::string sizestring = SizeString(dims.x, dims.y, nframes) + ", " + std::to_string(npositions) + " regions";
+        for (StageReport* report : { &createshift, &diffgrad, &createspectra })
+        {
+            report->size = sizestring;
+            report->work = nframes;
+            report->workunit = "frames";
+        }
+
+        createshift.errorname = "phase deviation";
+        createshift.error = RelativeDeviation(phasesrestored[STORAGE_FP32].data(), phasesrestored[precision].data(), nphase);
+        createshift.tolerance = RoundTripBound[precision];
+        ReportStage(createshift);
+
+        diffgrad.errorname = "objective deviation";
+        diffgrad.error = RelativeDeviation(diff[STORAGE_FP32].data(), diff[precision].data(), diff[precision].size());
+        diffgrad.tolerance = RoundTripBound[precision];
+        ReportStage(diffgrad);
+
+        createspectra.errorname = "spectra deviation";
+        createspectra.error = RelativeDeviation(spectra[STORAGE_FP32].data(), spectra[precision].data(), nspectrum);
+        createspectra.tolerance = RoundTripBound[precision];
+        ReportStage(createspectra);
+
+        printf("%s: phases %.1f MB, spectra %.1f MB, gradient deviation %.2e of its bound\n", name.c_str(),
+               nphase * StorageBytes(precision) / 1048576.0, nspectrum * StorageBytes(precision) / 1048576.0, graddev);
+
+        passed = passed && createshift.error <= createshift.tolerance && diffgrad.error <= diffgrad.tolerance &&
+                 createspectra.error <= createspectra.tolerance && graddev <= 0.01f;
+    }
+
+    return passed;
+}
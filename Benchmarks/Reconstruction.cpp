@@ -0,0 +1,118 @@
+#include "Benchmarks.h"
+#include <algorithm>
+using namespace gtom;
+
+/*
+
+BackprojectorReconstruct on the analytic transform of two Gaussian blobs, with unit weights and C2
+symmetry: the result must be the blobs plus their copies rotated by 180 degrees around z. Runs with 1, 2,
+4, ... threads up to all processors to show the scaling, then once more with a memory budget of an eighth
+of the padded grid, which moves the grid to a scratch file and must not change the result.
+
+*/
+
+bool BenchmarkReconstruction()
+{
+    const int Oversampling = 2;
+    int size = Settings.volumesize;
+    int3 dims = toInt3(size, size, size);
+
+    const float3 Centers[] = { make_float3(size / 6.0f, -size / 9.0f, size / 12.0f), make_float3(-size / 10.0f, size / 5.0f, -size / 7.0f) };
+    const float Sigmas[] = { size / 14.0f, size / 18.0f };
+
+    int3 dimsprojector;
+    std::vector<float2> data;
+    std::vector<float> expected(Elements(dims), 0.0f);
+    for (int i = 0; i < 2; i++)
+    {
+        std::vector<float2> blobft = SyntheticBlobProjector(size, Oversampling, Centers[i], Sigmas[i], dimsprojector);
+        if (data.empty())
+            data = blobft;
+        else
+            for (size_t j = 0; j < data.size(); j++)
+                data[j] += blobft[j];
+
+        float3 rotated = make_float3(-Centers[i].x, -Centers[i].y, Centers[i].z);
+        std::vector<float> blob = SyntheticBlobVolume(size, Centers[i], Sigmas[i]);
+        std::vector<float> blobrotated = SyntheticBlobVolume(size, rotated, Sigmas[i]);
+        for (size_t j = 0; j < expected.size(); j++)
+            expected[j] += blob[j] + blobrotated[j];
+    }
+    std::vector<float> weights(data.size(), 1.0f);
+
+    char symmetry[] = "C2";
+    std::vector<float> reconstruction(Elements(dims)), reference;
+
+    // Complex value, weight and density compensation per voxel of the padded grid
+    size_t gridbytes = (size_t)(dimsprojector.x / 2 + 1) * dimsprojector.y * dimsprojector.z * (sizeof(float2) + 2 * sizeof(float));
+
+    std::vector<int> threadcounts;
+    for (int t = 1; t < omp_get_max_threads(); t *= 2)
+        threadcounts.push_back(t);
+    threadcounts.push_back(omp_get_max_threads());
+
+    bool passed = true;
+    double singlethreaded = 0;
+
+    for (int run = 0; run <= (int)threadcounts.size(); run++)
+    {
+        bool outofcore = run == (int)threadcounts.size();
+        int nthreads = outofcore ? threadcounts.back() : threadcounts[run];
+        long long budget = outofcore ? (long long)(gridbytes / 8) : 0;
+
+        SetReconstructionOptions(nthreads, budget, (char*)".");
+
+        StageReport report = TimeStage("reconstruction", [&]()
+        {
+            BackprojectorReconstruct(dims, Oversampling, (float*)data.data(), weights.data(), symmetry, false, reconstruction.data());
+        });
+
+        char details[64];
+        sprintf(details, ", %d threads%s", nthreads, outofcore ? ", out-of-core" : "");
+        report.size = SizeString(size, size, size) + details;
+        report.work = (double)Elements(dims);
+        report.workunit = "voxels";
+
+        if (!outofcore)
+        {
+            report.errorname = "1 - correlation";
+            report.error = 1.0 - NormalizedCorrelation(expected, reconstruction);
+            report.tolerance = 0.05;
+
+            if (reference.empty())
+                reference = reconstruction;
+        }
+        else
+        {
+            // Same passes in the same order, only the storage differs
+            double maxdiff = 0, maxval = 0;
+            for (size_t i = 0; i < reference.size(); i++)
+            {
+                maxdiff = tmax(maxdiff, (double)abs(reference[i] - reconstruction[i]));
+                maxval = tmax(maxval, (double)abs(reference[i]));
+            }
+
+            report.errorname = "max relative difference to in-memory";
+            report.error = maxval > 0 ? maxdiff / maxval : 1.0;
+            report.tolerance = 1e-5;
+        }
+
+        ReportStage(report);
+
+        std::vector<double> latencies = report.latencies;
+        std::sort(latencies.begin(), latencies.end());
+        double median = latencies[latencies.size() / 2];
+        if (run == 0)
+            singlethreaded = median;
+        printf("%d threads%s: %.2fx the single-threaded speed, peak scratch %.1f MB of %.1f MB padded grid\n",
+               nthreads, outofcore ? " out-of-core" : "", singlethreaded / median, report.peakscratch / 1048576.0, gridbytes / 1048576.0);
+
+        passed = passed && report.error <= report.tolerance;
+        if (outofcore)
+            passed = passed && report.peakscratch < (long long)gridbytes / 4;
+    }
+
+    SetReconstructionOptions(0, 0, NULL);
+
+    return passed;
+}
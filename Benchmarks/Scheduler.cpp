@@ -0,0 +1,80 @@
+#include "Benchmarks.h"
+#include <thread>
+using namespace gtom;
+
+/*
+
+Batch of uneven movie-sized tasks with three stages each, all queued on the first of two devices, as a
+naive partition would do. Stages sleep instead of computing, so the numbers show only what the scheduler
+itself contributes. With work stealing, the makespan must approach half of the summed stage times; one task
+fails in its second stage, which must skip its third and be counted as failed.
+
+*/
+
+namespace
+{
+    const int NTasks = 24;
+    const int NStages = 3;
+    const int FailingTask = 5;
+
+    int StageMilliseconds(int task, int stage)
+    {
+        return 2 + (task * 7 + stage * 3) % 9;
+    }
+
+    int __stdcall SleepStage(int task, int stage, int device)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(StageMilliseconds(task, stage)));
+        return task == FailingTask && stage == 1 ? 1 : 0;
+    }
+}
+
+bool BenchmarkScheduler()
+{
+    const int NDevices = 2;
+
+    double serial = 0;
+    for (int t = 0; t < NTasks; t++)
+        for (int s = 0; s < (t == FailingTask ? 2 : NStages); s++)
+            serial += StageMilliseconds(t, s) * 1e-3;
+
+    void* scheduler = CreateScheduler(NDevices, 1, NStages, SleepStage);
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < NTasks; t++)
+        SchedulerSubmit(scheduler, t, 0);
+    SchedulerWait(scheduler, -1);
+    double makespan = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+    SchedulerProgress progress;
+    SchedulerGetProgress(scheduler, &progress);
+
+    double stageseconds[NStages], busyseconds[NDevices];
+    int stagecounts[NStages], devicetasks[NDevices];
+    SchedulerGetStageTimings(scheduler, stageseconds, stagecounts);
+    SchedulerGetDeviceTimings(scheduler, busyseconds, devicetasks);
+
+    float failedtimings[NStages];
+    bool failedfinished = SchedulerGetTaskTimings(scheduler, FailingTask, failedtimings);
+
+    DestroyScheduler(scheduler);
+
+    printf("%d tasks x %d stages on %d devices, all queued on device 0\n", NTasks, NStages, NDevices);
+    printf("serial %.1f ms, makespan %.1f ms, %.2fx\n", serial * 1e3, makespan * 1e3, serial / makespan);
+    printf("completed %d, failed %d, stolen %d\n", progress.ncompleted, progress.nfailed, progress.nstolen);
+    for (int s = 0; s < NStages; s++)
+        printf("stage %d: %d runs, %.1f ms\n", s, stagecounts[s], stageseconds[s] * 1e3);
+    for (int d = 0; d < NDevices; d++)
+        printf("device %d: %d tasks, %.1f ms busy\n", d, devicetasks[d], busyseconds[d] * 1e3);
+
+    // Sleeps overshoot, so compare against the time the stages actually took
+    double busy = busyseconds[0] + busyseconds[1];
+    bool passed = progress.ncompleted == NTasks - 1 &&
+                  progress.nfailed == 1 &&
+                  progress.nstolen > 0 &&
+                  stagecounts[0] == NTasks && stagecounts[1] == NTasks && stagecounts[2] == NTasks - 1 &&
+                  failedfinished && failedtimings[2] == 0 &&
+                  makespan < busy * 0.6;
+
+    return passed;
+}
@@ -0,0 +1,105 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+Average of the shifted frames for a long movie, as with EER fractions, where each step of the optimization only
+moves a few frames' shifts. ShiftGetAverageIncremental updates the running sums for the changed frames; after
+every step its average must match a full ShiftGetAverage with the same shifts. At the end the phase buffer gets
+new data as if it had been freed and handed out again, which must not be mistaken for the old phases.
+
+*/
+
+namespace
+{
+    const int Size = 128;
+    const uint NPositions = 9, NFrames = 1000;
+    const int NSteps = 20, NChangedPerStep = 8;
+}
+
+bool BenchmarkShiftAverage()
+{
+    std::vector<float2> factors;
+    for (int y = 0; y < Size; y++)
+        for (int x = 0; x < Size / 2 + 1; x++)
+        {
+            int yy = y < Size / 2 + 1 ? y : y - Size;
+            float r = sqrt((float)(x * x + yy * yy)) / Size;
+            if (r >= 0.025f && r < 0.25f)
+                factors.push_back(make_float2((float)x / Size * 2.0f * PI, (float)yy / Size * 2.0f * PI));
+        }
+
+    uint length = (uint)factors.size();
+    uint nspectra = NPositions * NFrames;
+
+    std::vector<float> phasevalues = RandomValues((size_t)nspectra * length * 2, -1.0f, 1.0f, 321);
+    std::vector<float> shiftvalues = RandomValues((size_t)nspectra * 2, -2.0f, 2.0f, 654);
+    std::vector<float> perturbations = RandomValues((size_t)NSteps * NChangedPerStep * 2, -0.1f, 0.1f, 987);
+    float2* phases = (float2*)phasevalues.data();
+    float2* shifts = (float2*)shiftvalues.data();
+
+    std::vector<float2> reference((size_t)NPositions * length), incremental((size_t)NPositions * length);
+
+    void* average = CreateShiftAverage(length, NPositions, NFrames);
+    ShiftGetAverageIncremental(average, phases, incremental.data(), factors.data(), length, length, shifts, NPositions, NFrames, STORAGE_FP32);
+
+    double tfull = 0, tincremental = 0;
+    float maxdev = 0;
+    std::mt19937 generator(42);
+
+    for (int step = 0; step < NSteps; step++)
+    {
+        // A few frames move, in all positions
+        for (int c = 0; c < NChangedPerStep; c++)
+        {
+            uint frame = generator() % NFrames;
+            for (uint p = 0; p < NPositions; p++)
+            {
+                shifts[NPositions * frame + p].x += perturbations[(step * NChangedPerStep + c) * 2];
+                shifts[NPositions * frame + p].y += perturbations[(step * NChangedPerStep + c) * 2 + 1];
+            }
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        ShiftGetAverageIncremental(average, phases, incremental.data(), factors.data(), length, length, shifts, NPositions, NFrames, STORAGE_FP32);
+        auto middle = std::chrono::high_resolution_clock::now();
+        ShiftGetAverage(phases, reference.data(), factors.data(), length, length, shifts, NPositions, NFrames, STORAGE_FP32);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        tincremental += std::chrono::duration<double>(middle - start).count();
+        tfull += std::chrono::duration<double>(end - middle).count();
+
+        float maxabs = 0, maxdiff = 0;
+        for (size_t i = 0; i < reference.size(); i++)
+        {
+            maxabs = tmax(maxabs, tmax(std::abs(reference[i].x), std::abs(reference[i].y)));
+            maxdiff = tmax(maxdiff, tmax(std::abs(reference[i].x - incremental[i].x), std::abs(reference[i].y - incremental[i].y)));
+        }
+        maxdev = tmax(maxdev, maxdiff / tmax(1e-20f, maxabs));
+    }
+
+    // Same address, different data: what the pool does after a free
+    for (size_t i = 0; i < phasevalues.size(); i++)
+        phasevalues[i] = -phasevalues[i] * 0.5f;
+    ForgetShiftAverages(phases);
+
+    ShiftGetAverageIncremental(average, phases, incremental.data(), factors.data(), length, length, shifts, NPositions, NFrames, STORAGE_FP32);
+    ShiftGetAverage(phases, reference.data(), factors.data(), length, length, shifts, NPositions, NFrames, STORAGE_FP32);
+
+    float reusedev = 0;
+    for (size_t i = 0; i < reference.size(); i++)
+        reusedev = tmax(reusedev, tmax(std::abs(reference[i].x - incremental[i].x), std::abs(reference[i].y - incremental[i].y)));
+
+    long long nupdated, nrecomputed;
+    ShiftAverageGetStats(average, &nupdated, &nrecomputed);
+    DestroyShiftAverage(average);
+
+    printf("%u positions x %u frames, %u components, %d steps moving up to %d frames\n", NPositions, NFrames, length, NSteps, NChangedPerStep);
+    printf("%-12s %12s %12s %9s %12s %12s\n", "", "full", "incremental", "speedup", "updated", "max dev");
+    printf("%-12s %9.2f ms %9.2f ms %8.2fx %12lld %12.2e\n", "per step",
+           tfull / NSteps * 1e3, tincremental / NSteps * 1e3, tfull / tincremental, nupdated, maxdev);
+    printf("%-12s %12lld passes %24s %12.2e\n", "reused", nrecomputed, "", reusedev);
+
+    // Only the initial pass and the one after the phases were replaced go over all frames
+    return maxdev < 1e-5f && reusedev == 0 && nrecomputed == 2 && nupdated <= (long long)NSteps * NChangedPerStep * NPositions;
+}
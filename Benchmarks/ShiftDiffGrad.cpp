@@ -0,0 +1,132 @@
+#include "Benchmarks.h"
+#include <algorithm>
+using namespace gtom;
+
+/*
+
+Objective and gradient of the frame alignment, once as two separate passes (ShiftGetDiff + ShiftGetGrad,
+ParticleShiftGetDiff + ParticleShiftGetGrad) and once through the fused single-pass functions. Shift factors
+are built the way Movie.cs builds them: a ring of Fourier components sorted by radius. The fused results must
+agree with the two-pass ones; throughput is reported as phase data streamed per second.
+
+*/
+
+namespace
+{
+    std::vector<float2> RingShiftFactors(int size, float minfreq, float maxfreq)
+    {
+        std::vector<std::pair<float, float2>> components;
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size / 2 + 1; x++)
+            {
+                int xx = x, yy = y < size / 2 + 1 ? y : y - size;
+                float r = sqrt((float)(xx * xx + yy * yy)) / size;
+                if (r < minfreq || r >= maxfreq)
+                    continue;
+
+                components.push_back(std::make_pair(r, make_float2((float)xx / size * 2.0f * PI, (float)yy / size * 2.0f * PI)));
+            }
+
+        std::stable_sort(components.begin(), components.end(), [](const std::pair<float, float2> &a, const std::pair<float, float2> &b) { return a.first < b.first; });
+
+        std::vector<float2> factors;
+        for (auto &c : components)
+            factors.push_back(c.second);
+
+        return factors;
+    }
+
+    // Relative to the largest reference value, or to an explicit scale if given
+    float MaxRelativeDeviation(const float* a, const float* b, size_t n, float scale = 0)
+    {
+        float maxabs = 0, maxdiff = 0;
+        for (size_t i = 0; i < n; i++)
+        {
+            maxabs = tmax(maxabs, std::abs(a[i]));
+            maxdiff = tmax(maxdiff, std::abs(a[i] - b[i]));
+        }
+
+        return maxdiff / tmax(1e-20f, scale > 0 ? scale : maxabs);
+    }
+}
+
+bool BenchmarkShiftDiffGrad()
+{
+    const int Size = 256;
+    const uint NPositions = 25, NFrames = 40;
+
+    std::vector<float2> factors = RingShiftFactors(Size, 0.025f, 0.25f);
+    uint probelength = (uint)factors.size();
+    uint length = probelength;
+    uint nspectra = NPositions * NFrames;
+
+    std::vector<float> phasevalues = RandomValues((size_t)nspectra * length * 2, -1.0f, 1.0f, 123);
+    std::vector<float> shiftvalues = RandomValues((size_t)nspectra * 2, -2.0f, 2.0f, 456);
+    std::vector<float> invsigma = RandomValues(probelength, 0.5f, 2.0f, 789);
+    float2* phases = (float2*)phasevalues.data();
+    float2* shifts = (float2*)shiftvalues.data();
+
+    std::vector<float2> average((size_t)NPositions * probelength);
+    ShiftGetAverage(phases, average.data(), factors.data(), length, probelength, shifts, NPositions, NFrames, STORAGE_FP32);
+
+    // Particle functions read one reference per position, at a stride of length
+    std::vector<float2> projections((size_t)NPositions * length);
+    for (size_t i = 0; i < projections.size(); i++)
+        projections[i] = average[i];
+
+    std::vector<float> diff(nspectra), difffused(nspectra);
+    std::vector<float2> grad(nspectra), gradfused(nspectra);
+
+    double bytes = (double)nspectra * probelength * sizeof(float2);
+    bool passed = true;
+
+    printf("%u positions x %u frames, %u components\n", NPositions, NFrames, probelength);
+    printf("%-10s %12s %12s %9s %10s %10s %12s %12s\n", "", "two-pass", "fused", "speedup", "GB/s", "GB/s", "diff dev", "grad dev");
+
+    {
+        double tseparate = BenchmarkSeconds([&]()
+        {
+            ShiftGetDiff(phases, average.data(), factors.data(), length, probelength, shifts, diff.data(), NPositions, NFrames, STORAGE_FP32);
+            ShiftGetGrad(phases, average.data(), factors.data(), length, probelength, shifts, grad.data(), NPositions, NFrames, STORAGE_FP32);
+        }, 3);
+        double tfused = BenchmarkSeconds([&]()
+        {
+            ShiftGetDiffAndGrad(phases, average.data(), factors.data(), length, probelength, shifts, difffused.data(), gradfused.data(), NPositions, NFrames, STORAGE_FP32);
+        }, 3);
+
+        // The gradient only counts signs, so components with value and average almost parallel can flip
+        // with the last bits of the phase ramp; measure against its bound, max |factor|, instead
+        float maxfactor = 0;
+        for (float2 f : factors)
+            maxfactor = tmax(maxfactor, tmax(std::abs(f.x), std::abs(f.y)));
+
+        float diffdev = MaxRelativeDeviation(diff.data(), difffused.data(), nspectra);
+        float graddev = MaxRelativeDeviation((float*)grad.data(), (float*)gradfused.data(), nspectra * 2, maxfactor);
+        passed = passed && diffdev < 1e-3f && graddev < 1e-3f;
+
+        printf("%-10s %9.2f ms %9.2f ms %8.2fx %10.2f %10.2f %12.2e %12.2e\n", "shift",
+               tseparate * 1e3, tfused * 1e3, tseparate / tfused, 2 * bytes / tseparate * 1e-9, bytes / tfused * 1e-9, diffdev, graddev);
+    }
+
+    {
+        double tseparate = BenchmarkSeconds([&]()
+        {
+            ParticleShiftGetDiff(phases, projections.data(), factors.data(), invsigma.data(), length, probelength, shifts, diff.data(), NPositions, NFrames, STORAGE_FP32);
+            ParticleShiftGetGrad(phases, projections.data(), factors.data(), invsigma.data(), length, probelength, shifts, grad.data(), NPositions, NFrames, STORAGE_FP32);
+        }, 3);
+        double tfused = BenchmarkSeconds([&]()
+        {
+            ParticleShiftGetDiffAndGrad(phases, projections.data(), factors.data(), invsigma.data(), length, probelength, shifts, difffused.data(), gradfused.data(), NPositions, NFrames, STORAGE_FP32);
+        }, 3);
+
+        // The two-pass gradient is a central difference, the fused one is analytic
+        float diffdev = MaxRelativeDeviation(diff.data(), difffused.data(), nspectra);
+        float graddev = MaxRelativeDeviation((float*)grad.data(), (float*)gradfused.data(), nspectra * 2);
+        passed = passed && diffdev < 1e-3f && graddev < 1e-2f;
+
+        printf("%-10s %9.2f ms %9.2f ms %8.2fx %10.2f %10.2f %12.2e %12.2e\n", "particle",
+               tseparate * 1e3, tfused * 1e3, tseparate / tfused, 2 * bytes / tseparate * 1e-9, bytes / tfused * 1e-9, diffdev, graddev);
+    }
+
+    return passed;
+}
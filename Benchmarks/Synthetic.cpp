@@ -0,0 +1,206 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+Deterministic synthetic data with known ground truth for the pipeline benchmarks.
+
+The movie specimen is a sum of separable products of random sinusoids, so every frame can be evaluated
+exactly at any sub-pixel shift without interpolation: a handful of 1D tables per frame instead of an FFT.
+Its spectrum covers the frequency band the frame alignment looks at.
+
+Volumes are Gaussian blobs, whose Fourier transforms are known in closed form, so projections can be
+checked against the analytic central slice.
+
+*/
+
+namespace
+{
+    const int SpecimenTerms = 6;
+    const int SpecimenWaves = 24;
+    const float SpecimenMinFreq = 0.03f, SpecimenMaxFreq = 0.22f;    // Cycles per pixel
+
+    struct Wave
+    {
+        float frequency;
+        float phase;
+    };
+
+    // Box-Muller over raw mt19937 output, which the standard fixes bit for bit, unlike std::normal_distribution,
+    // so the noise and everything fitted to it are the same with every standard library
+    class PortableGaussian
+    {
+        std::mt19937 generator;
+        float spare;
+        bool hasspare;
+
+        double Uniform()
+        {
+            // (0, 1], so the logarithm stays finite
+            return ((double)generator() + 1.0) / 4294967296.0;
+        }
+
+    public:
+        PortableGaussian(unsigned int seed) : generator(seed), spare(0), hasspare(false) {}
+
+        float operator()(float sigma)
+        {
+            if (hasspare)
+            {
+                hasspare = false;
+                return spare * sigma;
+            }
+
+            double radius = sqrt(-2.0 * log(Uniform()));
+            double angle = 2.0 * PI * Uniform();
+            spare = (float)(radius * sin(angle));
+            hasspare = true;
+
+            return (float)(radius * cos(angle)) * sigma;
+        }
+    };
+}
+
+std::vector<float> SyntheticMovie(int2 dims, int nframes, const float2* h_shifts, float noise, unsigned int seed)
+{
+    std::mt19937 generator(seed);
+    std::uniform_real_distribution<float> frequencies(SpecimenMinFreq, SpecimenMaxFreq);
+    std::uniform_real_distribution<float> phases(0.0f, 2.0f * PI);
+
+    std::vector<Wave> wavesx(SpecimenTerms * SpecimenWaves), wavesy(SpecimenTerms * SpecimenWaves);
+    for (int i = 0; i < SpecimenTerms * SpecimenWaves; i++)
+    {
+        wavesx[i].frequency = frequencies(generator);
+        wavesx[i].phase = phases(generator);
+        wavesy[i].frequency = frequencies(generator);
+        wavesy[i].phase = phases(generator);
+    }
+
+    // Each 1D sum has variance waves / 2, so this normalizes the specimen to unit standard deviation
+    float scale = 1.0f / sqrt((float)SpecimenTerms * SpecimenWaves * SpecimenWaves / 4.0f);
+
+    std::vector<float> movie(Elements2(dims) * nframes);
+    std::vector<float> tablex((size_t)SpecimenTerms * dims.x), tabley((size_t)SpecimenTerms * dims.y);
+
+    for (int z = 0; z < nframes; z++)
+    {
+        float2 shift = h_shifts[z];
+
+        #pragma omp parallel for
+        for (int t = 0; t < SpecimenTerms; t++)
+        {
+            for (int x = 0; x < dims.x; x++)
+            {
+                double sum = 0;
+                for (int w = 0; w < SpecimenWaves; w++)
+                {
+                    const Wave &wave = wavesx[t * SpecimenWaves + w];
+                    sum += cos(2.0 * PI * wave.frequency * (x - shift.x) + wave.phase);
+                }
+                tablex[(size_t)t * dims.x + x] = (float)sum;
+            }
+
+            for (int y = 0; y < dims.y; y++)
+            {
+                double sum = 0;
+                for (int w = 0; w < SpecimenWaves; w++)
+                {
+                    const Wave &wave = wavesy[t * SpecimenWaves + w];
+                    sum += cos(2.0 * PI * wave.frequency * (y - shift.y) + wave.phase);
+                }
+                tabley[(size_t)t * dims.y + y] = (float)sum;
+            }
+        }
+
+        #pragma omp parallel for
+        for (int y = 0; y < dims.y; y++)
+        {
+            // One generator per row keeps the noise independent of the number of threads
+            std::mt19937 rowgenerator(seed + 1 + (unsigned int)(z * dims.y + y));
+            std::normal_distribution<float> gaussian(0.0f, noise);
+
+            float* h_row = movie.data() + Elements2(dims) * z + (size_t)y * dims.x;
+            for (int x = 0; x < dims.x; x++)
+            {
+                float val = 0;
+                for (int t = 0; t < SpecimenTerms; t++)
+                    val += tablex[(size_t)t * dims.x + x] * tabley[(size_t)t * dims.y + y];
+
+                h_row[x] = val * scale + (noise > 0 ? gaussian(rowgenerator) : 0.0f);
+            }
+        }
+    }
+
+    return movie;
+}
+
+void SyntheticCTFSpectrum(int sidelength, CTFParams params, float noise, unsigned int seed, std::vector<float> &ps, std::vector<float2> &coords)
+{
+    // Same band CTF fitting usually looks at, well below the point where the rings alias
+    const float MinFreq = 0.05f, MaxFreq = 0.3f;
+
+    coords.clear();
+    for (int y = 0; y < sidelength; y++)
+    {
+        int ky = y < sidelength / 2 + 1 ? y : y - sidelength;
+        for (int x = 0; x < sidelength / 2 + 1; x++)
+        {
+            float r = sqrt((float)(x * x + ky * ky)) / sidelength;
+            if (r >= MinFreq && r < MaxFreq)
+                coords.push_back(make_float2(r, atan2((float)ky, (float)x)));
+        }
+    }
+
+    ps.resize(coords.size());
+    h_CTFSimulate(&params, coords.data(), ps.data(), (uint)coords.size(), true, 1);
+
+    PortableGaussian gaussian(seed);
+    for (size_t i = 0; i < ps.size(); i++)
+        ps[i] += gaussian(noise);
+}
+
+std::vector<float> SyntheticBlobVolume(int size, float3 center, float sigma)
+{
+    std::vector<float> volume(Elements(toInt3(size, size, size)));
+
+    #pragma omp parallel for
+    for (int z = 0; z < size; z++)
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size; x++)
+            {
+                float dx = x - size / 2 - center.x, dy = y - size / 2 - center.y, dz = z - size / 2 - center.z;
+                volume[((size_t)z * size + y) * size + x] = exp(-(dx * dx + dy * dy + dz * dz) / (2.0f * sigma * sigma));
+            }
+
+    return volume;
+}
+
+float2 SyntheticBlobFT(int size, float3 center, float sigma, float3 k)
+{
+    // Continuous transform of the blob, phase relative to the box center
+    float k2 = (k.x * k.x + k.y * k.y + k.z * k.z) / ((float)size * size);
+    float amplitude = pow(2.0f * PI * sigma * sigma, 1.5f) * exp(-2.0f * PI * PI * sigma * sigma * k2);
+    float phase = -2.0f * PI * (k.x * center.x + k.y * center.y + k.z * center.z) / (float)size;
+
+    return make_float2(amplitude * cos(phase), amplitude * sin(phase));
+}
+
+std::vector<float2> SyntheticBlobProjector(int size, int oversampling, float3 center, float sigma, int3 &dimsprojector)
+{
+    int n = 2 * (oversampling * (size / 2) + 1) + 1;
+    dimsprojector = toInt3(n, n, n);
+
+    int xhalf = n / 2 + 1;
+    std::vector<float2> data((size_t)xhalf * n * n);
+
+    #pragma omp parallel for
+    for (int z = 0; z < n; z++)
+        for (int y = 0; y < n; y++)
+            for (int x = 0; x < xhalf; x++)
+            {
+                float3 k = make_float3((float)x / oversampling, (float)(y - n / 2) / oversampling, (float)(z - n / 2) / oversampling);
+                data[((size_t)z * n + y) * xhalf + x] = SyntheticBlobFT(size, center, sigma, k);
+            }
+
+    return data;
+}
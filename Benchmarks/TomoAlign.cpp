@@ -0,0 +1,140 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+TomoGlobalAlign against TomoGlobalAlignHierarchical on synthetic subtomograms. The reference is a few
+Gaussian blobs, the particles are its central slices at grid orientations and shifts with noise, two tilts
+each. The hierarchical search must find the same orientation and shift as the exhaustive one for every
+particle.
+
+*/
+
+bool BenchmarkTomoAlign()
+{
+    const int Oversampling = 2;
+    const int NParticles = 16, NTilts = 2;
+    const float AngleStep = 20.0f * PI / 180.0f;
+
+    int size = tmax(16, Settings.volumesize / 2);
+    int2 dims = toInt2(size, size);
+    uint length = (uint)ElementsFFT2(dims);
+
+    int3 dimsref;
+    std::vector<float2> reference;
+    const float3 Centers[] = { make_float3(size / 6.0f, -size / 9.0f, size / 12.0f), make_float3(-size / 10.0f, size / 5.0f, -size / 7.0f), make_float3(0, -size / 6.0f, size / 5.0f) };
+    const float Sigmas[] = { size / 10.0f, size / 14.0f, size / 12.0f };
+    for (int i = 0; i < 3; i++)
+    {
+        std::vector<float2> blob = SyntheticBlobProjector(size, Oversampling, Centers[i], Sigmas[i], dimsref);
+        if (reference.empty())
+            reference = blob;
+        else
+            for (size_t j = 0; j < reference.size(); j++)
+                reference[j] += blob[j];
+    }
+
+    // Regular ZYZ grid, the same orientation in both tilts
+    std::vector<float3> angles;
+    for (float rot = 0; rot < 2 * PI - 1e-3f; rot += AngleStep)
+        for (float tilt = AngleStep / 2; tilt < PI; tilt += AngleStep)
+            for (float psi = 0; psi < 2 * PI - 1e-3f; psi += AngleStep)
+                for (int t = 0; t < NTilts; t++)
+                    angles.push_back(make_float3(rot, tilt, psi));
+    uint nangles = (uint)(angles.size() / NTilts);
+
+    std::vector<float2> shifts;
+    for (int y = -2; y <= 2; y++)
+        for (int x = -2; x <= 2; x++)
+            for (int t = 0; t < NTilts; t++)
+                shifts.push_back(make_float2((float)x, (float)y));
+    uint nshifts = (uint)(shifts.size() / NTilts);
+
+    std::vector<float2> shiftfactors(length);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size / 2 + 1; x++)
+        {
+            int ky = y < (size + 1) / 2 ? y : y - size;
+            shiftfactors[y * (size / 2 + 1) + x] = make_float2((float)x, (float)ky) * (2.0f * PI / size);
+        }
+
+    // Particles: projection at the true orientation, shifted so that the true shift's ramp undoes it, plus noise
+    std::mt19937 generator(77);
+    std::uniform_int_distribution<int> pickangle(0, nangles - 1), pickshift(0, nshifts - 1);
+    std::normal_distribution<float> noise(0.0f, 1.0f);
+
+    std::vector<int> trueangles(NParticles), trueshifts(NParticles);
+    std::vector<float2> experimental((size_t)NParticles * NTilts * length);
+    std::vector<float2> projection((size_t)NTilts * length);
+    for (int p = 0; p < NParticles; p++)
+    {
+        trueangles[p] = pickangle(generator);
+        trueshifts[p] = pickshift(generator);
+        ProjectForward(reference.data(), projection.data(), dimsref, dims, angles.data() + (size_t)trueangles[p] * NTilts, (float)Oversampling, NTilts);
+
+        double power = 0;
+        for (size_t i = 0; i < projection.size(); i++)
+            power += dotp2(projection[i], projection[i]);
+        float noiselevel = 0.5f * (float)sqrt(power / projection.size());
+
+        for (int t = 0; t < NTilts; t++)
+            for (uint i = 0; i < length; i++)
+            {
+                float2 factors = shiftfactors[i];
+                float2 shift = shifts[trueshifts[p] * NTilts + t];
+                float phase = -(factors.x * shift.x + factors.y * shift.y);
+
+                float2 value = cmul(projection[(size_t)t * length + i], make_float2(cos(phase), sin(phase)));
+                experimental[((size_t)p * NTilts + t) * length + i] = value + make_float2(noise(generator), noise(generator)) * noiselevel;
+            }
+    }
+
+    std::vector<float> ctf(experimental.size(), 1.0f), weights((size_t)NParticles * NTilts, 1.0f);
+
+    std::vector<int> exhaustiveangles(NParticles), exhaustiveshifts(NParticles), hierarchicalangles(NParticles), hierarchicalshifts(NParticles);
+    std::vector<float> scores(NParticles);
+
+    StageReport exhaustive = TimeStage("tomoalign exhaustive", [&]()
+    {
+        std::fill(scores.begin(), scores.end(), -1e30f);
+        TomoGlobalAlign(experimental.data(), shiftfactors.data(), ctf.data(), weights.data(), dims, reference.data(), dimsref, Oversampling,
+                        angles.data(), nangles, shifts.data(), nshifts, NParticles, NTilts, exhaustiveangles.data(), exhaustiveshifts.data(), scores.data());
+    });
+
+    StageReport hierarchical = TimeStage("tomoalign hierarchical", [&]()
+    {
+        std::fill(scores.begin(), scores.end(), -1e30f);
+        TomoGlobalAlignHierarchical(experimental.data(), shiftfactors.data(), ctf.data(), weights.data(), dims, reference.data(), dimsref, Oversampling,
+                                    angles.data(), nangles, shifts.data(), nshifts, NParticles, NTilts, 0.35f, 8, 0, 0,
+                                    hierarchicalangles.data(), hierarchicalshifts.data(), scores.data());
+    });
+
+    int mismatches = 0, misses = 0;
+    for (int p = 0; p < NParticles; p++)
+    {
+        mismatches += hierarchicalangles[p] != exhaustiveangles[p] || hierarchicalshifts[p] != exhaustiveshifts[p];
+        misses += exhaustiveangles[p] != trueangles[p] || exhaustiveshifts[p] != trueshifts[p];
+    }
+
+    std::string sizestring = SizeString(size, size, NTilts) + " x " + std::to_string(NParticles) + ", " + std::to_string(nangles) + " angles x " + std::to_string(nshifts) + " shifts";
+    for (StageReport* report : { &exhaustive, &hierarchical })
+    {
+        report->size = sizestring;
+        report->work = (double)NParticles;
+        report->workunit = "particles";
+    }
+
+    exhaustive.errorname = "particles off the ground truth";
+    exhaustive.error = misses;
+    exhaustive.tolerance = NParticles / 8;
+    ReportStage(exhaustive);
+
+    hierarchical.errorname = "particles off the exhaustive result";
+    hierarchical.error = mismatches;
+    hierarchical.tolerance = 0;
+    ReportStage(hierarchical);
+
+    printf("hierarchical search: %.1fx the exhaustive speed\n", exhaustive.latencies[0] / hierarchical.latencies[0]);
+
+    return exhaustive.error <= exhaustive.tolerance && hierarchical.error <= hierarchical.tolerance;
+}
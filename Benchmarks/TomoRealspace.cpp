@@ -0,0 +1,134 @@
+#include "Benchmarks.h"
+#include <algorithm>
+using namespace gtom;
+
+/*
+
+One particle's tilt images scored against many projections over a sweep of candidate shifts, as in the tilt
+series' real-space refinement. The scorer precomputes the masked mean and standard deviation for every shift
+once, then gets all shifts from one correlation map per projection and tilt. For integer shifts its scores must
+match one TomoRealspaceCorrelate call per shift; fractional shifts are interpolated from the maps, so their
+deviation is only reported.
+
+*/
+
+namespace
+{
+    const int Size = 64;
+    const uint NTilts = 21, NProjections = 96;
+    const int ShiftRange = 3;    // Integer shifts in [-ShiftRange, ShiftRange] per axis
+
+    // Periodic box blur, repeated a few times, so the images have a realistic spectrum for the interpolation
+    void Smooth(float* h_image, int2 dims, int passes)
+    {
+        std::vector<float> buffer(Elements2(dims));
+        for (int pass = 0; pass < passes; pass++)
+        {
+            for (int y = 0; y < dims.y; y++)
+                for (int x = 0; x < dims.x; x++)
+                    buffer[y * dims.x + x] = (h_image[y * dims.x + (x + dims.x - 1) % dims.x] + h_image[y * dims.x + x] + h_image[y * dims.x + (x + 1) % dims.x]) / 3.0f;
+            for (int y = 0; y < dims.y; y++)
+                for (int x = 0; x < dims.x; x++)
+                    h_image[y * dims.x + x] = (buffer[((y + dims.y - 1) % dims.y) * dims.x + x] + buffer[y * dims.x + x] + buffer[((y + 1) % dims.y) * dims.x + x]) / 3.0f;
+        }
+    }
+}
+
+bool BenchmarkTomoRealspace()
+{
+    int2 dims = toInt2(Size, Size);
+    size_t elements = Elements2(dims);
+
+    std::vector<float> experimental = RandomValues(elements * NTilts, -1.0f, 1.0f, 135);
+    std::vector<float> projections = RandomValues(elements * NTilts * NProjections, -1.0f, 1.0f, 246);
+    for (uint t = 0; t < NTilts; t++)
+        Smooth(experimental.data() + elements * t, dims, 4);
+    for (uint i = 0; i < NTilts * NProjections; i++)
+        Smooth(projections.data() + elements * i, dims, 4);
+
+    // Soft circular mask; the legacy path wants one copy per tilt
+    std::vector<float> mask(elements), masktiled(elements * NTilts);
+    for (int y = 0; y < Size; y++)
+        for (int x = 0; x < Size; x++)
+        {
+            float r = sqrt((float)((x - Size / 2) * (x - Size / 2) + (y - Size / 2) * (y - Size / 2)));
+            mask[y * Size + x] = r < Size / 4 ? 1.0f : (r < Size / 2 - 4 ? 0.5f + 0.5f * cos((r - Size / 4) / (Size / 4 - 4) * PI) : 0.0f);
+        }
+    for (uint t = 0; t < NTilts; t++)
+        std::copy(mask.begin(), mask.end(), masktiled.begin() + elements * t);
+
+    std::vector<float> weights = RandomValues(NTilts, 0.5f, 1.0f, 357);
+    std::vector<float> ctf(ElementsFFT2(dims) * NTilts, 1.0f);
+
+    // Integer sweep, then the same number of fractional shifts that differ per tilt
+    int nsteps = ShiftRange * 2 + 1;
+    uint nintegers = nsteps * nsteps;
+    std::vector<float3> shifts((size_t)nintegers * 2 * NTilts);
+    std::vector<float> fractional = RandomValues((size_t)nintegers * NTilts * 2, -ShiftRange, ShiftRange, 468);
+    for (uint s = 0; s < nintegers; s++)
+        for (uint t = 0; t < NTilts; t++)
+        {
+            shifts[(size_t)s * NTilts + t] = make_float3((float)((int)s % nsteps - ShiftRange), (float)((int)s / nsteps - ShiftRange), 0.0f);
+            shifts[(size_t)(nintegers + s) * NTilts + t] = make_float3(fractional[((size_t)s * NTilts + t) * 2], fractional[((size_t)s * NTilts + t) * 2 + 1], 0.0f);
+        }
+    uint nshifts = nintegers * 2;
+
+    std::vector<float> reference((size_t)nshifts * NProjections);
+    double tlegacy = BenchmarkSeconds([&]()
+    {
+        std::vector<float> result(NProjections);
+        for (uint s = 0; s < nshifts; s++)
+        {
+            TomoRealspaceCorrelate(projections.data(), dims, NProjections, NTilts, experimental.data(), ctf.data(), masktiled.data(), weights.data(), (float*)(shifts.data() + (size_t)s * NTilts), result.data());
+            for (uint p = 0; p < NProjections; p++)
+                reference[(size_t)p * nshifts + s] = result[p];
+        }
+    }, 1);
+
+    // Every shift's score, to compare against the reference, and the best one
+    std::vector<int> allshifts((size_t)nshifts * NProjections), bestshifts(NProjections);
+    std::vector<float> allscores((size_t)nshifts * NProjections), bestscores(NProjections);
+    double tscorer = BenchmarkSeconds([&]()
+    {
+        void* scorer = CreateTomoRealspaceScorer(experimental.data(), mask.data(), dims, NTilts);
+        TomoRealspaceScorerCorrelate(scorer, projections.data(), NProjections, weights.data(), (float*)shifts.data(), nshifts, 1, bestshifts.data(), bestscores.data());
+        DestroyTomoRealspaceScorer(scorer);
+    }, 3);
+
+    void* scorer = CreateTomoRealspaceScorer(experimental.data(), mask.data(), dims, NTilts);
+    TomoRealspaceScorerCorrelate(scorer, projections.data(), NProjections, weights.data(), (float*)shifts.data(), nshifts, nshifts, allshifts.data(), allscores.data());
+    DestroyTomoRealspaceScorer(scorer);
+
+    float maxabs = 0, maxinteger = 0, maxfractional = 0;
+    bool bestmatch = true;
+    for (uint p = 0; p < NProjections; p++)
+    {
+        std::vector<float> scores(nshifts);
+        for (uint k = 0; k < nshifts; k++)
+            scores[allshifts[(size_t)p * nshifts + k]] = allscores[(size_t)p * nshifts + k];
+
+        for (uint s = 0; s < nshifts; s++)
+        {
+            float ref = reference[(size_t)p * nshifts + s];
+            maxabs = tmax(maxabs, std::abs(ref));
+            if (s < nintegers)
+                maxinteger = tmax(maxinteger, std::abs(scores[s] - ref));
+            else
+                maxfractional = tmax(maxfractional, std::abs(scores[s] - ref));
+        }
+
+        // Sorted in descending order, and the top-1 call agrees with the full ranking
+        for (uint k = 1; k < nshifts; k++)
+            bestmatch = bestmatch && allscores[(size_t)p * nshifts + k] <= allscores[(size_t)p * nshifts + k - 1];
+        bestmatch = bestmatch && bestshifts[p] == allshifts[(size_t)p * nshifts] && bestscores[p] == allscores[(size_t)p * nshifts];
+    }
+    maxinteger /= tmax(1e-20f, maxabs);
+    maxfractional /= tmax(1e-20f, maxabs);
+
+    printf("%dx%d, %u tilts, %u projections, %u integer + %u fractional shifts\n", Size, Size, NTilts, NProjections, nintegers, nintegers);
+    printf("%-10s %12s %12s %9s %14s %14s %10s\n", "", "per shift", "scorer", "speedup", "integer dev", "fraction dev", "ranking");
+    printf("%-10s %9.1f ms %9.1f ms %8.2fx %14.2e %14.2e %10s\n", "all shifts",
+           tlegacy * 1e3, tscorer * 1e3, tlegacy / tscorer, maxinteger, maxfractional, bestmatch ? "ok" : "WRONG");
+
+    return maxinteger < 1e-4f && bestmatch;
+}
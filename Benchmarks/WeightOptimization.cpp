@@ -0,0 +1,139 @@
+#include "Benchmarks.h"
+using namespace gtom;
+
+/*
+
+Weighted averaging of many reconstructions as in the weight optimization, against the straightforward
+version: one pass over the sums per reconstruction, with exp per element. OptimizeWeights, a persistent
+optimizer with copied inputs, and one with inputs mapped from a file must all give the same bits, since
+every element still sums its reconstructions in the same order.
+
+*/
+
+namespace
+{
+    const int NRecs = 24;
+    const char* MappedPath = "weightoptimization_inputs.bin";
+
+    void ReferenceWeights(int nrecs, const float2* recft, const float* recweights, const float* r2, int elements, const int* subsets,
+                          const float* bfacs, const float* weightfactors, float2* recsum1, float2* recsum2, float* weightsum1, float* weightsum2)
+    {
+        for (int n = 0; n < nrecs; n++)
+        {
+            float2* recsum = subsets[n] % 2 == 0 ? recsum1 : recsum2;
+            float* weightsum = subsets[n] % 2 == 0 ? weightsum1 : weightsum2;
+            const float2* rec = recft + (size_t)elements * n;
+            const float* weights = recweights + (size_t)elements * n;
+
+            #pragma omp parallel for
+            for (int i = 0; i < elements; i++)
+            {
+                float weight = weightfactors[n] * (float)exp(r2[i] * bfacs[n]) * weights[i];
+                recsum[i].x += rec[i].x * weight;
+                recsum[i].y += rec[i].y * weight;
+                weightsum[i] += weight;
+            }
+        }
+    }
+
+    struct Sums
+    {
+        std::vector<float> recsum1, recsum2, weightsum1, weightsum2;
+
+        Sums(int elements) : recsum1(elements * 2), recsum2(elements * 2), weightsum1(elements), weightsum2(elements) {}
+
+        bool operator==(const Sums &other) const
+        {
+            return recsum1 == other.recsum1 && recsum2 == other.recsum2 && weightsum1 == other.weightsum1 && weightsum2 == other.weightsum2;
+        }
+    };
+}
+
+bool BenchmarkWeightOptimization()
+{
+    int size = Settings.volumesize;
+    int3 dims = toInt3(size, size, size);
+    int elements = (int)ElementsFFT(dims);
+
+    // r^2 in the layout the weight optimization uses
+    std::vector<float> r2(elements);
+    for (int z = 0; z < size; z++)
+        for (int y = 0; y < size; y++)
+            for (int x = 0; x < size / 2 + 1; x++)
+            {
+                int zz = z < size / 2 + 1 ? z : z - size;
+                int yy = y < size / 2 + 1 ? y : y - size;
+                float r = sqrt((float)(x * x + yy * yy + zz * zz)) / size / 1.35f;
+                r2[((size_t)z * size + y) * (size / 2 + 1) + x] = r * r;
+            }
+
+    std::vector<float> recft = RandomValues((size_t)elements * NRecs * 2, -1.0f, 1.0f, 11);
+    std::vector<float> recweights = RandomValues((size_t)elements * NRecs, 0.0f, 1.0f, 12);
+    std::vector<float> bfacs = RandomValues(NRecs, -50.0f, 0.0f, 13);
+    std::vector<float> weightfactors = RandomValues(NRecs, 0.5f, 2.0f, 14);
+    std::vector<int> subsets(NRecs);
+    for (int n = 0; n < NRecs; n++)
+        subsets[n] = n % 2;
+
+    FILE* file = fopen(MappedPath, "wb");
+    fwrite(recft.data(), sizeof(float), recft.size(), file);
+    fwrite(recweights.data(), sizeof(float), recweights.size(), file);
+    fclose(file);
+
+    Sums reference(elements), single(elements), copied(elements), mapped(elements);
+
+    double treference = BenchmarkSeconds([&]()
+    {
+        reference = Sums(elements);
+        ReferenceWeights(NRecs, (float2*)recft.data(), recweights.data(), r2.data(), elements, subsets.data(), bfacs.data(), weightfactors.data(),
+                         (float2*)reference.recsum1.data(), (float2*)reference.recsum2.data(), reference.weightsum1.data(), reference.weightsum2.data());
+    }, 3);
+
+    double tsingle = BenchmarkSeconds([&]()
+    {
+        single = Sums(elements);
+        OptimizeWeights(NRecs, recft.data(), recweights.data(), r2.data(), elements, subsets.data(), bfacs.data(), weightfactors.data(),
+                        single.recsum1.data(), single.recsum2.data(), single.weightsum1.data(), single.weightsum2.data());
+    }, 3);
+
+    // Inputs added in two parts, like two series
+    void* copiedoptimizer = CreateWeightOptimizer(r2.data(), elements);
+    int firstcopied = WeightOptimizerAddInputs(copiedoptimizer, NRecs / 2, recft.data(), recweights.data());
+    int secondcopied = WeightOptimizerAddInputs(copiedoptimizer, NRecs - NRecs / 2,
+                                                recft.data() + (size_t)elements * 2 * (NRecs / 2), recweights.data() + (size_t)elements * (NRecs / 2));
+
+    double tcopied = BenchmarkSeconds([&]()
+    {
+        copied = Sums(elements);
+        WeightOptimizerAccumulate(copiedoptimizer, subsets.data(), bfacs.data(), weightfactors.data(),
+                                  copied.recsum1.data(), copied.recsum2.data(), copied.weightsum1.data(), copied.weightsum2.data());
+    }, 3);
+    DestroyWeightOptimizer(copiedoptimizer);
+
+    void* mappedoptimizer = CreateWeightOptimizer(r2.data(), elements);
+    int firstmapped = WeightOptimizerMapInputs(mappedoptimizer, NRecs, (char*)MappedPath);
+    int toomany = WeightOptimizerMapInputs(mappedoptimizer, NRecs + 1, (char*)MappedPath);
+
+    double tmapped = BenchmarkSeconds([&]()
+    {
+        mapped = Sums(elements);
+        WeightOptimizerAccumulate(mappedoptimizer, subsets.data(), bfacs.data(), weightfactors.data(),
+                                  mapped.recsum1.data(), mapped.recsum2.data(), mapped.weightsum1.data(), mapped.weightsum2.data());
+    }, 3);
+    DestroyWeightOptimizer(mappedoptimizer);
+
+    remove(MappedPath);
+
+    bool identical[] = { single == reference, copied == reference, mapped == reference };
+
+    double bytes = (double)elements * NRecs * 3 * sizeof(float);
+    printf("%d reconstructions of %dx%dx%d, %.1f MB of inputs\n", NRecs, size, size, size, bytes / 1048576.0);
+    printf("%-18s %12s %10s %10s\n", "", "time", "GB/s", "identical");
+    printf("%-18s %9.2f ms %10.2f %10s\n", "per reconstruction", treference * 1e3, bytes / treference * 1e-9, "");
+    printf("%-18s %9.2f ms %10.2f %10s\n", "OptimizeWeights", tsingle * 1e3, bytes / tsingle * 1e-9, identical[0] ? "yes" : "NO");
+    printf("%-18s %9.2f ms %10.2f %10s\n", "copied inputs", tcopied * 1e3, bytes / tcopied * 1e-9, identical[1] ? "yes" : "NO");
+    printf("%-18s %9.2f ms %10.2f %10s\n", "mapped inputs", tmapped * 1e3, bytes / tmapped * 1e-9, identical[2] ? "yes" : "NO");
+
+    return identical[0] && identical[1] && identical[2] &&
+           firstcopied == 0 && secondcopied == NRecs / 2 && firstmapped == 0 && toomany == -1;
+}
@@ -0,0 +1,305 @@
+#include "Functions.h"
+#include <vector>
+using namespace gtom;
+
+/*
+
+Supplied with a stack of frames, and extraction positions for sub-regions, this method
+extracts portions of each frame, computes the FT, and averages the results as follows:
+
+-3D full fitting: d_output contains all individual spectra from each frame
+-2D spatial fitting: d_output contains averages for all positions over all frames
+-1D temporal fitting: d_output contains averages for all frames over all positions
+-0D no fitting: d_output is NULL
+
+Frames are ingested in chunks through a SpectrumAccumulator, which only keeps the running sums
+per origin and frame group, plus a tile of periodograms for as many origins as fit the memory budget.
+The sums are always fp32, the outputs are written with the STORAGE_* precision passed to Finish.
+
+*/
+
+#define SPECTRA_DEFAULT_BUDGET (256LL << 20)
+#define SPECTRA_STORE_CHUNK 4096
+
+struct SpectrumAccumulator
+{
+    int2 dimsregion;
+    int norigins;
+    std::vector<int3> origins;
+    int3 ctfgrid;
+    bool ctfspace;
+    int pertimegroup;
+
+    int tilesize;
+    int framesadded;
+    int framesused;
+
+    tfloat* h_tile;
+    tfloat* h_sums;
+    tfloat* h_meansum;
+};
+
+__declspec(dllexport) void* CreateSpectrumAccumulator(int2 dimsregion, int3* h_origins, int norigins, int nframes, int3 ctfgrid, long long memorybudget)
+{
+    SpectrumAccumulator* a = new SpectrumAccumulator();
+
+    size_t elementsspectrum = ElementsFFT2(dimsregion);
+
+    a->dimsregion = dimsregion;
+    a->norigins = norigins;
+    a->origins.assign(h_origins, h_origins + norigins);
+    a->ctfgrid = ctfgrid;
+    a->ctfspace = ctfgrid.x * ctfgrid.y > 1;
+    a->pertimegroup = tmax(1, nframes / ctfgrid.z);
+    a->framesadded = 0;
+    a->framesused = 0;
+
+    // Per origin: extracted region, its FT, and the resulting periodogram
+    size_t perorigin = Elements2(dimsregion) * sizeof(tfloat) + elementsspectrum * (sizeof(tcomplex) + sizeof(tfloat));
+    a->tilesize = (int)tmax(1LL, tmin((long long)norigins, memorybudget / (long long)perorigin));
+
+    a->h_tile = (tfloat*)MallocAligned(a->tilesize * elementsspectrum * sizeof(tfloat));
+
+    size_t nsums = (a->ctfspace ? norigins : 1) * ctfgrid.z;
+    a->h_sums = MallocAlignedValueFilled(nsums * elementsspectrum, 0.0f);
+    a->h_meansum = MallocAlignedValueFilled(elementsspectrum, 0.0f);
+
+    return a;
+}
+
+__declspec(dllexport) void SpectrumAccumulatorAdd(void* accumulator, float* d_frames, int2 dimsframe, int nframes)
+{
+    SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+    size_t elementsspectrum = ElementsFFT2(a->dimsregion);
+
+    for (int z = 0; z < nframes; z++)
+    {
+        int framegroup = a->framesadded++ / a->pertimegroup;
+        if (framegroup >= a->ctfgrid.z)    // Trailing frames that don't fill a whole group
+            continue;
+
+        tfloat* h_groupsums = a->h_sums + elementsspectrum * framegroup * (a->ctfspace ? a->norigins : 1);
+
+        for (int t = 0; t < a->norigins; t += a->tilesize)
+        {
+            int ntile = tmin(a->tilesize, a->norigins - t);
+
+            h_CTFPeriodogram(d_frames + Elements2(dimsframe) * z, dimsframe, a->origins.data() + t, ntile, a->dimsregion, a->h_tile);
+
+            // Log, reduction over origins, and accumulation in one pass over the tile
+            tfloat* h_tile = a->h_tile;
+            tfloat* h_sums = a->ctfspace ? h_groupsums + elementsspectrum * t : h_groupsums;
+            tfloat* h_meansum = a->h_meansum;
+            bool perspectrum = a->ctfspace;
+
+            #pragma omp parallel for
+            for (long long i = 0; i < (long long)elementsspectrum; i++)
+            {
+                tfloat sum = 0;
+                for (int n = 0; n < ntile; n++)
+                {
+                    tfloat val = log(h_tile[n * elementsspectrum + i] + 1e2f);
+                    sum += val;
+
+                    if (perspectrum)
+                        h_sums[n * elementsspectrum + i] += val;
+                }
+
+                if (!perspectrum)
+                    h_sums[i] += sum;
+                h_meansum[i] += sum;
+            }
+        }
+
+        a->framesused++;
+    }
+}
+
+namespace
+{
+    // h_input * factor, converted chunk by chunk so there is no fp32 copy of the output
+    void MultiplyByScalarToStorage(const float* h_input, void* h_output, size_t elements, float factor, int precision)
+    {
+        long long nchunks = (long long)((elements + SPECTRA_STORE_CHUNK - 1) / SPECTRA_STORE_CHUNK);
+
+        #pragma omp parallel for
+        for (long long c = 0; c < nchunks; c++)
+        {
+            float scaled[SPECTRA_STORE_CHUNK];
+            size_t first = (size_t)c * SPECTRA_STORE_CHUNK;
+            size_t n = tmin((size_t)SPECTRA_STORE_CHUNK, elements - first);
+
+            for (size_t i = 0; i < n; i++)
+                scaled[i] = h_input[first + i] * factor;
+
+            h_ConvertToStorage(scaled, (char*)h_output + first * StorageBytes(precision), n, precision);
+        }
+    }
+}
+
+__declspec(dllexport) void SpectrumAccumulatorFinish(void* accumulator, void* d_outputall, void* d_outputmean, int precision)
+{
+    SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+    size_t elementsspectrum = ElementsFFT2(a->dimsregion);
+    size_t nsums = (a->ctfspace ? a->norigins : 1) * a->ctfgrid.z;
+
+    // Spatially resolved spectra average over frames in their group, the others also over origins
+    MultiplyByScalarToStorage(a->h_sums, d_outputall, nsums * elementsspectrum, 1.0f / (tfloat)(a->pertimegroup * (a->ctfspace ? 1 : a->norigins)), precision);
+    MultiplyByScalarToStorage(a->h_meansum, d_outputmean, elementsspectrum, 1.0f / (tfloat)tmax(1, a->framesused * a->norigins), precision);
+}
+
+__declspec(dllexport) void DestroySpectrumAccumulator(void* accumulator)
+{
+    SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+
+    FreeAligned(a->h_tile);
+    FreeAligned(a->h_sums);
+    FreeAligned(a->h_meansum);
+
+    delete a;
+}
+
+__declspec(dllexport) void CreateSpectra(float* d_frame,
+                                        int2 dimsframe,
+                                        int nframes,
+                                        int3* h_origins,
+                                        int norigins,
+                                        int2 dimsregion,
+                                        int3 ctfgrid,
+                                        void* d_outputall,
+                                        void* d_outputmean,
+                                        int precision)
+{
+    void* accumulator = CreateSpectrumAccumulator(dimsregion, h_origins, norigins, nframes, ctfgrid, SPECTRA_DEFAULT_BUDGET);
+
+    SpectrumAccumulatorAdd(accumulator, d_frame, dimsframe, nframes);
+    SpectrumAccumulatorFinish(accumulator, d_outputall, d_outputmean, precision);
+
+    DestroySpectrumAccumulator(accumulator);
+}
+
+__declspec(dllexport) CTFParams CTFFitMean(float* d_ps, float2* d_pscoords, int2 dims, CTFParams startparams, CTFFitParams fp, bool doastigmatism)
+{
+    tfloat score;
+    CTFParams delta = h_CTFFit(d_ps, d_pscoords, dims, startparams, fp, score);
+
+    CTFParams result;
+    for (int i = 0; i < 12; i++)
+        ((tfloat*)&result)[i] = ((tfloat*)&startparams)[i] + ((tfloat*)&delta)[i];
+
+    result.Bfactor = score;
+
+    return result;
+}
+
+__declspec(dllexport) void CTFMakeAverage(float* d_ps, float2* d_pscoords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, uint minbin, uint maxbin, int* h_consider, uint batch, float* d_output)
+{
+    if (batch > 1)
+        h_CTFRotationalAverageToTarget((tfloat*)d_ps, d_pscoords, length, sidelength, h_sourceparams, targetparams, d_output, minbin, maxbin, h_consider, batch);
+    else
+        h_CTFRotationalAverageToTarget((tfloat*)d_ps, d_pscoords, length, sidelength, h_sourceparams, targetparams, d_output, minbin, maxbin, NULL, 1);
+}
+
+__declspec(dllexport) void CTFCompareToSim(half* d_ps, half2* d_pscoords, half* d_scale, uint length, CTFParams* h_sourceparams, float* h_scores, uint batch)
+{
+    std::vector<float2> coords(length);
+    for (uint i = 0; i < length; i++)
+        coords[i] = __half22float2(d_pscoords[i]);    // Sidelength and pixelsize are already included in d_pscoords
+
+    CTFGrid grid;
+    h_CTFCreateGrid(coords.data(), length, &grid);
+
+    std::vector<double> moments((size_t)batch * 3);
+    h_CTFMomentsMany(grid, h_sourceparams, (int)batch, d_ps, length, d_scale, true, moments.data());
+
+    h_CTFFreeGrid(&grid);
+
+    #pragma omp parallel for
+    for (int b = 0; b < (int)batch; b++)
+    {
+        half* h_target = d_ps + (size_t)length * b;
+
+        double sumtarget = 0.0;
+        for (uint i = 0; i < length; i++)
+            sumtarget += __half2float(h_target[i]);
+
+        // Simulated spectrum is normalized on the fly: sum(sim * target) and sum(target) suffice
+        double sum1 = moments[b * 3 + 0], sum2 = moments[b * 3 + 1], sumcross = moments[b * 3 + 2];
+        double mean = sum1 / length;
+        double stddev = sqrt(tmax(0.0, (double)length * sum2 - sum1 * sum1)) / length;
+        double invstddev = stddev > 0 ? 1.0 / stddev : 0.0;
+
+        h_scores[b] = (float)((sumcross - mean * sumtarget) * invstddev / length);
+    }
+}
+
+// CTFCompareToSim's scores and their gradients with respect to defocus, defocusdelta, astigmatismangle,
+// phaseshift and Bfactor, CTF_GRADIENT_PARAMS per spectrum in CTFParams units, all in one pass over the data
+__declspec(dllexport) void CTFCompareToSimGradients(half* d_ps, half2* d_pscoords, half* d_scale, uint length, CTFParams* h_sourceparams, float* h_scores, float* h_gradients, uint batch)
+{
+    std::vector<float2> coords(length);
+    for (uint i = 0; i < length; i++)
+        coords[i] = __half22float2(d_pscoords[i]);
+
+    CTFGrid grid;
+    h_CTFCreateGrid(coords.data(), length, &grid);
+
+    std::vector<double> moments((size_t)batch * 3), gradients((size_t)batch * 3 * CTF_GRADIENT_PARAMS);
+    h_CTFMomentsGradientsMany(grid, h_sourceparams, (int)batch, d_ps, length, d_scale, moments.data(), gradients.data());
+
+    h_CTFFreeGrid(&grid);
+
+    #pragma omp parallel for
+    for (int b = 0; b < (int)batch; b++)
+    {
+        half* h_target = d_ps + (size_t)length * b;
+
+        double sumtarget = 0.0;
+        for (uint i = 0; i < length; i++)
+            sumtarget += __half2float(h_target[i]);
+
+        // score = (sumcross - sum1 * sumtarget / length) / sqrt(length * sum2 - sum1^2), differentiated by the quotient rule
+        double sum1 = moments[b * 3 + 0], sum2 = moments[b * 3 + 1], sumcross = moments[b * 3 + 2];
+        double numerator = sumcross - sum1 * sumtarget / length;
+        double denominator = sqrt(tmax(0.0, (double)length * sum2 - sum1 * sum1));
+        double invdenominator = denominator > 0 ? 1.0 / denominator : 0.0;
+
+        h_scores[b] = (float)(numerator * invdenominator);
+
+        for (int p = 0; p < CTF_GRADIENT_PARAMS; p++)
+        {
+            const double* h_dsums = gradients.data() + ((size_t)b * CTF_GRADIENT_PARAMS + p) * 3;
+            double dnumerator = h_dsums[2] - h_dsums[0] * sumtarget / length;
+            double ddenominator = ((double)length * h_dsums[1] - 2.0 * sum1 * h_dsums[0]) * 0.5 * invdenominator;
+
+            h_gradients[b * CTF_GRADIENT_PARAMS + p] = (float)((dnumerator - numerator * ddenominator * invdenominator) * invdenominator);
+        }
+    }
+}
+
+/*
+
+Scoring many parameter sets against one spectrum, for fitters that evaluate their candidates in batches.
+The grid keeps the per-pixel invariants of the coordinates between calls; scores are the normalized
+cross-correlation of |CTF| with the spectrum, like CTFFitMean's.
+
+*/
+
+__declspec(dllexport) void* CreateCTFGrid(float2* d_coords, uint length)
+{
+    CTFGrid* grid = new CTFGrid();
+    h_CTFCreateGrid(d_coords, length, grid);
+
+    return grid;
+}
+
+__declspec(dllexport) void DestroyCTFGrid(void* grid)
+{
+    h_CTFFreeGrid((CTFGrid*)grid);
+    delete (CTFGrid*)grid;
+}
+
+__declspec(dllexport) void CTFScoreCandidates(void* grid, float* d_ps, CTFParams* h_params, uint ncandidates, float* h_scores)
+{
+    h_CTFCorrelateMany(*(CTFGrid*)grid, d_ps, h_params, (int)ncandidates, h_scores);
+}
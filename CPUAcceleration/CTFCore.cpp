@@ -0,0 +1,685 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+Batched CTF evaluation. A CTFGrid keeps what only depends on the coordinates: the squared radius, and the
+cosine and sine of twice the angle, which turn astigmatism and pixel size anisotropy into multiply-adds.
+Parameter sets are evaluated CTFLanes at a time, one per vector lane, on every pixel loaded from the grid.
+Amplitude contrast is folded into the phase, A cos(x) - sqrt(1 - A^2) sin(x) = cos(x + acos(A)), which
+leaves one cos and one exp per pixel and parameter set. The exp is evaluated even without a B-factor,
+so every lane runs the same code.
+
+*/
+
+namespace
+{
+    const int CTFLanes = 8;
+    const uint CTFBlock = 64;       // Pixels evaluated into a buffer before they are consumed
+    const uint CTFChunk = 2048;     // Pixels per task, all parameter sets are evaluated on them while they're in cache
+
+    struct CTFLaneParams
+    {
+        float ny2[CTFLanes];
+        float pixelsize[CTFLanes], pixelcos[CTFLanes], pixelsin[CTFLanes];
+        float defocus[CTFLanes], defocuscos[CTFLanes], defocussin[CTFLanes];
+        float astigmatismcos[CTFLanes], astigmatismsin[CTFLanes];
+        float K1[CTFLanes], K2[CTFLanes];
+        float phase[CTFLanes];
+        float Bfactor[CTFLanes];
+        float scale[CTFLanes];
+    };
+
+    // Lanes past the last parameter set repeat it
+    CTFLaneParams MakeLaneParams(const CTFParams* h_params, int first, int n)
+    {
+        CTFLaneParams lanes;
+
+        for (int l = 0; l < CTFLanes; l++)
+        {
+            CTFParamsLean p(h_params[tmin(first + l, n - 1)], toInt3(1, 1, 1));
+
+            lanes.ny2[l] = p.ny * p.ny;
+            lanes.pixelsize[l] = p.pixelsize;
+            lanes.pixelcos[l] = p.pixeldelta * cos(2.0f * p.pixelangle);
+            lanes.pixelsin[l] = p.pixeldelta * sin(2.0f * p.pixelangle);
+            lanes.defocus[l] = p.defocus;
+            lanes.astigmatismcos[l] = cos(2.0f * p.astigmatismangle);
+            lanes.astigmatismsin[l] = sin(2.0f * p.astigmatismangle);
+            lanes.defocuscos[l] = p.defocusdelta * lanes.astigmatismcos[l];
+            lanes.defocussin[l] = p.defocusdelta * lanes.astigmatismsin[l];
+            lanes.K1[l] = p.K1;
+            lanes.K2[l] = p.K2;
+            lanes.phase[l] = p.phaseshift - acos(tmax(-1.0f, tmin(1.0f, p.amplitude)));
+            lanes.Bfactor[l] = p.Bfactor;
+            lanes.scale[l] = p.scale;
+        }
+
+        return lanes;
+    }
+
+    std::vector<CTFLaneParams> MakeLaneGroups(const CTFParams* h_params, int n)
+    {
+        std::vector<CTFLaneParams> groups((n + CTFLanes - 1) / CTFLanes);
+        for (int g = 0; g < (int)groups.size(); g++)
+            groups[g] = MakeLaneParams(h_params, g * CTFLanes, n);
+
+        return groups;
+    }
+
+    // Values of all lanes for pixels [first, first + n), pixel-major
+    template <bool AmplitudeSquared> void EvaluateBlock(const CTFGrid &grid, const CTFLaneParams &p, uint first, uint n, float* h_values)
+    {
+        for (uint i = 0; i < n; i++)
+        {
+            float r2 = grid.h_r2[first + i], c = grid.h_cos2[first + i], s = grid.h_sin2[first + i];
+            float pixel[CTFLanes];
+
+            for (int l = 0; l < CTFLanes; l++)
+            {
+                float pixelsize = p.pixelsize[l] + p.pixelcos[l] * c + p.pixelsin[l] * s;
+                float k2 = r2 * p.ny2[l] / (pixelsize * pixelsize);
+                float deltaf = p.defocus[l] + p.defocuscos[l] * c + p.defocussin[l] * s;
+                float value = cos(p.K1[l] * deltaf * k2 + p.K2[l] * k2 * k2 - p.phase[l]) * exp(p.Bfactor[l] * k2);
+
+                if (AmplitudeSquared)
+                    value = abs(value);
+
+                pixel[l] = p.scale[l] * value;
+            }
+
+            memcpy(h_values + i * CTFLanes, pixel, sizeof(pixel));
+        }
+    }
+
+    void EvaluateBlock(const CTFGrid &grid, const CTFLaneParams &p, bool amplitudesquared, uint first, uint n, float* h_values)
+    {
+        if (amplitudesquared)
+            EvaluateBlock<true>(grid, p, first, n, h_values);
+        else
+            EvaluateBlock<false>(grid, p, first, n, h_values);
+    }
+
+    /*
+
+    |CTF| and its derivatives with respect to the lean parameters for defocus, defocus delta, astigmatism
+    angle, phase shift and B-factor, for pixels [first, first + n): CTF_GRADIENT_PARAMS + 1 values per pixel
+    and lane, value first, each group of CTFLanes contiguous. With phi the argument of the cos and e the
+    envelope, every derivative but the B-factor's is d|CTF|/dphi = -sgn(CTF) * scale * sin(phi) * e times
+    dphi/dparameter.
+
+    */
+
+    void EvaluateGradientBlock(const CTFGrid &grid, const CTFLaneParams &p, uint first, uint n, float* h_values)
+    {
+        for (uint i = 0; i < n; i++)
+        {
+            float r2 = grid.h_r2[first + i], c = grid.h_cos2[first + i], s = grid.h_sin2[first + i];
+            float pixel[CTF_GRADIENT_PARAMS + 1][CTFLanes];
+
+            for (int l = 0; l < CTFLanes; l++)
+            {
+                float pixelsize = p.pixelsize[l] + p.pixelcos[l] * c + p.pixelsin[l] * s;
+                float k2 = r2 * p.ny2[l] / (pixelsize * pixelsize);
+                float deltaf = p.defocus[l] + p.defocuscos[l] * c + p.defocussin[l] * s;
+                float phi = p.K1[l] * deltaf * k2 + p.K2[l] * k2 * k2 - p.phase[l];
+                float envelope = exp(p.Bfactor[l] * k2);
+
+                float value = cos(phi) * envelope;
+                float sign = value < 0 ? -p.scale[l] : p.scale[l];
+                float dphi = -sign * sin(phi) * envelope;       // d|CTF|/dphi
+                float ddefocus = dphi * p.K1[l] * k2;
+
+                pixel[0][l] = abs(value) * p.scale[l];
+                pixel[1][l] = ddefocus;
+                pixel[2][l] = ddefocus * (c * p.astigmatismcos[l] + s * p.astigmatismsin[l]);
+                pixel[3][l] = ddefocus * 2.0f * (s * p.defocuscos[l] - c * p.defocussin[l]);
+                pixel[4][l] = -dphi;
+                pixel[5][l] = pixel[0][l] * k2;
+            }
+
+            memcpy(h_values + i * (CTF_GRADIENT_PARAMS + 1) * CTFLanes, pixel, sizeof(pixel));
+        }
+    }
+
+    inline float ToFloat(float v)
+    {
+        return v;
+    }
+
+    inline float ToFloat(half v)
+    {
+        return __half2float(v);
+    }
+
+    template <class T> void MomentsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const T* h_target, size_t targetstride, const T* h_scale, bool amplitudesquared, double* h_moments)
+    {
+        std::vector<CTFLaneParams> groups = MakeLaneGroups(h_params, n);
+        int ngroups = (int)groups.size();
+        long long nchunks = (grid.length + CTFChunk - 1) / CTFChunk;
+
+        // Partial sums per chunk, reduced in a fixed order so the result doesn't depend on the thread count
+        std::vector<double> partial((size_t)nchunks * ngroups * CTFLanes * 3);
+
+        #pragma omp parallel
+        {
+            std::vector<float> values(CTFBlock * CTFLanes), scale(CTFBlock), target(CTFBlock * CTFLanes);
+
+            #pragma omp for schedule(dynamic)
+            for (long long c = 0; c < nchunks; c++)
+            {
+                uint chunkfirst = (uint)c * CTFChunk, chunklast = tmin(grid.length, chunkfirst + CTFChunk);
+
+                for (int g = 0; g < ngroups; g++)
+                {
+                    float sum1[CTFLanes] = { 0 }, sum2[CTFLanes] = { 0 }, sumcross[CTFLanes] = { 0 };
+
+                    for (uint first = chunkfirst; first < chunklast; first += CTFBlock)
+                    {
+                        uint nblock = tmin(CTFBlock, chunklast - first);
+                        EvaluateBlock(grid, groups[g], amplitudesquared, first, nblock, values.data());
+
+                        for (uint i = 0; i < nblock; i++)
+                            scale[i] = h_scale != NULL ? ToFloat(h_scale[first + i]) : 1.0f;
+
+                        for (int l = 0; l < CTFLanes; l++)
+                        {
+                            const T* h_lanetarget = h_target + (size_t)tmin(g * CTFLanes + l, n - 1) * targetstride + first;
+                            for (uint i = 0; i < nblock; i++)
+                                target[i * CTFLanes + l] = ToFloat(h_lanetarget[i]);
+                        }
+
+                        for (uint i = 0; i < nblock; i++)
+                            for (int l = 0; l < CTFLanes; l++)
+                            {
+                                float sim = values[i * CTFLanes + l] * scale[i];
+                                sum1[l] += sim;
+                                sum2[l] += sim * sim;
+                                sumcross[l] += sim * target[i * CTFLanes + l];
+                            }
+                    }
+
+                    double* h_partial = partial.data() + ((size_t)c * ngroups + g) * CTFLanes * 3;
+                    for (int l = 0; l < CTFLanes; l++)
+                    {
+                        h_partial[l * 3 + 0] = sum1[l];
+                        h_partial[l * 3 + 1] = sum2[l];
+                        h_partial[l * 3 + 2] = sumcross[l];
+                    }
+                }
+            }
+        }
+
+        for (int i = 0; i < n; i++)
+            for (int m = 0; m < 3; m++)
+            {
+                double sum = 0;
+                for (long long c = 0; c < nchunks; c++)
+                    sum += partial[((size_t)c * ngroups + i / CTFLanes) * CTFLanes * 3 + (i % CTFLanes) * 3 + m];
+
+                h_moments[i * 3 + m] = sum;
+            }
+    }
+
+    // Lean parameters to CTFParams units for the gradient's components, see CTFParamsLean
+    const double GradientUnits[CTF_GRADIENT_PARAMS] = { 1e10, 0.5e10, 1.0, 1.0, 0.25e20 };
+
+    void MomentsGradientsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const half* h_target, size_t targetstride, const half* h_scale, double* h_moments, double* h_gradients)
+    {
+        const int NValues = CTF_GRADIENT_PARAMS + 1;
+        const int NSums = 3 * NValues;     // sum(sim), sum(sim^2), sum(sim * target), then their derivatives
+
+        std::vector<CTFLaneParams> groups = MakeLaneGroups(h_params, n);
+        int ngroups = (int)groups.size();
+        long long nchunks = (grid.length + CTFChunk - 1) / CTFChunk;
+
+        std::vector<double> partial((size_t)nchunks * ngroups * CTFLanes * NSums);
+
+        #pragma omp parallel
+        {
+            std::vector<float> values(CTFBlock * NValues * CTFLanes), scale(CTFBlock), target(CTFBlock * CTFLanes);
+
+            #pragma omp for schedule(dynamic)
+            for (long long c = 0; c < nchunks; c++)
+            {
+                uint chunkfirst = (uint)c * CTFChunk, chunklast = tmin(grid.length, chunkfirst + CTFChunk);
+
+                for (int g = 0; g < ngroups; g++)
+                {
+                    float sums[NSums][CTFLanes] = { { 0 } };
+
+                    for (uint first = chunkfirst; first < chunklast; first += CTFBlock)
+                    {
+                        uint nblock = tmin(CTFBlock, chunklast - first);
+                        EvaluateGradientBlock(grid, groups[g], first, nblock, values.data());
+
+                        for (uint i = 0; i < nblock; i++)
+                            scale[i] = h_scale != NULL ? __half2float(h_scale[first + i]) : 1.0f;
+
+                        for (int l = 0; l < CTFLanes; l++)
+                        {
+                            const half* h_lanetarget = h_target + (size_t)tmin(g * CTFLanes + l, n - 1) * targetstride + first;
+                            for (uint i = 0; i < nblock; i++)
+                                target[i * CTFLanes + l] = __half2float(h_lanetarget[i]);
+                        }
+
+                        for (uint i = 0; i < nblock; i++)
+                        {
+                            const float* h_pixel = values.data() + i * NValues * CTFLanes;
+
+                            for (int l = 0; l < CTFLanes; l++)
+                            {
+                                float sim = h_pixel[l] * scale[i];
+                                float t = target[i * CTFLanes + l];
+
+                                sums[0][l] += sim;
+                                sums[1][l] += sim * sim;
+                                sums[2][l] += sim * t;
+                            }
+
+                            for (int v = 1; v < NValues; v++)
+                                for (int l = 0; l < CTFLanes; l++)
+                                {
+                                    float sim = h_pixel[l] * scale[i];
+                                    float dsim = h_pixel[v * CTFLanes + l] * scale[i];
+
+                                    sums[v * 3 + 0][l] += dsim;
+                                    sums[v * 3 + 1][l] += 2.0f * sim * dsim;
+                                    sums[v * 3 + 2][l] += dsim * target[i * CTFLanes + l];
+                                }
+                        }
+                    }
+
+                    double* h_partial = partial.data() + ((size_t)c * ngroups + g) * CTFLanes * NSums;
+                    for (int l = 0; l < CTFLanes; l++)
+                        for (int m = 0; m < NSums; m++)
+                            h_partial[l * NSums + m] = sums[m][l];
+                }
+            }
+        }
+
+        for (int i = 0; i < n; i++)
+            for (int m = 0; m < NSums; m++)
+            {
+                double sum = 0;
+                for (long long c = 0; c < nchunks; c++)
+                    sum += partial[((size_t)c * ngroups + i / CTFLanes) * CTFLanes * NSums + (i % CTFLanes) * NSums + m];
+
+                if (m < 3)
+                    h_moments[i * 3 + m] = sum;
+                else
+                    h_gradients[(size_t)i * 3 * CTF_GRADIENT_PARAMS + (m / 3 - 1) * 3 + m % 3] = sum * GradientUnits[m / 3 - 1];
+            }
+    }
+}
+
+void gtom::h_CTFCreateGrid(const float2* h_coords, uint length, CTFGrid* grid)
+{
+    grid->length = length;
+    grid->h_r2 = (float*)MallocAligned(length * sizeof(float));
+    grid->h_cos2 = (float*)MallocAligned(length * sizeof(float));
+    grid->h_sin2 = (float*)MallocAligned(length * sizeof(float));
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)length; i++)
+    {
+        float2 coords = h_coords[i];
+        grid->h_r2[i] = coords.x * coords.x;
+        grid->h_cos2[i] = cos(2.0f * coords.y);
+        grid->h_sin2[i] = sin(2.0f * coords.y);
+    }
+}
+
+void gtom::h_CTFFreeGrid(CTFGrid* grid)
+{
+    FreeAligned(grid->h_r2);
+    FreeAligned(grid->h_cos2);
+    FreeAligned(grid->h_sin2);
+}
+
+void gtom::h_CTFSimulateMany(const CTFGrid &grid, const CTFParams* h_params, int n, bool amplitudesquared, float* h_output)
+{
+    std::vector<CTFLaneParams> groups = MakeLaneGroups(h_params, n);
+    long long nchunks = (grid.length + CTFChunk - 1) / CTFChunk;
+
+    #pragma omp parallel
+    {
+        std::vector<float> values(CTFBlock * CTFLanes);
+
+        #pragma omp for schedule(dynamic)
+        for (long long c = 0; c < nchunks; c++)
+        {
+            uint chunkfirst = (uint)c * CTFChunk, chunklast = tmin(grid.length, chunkfirst + CTFChunk);
+
+            for (int g = 0; g < (int)groups.size(); g++)
+            {
+                int nlanes = tmin(CTFLanes, n - g * CTFLanes);
+
+                for (uint first = chunkfirst; first < chunklast; first += CTFBlock)
+                {
+                    uint nblock = tmin(CTFBlock, chunklast - first);
+                    EvaluateBlock(grid, groups[g], amplitudesquared, first, nblock, values.data());
+
+                    for (int l = 0; l < nlanes; l++)
+                    {
+                        float* h_laneoutput = h_output + (size_t)(g * CTFLanes + l) * grid.length + first;
+                        for (uint i = 0; i < nblock; i++)
+                            h_laneoutput[i] = values[i * CTFLanes + l];
+                    }
+                }
+            }
+        }
+    }
+}
+
+void gtom::h_CTFMomentsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const float* h_target, size_t targetstride, const float* h_scale, bool amplitudesquared, double* h_moments)
+{
+    MomentsMany(grid, h_params, n, h_target, targetstride, h_scale, amplitudesquared, h_moments);
+}
+
+void gtom::h_CTFMomentsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const half* h_target, size_t targetstride, const half* h_scale, bool amplitudesquared, double* h_moments)
+{
+    MomentsMany(grid, h_params, n, h_target, targetstride, h_scale, amplitudesquared, h_moments);
+}
+
+void gtom::h_CTFMomentsGradientsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const half* h_target, size_t targetstride, const half* h_scale, double* h_moments, double* h_gradients)
+{
+    MomentsGradientsMany(grid, h_params, n, h_target, targetstride, h_scale, h_moments, h_gradients);
+}
+
+void gtom::h_CTFCorrelateMany(const CTFGrid &grid, const float* h_ps, const CTFParams* h_params, int n, float* h_scores)
+{
+    std::vector<double> moments((size_t)n * 3);
+    h_CTFMomentsMany(grid, h_params, n, h_ps, 0, (const float*)NULL, true, moments.data());
+
+    double sumps = 0, sumps2 = 0;
+
+    #pragma omp parallel for reduction(+:sumps, sumps2)
+    for (long long i = 0; i < (long long)grid.length; i++)
+    {
+        float ps = h_ps[i];
+        sumps += ps;
+        sumps2 += (double)ps * ps;
+    }
+
+    double length = (double)grid.length;
+    double stdps = sqrt(tmax(0.0, sumps2 / length - (sumps / length) * (sumps / length)));
+
+    for (int i = 0; i < n; i++)
+    {
+        double sum1 = moments[i * 3 + 0], sum2 = moments[i * 3 + 1], sumcross = moments[i * 3 + 2];
+
+        double covariance = sumcross / length - (sum1 / length) * (sumps / length);
+        double stdsim = sqrt(tmax(0.0, sum2 / length - (sum1 / length) * (sum1 / length)));
+
+        h_scores[i] = stdsim > 0 && stdps > 0 ? (float)(covariance / (stdsim * stdps)) : 0.0f;
+    }
+}
+
+void gtom::h_CTFSimulate(CTFParams* h_params, float2* h_coords, float* h_output, uint length, bool amplitudesquared, int batch)
+{
+    CTFGrid grid;
+    h_CTFCreateGrid(h_coords, length, &grid);
+
+    h_CTFSimulateMany(grid, h_params, batch, amplitudesquared, h_output);
+
+    h_CTFFreeGrid(&grid);
+}
+
+void gtom::h_CTFPeriodogram(float* h_image, int2 dimsimage, int3* h_origins, int norigins, int2 dimsregion, float* h_output)
+{
+    float* h_extracts = (float*)MallocAligned(Elements2(dimsregion) * norigins * sizeof(float));
+    float2* h_extractsft = (float2*)MallocAligned(ElementsFFT2(dimsregion) * norigins * sizeof(float2));
+
+    h_ExtractMany(h_image, h_extracts, toInt3(dimsimage), toInt3(dimsregion), h_origins, norigins);
+    h_NormMonolithic(h_extracts, h_extracts, Elements2(dimsregion), norigins);
+    h_FFTR2C(h_extracts, h_extractsft, 2, toInt3(dimsregion), norigins);
+
+    float norm = 1.0f / (float)Elements2(dimsregion);
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)ElementsFFT2(dimsregion) * norigins; i++)
+        h_output[i] = dotp2(h_extractsft[i], h_extractsft[i]) * norm;
+
+    FreeAligned(h_extractsft);
+    FreeAligned(h_extracts);
+}
+
+namespace
+{
+    inline float SpectrumValue(float v)
+    {
+        return v;
+    }
+
+    // Complex spectra are averaged by amplitude
+    inline float SpectrumValue(float2 v)
+    {
+        return sqrt(dotp2(v, v));
+    }
+}
+
+/*
+
+Each pixel's source CTF phase is matched to the radius at which the target CTF has the
+same phase, then accumulated into 1D bins with linear interpolation between neighbors.
+Coordinates are (r in pixels, angle), sidelength converts them to cycles per pixel.
+
+*/
+
+template <class T> static void RotationalAverageToTarget(T* h_input, float2* h_coords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, float* h_average, uint minbin, uint maxbin, int* h_consider, int batch)
+{
+    int nbins = (int)(maxbin - minbin);
+    CTFParamsLean target(targetparams, toInt3(sidelength, 1, 1));
+
+    std::vector<double> sums((size_t)nbins, 0.0), weights((size_t)nbins, 0.0);
+
+    for (int b = 0; b < batch; b++)
+    {
+        if (h_consider != NULL && h_consider[b] == 0)
+            continue;
+
+        CTFParamsLean source(h_sourceparams[b], toInt3(sidelength, 1, 1));
+        T* h_batchinput = h_input + (size_t)length * b;
+
+        #pragma omp parallel
+        {
+            std::vector<double> localsums((size_t)nbins, 0.0), localweights((size_t)nbins, 0.0);
+
+            #pragma omp for
+            for (long long i = 0; i < (long long)length; i++)
+            {
+                float2 coords = h_coords[i];
+                float angle = coords.y;
+
+                float k = h_CTFFrequency(coords, source);
+                float k2 = k * k;
+                float deltafsource = source.defocus + source.defocusdelta * cos(2.0f * (angle - source.astigmatismangle));
+                float argument = source.K1 * deltafsource * k2 + source.K2 * k2 * k2 - source.phaseshift + target.phaseshift;
+
+                // Solve K2 * q^2 + K1 * deltaf * q - argument = 0 for q = k^2 at the target
+                float deltaftarget = target.defocus + target.defocusdelta * cos(2.0f * (angle - target.astigmatismangle));
+                float a = target.K2, bq = target.K1 * deltaftarget;
+                float q;
+                if (abs(a) < 1e-20f)
+                    q = bq != 0.0f ? argument / bq : k2;
+                else
+                {
+                    float discriminant = bq * bq + 4.0f * a * argument;
+                    if (discriminant < 0)
+                        continue;
+                    q = (-bq + sqrt(discriminant)) / (2.0f * a);
+                }
+                if (q < 0)
+                    continue;
+
+                float pixelsizetarget = target.pixelsize + target.pixeldelta * cos(2.0f * (angle - target.pixelangle));
+                float r = sqrt(q) * pixelsizetarget * (float)sidelength - (float)minbin;
+
+                int r0 = (int)floor(r);
+                float fr = r - r0;
+                float val = SpectrumValue(h_batchinput[i]);
+
+                if (r0 >= 0 && r0 < nbins)
+                {
+                    localsums[r0] += val * (1 - fr);
+                    localweights[r0] += 1 - fr;
+                }
+                if (r0 + 1 >= 0 && r0 + 1 < nbins)
+                {
+                    localsums[r0 + 1] += val * fr;
+                    localweights[r0 + 1] += fr;
+                }
+            }
+
+            #pragma omp critical
+            for (int n = 0; n < nbins; n++)
+            {
+                sums[n] += localsums[n];
+                weights[n] += localweights[n];
+            }
+        }
+    }
+
+    for (int n = 0; n < nbins; n++)
+        h_average[n] = weights[n] > 0 ? (float)(sums[n] / weights[n]) : 0.0f;
+}
+
+void gtom::h_CTFRotationalAverageToTarget(float* h_input, float2* h_coords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, float* h_average, uint minbin, uint maxbin, int* h_consider, int batch)
+{
+    RotationalAverageToTarget(h_input, h_coords, length, sidelength, h_sourceparams, targetparams, h_average, minbin, maxbin, h_consider, batch);
+}
+
+void gtom::h_CTFRotationalAverageToTarget(float2* h_input, float2* h_coords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, float* h_average, uint minbin, uint maxbin, int* h_consider, int batch)
+{
+    RotationalAverageToTarget(h_input, h_coords, length, sidelength, h_sourceparams, targetparams, h_average, minbin, maxbin, h_consider, batch);
+}
+
+float gtom::h_CTFCorrelate(float* h_ps, float2* h_coords, uint length, CTFParams params)
+{
+    CTFGrid grid;
+    h_CTFCreateGrid(h_coords, length, &grid);
+
+    float score;
+    h_CTFCorrelateMany(grid, h_ps, &params, 1, &score);
+
+    h_CTFFreeGrid(&grid);
+
+    return score;
+}
+
+#define CTF_FIT_BATCH 256
+
+/*
+
+Exhaustive search over all parameters with a non-zero step in fp, followed by coordinate-wise
+refinement with successively halved steps. Returns the offset relative to startparams, like GTOM.
+Candidates are scored in batches on one coordinate grid; within a batch, the first of equal scores
+wins, so the result is the same as scoring them one by one.
+
+*/
+
+CTFParams gtom::h_CTFFit(float* h_ps, float2* h_pscoords, int2 dims, CTFParams startparams, CTFFitParams fp, float &score)
+{
+    uint length = (uint)Elements2(dims);
+    tfloat3* ranges = (tfloat3*)&fp;
+
+    std::vector<int> varying;
+    for (int p = 0; p < 12; p++)
+        if (ranges[p].z != 0 && ranges[p].y > ranges[p].x)
+            varying.push_back(p);
+
+    CTFParams bestdelta;
+    memset(&bestdelta, 0, sizeof(CTFParams));
+    float bestscore = -1e30f;
+
+    CTFGrid grid;
+    h_CTFCreateGrid(h_pscoords, length, &grid);
+
+    std::vector<CTFParams> candidates, deltas;
+    std::vector<float> scores;
+
+    // Scores the queued deltas and updates the best with each improvement, or only with the first one
+    auto EvaluateQueued = [&](bool firstonly)
+    {
+        candidates.resize(deltas.size());
+        scores.resize(deltas.size());
+        for (size_t c = 0; c < deltas.size(); c++)
+        {
+            candidates[c] = startparams;
+            for (int p = 0; p < 12; p++)
+                ((tfloat*)&candidates[c])[p] += ((tfloat*)&deltas[c])[p];
+        }
+
+        h_CTFCorrelateMany(grid, h_ps, candidates.data(), (int)candidates.size(), scores.data());
+
+        for (size_t c = 0; c < deltas.size(); c++)
+            if (scores[c] > bestscore)
+            {
+                bestscore = scores[c];
+                bestdelta = deltas[c];
+
+                if (firstonly)
+                    break;
+            }
+
+        deltas.clear();
+    };
+
+    // Grid search
+    {
+        std::vector<int> nsteps(varying.size());
+        size_t combinations = 1;
+        for (size_t v = 0; v < varying.size(); v++)
+        {
+            tfloat3 range = ranges[varying[v]];
+            nsteps[v] = tmax(1, (int)((range.y - range.x) / range.z + 1e-4f) + 1);
+            combinations *= nsteps[v];
+        }
+
+        for (size_t c = 0; c < combinations; c++)
+        {
+            CTFParams delta;
+            memset(&delta, 0, sizeof(CTFParams));
+
+            size_t index = c;
+            for (size_t v = 0; v < varying.size(); v++)
+            {
+                tfloat3 range = ranges[varying[v]];
+                ((tfloat*)&delta)[varying[v]] = range.x + range.z * (float)(index % nsteps[v]);
+                index /= nsteps[v];
+            }
+
+            deltas.push_back(delta);
+            if (deltas.size() == CTF_FIT_BATCH || c == combinations - 1)
+                EvaluateQueued(false);
+        }
+    }
+
+    // Local refinement. Scored one by one, a step in the second direction would start from the first
+    // one's result if that improved, and go back to where it came from, so both can be scored together.
+    for (int iter = 0; iter < 4; iter++)
+    {
+        float stepscale = 0.5f / (float)(1 << iter);
+
+        for (size_t v = 0; v < varying.size(); v++)
+        {
+            int p = varying[v];
+            float step = ranges[p].z * stepscale;
+
+            for (int direction = -1; direction <= 1; direction += 2)
+            {
+                CTFParams delta = bestdelta;
+                ((tfloat*)&delta)[p] += step * direction;
+                deltas.push_back(delta);
+            }
+
+            EvaluateQueued(true);
+        }
+    }
+
+    h_CTFFreeGrid(&grid);
+
+    score = bestscore;
+    return bestdelta;
+}
@@ -0,0 +1,42 @@
+#include "Functions.h"
+using namespace gtom;
+
+__declspec(dllexport) void CompareParticles(float* d_particles,
+                                            float* d_masks,
+                                            float* d_projections,
+                                            int2 dims,
+                                            float2* d_ctfcoords,
+                                            CTFParams* h_ctfparams,
+                                            float highpass,
+                                            float lowpass,
+                                            float* d_scores,
+                                            uint nparticles)
+{
+    size_t elements = Elements2(dims);
+
+    float* h_ctf = (float*)MallocAligned(ElementsFFT2(dims) * nparticles * sizeof(float));
+    h_CTFSimulate(h_ctfparams, d_ctfcoords, h_ctf, (uint)ElementsFFT2(dims), false, nparticles);
+
+    h_Bandpass(d_particles, d_particles, toInt3(dims), highpass, lowpass, 1.0f, nparticles);
+    h_NormMonolithic(d_particles, d_particles, elements, d_masks, nparticles);
+    h_MultiplyByVector(d_particles, d_masks, d_particles, elements * nparticles);
+    h_NormMonolithic(d_particles, d_particles, elements, nparticles);
+
+    float2* h_projectionsft = (float2*)MallocAligned(ElementsFFT2(dims) * nparticles * sizeof(float2));
+    h_FFTR2C(d_projections, h_projectionsft, 2, toInt3(dims), nparticles);
+    h_MultiplyByVector(h_projectionsft, h_ctf, h_projectionsft, ElementsFFT2(dims) * nparticles);
+    h_IFFTC2R(h_projectionsft, d_projections, 2, toInt3(dims), nparticles);
+
+    h_RemapFullFFT2Full(d_projections, d_projections, toInt3(dims), nparticles);
+    h_Bandpass(d_projections, d_projections, toInt3(dims), highpass, lowpass, 1.0f, nparticles);
+    h_NormMonolithic(d_projections, d_projections, elements, d_masks, nparticles);
+    h_MultiplyByVector(d_projections, d_masks, d_projections, elements * nparticles);
+    h_NormMonolithic(d_projections, d_projections, elements, nparticles);
+
+    h_MultiplyByVector(d_particles, d_projections, d_projections, elements * nparticles);
+    h_SumMonolithic(d_projections, d_scores, elements, nparticles);
+    h_MultiplyByScalar(d_scores, d_scores, nparticles, 1.0f / elements);
+
+    FreeAligned(h_projectionsft);
+    FreeAligned(h_ctf);
+}
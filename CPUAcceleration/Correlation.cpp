@@ -0,0 +1,89 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+For every orientation, the reference is rotated out of the projector, multiplied by each volume's
+CTF, masked and normalized in real space, and cross-correlated with the experimental volume. The
+best correlation and the orientation that produced it are kept per voxel.
+
+*/
+
+__declspec(dllexport) void __stdcall CorrelateSubTomos(float2* d_projectordata,
+                                                        float projectoroversample,
+                                                        int3 dimsprojector,
+                                                        float2* d_experimentalft,
+                                                        float* d_ctf,
+                                                        int3 dimsvolume,
+                                                        uint nvolumes,
+                                                        float3* h_angles,
+                                                        uint nangles,
+                                                        float maskradius,
+                                                        float* d_bestcorrelation,
+                                                        float* d_bestrot,
+                                                        float* d_besttilt,
+                                                        float* d_bestpsi)
+{
+    size_t elements = Elements(dimsvolume);
+    size_t elementsft = ElementsFFT(dimsvolume);
+
+    float2* h_rotated = (float2*)MallocAligned(elementsft * sizeof(float2));
+    float2* h_refft = (float2*)MallocAligned(elementsft * nvolumes * sizeof(float2));
+    float* h_ref = (float*)MallocAligned(elements * nvolumes * sizeof(float));
+    float* h_mask = MallocAlignedValueFilled(elements, 1.0f);
+
+    h_SphereMask(h_mask, h_mask, dimsvolume, maskradius, 0.0f, 1);
+    float masksum = 0;
+    for (size_t i = 0; i < elements; i++)
+        masksum += h_mask[i];
+    masksum = tmax(1.0f, masksum);
+
+    h_ValueFill(d_bestcorrelation, elements * nvolumes, -1e30f);
+    h_ValueFill(d_bestrot, elements * nvolumes, 0.0f);
+    h_ValueFill(d_besttilt, elements * nvolumes, 0.0f);
+    h_ValueFill(d_bestpsi, elements * nvolumes, 0.0f);
+
+    for (uint a = 0; a < nangles; a++)
+    {
+        h_rlnRotate(d_projectordata, dimsprojector, h_rotated, dimsvolume, h_angles[a], projectoroversample);
+
+        // Same reference, different CTF for each volume
+        for (uint v = 0; v < nvolumes; v++)
+            h_MultiplyByVector(h_rotated, d_ctf + elementsft * v, h_refft + elementsft * v, elementsft);
+
+        h_IFFTC2R(h_refft, h_ref, 3, dimsvolume, nvolumes);
+        h_RemapFullFFT2Full(h_ref, h_ref, dimsvolume, nvolumes);
+        for (uint v = 0; v < nvolumes; v++)
+            h_NormMonolithic(h_ref + elements * v, h_ref + elements * v, elements, h_mask, 1);
+        h_MultiplyByVector(h_ref, h_mask, h_ref, elements, nvolumes);
+        h_RemapFull2FullFFT(h_ref, h_ref, dimsvolume, nvolumes);
+        h_FFTR2C(h_ref, h_refft, 3, dimsvolume, nvolumes);
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elementsft * nvolumes; i++)
+            h_refft[i] = cmul(d_experimentalft[i], cconj(h_refft[i]));
+
+        h_IFFTC2R(h_refft, h_ref, 3, dimsvolume, nvolumes);
+        h_RemapFullFFT2Full(h_ref, h_ref, dimsvolume, nvolumes);
+
+        float3 angle = h_angles[a];
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * nvolumes; i++)
+        {
+            float correlation = h_ref[i] / masksum;
+            if (correlation > d_bestcorrelation[i])
+            {
+                d_bestcorrelation[i] = correlation;
+                d_bestrot[i] = angle.x;
+                d_besttilt[i] = angle.y;
+                d_bestpsi[i] = angle.z;
+            }
+        }
+    }
+
+    FreeAligned(h_mask);
+    FreeAligned(h_ref);
+    FreeAligned(h_refft);
+    FreeAligned(h_rotated);
+}
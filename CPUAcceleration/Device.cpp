@@ -0,0 +1,178 @@
+#include "Functions.h"
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+using namespace gtom;
+
+/*
+
+Each NUMA node of the host is one "device" on the CPU backend. SetDevice binds the calling thread to
+the node's processors, so the pages it first touches (including blocks the memory pool obtains for it,
+which are kept in per-device free lists) come from that node's memory. With a single node, threads
+aren't bound at all.
+
+*/
+
+namespace
+{
+    struct NumaNode
+    {
+        int nprocessors;
+#ifdef _MSC_VER
+        GROUP_AFFINITY affinity;
+#else
+        std::vector<int> processors;
+#endif
+    };
+
+    std::vector<NumaNode> DetectNumaNodes()
+    {
+        std::vector<NumaNode> nodes;
+
+#ifdef _MSC_VER
+        ULONG highest = 0;
+        if (GetNumaHighestNodeNumber(&highest))
+            for (USHORT n = 0; n <= (USHORT)highest; n++)
+            {
+                NumaNode node;
+                if (!GetNumaNodeProcessorMaskEx(n, &node.affinity))
+                    continue;
+
+                node.nprocessors = 0;
+                for (KAFFINITY mask = node.affinity.Mask; mask != 0; mask &= mask - 1)
+                    node.nprocessors++;
+
+                if (node.nprocessors > 0)    // Memory-only nodes can't run anything
+                    nodes.push_back(node);
+            }
+#else
+        for (int n = 0; ; n++)
+        {
+            char path[128];
+            sprintf(path, "/sys/devices/system/node/node%d/cpulist", n);
+            FILE* file = fopen(path, "r");
+            if (!file)
+                break;
+
+            // Ranges like "0-7,16-23"
+            NumaNode node;
+            int first, last;
+            while (fscanf(file, "%d", &first) == 1)
+            {
+                last = first;
+                int c = fgetc(file);
+                if (c == '-')
+                {
+                    if (fscanf(file, "%d", &last) != 1)
+                        break;
+                    c = fgetc(file);
+                }
+
+                for (int p = first; p <= last; p++)
+                    node.processors.push_back(p);
+
+                if (c != ',')
+                    break;
+            }
+            fclose(file);
+
+            node.nprocessors = (int)node.processors.size();
+            if (node.nprocessors > 0)
+                nodes.push_back(node);
+        }
+#endif
+
+        if (nodes.empty())
+        {
+            NumaNode node;
+            node.nprocessors = tmax(1, omp_get_num_procs());
+#ifdef _MSC_VER
+            memset(&node.affinity, 0, sizeof(node.affinity));
+#endif
+            nodes.push_back(node);
+        }
+
+        return nodes;
+    }
+
+    const std::vector<NumaNode> &NumaNodes()
+    {
+        static std::vector<NumaNode> nodes = DetectNumaNodes();
+        return nodes;
+    }
+
+    thread_local int CurrentNode = 0;
+    thread_local bool NodeBound = false;
+}
+
+__declspec(dllexport) int __stdcall GetDeviceCount()
+{
+    return (int)NumaNodes().size();
+}
+
+__declspec(dllexport) void __stdcall SetDevice(int device)
+{
+    const std::vector<NumaNode> &nodes = NumaNodes();
+    device = tmax(0, device) % (int)nodes.size();
+    if (nodes.size() < 2 || (NodeBound && device == CurrentNode))
+    {
+        CurrentNode = device;
+        return;
+    }
+
+    CurrentNode = device;
+    NodeBound = true;
+
+#ifdef _MSC_VER
+    SetThreadGroupAffinity(GetCurrentThread(), &nodes[device].affinity, NULL);
+#else
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int p : nodes[device].processors)
+        CPU_SET(p, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+__declspec(dllexport) int __stdcall GetDevice()
+{
+    return CurrentNode;
+}
+
+int GetDeviceProcessorCount(int device)
+{
+    const std::vector<NumaNode> &nodes = NumaNodes();
+    return nodes[tmax(0, device) % (int)nodes.size()].nprocessors;
+}
+
+__declspec(dllexport) long __stdcall GetFreeMemory(int device)
+{
+#ifdef _MSC_VER
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatusEx(&status);
+
+    return (long)(status.ullAvailPhys >> 20);
+#else
+    return (long)(((size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGE_SIZE)) >> 20);
+#endif
+}
+
+__declspec(dllexport) long __stdcall GetTotalMemory(int device)
+{
+#ifdef _MSC_VER
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    GlobalMemoryStatusEx(&status);
+
+    return (long)(status.ullTotalPhys >> 20);
+#else
+    return (long)(((size_t)sysconf(_SC_PHYS_PAGES) * (size_t)sysconf(_SC_PAGE_SIZE)) >> 20);
+#endif
+}
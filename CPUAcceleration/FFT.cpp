@@ -0,0 +1,159 @@
+#include "Functions.h"
+#include <fftw3.h>
+#include <mutex>
+using namespace gtom;
+
+/*
+
+FFTW-backed transforms with the same layout and normalization as GTOM's cuFFT wrappers:
+R2C produces (x/2+1)*y*z unnormalized coefficients, C2R divides by the number of real elements.
+Batches are distributed over OpenMP threads with the new-array execute interface, which is
+thread-safe; single large transforms use FFTW's own threads instead.
+Plans come from the cache in FFTPlanCache.cpp, so only the first transform of a shape pays for planning.
+
+*/
+
+namespace
+{
+    std::mutex g_handlesmutex;
+    std::vector<void*> g_handles;    // Plans handed out by index through CreateFFTPlan
+    std::vector<int> g_freehandles;  // Slots in g_handles released by h_FFTDestroyPlan, reused before growing it
+
+    size_t ElementsReal(int ndims, int3 dims)
+    {
+        return (size_t)dims.x * (ndims > 1 ? dims.y : 1) * (ndims > 2 ? dims.z : 1);
+    }
+
+    size_t ElementsComplex(int ndims, int3 dims)
+    {
+        return (size_t)(dims.x / 2 + 1) * (ndims > 1 ? dims.y : 1) * (ndims > 2 ? dims.z : 1);
+    }
+
+    int PlanThreads(size_t elements, int batch)
+    {
+        // Small transforms are parallelized over the batch instead, and callers that are already
+        // running in parallel (e.g. one patch per thread) would only be oversubscribed
+        return (batch > 1 || elements < (1 << 18) || omp_in_parallel()) ? 1 : omp_get_max_threads();
+    }
+
+    // Plans are cached per shape, see FFTPlanCache.cpp; batch only matters through the thread count
+    fftwf_plan AcquirePlan(int ndims, int3 dims, bool forward, int batch)
+    {
+        return (fftwf_plan)AcquireFFTPlan(forward ? FFTPLAN_R2C : FFTPLAN_C2R, ndims, dims, 1, PlanThreads(ElementsReal(ndims, dims), batch));
+    }
+
+    int AddHandle(fftwf_plan plan)
+    {
+        std::lock_guard<std::mutex> lock(g_handlesmutex);
+        if (!g_freehandles.empty())
+        {
+            int slot = g_freehandles.back();
+            g_freehandles.pop_back();
+            g_handles[slot] = (void*)plan;
+
+            return slot + 1;
+        }
+
+        g_handles.push_back((void*)plan);
+
+        return (int)g_handles.size();
+    }
+}
+
+void gtom::h_FFTR2C(float* h_input, float2* h_output, int ndims, int3 dims, int batch)
+{
+    size_t elementsreal = ElementsReal(ndims, dims);
+    size_t elementscomplex = ElementsComplex(ndims, dims);
+
+    // Plans are out-of-place, copy the input away if it's going to be overwritten
+    float* h_source = h_input;
+    if ((void*)h_input == (void*)h_output)
+        h_source = MallocAlignedFromHostArray(h_input, elementsreal * batch);
+
+    fftwf_plan plan = AcquirePlan(ndims, dims, true, batch);
+
+    #pragma omp parallel for if(batch > 1)
+    for (int b = 0; b < batch; b++)
+        fftwf_execute_dft_r2c(plan, h_source + elementsreal * b, (fftwf_complex*)(h_output + elementscomplex * b));
+
+    ReleaseFFTPlan((size_t)plan);
+
+    if (h_source != h_input)
+        FreeAligned(h_source);
+}
+
+void gtom::h_IFFTC2R(float2* h_input, float* h_output, int ndims, int3 dims, int batch)
+{
+    size_t elementsreal = ElementsReal(ndims, dims);
+    size_t elementscomplex = ElementsComplex(ndims, dims);
+
+    // C2R destroys its input, which the caller still owns
+    float2* h_source = MallocAlignedFromHostArray(h_input, elementscomplex * batch);
+
+    fftwf_plan plan = AcquirePlan(ndims, dims, false, batch);
+
+    #pragma omp parallel for if(batch > 1)
+    for (int b = 0; b < batch; b++)
+        fftwf_execute_dft_c2r(plan, (fftwf_complex*)(h_source + elementscomplex * b), h_output + elementsreal * b);
+
+    ReleaseFFTPlan((size_t)plan);
+    FreeAligned(h_source);
+
+    h_MultiplyByScalar(h_output, h_output, elementsreal * batch, 1.0f / (float)elementsreal);
+}
+
+int gtom::h_FFTR2CGetPlan(int ndims, int3 dims, int batch)
+{
+    return AddHandle(AcquirePlan(ndims, dims, true, batch));
+}
+
+int gtom::h_IFFTC2RGetPlan(int ndims, int3 dims, int batch)
+{
+    return AddHandle(AcquirePlan(ndims, dims, false, batch));
+}
+
+void gtom::h_FFTDestroyPlan(int plan)
+{
+    void* torelease = NULL;
+    {
+        std::lock_guard<std::mutex> lock(g_handlesmutex);
+        if (plan < 1 || plan > (int)g_handles.size() || g_handles[plan - 1] == NULL)
+            return;
+
+        torelease = g_handles[plan - 1];
+        g_handles[plan - 1] = NULL;
+        g_freehandles.push_back(plan - 1);
+    }
+
+    ReleaseFFTPlan((size_t)torelease);
+}
+
+void* gtom::h_FFTCreateThreadPlan(int ndims, int3 dims, bool forward)
+{
+    return (void*)AcquireFFTPlan(forward ? FFTPLAN_R2C : FFTPLAN_C2R, ndims, dims, 1, 1);
+}
+
+void* gtom::h_FFTCreateLinesPlan(int length, int batch, bool forward)
+{
+    return (void*)AcquireFFTPlan(forward ? FFTPLAN_C2C_FORWARD : FFTPLAN_C2C_BACKWARD, 1, toInt3(length, 1, 1), batch, 1);
+}
+void gtom::h_FFTExecuteR2C(void* plan, float* h_input, float2* h_output)
+{
+    fftwf_execute_dft_r2c((fftwf_plan)plan, h_input, (fftwf_complex*)h_output);
+}
+
+void gtom::h_FFTExecuteC2R(void* plan, float2* h_input, float* h_output)
+{
+    fftwf_execute_dft_c2r((fftwf_plan)plan, (fftwf_complex*)h_input, h_output);
+}
+
+void gtom::h_FFTExecuteLines(void* plan, float2* h_lines)
+{
+    fftwf_execute_dft((fftwf_plan)plan, (fftwf_complex*)h_lines, (fftwf_complex*)h_lines);
+}
+
+void gtom::h_FFTDestroyThreadPlan(void* plan)
+{
+    if (plan != NULL)
+        ReleaseFFTPlan((size_t)plan);
+}
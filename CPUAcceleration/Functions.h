@@ -0,0 +1,845 @@
+#ifndef CPU_FUNCTIONS_H
+#define CPU_FUNCTIONS_H
+
+/*
+
+CPU backend: same exports and signatures as GPUAcceleration/Functions.h.
+"Device" pointers are plain host buffers allocated by MallocDevice.
+
+*/
+
+#include "Prerequisites.h"
+
+using namespace std;
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <set>
+#include <functional>
+
+#include "Primitives.h"
+
+// Comparison.cu:
+
+extern "C" __declspec(dllexport) void CompareParticles(float* d_particles,
+                                                        float* d_masks,
+                                                        float* d_projections,
+                                                        int2 dims,
+                                                        float2* d_ctfcoords,
+                                                        gtom::CTFParams* h_ctfparams,
+                                                        float highpass,
+                                                        float lowpass,
+                                                        float* d_scores,
+                                                        uint nparticles);
+
+// Correlation.cpp:
+
+extern "C" __declspec(dllexport) void CorrelateSubTomos(float2* d_projectordata,
+                                                        float projectoroversample,
+                                                        int3 dimsprojector,
+                                                        float2* d_experimentalft,
+                                                        float* d_ctf,
+                                                        int3 dimsvolume,
+                                                        uint nvolumes,
+                                                        float3* h_angles,
+                                                        uint nangles,
+                                                        float maskradius,
+                                                        float* d_bestcorrelation,
+                                                        float* d_bestrot,
+                                                        float* d_besttilt,
+                                                        float* d_bestpsi);
+
+// CTF.cpp:
+extern "C" __declspec(dllexport) void CreateSpectra(float* d_frame,
+													int2 dimsframe,
+													int nframes,
+													int3* h_origins,
+													int norigins,
+													int2 dimsregion,
+													int3 ctfgrid,
+													void* d_outputall,
+													void* d_outputmean,
+													int precision);
+
+extern "C" __declspec(dllexport) void* CreateSpectrumAccumulator(int2 dimsregion,
+																int3* h_origins,
+																int norigins,
+																int nframes,
+																int3 ctfgrid,
+																long long memorybudget);
+extern "C" __declspec(dllexport) void SpectrumAccumulatorAdd(void* accumulator, float* d_frames, int2 dimsframe, int nframes);
+extern "C" __declspec(dllexport) void SpectrumAccumulatorFinish(void* accumulator, void* d_outputall, void* d_outputmean, int precision);
+extern "C" __declspec(dllexport) void DestroySpectrumAccumulator(void* accumulator);
+
+extern "C" __declspec(dllexport) gtom::CTFParams CTFFitMean(float* d_ps, 
+											  			    float2* d_pscoords, 
+														    int2 dims,
+														    gtom::CTFParams startparams,
+														    gtom::CTFFitParams fp, 
+														    bool doastigmatism);
+
+extern "C" __declspec(dllexport) void CTFMakeAverage(float* d_ps, 
+													 float2* d_pscoords, 
+													 uint length, 
+													 uint sidelength, 
+													 gtom::CTFParams* h_sourceparams, 
+													 gtom::CTFParams targetparams, 
+													 uint minbin, 
+													 uint maxbin, 
+													 int* h_consider,
+													 uint batch, 
+													 float* d_output);
+
+extern "C" __declspec(dllexport) void CTFCompareToSim(half* d_ps, 
+													  half2* d_pscoords,
+													  half* d_scale,
+													  uint length, 
+													  gtom::CTFParams* h_sourceparams, 
+													  float* h_scores,
+													  uint batch);
+
+// Derivatives of the score with respect to defocus, defocusdelta, astigmatismangle, phaseshift and Bfactor
+#define CTF_GRADIENT_PARAMS 5
+
+extern "C" __declspec(dllexport) void CTFCompareToSimGradients(half* d_ps, 
+															   half2* d_pscoords,
+															   half* d_scale,
+															   uint length, 
+															   gtom::CTFParams* h_sourceparams, 
+															   float* h_scores,
+															   float* h_gradients,
+															   uint batch);
+
+extern "C" __declspec(dllexport) void* CreateCTFGrid(float2* d_coords, uint length);
+extern "C" __declspec(dllexport) void DestroyCTFGrid(void* grid);
+extern "C" __declspec(dllexport) void CTFScoreCandidates(void* grid, 
+														 float* d_ps, 
+														 gtom::CTFParams* h_params, 
+														 uint ncandidates, 
+														 float* h_scores);
+
+// CTFFitting.cpp:
+extern "C" __declspec(dllexport) int CTFFitGrid(half* d_ps,
+												half2* d_pscoords,
+												half* d_scale,
+												uint length,
+												uint nspectra,
+												gtom::CTFParams baseparams,
+												float* h_defocusweights,
+												int ndefocus,
+												float* h_phaseweights,
+												int nphase,
+												bool fitphase,
+												bool fitastigmatism,
+												bool fitbfactor,
+												int maxiterations,
+												float* h_values,
+												float* h_score);
+
+// ParticleCTF.cpp:
+extern "C" __declspec(dllexport) void CreateParticleSpectra(float* d_frame,
+                                                            int2 dimsframe,
+                                                            int nframes,
+                                                            int3* h_origins,
+                                                            int norigins,
+                                                            float* d_masks,
+                                                            int2 dimsregion,
+                                                            bool ctftime,
+                                                            int framegroupsize,
+                                                            float majorpixel,
+                                                            float minorpixel,
+                                                            float majorangle,
+                                                            float2* d_outputall);
+
+extern "C" __declspec(dllexport) void ParticleCTFMakeAverage(float2* d_ps,
+                                                            float2* d_pscoords, 
+                                                            uint length, 
+                                                            uint sidelength, 
+                                                            gtom::CTFParams* h_sourceparams, 
+                                                            gtom::CTFParams targetparams, 
+                                                            uint minbin, 
+                                                            uint maxbin, 
+                                                            uint batch, 
+                                                            float* d_output);
+
+extern "C" __declspec(dllexport) void ParticleCTFCompareToSim(float2* d_ps, 
+                                                                float2* d_pscoords, 
+                                                                float2* d_ref, 
+                                                                float* d_invsigma,
+                                                                uint length, gtom::CTFParams* h_sourceparams, 
+                                                                float* h_scores, 
+                                                                uint nframes,
+                                                                uint batch);
+
+// Angles.cpp:
+extern "C" __declspec(dllexport) int __stdcall GetAnglesCount(int healpixorder, char* c_symmetry, float limittilt);
+extern "C" __declspec(dllexport) void __stdcall GetAngles(float3* h_angles, int healpixorder, char* c_symmetry, float limittilt);
+extern "C" __declspec(dllexport) void* __stdcall CreateAngleSampling(int healpixorder, char* c_symmetry, float limittilt);
+extern "C" __declspec(dllexport) void __stdcall DestroyAngleSampling(void* sampling);
+extern "C" __declspec(dllexport) void __stdcall AngleSamplingSetNeighborhood(void* sampling, float3 prior, float maxangle);
+extern "C" __declspec(dllexport) long long __stdcall AngleSamplingCount(void* sampling);
+extern "C" __declspec(dllexport) int __stdcall AngleSamplingGetChunk(void* sampling, long long first, int n, float3* h_angles);
+
+// Cubic.cpp:
+
+extern "C" __declspec(dllexport) void __stdcall CubicInterpOnGrid(int3 dimensions, 
+																	float* values, 
+																	float3 spacing, 
+																	int3 valueGrid, 
+																	float3 step, 
+																	float3 offset, 
+																	float* output);
+
+extern "C" __declspec(dllexport) void __stdcall CubicInterpIrregular(int3 dimensions, 
+                                                                    float* values, 
+                                                                    float3* positions, 
+                                                                    int npositions, 
+                                                                    float3 spacing, 
+                                                                    float* output);
+
+extern "C" __declspec(dllexport) int __stdcall CubicInterpIrregularWithWeights(int3 dimensions,
+                                                                                float* values,
+                                                                                float3* positions,
+                                                                                int npositions,
+                                                                                float3 spacing,
+                                                                                float* output,
+                                                                                int* h_rowoffsets,
+                                                                                int* h_columns,
+                                                                                float* h_weights);
+
+// Device.cpp:
+
+extern "C" __declspec(dllexport) int __stdcall GetDeviceCount();
+extern "C" __declspec(dllexport) void __stdcall SetDevice(int device);
+extern "C" __declspec(dllexport) int __stdcall GetDevice();
+extern "C" __declspec(dllexport) long __stdcall GetFreeMemory(int device);
+extern "C" __declspec(dllexport) long __stdcall GetTotalMemory(int device);
+
+int GetDeviceProcessorCount(int device);
+
+// FFTPlanCache.cpp:
+
+#define FFTPLAN_R2C 0
+#define FFTPLAN_C2R 1
+#define FFTPLAN_C2C_FORWARD 2     // In place, batch contiguous lines of dims.x; always FFTW
+#define FFTPLAN_C2C_BACKWARD 3
+#define FFTPLAN_HOST 16           // Combined with R2C/C2R: an FFTW plan for host data, also in the CUDA backend
+
+struct FFTPlanCacheStats
+{
+    long long nrequests;
+    long long nhits;                // Requests served by a cached plan
+    long long ncreated;
+    long long nevicted;
+    long long nplans;               // Cached plans, in use or idle
+    long long nplansinuse;
+    long long bytescached;          // cuFFT work areas, or an estimate for FFTW
+    long long budget;
+    double creationseconds;         // Total time spent creating plans
+    double maxcreationseconds;
+};
+
+// Returns a cufftHandle or fftwf_plan; nthreads only matters for FFTW. Every acquired plan must be released.
+size_t AcquireFFTPlan(int type, int ndims, int3 dims, int batch = 1, int nthreads = 1);
+void ReleaseFFTPlan(size_t plan);
+
+extern "C" __declspec(dllexport) void __stdcall FFTPlanCacheSetBudget(long long bytes);
+extern "C" __declspec(dllexport) void __stdcall FFTPlanCacheTrim();
+extern "C" __declspec(dllexport) void __stdcall FFTPlanCacheGetStats(FFTPlanCacheStats* h_stats);
+extern "C" __declspec(dllexport) void __stdcall FFTPlanCacheResetStats();
+
+// MemoryPool.cpp:
+
+struct MemoryPoolStats
+{
+    long long bytesrequested;       // Live allocations, as requested
+    long long bytesinuse;           // Live allocations, rounded up to their size classes
+    long long bytescached;          // Freed blocks kept for reuse
+    long long bytesreserved;        // Everything obtained from the system, i.e. in use + cached
+    long long peakinuse;
+    long long peakreserved;
+    long long nallocations;
+    long long ncachehits;           // Allocations served from cached blocks
+    long long nsystemallocations;
+    long long nsystemfrees;
+};
+
+void PoolMalloc(void** d_memory, size_t bytes);
+void* PoolMallocFromHostArray(void* h_source, size_t bytes);
+void PoolFree(void* d_memory);
+
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolBeginScope();
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolEndScope();
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolSetRetainLimit(long long bytes);
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolTrim();
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolGetStats(MemoryPoolStats* h_stats);
+extern "C" __declspec(dllexport) void __stdcall MemoryPoolResetStats();
+
+// PhaseRamps.cpp:
+
+struct PhaseRampLattice
+{
+    bool separable;
+    double step;
+    int kxmin, kymin, nx, ny;
+    std::vector<uint> indices;    // Per element: row table index | column table index << 16
+};
+
+// Tables for one call's shifts, see AcquirePhaseRamps
+struct PhaseRampView
+{
+    int nx;             // 0 if there are no tables, evaluate sincos per element instead
+    uint* d_lattice;
+    float2* d_tables;   // Per shift, nx row table entries followed by the column table
+    uint* d_offsets;    // Start of each shift's tables in d_tables
+    void* set;
+};
+
+PhaseRampLattice GetPhaseRampLattice(float2* h_shiftfactors, uint n);
+void GetPhaseRampTables(const PhaseRampLattice &lattice, float2 shift, float2* h_tables);
+void GetPhaseRamps(const PhaseRampView &view, uint shiftid, float2* h_shiftfactors, float2 shift, uint first, uint n, float2* h_output);
+bool AcquirePhaseRamps(float2* d_shiftfactors, uint length, float2* d_shifts, uint nshifts, PhaseRampView* view);
+void ReleasePhaseRamps(PhaseRampView* view);
+void ForgetPhaseRamps(void* d_memory);
+
+extern "C" __declspec(dllexport) void* __stdcall CreatePhaseRamps(float2* h_shiftfactors, float2* d_shiftfactors, uint length, int maxshifts);
+extern "C" __declspec(dllexport) void __stdcall DestroyPhaseRamps(void* ramps);
+extern "C" __declspec(dllexport) void __stdcall PhaseRampsGetStats(void* ramps, long long* h_hits, long long* h_misses);
+
+// MovieReader.cpp:
+
+extern "C" __declspec(dllexport) void* __stdcall MovieReaderOpen(char* c_path, int ringsize, int3* h_dims);
+extern "C" __declspec(dllexport) void* __stdcall MovieReaderOpenGroups(char* c_path, int ringsize, int* h_groupfirst, int* h_grouplength, int ngroups, int upsampling, int3* h_dims);
+extern "C" __declspec(dllexport) bool __stdcall MovieGetDims(char* c_path, int3* h_dims);
+extern "C" __declspec(dllexport) int __stdcall MovieReaderAcquire(void* reader, float** h_frame);
+extern "C" __declspec(dllexport) void __stdcall MovieReaderRelease(void* reader);
+extern "C" __declspec(dllexport) void __stdcall MovieReaderClose(void* reader);
+
+extern "C" __declspec(dllexport) bool __stdcall MovieIngest(char* c_path,
+                                                            int ringsize,
+                                                            int* h_groupfirst,
+                                                            int* h_grouplength,
+                                                            int ngroups,
+                                                            int upsampling,
+                                                            float* d_stack,
+                                                            int3* h_shiftorigins,
+                                                            int nshiftorigins,
+                                                            int2 dimsshiftregion,
+                                                            size_t* h_shiftmask,
+                                                            uint shiftmasklength,
+                                                            float2* d_shiftoutput,
+                                                            void* spectrumaccumulator);
+
+// Scheduler.cpp:
+
+struct SchedulerProgress
+{
+    int nsubmitted;
+    int nqueued;
+    int nrunning;
+    int ncompleted;
+    int nfailed;        // A stage returned non-zero, the remaining stages were skipped
+    int ncancelled;     // Dropped from the queues before they started
+    int nstolen;        // Run by a device other than the one they were queued for
+};
+
+// Runs one stage of a task on the given device; returns 0 on success
+typedef int (__stdcall *SchedulerStageCallback)(int task, int stage, int device);
+
+extern "C" __declspec(dllexport) void* __stdcall CreateScheduler(int ndevices, int workersperdevice, int nstages, SchedulerStageCallback callback);
+extern "C" __declspec(dllexport) void __stdcall DestroyScheduler(void* scheduler);
+extern "C" __declspec(dllexport) void __stdcall SchedulerSubmit(void* scheduler, int task, int device);
+extern "C" __declspec(dllexport) bool __stdcall SchedulerWait(void* scheduler, int timeoutms);
+extern "C" __declspec(dllexport) void __stdcall SchedulerCancel(void* scheduler);
+extern "C" __declspec(dllexport) void __stdcall SchedulerGetProgress(void* scheduler, SchedulerProgress* h_progress);
+extern "C" __declspec(dllexport) void __stdcall SchedulerGetStageTimings(void* scheduler, double* h_seconds, int* h_counts);
+extern "C" __declspec(dllexport) void __stdcall SchedulerGetDeviceTimings(void* scheduler, double* h_busyseconds, int* h_tasks);
+extern "C" __declspec(dllexport) bool __stdcall SchedulerGetTaskTimings(void* scheduler, int task, float* h_seconds);
+
+// Memory.cpp:
+
+extern "C" __declspec(dllexport) float* __stdcall MallocDevice(long elements);
+extern "C" __declspec(dllexport) float* __stdcall MallocDeviceFromHost(float* h_data, long elements);
+extern "C" __declspec(dllexport) void* __stdcall MallocDeviceHalf(long elements);
+extern "C" __declspec(dllexport) void* __stdcall MallocDeviceHalfFromHost(float* h_data, long elements);
+
+extern "C" __declspec(dllexport) void __stdcall FreeDevice(void* d_data);
+
+extern "C" __declspec(dllexport) void __stdcall CopyDeviceToHost(float* d_source, float* h_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall CopyDeviceHalfToHost(half* d_source, float* h_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall CopyDeviceToDevice(float* d_source, float* d_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall CopyDeviceHalfToDeviceHalf(half* d_source, half* d_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall CopyHostToDevice(float* h_source, float* d_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall CopyHostToDeviceHalf(float* h_source, half* d_dest, long elements);
+
+extern "C" __declspec(dllexport) void __stdcall SingleToHalf(float* d_source, half* d_dest, long elements);
+extern "C" __declspec(dllexport) void __stdcall HalfToSingle(half* d_source, float* d_dest, long elements);
+
+// Precision.cu:
+
+// Storage precision of spectrum and phase buffers. Only storage: everything computed from them is fp32.
+#define STORAGE_FP32 0
+#define STORAGE_FP16 1
+#define STORAGE_BF16 2
+
+// Bytes per real value
+inline size_t StorageBytes(int precision) { return precision == STORAGE_FP32 ? sizeof(float) : sizeof(unsigned short); }
+
+extern "C" __declspec(dllexport) void* __stdcall MallocDeviceStorage(long elements, int precision);
+extern "C" __declspec(dllexport) void __stdcall SingleToStorage(float* d_source, void* d_dest, long elements, int precision);
+extern "C" __declspec(dllexport) void __stdcall StorageToSingle(void* d_source, float* d_dest, long elements, int precision);
+
+// Post.cu:
+
+extern "C" __declspec(dllexport) void GetMotionFilter(float* d_output, 
+														int3 dims, 
+														float3* h_shifts, 
+														uint nshifts, 
+														uint batch);
+
+extern "C" __declspec(dllexport) void CorrectMagAnisotropy(float* d_image, 
+                                                            int2 dimsimage, 
+                                                            float* d_scaled, 
+                                                            int2 dimsscaled, 
+                                                            float majorpixel, 
+                                                            float minorpixel, 
+                                                            float majorangle, 
+                                                            uint supersample, 
+                                                            uint batch);
+
+extern "C" __declspec(dllexport) void DoseWeighting(float* d_freq,
+                                                    float* d_output,
+                                                    uint length,
+                                                    float* h_dose,
+                                                    float3 nikoconst,
+                                                    uint batch);
+
+extern "C" __declspec(dllexport) void NormParticles(float* d_input, float* d_output, int3 dims, uint particleradius, bool flipsign, uint batch);
+
+// PatchSpectra.cpp:
+
+// Fills one patch with dimsregion real values; h_scratch has the number of elements given to PatchSpectra
+typedef std::function<void(int item, float* h_patch, float* h_scratch)> PatchPrepare;
+// Receives the patch's unnormalized half spectrum, in FFT layout
+typedef std::function<void(int item, const float2* h_spectrum)> PatchConsume;
+
+// Maps indices into the centered half spectrum (RemapHalfFFT2Half's layout) to the FFT layout; out of range stays out of range
+std::vector<size_t> PatchSpectrumGatherIndices(const size_t* h_indices, uint n, int2 dimsregion);
+// Items in each run of runlength consecutive items are processed in order by the same thread
+void PatchSpectra(int nitems, int runlength, int2 dimsregion, size_t scratchelements, const PatchPrepare &prepare, const PatchConsume &consume);
+// Writes the gathered components, 0 for out of range indices, to h_output at element first, in the given precision
+void GatherPatchSpectrum(const float2* h_spectrum, const size_t* h_gather, uint n, size_t elements, void* h_output, int precision, size_t first);
+
+// Shift.cpp:
+
+extern "C" __declspec(dllexport) void CreateShift(float* d_frame,
+													int2 dimsframe,
+													int nframes,
+													int3* h_origins,
+													int norigins,
+													int2 dimsregion,
+													size_t* h_mask,
+													uint masklength,
+                                                    void* d_outputall,
+                                                    int precision);
+
+extern "C" __declspec(dllexport) void ShiftGetAverage(void* d_phase,
+                                                        float2* d_average,
+                                                        float2* d_shiftfactors,
+														uint length,
+														uint probelength,
+														float2* d_shifts,
+														uint nspectra,
+														uint nframes,
+														int precision);
+
+void ForgetShiftAverages(void* d_memory);
+extern "C" __declspec(dllexport) void* CreateShiftAverage(uint length, uint npositions, uint nframes);
+extern "C" __declspec(dllexport) void DestroyShiftAverage(void* average);
+extern "C" __declspec(dllexport) void ShiftAverageGetStats(void* average, long long* h_updated, long long* h_recomputed);
+
+extern "C" __declspec(dllexport) void ShiftGetAverageIncremental(void* average,
+                                                                    void* d_phase,
+                                                                    float2* d_average,
+                                                                    float2* d_shiftfactors,
+                                                                    uint length,
+                                                                    uint probelength,
+                                                                    float2* d_shifts,
+                                                                    uint npositions,
+                                                                    uint nframes,
+                                                                    int precision);
+
+extern "C" __declspec(dllexport) void ShiftGetDiff(void* d_phase,
+                                                    float2* d_average,
+                                                    float2* d_shiftfactors,
+													uint length,
+													uint probelength,
+													float2* d_shifts,
+													float* h_diff,
+													uint npositions,
+													uint nframes,
+													int precision);
+
+extern "C" __declspec(dllexport) void ShiftGetGrad(void* d_phase,
+                                                    float2* d_average,
+                                                    float2* d_shiftfactors,
+													uint length,
+													uint probelength,
+													float2* d_shifts,
+													float2* h_grad,
+													uint npositions,
+													uint nframes,
+													int precision);
+
+extern "C" __declspec(dllexport) void ShiftGetDiffAndGrad(void* d_phase,
+                                                            float2* d_average,
+                                                            float2* d_shiftfactors,
+                                                            uint length,
+                                                            uint probelength,
+                                                            float2* d_shifts,
+                                                            float* h_diff,
+                                                            float2* h_grad,
+                                                            uint npositions,
+                                                            uint nframes,
+                                                            int precision);
+
+extern "C" __declspec(dllexport) void CreateMotionBlur(float* d_output, 
+                                                       int3 dims, 
+                                                       float* h_shifts, 
+                                                       uint nshifts, 
+                                                       uint batch);
+
+// ParticleShift.cu:
+extern "C" __declspec(dllexport) void CreateParticleShift(float* d_frame,
+                                                            int2 dimsframe,
+                                                            int nframes,
+                                                            float2* h_positions,
+                                                            float2* h_shifts,
+                                                            int npositions,
+                                                            int2 dimsregion,
+                                                            size_t* h_indices,
+                                                            uint indiceslength,
+                                                            float* d_masks,
+                                                            float2* d_projections,
+                                                            gtom::CTFParams* h_ctfparams,
+                                                            float2* d_ctfcoords,
+                                                            float* d_invsigma,
+                                                            float pixelmajor,
+                                                            float pixelminor,
+                                                            float pixelangle,
+                                                            void* d_outputparticles,
+                                                            float2* d_outputprojections,
+                                                            float* d_outputinvsigma,
+                                                            int precision);
+
+extern "C" __declspec(dllexport) void ParticleShiftGetDiff(void* d_phase,
+                                                            float2* d_average,
+                                                            float2* d_shiftfactors,
+                                                            float* d_invsigma,
+                                                            uint length,
+                                                            uint probelength,
+                                                            float2* d_shifts,
+                                                            float* h_diff,
+                                                            uint npositions,
+                                                            uint nframes,
+                                                            int precision);
+
+extern "C" __declspec(dllexport) void ParticleShiftGetGrad(void* d_phase,
+                                                            float2* d_average,
+                                                            float2* d_shiftfactors,
+                                                            float* d_invsigma,
+                                                            uint length,
+                                                            uint probelength,
+                                                            float2* d_shifts,
+                                                            float2* h_grad,
+                                                            uint npositions,
+                                                            uint nframes,
+                                                            int precision);
+
+extern "C" __declspec(dllexport) void ParticleShiftGetDiffAndGrad(void* d_phase,
+                                                                    float2* d_average,
+                                                                    float2* d_shiftfactors,
+                                                                    float* d_invsigma,
+                                                                    uint length,
+                                                                    uint probelength,
+                                                                    float2* d_shifts,
+                                                                    float* h_diff,
+                                                                    float2* h_grad,
+                                                                    uint npositions,
+                                                                    uint nframes,
+                                                                    int precision);
+
+// Polishing.cu:
+extern "C" __declspec(dllexport) void CreatePolishing(float* d_particles, float2* d_particlesft, float* d_masks, int2 dims, int2 dimscropped, int nparticles, int nframes);
+extern "C" __declspec(dllexport) void CreatePolishingGroups(float* d_particles,
+                                                             void* d_particlesft,
+                                                             int2 dims,
+                                                             int2 dimscropped,
+                                                             int nparticles,
+                                                             int nframes,
+                                                             int* h_groupfirst,
+                                                             int* h_grouplength,
+                                                             int ngroups,
+                                                             float* h_frameweights,
+                                                             float maskradius,
+                                                             float maskfalloff,
+                                                             int batchsize,
+                                                             int precision);
+
+extern "C" __declspec(dllexport) void PolishingGetDiff(void* d_phase,
+                                                        float2* d_average,
+                                                        float2* d_shiftfactors,
+                                                        float2* d_ctfcoords,
+                                                        gtom::CTFParams* h_ctfparams,
+                                                        float* d_invsigma,
+                                                        int2 dims,                                                        
+                                                        float2* d_shifts,
+                                                        float* h_diff,
+                                                        float* h_diffall,
+                                                        uint npositions,
+                                                        uint nframes,
+                                                        int precision);
+
+// Projector.cpp:
+extern "C" __declspec(dllexport) void InitProjector(int3 dims, int oversampling, float* data, float* datasize);
+extern "C" __declspec(dllexport) void BackprojectorReconstruct(int3 dimsori, int oversampling, float* h_data, float* h_weights, char* c_symmetry, bool do_reconstruct_ctf, float* h_reconstruction);
+extern "C" __declspec(dllexport) void BackprojectorReconstructGPU(int3 dimsori, int3 dimspadded, int oversampling, float2* d_dataft, float* d_weights, bool do_reconstruct_ctf, float* d_result, cufftHandle pre_planforw, cufftHandle pre_planback, cufftHandle pre_planforwctf);
+extern "C" __declspec(dllexport) void __stdcall SetReconstructionOptions(int nthreads, long long memorybudget, char* c_scratchdir);
+extern "C" __declspec(dllexport) void __stdcall SetProjectorCacheDirectory(char* c_directory);
+
+// TomoRefine.cu:
+extern "C" __declspec(dllexport) void TomoRefineGetDiff(float2* d_experimental,
+                                                        float2* d_reference,
+                                                        float2* d_shiftfactors,
+                                                        float* d_ctf,
+                                                        float* d_weights,
+                                                        int2 dims,
+                                                        float2* h_shifts,
+                                                        float* h_diff,
+                                                        uint nparticles);
+
+extern "C" __declspec(dllexport) void TomoRealspaceCorrelate(float* d_projections, 
+                                                            int2 dims, 
+                                                            uint nprojections, 
+                                                            uint ntilts, 
+                                                            float* d_experimental, 
+                                                            float* d_ctf, 
+                                                            float* d_mask, 
+                                                            float* d_weights, 
+                                                            float* h_shifts, 
+                                                            float* h_result);
+
+extern "C" __declspec(dllexport) void* CreateTomoRealspaceScorer(float* d_experimental, float* d_mask, int2 dims, uint ntilts);
+extern "C" __declspec(dllexport) void DestroyTomoRealspaceScorer(void* tomoscorer);
+extern "C" __declspec(dllexport) void TomoRealspaceScorerCorrelate(void* tomoscorer,
+                                                                    float* d_projections,
+                                                                    uint nprojections,
+                                                                    float* d_weights,
+                                                                    float* h_shifts,
+                                                                    uint nshifts,
+                                                                    int topk,
+                                                                    int* h_bestshifts,
+                                                                    float* h_bestscores);
+
+extern "C" __declspec(dllexport) void TomoGlobalAlign(float2* d_experimental,
+                                                        float2* d_shiftfactors,
+                                                        float* d_ctf,
+                                                        float* d_weights,
+                                                        int2 dims,
+                                                        float2* d_ref,
+                                                        int3 dimsref,
+                                                        int refsupersample,
+                                                        float3* h_angles,
+                                                        uint nangles,
+                                                        float2* h_shifts,
+                                                        uint nshifts,
+                                                        uint nparticles,
+                                                        uint ntilts,
+                                                        int* h_bestangles,
+                                                        int* h_bestshifts,
+                                                        float* h_bestscores);
+
+extern "C" __declspec(dllexport) void TomoGlobalAlignHierarchical(float2* d_experimental,
+                                                                  float2* d_shiftfactors,
+                                                                  float* d_ctf,
+                                                                  float* d_weights,
+                                                                  int2 dims,
+                                                                  float2* d_ref,
+                                                                  int3 dimsref,
+                                                                  int refsupersample,
+                                                                  float3* h_angles,
+                                                                  uint nangles,
+                                                                  float2* h_shifts,
+                                                                  uint nshifts,
+                                                                  uint nparticles,
+                                                                  uint ntilts,
+                                                                  float coarsecutoff,
+                                                                  int topk,
+                                                                  float angleradius,
+                                                                  float shiftradius,
+                                                                  int* h_bestangles,
+                                                                  int* h_bestshifts,
+                                                                  float* h_bestscores);
+
+// Tools.cu:
+
+extern "C" __declspec(dllexport) void Extract(float* d_input,
+												float* d_output,
+												int3 dims,
+												int3 dimsregion,
+												int3* h_origins,
+												uint batch);
+
+extern "C" __declspec(dllexport) void ExtractHalf(float* d_input,
+													float* d_output,
+													int3 dims,
+													int3 dimsregion,
+													int3* h_origins,
+													uint batch);
+
+extern "C" __declspec(dllexport) void ReduceMean(float* d_input, 
+													float* d_output, 
+													uint vectorlength, 
+													uint nvectors, 
+													uint batch);
+
+extern "C" __declspec(dllexport) void ReduceMeanHalf(half* d_input, half* d_output, uint vectorlength, uint nvectors, uint batch);
+
+extern "C" __declspec(dllexport) void Normalize(float* d_ps,
+												float* d_output,
+												uint length,
+												uint batch);
+
+extern "C" __declspec(dllexport) void NormalizeMasked(float* d_ps, 
+                                                      float* d_output, 
+                                                      float* d_mask, 
+                                                      uint length, 
+                                                      uint batch);
+
+extern "C" __declspec(dllexport) void SphereMask(float* d_input, float* d_output, int3 dims, float radius, float sigma, uint batch);
+
+extern "C" __declspec(dllexport) void CreateCTF(float* d_output,
+												float2* d_coords,
+												uint length,
+												gtom::CTFParams* h_params,
+												bool amplitudesquared,
+												uint batch);
+
+extern "C" __declspec(dllexport) void Resize(float* d_input,
+											int3 dimsinput,
+											float* d_output,
+											int3 dimsoutput,
+											uint batch);
+
+extern "C" __declspec(dllexport) void ShiftStack(float* d_input,
+												float* d_output,
+												int3 dims,
+												float* h_shifts,
+												uint batch);
+
+extern "C" __declspec(dllexport) void ShiftStackMassive(float* d_input,
+                                                        float* d_output,
+                                                        int3 dims,
+                                                        float* h_shifts,
+                                                        uint batch);
+
+extern "C" __declspec(dllexport) void FFT(float* d_input, float2* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void IFFT(float2* d_input, float* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void Pad(float* d_input, float* d_output, int3 olddims, int3 newdims, uint batch);
+
+extern "C" __declspec(dllexport) void PadFT(float2* d_input, float2* d_output, int3 olddims, int3 newdims, uint batch);
+
+extern "C" __declspec(dllexport) void CropFT(float2* d_input, float2* d_output, int3 olddims, int3 newdims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapToFTComplex(float2* d_input, float2* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapToFTFloat(float* d_input, float* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapFromFTComplex(float2* d_input, float2* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapFromFTFloat(float* d_input, float* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapFullToFTFloat(float* d_input, float* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void RemapFullFromFTFloat(float* d_input, float* d_output, int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void Cart2Polar(float* d_input, float* d_output, int2 dims, uint innerradius, uint exclusiveouterradius, uint batch);
+
+extern "C" __declspec(dllexport) void Cart2PolarFFT(float* d_input, float* d_output, int2 dims, uint innerradius, uint exclusiveouterradius, uint batch);
+
+extern "C" __declspec(dllexport) void Xray(float* d_input, float* d_output, float ndevs, int2 dims, uint batch);
+
+extern "C" __declspec(dllexport) void Sum(float* d_input, float* d_output, uint length, uint batch);
+
+extern "C" __declspec(dllexport) void Abs(float* d_input, float* d_output, size_t length);
+
+extern "C" __declspec(dllexport) void Amplitudes(float2* d_input, float* d_output, size_t length);
+
+extern "C" __declspec(dllexport) void Sign(float* d_input, float* d_output, size_t length);
+
+extern "C" __declspec(dllexport) void AddToSlices(float* d_input, float* d_summands, float* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void SubtractFromSlices(float* d_input, float* d_subtrahends, float* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void MultiplySlices(float* d_input, float* d_multiplicators, float* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void DivideSlices(float* d_input, float* d_divisors, float* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void AddToSlicesHalf(half* d_input, half* d_summands, half* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void SubtractFromSlicesHalf(half* d_input, half* d_subtrahends, half* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void MultiplySlicesHalf(half* d_input, half* d_multiplicators, half* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void MultiplyComplexSlicesByScalar(float2* d_input, float* d_multiplicators, float2* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void DivideComplexSlicesByScalar(float2* d_input, float* d_divisors, float2* d_output, size_t sliceelements, uint slices);
+
+extern "C" __declspec(dllexport) void Scale(float* d_input, float* d_output, int3 dimsinput, int3 dimsoutput, uint batch);
+
+extern "C" __declspec(dllexport) void ProjectForward(float2* d_inputft, float2* d_outputft, int3 dimsinput, int2 dimsoutput, float3* h_angles, float supersample, uint batch);
+
+extern "C" __declspec(dllexport) void ProjectBackward(float2* d_volumeft, float* d_volumeweights, int3 dimsvolume, float2* d_projft, float* d_projweights, int2 dimsproj, int rmax, float3* h_angles, float supersample, uint batch);
+
+extern "C" __declspec(dllexport) void Bandpass(float* d_input, float* d_output, int3 dims, float nyquistlow, float nyquisthigh, uint batch);
+
+extern "C" __declspec(dllexport) void Rotate2D(float* d_input, float* d_output, int2 dims, float* h_angles, int oversample, uint batch);
+
+extern "C" __declspec(dllexport) void ShiftAndRotate2D(float* d_input, float* d_output, int2 dims, float2* h_shifts, float* h_angles, uint batch);
+
+extern "C" __declspec(dllexport) int CreateFFTPlan(int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) int CreateIFFTPlan(int3 dims, uint batch);
+
+extern "C" __declspec(dllexport) void DestroyFFTPlan(cufftHandle plan);
+
+
+// WeightOptimization.cpp:
+extern "C" __declspec(dllexport) void OptimizeWeights(int nrecs,
+                                                        float* h_recft, 
+                                                        float* h_recweights, 
+                                                        float* h_r2, 
+                                                        int elements, 
+                                                        int* h_subsets, 
+                                                        float* h_bfacs, 
+                                                        float* h_weightfactors, 
+                                                        float* h_recsum1, 
+                                                        float* h_recsum2, 
+                                                        float* h_weightsum1, 
+                                                        float* h_weightsum2);
+
+extern "C" __declspec(dllexport) void* __stdcall CreateWeightOptimizer(float* h_r2, int elements);
+extern "C" __declspec(dllexport) void __stdcall DestroyWeightOptimizer(void* optimizer);
+extern "C" __declspec(dllexport) int __stdcall WeightOptimizerAddInputs(void* optimizer, int nrecs, float* h_recft, float* h_recweights);
+extern "C" __declspec(dllexport) int __stdcall WeightOptimizerMapInputs(void* optimizer, int nrecs, char* c_path);
+extern "C" __declspec(dllexport) void __stdcall WeightOptimizerAccumulate(void* optimizer, int* h_subsets, float* h_bfacs, float* h_weightfactors, float* h_recsum1, float* h_recsum2, float* h_weightsum1, float* h_weightsum2);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include "Functions.h"
+using namespace gtom;
+
+// Every host buffer of the CPU backend comes out of the pool in MemoryPool.cpp
+
+void* gtom::MallocAligned(size_t bytes)
+{
+    void* h_memory;
+    PoolMalloc(&h_memory, bytes);
+
+    return h_memory;
+}
+
+void gtom::FreeAligned(void* h_data)
+{
+    PoolFree(h_data);
+}
+
+__declspec(dllexport) float* __stdcall MallocDevice(long elements)
+{
+    return (float*)MallocAligned(elements * sizeof(float));
+}
+
+__declspec(dllexport) float* __stdcall MallocDeviceFromHost(float* h_data, long elements)
+{
+    return MallocAlignedFromHostArray(h_data, elements);
+}
+
+__declspec(dllexport) void* __stdcall MallocDeviceHalf(long elements)
+{
+    return MallocAligned(elements * sizeof(half));
+}
+
+__declspec(dllexport) void* __stdcall MallocDeviceHalfFromHost(float* h_data, long elements)
+{
+    half* d_memory = (half*)MallocAligned(elements * sizeof(half));
+
+    CopyHostToDeviceHalf(h_data, d_memory, elements);
+
+    return d_memory;
+}
+
+__declspec(dllexport) void __stdcall FreeDevice(void* d_data)
+{
+    ForgetPhaseRamps(d_data);
+    ForgetShiftAverages(d_data);
+    FreeAligned(d_data);
+}
+
+__declspec(dllexport) void __stdcall CopyDeviceToHost(float* d_source, float* h_dest, long elements)
+{
+    memcpy(h_dest, d_source, elements * sizeof(float));
+}
+
+__declspec(dllexport) void __stdcall CopyDeviceHalfToHost(half* d_source, float* h_dest, long elements)
+{
+    HalfToSingle(d_source, h_dest, elements);
+}
+
+__declspec(dllexport) void __stdcall CopyDeviceToDevice(float* d_source, float* d_dest, long elements)
+{
+    memmove(d_dest, d_source, elements * sizeof(float));
+}
+
+__declspec(dllexport) void __stdcall CopyDeviceHalfToDeviceHalf(half* d_source, half* d_dest, long elements)
+{
+    memmove(d_dest, d_source, elements * sizeof(half));
+}
+
+__declspec(dllexport) void __stdcall CopyHostToDevice(float* h_source, float* d_dest, long elements)
+{
+    memcpy(d_dest, h_source, elements * sizeof(float));
+}
+
+__declspec(dllexport) void __stdcall CopyHostToDeviceHalf(float* h_source, half* d_dest, long elements)
+{
+    SingleToHalf(h_source, d_dest, elements);
+}
+
+__declspec(dllexport) void __stdcall SingleToHalf(float* d_source, half* d_dest, long elements)
+{
+    SingleToStorage(d_source, d_dest, elements, STORAGE_FP16);
+}
+
+__declspec(dllexport) void __stdcall HalfToSingle(half* d_source, float* d_dest, long elements)
+{
+    StorageToSingle(d_source, d_dest, elements, STORAGE_FP16);
+}
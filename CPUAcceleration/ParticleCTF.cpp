@@ -0,0 +1,103 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+Supplied with a stack of frames, and extraction positions for particles, this method
+extracts particles, masks them, computes the FT, and averages the results as follows:
+
+-3D full fitting: d_output contains all individual spectra from each frame
+-2D spatial fitting: d_output contains averages for every position over all frames
+
+*/
+
+__declspec(dllexport) void CreateParticleSpectra(float* d_frame,
+                                                int2 dimsframe,
+                                                int nframes,
+                                                int3* h_origins,
+                                                int norigins,
+                                                float* d_masks,
+                                                int2 dimsregion,
+                                                bool ctftime,
+                                                int framegroupsize,
+                                                float majorpixel,
+                                                float minorpixel,
+                                                float majorangle,
+                                                float2* d_outputall)
+{
+    size_t elementsspectrum = ElementsFFT2(dimsregion);
+    size_t elements = Elements2(dimsregion);
+    bool anisotropic = abs(majorpixel - minorpixel) > 0;
+
+    // Trailing frames that don't fill a whole group have nowhere to go
+    int nused = ctftime ? nframes / framegroupsize * framegroupsize : nframes;
+    int runlength = ctftime ? framegroupsize : nframes;
+    int ntargets = ctftime ? nframes / framegroupsize : 1;
+
+    // Temp spectra will be summed up to be averaged later in case of only spatial resolution
+    h_ValueFill(d_outputall, elementsspectrum * norigins * ntargets, make_cuComplex(0.0f, 0.0f));
+
+    // Items go through all frames for one origin, a run covers everything that's summed into one spectrum
+    PatchSpectra(norigins * nused, runlength, dimsregion, elements * 2, [&](int item, float* h_patch, float* h_scratch)
+    {
+        int p = item / nused, z = item % nused;
+        float* h_extract = h_scratch;
+        float* h_flipped = h_scratch + elements;
+
+        h_ExtractMany(d_frame + Elements2(dimsframe) * z, h_extract, toInt3(dimsframe), toInt3(dimsregion), h_origins + norigins * z + p, 1);
+        if (anisotropic)
+        {
+            h_MultiplyByScalar(h_extract, h_extract, elements, -1.0f);
+            h_MagAnisotropyCorrect(h_extract, dimsregion, h_flipped, dimsregion, majorpixel, minorpixel, majorangle, 4, 1);
+        }
+        else
+        {
+            h_MultiplyByScalar(h_extract, h_flipped, elements, -1.0f);
+        }
+
+        h_RemapFull2FullFFT(h_flipped, h_patch, toInt3(dimsregion), 1);
+    },
+    [&](int item, const float2* h_spectrum)
+    {
+        int p = item / nused, z = item % nused;
+
+        // Full temporal precision accumulates into the frame group, spatial-only into one set of spectra
+        tcomplex* h_target = d_outputall + ((ctftime ? z / framegroupsize : 0) * norigins + p) * elementsspectrum;
+        for (size_t i = 0; i < elementsspectrum; i++)
+            h_target[i] = h_spectrum[i] + h_target[i];
+    });
+
+    h_MultiplyByScalar(d_outputall, d_outputall, norigins * ntargets * elementsspectrum, 1.0f / (ctftime ? framegroupsize : nframes));
+}
+
+__declspec(dllexport) void ParticleCTFMakeAverage(float2* d_ps, float2* d_pscoords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, uint minbin, uint maxbin, uint batch, float* d_output)
+{
+    h_CTFRotationalAverageToTarget((tcomplex*)d_ps, d_pscoords, length, sidelength, h_sourceparams, targetparams, d_output, minbin, maxbin, NULL, 1);
+}
+
+__declspec(dllexport) void ParticleCTFCompareToSim(float2* d_ps, float2* d_pscoords, float2* d_ref, float* d_invsigma, uint length, CTFParams* h_sourceparams, float* h_scores, uint nframes, uint batch)
+{
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(batch * nframes); specid++)
+    {
+        CTFParamsLean params(h_sourceparams[specid], toInt3(1, 1, 1));    // Sidelength and pixelsize are already included in d_pscoords
+        float2* h_ps = d_ps + (size_t)specid * length;
+        float2* h_ref = d_ref + (size_t)(specid % batch) * length;
+
+        float num = 0.0f, denom1 = 0.0f, denom2 = 0.0f;
+        for (uint i = 0; i < length; i++)
+        {
+            float2 simcoords = d_pscoords[i];
+            float invsigma = d_invsigma[i];
+
+            float2 refval = h_ref[i] * (h_GetCTF(simcoords.x / params.pixelsize, simcoords.y, params, false) * invsigma);
+            float2 psval = h_ps[i] * invsigma;
+
+            num += dotp2(refval, psval);
+            denom1 += dotp2(refval, refval);
+            denom2 += dotp2(psval, psval);
+        }
+
+        h_scores[specid] = num / tmax(1e-6f, sqrt(denom1 * denom2));
+    }
+}
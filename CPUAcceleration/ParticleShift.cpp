@@ -0,0 +1,263 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+Supplied with a stack of frames, extraction positions for sub-regions, and a mask of relevant pixels in Fspace,
+this method extracts portions of each frame, computes the FT, and returns the relevant pixels. The particles are
+stored with the given STORAGE_* precision, which the ParticleShiftGet* methods take for d_phase; projections and
+inverse sigma stay fp32.
+
+*/
+
+__declspec(dllexport) void CreateParticleShift(float* d_frame,
+                                                int2 dimsframe,
+                                                int nframes,
+                                                float2* h_positions,
+                                                float2* h_shifts,
+                                                int npositions,
+                                                int2 dimsregion,
+                                                size_t* h_indices,
+                                                uint indiceslength,
+                                                float* d_masks,
+                                                float2* d_projections,
+                                                CTFParams* h_ctfparams,
+                                                float2* d_ctfcoords,
+                                                float* d_invsigma,
+                                                float pixelmajor,
+                                                float pixelminor,
+                                                float pixelangle,
+                                                void* d_outputparticles,
+                                                float2* d_outputprojections,
+                                                float* d_outputinvsigma,
+                                                int precision)
+{
+    int2 dimspadded = toInt2(dimsregion.x + 64, dimsregion.y + 64);
+    std::vector<size_t> gather = PatchSpectrumGatherIndices(h_indices, indiceslength, dimsregion);
+
+    // One particle in one frame per item, with the padded extraction and its anisotropy-corrected copy in scratch
+    PatchSpectra(nframes * npositions, 1, dimsregion, Elements2(dimspadded), [&](int item, float* h_patch, float* h_scratch)
+    {
+        int z = item / npositions;
+
+        // Get closest origin for extraction, add residuals to the shift
+        float2 position = h_positions[item % npositions];
+        float2 shift = h_shifts[item];
+        int3 origin = toInt3((int)position.x - dimspadded.x / 2, (int)position.y - dimspadded.y / 2, 0);
+        float3 overallshift = make_float3(shift.x - (position.x - (int)position.x),
+                                          shift.y - (position.y - (int)position.y),
+                                          0.0f);
+
+        h_ExtractMany(d_frame + Elements2(dimsframe) * z, h_scratch, toInt3(dimsframe), toInt3(dimspadded), &origin, 1);
+        h_Shift(h_scratch, h_scratch, toInt3(dimspadded), &overallshift, 1);
+        h_Pad(h_scratch, h_patch, toInt3(dimspadded), toInt3(dimsregion), 0.0f, 1);
+
+        h_MagAnisotropyCorrect(h_patch, dimsregion, h_scratch, dimsregion, pixelmajor, pixelminor, pixelangle, 4, 1);
+        h_NormBackground(h_scratch, h_patch, toInt3(dimsregion), (uint)(100.0f / 1.057f), true, 1);
+    },
+    [&](int item, const float2* h_spectrum)
+    {
+        GatherPatchSpectrum(h_spectrum, gather.data(), indiceslength, ElementsFFT2(dimsregion), d_outputparticles, precision, (size_t)indiceslength * item);
+    });
+
+    tfloat* h_temp = (tfloat*)MallocAligned(npositions * ElementsFFT2(dimsregion) * sizeof(tcomplex));
+
+    h_CTFSimulate(h_ctfparams, d_ctfcoords, h_temp, (uint)ElementsFFT2(dimsregion), false, npositions);
+    h_MultiplyByVector(d_projections, h_temp, d_projections, ElementsFFT2(dimsregion) * npositions);
+
+    h_IFFTC2R(d_projections, h_temp, 2, toInt3(dimsregion), npositions);
+    h_RemapFullFFT2Full(h_temp, h_temp, toInt3(dimsregion), npositions);
+    h_NormBackground(h_temp, h_temp, toInt3(dimsregion), (uint)(100.0f / 1.057f), false, npositions);
+    h_FFTR2C(h_temp, d_projections, 2, toInt3(dimsregion), npositions);
+    for (int p = 0; p < npositions; p++)
+        GatherPatchSpectrum(d_projections + ElementsFFT2(dimsregion) * p, gather.data(), indiceslength, ElementsFFT2(dimsregion), d_outputprojections, STORAGE_FP32, (size_t)indiceslength * p);
+
+    h_RemapHalfFFT2Half(d_invsigma, d_invsigma, toInt3(dimsregion));
+    h_Remap(d_invsigma, h_indices, d_outputinvsigma, indiceslength, ElementsFFT2(dimsregion), (float)0, 1);
+
+    FreeAligned(h_temp);
+}
+
+namespace
+{
+    // The GPU sums per-block partials that are each divided by probelength, then divides by the number of blocks
+    // along x again; the optimizer in C# is tuned to that scale, so the CPU backend applies the same factor
+    float ParticleShiftNorm(uint probelength)
+    {
+        uint TpB = (uint)tmin((size_t)128, NextMultipleOf(probelength, 32));
+        uint blocks = tmin(128u, (probelength + TpB - 1) / TpB);
+
+        return 1.0f / ((float)probelength * (float)blocks);
+    }
+}
+
+__declspec(dllexport) void ParticleShiftGetDiff(void* d_phase,
+                                                float2* d_average,
+                                                float2* d_shiftfactors,
+                                                float* d_invsigma,
+                                                uint length,
+                                                uint probelength,
+                                                float2* d_shifts,
+                                                float* h_diff,
+                                                uint npositions,
+                                                uint nframes,
+                                                int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(npositions * nframes); specid++)
+    {
+        std::vector<float2> loaded(precision == STORAGE_FP32 ? 0 : probelength);
+        const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length, probelength, loaded.data());
+        float2* h_average = d_average + (size_t)(specid % npositions) * length;
+
+        std::vector<float2> changes(probelength);
+        GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], 0, probelength, changes.data());
+
+        float diffsum = 0.0f;
+        for (uint id = 0; id < probelength; id++)
+        {
+            float2 diff = cmul(h_phase[id], changes[id]) - h_average[id];
+
+            diffsum += (diff.x * diff.x + diff.y * diff.y) * d_invsigma[id];
+        }
+
+        h_diff[specid] = diffsum * ParticleShiftNorm(probelength);
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+__declspec(dllexport) void ParticleShiftGetGrad(void* d_phase,
+                                                float2* d_average,
+                                                float2* d_shiftfactors,
+                                                float* d_invsigma,
+                                                uint length,
+                                                uint probelength,
+                                                float2* d_shifts,
+                                                float2* h_grad,
+                                                uint npositions,
+                                                uint nframes,
+                                                int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(npositions * nframes); specid++)
+    {
+        std::vector<float2> loaded(precision == STORAGE_FP32 ? 0 : probelength);
+        const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length, probelength, loaded.data());
+        float2* h_average = d_average + (size_t)(specid % npositions) * length;
+
+        std::vector<float2> changes(probelength);
+        GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], 0, probelength, changes.data());
+
+        float2 gradsum = make_float2(0.0f, 0.0f);
+        for (uint id = 0; id < probelength; id++)
+        {
+            float2 shiftfactors = d_shiftfactors[id];
+            float2 average = h_average[id];
+            float2 value = cmul(h_phase[id], changes[id]);
+
+            // Analytic limit of the central difference used on the GPU: d|v - a|^2 / ds = 2 * f * Im(conj(a) * v)
+            float common = 2.0f * (average.x * value.y - average.y * value.x) * d_invsigma[id];
+            gradsum.x += common * shiftfactors.x;
+            gradsum.y += common * shiftfactors.y;
+        }
+
+        h_grad[specid] = gradsum * ParticleShiftNorm(probelength);
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+/*
+
+ParticleShiftGetDiff and ParticleShiftGetGrad in one pass, blocked the same way as ShiftGetDiffAndGrad.
+
+*/
+
+#define PARTICLESHIFT_BLOCK 1024
+#define PARTICLESHIFT_FRAMES_PER_ITEM 4
+
+__declspec(dllexport) void ParticleShiftGetDiffAndGrad(void* d_phase,
+                                                        float2* d_average,
+                                                        float2* d_shiftfactors,
+                                                        float* d_invsigma,
+                                                        uint length,
+                                                        uint probelength,
+                                                        float2* d_shifts,
+                                                        float* h_diff,
+                                                        float2* h_grad,
+                                                        uint npositions,
+                                                        uint nframes,
+                                                        int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    int nframegroups = (nframes + PARTICLESHIFT_FRAMES_PER_ITEM - 1) / PARTICLESHIFT_FRAMES_PER_ITEM;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int item = 0; item < (int)npositions * nframegroups; item++)
+    {
+        uint p = item / nframegroups;
+        uint firstframe = (item % nframegroups) * PARTICLESHIFT_FRAMES_PER_ITEM;
+        uint nitemframes = tmin((uint)PARTICLESHIFT_FRAMES_PER_ITEM, nframes - firstframe);
+
+        float2 changes[PARTICLESHIFT_BLOCK];
+        float2 loaded[PARTICLESHIFT_BLOCK];
+
+        float diffsum[PARTICLESHIFT_FRAMES_PER_ITEM] = { 0 };
+        float2 gradsum[PARTICLESHIFT_FRAMES_PER_ITEM];
+        for (uint f = 0; f < nitemframes; f++)
+            gradsum[f] = make_float2(0, 0);
+
+        float2* h_average = d_average + (size_t)length * p;
+
+        for (uint first = 0; first < probelength; first += PARTICLESHIFT_BLOCK)
+        {
+            uint n = tmin((uint)PARTICLESHIFT_BLOCK, probelength - first);
+
+            for (uint f = 0; f < nitemframes; f++)
+            {
+                uint specid = npositions * (firstframe + f) + p;
+                const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length + first, n, loaded);
+                float2* h_factors = d_shiftfactors + first;
+                float* h_invsigma = d_invsigma + first;
+
+                GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], first, n, changes);
+
+                float diff = 0;
+                float2 grad = make_float2(0, 0);
+                for (uint i = 0; i < n; i++)
+                {
+                    float2 value = cmul(h_phase[i], changes[i]);
+                    float2 average = h_average[first + i];
+                    float2 delta = value - average;
+
+                    diff += (delta.x * delta.x + delta.y * delta.y) * h_invsigma[i];
+
+                    float common = 2.0f * (average.x * value.y - average.y * value.x) * h_invsigma[i];
+                    grad.x += common * h_factors[i].x;
+                    grad.y += common * h_factors[i].y;
+                }
+
+                diffsum[f] += diff;
+                gradsum[f] += grad;
+            }
+        }
+
+        for (uint f = 0; f < nitemframes; f++)
+        {
+            uint specid = npositions * (firstframe + f) + p;
+            h_diff[specid] = diffsum[f] * ParticleShiftNorm(probelength);
+            h_grad[specid] = gradsum[f] * ParticleShiftNorm(probelength);
+        }
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
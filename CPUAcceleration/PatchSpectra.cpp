@@ -0,0 +1,94 @@
+#include "Functions.h"
+using namespace gtom;
+
+#define PATCH_GATHER_CHUNK 1024
+
+/*
+
+Patch spectra for CreateShift, CreateParticleShift and CreateParticleSpectra in one pass per patch: the caller
+prepares a patch in real space, it's transformed right away, and the caller takes what it needs from the spectrum,
+all while the patch is still in cache. Every thread works on its own patch, so the scratch memory is a few
+patches per thread instead of a few per extracted region, and there's no batch-wide pass between the steps.
+
+Items are handed out in runs of consecutive items, each run to one thread in order, so callers that accumulate
+several items into the same place can do so without locking, and in a deterministic order.
+
+*/
+
+std::vector<size_t> PatchSpectrumGatherIndices(const size_t* h_indices, uint n, int2 dimsregion)
+{
+    int xhalf = dimsregion.x / 2;
+    size_t elements = ElementsFFT2(dimsregion);
+
+    // Inverse of RemapHalfFFT2Half, which is its own inverse
+    std::vector<size_t> gather(n);
+    for (uint i = 0; i < n; i++)
+    {
+        size_t index = h_indices[i];
+        if (index >= elements)
+        {
+            gather[i] = index;
+            continue;
+        }
+
+        int rx = (int)(index % (xhalf + 1));
+        int ry = (int)(index / (xhalf + 1));
+        int x = xhalf - rx;
+        int y = (dimsregion.y + dimsregion.y / 2 - ry) % dimsregion.y;
+
+        gather[i] = (size_t)y * (xhalf + 1) + x;
+    }
+
+    return gather;
+}
+
+void PatchSpectra(int nitems, int runlength, int2 dimsregion, size_t scratchelements, const PatchPrepare &prepare, const PatchConsume &consume)
+{
+    runlength = tmax(1, runlength);
+    int nruns = (nitems + runlength - 1) / runlength;
+
+    void* plan = h_FFTCreateThreadPlan(2, toInt3(dimsregion), true);
+
+    #pragma omp parallel
+    {
+        float* h_patch = (float*)MallocAligned(Elements2(dimsregion) * sizeof(float));
+        float2* h_spectrum = (float2*)MallocAligned(ElementsFFT2(dimsregion) * sizeof(float2));
+        float* h_scratch = scratchelements > 0 ? (float*)MallocAligned(scratchelements * sizeof(float)) : NULL;
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int run = 0; run < nruns; run++)
+            for (int item = run * runlength; item < tmin(nitems, (run + 1) * runlength); item++)
+            {
+                prepare(item, h_patch, h_scratch);
+                h_FFTExecuteR2C(plan, h_patch, h_spectrum);
+                consume(item, h_spectrum);
+            }
+
+        if (h_scratch != NULL)
+            FreeAligned(h_scratch);
+        FreeAligned(h_spectrum);
+        FreeAligned(h_patch);
+    }
+
+    h_FFTDestroyThreadPlan(plan);
+}
+
+void GatherPatchSpectrum(const float2* h_spectrum, const size_t* h_gather, uint n, size_t elements, void* h_output, int precision, size_t first)
+{
+    float2 gathered[PATCH_GATHER_CHUNK];
+
+    for (uint start = 0; start < n; start += PATCH_GATHER_CHUNK)
+    {
+        uint count = tmin((uint)PATCH_GATHER_CHUNK, n - start);
+        float2* h_target = precision == STORAGE_FP32 ? (float2*)h_output + first + start : gathered;
+
+        for (uint i = 0; i < count; i++)
+        {
+            size_t index = h_gather[start + i];
+            h_target[i] = index < elements ? h_spectrum[index] : make_float2(0.0f, 0.0f);
+        }
+
+        if (precision != STORAGE_FP32)
+            h_StoreComplex(gathered, h_output, precision, first + start, count);
+    }
+}
@@ -0,0 +1,138 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+Polishing works on sums of frame groups. A group is a range of consecutive frames, and ranges can have any
+length and may overlap, e.g. shorter groups for the first, least damaged frames, or a sliding window. Each
+frame can additionally be weighted, e.g. by its dose. Every group sum is masked with a soft sphere, transformed
+and cropped to dimscropped.
+
+Each thread takes one particle at a time through all groups (see PatchSpectra), so the scratch memory is a few
+particles per thread, and the particle's frames stay in cache from one group to the next. batchsize only
+matters to the GPU backend.
+
+Layouts: d_particles holds nparticles particles per frame, frame after frame; d_particlesft holds nparticles
+transforms per group, group after group, stored with the given STORAGE_* precision, which PolishingGetDiff
+takes for d_phase.
+
+*/
+
+__declspec(dllexport) void CreatePolishingGroups(float* d_particles,
+                                                 void* d_particlesft,
+                                                 int2 dims,
+                                                 int2 dimscropped,
+                                                 int nparticles,
+                                                 int nframes,
+                                                 int* h_groupfirst,
+                                                 int* h_grouplength,
+                                                 int ngroups,
+                                                 float* h_frameweights,
+                                                 float maskradius,
+                                                 float maskfalloff,
+                                                 int batchsize,
+                                                 int precision)
+{
+    size_t elements = Elements2(dims);
+
+    PatchSpectra(nparticles * ngroups, ngroups, dims, elements, [&](int item, float* h_patch, float* h_scratch)
+    {
+        int p = item / ngroups, g = item % ngroups;
+
+        for (size_t i = 0; i < elements; i++)
+        {
+            float sum = 0.0f;
+            for (int z = h_groupfirst[g]; z < h_groupfirst[g] + h_grouplength[g]; z++)
+                sum += d_particles[elements * ((size_t)nparticles * z + p) + i] * (h_frameweights != NULL ? h_frameweights[z] : 1.0f);
+
+            h_scratch[i] = sum;
+        }
+
+        if (maskradius > 0)
+            h_SphereMask(h_scratch, h_scratch, toInt3(dims), maskradius, maskfalloff, 1);
+        h_RemapFull2FullFFT(h_scratch, h_patch, toInt3(dims));
+    },
+    [&](int item, const float2* h_spectrum)
+    {
+        int p = item / ngroups, g = item % ngroups;
+
+        size_t offset = ElementsFFT2(dimscropped) * ((size_t)nparticles * g + p);
+
+        if (precision == STORAGE_FP32)
+        {
+            h_FFTCrop((float2*)h_spectrum, (float2*)d_particlesft + offset, toInt3(dims), toInt3(dimscropped));
+        }
+        else
+        {
+            std::vector<float2> cropped(ElementsFFT2(dimscropped));
+            h_FFTCrop((float2*)h_spectrum, cropped.data(), toInt3(dims), toInt3(dimscropped));
+            h_StoreComplex(cropped.data(), d_particlesft, precision, offset, cropped.size());
+        }
+    });
+}
+
+// Groups of 3 frames, remaining frames are left out
+__declspec(dllexport) void CreatePolishing(float* d_particles, float2* d_particlesft, float* d_masks, int2 dims, int2 dimscropped, int nparticles, int nframes)
+{
+    std::vector<int> groupfirst(nframes / 3), grouplength(nframes / 3, 3);
+    for (int g = 0; g < nframes / 3; g++)
+        groupfirst[g] = g * 3;
+
+    CreatePolishingGroups(d_particles, d_particlesft, dims, dimscropped, nparticles, nframes,
+                          groupfirst.data(), grouplength.data(), nframes / 3, NULL,
+                          90.0f / (1.0605f / 1.25f), 24, 0, STORAGE_FP32);
+}
+
+__declspec(dllexport) void PolishingGetDiff(void* d_phase,
+                                            float2* d_average,
+                                            float2* d_shiftfactors,
+                                            float2* d_ctfcoords,
+                                            CTFParams* h_ctfparams,
+                                            float* d_invsigma,
+                                            int2 dims,
+                                            float2* d_shifts,
+                                            float* h_diff,
+                                            float* h_diffall,
+                                            uint npositions,
+                                            uint nframes,
+                                            int precision)
+{
+    uint length = (uint)ElementsFFT2(dims);
+
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, length, d_shifts, npositions * nframes, &ramps);
+
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(npositions * nframes); specid++)
+    {
+        std::vector<float2> loaded(precision == STORAGE_FP32 ? 0 : length);
+        const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length, length, loaded.data());
+        float2* h_average = d_average + (size_t)specid * length;
+        CTFParamsLean ctfparams(h_ctfparams[specid], toInt3(dims));
+
+        std::vector<float2> changes(length);
+        GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], 0, length, changes.data());
+
+        float numsum = 0.0f, denomsum1 = 0.0f, denomsum2 = 0.0f;
+
+        for (uint id = 0; id < length; id++)
+        {
+            float2 value = cmul(h_phase[id], changes[id]);
+            float2 average = h_average[id] * h_GetCTF(d_ctfcoords[id].x, d_ctfcoords[id].y, ctfparams, false);  // Already corrected for mag anisotropy.
+
+            float invsigma = d_invsigma[id];
+            value *= invsigma;
+            average *= invsigma;
+
+            numsum += dotp2(value, average);
+            denomsum1 += dotp2(value, value);
+            denomsum2 += dotp2(average, average);
+        }
+
+        h_diffall[specid] = numsum / tmax(1e-6f, sqrt(denomsum1 * denomsum2));
+    }
+
+    ReleasePhaseRamps(&ramps);
+
+    h_ReduceMean(h_diffall, h_diff, npositions, nframes);
+}
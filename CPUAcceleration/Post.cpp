@@ -0,0 +1,44 @@
+#include "Functions.h"
+using namespace gtom;
+
+__declspec(dllexport) void GetMotionFilter(float* d_output, int3 dims, float3* h_shifts, uint nshifts, uint batch)
+{
+    size_t elements = ElementsFFT2(dims);
+    tcomplex* h_phases = MallocAlignedValueFilled(elements * nshifts * batch, make_cuComplex(1.0f, 0.0f));
+    tcomplex* h_meanphases = (tcomplex*)MallocAligned(elements * batch * sizeof(tcomplex));
+
+    h_Shift(h_phases, h_phases, dims, (tfloat3*)h_shifts, nshifts * batch);
+    h_ReduceMean(h_phases, h_meanphases, elements, nshifts, batch);
+    h_Abs(h_meanphases, d_output, elements * batch);
+
+    FreeAligned(h_meanphases);
+    FreeAligned(h_phases);
+}
+
+__declspec(dllexport) void CorrectMagAnisotropy(float* d_image, int2 dimsimage, float* d_scaled, int2 dimsscaled, float majorpixel, float minorpixel, float majorangle, uint supersample, uint batch)
+{
+    h_MagAnisotropyCorrect(d_image, dimsimage, d_scaled, dimsscaled, majorpixel, minorpixel, majorangle, supersample, batch);
+}
+
+__declspec(dllexport) void DoseWeighting(float* d_freq,
+                                        float* d_output,
+                                        uint length,
+                                        float* h_dose,
+                                        float3 nikoconst,
+                                        uint batch)
+{
+    // Critical exposure after Grant & Grigorieff: Ne = a * k^b + c
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)length * batch; i++)
+    {
+        float freq = d_freq[i % length];
+        float criticaldose = nikoconst.x * pow(freq, nikoconst.y) + nikoconst.z;
+
+        d_output[i] = exp(-h_dose[i / length] / (2.0f * criticaldose));
+    }
+}
+
+__declspec(dllexport) void NormParticles(float* d_input, float* d_output, int3 dims, uint particleradius, bool flipsign, uint batch)
+{
+    h_NormBackground(d_input, d_output, dims, particleradius, flipsign, batch);
+}
@@ -0,0 +1,166 @@
+#include "Functions.h"
+#include <immintrin.h>
+using namespace gtom;
+
+/*
+
+fp16 and bf16 storage for spectrum and phase buffers. Values are converted to fp32 block by block right
+before they're used, so all arithmetic and accumulation stays in fp32 while the buffers take half the memory.
+
+fp16 conversions use F16C (every AVX2 CPU has it; MSVC doesn't define __F16C__, hence the __AVX2__ test), or
+AVX-512F when the build enables it, both rounding to nearest even like __float2half. bf16 is plain integer work
+on the upper half of each float. Tails and builds without these go through the scalar conversions in
+Prerequisites.h, which give the same results bit for bit.
+
+*/
+
+#if defined(__F16C__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define PRECISION_F16C
+#endif
+
+#define PRECISION_CHUNK 65536
+
+namespace
+{
+    void FloatToHalf(const float* h_input, half* h_output, size_t n)
+    {
+        size_t i = 0;
+#ifdef __AVX512F__
+        for (; i + 16 <= n; i += 16)
+            _mm256_storeu_si256((__m256i*)(h_output + i), _mm512_cvtps_ph(_mm512_loadu_ps(h_input + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+#endif
+#ifdef PRECISION_F16C
+        for (; i + 8 <= n; i += 8)
+            _mm_storeu_si128((__m128i*)(h_output + i), _mm256_cvtps_ph(_mm256_loadu_ps(h_input + i), _MM_FROUND_TO_NEAREST_INT));
+#endif
+        for (; i < n; i++)
+            h_output[i] = __float2half(h_input[i]);
+    }
+
+    void HalfToFloat(const half* h_input, float* h_output, size_t n)
+    {
+        size_t i = 0;
+#ifdef __AVX512F__
+        for (; i + 16 <= n; i += 16)
+            _mm512_storeu_ps(h_output + i, _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i*)(h_input + i))));
+#endif
+#ifdef PRECISION_F16C
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(h_output + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h_input + i))));
+#endif
+        for (; i < n; i++)
+            h_output[i] = __half2float(h_input[i]);
+    }
+
+#ifdef __AVX2__
+    // Same rounding as __float2bfloat16, result in the lower 16 bits of each lane
+    inline __m256i RoundToBFloat16(__m256i bits)
+    {
+        const __m256i One = _mm256_set1_epi32(1), Bias = _mm256_set1_epi32(0x7fff);
+        const __m256i AbsMask = _mm256_set1_epi32(0x7fffffff), Infinity = _mm256_set1_epi32(0x7f800000), Quiet = _mm256_set1_epi32(0x400000);
+
+        __m256i lsb = _mm256_and_si256(_mm256_srli_epi32(bits, 16), One);
+        __m256i rounded = _mm256_add_epi32(bits, _mm256_add_epi32(Bias, lsb));
+        __m256i isnan = _mm256_cmpgt_epi32(_mm256_and_si256(bits, AbsMask), Infinity);
+
+        return _mm256_srli_epi32(_mm256_blendv_epi8(rounded, _mm256_or_si256(bits, Quiet), isnan), 16);
+    }
+#endif
+
+    void FloatToBFloat16(const float* h_input, bfloat16* h_output, size_t n)
+    {
+        size_t i = 0;
+#ifdef __AVX2__
+        for (; i + 16 <= n; i += 16)
+        {
+            __m256i lower = RoundToBFloat16(_mm256_castps_si256(_mm256_loadu_ps(h_input + i)));
+            __m256i upper = RoundToBFloat16(_mm256_castps_si256(_mm256_loadu_ps(h_input + i + 8)));
+
+            // packus interleaves the 128-bit lanes of both operands, the permute puts them back in order
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi32(lower, upper), 0xD8);
+            _mm256_storeu_si256((__m256i*)(h_output + i), packed);
+        }
+#endif
+        for (; i < n; i++)
+            h_output[i] = __float2bfloat16(h_input[i]);
+    }
+
+    void BFloat16ToFloat(const bfloat16* h_input, float* h_output, size_t n)
+    {
+        size_t i = 0;
+#ifdef __AVX2__
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256i bits = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h_input + i))), 16);
+            _mm256_storeu_ps(h_output + i, _mm256_castsi256_ps(bits));
+        }
+#endif
+        for (; i < n; i++)
+            h_output[i] = __bfloat162float(h_input[i]);
+    }
+}
+
+void gtom::h_ConvertToStorage(const float* h_input, void* h_output, size_t n, int precision)
+{
+    if (precision == STORAGE_FP16)
+        FloatToHalf(h_input, (half*)h_output, n);
+    else if (precision == STORAGE_BF16)
+        FloatToBFloat16(h_input, (bfloat16*)h_output, n);
+    else if (h_output != h_input)
+        memmove(h_output, h_input, n * sizeof(float));
+}
+
+void gtom::h_ConvertFromStorage(const void* h_input, float* h_output, size_t n, int precision)
+{
+    if (precision == STORAGE_FP16)
+        HalfToFloat((const half*)h_input, h_output, n);
+    else if (precision == STORAGE_BF16)
+        BFloat16ToFloat((const bfloat16*)h_input, h_output, n);
+    else if (h_output != h_input)
+        memmove(h_output, h_input, n * sizeof(float));
+}
+
+const float2* gtom::h_LoadComplex(const void* h_data, int precision, size_t first, size_t n, float2* h_buffer)
+{
+    if (precision == STORAGE_FP32)
+        return (const float2*)h_data + first;
+
+    h_ConvertFromStorage((const char*)h_data + first * 2 * StorageBytes(precision), (float*)h_buffer, n * 2, precision);
+    return h_buffer;
+}
+
+void gtom::h_StoreComplex(const float2* h_values, void* h_data, int precision, size_t first, size_t n)
+{
+    h_ConvertToStorage((const float*)h_values, (char*)h_data + first * 2 * StorageBytes(precision), n * 2, precision);
+}
+
+__declspec(dllexport) void* __stdcall MallocDeviceStorage(long elements, int precision)
+{
+    return MallocAligned((size_t)elements * StorageBytes(precision));
+}
+
+__declspec(dllexport) void __stdcall SingleToStorage(float* d_source, void* d_dest, long elements, int precision)
+{
+    long nchunks = (elements + PRECISION_CHUNK - 1) / PRECISION_CHUNK;
+
+    #pragma omp parallel for
+    for (long c = 0; c < nchunks; c++)
+    {
+        size_t first = (size_t)c * PRECISION_CHUNK;
+        size_t n = tmin((size_t)PRECISION_CHUNK, (size_t)elements - first);
+        h_ConvertToStorage(d_source + first, (char*)d_dest + first * StorageBytes(precision), n, precision);
+    }
+}
+
+__declspec(dllexport) void __stdcall StorageToSingle(void* d_source, float* d_dest, long elements, int precision)
+{
+    long nchunks = (elements + PRECISION_CHUNK - 1) / PRECISION_CHUNK;
+
+    #pragma omp parallel for
+    for (long c = 0; c < nchunks; c++)
+    {
+        size_t first = (size_t)c * PRECISION_CHUNK;
+        size_t n = tmin((size_t)PRECISION_CHUNK, (size_t)elements - first);
+        h_ConvertFromStorage((const char*)d_source + first * StorageBytes(precision), d_dest + first, n, precision);
+    }
+}
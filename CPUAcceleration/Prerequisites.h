@@ -0,0 +1,290 @@
+#ifndef PREREQUISITES_H
+#define PREREQUISITES_H
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include <omp.h>
+
+/*
+
+Stand-ins for the parts of CUDA and GTOM that the exported signatures depend on,
+so that the CPU backend can be built without either toolkit and still present
+the exact C ABI of GPUAcceleration.
+
+*/
+
+#ifndef _MSC_VER
+#define __declspec(x) __attribute__((visibility("default")))
+#define __stdcall
+#endif
+
+#ifndef PI
+#define PI 3.1415926535897932384626433832795
+#endif
+
+#define CPU_ALIGNMENT 64
+
+typedef unsigned int uint;
+
+// Vector types:
+
+struct int2 { int x, y; };
+struct int3 { int x, y, z; };
+struct float2 { float x, y; };
+struct float3 { float x, y, z; };
+struct float4 { float x, y, z, w; };
+
+inline int2 make_int2(int x, int y) { int2 r = { x, y }; return r; }
+inline int3 make_int3(int x, int y, int z) { int3 r = { x, y, z }; return r; }
+inline float2 make_float2(float x, float y) { float2 r = { x, y }; return r; }
+inline float3 make_float3(float x, float y, float z) { float3 r = { x, y, z }; return r; }
+inline float4 make_float4(float x, float y, float z, float w) { float4 r = { x, y, z, w }; return r; }
+inline float2 make_cuComplex(float x, float y) { return make_float2(x, y); }
+
+inline float2 operator+(float2 a, float2 b) { return make_float2(a.x + b.x, a.y + b.y); }
+inline float2 operator-(float2 a, float2 b) { return make_float2(a.x - b.x, a.y - b.y); }
+inline float2 operator*(float2 a, float s) { return make_float2(a.x * s, a.y * s); }
+inline float2 operator*(float s, float2 a) { return make_float2(a.x * s, a.y * s); }
+inline float2 operator/(float2 a, float s) { return make_float2(a.x / s, a.y / s); }
+inline void operator+=(float2 &a, float2 b) { a.x += b.x; a.y += b.y; }
+inline void operator-=(float2 &a, float2 b) { a.x -= b.x; a.y -= b.y; }
+inline void operator*=(float2 &a, float s) { a.x *= s; a.y *= s; }
+inline void operator/=(float2 &a, float s) { a.x /= s; a.y /= s; }
+
+inline float3 operator+(float3 a, float3 b) { return make_float3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline float3 operator-(float3 a, float3 b) { return make_float3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline float3 operator*(float3 a, float s) { return make_float3(a.x * s, a.y * s, a.z * s); }
+
+inline int2 operator*(int2 a, int s) { return make_int2(a.x * s, a.y * s); }
+
+inline float dotp2(float2 a, float2 b) { return a.x * b.x + a.y * b.y; }
+inline float2 cmul(float2 a, float2 b) { return make_float2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x); }
+inline float2 cconj(float2 a) { return make_float2(a.x, -a.y); }
+inline float2 cuCmulf(float2 a, float2 b) { return cmul(a, b); }
+
+// Half precision, stored as raw IEEE 754 binary16:
+
+struct half { unsigned short x; };
+struct half2 { half x, y; };
+
+inline float __half2float(half h)
+{
+    uint sign = (uint)(h.x & 0x8000) << 16;
+    uint exponent = (h.x >> 10) & 0x1f;
+    uint mantissa = h.x & 0x3ff;
+    uint bits;
+
+    if (exponent == 0)
+    {
+        if (mantissa == 0)
+            bits = sign;
+        else
+        {
+            exponent = 113;
+            while (!(mantissa & 0x400))
+            {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else if (exponent == 0x1f)
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+inline half __float2half(float f)
+{
+    uint bits;
+    memcpy(&bits, &f, sizeof(float));
+
+    uint sign = (bits >> 16) & 0x8000;
+    uint absbits = bits & 0x7fffffff;
+    uint value;
+
+    if (absbits >= 0x7f800000)          // Inf or NaN
+        value = absbits > 0x7f800000 ? 0x7e00 : 0x7c00;
+    else if (absbits >= 0x477ff000)     // Rounds to more than 65504
+        value = 0x7c00;
+    else if (absbits < 0x38800000)      // Subnormal in half precision
+    {
+        if (absbits < 0x33000000)
+            value = 0;
+        else
+        {
+            uint shift = 126 - (absbits >> 23);
+            uint mantissa = (absbits & 0x7fffff) | 0x800000;
+            uint remainder = mantissa & ((1u << shift) - 1);
+            uint halfway = 1u << (shift - 1);
+            value = mantissa >> shift;
+            if (remainder > halfway || (remainder == halfway && (value & 1)))
+                value++;
+        }
+    }
+    else
+    {
+        uint rebiased = absbits - 0x38000000;
+        uint remainder = rebiased & 0x1fff;
+        value = rebiased >> 13;
+        if (remainder > 0x1000 || (remainder == 0x1000 && (value & 1)))
+            value++;
+    }
+
+    half result;
+    result.x = (unsigned short)(sign | value);
+    return result;
+}
+
+inline float2 __half22float2(half2 h) { return make_float2(__half2float(h.x), __half2float(h.y)); }
+inline half2 __float22half2_rn(float2 f) { half2 r = { __float2half(f.x), __float2half(f.y) }; return r; }
+
+// bfloat16, the upper half of an IEEE 754 binary32: float's range with 8 bits of mantissa:
+
+struct bfloat16 { unsigned short x; };
+struct bfloat162 { bfloat16 x, y; };
+
+inline float __bfloat162float(bfloat16 h)
+{
+    uint bits = (uint)h.x << 16;
+
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+inline bfloat16 __float2bfloat16(float f)
+{
+    uint bits;
+    memcpy(&bits, &f, sizeof(float));
+
+    bfloat16 result;
+    if ((bits & 0x7fffffff) > 0x7f800000)   // NaN stays NaN, quieted
+        result.x = (unsigned short)((bits >> 16) | 0x40);
+    else                                    // Round to nearest even, overflows to Inf as it should
+        result.x = (unsigned short)((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+
+    return result;
+}
+
+inline float2 __bfloat1622float2(bfloat162 h) { return make_float2(__bfloat162float(h.x), __bfloat162float(h.y)); }
+inline bfloat162 __float22bfloat162_rn(float2 f) { bfloat162 r = { __float2bfloat16(f.x), __float2bfloat16(f.y) }; return r; }
+
+typedef int cufftHandle;
+
+namespace gtom
+{
+    typedef float tfloat;
+    typedef float2 tcomplex;
+    typedef float3 tfloat3;
+
+    template <class T> inline T tmin(T a, T b) { return a < b ? a : b; }
+    template <class T> inline T tmax(T a, T b) { return a > b ? a : b; }
+    template <class T> inline int sgn(T val) { return (T(0) < val) - (val < T(0)); }
+
+    inline int2 toInt2(int x, int y) { return make_int2(x, y); }
+    inline int3 toInt3(int x, int y, int z) { return make_int3(x, y, z); }
+    inline int3 toInt3(int2 v) { return make_int3(v.x, v.y, 1); }
+    inline int3 toInt3FFT(int2 v) { return make_int3(v.x / 2 + 1, v.y, 1); }
+    inline int3 toInt3FFT(int3 v) { return make_int3(v.x / 2 + 1, v.y, v.z); }
+
+    inline size_t Elements(int3 dims) { return (size_t)dims.x * dims.y * dims.z; }
+    inline size_t Elements2(int2 dims) { return (size_t)dims.x * dims.y; }
+    inline size_t Elements2(int3 dims) { return (size_t)dims.x * dims.y; }
+    inline size_t ElementsFFT(int3 dims) { return (size_t)(dims.x / 2 + 1) * dims.y * dims.z; }
+    inline size_t ElementsFFT2(int2 dims) { return (size_t)(dims.x / 2 + 1) * dims.y; }
+    inline size_t ElementsFFT2(int3 dims) { return (size_t)(dims.x / 2 + 1) * dims.y; }
+    inline int DimensionCount(int3 dims) { return dims.z > 1 ? 3 : (dims.y > 1 ? 2 : 1); }
+    inline size_t NextMultipleOf(size_t value, size_t base) { return (value + base - 1) / base * base; }
+
+    // Same field order as CTFStruct on the C# side, everything in SI units.
+    struct CTFParams
+    {
+        tfloat pixelsize;
+        tfloat pixeldelta;
+        tfloat pixelangle;
+        tfloat Cs;
+        tfloat voltage;
+        tfloat defocus;
+        tfloat astigmatismangle;
+        tfloat defocusdelta;
+        tfloat amplitude;
+        tfloat Bfactor;
+        tfloat scale;
+        tfloat phaseshift;
+    };
+
+    // Ranges are (min, max, step), relative to the start parameters.
+    struct CTFFitParams
+    {
+        tfloat3 pixelsize;
+        tfloat3 pixeldelta;
+        tfloat3 pixelangle;
+        tfloat3 Cs;
+        tfloat3 voltage;
+        tfloat3 defocus;
+        tfloat3 astigmatismangle;
+        tfloat3 defocusdelta;
+        tfloat3 amplitude;
+        tfloat3 Bfactor;
+        tfloat3 scale;
+        tfloat3 phaseshift;
+
+        int2 dimsperiodogram;
+        int maskinnerradius;
+        int maskouterradius;
+    };
+
+    // Parameters converted to Angstrom and with all per-pixel invariants precomputed.
+    struct CTFParamsLean
+    {
+        tfloat ny;
+        tfloat pixelsize;
+        tfloat pixeldelta;
+        tfloat pixelangle;
+        tfloat lambda;
+        tfloat defocus;
+        tfloat astigmatismangle;
+        tfloat defocusdelta;
+        tfloat amplitude;
+        tfloat Cs;
+        tfloat scale;
+        tfloat phaseshift;
+        tfloat K1, K2, K3;
+        tfloat Bfactor;
+
+        CTFParamsLean() {}
+
+        CTFParamsLean(CTFParams p, int3 dims) :
+            ny(1.0f / (tfloat)dims.x),
+            pixelsize(p.pixelsize * 1e10f),
+            pixeldelta(p.pixeldelta * 1e10f),
+            pixelangle(p.pixelangle),
+            lambda((tfloat)(12.2643247 / sqrt((double)p.voltage * (1.0 + (double)p.voltage * 0.978466e-6)))),
+            defocus(p.defocus * 1e10f),
+            astigmatismangle(p.astigmatismangle),
+            defocusdelta(p.defocusdelta * 0.5e10f),
+            amplitude(p.amplitude),
+            Cs(p.Cs * 1e10f),
+            scale(p.scale),
+            phaseshift(p.phaseshift),
+            K1((tfloat)PI * lambda),
+            K2((tfloat)PI * 0.5f * Cs * lambda * lambda * lambda),
+            K3(sqrt(1.0f - p.amplitude * p.amplitude)),
+            Bfactor(p.Bfactor * 0.25e20f)
+        {
+        }
+    };
+}
+
+#endif
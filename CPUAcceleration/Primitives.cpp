@@ -0,0 +1,356 @@
+#include "Functions.h"
+using namespace gtom;
+
+namespace
+{
+    // Signed frequency for index i along an axis of length n in FFTW layout.
+    inline int FFTFrequency(int i, int n)
+    {
+        return i < (n + 1) / 2 ? i : i - n;
+    }
+
+    // Applies a real-valued radial filter, computed by weight(kx, ky, kz), in Fourier space.
+    template <class F> void FourierFilter(float* h_input, float* h_output, int3 dims, int batch, F weight)
+    {
+        int ndims = DimensionCount(dims);
+        float2* h_inputft = (float2*)MallocAligned(ElementsFFT(dims) * batch * sizeof(float2));
+        h_FFTR2C(h_input, h_inputft, ndims, dims, batch);
+
+        int xhalf = dims.x / 2 + 1;
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)ElementsFFT(dims) * batch; i++)
+        {
+            size_t e = (size_t)i % ElementsFFT(dims);
+            int kx = (int)(e % xhalf);
+            int ky = FFTFrequency((int)(e / xhalf % dims.y), dims.y);
+            int kz = FFTFrequency((int)(e / xhalf / dims.y), dims.z);
+
+            h_inputft[i] *= weight(kx, ky, kz);
+        }
+
+        h_IFFTC2R(h_inputft, h_output, ndims, dims, batch);
+        FreeAligned(h_inputft);
+    }
+
+    inline float RadiusFromCenter(int x, int y, int z, int3 dims)
+    {
+        float dx = (float)(x - dims.x / 2);
+        float dy = (float)(y - dims.y / 2);
+        float dz = (float)(z - dims.z / 2);
+
+        return sqrt(dx * dx + dy * dy + dz * dz);
+    }
+}
+
+// Half precision arithmetics, computed in single precision:
+
+void gtom::h_AddVector(half* h_input, half* h_summands, half* h_output, size_t elements, int batch)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+        h_output[i] = __float2half(__half2float(h_input[i]) + __half2float(h_summands[i % elements]));
+}
+
+void gtom::h_SubtractVector(half* h_input, half* h_subtrahends, half* h_output, size_t elements, int batch)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+        h_output[i] = __float2half(__half2float(h_input[i]) - __half2float(h_subtrahends[i % elements]));
+}
+
+void gtom::h_MultiplyByVector(half* h_input, half* h_multiplicators, half* h_output, size_t elements, int batch)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+        h_output[i] = __float2half(__half2float(h_input[i]) * __half2float(h_multiplicators[i % elements]));
+}
+
+void gtom::h_ReduceMean(half* h_input, half* h_output, size_t vectorlength, int nvectors, int batch)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)vectorlength * batch; i++)
+    {
+        size_t b = (size_t)i / vectorlength, e = (size_t)i % vectorlength;
+        half* h_batchinput = h_input + vectorlength * nvectors * b;
+
+        float sum = 0.0f;
+        for (int n = 0; n < nvectors; n++)
+            sum += __half2float(h_batchinput[vectorlength * n + e]);
+
+        h_output[i] = __float2half(sum / (float)nvectors);
+    }
+}
+
+// Element-wise:
+
+void gtom::h_AddScalar(float* h_input, float* h_output, size_t elements, float summand)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements; i++)
+        h_output[i] = h_input[i] + summand;
+}
+
+void gtom::h_Log(float* h_input, float* h_output, size_t elements)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements; i++)
+        h_output[i] = log(h_input[i]);
+}
+
+void gtom::h_Abs(float* h_input, float* h_output, size_t elements)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements; i++)
+        h_output[i] = abs(h_input[i]);
+}
+
+void gtom::h_Abs(float2* h_input, float* h_output, size_t elements)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements; i++)
+        h_output[i] = sqrt(h_input[i].x * h_input[i].x + h_input[i].y * h_input[i].y);
+}
+
+void gtom::h_Sign(float* h_input, float* h_output, size_t elements)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements; i++)
+        h_output[i] = (float)sgn(h_input[i]);
+}
+
+void gtom::h_SumMonolithic(float* h_input, float* h_output, size_t elements, int batch)
+{
+    #pragma omp parallel for
+    for (int b = 0; b < batch; b++)
+    {
+        double sum = 0;
+        float* h_batchinput = h_input + elements * b;
+        for (size_t i = 0; i < elements; i++)
+            sum += h_batchinput[i];
+
+        h_output[b] = (float)sum;
+    }
+}
+
+// Padding:
+
+void gtom::h_Pad(float* h_input, float* h_output, int3 olddims, int3 newdims, float value, int batch)
+{
+    int3 offset = make_int3(newdims.x / 2 - olddims.x / 2, newdims.y / 2 - olddims.y / 2, newdims.z / 2 - olddims.z / 2);
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)Elements(newdims) * batch; i++)
+    {
+        size_t b = (size_t)i / Elements(newdims), e = (size_t)i % Elements(newdims);
+        int x = (int)(e % newdims.x) - offset.x;
+        int y = (int)(e / newdims.x % newdims.y) - offset.y;
+        int z = (int)(e / newdims.x / newdims.y) - offset.z;
+
+        if (x < 0 || y < 0 || z < 0 || x >= olddims.x || y >= olddims.y || z >= olddims.z)
+            h_output[i] = value;
+        else
+            h_output[i] = h_input[Elements(olddims) * b + ((size_t)z * olddims.y + y) * olddims.x + x];
+    }
+}
+
+void gtom::h_FFTPad(float2* h_input, float2* h_output, int3 olddims, int3 newdims, int batch)
+{
+    size_t elementsold = ElementsFFT(olddims), elementsnew = ElementsFFT(newdims);
+    int oldxhalf = olddims.x / 2 + 1, newxhalf = newdims.x / 2 + 1;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elementsnew * batch; i++)
+    {
+        size_t b = (size_t)i / elementsnew, e = (size_t)i % elementsnew;
+        int x = (int)(e % newxhalf);
+        int ky = FFTFrequency((int)(e / newxhalf % newdims.y), newdims.y);
+        int kz = FFTFrequency((int)(e / newxhalf / newdims.y), newdims.z);
+
+        if (x >= oldxhalf || ky >= (olddims.y + 1) / 2 || ky < -(olddims.y / 2) || kz >= (olddims.z + 1) / 2 || kz < -(olddims.z / 2))
+        {
+            h_output[i] = make_float2(0, 0);
+            continue;
+        }
+
+        int y = ky < 0 ? ky + olddims.y : ky;
+        int z = kz < 0 ? kz + olddims.z : kz;
+        h_output[i] = h_input[elementsold * b + ((size_t)z * olddims.y + y) * oldxhalf + x];
+    }
+}
+
+void gtom::h_FFTCrop(float2* h_input, float2* h_output, int3 olddims, int3 newdims, int batch)
+{
+    size_t elementsold = ElementsFFT(olddims), elementsnew = ElementsFFT(newdims);
+    int oldxhalf = olddims.x / 2 + 1, newxhalf = newdims.x / 2 + 1;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elementsnew * batch; i++)
+    {
+        size_t b = (size_t)i / elementsnew, e = (size_t)i % elementsnew;
+        int x = (int)(e % newxhalf);
+        int ky = FFTFrequency((int)(e / newxhalf % newdims.y), newdims.y);
+        int kz = FFTFrequency((int)(e / newxhalf / newdims.y), newdims.z);
+
+        int y = ky < 0 ? ky + olddims.y : ky;
+        int z = kz < 0 ? kz + olddims.z : kz;
+        h_output[i] = h_input[elementsold * b + ((size_t)z * olddims.y + y) * oldxhalf + x];
+    }
+}
+
+// Normalization:
+
+void gtom::h_NormMonolithic(float* h_input, float* h_output, size_t elements, int batch)
+{
+    #pragma omp parallel for
+    for (int b = 0; b < batch; b++)
+    {
+        float* h_in = h_input + elements * b;
+        float* h_out = h_output + elements * b;
+
+        double sum1 = 0, sum2 = 0;
+        for (size_t i = 0; i < elements; i++)
+        {
+            sum1 += h_in[i];
+            sum2 += (double)h_in[i] * h_in[i];
+        }
+
+        double mean = sum1 / elements;
+        double stddev = sqrt(tmax(0.0, sum2 / elements - mean * mean));
+        float scale = stddev > 0 ? (float)(1.0 / stddev) : 0.0f;
+
+        for (size_t i = 0; i < elements; i++)
+            h_out[i] = (h_in[i] - (float)mean) * scale;
+    }
+}
+
+void gtom::h_NormMonolithic(float* h_input, float* h_output, size_t elements, float* h_mask, int batch)
+{
+    #pragma omp parallel for
+    for (int b = 0; b < batch; b++)
+    {
+        float* h_in = h_input + elements * b;
+        float* h_out = h_output + elements * b;
+        float* h_batchmask = h_mask + elements * b;
+
+        double sum1 = 0, sum2 = 0, samples = 0;
+        for (size_t i = 0; i < elements; i++)
+        {
+            sum1 += h_in[i] * h_batchmask[i];
+            sum2 += (double)h_in[i] * h_in[i] * h_batchmask[i];
+            samples += h_batchmask[i];
+        }
+
+        samples = tmax(samples, 1e-6);
+        double mean = sum1 / samples;
+        double stddev = sqrt(tmax(0.0, sum2 / samples - mean * mean));
+        float scale = stddev > 0 ? (float)(1.0 / stddev) : 0.0f;
+
+        for (size_t i = 0; i < elements; i++)
+            h_out[i] = (h_in[i] - (float)mean) * scale;
+    }
+}
+
+void gtom::h_NormBackground(float* h_input, float* h_output, int3 dims, uint particleradius, bool flipsign, int batch)
+{
+    size_t elements = Elements(dims);
+
+    #pragma omp parallel for
+    for (int b = 0; b < batch; b++)
+    {
+        float* h_in = h_input + elements * b;
+        float* h_out = h_output + elements * b;
+
+        double sum1 = 0, sum2 = 0;
+        size_t samples = 0;
+        for (int z = 0; z < dims.z; z++)
+            for (int y = 0; y < dims.y; y++)
+                for (int x = 0; x < dims.x; x++)
+                {
+                    if (RadiusFromCenter(x, y, z, dims) <= (float)particleradius)
+                        continue;
+
+                    float val = h_in[((size_t)z * dims.y + y) * dims.x + x];
+                    sum1 += val;
+                    sum2 += (double)val * val;
+                    samples++;
+                }
+
+        double mean = samples > 0 ? sum1 / samples : 0.0;
+        double stddev = samples > 0 ? sqrt(tmax(0.0, sum2 / samples - mean * mean)) : 1.0;
+        float scale = stddev > 0 ? (float)(1.0 / stddev) : 0.0f;
+        if (flipsign)
+            scale = -scale;
+
+        for (size_t i = 0; i < elements; i++)
+            h_out[i] = (h_in[i] - (float)mean) * scale;
+    }
+}
+
+// Masking:
+
+void gtom::h_HammingMask(float* h_input, float* h_output, int3 dims, int batch)
+{
+    size_t elements = Elements(dims);
+    float radius = (float)tmin(dims.x, tmin(dims.y, dims.z > 1 ? dims.z : dims.y)) / 2.0f;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+    {
+        size_t e = (size_t)i % elements;
+        float r = RadiusFromCenter((int)(e % dims.x), (int)(e / dims.x % dims.y), (int)(e / dims.x / dims.y), dims);
+        float weight = r < radius ? 0.54f + 0.46f * cos((float)PI * r / radius) : 0.08f;
+
+        h_output[i] = h_input[i] * weight;
+    }
+}
+
+void gtom::h_SphereMask(float* h_input, float* h_output, int3 dims, float radius, float sigma, int batch)
+{
+    size_t elements = Elements(dims);
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+    {
+        size_t e = (size_t)i % elements;
+        float r = RadiusFromCenter((int)(e % dims.x), (int)(e / dims.x % dims.y), (int)(e / dims.x / dims.y), dims);
+
+        float weight;
+        if (r <= radius)
+            weight = 1.0f;
+        else if (sigma > 0 && r < radius + sigma)
+            weight = 0.5f + 0.5f * cos((float)PI * (r - radius) / sigma);
+        else
+            weight = 0.0f;
+
+        h_output[i] = h_input[i] * weight;
+    }
+}
+
+void gtom::h_Bandpass(float* h_input, float* h_output, int3 dims, float low, float high, float smooth, int batch)
+{
+    FourierFilter(h_input, h_output, dims, batch, [=](int kx, int ky, int kz)
+    {
+        float r = sqrt((float)(kx * kx + ky * ky + kz * kz));
+
+        if (r < low)
+            return smooth > 0 && r > low - smooth ? 0.5f + 0.5f * cos((float)PI * (low - r) / smooth) : 0.0f;
+        if (r > high)
+            return smooth > 0 && r < high + smooth ? 0.5f + 0.5f * cos((float)PI * (r - high) / smooth) : 0.0f;
+
+        return 1.0f;
+    });
+}
+
+void gtom::h_BandpassNonCubic(float* h_input, float* h_output, int3 dims, float nyquistlow, float nyquisthigh, int batch)
+{
+    FourierFilter(h_input, h_output, dims, batch, [=](int kx, int ky, int kz)
+    {
+        float fx = (float)kx / tmax(1, dims.x / 2);
+        float fy = (float)ky / tmax(1, dims.y / 2);
+        float fz = (float)kz / tmax(1, dims.z / 2);
+        float r = sqrt(fx * fx + fy * fy + fz * fz);
+
+        return (r >= nyquistlow && r <= nyquisthigh) ? 1.0f : 0.0f;
+    });
+}
@@ -0,0 +1,374 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include "Prerequisites.h"
+
+/*
+
+Host counterparts of the GTOM building blocks used by the exports. Names follow
+GTOM with the d_ prefix replaced by h_, argument order is kept identical so
+the CPU exports read like their CUDA twins.
+
+*/
+
+namespace gtom
+{
+    // Memory.cpp:
+
+    void* MallocAligned(size_t bytes);
+    void FreeAligned(void* h_data);
+
+    template <class T> T* MallocAlignedValueFilled(size_t elements, T value)
+    {
+        T* h_data = (T*)MallocAligned(elements * sizeof(T));
+        for (size_t i = 0; i < elements; i++)
+            h_data[i] = value;
+
+        return h_data;
+    }
+
+    template <class T> T* MallocAlignedFromHostArray(T* h_source, size_t elements)
+    {
+        T* h_data = (T*)MallocAligned(elements * sizeof(T));
+        memcpy(h_data, h_source, elements * sizeof(T));
+
+        return h_data;
+    }
+
+    // Arithmetics, batched the same way as GTOM: the second operand is reused for each of the batch slices.
+
+    template <class T> void h_ValueFill(T* h_output, size_t elements, T value)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements; i++)
+            h_output[i] = value;
+    }
+
+    template <class T> void h_AddVector(T* h_input, T* h_summands, T* h_output, size_t elements, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+            h_output[i] = h_input[i] + h_summands[i % elements];
+    }
+
+    template <class T> void h_SubtractVector(T* h_input, T* h_subtrahends, T* h_output, size_t elements, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+            h_output[i] = h_input[i] - h_subtrahends[i % elements];
+    }
+
+    template <class T> void h_MultiplyByVector(T* h_input, float* h_multiplicators, T* h_output, size_t elements, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+            h_output[i] = h_input[i] * h_multiplicators[i % elements];
+    }
+
+    template <class T> void h_DivideSafeByVector(T* h_input, float* h_divisors, T* h_output, size_t elements, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+        {
+            float divisor = h_divisors[i % elements];
+            h_output[i] = divisor != 0.0f ? h_input[i] / divisor : h_input[i] * 0.0f;
+        }
+    }
+
+    template <class T> void h_MultiplyByScalar(T* h_input, T* h_output, size_t elements, float multiplicator)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements; i++)
+            h_output[i] = h_input[i] * multiplicator;
+    }
+
+    void h_AddVector(half* h_input, half* h_summands, half* h_output, size_t elements, int batch = 1);
+    void h_SubtractVector(half* h_input, half* h_subtrahends, half* h_output, size_t elements, int batch = 1);
+    void h_MultiplyByVector(half* h_input, half* h_multiplicators, half* h_output, size_t elements, int batch = 1);
+
+    void h_AddScalar(float* h_input, float* h_output, size_t elements, float summand);
+    void h_Log(float* h_input, float* h_output, size_t elements);
+    void h_Abs(float* h_input, float* h_output, size_t elements);
+    void h_Abs(float2* h_input, float* h_output, size_t elements);
+    void h_Sign(float* h_input, float* h_output, size_t elements);
+
+    // Reductions:
+
+    template <class T> void h_ReduceAdd(T* h_input, T* h_output, size_t vectorlength, int nvectors, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)vectorlength * batch; i++)
+        {
+            size_t b = (size_t)i / vectorlength, e = (size_t)i % vectorlength;
+            T* h_batchinput = h_input + vectorlength * nvectors * b;
+
+            T sum = h_batchinput[e] * 0.0f;
+            for (int n = 0; n < nvectors; n++)
+                sum += h_batchinput[vectorlength * n + e];
+
+            h_output[i] = sum;
+        }
+    }
+
+    template <class T> void h_ReduceMean(T* h_input, T* h_output, size_t vectorlength, int nvectors, int batch = 1)
+    {
+        h_ReduceAdd(h_input, h_output, vectorlength, nvectors, batch);
+        h_MultiplyByScalar(h_output, h_output, vectorlength * batch, 1.0f / (float)nvectors);
+    }
+
+    void h_ReduceMean(half* h_input, half* h_output, size_t vectorlength, int nvectors, int batch = 1);
+    void h_SumMonolithic(float* h_input, float* h_output, size_t elements, int batch);
+
+    // Extraction, padding and remapping:
+
+    template <class T> void h_ExtractMany(T* h_input, T* h_output, int3 dims, int3 dimsregion, int3* h_origins, int batch)
+    {
+        #pragma omp parallel for
+        for (int b = 0; b < batch; b++)
+        {
+            int3 origin = h_origins[b];
+            T* h_region = h_output + Elements(dimsregion) * b;
+
+            for (int z = 0; z < dimsregion.z; z++)
+            {
+                int zz = ((z + origin.z) % dims.z + dims.z) % dims.z;
+                for (int y = 0; y < dimsregion.y; y++)
+                {
+                    int yy = ((y + origin.y) % dims.y + dims.y) % dims.y;
+                    T* h_row = h_input + ((size_t)zz * dims.y + yy) * dims.x;
+                    T* h_regionrow = h_region + ((size_t)z * dimsregion.y + y) * dimsregion.x;
+
+                    for (int x = 0; x < dimsregion.x; x++)
+                        h_regionrow[x] = h_row[((x + origin.x) % dims.x + dims.x) % dims.x];
+                }
+            }
+        }
+    }
+
+    template <class T> void h_Remap(T* h_input, size_t* h_map, T* h_output, size_t elementsmapped, size_t elementsoriginal, T defvalue, int batch = 1)
+    {
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elementsmapped * batch; i++)
+        {
+            size_t b = (size_t)i / elementsmapped, e = (size_t)i % elementsmapped;
+            size_t address = h_map[e];
+            h_output[i] = address < elementsoriginal ? h_input[elementsoriginal * b + address] : defvalue;
+        }
+    }
+
+    template <class T> void h_RemapHalfFFT2Half(T* h_input, T* h_output, int3 dims, int batch = 1)
+    {
+        size_t elements = ElementsFFT(dims);
+        int xhalf = dims.x / 2;
+        T* h_temp = h_input == h_output ? MallocAlignedFromHostArray(h_input, elements * batch) : h_input;
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+        {
+            size_t b = (size_t)i / elements, e = (size_t)i % elements;
+            int x = (int)(e % (xhalf + 1));
+            int y = (int)(e / (xhalf + 1) % dims.y);
+            int z = (int)(e / (xhalf + 1) / dims.y);
+
+            int rx = xhalf - x;
+            int ry = (dims.y + dims.y / 2 - y) % dims.y;
+            int rz = (dims.z + dims.z / 2 - z) % dims.z;
+
+            h_output[elements * b + ((size_t)rz * dims.y + ry) * (xhalf + 1) + rx] = h_temp[i];
+        }
+
+        if (h_temp != h_input)
+            FreeAligned(h_temp);
+    }
+
+    // The half-plane remap is its own inverse.
+    template <class T> void h_RemapHalf2HalfFFT(T* h_input, T* h_output, int3 dims, int batch = 1)
+    {
+        h_RemapHalfFFT2Half(h_input, h_output, dims, batch);
+    }
+
+    template <class T> void h_RemapFullFFT2Full(T* h_input, T* h_output, int3 dims, int batch = 1)
+    {
+        size_t elements = Elements(dims);
+        T* h_temp = h_input == h_output ? MallocAlignedFromHostArray(h_input, elements * batch) : h_input;
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+        {
+            size_t b = (size_t)i / elements, e = (size_t)i % elements;
+            int x = (int)(e % dims.x);
+            int y = (int)(e / dims.x % dims.y);
+            int z = (int)(e / dims.x / dims.y);
+
+            int rx = (x + dims.x / 2) % dims.x;
+            int ry = (y + dims.y / 2) % dims.y;
+            int rz = (z + dims.z / 2) % dims.z;
+
+            h_output[elements * b + ((size_t)rz * dims.y + ry) * dims.x + rx] = h_temp[i];
+        }
+
+        if (h_temp != h_input)
+            FreeAligned(h_temp);
+    }
+
+    template <class T> void h_RemapFull2FullFFT(T* h_input, T* h_output, int3 dims, int batch = 1)
+    {
+        size_t elements = Elements(dims);
+        T* h_temp = h_input == h_output ? MallocAlignedFromHostArray(h_input, elements * batch) : h_input;
+
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements * batch; i++)
+        {
+            size_t b = (size_t)i / elements, e = (size_t)i % elements;
+            int x = (int)(e % dims.x);
+            int y = (int)(e / dims.x % dims.y);
+            int z = (int)(e / dims.x / dims.y);
+
+            int rx = (x + dims.x / 2) % dims.x;
+            int ry = (y + dims.y / 2) % dims.y;
+            int rz = (z + dims.z / 2) % dims.z;
+
+            h_output[i] = h_temp[elements * b + ((size_t)rz * dims.y + ry) * dims.x + rx];
+        }
+
+        if (h_temp != h_input)
+            FreeAligned(h_temp);
+    }
+
+    void h_Pad(float* h_input, float* h_output, int3 olddims, int3 newdims, float value, int batch = 1);
+    void h_FFTPad(float2* h_input, float2* h_output, int3 olddims, int3 newdims, int batch = 1);
+    void h_FFTCrop(float2* h_input, float2* h_output, int3 olddims, int3 newdims, int batch = 1);
+
+    // Normalization and masking:
+
+    void h_NormMonolithic(float* h_input, float* h_output, size_t elements, int batch);
+    void h_NormMonolithic(float* h_input, float* h_output, size_t elements, float* h_mask, int batch);
+    void h_NormBackground(float* h_input, float* h_output, int3 dims, uint particleradius, bool flipsign, int batch);
+    void h_HammingMask(float* h_input, float* h_output, int3 dims, int batch);
+    void h_SphereMask(float* h_input, float* h_output, int3 dims, float radius, float sigma, int batch);
+    void h_Bandpass(float* h_input, float* h_output, int3 dims, float low, float high, float smooth, int batch);
+    void h_BandpassNonCubic(float* h_input, float* h_output, int3 dims, float nyquistlow, float nyquisthigh, int batch);
+
+    // FFT.cpp:
+
+    void h_FFTR2C(float* h_input, float2* h_output, int ndims, int3 dims, int batch = 1);
+    void h_IFFTC2R(float2* h_input, float* h_output, int ndims, int3 dims, int batch = 1);
+    int h_FFTR2CGetPlan(int ndims, int3 dims, int batch = 1);
+    int h_IFFTC2RGetPlan(int ndims, int3 dims, int batch = 1);
+    void h_FFTDestroyPlan(int plan);
+
+    // Single-threaded, unnormalized plans for callers that distribute transforms over their own threads.
+    // Execution is thread-safe and doesn't need aligned buffers. Lines plans transform batch contiguous
+    // complex lines of the given length in place.
+
+    void* h_FFTCreateThreadPlan(int ndims, int3 dims, bool forward);
+    void* h_FFTCreateLinesPlan(int length, int batch, bool forward);
+    void h_FFTExecuteR2C(void* plan, float* h_input, float2* h_output);
+    void h_FFTExecuteC2R(void* plan, float2* h_input, float* h_output);
+    void h_FFTExecuteLines(void* plan, float2* h_lines);
+    void h_FFTDestroyThreadPlan(void* plan);
+
+    // Transformation.cpp:
+
+    void h_Shift(float* h_input, float* h_output, int3 dims, float3* h_shifts, int batch);
+    void h_Shift(float2* h_input, float2* h_output, int3 dims, float3* h_shifts, int batch);
+    void h_Scale(float* h_input, float* h_output, int3 olddims, int3 newdims, int batch);
+    void h_MagAnisotropyCorrect(float* h_image, int2 dimsimage, float* h_scaled, int2 dimsscaled, float majorpixel, float minorpixel, float majorangle, uint supersample, int batch);
+    void h_Rotate2D(float* h_input, float* h_output, int2 dims, float* h_angles, int batch);
+    void h_Cart2Polar(float* h_input, float* h_output, int2 dims, uint innerradius, uint exclusiveouterradius, int batch);
+    void h_Cart2PolarFFT(float* h_input, float* h_output, int2 dims, uint innerradius, uint exclusiveouterradius, int batch);
+    void h_Xray(float* h_input, float* h_output, int3 dims, float ndevs, int region, int batch);
+
+    // CTF.cpp (the export file) relies on these, implemented in CTFCore.cpp:
+
+    inline float h_GetCTF(float r, float angle, const CTFParamsLean &p, bool ampsquared)
+    {
+        float r2 = r * r;
+        float r4 = r2 * r2;
+
+        float deltaf = p.defocus + p.defocusdelta * cos(2.0f * (angle - p.astigmatismangle));
+        float argument = p.K1 * deltaf * r2 + p.K2 * r4 - p.phaseshift;
+        float retval = p.amplitude * cos(argument) - p.K3 * sin(argument);
+
+        if (p.Bfactor != 0.0f)
+            retval *= exp(p.Bfactor * r2);
+
+        if (ampsquared)
+            retval = abs(retval);
+
+        return p.scale * retval;
+    }
+
+    // Radius in 1/Angstrom for a coordinate given in cycles per pixel.
+    inline float h_CTFFrequency(float2 coords, const CTFParamsLean &p)
+    {
+        return coords.x * p.ny / (p.pixelsize + p.pixeldelta * cos(2.0f * (coords.y - p.pixelangle)));
+    }
+
+    // Per-pixel invariants of a coordinate grid, computed once and shared by every parameter set evaluated on it
+    struct CTFGrid
+    {
+        uint length;
+        float* h_r2;        // Squared radius in cycles per pixel
+        float* h_cos2;      // Cosine and sine of twice the angle
+        float* h_sin2;
+    };
+
+    void h_CTFCreateGrid(const float2* h_coords, uint length, CTFGrid* grid);
+    void h_CTFFreeGrid(CTFGrid* grid);
+    void h_CTFSimulateMany(const CTFGrid &grid, const CTFParams* h_params, int n, bool amplitudesquared, float* h_output);
+
+    // Sums of sim, sim^2 and sim * target for every parameter set, 3 doubles each. Parameter set i is compared to
+    // h_target + i * targetstride, and the simulation is multiplied by h_scale per pixel unless it's NULL.
+    void h_CTFMomentsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const float* h_target, size_t targetstride, const float* h_scale, bool amplitudesquared, double* h_moments);
+    void h_CTFMomentsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const half* h_target, size_t targetstride, const half* h_scale, bool amplitudesquared, double* h_moments);
+
+    // Like h_CTFMomentsMany for |CTF|, plus the derivatives of each sum with respect to defocus, defocusdelta,
+    // astigmatismangle, phaseshift and Bfactor in CTFParams units: 3 x CTF_GRADIENT_PARAMS doubles per parameter set
+    void h_CTFMomentsGradientsMany(const CTFGrid &grid, const CTFParams* h_params, int n, const half* h_target, size_t targetstride, const half* h_scale, double* h_moments, double* h_gradients);
+
+    // Normalized cross-correlation of |CTF| with h_ps for every parameter set
+    void h_CTFCorrelateMany(const CTFGrid &grid, const float* h_ps, const CTFParams* h_params, int n, float* h_scores);
+
+    void h_CTFSimulate(CTFParams* h_params, float2* h_coords, float* h_output, uint length, bool amplitudesquared, int batch);
+    void h_CTFPeriodogram(float* h_image, int2 dimsimage, int3* h_origins, int norigins, int2 dimsregion, float* h_output);
+    void h_CTFRotationalAverageToTarget(float* h_input, float2* h_coords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, float* h_average, uint minbin, uint maxbin, int* h_consider, int batch);
+    void h_CTFRotationalAverageToTarget(float2* h_input, float2* h_coords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, float* h_average, uint minbin, uint maxbin, int* h_consider, int batch);
+    float h_CTFCorrelate(float* h_ps, float2* h_coords, uint length, CTFParams params);
+    CTFParams h_CTFFit(float* h_ps, float2* h_pscoords, int2 dims, CTFParams startparams, CTFFitParams fp, float &score);
+
+    // Projection.cpp:
+
+    // Projector data in bricks for the batched h_rlnProject, build once to reuse it across calls
+    struct BrickedVolume
+    {
+        int3 dims;
+        int3 nbricks;
+        float2* h_bricks;
+    };
+
+    bool h_BrickVolume(float2* h_volumeft, int3 dimsvolume, BrickedVolume* bricked);
+    void h_FreeBrickedVolume(BrickedVolume* bricked);
+    void h_rlnProject(const BrickedVolume &bricked, float2* h_projft, int3 dimsproj, float3* h_angles, float supersample, int batch);
+    void h_rlnProject(float2* h_volumeft, int3 dimsvolume, float2* h_projft, int3 dimsproj, float3* h_angles, float supersample, int batch);
+    void h_rlnBackproject(float2* h_volumeft, float* h_volumeweights, int3 dimsvolume, float2* h_projft, float* h_projweights, int3 dimsproj, int rmax, float3* h_angles, float supersample, int batch);
+    void h_rlnRotate(float2* h_volumeft, int3 dimsvolume, float2* h_rotatedft, int3 dimsrotated, float3 angles, float supersample);
+
+    // Precision.cpp:
+
+    // Conversions between fp32 and a STORAGE_* format on one thread, vectorized with F16C or AVX-512F where the
+    // build enables them. n counts real values.
+    void h_ConvertToStorage(const float* h_input, void* h_output, size_t n, int precision);
+    void h_ConvertFromStorage(const void* h_input, float* h_output, size_t n, int precision);
+
+    // n complex values of a stored buffer, starting at complex value first. fp32 storage is returned in place,
+    // anything else is converted into h_buffer.
+    const float2* h_LoadComplex(const void* h_data, int precision, size_t first, size_t n, float2* h_buffer);
+    void h_StoreComplex(const float2* h_values, void* h_data, int precision, size_t first, size_t n);
+
+    // Reconstruction.cpp:
+
+    bool h_ReconstructGridding(float2* h_dataft, float* h_weights, int3 dimsori, int oversampling, float* h_symmetry, int nsymmetry, int iterations, float* h_reconstruction, int nthreads, long long memorybudget, const char* c_scratchdir);
+}
+
+#endif
@@ -0,0 +1,560 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+Fourier-space projection and backprojection on RELION's projector layout: x is the
+non-redundant half (0..N/2), y and z are centered around N/2. Angles are ZYZ Euler in radians.
+
+*/
+
+namespace
+{
+    struct Matrix3
+    {
+        float m[3][3];
+
+        float3 operator*(float3 v) const
+        {
+            return make_float3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                               m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                               m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+        }
+    };
+
+    // Transposed (= inverse) rotation matrix, scaled by the oversampling factor, same as relion::Projector's Ainv.
+    Matrix3 GetInverseRotation(float3 angles, float scale)
+    {
+        float ca = cos(angles.x), sa = sin(angles.x);
+        float cb = cos(angles.y), sb = sin(angles.y);
+        float cg = cos(angles.z), sg = sin(angles.z);
+        float cc = cb * ca, cs = cb * sa, sc = sb * ca, ss = sb * sa;
+
+        float A[3][3] = { { cg * cc - sg * sa, cg * cs + sg * ca, -cg * sb },
+                          { -sg * cc - cg * sa, -sg * cs + cg * ca, sg * sb },
+                          { sc, ss, cb } };
+
+        Matrix3 result;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                result.m[i][j] = A[j][i] * scale;
+
+        return result;
+    }
+
+    inline int FFTFrequency(int i, int n)
+    {
+        return i < (n + 1) / 2 ? i : i - n;
+    }
+
+    inline float2 SampleTrilinear(float2* h_volumeft, int3 dimsvolume, float3 pos)
+    {
+        bool conjugate = false;
+        if (pos.x < 0)
+        {
+            pos = pos * -1.0f;
+            conjugate = true;
+        }
+
+        int xhalf = dimsvolume.x / 2 + 1;
+        int x0 = (int)floor(pos.x);
+        int y0 = (int)floor(pos.y);
+        int z0 = (int)floor(pos.z);
+        float fx = pos.x - x0, fy = pos.y - y0, fz = pos.z - z0;
+        y0 += dimsvolume.y / 2;
+        z0 += dimsvolume.z / 2;
+
+        if (x0 < 0 || x0 + 1 >= xhalf || y0 < 0 || y0 + 1 >= dimsvolume.y || z0 < 0 || z0 + 1 >= dimsvolume.z)
+            return make_float2(0, 0);
+
+        float2 result = make_float2(0, 0);
+        for (int dz = 0; dz <= 1; dz++)
+            for (int dy = 0; dy <= 1; dy++)
+                for (int dx = 0; dx <= 1; dx++)
+                {
+                    float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+                    result += h_volumeft[((size_t)(z0 + dz) * dimsvolume.y + (y0 + dy)) * xhalf + x0 + dx] * w;
+                }
+
+        return conjugate ? cconj(result) : result;
+    }
+}
+
+/*
+
+Batched engine behind h_rlnProject and h_rlnBackproject. The volume is split into bricks of
+BrickCells^3 interpolation cells. Each brick stores one extra voxel along every axis, so all 8 corners of a
+trilinear sample sit in one contiguous 4 KB block. Neighboring slice samples then land in the same few
+cache lines no matter how the slice is oriented.
+
+Work is split into blocks of AngleLanes orientations times a few projection rows. Inside a block, every
+pixel's positions are computed for all lanes at once in loops the compiler vectorizes, followed by the
+lookups. Backprojection accumulates into bricks owned by each thread, allocated on first touch. These are
+summed per output voxel at the end, so no atomics are needed.
+
+*/
+
+namespace
+{
+    const int BrickCells = 7;
+    const int BrickSide = BrickCells + 1;
+    const int BrickVoxels = BrickSide * BrickSide * BrickSide;
+    const int AngleLanes = 8;
+    const int RowsPerJob = 8;
+
+    // Offsets of the 8 trilinear corners inside a brick, in the order dx + 2 * dy + 4 * dz
+    const int CornerOffsets[8] = { 0, 1, BrickSide, BrickSide + 1,
+                                   BrickSide * BrickSide, BrickSide * BrickSide + 1, BrickSide * BrickSide + BrickSide, BrickSide * BrickSide + BrickSide + 1 };
+
+    inline int BrickCount(int cells)
+    {
+        return (cells + BrickCells - 1) / BrickCells;
+    }
+
+    // Brick and in-brick offsets of every cell along the 3 axes; a cell's brick is the sum of the 3 brick
+    // terms, its position inside the brick the sum of the local terms. Saves 6 integer divisions per sample.
+    struct BrickAddressing
+    {
+        std::vector<int> brick[3], local[3];
+
+        BrickAddressing(int3 cells, int3 nbricks)
+        {
+            int ncells[3] = { cells.x, cells.y, cells.z };
+            int brickstrides[3] = { 1, nbricks.x, nbricks.x * nbricks.y };
+            int localstrides[3] = { 1, BrickSide, BrickSide * BrickSide };
+
+            for (int i = 0; i < 3; i++)
+            {
+                brick[i].resize(ncells[i]);
+                local[i].resize(ncells[i]);
+                for (int c = 0; c < ncells[i]; c++)
+                {
+                    brick[i][c] = (c / BrickCells) * brickstrides[i];
+                    local[i][c] = (c % BrickCells) * localstrides[i];
+                }
+            }
+        }
+
+        size_t Brick(int cx, int cy, int cz) const
+        {
+            return (size_t)brick[0][cx] + brick[1][cy] + brick[2][cz];
+        }
+
+        int Local(int cx, int cy, int cz) const
+        {
+            return local[0][cx] + local[1][cy] + local[2][cz];
+        }
+    };
+
+    // Positions, interpolation weights and conjugation flags for one pixel in all lanes of a block
+    struct LaneSamples
+    {
+        int cell[3][AngleLanes];
+        float frac[3][AngleLanes];
+        bool conjugate[AngleLanes];
+    };
+
+    struct LaneRotations
+    {
+        float m[3][2][AngleLanes];    // Only the first two columns matter for a central slice
+
+        LaneRotations(float3* h_angles, int first, int n, float supersample)
+        {
+            for (int l = 0; l < AngleLanes; l++)
+            {
+                Matrix3 rotation = GetInverseRotation(h_angles[first + tmin(l, n - 1)], supersample);
+                for (int i = 0; i < 3; i++)
+                    for (int j = 0; j < 2; j++)
+                        m[i][j][l] = rotation.m[i][j];
+            }
+        }
+
+        void Sample(float x, float y, int3 center, LaneSamples &s) const
+        {
+            float pos[3][AngleLanes];
+            for (int i = 0; i < 3; i++)
+                for (int l = 0; l < AngleLanes; l++)
+                    pos[i][l] = m[i][0][l] * x + m[i][1][l] * y;
+
+            // Friedel mate for the half that isn't stored
+            for (int l = 0; l < AngleLanes; l++)
+            {
+                s.conjugate[l] = pos[0][l] < 0;
+                float sign = s.conjugate[l] ? -1.0f : 1.0f;
+                for (int i = 0; i < 3; i++)
+                    pos[i][l] *= sign;
+            }
+
+            int offsets[3] = { center.x, center.y, center.z };
+            for (int i = 0; i < 3; i++)
+                for (int l = 0; l < AngleLanes; l++)
+                {
+                    float floored = floor(pos[i][l]);
+                    s.frac[i][l] = pos[i][l] - floored;
+                    s.cell[i][l] = (int)floored + offsets[i];
+                }
+        }
+    };
+
+    inline void TrilinearWeights(const LaneSamples &s, int l, float* w)
+    {
+        float fx = s.frac[0][l], fy = s.frac[1][l], fz = s.frac[2][l];
+        for (int c = 0; c < 8; c++)
+            w[c] = ((c & 1) ? fx : 1 - fx) * ((c & 2) ? fy : 1 - fy) * ((c & 4) ? fz : 1 - fz);
+    }
+
+    // Runs body(b0, nlanes, y0, y1) for every block of angles and rows, statically split over threads
+    template <class F> void ForEachAngleBlock(int batch, int rows, F body)
+    {
+        int nangleblocks = (batch + AngleLanes - 1) / AngleLanes;
+        int nrowblocks = (rows + RowsPerJob - 1) / RowsPerJob;
+
+        #pragma omp parallel for schedule(static)
+        for (int job = 0; job < nangleblocks * nrowblocks; job++)
+        {
+            int b0 = (job / nrowblocks) * AngleLanes;
+            int y0 = (job % nrowblocks) * RowsPerJob;
+            body(b0, tmin(AngleLanes, batch - b0), y0, tmin(rows, y0 + RowsPerJob));
+        }
+    }
+
+    // Accumulation bricks of one thread. Cells start at -1, so samples whose corners
+    // partially leave the volume can still deposit the part that's inside.
+    struct BrickAccumulator
+    {
+        static const int BricksPerChunk = 64;
+        static const size_t BrickBytes = BrickVoxels * (sizeof(float2) + sizeof(float));
+
+        int3 nbricks;
+        std::vector<float2*> values;    // Each brick holds BrickVoxels values followed by BrickVoxels weights
+        std::vector<char*> chunks;
+        int chunkused;
+
+        BrickAccumulator(int3 nbricks) : nbricks(nbricks), values(Elements(nbricks), NULL), chunkused(BricksPerChunk) {}
+
+        ~BrickAccumulator()
+        {
+            for (char* h_chunk : chunks)
+                FreeAligned(h_chunk);
+        }
+
+        float2* Brick(size_t index)
+        {
+            float2* &h_brick = values[index];
+            if (h_brick == NULL)
+            {
+                // Bricks come from larger chunks to keep the allocator out of the inner loop
+                if (chunkused == BricksPerChunk)
+                {
+                    chunks.push_back((char*)MallocAligned(BricksPerChunk * BrickBytes));
+                    chunkused = 0;
+                }
+
+                h_brick = (float2*)(chunks.back() + chunkused++ * BrickBytes);
+                memset(h_brick, 0, BrickBytes);
+            }
+
+            return h_brick;
+        }
+
+        const float2* Find(int bx, int by, int bz) const
+        {
+            return values[((size_t)bz * nbricks.y + by) * nbricks.x + bx];
+        }
+    };
+
+    // Bricks (index, local position) holding padded voxel u: its own, plus the apron of the previous one
+    inline int BrickCandidates(int u, int nbricks, int2* candidates)
+    {
+        int n = 0;
+        if (u / BrickCells < nbricks)
+            candidates[n++] = toInt2(u / BrickCells, u % BrickCells);
+        if (u % BrickCells == 0 && u > 0)
+            candidates[n++] = toInt2(u / BrickCells - 1, BrickCells);
+
+        return n;
+    }
+}
+
+bool gtom::h_BrickVolume(float2* h_volumeft, int3 dimsvolume, BrickedVolume* bricked)
+{
+    int3 cells = toInt3(dimsvolume.x / 2, dimsvolume.y - 1, dimsvolume.z - 1);
+    bricked->dims = dimsvolume;
+    bricked->nbricks = toInt3(BrickCount(cells.x), BrickCount(cells.y), BrickCount(cells.z));
+    bricked->h_bricks = (float2*)MallocAligned(Elements(bricked->nbricks) * BrickVoxels * sizeof(float2));
+    if (bricked->h_bricks == NULL)
+        return false;
+
+    int xhalf = dimsvolume.x / 2 + 1;
+    int3 nbricks = bricked->nbricks;
+
+    // One row of bricks at a time, so every source row is read in one contiguous sweep
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < nbricks.y * nbricks.z; row++)
+    {
+        int by = row % nbricks.y, bz = row / nbricks.y;
+        float2* h_row = bricked->h_bricks + (size_t)row * nbricks.x * BrickVoxels;
+
+        for (int lz = 0; lz < BrickSide; lz++)
+            for (int ly = 0; ly < BrickSide; ly++)
+            {
+                int y = by * BrickCells + ly, z = bz * BrickCells + lz;
+                bool inside = y < dimsvolume.y && z < dimsvolume.z;
+                const float2* h_source = h_volumeft + ((size_t)z * dimsvolume.y + y) * xhalf;
+
+                for (int bx = 0; bx < nbricks.x; bx++)
+                {
+                    float2* h_dest = h_row + (size_t)bx * BrickVoxels + (lz * BrickSide + ly) * BrickSide;
+                    int x0 = bx * BrickCells;
+                    int n = inside ? tmax(0, tmin(BrickSide, xhalf - x0)) : 0;
+
+                    if (n > 0)
+                        memcpy(h_dest, h_source + x0, n * sizeof(float2));
+                    for (int lx = n; lx < BrickSide; lx++)
+                        h_dest[lx] = make_float2(0, 0);
+                }
+            }
+    }
+
+    return true;
+}
+
+void gtom::h_FreeBrickedVolume(BrickedVolume* bricked)
+{
+    if (bricked->h_bricks != NULL)
+        FreeAligned(bricked->h_bricks);
+    bricked->h_bricks = NULL;
+}
+
+void gtom::h_rlnProject(const BrickedVolume &bricked, float2* h_projft, int3 dimsproj, float3* h_angles, float supersample, int batch)
+{
+    int xhalf = dimsproj.x / 2 + 1;
+    int rmax2 = (dimsproj.x / 2) * (dimsproj.x / 2);
+    size_t elementsproj = ElementsFFT2(dimsproj);
+
+    int3 dimsvolume = bricked.dims;
+    int3 center = toInt3(0, dimsvolume.y / 2, dimsvolume.z / 2);
+    int3 cells = toInt3(dimsvolume.x / 2, dimsvolume.y - 1, dimsvolume.z - 1);
+    BrickAddressing addressing(cells, bricked.nbricks);
+
+    ForEachAngleBlock(batch, dimsproj.y, [&](int b0, int nlanes, int y0, int y1)
+    {
+        LaneRotations rotations(h_angles, b0, nlanes, supersample);
+        LaneSamples s;
+
+        for (int y = y0; y < y1; y++)
+        {
+            int ky = FFTFrequency(y, dimsproj.y);
+            for (int x = 0; x < xhalf; x++)
+            {
+                size_t i = (size_t)y * xhalf + x;
+                if (x * x + ky * ky > rmax2)
+                {
+                    for (int l = 0; l < nlanes; l++)
+                        h_projft[elementsproj * (b0 + l) + i] = make_float2(0, 0);
+                    continue;
+                }
+
+                rotations.Sample((float)x, (float)ky, center, s);
+
+                for (int l = 0; l < nlanes; l++)
+                {
+                    int cx = s.cell[0][l], cy = s.cell[1][l], cz = s.cell[2][l];
+                    float2 result = make_float2(0, 0);
+
+                    if (cx >= 0 && cx < cells.x && cy >= 0 && cy < cells.y && cz >= 0 && cz < cells.z)
+                    {
+                        const float2* h_corner = bricked.h_bricks + addressing.Brick(cx, cy, cz) * BrickVoxels + addressing.Local(cx, cy, cz);
+
+                        float w[8];
+                        TrilinearWeights(s, l, w);
+                        for (int c = 0; c < 8; c++)
+                            result += h_corner[CornerOffsets[c]] * w[c];
+
+                        if (s.conjugate[l])
+                            result = cconj(result);
+                    }
+
+                    h_projft[elementsproj * (b0 + l) + i] = result;
+                }
+            }
+        }
+    });
+}
+
+void gtom::h_rlnProject(float2* h_volumeft, int3 dimsvolume, float2* h_projft, int3 dimsproj, float3* h_angles, float supersample, int batch)
+{
+    // Bricking touches every voxel once, only worth it if the projections take more samples than that
+    if ((size_t)batch * ElementsFFT2(dimsproj) * 4 >= ElementsFFT(dimsvolume))
+    {
+        BrickedVolume bricked;
+        if (h_BrickVolume(h_volumeft, dimsvolume, &bricked))
+        {
+            h_rlnProject(bricked, h_projft, dimsproj, h_angles, supersample, batch);
+            h_FreeBrickedVolume(&bricked);
+            return;
+        }
+    }
+
+    int xhalf = dimsproj.x / 2 + 1;
+    int rmax2 = (dimsproj.x / 2) * (dimsproj.x / 2);
+    size_t elementsproj = ElementsFFT2(dimsproj);
+
+    #pragma omp parallel for
+    for (int b = 0; b < batch; b++)
+    {
+        Matrix3 rotation = GetInverseRotation(h_angles[b], supersample);
+        float2* h_proj = h_projft + elementsproj * b;
+
+        for (int y = 0; y < dimsproj.y; y++)
+        {
+            int ky = FFTFrequency(y, dimsproj.y);
+            for (int x = 0; x < xhalf; x++)
+            {
+                if (x * x + ky * ky > rmax2)
+                {
+                    h_proj[y * xhalf + x] = make_float2(0, 0);
+                    continue;
+                }
+
+                h_proj[y * xhalf + x] = SampleTrilinear(h_volumeft, dimsvolume, rotation * make_float3((float)x, (float)ky, 0));
+            }
+        }
+    }
+}
+
+void gtom::h_rlnBackproject(float2* h_volumeft, float* h_volumeweights, int3 dimsvolume, float2* h_projft, float* h_projweights, int3 dimsproj, int rmax, float3* h_angles, float supersample, int batch)
+{
+    int xhalfproj = dimsproj.x / 2 + 1;
+    int xhalf = dimsvolume.x / 2 + 1;
+    size_t elementsproj = ElementsFFT2(dimsproj);
+
+    // Padded voxel u = v + 1, so cell -1 is cell 0 here and every cell with at least one corner inside is covered
+    int3 center = toInt3(1, dimsvolume.y / 2 + 1, dimsvolume.z / 2 + 1);
+    int3 cells = toInt3(xhalf + 1, dimsvolume.y + 1, dimsvolume.z + 1);
+    int3 nbricks = toInt3(BrickCount(cells.x), BrickCount(cells.y), BrickCount(cells.z));
+    BrickAddressing addressing(cells, nbricks);
+
+    std::vector<BrickAccumulator*> accumulators(omp_get_max_threads(), NULL);
+
+    ForEachAngleBlock(batch, dimsproj.y, [&](int b0, int nlanes, int y0, int y1)
+    {
+        BrickAccumulator* &accumulator = accumulators[omp_get_thread_num()];
+        if (accumulator == NULL)
+            accumulator = new BrickAccumulator(nbricks);
+
+        LaneRotations rotations(h_angles, b0, nlanes, supersample);
+        LaneSamples s;
+
+        for (int y = y0; y < y1; y++)
+        {
+            int ky = FFTFrequency(y, dimsproj.y);
+            for (int x = 0; x < xhalfproj; x++)
+            {
+                if (x * x + ky * ky > rmax * rmax)
+                    continue;
+
+                rotations.Sample((float)x, (float)ky, center, s);
+
+                for (int l = 0; l < nlanes; l++)
+                {
+                    int cx = s.cell[0][l], cy = s.cell[1][l], cz = s.cell[2][l];
+                    if (cx < 0 || cx >= cells.x || cy < 0 || cy >= cells.y || cz < 0 || cz >= cells.z)
+                        continue;
+
+                    size_t i = elementsproj * (b0 + l) + (size_t)y * xhalfproj + x;
+                    float2 val = s.conjugate[l] ? cconj(h_projft[i]) : h_projft[i];
+                    float weight = h_projweights[i];
+
+                    float2* h_brick = accumulator->Brick(addressing.Brick(cx, cy, cz));
+                    int local = addressing.Local(cx, cy, cz);
+                    float2* h_values = h_brick + local;
+                    float* h_weights = (float*)(h_brick + BrickVoxels) + local;
+
+                    float w[8];
+                    TrilinearWeights(s, l, w);
+                    for (int c = 0; c < 8; c++)
+                    {
+                        h_values[CornerOffsets[c]] += val * w[c];
+                        h_weights[CornerOffsets[c]] += weight * w[c];
+                    }
+                }
+            }
+        }
+    });
+
+    // Every output voxel gathers from the up to 8 bricks that hold it, in every thread's accumulator
+    #pragma omp parallel for schedule(dynamic)
+    for (int z = 0; z < dimsvolume.z; z++)
+    {
+        int2 candz[2], candy[2], candx[2];
+        int ncandz = BrickCandidates(z + 1, nbricks.z, candz);
+
+        for (int y = 0; y < dimsvolume.y; y++)
+        {
+            int ncandy = BrickCandidates(y + 1, nbricks.y, candy);
+
+            for (int x = 0; x < xhalf; x++)
+            {
+                int ncandx = BrickCandidates(x + 1, nbricks.x, candx);
+
+                float2 sum = make_float2(0, 0);
+                float sumweights = 0;
+
+                for (BrickAccumulator* accumulator : accumulators)
+                {
+                    if (accumulator == NULL)
+                        continue;
+
+                    for (int iz = 0; iz < ncandz; iz++)
+                        for (int iy = 0; iy < ncandy; iy++)
+                            for (int ix = 0; ix < ncandx; ix++)
+                            {
+                                const float2* h_brick = accumulator->Find(candx[ix].x, candy[iy].x, candz[iz].x);
+                                if (h_brick == NULL)
+                                    continue;
+
+                                int local = (candz[iz].y * BrickSide + candy[iy].y) * BrickSide + candx[ix].y;
+                                sum += h_brick[local];
+                                sumweights += ((const float*)(h_brick + BrickVoxels))[local];
+                            }
+                }
+
+                size_t address = ((size_t)z * dimsvolume.y + y) * xhalf + x;
+                h_volumeft[address] += sum;
+                h_volumeweights[address] += sumweights;
+            }
+        }
+    }
+
+    for (BrickAccumulator* accumulator : accumulators)
+        delete accumulator;
+}
+
+void gtom::h_rlnRotate(float2* h_volumeft, int3 dimsvolume, float2* h_rotatedft, int3 dimsrotated, float3 angles, float supersample)
+{
+    Matrix3 rotation = GetInverseRotation(angles, supersample);
+    int xhalf = dimsrotated.x / 2 + 1;
+    int rmax2 = (dimsrotated.x / 2) * (dimsrotated.x / 2);
+
+    #pragma omp parallel for
+    for (int z = 0; z < dimsrotated.z; z++)
+    {
+        int kz = FFTFrequency(z, dimsrotated.z);
+        for (int y = 0; y < dimsrotated.y; y++)
+        {
+            int ky = FFTFrequency(y, dimsrotated.y);
+            for (int x = 0; x < xhalf; x++)
+            {
+                size_t i = ((size_t)z * dimsrotated.y + y) * xhalf + x;
+                if (x * x + ky * ky + kz * kz > rmax2)
+                {
+                    h_rotatedft[i] = make_float2(0, 0);
+                    continue;
+                }
+
+                h_rotatedft[i] = SampleTrilinear(h_volumeft, dimsvolume, rotation * make_float3((float)x, (float)ky, (float)kz));
+            }
+        }
+    }
+}
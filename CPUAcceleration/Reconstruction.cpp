@@ -0,0 +1,714 @@
+#include "Functions.h"
+#include <string>
+#include <atomic>
+using namespace gtom;
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+/*
+
+Gridding reconstruction from RELION's backprojector layout, doing what relion::BackProjector::reconstruct
+does without MAP regularization: Hermitian and point-group symmetrization, Pipe & Menon's iterative
+density compensation with a Kaiser-Bessel blob, windowing to the padded box, inverse transform, soft mask
+and trilinear gridding correction.
+
+The padded grid is only ever touched in two kinds of passes: over z-planes (2D transforms and the blob
+multiplication in real space) and over y-slabs of z-columns (transforms along z and the weight update).
+Every column or plane is independent, so the passes are spread over threads, and the grid can live in a
+scratch file with one slab in memory at a time. Symmetry operators are applied by gathering from the
+caller's arrays the first time a voxel is needed, without ever building rotated copies.
+
+*/
+
+namespace
+{
+    const double BlobRadius = 1.9;          // In original voxels, RELION's defaults
+    const double BlobAlpha = 15;
+    const int BlobTableSamples = 10000;
+
+    const int ColumnBlock = 16;             // z-columns transformed together, neighbors in x
+
+    struct GridVoxel
+    {
+        float2 conv;
+        float weight;
+        float newweight;
+    };
+
+    // FFTW-ordered index to frequency, same as RELION's FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM
+    inline int Frequency(int i, int n)
+    {
+        return i < n / 2 + 1 ? i : i - n;
+    }
+
+    inline int Wrap(int i, int n)
+    {
+        return (i % n + n) % n;
+    }
+
+    // Fourier transform of an order-0 Kaiser-Bessel blob up to a constant factor, i.e. i(3/2) or j(3/2) of
+    // sigma over sigma^(3/2) on either side of 2 pi a w = alpha
+    double KaiserFourier(double w, double a, double alpha)
+    {
+        double s = 2.0 * PI * a * w;
+        double sigma = sqrt(fabs(alpha * alpha - s * s));
+        if (sigma < 1e-3)
+            return 1.0 / 3.0;
+
+        if (s > alpha)
+            return (sin(sigma) / sigma - cos(sigma)) / (sigma * sigma);
+        else
+            return (cosh(sigma) - sinh(sigma) / sigma) / (sigma * sigma);
+    }
+
+    /*
+
+    Padded grid of GridVoxels, dims.x = n / 2 + 1 wide, in FFTW order. In memory, a slab is simply a view of
+    the whole grid. On disk, a slab is read into a buffer of at most the memory budget and written back
+    after the pass is done with it.
+
+    */
+
+    struct SlabView
+    {
+        GridVoxel* data;
+        int z0, y0;
+        size_t planestride;
+        size_t rowstride;
+
+        GridVoxel* Row(int z, int y) const
+        {
+            return data + (size_t)(z - z0) * planestride + (size_t)(y - y0) * rowstride;
+        }
+    };
+
+    class GridStore
+    {
+        int3 dims;
+        GridVoxel* h_grid;
+        GridVoxel* h_buffer;
+        size_t bufferelements;
+        FILE* file;
+        std::string path;
+
+    public:
+        GridStore(int3 griddims, long long memorybudget, const char* c_scratchdir) : dims(griddims), h_grid(NULL), h_buffer(NULL), bufferelements(0), file(NULL)
+        {
+            size_t elements = Elements(dims);
+
+            if (memorybudget > 0 && (size_t)memorybudget < elements * sizeof(GridVoxel))
+            {
+                static std::atomic<int> counter(0);
+
+                char name[64];
+                sprintf(name, "warp_reconstruction_%p_%d.tmp", (void*)this, counter++);
+
+                path = c_scratchdir != NULL && c_scratchdir[0] != 0 ? std::string(c_scratchdir) : std::string(".");
+                if (path.back() != '/' && path.back() != '\\')
+                    path += "/";
+                path += name;
+
+                file = fopen(path.c_str(), "w+b");
+
+                // One row of every plane, or one plane, is the smallest slab a pass can work with
+                bufferelements = tmax((size_t)memorybudget / sizeof(GridVoxel), (size_t)dims.x * tmax(dims.y, dims.z));
+                bufferelements = tmin(bufferelements, elements);
+            }
+
+            // Without a usable scratch file, everything stays in memory
+            if (file == NULL)
+                PoolMalloc((void**)&h_grid, elements * sizeof(GridVoxel));
+            else
+                PoolMalloc((void**)&h_buffer, bufferelements * sizeof(GridVoxel));
+        }
+
+        ~GridStore()
+        {
+            if (h_grid != NULL)
+                PoolFree(h_grid);
+            if (h_buffer != NULL)
+                PoolFree(h_buffer);
+
+            if (file != NULL)
+            {
+                fclose(file);
+                remove(path.c_str());
+            }
+        }
+
+        bool OnDisk() const
+        {
+            return file != NULL;
+        }
+
+        // Planes per plane slab, and rows per column slab
+        int SlabPlanes() const
+        {
+            return OnDisk() ? (int)tmin(bufferelements / ((size_t)dims.x * dims.y), (size_t)dims.z) : dims.z;
+        }
+
+        int SlabRows() const
+        {
+            return OnDisk() ? (int)tmin(bufferelements / ((size_t)dims.x * dims.z), (size_t)dims.y) : dims.y;
+        }
+
+        // Rows [y0, y1) of planes [z0, z1); the buffer contents are only read from disk if needed
+        bool Load(int z0, int z1, int y0, int y1, bool read, SlabView &view)
+        {
+            if (!OnDisk())
+            {
+                view.data = h_grid;
+                view.z0 = 0;
+                view.y0 = 0;
+                view.planestride = (size_t)dims.y * dims.x;
+                view.rowstride = dims.x;
+
+                return true;
+            }
+
+            view.data = h_buffer;
+            view.z0 = z0;
+            view.y0 = y0;
+            view.planestride = (size_t)(y1 - y0) * dims.x;
+            view.rowstride = dims.x;
+
+            if (read)
+                for (int z = z0; z < z1; z++)
+                {
+                    size_t elements = view.planestride;
+                    if (fseek64(file, (long long)(((size_t)z * dims.y + y0) * dims.x * sizeof(GridVoxel)), SEEK_SET) != 0 ||
+                        fread(view.Row(z, y0), sizeof(GridVoxel), elements, file) != elements)
+                        return false;
+                }
+
+            return true;
+        }
+
+        bool Save(int z0, int z1, int y0, int y1, const SlabView &view)
+        {
+            if (!OnDisk())
+                return true;
+
+            for (int z = z0; z < z1; z++)
+            {
+                size_t elements = view.planestride;
+                if (fseek64(file, (long long)(((size_t)z * dims.y + y0) * dims.x * sizeof(GridVoxel)), SEEK_SET) != 0 ||
+                    fwrite(view.Row(z, y0), sizeof(GridVoxel), elements, file) != elements)
+                    return false;
+            }
+
+            return true;
+        }
+    };
+
+    /*
+
+    The caller's data and weights, centered in y and z. Values on the x = 0 plane are summed with their
+    Friedel mates like relion::BackProjector::enforceHermitianSymmetry does, and symmetry-related values
+    are trilinearly interpolated like in applyPointGroupSymmetry, both on the fly.
+
+    */
+
+    struct SymmetrizedSource
+    {
+        float2* h_data;
+        float* h_weights;
+        int n, h, xh;
+        const float* h_symmetry;    // 3x3 row-major, the identity first
+        int nsymmetry;
+
+        size_t Address(int x, int y, int z) const
+        {
+            return ((size_t)(z + h) * n + (y + h)) * xh + x;
+        }
+
+        float2 Data(int x, int y, int z) const
+        {
+            float2 val = h_data[Address(x, y, z)];
+            if (x == 0 && (y != 0 || z != 0))
+                val += cconj(h_data[Address(0, -y, -z)]);
+
+            return val;
+        }
+
+        float Weight(int x, int y, int z) const
+        {
+            float val = h_weights[Address(x, y, z)];
+            if (x == 0 && (y != 0 || z != 0))
+                val += h_weights[Address(0, -y, -z)];
+
+            return val;
+        }
+
+        template<bool dodata, bool doweight> void Gather(int x, int y, int z, float2 &data, float &weight) const
+        {
+            data = make_float2(0, 0);
+            weight = 0;
+
+            if (dodata)
+                data = Data(x, y, z);
+            if (doweight)
+                weight = Weight(x, y, z);
+
+            for (int s = 1; s < nsymmetry; s++)
+            {
+                const float* R = h_symmetry + s * 9;
+                float xp = x * R[0] + y * R[1] + z * R[2];
+                float yp = x * R[3] + y * R[4] + z * R[5];
+                float zp = x * R[6] + y * R[7] + z * R[8];
+
+                bool conjugate = false;
+                if (xp < 0)
+                {
+                    xp = -xp;
+                    yp = -yp;
+                    zp = -zp;
+                    conjugate = true;
+                }
+
+                int x0 = (int)floor(xp), y0 = (int)floor(yp), z0 = (int)floor(zp);
+                float fx = xp - x0, fy = yp - y0, fz = zp - z0;
+
+                float2 interpdata = make_float2(0, 0);
+                float interpweight = 0;
+                for (int dz = 0; dz <= 1; dz++)
+                    for (int dy = 0; dy <= 1; dy++)
+                        for (int dx = 0; dx <= 1; dx++)
+                        {
+                            float w = (dx ? fx : 1 - fx) * (dy ? fy : 1 - fy) * (dz ? fz : 1 - fz);
+                            if (dodata)
+                                interpdata += Data(x0 + dx, y0 + dy, z0 + dz) * w;
+                            if (doweight)
+                                interpweight += Weight(x0 + dx, y0 + dy, z0 + dz) * w;
+                        }
+
+                data += conjugate ? cconj(interpdata) : interpdata;
+                weight += interpweight;
+            }
+        }
+    };
+}
+
+bool gtom::h_ReconstructGridding(float2* h_dataft, float* h_weights, int3 dimsori, int oversampling, float* h_symmetry, int nsymmetry, int iterations, float* h_reconstruction, int nthreads, long long memorybudget, const char* c_scratchdir)
+{
+    if (nthreads <= 0)
+        nthreads = omp_get_max_threads();
+
+    int ori = dimsori.x;
+    int rmax = oversampling * (ori / 2);
+    int maxr2 = rmax * rmax;
+
+    // Padded grid as laid out by the caller, and the box it is windowed to before the final transform
+    int h = rmax + 1, n = 2 * h + 1, xh = h + 1;
+    int P = oversampling * ori, Pxh = P / 2 + 1;
+
+    SymmetrizedSource source = { h_dataft, h_weights, n, h, xh, h_symmetry, nsymmetry };
+
+    GridStore store(toInt3(xh, n, n), memorybudget, c_scratchdir);
+    int slabplanes = store.SlabPlanes();
+    int slabrows = store.SlabRows();
+
+    // Blob transform by squared real-space radius, tabulated like RELION's TabFtBlob.
+    // The 1 / n^3 of the round trip through real space is folded in.
+    std::vector<float> blobtable(3 * (h + 1) * (h + 1) + 1);
+    {
+        double a = BlobRadius * oversampling, sampling = 0.5 / BlobTableSamples;
+        double norm = KaiserFourier(0, a, BlobAlpha);
+        double scale = 1.0 / ((double)n * n * n);
+
+        for (int r2 = 0; r2 < (int)blobtable.size(); r2++)
+        {
+            int sample = (int)(sqrt((double)r2) / (ori * oversampling) / sampling);
+            blobtable[r2] = sample < BlobTableSamples ? (float)(KaiserFourier(sample * sampling, a, BlobAlpha) / norm * scale) : 0.0f;
+        }
+    }
+
+    void* planforwlines = h_FFTCreateLinesPlan(n, ColumnBlock, true);
+    void* planbacklines = h_FFTCreateLinesPlan(n, ColumnBlock, false);
+    void* planforwline = h_FFTCreateLinesPlan(n, 1, true);
+    void* planbackline = h_FFTCreateLinesPlan(n, 1, false);
+    void* planforwplane = h_FFTCreateThreadPlan(2, toInt3(n, n, 1), true);
+    void* planbackplane = h_FFTCreateThreadPlan(2, toInt3(n, n, 1), false);
+
+    bool success = true;
+
+    // Symmetrized weights and the initial density compensation: 1 inside the sphere, 0 outside
+    for (int z0 = 0; z0 < n && success; z0 += slabplanes)
+    {
+        int z1 = tmin(n, z0 + slabplanes);
+
+        SlabView slab;
+        success = store.Load(z0, z1, 0, n, false, slab);
+        if (!success)
+            break;
+
+        #pragma omp parallel for num_threads(nthreads) schedule(dynamic)
+        for (int z = z0; z < z1; z++)
+        {
+            int kz = Frequency(z, n);
+            for (int y = 0; y < n; y++)
+            {
+                int ky = Frequency(y, n);
+                GridVoxel* h_row = slab.Row(z, y);
+
+                for (int x = 0; x < xh; x++)
+                {
+                    int r2 = x * x + ky * ky + kz * kz;
+                    GridVoxel voxel = { make_float2(0, 0), 0.0f, 0.0f };
+
+                    if (r2 <= maxr2)
+                    {
+                        float2 dummy;
+                        source.Gather<false, true>(x, ky, kz, dummy, voxel.weight);
+                        voxel.newweight = r2 < maxr2 ? 1.0f : 0.0f;
+                    }
+
+                    h_row[x] = voxel;
+                }
+            }
+        }
+
+        success = store.Save(z0, z1, 0, n, slab);
+    }
+
+    // Transforms along z of a slab's columns, with an optional weight update in between:
+    // conv is brought to Fourier space, newweight divided by |conv|, conv reset to newweight * weight,
+    // and brought back to real space along z.
+    auto ColumnPass = [&](bool forward, bool update, bool backward) -> bool
+    {
+        for (int y0 = 0; y0 < n; y0 += slabrows)
+        {
+            int y1 = tmin(n, y0 + slabrows);
+
+            SlabView slab;
+            if (!store.Load(0, n, y0, y1, true, slab))
+                return false;
+
+            #pragma omp parallel num_threads(nthreads)
+            {
+                std::vector<float2> columns((size_t)n * ColumnBlock);
+
+                #pragma omp for schedule(dynamic)
+                for (int y = y0; y < y1; y++)
+                {
+                    int ky = Frequency(y, n);
+
+                    for (int xblock = 0; xblock < xh; xblock += ColumnBlock)
+                    {
+                        int nx = tmin(ColumnBlock, xh - xblock);
+                        void* planforw = nx == ColumnBlock ? planforwlines : planforwline;
+                        void* planback = nx == ColumnBlock ? planbacklines : planbackline;
+
+                        for (int x = 0; x < nx; x++)
+                        {
+                            float2* h_column = columns.data() + (size_t)n * x;
+
+                            if (forward)
+                                for (int z = 0; z < n; z++)
+                                    h_column[z] = slab.Row(z, y)[xblock + x].conv;
+                            else
+                                for (int z = 0; z < n; z++)
+                                {
+                                    GridVoxel &voxel = slab.Row(z, y)[xblock + x];
+                                    h_column[z] = make_float2(voxel.newweight * voxel.weight, 0);
+                                }
+                        }
+
+                        if (forward)
+                            for (int x = 0; x < nx; x += (nx == ColumnBlock ? ColumnBlock : 1))
+                                h_FFTExecuteLines(planforw, columns.data() + (size_t)n * x);
+
+                        if (update)
+                            for (int x = 0; x < nx; x++)
+                            {
+                                int kx = xblock + x;
+                                float2* h_column = columns.data() + (size_t)n * x;
+
+                                for (int z = 0; z < n; z++)
+                                {
+                                    int kz = Frequency(z, n);
+                                    GridVoxel &voxel = slab.Row(z, y)[kx];
+
+                                    // Eq. 14 in Pipe & Menon (1999)
+                                    if (kx * kx + ky * ky + kz * kz < maxr2)
+                                        voxel.newweight /= tmax(1e-6f, sqrt(h_column[z].x * h_column[z].x + h_column[z].y * h_column[z].y));
+
+                                    h_column[z] = make_float2(voxel.newweight * voxel.weight, 0);
+                                }
+                            }
+
+                        if (backward)
+                        {
+                            for (int x = 0; x < nx; x += (nx == ColumnBlock ? ColumnBlock : 1))
+                                h_FFTExecuteLines(planback, columns.data() + (size_t)n * x);
+
+                            for (int x = 0; x < nx; x++)
+                            {
+                                float2* h_column = columns.data() + (size_t)n * x;
+                                for (int z = 0; z < n; z++)
+                                    slab.Row(z, y)[xblock + x].conv = h_column[z];
+                            }
+                        }
+                    }
+                }
+            }
+
+            if (!store.Save(0, n, y0, y1, slab))
+                return false;
+        }
+
+        return true;
+    };
+
+    // 2D transforms of every plane to real space, multiplication with the blob transform, and back
+    auto PlanePass = [&]() -> bool
+    {
+        for (int z0 = 0; z0 < n; z0 += slabplanes)
+        {
+            int z1 = tmin(n, z0 + slabplanes);
+
+            SlabView slab;
+            if (!store.Load(z0, z1, 0, n, true, slab))
+                return false;
+
+            #pragma omp parallel num_threads(nthreads)
+            {
+                std::vector<float2> planeft((size_t)n * xh);
+                std::vector<float> plane((size_t)n * n);
+
+                #pragma omp for schedule(dynamic)
+                for (int z = z0; z < z1; z++)
+                {
+                    // Real-space coordinates wrap like in RELION's convoluteBlobRealSpace
+                    int rz = Frequency(z, n);
+
+                    for (int y = 0; y < n; y++)
+                    {
+                        GridVoxel* h_row = slab.Row(z, y);
+                        for (int x = 0; x < xh; x++)
+                            planeft[(size_t)y * xh + x] = h_row[x].conv;
+                    }
+
+                    h_FFTExecuteC2R(planbackplane, planeft.data(), plane.data());
+
+                    for (int y = 0; y < n; y++)
+                    {
+                        int ry = Frequency(y, n);
+                        for (int x = 0; x < n; x++)
+                        {
+                            int rx = Frequency(x, n);
+                            plane[(size_t)y * n + x] *= blobtable[rx * rx + ry * ry + rz * rz];
+                        }
+                    }
+
+                    h_FFTExecuteR2C(planforwplane, plane.data(), planeft.data());
+
+                    for (int y = 0; y < n; y++)
+                    {
+                        GridVoxel* h_row = slab.Row(z, y);
+                        for (int x = 0; x < xh; x++)
+                            h_row[x].conv = planeft[(size_t)y * xh + x];
+                    }
+                }
+            }
+
+            if (!store.Save(z0, z1, 0, n, slab))
+                return false;
+        }
+
+        return true;
+    };
+
+    if (success && iterations > 0)
+        success = ColumnPass(false, false, true);
+
+    for (int i = 0; i < iterations && success; i++)
+    {
+        success = PlanePass();
+        if (success)
+            success = ColumnPass(true, true, i < iterations - 1);
+    }
+
+    h_FFTDestroyThreadPlan(planforwlines);
+    h_FFTDestroyThreadPlan(planbacklines);
+    h_FFTDestroyThreadPlan(planforwline);
+    h_FFTDestroyThreadPlan(planbackline);
+    h_FFTDestroyThreadPlan(planforwplane);
+    h_FFTDestroyThreadPlan(planbackplane);
+
+    if (!success)
+        return false;
+
+    /*
+
+    Symmetrized data times the final weights, windowed to P = oversampling * ori and transformed along z.
+    Only the ori planes that survive the real-space windowing are kept, in the first ori planes of conv.
+    Rows keep their index on the padded grid, so every column is read and written in the same place.
+
+    */
+
+    planbacklines = h_FFTCreateLinesPlan(P, 1, false);
+
+    for (int y0 = 0; y0 < n && success; y0 += slabrows)
+    {
+        int y1 = tmin(n, y0 + slabrows);
+
+        SlabView slab;
+        success = store.Load(0, n, y0, y1, true, slab);
+        if (!success)
+            break;
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            std::vector<float2> column(P);
+
+            #pragma omp for schedule(dynamic)
+            for (int y = y0; y < y1; y++)
+            {
+                int ky = Frequency(y, n);
+                if (ky <= -P / 2 || ky > P / 2)
+                    continue;
+
+                for (int x = 0; x < Pxh; x++)
+                {
+                    for (int zp = 0; zp < P; zp++)
+                    {
+                        int kz = Frequency(zp, P);
+                        column[zp] = make_float2(0, 0);
+
+                        if (x * x + ky * ky + kz * kz <= maxr2)
+                        {
+                            float2 data;
+                            float dummy;
+                            source.Gather<true, false>(x, ky, kz, data, dummy);
+
+                            column[zp] = data * slab.Row(Wrap(kz, n), y)[x].newweight;
+                        }
+                    }
+
+                    h_FFTExecuteLines(planbacklines, column.data());
+
+                    for (int z = 0; z < ori; z++)
+                        slab.Row(z, y)[x].conv = column[Wrap(z - ori / 2, P)];
+                }
+            }
+        }
+
+        success = store.Save(0, n, y0, y1, slab);
+    }
+
+    h_FFTDestroyThreadPlan(planbacklines);
+
+    if (!success)
+        return false;
+
+    // Remaining 2D transforms, real-space windowing to ori, and the background outside the sphere for the soft mask
+    const float MaskWidth = 3;
+    float maskradius = ori / 2.0f, maskradiusouter = maskradius + MaskWidth;
+    double masksum = 0, maskweightsum = 0;
+
+    planbackplane = h_FFTCreateThreadPlan(2, toInt3(P, P, 1), false);
+    float normfft = 1.0f / (float)(oversampling * oversampling * oversampling);
+
+    for (int z0 = 0; z0 < ori && success; z0 += slabplanes)
+    {
+        int z1 = tmin(ori, z0 + slabplanes);
+
+        SlabView slab;
+        success = store.Load(z0, z1, 0, n, true, slab);
+        if (!success)
+            break;
+
+        #pragma omp parallel num_threads(nthreads) reduction(+:masksum, maskweightsum)
+        {
+            std::vector<float2> planeft((size_t)P * Pxh);
+            std::vector<float> plane((size_t)P * P);
+
+            #pragma omp for schedule(dynamic)
+            for (int z = z0; z < z1; z++)
+            {
+                for (int y = 0; y < P; y++)
+                {
+                    GridVoxel* h_row = slab.Row(z, Wrap(Frequency(y, P), n));
+                    for (int x = 0; x < Pxh; x++)
+                        planeft[(size_t)y * Pxh + x] = h_row[x].conv;
+                }
+
+                h_FFTExecuteC2R(planbackplane, planeft.data(), plane.data());
+
+                int cz = z - ori / 2;
+                float* h_output = h_reconstruction + (size_t)z * ori * ori;
+
+                for (int y = 0; y < ori; y++)
+                {
+                    int cy = y - ori / 2;
+                    float* h_planerow = plane.data() + (size_t)Wrap(cy, P) * P;
+
+                    for (int x = 0; x < ori; x++)
+                    {
+                        int cx = x - ori / 2;
+                        float val = h_planerow[Wrap(cx, P)] * normfft;
+                        h_output[(size_t)y * ori + x] = val;
+
+                        float r = sqrt((float)(cx * cx + cy * cy + cz * cz));
+                        if (r < maskradius)
+                            continue;
+
+                        float raisedcos = r > maskradiusouter ? 1.0f : 0.5f + 0.5f * cos(PI * (maskradiusouter - r) / MaskWidth);
+                        masksum += raisedcos * val;
+                        maskweightsum += raisedcos;
+                    }
+                }
+            }
+        }
+    }
+
+    h_FFTDestroyThreadPlan(planbackplane);
+
+    if (!success)
+        return false;
+
+    // Soft mask towards the average background, then correct for the trilinear interpolation in backprojection
+    float background = maskweightsum > 0 ? (float)(masksum / maskweightsum) : 0.0f;
+
+    #pragma omp parallel for num_threads(nthreads)
+    for (int z = 0; z < ori; z++)
+    {
+        int cz = z - ori / 2;
+        for (int y = 0; y < ori; y++)
+        {
+            int cy = y - ori / 2;
+            float* h_row = h_reconstruction + ((size_t)z * ori + y) * ori;
+
+            for (int x = 0; x < ori; x++)
+            {
+                int cx = x - ori / 2;
+                float r = sqrt((float)(cx * cx + cy * cy + cz * cz));
+                float val = h_row[x];
+
+                if (r > maskradiusouter)
+                    val = background;
+                else if (r >= maskradius)
+                {
+                    float raisedcos = 0.5f + 0.5f * cos(PI * (maskradiusouter - r) / MaskWidth);
+                    val = (1 - raisedcos) * val + raisedcos * background;
+                }
+
+                if (r > 0)
+                {
+                    float rval = r / (ori * oversampling);
+                    float sinc = sin(PI * rval) / (PI * rval);
+                    val /= sinc * sinc;
+                }
+
+                h_row[x] = val;
+            }
+        }
+    }
+
+    return true;
+}
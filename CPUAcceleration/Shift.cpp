@@ -0,0 +1,548 @@
+#include "Functions.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+using namespace gtom;
+
+#define SHIFT_BLOCK 1024
+#define SHIFT_FRAMES_PER_ITEM 4
+
+/*
+
+Supplied with a stack of frames, extraction positions for sub-regions, and a mask of relevant pixels in Fspace,
+this method extracts portions of each frame, computes the FT, and returns the relevant pixels, stored with the
+given STORAGE_* precision. The ShiftGet* methods take the same precision for d_phase.
+
+*/
+
+__declspec(dllexport) void CreateShift(float* d_frame,
+                                        int2 dimsframe,
+                                        int nframes,
+                                        int3* h_origins,
+                                        int norigins,
+                                        int2 dimsregion,
+                                        size_t* h_mask,
+                                        uint masklength,
+                                        void* d_outputall,
+                                        int precision)
+{
+    size_t elements = Elements2(dimsregion);
+    std::vector<size_t> gather = PatchSpectrumGatherIndices(h_mask, masklength, dimsregion);
+
+    // Same weights as h_HammingMask
+    std::vector<float> window(elements, 1.0f);
+    h_HammingMask(window.data(), window.data(), toInt3(dimsregion), 1);
+
+    // Every region of every frame is independent: extract while summing up, normalize and window, transform, gather
+    PatchSpectra(nframes * norigins, 1, dimsregion, 0, [&](int item, float* h_patch, float* h_scratch)
+    {
+        int z = item / norigins;
+        int3 origin = h_origins[item % norigins];
+        float* h_frame = d_frame + Elements2(dimsframe) * z;
+
+        double sum1 = 0, sum2 = 0;
+        for (int y = 0; y < dimsregion.y; y++)
+        {
+            int yy = ((y + origin.y) % dimsframe.y + dimsframe.y) % dimsframe.y;
+            float* h_row = h_frame + (size_t)yy * dimsframe.x;
+            float* h_patchrow = h_patch + (size_t)y * dimsregion.x;
+
+            for (int x = 0; x < dimsregion.x; x++)
+            {
+                float value = h_row[((x + origin.x) % dimsframe.x + dimsframe.x) % dimsframe.x];
+                h_patchrow[x] = value;
+                sum1 += value;
+                sum2 += (double)value * value;
+            }
+        }
+
+        double mean = sum1 / elements;
+        double stddev = sqrt(tmax(0.0, sum2 / elements - mean * mean));
+        float scale = stddev > 0 ? (float)(1.0 / stddev) : 0.0f;
+
+        for (size_t i = 0; i < elements; i++)
+            h_patch[i] = (h_patch[i] - (float)mean) * scale * window[i];
+    },
+    [&](int item, const float2* h_spectrum)
+    {
+        GatherPatchSpectrum(h_spectrum, gather.data(), masklength, ElementsFFT2(dimsregion), d_outputall, precision, (size_t)masklength * item);
+    });
+}
+
+namespace
+{
+    // Sums over all frames of every position's shifted phases, averages them, and optionally keeps the sums
+    void ShiftSumFrames(void* d_phase, float2* d_average, double* h_sums, float2* d_shiftfactors, uint length, uint probelength, float2* d_shifts, uint npositions, uint nframes, int precision)
+    {
+        PhaseRampView ramps;
+        AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+        int nblocks = (probelength + SHIFT_BLOCK - 1) / SHIFT_BLOCK;
+
+        #pragma omp parallel for
+        for (int item = 0; item < (int)npositions * nblocks; item++)
+        {
+            uint p = item / nblocks;
+            uint first = (item % nblocks) * SHIFT_BLOCK;
+            uint n = tmin((uint)SHIFT_BLOCK, probelength - first);
+
+            float2 changes[SHIFT_BLOCK];
+            float2 loaded[SHIFT_BLOCK];
+            double sums[SHIFT_BLOCK * 2];
+            for (uint i = 0; i < n * 2; i++)
+                sums[i] = 0.0;
+
+            for (uint frame = 0; frame < nframes; frame++)
+            {
+                uint specid = npositions * frame + p;
+                GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], first, n, changes);
+
+                const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)length * specid + first, n, loaded);
+                for (uint i = 0; i < n; i++)
+                {
+                    float2 value = cmul(h_phase[i], changes[i]);
+                    sums[i * 2] += (double)value.x;
+                    sums[i * 2 + 1] += (double)value.y;
+                }
+            }
+
+            if (h_sums != NULL)
+                for (uint i = 0; i < n * 2; i++)
+                    h_sums[(size_t)probelength * p * 2 + first * 2 + i] = sums[i];
+
+            for (uint i = 0; i < n; i++)
+                d_average[(size_t)probelength * p + first + i] = make_float2((float)(sums[i * 2] / nframes), (float)(sums[i * 2 + 1] / nframes));
+        }
+
+        ReleasePhaseRamps(&ramps);
+    }
+}
+
+__declspec(dllexport) void ShiftGetAverage(void* d_phase,
+                                            float2* d_average,
+                                            float2* d_shiftfactors,
+                                            uint length,
+                                            uint probelength,
+                                            float2* d_shifts,
+                                            uint npositions,
+                                            uint nframes,
+                                            int precision)
+{
+    ShiftSumFrames(d_phase, d_average, NULL, d_shiftfactors, length, probelength, d_shifts, npositions, nframes, precision);
+}
+
+/*
+
+Running average for optimizations that move only some of the shifts between evaluations, see the GPU version.
+The sums are kept as interleaved doubles. Freeing the phases or shift factors invalidates the states that use them.
+
+*/
+
+struct ShiftAverageState
+{
+    uint length, npositions, nframes;
+
+    // What the sums are for, anything else starts over
+    void* d_phase;
+    float2* d_shiftfactors;
+    uint probelength;
+    int precision;
+    bool valid;
+
+    std::vector<double> h_sums;         // npositions * probelength * 2
+    std::vector<float2> h_lastshifts;   // Frame-major like d_shifts
+
+    long long nupdated, nrecomputed;
+};
+
+namespace
+{
+    std::mutex ShiftAveragesMutex;
+    std::unordered_set<ShiftAverageState*> ShiftAverages;
+    std::atomic<int> ShiftAveragesSize(0);  // Lets ForgetShiftAverages skip the lock on every free while no state exists
+}
+
+void ForgetShiftAverages(void* d_memory)
+{
+    if (ShiftAveragesSize.load() == 0 || d_memory == NULL)
+        return;
+
+    std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+    for (ShiftAverageState* state : ShiftAverages)
+        if (state->d_phase == d_memory || state->d_shiftfactors == d_memory)
+            state->valid = false;
+}
+
+__declspec(dllexport) void* CreateShiftAverage(uint length, uint npositions, uint nframes)
+{
+    ShiftAverageState* state = new ShiftAverageState();
+    state->length = length;
+    state->npositions = npositions;
+    state->nframes = nframes;
+    state->d_phase = NULL;
+    state->d_shiftfactors = NULL;
+    state->probelength = 0;
+    state->precision = STORAGE_FP32;
+    state->valid = false;
+    state->nupdated = state->nrecomputed = 0;
+
+    state->h_sums.resize((size_t)length * npositions * 2);
+    state->h_lastshifts.resize((size_t)npositions * nframes);
+
+    std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+    ShiftAverages.insert(state);
+    ShiftAveragesSize = (int)ShiftAverages.size();
+
+    return state;
+}
+
+__declspec(dllexport) void DestroyShiftAverage(void* average)
+{
+    if (average == NULL)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+        ShiftAverages.erase((ShiftAverageState*)average);
+        ShiftAveragesSize = (int)ShiftAverages.size();
+    }
+
+    delete (ShiftAverageState*)average;
+}
+
+__declspec(dllexport) void ShiftAverageGetStats(void* average, long long* h_updated, long long* h_recomputed)
+{
+    ShiftAverageState* state = (ShiftAverageState*)average;
+
+    *h_updated = state->nupdated;
+    *h_recomputed = state->nrecomputed;
+}
+
+__declspec(dllexport) void ShiftGetAverageIncremental(void* average,
+                                                        void* d_phase,
+                                                        float2* d_average,
+                                                        float2* d_shiftfactors,
+                                                        uint length,
+                                                        uint probelength,
+                                                        float2* d_shifts,
+                                                        uint npositions,
+                                                        uint nframes,
+                                                        int precision)
+{
+    ShiftAverageState* state = (ShiftAverageState*)average;
+    uint nshifts = npositions * nframes;
+
+    if (length > state->length || npositions != state->npositions || nframes != state->nframes)
+    {
+        state->valid = false;
+        ShiftGetAverage(d_phase, d_average, d_shiftfactors, length, probelength, d_shifts, npositions, nframes, precision);
+        return;
+    }
+
+    // Changed frames grouped by position
+    std::vector<uint> h_offsets(npositions + 1);
+    std::vector<uint> h_frames;
+    for (uint p = 0; p < npositions; p++)
+    {
+        h_offsets[p] = (uint)h_frames.size();
+        for (uint frame = 0; frame < nframes; frame++)
+        {
+            float2 a = d_shifts[npositions * frame + p], b = state->h_lastshifts[npositions * frame + p];
+            if (a.x != b.x || a.y != b.y)
+                h_frames.push_back(frame);
+        }
+    }
+    h_offsets[npositions] = (uint)h_frames.size();
+    uint nchanged = (uint)h_frames.size();
+
+    bool compatible = state->valid &&
+                      state->d_phase == d_phase &&
+                      state->d_shiftfactors == d_shiftfactors &&
+                      state->probelength == probelength &&
+                      state->precision == precision;
+
+    if (!compatible || nchanged * 2 > nshifts)
+    {
+        ShiftSumFrames(d_phase, d_average, state->h_sums.data(), d_shiftfactors, length, probelength, d_shifts, npositions, nframes, precision);
+
+        state->d_phase = d_phase;
+        state->d_shiftfactors = d_shiftfactors;
+        state->probelength = probelength;
+        state->precision = precision;
+        state->valid = true;
+        state->nrecomputed++;
+    }
+    else
+    {
+        // New shifts of the changed frames, followed by their old ones
+        std::vector<float2> h_pairshifts(nchanged * 2);
+        for (uint p = 0, k = 0; p < npositions; p++)
+            for (; k < h_offsets[p + 1]; k++)
+            {
+                h_pairshifts[k] = d_shifts[npositions * h_frames[k] + p];
+                h_pairshifts[nchanged + k] = state->h_lastshifts[npositions * h_frames[k] + p];
+            }
+
+        PhaseRampView ramps;
+        AcquirePhaseRamps(d_shiftfactors, probelength, h_pairshifts.data(), nchanged * 2, &ramps);
+
+        int nblocks = (probelength + SHIFT_BLOCK - 1) / SHIFT_BLOCK;
+        double* h_sums = state->h_sums.data();
+
+        #pragma omp parallel for
+        for (int item = 0; item < (int)npositions * nblocks; item++)
+        {
+            uint p = item / nblocks;
+            uint first = (item % nblocks) * SHIFT_BLOCK;
+            uint n = tmin((uint)SHIFT_BLOCK, probelength - first);
+            double* h_blocksums = h_sums + ((size_t)probelength * p + first) * 2;
+
+            float2 added[SHIFT_BLOCK];
+            float2 removed[SHIFT_BLOCK];
+            float2 loaded[SHIFT_BLOCK];
+
+            for (uint k = h_offsets[p]; k < h_offsets[p + 1]; k++)
+            {
+                GetPhaseRamps(ramps, k, d_shiftfactors, h_pairshifts[k], first, n, added);
+                GetPhaseRamps(ramps, nchanged + k, d_shiftfactors, h_pairshifts[nchanged + k], first, n, removed);
+
+                const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)length * (npositions * h_frames[k] + p) + first, n, loaded);
+                for (uint i = 0; i < n; i++)
+                {
+                    float2 a = cmul(h_phase[i], added[i]), r = cmul(h_phase[i], removed[i]);
+                    h_blocksums[i * 2] += (double)a.x - (double)r.x;
+                    h_blocksums[i * 2 + 1] += (double)a.y - (double)r.y;
+                }
+            }
+
+            for (uint i = 0; i < n; i++)
+                d_average[(size_t)probelength * p + first + i] = make_float2((float)(h_blocksums[i * 2] / nframes), (float)(h_blocksums[i * 2 + 1] / nframes));
+        }
+
+        ReleasePhaseRamps(&ramps);
+
+        state->nupdated += nchanged;
+    }
+
+    state->h_lastshifts.assign(d_shifts, d_shifts + nshifts);
+}
+
+__declspec(dllexport) void ShiftGetDiff(void* d_phase,
+                                        float2* d_average,
+                                        float2* d_shiftfactors,
+                                        uint length,
+                                        uint probelength,
+                                        float2* d_shifts,
+                                        float* h_diff,
+                                        uint npositions,
+                                        uint nframes,
+                                        int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(npositions * nframes); specid++)
+    {
+        std::vector<float2> loaded(precision == STORAGE_FP32 ? 0 : probelength);
+        const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length, probelength, loaded.data());
+        float2* h_average = d_average + (size_t)(specid % npositions) * probelength;
+
+        std::vector<float2> changes(probelength);
+        GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], 0, probelength, changes.data());
+
+        float diffsum = 0.0f;
+        float ampsum = 0.0f;
+
+        for (uint id = 0; id < probelength; id++)
+        {
+            float2 value = cmul(h_phase[id], changes[id]);
+            float2 average = h_average[id];
+
+            float2 valuenorm = value / tmax(1e-10f, sqrt(value.x * value.x + value.y * value.y));
+            float avgamp = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));
+            average /= avgamp;
+
+            diffsum += acos(tmax(-1.0f, tmin(valuenorm.x * average.x + valuenorm.y * average.y, 1.0f))) * avgamp;
+            ampsum += avgamp;
+        }
+
+        h_diff[specid] = diffsum / ampsum;
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+__declspec(dllexport) void ShiftGetGrad(void* d_phase,
+                                        float2* d_average,
+                                        float2* d_shiftfactors,
+                                        uint length,
+                                        uint probelength,
+                                        float2* d_shifts,
+                                        float2* h_grad,
+                                        uint npositions,
+                                        uint nframes,
+                                        int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    #pragma omp parallel for
+    for (int specid = 0; specid < (int)(npositions * nframes); specid++)
+    {
+        std::vector<float2> loaded(precision == STORAGE_FP32 ? 0 : probelength);
+        const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length, probelength, loaded.data());
+        float2* h_average = d_average + (size_t)(specid % npositions) * probelength;
+
+        std::vector<float2> changes(probelength);
+        GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], 0, probelength, changes.data());
+
+        float2 gradsum = make_float2(0.0f, 0.0f);
+        float ampsum = 0.0f;
+
+        for (uint id = 0; id < probelength; id++)
+        {
+            float2 average = h_average[id];
+            float2 shiftfactors = d_shiftfactors[id];
+            float weight = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));
+
+            float2 altvalue = cmul(h_phase[id], changes[id]);
+            float direction = (float)-sgn(altvalue.x * average.y - altvalue.y * average.x);
+
+            gradsum.x += direction * shiftfactors.x * weight;
+            gradsum.y += direction * shiftfactors.y * weight;
+            ampsum += weight;
+        }
+
+        h_grad[specid] = gradsum / ampsum;
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+/*
+
+Objective and gradient of ShiftGetDiff and ShiftGetGrad in one pass over d_phase. Work items are a position and
+a few of its frames; they walk the mask in blocks, so the normalized average of each block stays in L1 while it
+is compared to all of the item's frames.
+
+*/
+
+__declspec(dllexport) void ShiftGetDiffAndGrad(void* d_phase,
+                                                float2* d_average,
+                                                float2* d_shiftfactors,
+                                                uint length,
+                                                uint probelength,
+                                                float2* d_shifts,
+                                                float* h_diff,
+                                                float2* h_grad,
+                                                uint npositions,
+                                                uint nframes,
+                                                int precision)
+{
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+    int nframegroups = (nframes + SHIFT_FRAMES_PER_ITEM - 1) / SHIFT_FRAMES_PER_ITEM;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int item = 0; item < (int)npositions * nframegroups; item++)
+    {
+        uint p = item / nframegroups;
+        uint firstframe = (item % nframegroups) * SHIFT_FRAMES_PER_ITEM;
+        uint nitemframes = tmin((uint)SHIFT_FRAMES_PER_ITEM, nframes - firstframe);
+
+        float2 averagenorm[SHIFT_BLOCK];
+        float averageamp[SHIFT_BLOCK];
+        float2 changes[SHIFT_BLOCK];
+        float2 loaded[SHIFT_BLOCK];
+
+        float diffsum[SHIFT_FRAMES_PER_ITEM] = { 0 };
+        float2 gradsum[SHIFT_FRAMES_PER_ITEM];
+        for (uint f = 0; f < nitemframes; f++)
+            gradsum[f] = make_float2(0, 0);
+        float ampsum = 0;
+
+        float2* h_average = d_average + (size_t)probelength * p;
+
+        for (uint first = 0; first < probelength; first += SHIFT_BLOCK)
+        {
+            uint n = tmin((uint)SHIFT_BLOCK, probelength - first);
+
+            for (uint i = 0; i < n; i++)
+            {
+                float2 average = h_average[first + i];
+                float amp = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));
+                averagenorm[i] = average / amp;
+                averageamp[i] = amp;
+                ampsum += amp;
+            }
+
+            for (uint f = 0; f < nitemframes; f++)
+            {
+                uint specid = npositions * (firstframe + f) + p;
+                const float2* h_phase = h_LoadComplex(d_phase, precision, (size_t)specid * length + first, n, loaded);
+                float2* h_factors = d_shiftfactors + first;
+
+                GetPhaseRamps(ramps, specid, d_shiftfactors, d_shifts[specid], first, n, changes);
+
+                float diff = 0;
+                float2 grad = make_float2(0, 0);
+                for (uint i = 0; i < n; i++)
+                {
+                    float2 value = cmul(h_phase[i], changes[i]);
+                    float2 average = averagenorm[i];
+                    float amp = averageamp[i];
+
+                    float valueamp = tmax(1e-10f, sqrt(value.x * value.x + value.y * value.y));
+                    float cosine = (value.x * average.x + value.y * average.y) / valueamp;
+                    diff += acos(tmax(-1.0f, tmin(cosine, 1.0f))) * amp;
+
+                    float direction = (float)-sgn(value.x * average.y - value.y * average.x) * amp;
+                    grad.x += direction * h_factors[i].x;
+                    grad.y += direction * h_factors[i].y;
+                }
+
+                diffsum[f] += diff;
+                gradsum[f] += grad;
+            }
+        }
+
+        for (uint f = 0; f < nitemframes; f++)
+        {
+            uint specid = npositions * (firstframe + f) + p;
+            h_diff[specid] = diffsum[f] / ampsum;
+            h_grad[specid] = gradsum[f] / ampsum;
+        }
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+__declspec(dllexport) void CreateMotionBlur(float* d_output, int3 dims, float* h_shifts, uint nshifts, uint batch)
+{
+    // Real part of the average phase ramp over all shifts in each batch item
+    size_t elements = ElementsFFT(dims);
+    int xhalf = dims.x / 2 + 1;
+    float3* h_shifts3 = (float3*)h_shifts;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+    {
+        size_t b = (size_t)i / elements, e = (size_t)i % elements;
+        int kx = (int)(e % xhalf);
+        int y = (int)(e / xhalf % dims.y), z = (int)(e / xhalf / dims.y);
+        int ky = y < (dims.y + 1) / 2 ? y : y - dims.y;
+        int kz = z < (dims.z + 1) / 2 ? z : z - dims.z;
+
+        float sum = 0;
+        for (uint s = 0; s < nshifts; s++)
+        {
+            float3 shift = h_shifts3[b * nshifts + s];
+            float phase = -2.0f * (float)PI * ((float)kx * shift.x / dims.x + (float)ky * shift.y / dims.y + (float)kz * shift.z / dims.z);
+            sum += cos(phase);
+        }
+
+        d_output[i] = sum / (float)nshifts;
+    }
+}
@@ -0,0 +1,736 @@
+#include "Functions.h"
+#include <algorithm>
+using namespace gtom;
+
+namespace
+{
+    // CTF-weighted normalized cross-correlation between a shifted experimental and a reference spectrum.
+    // h_changes holds the phase ramp for the shift, see GetPhaseRamps.
+    float TomoCorrelate(float2* h_experimental, float2* h_reference, const float2* h_changes, float* h_ctf, uint length)
+    {
+        float numsum = 0.0f, denomsum1 = 0.0f, denomsum2 = 0.0f;
+
+        for (uint id = 0; id < length; id++)
+        {
+            float2 experimental = cmul(h_experimental[id], h_changes[id]);
+            float2 reference = h_reference[id] * h_ctf[id];
+
+            float weight = abs(h_ctf[id]);
+            experimental *= weight;
+            reference *= weight;
+
+            numsum += dotp2(experimental, reference);
+            denomsum1 += dotp2(experimental, experimental);
+            denomsum2 += dotp2(reference, reference);
+        }
+
+        return numsum / tmax(1e-15f, sqrt(denomsum1 * denomsum2));
+    }
+}
+
+__declspec(dllexport) void TomoRefineGetDiff(float2* d_experimental,
+                                            float2* d_reference,
+                                            float2* d_shiftfactors,
+                                            float* d_ctf,
+                                            float* d_weights,
+                                            int2 dims,
+                                            float2* h_shifts,
+                                            float* h_diff,
+                                            uint nparticles)
+{
+    uint length = (uint)ElementsFFT2(dims);
+
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, length, h_shifts, nparticles, &ramps);
+
+    #pragma omp parallel for
+    for (int p = 0; p < (int)nparticles; p++)
+    {
+        std::vector<float2> changes(length);
+        GetPhaseRamps(ramps, p, d_shiftfactors, h_shifts[p], 0, length, changes.data());
+
+        h_diff[p] = TomoCorrelate(d_experimental + (size_t)length * p,
+                                  d_reference + (size_t)length * p,
+                                  changes.data(),
+                                  d_ctf + (size_t)length * p,
+                                  length) * d_weights[p];
+    }
+
+    ReleasePhaseRamps(&ramps);
+}
+
+__declspec(dllexport) void TomoRealspaceCorrelate(float* d_projections, int2 dims, uint nprojections, uint ntilts, float* d_experimental, float* d_ctf, float* d_mask, float* d_weights, float* h_shifts, float* h_result)
+{
+    size_t elements = Elements2(dims);
+    float* h_experimentalshifted = (float*)MallocAligned(elements * ntilts * sizeof(float));
+
+    // Shift experimental data
+    h_Shift(d_experimental, h_experimentalshifted, toInt3(dims), (tfloat3*)h_shifts, ntilts);
+    h_NormMonolithic(h_experimentalshifted, h_experimentalshifted, elements, d_mask, ntilts);
+
+    // The mask is the same for every tilt and projection, sum it once
+    float samples = 0;
+    for (size_t i = 0; i < elements; i++)
+        samples += d_mask[i];
+
+    #pragma omp parallel for
+    for (int p = 0; p < (int)nprojections; p++)
+    {
+        float* h_projection = d_projections + elements * ntilts * p;
+        float corrsum = 0;
+
+        for (uint t = 0; t < ntilts; t++)
+        {
+            float tiltcorr = 0;
+            for (size_t i = 0; i < elements; i++)
+                tiltcorr += h_projection[elements * t + i] * h_experimentalshifted[elements * t + i] * d_mask[i];
+
+            corrsum += tiltcorr / samples * d_weights[t];
+        }
+
+        h_result[p] = corrsum;
+    }
+
+    FreeAligned(h_experimentalshifted);
+}
+
+/*
+
+Real-space scoring of one particle's tilt images against many projections and many candidate shifts at once, see
+the GPU version for the math. Every thread takes one projection at a time: its correlation maps for all tilts
+stay in the thread's scratch memory while all candidate shifts are looked up in them.
+
+*/
+
+namespace
+{
+    float CatmullRomPeriodic(const float* h_map, int2 dims, float2 shift)
+    {
+        float fx = floor(shift.x), fy = floor(shift.y);
+        float tx = shift.x - fx, ty = shift.y - fy;
+
+        float wx[4] = { ((-tx + 2.0f) * tx - 1.0f) * tx * 0.5f, ((3.0f * tx - 5.0f) * tx * tx + 2.0f) * 0.5f, ((-3.0f * tx + 4.0f) * tx + 1.0f) * tx * 0.5f, (tx - 1.0f) * tx * tx * 0.5f };
+        float wy[4] = { ((-ty + 2.0f) * ty - 1.0f) * ty * 0.5f, ((3.0f * ty - 5.0f) * ty * ty + 2.0f) * 0.5f, ((-3.0f * ty + 4.0f) * ty + 1.0f) * ty * 0.5f, (ty - 1.0f) * ty * ty * 0.5f };
+
+        int x0 = (int)fx - 1, y0 = (int)fy - 1;
+        float sum = 0.0f;
+        for (int j = 0; j < 4; j++)
+        {
+            int y = ((y0 + j) % dims.y + dims.y) % dims.y;
+            float row = 0.0f;
+            for (int i = 0; i < 4; i++)
+                row += h_map[y * dims.x + ((x0 + i) % dims.x + dims.x) % dims.x] * wx[i];
+            sum += row * wy[j];
+        }
+
+        return sum;
+    }
+
+    // a * conj(b)
+    inline float2 MultiplyConj(float2 a, float2 b)
+    {
+        return make_float2(a.x * b.x + a.y * b.y, a.y * b.x - a.x * b.y);
+    }
+}
+
+struct TomoRealspaceScorer
+{
+    int2 dims;
+    uint ntilts;
+    float masknorm;     // 1 / sum of the mask
+
+    std::vector<float> mask;
+    float2* h_imagesft;
+    float* h_means;     // Per tilt and shift, mean of the shifted image under the mask
+    float* h_scales;    // ... and its inverse standard deviation
+};
+
+__declspec(dllexport) void* CreateTomoRealspaceScorer(float* d_experimental, float* d_mask, int2 dims, uint ntilts)
+{
+    TomoRealspaceScorer* scorer = new TomoRealspaceScorer();
+    scorer->dims = dims;
+    scorer->ntilts = ntilts;
+
+    size_t elements = Elements2(dims), elementsft = ElementsFFT2(dims);
+
+    scorer->mask.assign(d_mask, d_mask + elements);
+    double samples = 0;
+    for (size_t i = 0; i < elements; i++)
+        samples += d_mask[i];
+    scorer->masknorm = (float)(1.0 / tmax(samples, 1e-6));
+
+    scorer->h_imagesft = (float2*)MallocAligned(elementsft * ntilts * sizeof(float2));
+    scorer->h_means = (float*)MallocAligned(elements * ntilts * sizeof(float));
+    scorer->h_scales = (float*)MallocAligned(elements * ntilts * sizeof(float));
+
+    std::vector<float2> maskft(elementsft);
+    h_FFTR2C(d_mask, maskft.data(), 2, toInt3(dims));
+
+    float* h_squares = (float*)MallocAligned(elements * ntilts * sizeof(float));
+    float2* h_squaresft = (float2*)MallocAligned(elementsft * ntilts * sizeof(float2));
+    for (size_t i = 0; i < elements * ntilts; i++)
+        h_squares[i] = d_experimental[i] * d_experimental[i];
+
+    h_FFTR2C(d_experimental, scorer->h_imagesft, 2, toInt3(dims), ntilts);
+    h_FFTR2C(h_squares, h_squaresft, 2, toInt3(dims), ntilts);
+
+    // Masked sums of the image and its square for every shift, turned into mean and inverse standard deviation
+    float2* h_sums1ft = (float2*)MallocAligned(elementsft * ntilts * sizeof(float2));
+    for (size_t i = 0; i < elementsft * ntilts; i++)
+    {
+        h_sums1ft[i] = MultiplyConj(maskft[i % elementsft], scorer->h_imagesft[i]);
+        h_squaresft[i] = MultiplyConj(maskft[i % elementsft], h_squaresft[i]);
+    }
+    h_IFFTC2R(h_sums1ft, scorer->h_means, 2, toInt3(dims), ntilts);
+    h_IFFTC2R(h_squaresft, scorer->h_scales, 2, toInt3(dims), ntilts);
+
+    for (size_t i = 0; i < elements * ntilts; i++)
+    {
+        float mean = scorer->h_means[i] * scorer->masknorm;
+        float stddev = sqrt(tmax(0.0f, scorer->h_scales[i] * scorer->masknorm - mean * mean));
+
+        scorer->h_means[i] = mean;
+        scorer->h_scales[i] = stddev > 0.0f ? 1.0f / stddev : 0.0f;
+    }
+
+    FreeAligned(h_sums1ft);
+    FreeAligned(h_squaresft);
+    FreeAligned(h_squares);
+
+    return scorer;
+}
+
+__declspec(dllexport) void DestroyTomoRealspaceScorer(void* tomoscorer)
+{
+    if (tomoscorer == NULL)
+        return;
+
+    TomoRealspaceScorer* scorer = (TomoRealspaceScorer*)tomoscorer;
+    FreeAligned(scorer->h_scales);
+    FreeAligned(scorer->h_means);
+    FreeAligned(scorer->h_imagesft);
+    delete scorer;
+}
+
+__declspec(dllexport) void TomoRealspaceScorerCorrelate(void* tomoscorer, float* d_projections, uint nprojections, float* d_weights, float* h_shifts, uint nshifts, int topk, int* h_bestshifts, float* h_bestscores)
+{
+    TomoRealspaceScorer* scorer = (TomoRealspaceScorer*)tomoscorer;
+    int2 dims = scorer->dims;
+    uint ntilts = scorer->ntilts;
+    size_t elements = Elements2(dims), elementsft = ElementsFFT2(dims);
+
+    std::vector<float2> shifts((size_t)nshifts * ntilts);
+    for (size_t i = 0; i < shifts.size(); i++)
+        shifts[i] = make_float2(h_shifts[i * 3], h_shifts[i * 3 + 1]);
+
+    void* planforward = h_FFTCreateThreadPlan(2, toInt3(dims), true);
+    void* planback = h_FFTCreateThreadPlan(2, toInt3(dims), false);
+
+    #pragma omp parallel
+    {
+        float* h_maps = (float*)MallocAligned(elements * ntilts * sizeof(float));
+        float* h_masked = (float*)MallocAligned(elements * sizeof(float));
+        float2* h_maskedft = (float2*)MallocAligned(elementsft * sizeof(float2));
+        std::vector<float> scores(nshifts);
+        std::vector<int> order(nshifts);
+
+        #pragma omp for schedule(dynamic, 1)
+        for (int p = 0; p < (int)nprojections; p++)
+        {
+            for (uint t = 0; t < ntilts; t++)
+            {
+                float* h_projection = d_projections + elements * (ntilts * p + t);
+                for (size_t i = 0; i < elements; i++)
+                    h_masked[i] = h_projection[i] * scorer->mask[i];
+
+                h_FFTExecuteR2C(planforward, h_masked, h_maskedft);
+
+                // Unnormalized transforms: the DC component is the masked projection's sum, the inverse needs 1 / elements
+                float sum = h_maskedft[0].x;
+                const float2* h_imageft = scorer->h_imagesft + elementsft * t;
+                for (size_t i = 0; i < elementsft; i++)
+                    h_maskedft[i] = MultiplyConj(h_maskedft[i], h_imageft[i]);
+
+                float* h_map = h_maps + elements * t;
+                h_FFTExecuteC2R(planback, h_maskedft, h_map);
+
+                const float* h_means = scorer->h_means + elements * t;
+                const float* h_scales = scorer->h_scales + elements * t;
+                float norm = 1.0f / (float)elements;
+                for (size_t i = 0; i < elements; i++)
+                    h_map[i] = (h_map[i] * norm - h_means[i] * sum) * h_scales[i] * scorer->masknorm;
+            }
+
+            for (uint s = 0; s < nshifts; s++)
+            {
+                float score = 0.0f;
+                for (uint t = 0; t < ntilts; t++)
+                    score += CatmullRomPeriodic(h_maps + elements * t, dims, shifts[(size_t)s * ntilts + t]) * d_weights[t];
+                scores[s] = score;
+                order[s] = s;
+            }
+
+            int nbest = tmin(topk, (int)nshifts);
+            std::partial_sort(order.begin(), order.begin() + nbest, order.end(), [&](int a, int b) { return scores[a] > scores[b] || (scores[a] == scores[b] && a < b); });
+
+            for (int k = 0; k < topk; k++)
+            {
+                h_bestshifts[(size_t)p * topk + k] = k < nbest ? order[k] : -1;
+                h_bestscores[(size_t)p * topk + k] = k < nbest ? scores[order[k]] : -1e30f;
+            }
+        }
+
+        FreeAligned(h_maskedft);
+        FreeAligned(h_masked);
+        FreeAligned(h_maps);
+    }
+
+    h_FFTDestroyThreadPlan(planback);
+    h_FFTDestroyThreadPlan(planforward);
+}
+
+__declspec(dllexport) void TomoGlobalAlign(float2* d_experimental,
+                                            float2* d_shiftfactors,
+                                            float* d_ctf,
+                                            float* d_weights,
+                                            int2 dims,
+                                            float2* d_ref,
+                                            int3 dimsref,
+                                            int refsupersample,
+                                            float3* h_angles,
+                                            uint nangles,
+                                            float2* h_shifts,
+                                            uint nshifts,
+                                            uint nparticles,
+                                            uint ntilts,
+                                            int* h_bestangles,
+                                            int* h_bestshifts,
+                                            float* h_bestscores)
+{
+    uint batchangles = 128;
+    uint length = (uint)ElementsFFT2(dims);
+
+    PhaseRampView ramps;
+    AcquirePhaseRamps(d_shiftfactors, length, h_shifts, nshifts * ntilts, &ramps);
+
+    float2* h_proj = (float2*)MallocAligned((size_t)length * batchangles * ntilts * sizeof(float2));
+    float* h_scores = (float*)MallocAligned((size_t)nparticles * batchangles * nshifts * sizeof(float));
+
+    // Bricked once, every batch below projects from the same copy
+    BrickedVolume bricked;
+    bool isbricked = h_BrickVolume(d_ref, dimsref, &bricked);
+
+    for (uint b = 0; b < nangles; b += batchangles)
+    {
+        uint curbatch = tmin(batchangles, nangles - b);
+
+        // Every angle comes with one orientation per tilt
+        if (isbricked)
+            h_rlnProject(bricked, h_proj, toInt3(dims), h_angles + b * ntilts, (float)refsupersample, curbatch * ntilts);
+        else
+            h_rlnProject(d_ref, dimsref, h_proj, toInt3(dims), h_angles + b * ntilts, (float)refsupersample, curbatch * ntilts);
+
+        #pragma omp parallel for collapse(2)
+        for (int p = 0; p < (int)nparticles; p++)
+            for (int a = 0; a < (int)curbatch; a++)
+            {
+                std::vector<float2> changes(length);
+
+                for (uint s = 0; s < nshifts; s++)
+                {
+                    float partsum = 0;
+                    for (uint n = 0; n < ntilts; n++)
+                    {
+                        GetPhaseRamps(ramps, s * ntilts + n, d_shiftfactors, h_shifts[s * ntilts + n], 0, length, changes.data());
+
+                        partsum += TomoCorrelate(d_experimental + ((size_t)p * ntilts + n) * length,
+                                                 h_proj + ((size_t)a * ntilts + n) * length,
+                                                 changes.data(),
+                                                 d_ctf + ((size_t)p * ntilts + n) * length,
+                                                 length) * d_weights[p * ntilts + n];
+                    }
+
+                    h_scores[((size_t)p * curbatch + a) * nshifts + s] = partsum;
+                }
+            }
+
+        for (uint p = 0; p < nparticles; p++)
+            for (uint a = 0; a < curbatch; a++)
+                for (uint s = 0; s < nshifts; s++)
+                {
+                    size_t scoreid = ((size_t)p * curbatch + a) * nshifts + s;
+                    if (h_bestscores[p] < h_scores[scoreid])
+                    {
+                        h_bestscores[p] = h_scores[scoreid];
+                        h_bestangles[p] = b + a;
+                        h_bestshifts[p] = s;
+                    }
+                }
+    }
+
+    if (isbricked)
+        h_FreeBrickedVolume(&bricked);
+    FreeAligned(h_scores);
+    FreeAligned(h_proj);
+
+    ReleasePhaseRamps(&ramps);
+}
+
+/*
+
+Coarse-to-fine variant of TomoGlobalAlign. Every angle and shift is scored first using only the Fourier
+components below coarsecutoff (a fraction of Nyquist), projected into a correspondingly smaller box. Each
+particle keeps its topk best (angle, shift) pairs while scoring, in the thread that owns the particle, so no
+score tensor is ever stored. At full resolution, only the neighborhoods of these candidates get scored:
+angles within angleradius (radians) and shifts within shiftradius (pixels, largest difference over all tilts).
+A radius <= 0 means 1.75 times the distance to the candidate's nearest neighbor in the given grid, i.e. the
+candidate plus its immediate neighbors.
+
+Angles are compared by their orientation in the first tilt; all tilts of one angle differ from those of
+another by the same rotation. Results are merged into h_best* the same way as TomoGlobalAlign, so both can
+be called repeatedly on chunks of a larger sampling.
+
+*/
+
+namespace
+{
+    struct AlignCandidate
+    {
+        float score;
+        int angle, shift;
+    };
+
+    // Sorted best first, at most k entries
+    void InsertCandidate(std::vector<AlignCandidate> &best, int k, float score, int angle, int shift)
+    {
+        if ((int)best.size() == k && best.back().score >= score)
+            return;
+
+        AlignCandidate candidate = { score, angle, shift };
+        auto position = std::upper_bound(best.begin(), best.end(), candidate, [](const AlignCandidate &a, const AlignCandidate &b) { return a.score > b.score; });
+        best.insert(position, candidate);
+
+        if ((int)best.size() > k)
+            best.pop_back();
+    }
+
+    // ZYZ rotation in radians, same convention as the projector
+    void AlignRotation(float3 angles, float* m)
+    {
+        float ca = cos(angles.x), sa = sin(angles.x);
+        float cb = cos(angles.y), sb = sin(angles.y);
+        float cg = cos(angles.z), sg = sin(angles.z);
+        float cc = cb * ca, cs = cb * sa, sc = sb * ca, ss = sb * sa;
+
+        m[0] = cg * cc - sg * sa;   m[1] = cg * cs + sg * ca;   m[2] = -cg * sb;
+        m[3] = -sg * cc - cg * sa;  m[4] = -sg * cs + cg * ca;  m[5] = sg * sb;
+        m[6] = sc;                  m[7] = ss;                  m[8] = cb;
+    }
+
+    // Members of a grid within radius of the point, given the point's distances to every member.
+    // radius <= 0 picks 1.75x the distance to the nearest other member.
+    void GridNeighbors(const std::vector<float> &distances, float radius, std::vector<int> &neighbors)
+    {
+        if (radius <= 0)
+        {
+            float nearest = 1e30f;
+            for (float d : distances)
+                if (d > 1e-5f)
+                    nearest = tmin(nearest, d);
+
+            radius = nearest < 1e30f ? 1.75f * nearest : 0.0f;
+        }
+
+        neighbors.clear();
+        for (int i = 0; i < (int)distances.size(); i++)
+            if (distances[i] <= radius + 1e-5f)
+                neighbors.push_back(i);
+    }
+}
+
+__declspec(dllexport) void TomoGlobalAlignHierarchical(float2* d_experimental,
+                                                       float2* d_shiftfactors,
+                                                       float* d_ctf,
+                                                       float* d_weights,
+                                                       int2 dims,
+                                                       float2* d_ref,
+                                                       int3 dimsref,
+                                                       int refsupersample,
+                                                       float3* h_angles,
+                                                       uint nangles,
+                                                       float2* h_shifts,
+                                                       uint nshifts,
+                                                       uint nparticles,
+                                                       uint ntilts,
+                                                       float coarsecutoff,
+                                                       int topk,
+                                                       float angleradius,
+                                                       float shiftradius,
+                                                       int* h_bestangles,
+                                                       int* h_bestshifts,
+                                                       float* h_bestscores)
+{
+    uint batchangles = 128;
+    uint length = (uint)ElementsFFT2(dims);
+    topk = tmax(1, topk);
+
+    BrickedVolume bricked;
+    bool isbricked = h_BrickVolume(d_ref, dimsref, &bricked);
+
+    auto Project = [&](float3* h_projangles, float2* h_proj, int2 dimsproj, uint n)
+    {
+        if (isbricked)
+            h_rlnProject(bricked, h_proj, toInt3(dimsproj), h_projangles, (float)refsupersample, n);
+        else
+            h_rlnProject(d_ref, dimsref, h_proj, toInt3(dimsproj), h_projangles, (float)refsupersample, n);
+    };
+
+    // Coarse pass
+
+    // Components within the cutoff radius, by their position in the small box and in the full one
+    int rcoarse = tmax(1, tmin(dims.x / 2, (int)ceil(coarsecutoff * dims.x / 2)));
+    int2 dimscoarse = toInt2(2 * rcoarse, 2 * rcoarse);
+    uint lengthcoarseproj = (uint)ElementsFFT2(dimscoarse);
+
+    std::vector<uint> coarseprojindices, coarsefullindices;
+    for (int y = 0; y < dimscoarse.y; y++)
+    {
+        int ky = y < (dimscoarse.y + 1) / 2 ? y : y - dimscoarse.y;     // Same convention as the projector
+        for (int x = 0; x <= rcoarse; x++)
+        {
+            if (x * x + ky * ky > rcoarse * rcoarse)
+                continue;
+
+            coarseprojindices.push_back(y * (rcoarse + 1) + x);
+            coarsefullindices.push_back((ky >= 0 ? ky : ky + dims.y) * (dims.x / 2 + 1) + x);
+        }
+    }
+    uint lengthcoarse = (uint)coarseprojindices.size();
+
+    std::vector<float2> coarseexperimental((size_t)nparticles * ntilts * lengthcoarse);
+    std::vector<float> coarsectf((size_t)nparticles * ntilts * lengthcoarse);
+    std::vector<float2> coarsefactors(lengthcoarse);
+
+    #pragma omp parallel for
+    for (int i = 0; i < (int)(nparticles * ntilts); i++)
+        for (uint k = 0; k < lengthcoarse; k++)
+        {
+            coarseexperimental[(size_t)i * lengthcoarse + k] = d_experimental[(size_t)i * length + coarsefullindices[k]];
+            coarsectf[(size_t)i * lengthcoarse + k] = d_ctf[(size_t)i * length + coarsefullindices[k]];
+        }
+    for (uint k = 0; k < lengthcoarse; k++)
+        coarsefactors[k] = d_shiftfactors[coarsefullindices[k]];
+
+    // Ramps for every shift and tilt at low resolution are few enough to keep
+    std::vector<float2> coarseramps((size_t)nshifts * ntilts * lengthcoarse);
+    {
+        PhaseRampView ramps;
+        AcquirePhaseRamps(coarsefactors.data(), lengthcoarse, h_shifts, nshifts * ntilts, &ramps);
+
+        #pragma omp parallel for
+        for (int i = 0; i < (int)(nshifts * ntilts); i++)
+            GetPhaseRamps(ramps, i, coarsefactors.data(), h_shifts[i], 0, lengthcoarse, coarseramps.data() + (size_t)i * lengthcoarse);
+
+        ReleasePhaseRamps(&ramps);
+    }
+
+    std::vector<std::vector<AlignCandidate>> candidates(nparticles);
+    {
+        float2* h_proj = (float2*)MallocAligned((size_t)lengthcoarseproj * batchangles * ntilts * sizeof(float2));
+        std::vector<float2> reference((size_t)lengthcoarse * batchangles * ntilts);
+
+        for (uint b = 0; b < nangles; b += batchangles)
+        {
+            uint curbatch = tmin(batchangles, nangles - b);
+            Project(h_angles + b * ntilts, h_proj, dimscoarse, curbatch * ntilts);
+
+            #pragma omp parallel for
+            for (int i = 0; i < (int)(curbatch * ntilts); i++)
+                for (uint k = 0; k < lengthcoarse; k++)
+                    reference[(size_t)i * lengthcoarse + k] = h_proj[(size_t)i * lengthcoarseproj + coarseprojindices[k]];
+
+            // Each particle's candidates belong to one thread
+            #pragma omp parallel for schedule(dynamic)
+            for (int p = 0; p < (int)nparticles; p++)
+                for (uint a = 0; a < curbatch; a++)
+                    for (uint s = 0; s < nshifts; s++)
+                    {
+                        float partsum = 0;
+                        for (uint n = 0; n < ntilts; n++)
+                            partsum += TomoCorrelate(coarseexperimental.data() + ((size_t)p * ntilts + n) * lengthcoarse,
+                                                     reference.data() + ((size_t)a * ntilts + n) * lengthcoarse,
+                                                     coarseramps.data() + ((size_t)s * ntilts + n) * lengthcoarse,
+                                                     coarsectf.data() + ((size_t)p * ntilts + n) * lengthcoarse,
+                                                     lengthcoarse) * d_weights[p * ntilts + n];
+
+                        InsertCandidate(candidates[p], topk, partsum, b + a, s);
+                    }
+        }
+
+        FreeAligned(h_proj);
+    }
+
+    // Neighborhoods in the angle and shift grids
+
+    std::vector<int> uniqueangles, uniqueshifts;
+    for (uint p = 0; p < nparticles; p++)
+        for (const AlignCandidate &c : candidates[p])
+        {
+            uniqueangles.push_back(c.angle);
+            uniqueshifts.push_back(c.shift);
+        }
+    std::sort(uniqueangles.begin(), uniqueangles.end());
+    uniqueangles.erase(std::unique(uniqueangles.begin(), uniqueangles.end()), uniqueangles.end());
+    std::sort(uniqueshifts.begin(), uniqueshifts.end());
+    uniqueshifts.erase(std::unique(uniqueshifts.begin(), uniqueshifts.end()), uniqueshifts.end());
+
+    std::vector<float> rotations((size_t)nangles * 9);
+    #pragma omp parallel for
+    for (int a = 0; a < (int)nangles; a++)
+        AlignRotation(h_angles[(size_t)a * ntilts], rotations.data() + (size_t)a * 9);
+
+    std::vector<std::vector<int>> angleneighbors(uniqueangles.size()), shiftneighbors(uniqueshifts.size());
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int u = 0; u < (int)uniqueangles.size(); u++)
+    {
+        const float* A = rotations.data() + (size_t)uniqueangles[u] * 9;
+        std::vector<float> distances(nangles);
+        for (uint a = 0; a < nangles; a++)
+        {
+            // Rotation angle of A^T * B from its trace
+            const float* B = rotations.data() + (size_t)a * 9;
+            float trace = 0;
+            for (int i = 0; i < 9; i++)
+                trace += A[i] * B[i];
+
+            distances[a] = acos(tmax(-1.0f, tmin(1.0f, (trace - 1.0f) * 0.5f)));
+        }
+
+        GridNeighbors(distances, angleradius, angleneighbors[u]);
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int u = 0; u < (int)uniqueshifts.size(); u++)
+    {
+        std::vector<float> distances(nshifts);
+        for (uint s = 0; s < nshifts; s++)
+        {
+            float maxdist2 = 0;
+            for (uint n = 0; n < ntilts; n++)
+            {
+                float2 diff = h_shifts[(size_t)s * ntilts + n] - h_shifts[(size_t)uniqueshifts[u] * ntilts + n];
+                maxdist2 = tmax(maxdist2, dotp2(diff, diff));
+            }
+
+            distances[s] = sqrt(maxdist2);
+        }
+
+        GridNeighbors(distances, shiftradius, shiftneighbors[u]);
+    }
+
+    // Fine pass
+
+    // Per particle, all (angle, shift) pairs in its candidates' neighborhoods, sorted by angle
+    std::vector<std::vector<int2>> pairs(nparticles);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (int p = 0; p < (int)nparticles; p++)
+    {
+        for (const AlignCandidate &c : candidates[p])
+        {
+            const std::vector<int> &angles = angleneighbors[std::lower_bound(uniqueangles.begin(), uniqueangles.end(), c.angle) - uniqueangles.begin()];
+            const std::vector<int> &shifts = shiftneighbors[std::lower_bound(uniqueshifts.begin(), uniqueshifts.end(), c.shift) - uniqueshifts.begin()];
+
+            for (int a : angles)
+                for (int s : shifts)
+                    pairs[p].push_back(toInt2(a, s));
+        }
+
+        std::sort(pairs[p].begin(), pairs[p].end(), [](int2 a, int2 b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+        pairs[p].erase(std::unique(pairs[p].begin(), pairs[p].end(), [](int2 a, int2 b) { return a.x == b.x && a.y == b.y; }), pairs[p].end());
+    }
+
+    std::vector<int> fineangles;
+    for (uint p = 0; p < nparticles; p++)
+        for (int2 pair : pairs[p])
+            fineangles.push_back(pair.x);
+    std::sort(fineangles.begin(), fineangles.end());
+    fineangles.erase(std::unique(fineangles.begin(), fineangles.end()), fineangles.end());
+
+    std::vector<AlignCandidate> finebest(nparticles, { -1e30f, 0, 0 });
+    {
+        PhaseRampView ramps;
+        AcquirePhaseRamps(d_shiftfactors, length, h_shifts, nshifts * ntilts, &ramps);
+
+        float2* h_proj = (float2*)MallocAligned((size_t)length * batchangles * ntilts * sizeof(float2));
+        std::vector<float3> batchanglesdata((size_t)batchangles * ntilts);
+
+        for (size_t b = 0; b < fineangles.size(); b += batchangles)
+        {
+            uint curbatch = (uint)tmin((size_t)batchangles, fineangles.size() - b);
+            for (uint a = 0; a < curbatch; a++)
+                for (uint n = 0; n < ntilts; n++)
+                    batchanglesdata[(size_t)a * ntilts + n] = h_angles[(size_t)fineangles[b + a] * ntilts + n];
+
+            Project(batchanglesdata.data(), h_proj, dims, curbatch * ntilts);
+
+            int firstangle = fineangles[b], lastangle = fineangles[b + curbatch - 1];
+
+            #pragma omp parallel for schedule(dynamic)
+            for (int p = 0; p < (int)nparticles; p++)
+            {
+                auto first = std::lower_bound(pairs[p].begin(), pairs[p].end(), toInt2(firstangle, 0), [](int2 a, int2 b) { return a.x < b.x; });
+                auto last = std::upper_bound(pairs[p].begin(), pairs[p].end(), toInt2(lastangle, 0), [](int2 a, int2 b) { return a.x < b.x; });
+                if (first == last)
+                    continue;
+
+                // Grouped by shift, so each shift's ramps are computed once per batch
+                std::vector<int2> batchpairs(first, last);
+                std::sort(batchpairs.begin(), batchpairs.end(), [](int2 a, int2 b) { return a.y < b.y || (a.y == b.y && a.x < b.x); });
+
+                std::vector<float2> changes((size_t)ntilts * length);
+                int currentshift = -1;
+
+                for (int2 pair : batchpairs)
+                {
+                    if (pair.y != currentshift)
+                    {
+                        currentshift = pair.y;
+                        for (uint n = 0; n < ntilts; n++)
+                            GetPhaseRamps(ramps, currentshift * ntilts + n, d_shiftfactors, h_shifts[currentshift * ntilts + n], 0, length, changes.data() + (size_t)n * length);
+                    }
+
+                    size_t slot = std::lower_bound(fineangles.begin() + b, fineangles.begin() + b + curbatch, pair.x) - (fineangles.begin() + b);
+
+                    float partsum = 0;
+                    for (uint n = 0; n < ntilts; n++)
+                        partsum += TomoCorrelate(d_experimental + ((size_t)p * ntilts + n) * length,
+                                                 h_proj + (slot * ntilts + n) * length,
+                                                 changes.data() + (size_t)n * length,
+                                                 d_ctf + ((size_t)p * ntilts + n) * length,
+                                                 length) * d_weights[p * ntilts + n];
+
+                    // Same tie-breaking as the exhaustive search: lowest angle, then lowest shift
+                    AlignCandidate &best = finebest[p];
+                    if (partsum > best.score || (partsum == best.score && (pair.x < best.angle || (pair.x == best.angle && pair.y < best.shift))))
+                        best = { partsum, pair.x, pair.y };
+                }
+            }
+        }
+
+        FreeAligned(h_proj);
+        ReleasePhaseRamps(&ramps);
+    }
+
+    for (uint p = 0; p < nparticles; p++)
+        if (h_bestscores[p] < finebest[p].score)
+        {
+            h_bestscores[p] = finebest[p].score;
+            h_bestangles[p] = finebest[p].angle;
+            h_bestshifts[p] = finebest[p].shift;
+        }
+
+    if (isbricked)
+        h_FreeBrickedVolume(&bricked);
+}
@@ -0,0 +1,294 @@
+#include "Functions.h"
+using namespace gtom;
+
+__declspec(dllexport) void FFT(float* d_input, float2* d_output, int3 dims, uint batch)
+{
+    h_FFTR2C(d_input, d_output, DimensionCount(dims), dims, batch);
+}
+
+__declspec(dllexport) void IFFT(float2* d_input, float* d_output, int3 dims, uint batch)
+{
+    h_IFFTC2R(d_input, d_output, DimensionCount(dims), dims, batch);
+}
+
+__declspec(dllexport) void Pad(float* d_input, float* d_output, int3 olddims, int3 newdims, uint batch)
+{
+    h_Pad(d_input, d_output, olddims, newdims, 0.0f, batch);
+}
+
+__declspec(dllexport) void PadFT(float2* d_input, float2* d_output, int3 olddims, int3 newdims, uint batch)
+{
+    h_FFTPad(d_input, d_output, olddims, newdims, batch);
+}
+
+__declspec(dllexport) void CropFT(float2* d_input, float2* d_output, int3 olddims, int3 newdims, uint batch)
+{
+    h_FFTCrop(d_input, d_output, olddims, newdims, batch);
+}
+
+__declspec(dllexport) void RemapToFTComplex(float2* d_input, float2* d_output, int3 dims, uint batch)
+{
+    h_RemapHalfFFT2Half(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void RemapToFTFloat(float* d_input, float* d_output, int3 dims, uint batch)
+{
+    h_RemapHalfFFT2Half(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void RemapFromFTComplex(float2* d_input, float2* d_output, int3 dims, uint batch)
+{
+    h_RemapHalf2HalfFFT(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void RemapFromFTFloat(float* d_input, float* d_output, int3 dims, uint batch)
+{
+    h_RemapHalf2HalfFFT(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void RemapFullToFTFloat(float* d_input, float* d_output, int3 dims, uint batch)
+{
+    h_RemapFullFFT2Full(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void RemapFullFromFTFloat(float* d_input, float* d_output, int3 dims, uint batch)
+{
+    h_RemapFull2FullFFT(d_input, d_output, dims, batch);
+}
+
+__declspec(dllexport) void Extract(float* d_input, float* d_output, int3 dims, int3 dimsregion, int3* h_origins, uint batch)
+{
+    h_ExtractMany(d_input, d_output, dims, dimsregion, h_origins, batch);
+}
+
+__declspec(dllexport) void ExtractHalf(float* d_input, float* d_output, int3 dims, int3 dimsregion, int3* h_origins, uint batch)
+{
+    h_ExtractMany((half*)d_input, (half*)d_output, dims, dimsregion, h_origins, batch);
+}
+
+__declspec(dllexport) void ReduceMean(float* d_input, float* d_output, uint vectorlength, uint nvectors, uint batch)
+{
+    h_ReduceMean(d_input, d_output, vectorlength, nvectors, batch);
+}
+
+__declspec(dllexport) void ReduceMeanHalf(half* d_input, half* d_output, uint vectorlength, uint nvectors, uint batch)
+{
+    h_ReduceMean(d_input, d_output, vectorlength, nvectors, batch);
+}
+
+__declspec(dllexport) void Normalize(float* d_ps, float* d_output, uint length, uint batch)
+{
+    h_NormMonolithic(d_ps, d_output, length, batch);
+}
+
+__declspec(dllexport) void NormalizeMasked(float* d_ps, float* d_output, float* d_mask, uint length, uint batch)
+{
+    h_NormMonolithic(d_ps, d_output, length, d_mask, batch);
+}
+
+__declspec(dllexport) void SphereMask(float* d_input, float* d_output, int3 dims, float radius, float sigma, uint batch)
+{
+    h_SphereMask(d_input, d_output, dims, radius, sigma, batch);
+}
+
+__declspec(dllexport) void CreateCTF(float* d_output, float2* d_coords, uint length, CTFParams* h_params, bool amplitudesquared, uint batch)
+{
+    h_CTFSimulate(h_params, d_coords, d_output, length, amplitudesquared, batch);
+}
+
+__declspec(dllexport) void Resize(float* d_input, int3 dimsinput, float* d_output, int3 dimsoutput, uint batch)
+{
+    h_Scale(d_input, d_output, dimsinput, dimsoutput, batch);
+}
+
+__declspec(dllexport) void ShiftStack(float* d_input, float* d_output, int3 dims, float* h_shifts, uint batch)
+{
+    h_Shift(d_input, d_output, dims, (tfloat3*)h_shifts, batch);
+}
+
+__declspec(dllexport) void ShiftStackMassive(float* d_input, float* d_output, int3 dims, float* h_shifts, uint batch)
+{
+    // No device memory limit to work around, one slice at a time keeps the footprint equally small
+    for (uint b = 0; b < batch; b++)
+        h_Shift(d_input + Elements(dims) * b, d_output + Elements(dims) * b, dims, (tfloat3*)h_shifts + b, 1);
+}
+
+__declspec(dllexport) void Cart2Polar(float* d_input, float* d_output, int2 dims, uint innerradius, uint exclusiveouterradius, uint batch)
+{
+    h_Cart2Polar(d_input, d_output, dims, innerradius, exclusiveouterradius, batch);
+}
+
+__declspec(dllexport) void Cart2PolarFFT(float* d_input, float* d_output, int2 dims, uint innerradius, uint exclusiveouterradius, uint batch)
+{
+    h_Cart2PolarFFT(d_input, d_output, dims, innerradius, exclusiveouterradius, batch);
+}
+
+__declspec(dllexport) void Xray(float* d_input, float* d_output, float ndevs, int2 dims, uint batch)
+{
+    h_Xray(d_input, d_output, toInt3(dims), ndevs, 5, batch);
+}
+
+// Arithmetics:
+
+__declspec(dllexport) void Sum(float* d_input, float* d_output, uint length, uint batch)
+{
+    h_SumMonolithic(d_input, d_output, length, batch);
+}
+
+__declspec(dllexport) void Abs(float* d_input, float* d_output, size_t length)
+{
+    h_Abs(d_input, d_output, length);
+}
+
+__declspec(dllexport) void Amplitudes(float2* d_input, float* d_output, size_t length)
+{
+    h_Abs(d_input, d_output, length);
+}
+
+__declspec(dllexport) void Sign(float* d_input, float* d_output, size_t length)
+{
+    h_Sign(d_input, d_output, length);
+}
+
+__declspec(dllexport) void AddToSlices(float* d_input, float* d_summands, float* d_output, size_t sliceelements, uint slices)
+{
+    h_AddVector(d_input, d_summands, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void SubtractFromSlices(float* d_input, float* d_subtrahends, float* d_output, size_t sliceelements, uint slices)
+{
+    h_SubtractVector(d_input, d_subtrahends, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void MultiplySlices(float* d_input, float* d_multiplicators, float* d_output, size_t sliceelements, uint slices)
+{
+    h_MultiplyByVector(d_input, d_multiplicators, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void DivideSlices(float* d_input, float* d_divisors, float* d_output, size_t sliceelements, uint slices)
+{
+    h_DivideSafeByVector(d_input, d_divisors, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void AddToSlicesHalf(half* d_input, half* d_summands, half* d_output, size_t sliceelements, uint slices)
+{
+    h_AddVector(d_input, d_summands, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void SubtractFromSlicesHalf(half* d_input, half* d_subtrahends, half* d_output, size_t sliceelements, uint slices)
+{
+    h_SubtractVector(d_input, d_subtrahends, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void MultiplySlicesHalf(half* d_input, half* d_multiplicators, half* d_output, size_t sliceelements, uint slices)
+{
+    h_MultiplyByVector(d_input, d_multiplicators, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void MultiplyComplexSlicesByScalar(float2* d_input, float* d_multiplicators, float2* d_output, size_t sliceelements, uint slices)
+{
+    h_MultiplyByVector(d_input, d_multiplicators, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void DivideComplexSlicesByScalar(float2* d_input, float* d_multiplicators, float2* d_output, size_t sliceelements, uint slices)
+{
+    h_DivideSafeByVector(d_input, d_multiplicators, d_output, sliceelements, slices);
+}
+
+__declspec(dllexport) void Scale(float* d_input, float* d_output, int3 dimsinput, int3 dimsoutput, uint batch)
+{
+    h_Scale(d_input, d_output, dimsinput, dimsoutput, batch);
+}
+
+__declspec(dllexport) void ProjectForward(float2* d_inputft, float2* d_outputft, int3 dimsinput, int2 dimsoutput, float3* h_angles, float supersample, uint batch)
+{
+    h_rlnProject(d_inputft, dimsinput, d_outputft, toInt3(dimsoutput), h_angles, supersample, batch);
+}
+
+__declspec(dllexport) void ProjectBackward(float2* d_volumeft, float* d_volumeweights, int3 dimsvolume, float2* d_projft, float* d_projweights, int2 dimsproj, int rmax, float3* h_angles, float supersample, uint batch)
+{
+    h_rlnBackproject(d_volumeft, d_volumeweights, dimsvolume, d_projft, d_projweights, toInt3(dimsproj), rmax, h_angles, supersample, batch);
+}
+
+__declspec(dllexport) void Bandpass(float* d_input, float* d_output, int3 dims, float nyquistlow, float nyquisthigh, uint batch)
+{
+    h_BandpassNonCubic(d_input, d_output, dims, nyquistlow, nyquisthigh, batch);
+}
+
+__declspec(dllexport) void Rotate2D(float* d_input, float* d_output, int2 dims, float* h_angles, int oversample, uint batch)
+{
+    if (oversample <= 1)
+    {
+        h_Rotate2D(d_input, d_output, dims, h_angles, batch);
+    }
+    else
+    {
+        int2 dimspadded = dims * oversample;
+        float* h_temp = (float*)MallocAligned(Elements2(dimspadded) * sizeof(float));
+
+        for (uint b = 0; b < batch; b++)
+        {
+            h_Scale(d_input + Elements2(dims) * b, h_temp, toInt3(dims), toInt3(dimspadded), 1);
+            h_Rotate2D(h_temp, h_temp, dimspadded, h_angles + b, 1);
+            h_Scale(h_temp, d_output + Elements2(dims) * b, toInt3(dimspadded), toInt3(dims), 1);
+        }
+
+        FreeAligned(h_temp);
+    }
+}
+
+__declspec(dllexport) void ShiftAndRotate2D(float* d_input, float* d_output, int2 dims, float2* h_shifts, float* h_angles, uint batch)
+{
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)Elements2(dims) * batch; i++)
+    {
+        uint b = (uint)(i / Elements2(dims));
+        int x = (int)(i % dims.x), y = (int)(i / dims.x % dims.y);
+        float* h_input = d_input + Elements2(dims) * b;
+
+        // Same transform as the kernel: rotate by -angle after translating by -shift
+        float c = cos(-h_angles[b]), s = sin(-h_angles[b]);
+        float tx = (float)(x - dims.x / 2) - h_shifts[b].x;
+        float ty = (float)(y - dims.y / 2) - h_shifts[b].y;
+        float2 pos = make_float2(c * tx - s * ty + dims.x / 2, s * tx + c * ty + dims.y / 2);
+
+        float val = 0;
+        if (pos.x >= 0 && pos.x < dims.x && pos.y >= 0 && pos.y < dims.y)
+        {
+            int x0 = (int)floor(pos.x);
+            int x1 = tmin(x0 + 1, dims.x - 1);
+            pos.x -= x0;
+
+            int y0 = (int)floor(pos.y);
+            int y1 = tmin(y0 + 1, dims.y - 1);
+            pos.y -= y0;
+
+            float d000 = h_input[y0 * dims.x + x0];
+            float d001 = h_input[y0 * dims.x + x1];
+            float d010 = h_input[y1 * dims.x + x0];
+            float d011 = h_input[y1 * dims.x + x1];
+
+            float dx00 = d000 + (d001 - d000) * pos.x;
+            float dx01 = d010 + (d011 - d010) * pos.x;
+
+            val = dx00 + (dx01 - dx00) * pos.y;
+        }
+
+        d_output[i] = val;
+    }
+}
+
+__declspec(dllexport) int CreateFFTPlan(int3 dims, uint batch)
+{
+    return h_FFTR2CGetPlan(DimensionCount(dims), dims, batch);
+}
+
+__declspec(dllexport) int CreateIFFTPlan(int3 dims, uint batch)
+{
+    return h_IFFTC2RGetPlan(DimensionCount(dims), dims, batch);
+}
+
+__declspec(dllexport) void DestroyFFTPlan(cufftHandle plan)
+{
+    h_FFTDestroyPlan(plan);
+}
@@ -0,0 +1,255 @@
+#include "Functions.h"
+using namespace gtom;
+
+namespace
+{
+    inline int FFTFrequency(int i, int n)
+    {
+        return i < (n + 1) / 2 ? i : i - n;
+    }
+
+    // Bilinear lookup in a single 2D slice, 0 outside.
+    inline float Bilinear(float* h_input, int2 dims, float x, float y)
+    {
+        if (x < 0 || y < 0 || x > dims.x - 1 || y > dims.y - 1)
+            return 0.0f;
+
+        int x0 = (int)x, y0 = (int)y;
+        int x1 = tmin(x0 + 1, dims.x - 1), y1 = tmin(y0 + 1, dims.y - 1);
+        float fx = x - x0, fy = y - y0;
+
+        float v00 = h_input[y0 * dims.x + x0], v01 = h_input[y0 * dims.x + x1];
+        float v10 = h_input[y1 * dims.x + x0], v11 = h_input[y1 * dims.x + x1];
+
+        return (v00 * (1 - fx) + v01 * fx) * (1 - fy) + (v10 * (1 - fx) + v11 * fx) * fy;
+    }
+
+    // Phase factor that moves real-space content by +shift.
+    inline float2 ShiftPhase(int kx, int ky, int kz, int3 dims, float3 shift)
+    {
+        float phase = -2.0f * (float)PI * ((float)kx * shift.x / dims.x + (float)ky * shift.y / dims.y + (float)kz * shift.z / dims.z);
+        return make_float2(cos(phase), sin(phase));
+    }
+}
+
+void gtom::h_Shift(float2* h_input, float2* h_output, int3 dims, float3* h_shifts, int batch)
+{
+    size_t elements = ElementsFFT(dims);
+    int xhalf = dims.x / 2 + 1;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elements * batch; i++)
+    {
+        size_t b = (size_t)i / elements, e = (size_t)i % elements;
+        int kx = (int)(e % xhalf);
+        int ky = FFTFrequency((int)(e / xhalf % dims.y), dims.y);
+        int kz = FFTFrequency((int)(e / xhalf / dims.y), dims.z);
+
+        h_output[i] = cmul(h_input[i], ShiftPhase(kx, ky, kz, dims, h_shifts[b]));
+    }
+}
+
+void gtom::h_Shift(float* h_input, float* h_output, int3 dims, float3* h_shifts, int batch)
+{
+    float2* h_inputft = (float2*)MallocAligned(ElementsFFT(dims) * batch * sizeof(float2));
+
+    h_FFTR2C(h_input, h_inputft, DimensionCount(dims), dims, batch);
+    h_Shift(h_inputft, h_inputft, dims, h_shifts, batch);
+    h_IFFTC2R(h_inputft, h_output, DimensionCount(dims), dims, batch);
+
+    FreeAligned(h_inputft);
+}
+
+void gtom::h_Scale(float* h_input, float* h_output, int3 olddims, int3 newdims, int batch)
+{
+    size_t elementsold = ElementsFFT(olddims), elementsnew = ElementsFFT(newdims);
+    int oldxhalf = olddims.x / 2 + 1, newxhalf = newdims.x / 2 + 1;
+
+    float2* h_oldft = (float2*)MallocAligned(elementsold * batch * sizeof(float2));
+    float2* h_newft = (float2*)MallocAligned(elementsnew * batch * sizeof(float2));
+
+    h_FFTR2C(h_input, h_oldft, DimensionCount(olddims), olddims, batch);
+
+    // Copy every frequency both grids have in common, zero the rest; handles mixed crop/pad per axis
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)elementsnew * batch; i++)
+    {
+        size_t b = (size_t)i / elementsnew, e = (size_t)i % elementsnew;
+        int x = (int)(e % newxhalf);
+        int ky = FFTFrequency((int)(e / newxhalf % newdims.y), newdims.y);
+        int kz = FFTFrequency((int)(e / newxhalf / newdims.y), newdims.z);
+
+        if (x >= oldxhalf || ky >= (olddims.y + 1) / 2 || ky < -(olddims.y / 2) || kz >= (olddims.z + 1) / 2 || kz < -(olddims.z / 2))
+        {
+            h_newft[i] = make_float2(0, 0);
+            continue;
+        }
+
+        int y = ky < 0 ? ky + olddims.y : ky;
+        int z = kz < 0 ? kz + olddims.z : kz;
+        h_newft[i] = h_oldft[elementsold * b + ((size_t)z * olddims.y + y) * oldxhalf + x];
+    }
+
+    h_IFFTC2R(h_newft, h_output, DimensionCount(newdims), newdims, batch);
+
+    // Preserve the mean value rather than the sum
+    h_MultiplyByScalar(h_output, h_output, Elements(newdims) * batch, (float)Elements(newdims) / (float)Elements(olddims));
+
+    FreeAligned(h_newft);
+    FreeAligned(h_oldft);
+}
+
+void gtom::h_MagAnisotropyCorrect(float* h_image, int2 dimsimage, float* h_scaled, int2 dimsscaled, float majorpixel, float minorpixel, float majorangle, uint supersample, int batch)
+{
+    // Output pixels are isotropic with the mean pixel size; supersampling is only needed to
+    // compensate for texture interpolation on the GPU, bilinear lookup is used here directly.
+    float meanpixel = (majorpixel + minorpixel) * 0.5f;
+    float2 ratio = make_float2((float)dimsimage.x / dimsscaled.x, (float)dimsimage.y / dimsscaled.y);
+    float c = cos(majorangle), s = sin(majorangle);
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)Elements2(dimsscaled) * batch; i++)
+    {
+        size_t b = (size_t)i / Elements2(dimsscaled), e = (size_t)i % Elements2(dimsscaled);
+        float x = ((float)(e % dimsscaled.x) - dimsscaled.x / 2) * ratio.x;
+        float y = ((float)(e / dimsscaled.x) - dimsscaled.y / 2) * ratio.y;
+
+        float major = (c * x + s * y) * meanpixel / majorpixel;
+        float minor = (-s * x + c * y) * meanpixel / minorpixel;
+
+        float sx = c * major - s * minor + dimsimage.x / 2;
+        float sy = s * major + c * minor + dimsimage.y / 2;
+
+        h_scaled[i] = Bilinear(h_image + Elements2(dimsimage) * b, dimsimage, sx, sy);
+    }
+}
+
+void gtom::h_Rotate2D(float* h_input, float* h_output, int2 dims, float* h_angles, int batch)
+{
+    float* h_source = h_input == h_output ? MallocAlignedFromHostArray(h_input, Elements2(dims) * batch) : h_input;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)Elements2(dims) * batch; i++)
+    {
+        size_t b = (size_t)i / Elements2(dims), e = (size_t)i % Elements2(dims);
+        float x = (float)(e % dims.x) - dims.x / 2;
+        float y = (float)(e / dims.x) - dims.y / 2;
+        float c = cos(-h_angles[b]), s = sin(-h_angles[b]);
+
+        h_output[i] = Bilinear(h_source + Elements2(dims) * b, dims, c * x - s * y + dims.x / 2, s * x + c * y + dims.y / 2);
+    }
+
+    if (h_source != h_input)
+        FreeAligned(h_source);
+}
+
+void gtom::h_Cart2Polar(float* h_input, float* h_output, int2 dims, uint innerradius, uint exclusiveouterradius, int batch)
+{
+    int nradius = (int)(exclusiveouterradius - innerradius);
+    int nangles = dims.y * 2;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)nradius * nangles * batch; i++)
+    {
+        int b = (int)(i / ((long long)nradius * nangles));
+        int r = (int)(i % nradius) + (int)innerradius;
+        int a = (int)(i / nradius % nangles);
+
+        float angle = (float)a / nangles * 2.0f * (float)PI;
+        float x = cos(angle) * r + dims.x / 2;
+        float y = sin(angle) * r + dims.y / 2;
+
+        h_output[i] = Bilinear(h_input + Elements2(dims) * b, dims, x, y);
+    }
+}
+
+void gtom::h_Cart2PolarFFT(float* h_input, float* h_output, int2 dims, uint innerradius, uint exclusiveouterradius, int batch)
+{
+    int nradius = (int)(exclusiveouterradius - innerradius);
+    int nangles = dims.y;
+    int xhalf = dims.x / 2 + 1;
+
+    #pragma omp parallel for
+    for (long long i = 0; i < (long long)nradius * nangles * batch; i++)
+    {
+        int b = (int)(i / ((long long)nradius * nangles));
+        int r = (int)(i % nradius) + (int)innerradius;
+        int a = (int)(i / nradius % nangles);
+
+        // Half-plane: angles from -pi/2 to pi/2, x is never negative
+        float angle = (float)a / nangles * (float)PI - (float)PI / 2;
+        float x = tmax(0.0f, cos(angle) * r);
+        float y = sin(angle) * r;
+
+        int x0 = tmin((int)x, xhalf - 1), x1 = tmin(x0 + 1, xhalf - 1);
+        int y0 = (int)floor(y), y1 = y0 + 1;
+        float fx = x - x0, fy = y - y0;
+
+        float* h_slice = h_input + (size_t)xhalf * dims.y * b;
+        int wy0 = (y0 % dims.y + dims.y) % dims.y, wy1 = (y1 % dims.y + dims.y) % dims.y;
+
+        float v00 = h_slice[wy0 * xhalf + x0], v01 = h_slice[wy0 * xhalf + x1];
+        float v10 = h_slice[wy1 * xhalf + x0], v11 = h_slice[wy1 * xhalf + x1];
+
+        h_output[i] = (v00 * (1 - fx) + v01 * fx) * (1 - fy) + (v10 * (1 - fx) + v11 * fx) * fy;
+    }
+}
+
+void gtom::h_Xray(float* h_input, float* h_output, int3 dims, float ndevs, int region, int batch)
+{
+    size_t elements = Elements(dims);
+
+    for (int b = 0; b < batch; b++)
+    {
+        float* h_in = h_input + elements * b;
+        float* h_out = h_output + elements * b;
+        float* h_source = h_in == h_out ? MallocAlignedFromHostArray(h_in, elements) : h_in;
+
+        double sum1 = 0, sum2 = 0;
+        #pragma omp parallel for reduction(+:sum1, sum2)
+        for (long long i = 0; i < (long long)elements; i++)
+        {
+            sum1 += h_source[i];
+            sum2 += (double)h_source[i] * h_source[i];
+        }
+
+        float mean = (float)(sum1 / elements);
+        float threshold = (float)sqrt(tmax(0.0, sum2 / elements - (sum1 / elements) * (sum1 / elements))) * ndevs;
+
+        // Outliers are replaced by the mean of their non-outlier neighborhood
+        #pragma omp parallel for
+        for (long long i = 0; i < (long long)elements; i++)
+        {
+            if (abs(h_source[i] - mean) <= threshold)
+            {
+                h_out[i] = h_source[i];
+                continue;
+            }
+
+            int x = (int)(i % dims.x), y = (int)(i / dims.x % dims.y), z = (int)(i / dims.x / dims.y);
+            float neighborsum = 0;
+            int neighbors = 0;
+
+            for (int dz = (dims.z > 1 ? -region / 2 : 0); dz <= (dims.z > 1 ? region / 2 : 0); dz++)
+                for (int dy = -region / 2; dy <= region / 2; dy++)
+                    for (int dx = -region / 2; dx <= region / 2; dx++)
+                    {
+                        int xx = x + dx, yy = y + dy, zz = z + dz;
+                        if (xx < 0 || yy < 0 || zz < 0 || xx >= dims.x || yy >= dims.y || zz >= dims.z)
+                            continue;
+
+                        float val = h_source[((size_t)zz * dims.y + yy) * dims.x + xx];
+                        if (abs(val - mean) > threshold)
+                            continue;
+
+                        neighborsum += val;
+                        neighbors++;
+                    }
+
+            h_out[i] = neighbors > 0 ? neighborsum / neighbors : mean;
+        }
+
+        if (h_source != h_in)
+            FreeAligned(h_source);
+    }
+}
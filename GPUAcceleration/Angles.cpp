@@ -1,34 +1,234 @@
 #include "Functions.h"
 #include "liblion.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+using namespace gtom;
 
-__declspec(dllexport) int __stdcall GetAnglesCount(int healpixorder, char* c_symmetry, float limittilt)
+/*
+
+Orientation sampling without materializing it. A sampling table keeps RELION's HEALPix directions and psi
+angles separately; orientation i is direction i / npsi with psi i % npsi, the order GetAngles has always
+used. Tables are built once per (order, symmetry, limittilt) and shared by everyone asking for the same
+sampling, so their size is O(directions + psi angles) and never O(orientations).
+
+An AngleSampling handle iterates a table in chunks of any size. It can be restricted to the neighborhood
+of a prior orientation for local refinement: everything within a maximum rotation angle of the prior or
+one of its symmetry mates. Only the neighborhood's members are stored, as (direction, psi) pairs.
+
+All angles are ZYZ Euler angles in degrees, as RELION gives them.
+
+*/
+
+namespace
 {
-    relion::FileName fn_symmetry(c_symmetry);
+    struct SamplingTable
+    {
+        std::vector<float> rot, tilt;   // Per direction
+        std::vector<float> psi;
+        std::vector<float> symmetry;    // Row-major 3x3 rotations, identity first
+    };
+
+    struct AngleSampling
+    {
+        std::shared_ptr<const SamplingTable> table;
+        std::vector<int2> neighborhood; // (direction, psi) pairs
+        bool local;
+    };
+
+    std::mutex TablesMutex;
+    std::map<std::tuple<int, std::string, float>, std::shared_ptr<const SamplingTable>> Tables;
+
+    std::shared_ptr<const SamplingTable> GetSamplingTable(int healpixorder, char* c_symmetry, float limittilt)
+    {
+        std::lock_guard<std::mutex> lock(TablesMutex);
+
+        auto key = std::make_tuple(healpixorder, std::string(c_symmetry), limittilt);
+        auto cached = Tables.find(key);
+        if (cached != Tables.end())
+            return cached->second;
+
+        relion::FileName fn_symmetry(c_symmetry);
+
+        relion::HealpixSampling sampling;
+        sampling.setTranslations(1, 0);
+        sampling.setOrientations(healpixorder);
+        sampling.psi_step = -1;
+        sampling.limit_tilt = limittilt;
+        sampling.fn_sym = fn_symmetry;
+        sampling.initialise(NOPRIOR, 3);
+
+        std::shared_ptr<SamplingTable> table = std::make_shared<SamplingTable>();
+        for (int rt = 0; rt < sampling.directions_ipix.size(); rt++)
+        {
+            table->rot.push_back((float)sampling.rot_angles[rt]);
+            table->tilt.push_back((float)sampling.tilt_angles[rt]);
+        }
+        for (int p = 0; p < sampling.psi_angles.size(); p++)
+            table->psi.push_back((float)sampling.psi_angles[p]);
+
+        relion::SymList symmetrylist;
+        symmetrylist.read_sym_file(fn_symmetry);
 
-    relion::HealpixSampling sampling;
-    sampling.setTranslations(1, 0);
-    sampling.setOrientations(healpixorder);
-    sampling.psi_step = -1;
-    sampling.limit_tilt = limittilt;
-    sampling.fn_sym = fn_symmetry;
-    sampling.initialise(NOPRIOR, 3);
+        table->symmetry.resize(9, 0.0f);
+        table->symmetry[0] = table->symmetry[4] = table->symmetry[8] = 1.0f;
 
-    return sampling.directions_ipix.size() * sampling.psi_angles.size();
+        relion::Matrix2D<DOUBLE> L(4, 4), R(4, 4);
+        for (int s = 0; s < symmetrylist.SymsNo(); s++)
+        {
+            symmetrylist.get_matrices(s, L, R);
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    table->symmetry.push_back((float)R(i, j));
+        }
+
+        Tables[key] = table;
+        return table;
+    }
+
+    // Same convention as relion::Euler_angles2matrix, angles in degrees
+    void EulerMatrix(float3 angles, float* m)
+    {
+        float a = angles.x * PI / 180.0f, b = angles.y * PI / 180.0f, g = angles.z * PI / 180.0f;
+        float ca = cos(a), sa = sin(a), cb = cos(b), sb = sin(b), cg = cos(g), sg = sin(g);
+        float cc = cb * ca, cs = cb * sa, sc = sb * ca, ss = sb * sa;
+
+        m[0] = cg * cc - sg * sa;   m[1] = cg * cs + sg * ca;   m[2] = -cg * sb;
+        m[3] = -sg * cc - cg * sa;  m[4] = -sg * cs + cg * ca;  m[5] = sg * sb;
+        m[6] = sc;                  m[7] = ss;                  m[8] = cb;
+    }
+
+    long long OrientationCount(const AngleSampling* sampling)
+    {
+        if (sampling->local)
+            return (long long)sampling->neighborhood.size();
+
+        return (long long)sampling->table->rot.size() * sampling->table->psi.size();
+    }
+}
+
+__declspec(dllexport) int __stdcall GetAnglesCount(int healpixorder, char* c_symmetry, float limittilt)
+{
+    std::shared_ptr<const SamplingTable> table = GetSamplingTable(healpixorder, c_symmetry, limittilt);
+
+    return (int)(table->rot.size() * table->psi.size());
 }
 
 __declspec(dllexport) void __stdcall GetAngles(float3* h_angles, int healpixorder, char* c_symmetry, float limittilt)
 {
-    relion::FileName fn_symmetry(c_symmetry);
+    std::shared_ptr<const SamplingTable> table = GetSamplingTable(healpixorder, c_symmetry, limittilt);
 
-    relion::HealpixSampling sampling;
-    sampling.setTranslations(1, 0);
-    sampling.setOrientations(healpixorder);
-    sampling.psi_step = -1;
-    sampling.limit_tilt = limittilt;
-    sampling.fn_sym = fn_symmetry;
-    sampling.initialise(NOPRIOR, 3);
+    for (int rt = 0; rt < table->rot.size(); rt++)
+        for (int p = 0; p < table->psi.size(); p++)
+            h_angles[rt * table->psi.size() + p] = make_float3(table->rot[rt], table->tilt[rt], table->psi[p]);
+}
 
-    for (int rt = 0; rt < sampling.directions_ipix.size(); rt++)
-        for (int p = 0; p < sampling.psi_angles.size(); p++)
-            h_angles[rt * sampling.psi_angles.size() + p] = make_float3(sampling.rot_angles[rt], sampling.tilt_angles[rt], sampling.psi_angles[p]);
-}
\ No newline at end of file
+__declspec(dllexport) void* __stdcall CreateAngleSampling(int healpixorder, char* c_symmetry, float limittilt)
+{
+    AngleSampling* sampling = new AngleSampling();
+    sampling->table = GetSamplingTable(healpixorder, c_symmetry, limittilt);
+    sampling->local = false;
+
+    return sampling;
+}
+
+__declspec(dllexport) void __stdcall DestroyAngleSampling(void* sampling)
+{
+    delete (AngleSampling*)sampling;
+}
+
+// Restricts the sampling to orientations within maxangle degrees of the prior; a negative maxangle lifts the restriction
+__declspec(dllexport) void __stdcall AngleSamplingSetNeighborhood(void* handle, float3 prior, float maxangle)
+{
+    AngleSampling* sampling = (AngleSampling*)handle;
+    const SamplingTable &table = *sampling->table;
+
+    sampling->neighborhood.clear();
+    sampling->local = maxangle >= 0;
+    if (!sampling->local)
+        return;
+
+    int nsymmetry = (int)table.symmetry.size() / 9;
+    float mincos = cos(tmin(maxangle, 180.0f) * PI / 180.0f) - 1e-5f;     // Keeps the prior itself despite rounding
+
+    float P[9];
+    EulerMatrix(prior, P);
+
+    // Viewing directions of prior * S for every symmetry operator S, i.e. S^T applied to the prior's third row
+    std::vector<float3> priordirections(nsymmetry);
+    for (int s = 0; s < nsymmetry; s++)
+    {
+        const float* S = table.symmetry.data() + s * 9;
+        priordirections[s] = make_float3(S[0] * P[6] + S[3] * P[7] + S[6] * P[8],
+                                         S[1] * P[6] + S[4] * P[7] + S[7] * P[8],
+                                         S[2] * P[6] + S[5] * P[7] + S[8] * P[8]);
+    }
+
+    for (int d = 0; d < table.rot.size(); d++)
+    {
+        float C[9];
+        EulerMatrix(make_float3(table.rot[d], table.tilt[d], 0), C);
+
+        // A rotation by less than maxangle can't move the viewing direction by more than that
+        bool close = false;
+        for (int s = 0; s < nsymmetry && !close; s++)
+            close = C[6] * priordirections[s].x + C[7] * priordirections[s].y + C[8] * priordirections[s].z >= mincos;
+        if (!close)
+            continue;
+
+        for (int p = 0; p < table.psi.size(); p++)
+        {
+            EulerMatrix(make_float3(table.rot[d], table.tilt[d], table.psi[p]), C);
+
+            // M = P^T * C, the rotation angle to prior * S follows from trace(M * S^T) = sum(M .* S)
+            float M[9];
+            for (int i = 0; i < 3; i++)
+                for (int j = 0; j < 3; j++)
+                    M[i * 3 + j] = P[i] * C[j] + P[3 + i] * C[3 + j] + P[6 + i] * C[6 + j];
+
+            bool inside = false;
+            for (int s = 0; s < nsymmetry && !inside; s++)
+            {
+                const float* S = table.symmetry.data() + s * 9;
+                float trace = 0;
+                for (int i = 0; i < 9; i++)
+                    trace += M[i] * S[i];
+
+                inside = (trace - 1.0f) * 0.5f >= mincos;
+            }
+
+            if (inside)
+                sampling->neighborhood.push_back(toInt2(d, p));
+        }
+    }
+}
+
+__declspec(dllexport) long long __stdcall AngleSamplingCount(void* sampling)
+{
+    return OrientationCount((AngleSampling*)sampling);
+}
+
+// Writes orientations [first, first + n) and returns how many there were
+__declspec(dllexport) int __stdcall AngleSamplingGetChunk(void* handle, long long first, int n, float3* h_angles)
+{
+    AngleSampling* sampling = (AngleSampling*)handle;
+    const SamplingTable &table = *sampling->table;
+
+    long long count = OrientationCount(sampling);
+    int nchunk = (int)tmax(0LL, tmin((long long)n, count - first));
+    long long npsi = (long long)table.psi.size();
+
+    for (int i = 0; i < nchunk; i++)
+    {
+        int2 orientation;
+        if (sampling->local)
+            orientation = sampling->neighborhood[first + i];
+        else
+            orientation = toInt2((int)((first + i) / npsi), (int)((first + i) % npsi));
+
+        h_angles[i] = make_float3(table.rot[orientation.x], table.tilt[orientation.x], table.psi[orientation.y]);
+    }
+
+    return nchunk;
+}
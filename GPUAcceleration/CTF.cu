@@ -2,6 +2,34 @@
 using namespace gtom;
 
 __global__ void ScaleNormCorrSumKernel(half2* d_simcoords, half* d_sim, half* d_scale, half* d_target, CTFParamsLean* d_params, float* d_scores, uint length);
+__global__ void SpectrumAccumulateKernel(tfloat* d_spectra, uint elements, uint nspectra, tfloat* d_sums, tfloat* d_meansum, bool perspectrum);
+
+#define CTF_CANDIDATE_LANES 8
+
+// Per-pixel invariants of a coordinate grid
+struct CTFGrid
+{
+	uint length;
+	float* d_r2;	// Squared radius in cycles per pixel
+	float* d_cos2;	// Cosine and sine of twice the angle
+	float* d_sin2;
+};
+
+// Everything about a parameter set that doesn't depend on the pixel, amplitude contrast folded into the phase
+struct CTFCandidate
+{
+	float ny2;
+	float pixelsize, pixelcos, pixelsin;
+	float defocus, defocuscos, defocussin;
+	float K1, K2;
+	float phase;
+	float Bfactor;
+	float scale;
+};
+
+__global__ void CTFGridKernel(float2* d_coords, float* d_r2, float* d_cos2, float* d_sin2, uint length);
+__global__ void CTFScoreCandidatesKernel(CTFGrid grid, float* d_ps, CTFCandidate* d_candidates, uint ncandidates, float* d_scores);
+__global__ void CTFCompareToSimGradientsKernel(half2* d_simcoords, half* d_scale, half* d_target, CTFParamsLean* d_params, float* d_scores, float* d_gradients, uint length);
 
 /*
 
@@ -13,93 +41,150 @@ extracts portions of each frame, computes the FT, and averages the results as fo
 -1D temporal fitting: d_output contains averages for all frames over all positions
 -0D no fitting: d_output is NULL
 
+Frames are ingested in chunks through a SpectrumAccumulator, which only keeps the running sums
+per origin and frame group, plus a tile of periodograms for as many origins as fit the memory budget.
+Log, averaging over origins and accumulation are fused into one kernel per tile.
+
 */
 
-__declspec(dllexport) void CreateSpectra(float* d_frame, 
-										int2 dimsframe, 
-										int nframes, 
-										int3* h_origins, 
-										int norigins, 
-										int2 dimsregion, 
-										int3 ctfgrid, 
-										float* d_outputall,
-										float* d_outputmean)
+#define SPECTRA_DEFAULT_BUDGET (256LL << 20)
+
+struct SpectrumAccumulator
+{
+	int2 dimsregion;
+	int norigins;
+	int3* d_origins;
+	int3 ctfgrid;
+	bool ctfspace;
+	int pertimegroup;
+
+	int tilesize;
+	int framesadded;
+	int framesused;
+
+	tfloat* d_tile;
+	tfloat* d_sums;
+	tfloat* d_meansum;
+};
+
+__declspec(dllexport) void* CreateSpectrumAccumulator(int2 dimsregion, int3* h_origins, int norigins, int nframes, int3 ctfgrid, long long memorybudget)
 {
+	SpectrumAccumulator* a = new SpectrumAccumulator();
+
+	size_t elementsspectrum = ElementsFFT2(dimsregion);
+
+	a->dimsregion = dimsregion;
+	a->norigins = norigins;
+	a->d_origins = (int3*)PoolMallocFromHostArray(h_origins, norigins * sizeof(int3));
+	a->ctfgrid = ctfgrid;
+	a->ctfspace = ctfgrid.x * ctfgrid.y > 1;
+	a->pertimegroup = tmax(1, nframes / ctfgrid.z);
+	a->framesadded = 0;
+	a->framesused = 0;
 
-	int3* d_origins = (int3*)CudaMallocFromHostArray(h_origins, norigins * sizeof(int3));
-	tfloat* d_tempspectra;
-	cudaMalloc((void**)&d_tempspectra, tmax(norigins, nframes) * ElementsFFT2(dimsregion) * sizeof(tfloat));
-	tfloat* d_tempaverages;
-	cudaMalloc((void**)&d_tempaverages, nframes * ElementsFFT2(dimsregion) * sizeof(tfloat));
+	// Per origin: extracted region, its FT, and the resulting periodogram
+	size_t perorigin = Elements2(dimsregion) * sizeof(tfloat) + elementsspectrum * (sizeof(tcomplex) + sizeof(tfloat));
+	a->tilesize = (int)tmax(1LL, tmin((long long)norigins, memorybudget / (long long)perorigin));
 
-	bool ctfspace = ctfgrid.x * ctfgrid.y > 1;
-	bool ctftime = ctfgrid.z > 1;
-	int nspectra = (ctfspace || ctftime) ? (ctfspace ? norigins : 1) * (ctftime ? ctfgrid.z : 1) : 1;
+	PoolMalloc((void**)&a->d_tile, a->tilesize * elementsspectrum * sizeof(tfloat));
 
-	int pertimegroup = nframes / ctfgrid.z;
+	size_t nsums = (a->ctfspace ? norigins : 1) * ctfgrid.z;
+	PoolMalloc((void**)&a->d_sums, nsums * elementsspectrum * sizeof(tfloat));
+	PoolMalloc((void**)&a->d_meansum, elementsspectrum * sizeof(tfloat));
+	d_ValueFill(a->d_sums, nsums * elementsspectrum, 0.0f);
+	d_ValueFill(a->d_meansum, elementsspectrum, 0.0f);
 
-	// Temp spectra will be summed up to be averaged later
-	d_ValueFill(d_outputall, ElementsFFT2(dimsregion) * nspectra, 0.0f);
+	return a;
+}
+
+__declspec(dllexport) void SpectrumAccumulatorAdd(void* accumulator, float* d_frames, int2 dimsframe, int nframes)
+{
+	SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+	size_t elementsspectrum = ElementsFFT2(a->dimsregion);
+
+	int TpB = 256;
+	dim3 grid = dim3(tmin(1024, ((int)elementsspectrum + TpB - 1) / TpB), 1, 1);
 
 	for (int z = 0; z < nframes; z++)
 	{
-		// Full precision, just write everything to output which is big enough
-		//if (ctfspace && ctftime)
-		//{
-		//	d_CTFPeriodogram(d_frame + Elements2(dimsframe) * z, dimsframe, d_origins, norigins, dimsregion, dimsregion, d_outputall + ElementsFFT2(dimsregion) * norigins * z, false);			
-		//	d_AddScalar(d_outputall + ElementsFFT2(dimsregion) * norigins * z, d_outputall + ElementsFFT2(dimsregion) * norigins * z, ElementsFFT2(dimsregion) * norigins, 1e2f);
-		//	d_Log(d_outputall + ElementsFFT2(dimsregion) * norigins * z, d_outputall + ElementsFFT2(dimsregion) * norigins * z, ElementsFFT2(dimsregion) * norigins);
-		//}
-		//else // Partial or no precision
+		int framegroup = a->framesadded++ / a->pertimegroup;
+		if (framegroup >= a->ctfgrid.z)	// Trailing frames that don't fill a whole group
+			continue;
+
+		tfloat* d_groupsums = a->d_sums + elementsspectrum * framegroup * (a->ctfspace ? a->norigins : 1);
+
+		for (int t = 0; t < a->norigins; t += a->tilesize)
 		{
-			int framegroup = z / pertimegroup;
-			if (framegroup >= ctfgrid.z)
-				break;
-
-			// Write spectra to temp and reduce them to a temporary average spectrum
-			d_CTFPeriodogram(d_frame + Elements2(dimsframe) * z, dimsframe, d_origins, norigins, dimsregion, dimsregion, d_tempspectra, false);
-			d_AddScalar(d_tempspectra, d_tempspectra, ElementsFFT2(dimsregion) * norigins, 1e2f);
-			d_Log(d_tempspectra, d_tempspectra, ElementsFFT2(dimsregion) * norigins);
-
-			//d_WriteMRC(d_tempspectra, toInt3(dimsregion.x / 2 + 1, dimsregion.y, norigins), "d_tempspectra.mrc");
-
-			d_ReduceMean(d_tempspectra, d_tempaverages + ElementsFFT2(dimsregion) * z, ElementsFFT2(dimsregion), norigins);
-
-			// Spatially resolved, add to output which has norigins spectra
-			//if (ctfspace)
-			{
-				d_AddVector(d_outputall + ElementsFFT2(dimsregion) * norigins * framegroup, d_tempspectra, d_outputall + ElementsFFT2(dimsregion) * norigins * framegroup, ElementsFFT2(dimsregion) * norigins);
-			}
-			// Temporally resolved, each spectrum will be the average of the entire frame's spectra (= temporary average, so just copy)
-			//else if (ctftime)
-			//{
-			//	cudaMemcpy(d_outputall + ElementsFFT2(dimsregion) * z, d_tempaverages + ElementsFFT2(dimsregion) * z, ElementsFFT2(dimsregion) * sizeof(float), cudaMemcpyDeviceToDevice);
-			//}
+			int ntile = tmin(a->tilesize, a->norigins - t);
+
+			d_CTFPeriodogram(d_frames + Elements2(dimsframe) * z, dimsframe, a->d_origins + t, ntile, a->dimsregion, a->dimsregion, a->d_tile, false);
+
+			SpectrumAccumulateKernel <<<grid, TpB>>> (a->d_tile, elementsspectrum, ntile, a->ctfspace ? d_groupsums + elementsspectrum * t : d_groupsums, a->d_meansum, a->ctfspace);
 		}
+
+		a->framesused++;
 	}
+}
 
-	// Just average over all individual spectra in d_outputall
-	//if (ctfspace && ctftime)
-		d_DivideByScalar(d_outputall, d_outputall, ElementsFFT2(dimsregion) * Elements(ctfgrid), (tfloat)pertimegroup);
-		//d_ReduceMean(d_outputall, d_outputmean, ElementsFFT2(dimsregion), Elements(ctfgrid));
-	//else
-	//{
-	//	// Average output is average of temporary averages
-		d_ReduceMean(d_tempaverages, d_outputmean, ElementsFFT2(dimsregion), nframes);
-	//
-	//	// Those were summed up, so divide by number of summands
-	//	if (ctfspace)
-
-	//}
-	//d_WriteMRC(d_outputmean, toInt3FFT(dimsregion), "d_outputmean.mrc");
-	
-	// 0D case, only one average spectrum in outputall
-	//if (nspectra == 1)
-	//	cudaMemcpy(d_outputall, d_outputmean, ElementsFFT2(dimsregion) * sizeof(float), cudaMemcpyDeviceToDevice);
-
-	cudaFree(d_origins);
-	cudaFree(d_tempspectra);
-	cudaFree(d_tempaverages);
+__declspec(dllexport) void SpectrumAccumulatorFinish(void* accumulator, void* d_outputall, void* d_outputmean, int precision)
+{
+	SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+	size_t elementsspectrum = ElementsFFT2(a->dimsregion);
+	size_t nsums = (a->ctfspace ? a->norigins : 1) * a->ctfgrid.z;
+
+	// Spatially resolved spectra average over frames in their group, the others also over origins
+	tfloat scaleall = 1.0f / (tfloat)(a->pertimegroup * (a->ctfspace ? 1 : a->norigins));
+	tfloat scalemean = 1.0f / (tfloat)tmax(1, a->framesused * a->norigins);
+
+	if (precision == STORAGE_FP32)
+	{
+		d_MultiplyByScalar(a->d_sums, (tfloat*)d_outputall, nsums * elementsspectrum, scaleall);
+		d_MultiplyByScalar(a->d_meansum, (tfloat*)d_outputmean, elementsspectrum, scalemean);
+	}
+	else
+	{
+		// The sums stay fp32, only the averages are converted
+		tfloat* d_scaled;
+		PoolMalloc((void**)&d_scaled, nsums * elementsspectrum * sizeof(tfloat));
+
+		d_MultiplyByScalar(a->d_sums, d_scaled, nsums * elementsspectrum, scaleall);
+		SingleToStorage(d_scaled, d_outputall, nsums * elementsspectrum, precision);
+		d_MultiplyByScalar(a->d_meansum, d_scaled, elementsspectrum, scalemean);
+		SingleToStorage(d_scaled, d_outputmean, elementsspectrum, precision);
+
+		PoolFree(d_scaled);
+	}
+}
+
+__declspec(dllexport) void DestroySpectrumAccumulator(void* accumulator)
+{
+	SpectrumAccumulator* a = (SpectrumAccumulator*)accumulator;
+
+	PoolFree(a->d_origins);
+	PoolFree(a->d_tile);
+	PoolFree(a->d_sums);
+	PoolFree(a->d_meansum);
+
+	delete a;
+}
+
+__declspec(dllexport) void CreateSpectra(float* d_frame, 
+										int2 dimsframe, 
+										int nframes, 
+										int3* h_origins, 
+										int norigins, 
+										int2 dimsregion, 
+										int3 ctfgrid, 
+										void* d_outputall,
+										void* d_outputmean,
+										int precision)
+{
+	void* accumulator = CreateSpectrumAccumulator(dimsregion, h_origins, norigins, nframes, ctfgrid, SPECTRA_DEFAULT_BUDGET);
+
+	SpectrumAccumulatorAdd(accumulator, d_frame, dimsframe, nframes);
+	SpectrumAccumulatorFinish(accumulator, d_outputall, d_outputmean, precision);
+
+	DestroySpectrumAccumulator(accumulator);
 }
 
 __declspec(dllexport) CTFParams CTFFitMean(float* d_ps, float2* d_pscoords, int2 dims, CTFParams startparams, CTFFitParams fp, bool doastigmatism)
@@ -132,16 +217,16 @@ __declspec(dllexport) void CTFMakeAverage(float* d_ps, float2* d_pscoords, uint
 __declspec(dllexport) void CTFCompareToSim(half* d_ps, half2* d_pscoords, half* d_scale, uint length, CTFParams* h_sourceparams, float* h_scores, uint batch)
 {
 	half* d_sim;
-	cudaMalloc((void**)&d_sim, length * batch * sizeof(float));
+	PoolMalloc((void**)&d_sim, length * batch * sizeof(float));
 	float* d_scores;
-	cudaMalloc((void**)&d_scores, batch * sizeof(float));
+	PoolMalloc((void**)&d_scores, batch * sizeof(float));
 
 	CTFParamsLean* h_lean;
 	cudaMallocHost((void**)&h_lean, batch * sizeof(CTFParamsLean));
 	#pragma omp parallel for
 	for (int i = 0; i < batch; i++)
 		h_lean[i] = CTFParamsLean(h_sourceparams[i], toInt3(1, 1, 1));	// Sidelength and pixelsize are already included in d_addresses
-	CTFParamsLean* d_lean = (CTFParamsLean*)CudaMallocFromHostArray(h_lean, batch * sizeof(CTFParamsLean));
+	CTFParamsLean* d_lean = (CTFParamsLean*)PoolMallocFromHostArray(h_lean, batch * sizeof(CTFParamsLean));
 	cudaFreeHost(h_lean);
 
 	//d_CTFSimulate(h_sourceparams, d_pscoords, d_sim, length, true, batch);
@@ -160,14 +245,116 @@ __declspec(dllexport) void CTFCompareToSim(half* d_ps, half2* d_pscoords, half*
 	//d_SumMonolithic(d_sim, d_scores, length, batch);
 
 	cudaMemcpy(h_scores, d_scores, batch * sizeof(float), cudaMemcpyDeviceToHost);
-	cudaFree(d_lean);
-	cudaFree(d_sim);
-	cudaFree(d_scores);
+	PoolFree(d_lean);
+	PoolFree(d_sim);
+	PoolFree(d_scores);
 
 	//for (uint i = 0; i < batch; i++)
 		//h_scores[i] /= (float)length;
 }
 
+/*
+
+CTFCompareToSim's scores and their analytic gradients, CTF_GRADIENT_PARAMS per spectrum in CTFParams units.
+Each block accumulates the three sums behind the score and their derivatives for one spectrum, so a fitter
+gets the objective and its gradient from a single pass over the data.
+
+*/
+
+__declspec(dllexport) void CTFCompareToSimGradients(half* d_ps, half2* d_pscoords, half* d_scale, uint length, CTFParams* h_sourceparams, float* h_scores, float* h_gradients, uint batch)
+{
+	std::vector<CTFParamsLean> h_lean;
+	for (uint i = 0; i < batch; i++)
+		h_lean.push_back(CTFParamsLean(h_sourceparams[i], toInt3(1, 1, 1)));	// Sidelength and pixelsize are already included in d_pscoords
+	CTFParamsLean* d_lean = (CTFParamsLean*)PoolMallocFromHostArray(h_lean.data(), batch * sizeof(CTFParamsLean));
+
+	float* d_scores;
+	PoolMalloc((void**)&d_scores, batch * (1 + CTF_GRADIENT_PARAMS) * sizeof(float));
+	float* d_gradients = d_scores + batch;
+
+	CTFCompareToSimGradientsKernel <<<batch, 128>>> (d_pscoords, d_scale, d_ps, d_lean, d_scores, d_gradients, length);
+
+	cudaMemcpy(h_scores, d_scores, batch * sizeof(float), cudaMemcpyDeviceToHost);
+	cudaMemcpy(h_gradients, d_gradients, batch * CTF_GRADIENT_PARAMS * sizeof(float), cudaMemcpyDeviceToHost);
+
+	PoolFree(d_lean);
+	PoolFree(d_scores);
+}
+
+/*
+
+Scoring many parameter sets against one spectrum, for fitters that evaluate their candidates in batches.
+The grid keeps the per-pixel invariants of the coordinates between calls, which turn astigmatism and pixel
+size anisotropy into multiply-adds. Each block scores CTF_CANDIDATE_LANES parameter sets, so every pixel
+loaded from the grid serves all of them. Scores are the normalized cross-correlation of |CTF| with the
+spectrum, like CTFFitMean's.
+
+*/
+
+__declspec(dllexport) void* CreateCTFGrid(float2* d_coords, uint length)
+{
+	CTFGrid* grid = new CTFGrid();
+	grid->length = length;
+
+	PoolMalloc((void**)&grid->d_r2, length * sizeof(float));
+	PoolMalloc((void**)&grid->d_cos2, length * sizeof(float));
+	PoolMalloc((void**)&grid->d_sin2, length * sizeof(float));
+
+	int TpB = 256;
+	dim3 blocks = dim3(tmin(1024, ((int)length + TpB - 1) / TpB), 1, 1);
+	CTFGridKernel <<<blocks, TpB>>> (d_coords, grid->d_r2, grid->d_cos2, grid->d_sin2, length);
+
+	return grid;
+}
+
+__declspec(dllexport) void DestroyCTFGrid(void* handle)
+{
+	CTFGrid* grid = (CTFGrid*)handle;
+
+	PoolFree(grid->d_r2);
+	PoolFree(grid->d_cos2);
+	PoolFree(grid->d_sin2);
+
+	delete grid;
+}
+
+__declspec(dllexport) void CTFScoreCandidates(void* grid, float* d_ps, CTFParams* h_params, uint ncandidates, float* h_scores)
+{
+	uint ngroups = (ncandidates + CTF_CANDIDATE_LANES - 1) / CTF_CANDIDATE_LANES;
+
+	// Lanes past the last parameter set repeat it
+	std::vector<CTFCandidate> h_candidates(ngroups * CTF_CANDIDATE_LANES);
+	for (uint i = 0; i < h_candidates.size(); i++)
+	{
+		CTFParamsLean p(h_params[tmin(i, ncandidates - 1)], toInt3(1, 1, 1));
+		CTFCandidate &c = h_candidates[i];
+
+		c.ny2 = p.ny * p.ny;
+		c.pixelsize = p.pixelsize;
+		c.pixelcos = p.pixeldelta * cos(2.0f * p.pixelangle);
+		c.pixelsin = p.pixeldelta * sin(2.0f * p.pixelangle);
+		c.defocus = p.defocus;
+		c.defocuscos = p.defocusdelta * cos(2.0f * p.astigmatismangle);
+		c.defocussin = p.defocusdelta * sin(2.0f * p.astigmatismangle);
+		c.K1 = p.K1;
+		c.K2 = p.K2;
+		c.phase = p.phaseshift - acos(tmax(-1.0f, tmin(1.0f, p.amplitude)));	// A cos(x) - sqrt(1 - A^2) sin(x) = cos(x + acos(A))
+		c.Bfactor = p.Bfactor;
+		c.scale = p.scale;
+	}
+
+	CTFCandidate* d_candidates = (CTFCandidate*)PoolMallocFromHostArray(h_candidates.data(), h_candidates.size() * sizeof(CTFCandidate));
+	float* d_scores;
+	PoolMalloc((void**)&d_scores, ngroups * CTF_CANDIDATE_LANES * sizeof(float));
+
+	CTFScoreCandidatesKernel <<<ngroups, 128>>> (*(CTFGrid*)grid, d_ps, d_candidates, ncandidates, d_scores);
+
+	cudaMemcpy(h_scores, d_scores, ncandidates * sizeof(float), cudaMemcpyDeviceToHost);
+
+	PoolFree(d_candidates);
+	PoolFree(d_scores);
+}
+
 __global__ void ScaleNormCorrSumKernel(half2* d_simcoords, half* d_sim, half* d_scale, half* d_target, CTFParamsLean* d_params, float* d_scores, uint length)
 {
 	__shared__ float s_sums1[128];
@@ -224,4 +411,200 @@ __global__ void ScaleNormCorrSumKernel(half2* d_simcoords, half* d_sim, half* d_
 
 		d_scores[blockIdx.x] = sum1 / (float)length;
 	}
-}
\ No newline at end of file
+}
+
+__global__ void SpectrumAccumulateKernel(tfloat* d_spectra, uint elements, uint nspectra, tfloat* d_sums, tfloat* d_meansum, bool perspectrum)
+{
+	for (uint i = blockIdx.x * blockDim.x + threadIdx.x; i < elements; i += gridDim.x * blockDim.x)
+	{
+		tfloat sum = 0;
+		for (uint n = 0; n < nspectra; n++)
+		{
+			tfloat val = log(d_spectra[n * elements + i] + 1e2f);
+			sum += val;
+
+			if (perspectrum)
+				d_sums[n * elements + i] += val;
+		}
+
+		if (!perspectrum)
+			d_sums[i] += sum;
+		d_meansum[i] += sum;
+	}
+}
+
+__global__ void CTFGridKernel(float2* d_coords, float* d_r2, float* d_cos2, float* d_sin2, uint length)
+{
+	for (uint i = blockIdx.x * blockDim.x + threadIdx.x; i < length; i += gridDim.x * blockDim.x)
+	{
+		float2 coords = d_coords[i];
+		d_r2[i] = coords.x * coords.x;
+		d_cos2[i] = cos(2.0f * coords.y);
+		d_sin2[i] = sin(2.0f * coords.y);
+	}
+}
+
+__global__ void CTFScoreCandidatesKernel(CTFGrid grid, float* d_ps, CTFCandidate* d_candidates, uint ncandidates, float* d_scores)
+{
+	// Per lane: sum(sim), sum(sim^2), sum(sim * ps); then sum(ps) and sum(ps^2)
+	const int NSums = CTF_CANDIDATE_LANES * 3 + 2;
+
+	__shared__ CTFCandidate s_candidates[CTF_CANDIDATE_LANES];
+	__shared__ float s_sums[NSums][128];
+	__shared__ float s_totals[NSums];
+
+	if (threadIdx.x < CTF_CANDIDATE_LANES)
+		s_candidates[threadIdx.x] = d_candidates[blockIdx.x * CTF_CANDIDATE_LANES + threadIdx.x];
+	__syncthreads();
+
+	float sums[NSums];
+	for (int n = 0; n < NSums; n++)
+		sums[n] = 0;
+
+	for (uint i = threadIdx.x; i < grid.length; i += blockDim.x)
+	{
+		float r2 = grid.d_r2[i], c = grid.d_cos2[i], s = grid.d_sin2[i];
+		float ps = d_ps[i];
+
+		for (int l = 0; l < CTF_CANDIDATE_LANES; l++)
+		{
+			const CTFCandidate &p = s_candidates[l];
+
+			float pixelsize = p.pixelsize + p.pixelcos * c + p.pixelsin * s;
+			float k2 = r2 * p.ny2 / (pixelsize * pixelsize);
+			float deltaf = p.defocus + p.defocuscos * c + p.defocussin * s;
+			float sim = p.scale * abs(__cosf(p.K1 * deltaf * k2 + p.K2 * k2 * k2 - p.phase) * __expf(p.Bfactor * k2));
+
+			sums[l * 3 + 0] += sim;
+			sums[l * 3 + 1] += sim * sim;
+			sums[l * 3 + 2] += sim * ps;
+		}
+
+		sums[NSums - 2] += ps;
+		sums[NSums - 1] += ps * ps;
+	}
+
+	for (int n = 0; n < NSums; n++)
+		s_sums[n][threadIdx.x] = sums[n];
+	__syncthreads();
+
+	if (threadIdx.x < NSums)
+	{
+		float total = 0;
+		for (int t = 0; t < 128; t++)
+			total += s_sums[threadIdx.x][t];
+		s_totals[threadIdx.x] = total;
+	}
+	__syncthreads();
+
+	uint candidate = blockIdx.x * CTF_CANDIDATE_LANES + threadIdx.x;
+	if (threadIdx.x < CTF_CANDIDATE_LANES && candidate < ncandidates)
+	{
+		float length = (float)grid.length;
+		float sumps = s_totals[NSums - 2], sumps2 = s_totals[NSums - 1];
+		float sum1 = s_totals[threadIdx.x * 3 + 0], sum2 = s_totals[threadIdx.x * 3 + 1], sumcross = s_totals[threadIdx.x * 3 + 2];
+
+		float covariance = sumcross / length - (sum1 / length) * (sumps / length);
+		float stdsim = sqrt(fmaxf(0.0f, sum2 / length - (sum1 / length) * (sum1 / length)));
+		float stdps = sqrt(fmaxf(0.0f, sumps2 / length - (sumps / length) * (sumps / length)));
+
+		d_scores[candidate] = stdsim > 0 && stdps > 0 ? covariance / (stdsim * stdps) : 0.0f;
+	}
+}
+
+__global__ void CTFCompareToSimGradientsKernel(half2* d_simcoords, half* d_scale, half* d_target, CTFParamsLean* d_params, float* d_scores, float* d_gradients, uint length)
+{
+	// sum(sim), sum(sim^2), sum(sim * target), the same for each derivative of sim, then sum(target)
+	const int NSums = 3 * (CTF_GRADIENT_PARAMS + 1) + 1;
+
+	__shared__ float s_sums[NSums][128];
+	__shared__ float s_totals[NSums];
+
+	d_target += blockIdx.x * length;
+	CTFParamsLean p = d_params[blockIdx.x];
+
+	float astigmatismcos = cos(2.0f * p.astigmatismangle), astigmatismsin = sin(2.0f * p.astigmatismangle);
+	float defocuscos = p.defocusdelta * astigmatismcos, defocussin = p.defocusdelta * astigmatismsin;
+	float phase = p.phaseshift - acos(fmaxf(-1.0f, fminf(1.0f, p.amplitude)));
+
+	float sums[NSums];
+	for (int n = 0; n < NSums; n++)
+		sums[n] = 0;
+
+	for (uint i = threadIdx.x; i < length; i += blockDim.x)
+	{
+		float2 coords = __half22float2(d_simcoords[i]);
+		float c = __cosf(2.0f * coords.y), s = __sinf(2.0f * coords.y);
+		float pixelsize = p.pixelsize + p.pixeldelta * __cosf(2.0f * (coords.y - p.pixelangle));
+		float k2 = coords.x * coords.x * p.ny * p.ny / (pixelsize * pixelsize);
+
+		float deltaf = p.defocus + defocuscos * c + defocussin * s;
+		float phi = p.K1 * deltaf * k2 + p.K2 * k2 * k2 - phase;
+		float envelope = __expf(p.Bfactor * k2);
+		float scale = p.scale * __half2float(d_scale[i]);
+		float target = __half2float(d_target[i]);
+
+		float value = __cosf(phi) * envelope;
+		float sign = value < 0 ? -scale : scale;
+		float dphi = -sign * __sinf(phi) * envelope;	// d|CTF|/dphi
+		float ddefocus = dphi * p.K1 * k2;
+
+		float values[CTF_GRADIENT_PARAMS + 1];
+		values[0] = abs(value) * scale;
+		values[1] = ddefocus;
+		values[2] = ddefocus * (c * astigmatismcos + s * astigmatismsin);
+		values[3] = ddefocus * 2.0f * (s * defocuscos - c * defocussin);
+		values[4] = -dphi;
+		values[5] = values[0] * k2;
+
+		sums[0] += values[0];
+		sums[1] += values[0] * values[0];
+		sums[2] += values[0] * target;
+		for (int v = 1; v <= CTF_GRADIENT_PARAMS; v++)
+		{
+			sums[v * 3 + 0] += values[v];
+			sums[v * 3 + 1] += 2.0f * values[0] * values[v];
+			sums[v * 3 + 2] += values[v] * target;
+		}
+		sums[NSums - 1] += target;
+	}
+
+	for (int n = 0; n < NSums; n++)
+		s_sums[n][threadIdx.x] = sums[n];
+	__syncthreads();
+
+	if (threadIdx.x < NSums)
+	{
+		float total = 0;
+		for (int t = 0; t < 128; t++)
+			total += s_sums[threadIdx.x][t];
+		s_totals[threadIdx.x] = total;
+	}
+	__syncthreads();
+
+	// score = (sumcross - sum1 * sumtarget / length) / sqrt(length * sum2 - sum1^2), differentiated by the quotient rule
+	if (threadIdx.x <= CTF_GRADIENT_PARAMS)
+	{
+		// Lean parameters to CTFParams units, see CTFParamsLean
+		const float Units[CTF_GRADIENT_PARAMS] = { 1e10f, 0.5e10f, 1.0f, 1.0f, 0.25e20f };
+
+		float n = (float)length;
+		float sum1 = s_totals[0], sum2 = s_totals[1], sumcross = s_totals[2], sumtarget = s_totals[NSums - 1];
+		float numerator = sumcross - sum1 * sumtarget / n;
+		float denominator = sqrt(fmaxf(0.0f, n * sum2 - sum1 * sum1));
+		float invdenominator = denominator > 0 ? 1.0f / denominator : 0.0f;
+
+		if (threadIdx.x == 0)
+		{
+			d_scores[blockIdx.x] = numerator * invdenominator;
+		}
+		else
+		{
+			int v = threadIdx.x;
+			float dnumerator = s_totals[v * 3 + 2] - s_totals[v * 3 + 0] * sumtarget / n;
+			float ddenominator = (n * s_totals[v * 3 + 1] - 2.0f * sum1 * s_totals[v * 3 + 0]) * 0.5f * invdenominator;
+
+			d_gradients[blockIdx.x * CTF_GRADIENT_PARAMS + v - 1] = (dnumerator - numerator * ddenominator * invdenominator) * invdenominator * Units[v - 1];
+		}
+	}
+}
@@ -0,0 +1,258 @@
+#include "Functions.h"
+#include <functional>
+using namespace gtom;
+
+/*
+
+Spatially resolved CTF fitting in one call. Defocus and phase shift vary over the spectra through linear
+interpolants, typically the anchors of a CubicGrid: the value for spectrum s is the sum over anchors a of
+weights[a * nspectra + s] * anchor[a], which is what CubicGrid.GetWiggleWeights returns. Astigmatism and
+B-factor are shared by all spectra.
+
+The objective is Warp's, (1 - mean CTFCompareToSim score) * 1000. CTFCompareToSimGradients gives it
+together with its analytic gradient in one pass over the spectra, where finite differences needed two
+passes per parameter, and L-BFGS minimizes it.
+
+h_values holds the ndefocus defocus anchors (um), nphase phase anchors (pi), defocus delta (um),
+astigmatism angle (radians) and B-factor (A^2), in this order. They are the start on input and the
+solution on output; parameters not being fitted keep their input values.
+
+*/
+
+namespace
+{
+    // Returns the objective at x and writes its gradient
+    typedef std::function<double(const std::vector<double>&, std::vector<double>&)> Objective;
+
+    double Dot(const std::vector<double> &a, const std::vector<double> &b)
+    {
+        double sum = 0;
+        for (size_t i = 0; i < a.size(); i++)
+            sum += a[i] * b[i];
+
+        return sum;
+    }
+
+    /*
+
+    L-BFGS, the two-loop recursion over the last ncorrections curvature pairs, with a backtracking line search
+    enforcing the Armijo condition. Pairs that would break positive definiteness are skipped. Stops when the
+    objective decreases by less than delta relative to its value, when no step along the search direction
+    decreases it, or after maxiterations. Returns the number of objective evaluations.
+
+    */
+
+    int MinimizeLBFGS(const Objective &f, std::vector<double> &x, double &fx, int ncorrections, int maxiterations, int maxlinesearch, double delta)
+    {
+        const double Armijo = 1e-4;
+
+        size_t n = x.size();
+        std::vector<double> gradient(n), direction(n), xnew(n), gradientnew(n);
+        std::vector<std::vector<double>> S, Y;
+        std::vector<double> rho;
+
+        fx = f(x, gradient);
+        int nevaluations = 1;
+
+        for (int iter = 0; iter < maxiterations; iter++)
+        {
+            // direction = -H * gradient
+            direction = gradient;
+            std::vector<double> alpha(S.size());
+            for (int i = (int)S.size() - 1; i >= 0; i--)
+            {
+                alpha[i] = rho[i] * Dot(S[i], direction);
+                for (size_t j = 0; j < n; j++)
+                    direction[j] -= alpha[i] * Y[i][j];
+            }
+
+            double gamma = S.empty() ? 1.0 / tmax(1e-30, sqrt(Dot(gradient, gradient))) : Dot(S.back(), Y.back()) / Dot(Y.back(), Y.back());
+            for (size_t j = 0; j < n; j++)
+                direction[j] *= gamma;
+
+            for (int i = 0; i < (int)S.size(); i++)
+            {
+                double beta = rho[i] * Dot(Y[i], direction);
+                for (size_t j = 0; j < n; j++)
+                    direction[j] += S[i][j] * (alpha[i] - beta);
+            }
+
+            for (size_t j = 0; j < n; j++)
+                direction[j] = -direction[j];
+
+            double slope = Dot(gradient, direction);
+            if (slope >= 0)
+            {
+                // Not a descent direction anymore, start over with steepest descent
+                if (S.empty())
+                    break;
+
+                S.clear();
+                Y.clear();
+                rho.clear();
+                continue;
+            }
+
+            // Backtracking, the next step comes from the minimum of the quadratic through f(0), f'(0) and f(step)
+            double step = 1.0, fnew = 0;
+            bool accepted = false;
+            for (int l = 0; l < maxlinesearch && !accepted; l++)
+            {
+                for (size_t j = 0; j < n; j++)
+                    xnew[j] = x[j] + step * direction[j];
+
+                fnew = f(xnew, gradientnew);
+                nevaluations++;
+
+                if (fnew <= fx + Armijo * step * slope)
+                    accepted = true;
+                else
+                    step = tmax(0.1 * step, tmin(0.5 * step, -slope * step * step / (2.0 * (fnew - fx - slope * step))));
+            }
+
+            if (!accepted)
+                break;
+
+            std::vector<double> s(n), y(n);
+            for (size_t j = 0; j < n; j++)
+            {
+                s[j] = xnew[j] - x[j];
+                y[j] = gradientnew[j] - gradient[j];
+            }
+
+            double sy = Dot(s, y);
+            if (sy > 1e-12 * sqrt(Dot(s, s) * Dot(y, y)))
+            {
+                if ((int)S.size() == ncorrections)
+                {
+                    S.erase(S.begin());
+                    Y.erase(Y.begin());
+                    rho.erase(rho.begin());
+                }
+
+                S.push_back(s);
+                Y.push_back(y);
+                rho.push_back(1.0 / sy);
+            }
+
+            double decrease = fx - fnew;
+            x = xnew;
+            gradient = gradientnew;
+            fx = fnew;
+
+            if (decrease <= delta * tmax(1.0, abs(fx)))
+                break;
+        }
+
+        return nevaluations;
+    }
+}
+
+// Returns the number of passes over the spectra, h_score gets the final mean score
+__declspec(dllexport) int __stdcall CTFFitGrid(half* d_ps,
+                                               half2* d_pscoords,
+                                               half* d_scale,
+                                               uint length,
+                                               uint nspectra,
+                                               CTFParams baseparams,
+                                               float* h_defocusweights,
+                                               int ndefocus,
+                                               float* h_phaseweights,
+                                               int nphase,
+                                               bool fitphase,
+                                               bool fitastigmatism,
+                                               bool fitbfactor,
+                                               int maxiterations,
+                                               float* h_values,
+                                               float* h_score)
+{
+    int idelta = ndefocus + nphase, iangle = idelta + 1, ibfactor = idelta + 2;
+
+    // Only the fitted parameters are exposed to the optimizer
+    std::vector<int> fitted;
+    for (int i = 0; i < ndefocus; i++)
+        fitted.push_back(i);
+    if (fitphase)
+        for (int i = 0; i < nphase; i++)
+            fitted.push_back(ndefocus + i);
+    if (fitastigmatism)
+    {
+        fitted.push_back(idelta);
+        fitted.push_back(iangle);
+    }
+    if (fitbfactor)
+        fitted.push_back(ibfactor);
+
+    std::vector<double> values(h_values, h_values + ibfactor + 1);
+    std::vector<CTFParams> params(nspectra, baseparams);
+    std::vector<float> scores(nspectra), gradients((size_t)nspectra * CTF_GRADIENT_PARAMS);
+    std::vector<double> fullgradient(values.size());
+
+    Objective objective = [&](const std::vector<double> &x, std::vector<double> &gradient)
+    {
+        for (size_t i = 0; i < fitted.size(); i++)
+            values[fitted[i]] = x[i];
+
+        for (uint s = 0; s < nspectra; s++)
+        {
+            double defocus = 0, phase = 0;
+            for (int a = 0; a < ndefocus; a++)
+                defocus += h_defocusweights[(size_t)a * nspectra + s] * values[a];
+            for (int a = 0; a < nphase; a++)
+                phase += h_phaseweights[(size_t)a * nspectra + s] * values[ndefocus + a];
+
+            // Same conversions as CTF.ToStruct
+            params[s].defocus = (float)(-defocus * 1e-6);
+            params[s].phaseshift = (float)(phase * PI);
+            params[s].defocusdelta = (float)(-values[idelta] * 1e-6);
+            params[s].astigmatismangle = (float)values[iangle];
+            params[s].Bfactor = (float)(values[ibfactor] * 1e-20);
+        }
+
+        CTFCompareToSimGradients(d_ps, d_pscoords, d_scale, length, params.data(), scores.data(), gradients.data(), nspectra);
+
+        // Chain rule through the interpolants and unit conversions, and the objective's -1000 / nspectra
+        const double Factor = -1000.0 / nspectra;
+        const double Units[CTF_GRADIENT_PARAMS] = { -1e-6, -1e-6, 1.0, PI, 1e-20 };
+
+        double sumscores = 0;
+        std::fill(fullgradient.begin(), fullgradient.end(), 0.0);
+        for (uint s = 0; s < nspectra; s++)
+        {
+            const float* h_spectrumgradient = gradients.data() + (size_t)s * CTF_GRADIENT_PARAMS;
+            sumscores += scores[s];
+
+            for (int a = 0; a < ndefocus; a++)
+                fullgradient[a] += h_defocusweights[(size_t)a * nspectra + s] * h_spectrumgradient[0] * Units[0];
+            for (int a = 0; a < nphase; a++)
+                fullgradient[ndefocus + a] += h_phaseweights[(size_t)a * nspectra + s] * h_spectrumgradient[3] * Units[3];
+
+            fullgradient[idelta] += h_spectrumgradient[1] * Units[1];
+            fullgradient[iangle] += h_spectrumgradient[2] * Units[2];
+            fullgradient[ibfactor] += h_spectrumgradient[4] * Units[4];
+        }
+
+        for (size_t i = 0; i < fitted.size(); i++)
+            gradient[i] = fullgradient[fitted[i]] * Factor;
+
+        return (1.0 - sumscores / nspectra) * 1000.0;
+    };
+
+    std::vector<double> x(fitted.size());
+    for (size_t i = 0; i < fitted.size(); i++)
+        x[i] = values[fitted[i]];
+
+    double fx;
+    int npasses = MinimizeLBFGS(objective, x, fx, 20, maxiterations, 15, 1e-6);
+
+    // The last evaluation may have been a rejected line search step
+    for (size_t i = 0; i < fitted.size(); i++)
+        values[fitted[i]] = x[i];
+    for (size_t i = 0; i < values.size(); i++)
+        h_values[i] = (float)values[i];
+
+    if (h_score != NULL)
+        *h_score = (float)(1.0 - fx / 1000.0);
+
+    return npasses;
+}
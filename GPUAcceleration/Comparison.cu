@@ -14,7 +14,7 @@ __declspec(dllexport) void CompareParticles(float* d_particles,
 											uint nparticles)
 {
 	float* d_ctf;
-	cudaMalloc((void**)&d_ctf, ElementsFFT2(dims) * nparticles * sizeof(float));
+	PoolMalloc((void**)&d_ctf, ElementsFFT2(dims) * nparticles * sizeof(float));
 	d_CTFSimulate(h_ctfparams, d_ctfcoords, d_ctf, ElementsFFT2(dims), false, nparticles);
 	//d_WriteMRC(d_ctf, toInt3(dims.x / 2 + 1, dims.y, nparticles), "d_ctf.mrc");
 
@@ -25,10 +25,10 @@ __declspec(dllexport) void CompareParticles(float* d_particles,
 	//d_WriteMRC(d_particles, toInt3(dims.x, dims.y, nparticles), "d_particles.mrc");
 	
 	float2* d_projectionsft;
-	cudaMalloc((void**)&d_projectionsft, ElementsFFT2(dims) * nparticles * sizeof(float2));
-	d_FFTR2C(d_projections, d_projectionsft, 2, toInt3(dims), nparticles);
+	PoolMalloc((void**)&d_projectionsft, ElementsFFT2(dims) * nparticles * sizeof(float2));
+	d_FFTR2CCached(d_projections, d_projectionsft, 2, toInt3(dims), nparticles);
 	d_ComplexMultiplyByVector(d_projectionsft, d_ctf, d_projectionsft, ElementsFFT2(dims) * nparticles);
-	d_IFFTC2R(d_projectionsft, d_projections, 2, toInt3(dims), nparticles);
+	d_IFFTC2RCached(d_projectionsft, d_projections, 2, toInt3(dims), nparticles);
 
 	d_RemapFullFFT2Full(d_projections, d_projections, toInt3(dims), nparticles);
 	d_Bandpass(d_projections, d_projections, toInt3(dims), highpass, lowpass, 1.0f, NULL, NULL, NULL, nparticles);
@@ -41,6 +41,6 @@ __declspec(dllexport) void CompareParticles(float* d_particles,
 	d_SumMonolithic(d_projections, d_scores, Elements2(dims), nparticles);
 	d_MultiplyByScalar(d_scores, d_scores, nparticles, 1.0f / Elements2(dims));
 
-	cudaFree(d_projectionsft);
-	cudaFree(d_ctf);
+	PoolFree(d_projectionsft);
+	PoolFree(d_ctf);
 }
\ No newline at end of file
@@ -1,261 +1,507 @@
 #include "Functions.h"
+#include <vector>
 using namespace gtom;
 
-float CubicInterpShort(float2* data, float x, int n);
-template<int N> float CubicInterp(float2* data, float x);
+#ifndef CUBIC_LANES
+#define CUBIC_LANES 16    // Samples evaluated together: 2 AVX2 or 1 AVX-512 register of floats
+#endif
 
-__declspec(dllexport) void __stdcall CubicInterpOnGrid(int3 dimensions, float* values, float3 spacing, int3 valueGrid, float3 step, float3 offset, float* output)
-{
-	#pragma omp parallel for
-	for (int valueZ = 0; valueZ < valueGrid.z; valueZ++)
-		for (int valueY = 0; valueY < valueGrid.y; valueY++)
-			for (int valueX = 0; valueX < valueGrid.x; valueX++)
-			{
-				float3 coords = make_float3(valueX * step.x + offset.x, valueY * step.y + offset.y, valueZ * step.z + offset.z);
-				
-				{
-					coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);  // from [0, 1] to [0, dim - 1]
-
-					float3 coord_grid = coords;
-					float3 index = make_float3(floor(coord_grid.x), floor(coord_grid.y), floor(coord_grid.z));
-
-					float result = 0.0f;
-
-					int MinX = tmax(0, (int)index.x - 1), MaxX = tmin((int)index.x + 2, dimensions.x - 1);
-					int MinY = tmax(0, (int)index.y - 1), MaxY = tmin((int)index.y + 2, dimensions.y - 1);
-					int MinZ = tmax(0, (int)index.z - 1), MaxZ = tmin((int)index.z + 2, dimensions.z - 1);
-
-					int nz = MaxZ - MinZ + 1;
-					int ny = MaxY - MinY + 1;
-					int nx = MaxX - MinX + 1;
-
-					float InterpX[16];
-					for (int z = MinZ; z <= MaxZ; z++)
-					{
-						for (int y = MinY; y <= MaxY; y++)
-						{
-							float2 Points[4];
-							if (nx == 1)
-								InterpX[(z - MinZ) * ny + y - MinY] = values[(z * dimensions.y + y) * 1];
-							else
-							{
-								for (int x = MinX; x <= MaxX; x++)
-									Points[x - MinX] = make_float2(x, values[(z * dimensions.y + y) * dimensions.x + x]);
-
-								InterpX[(z - MinZ) * ny + y - MinY] = CubicInterpShort(Points, coords.x, nx);
-							}
-						}
-					}
-
-					float InterpXY[4];
-					for (int z = MinZ; z <= MaxZ; z++)
-					{
-						float2 Points[4];
-						if (ny == 1)
-							InterpXY[z - MinZ] = InterpX[(z - MinZ) * ny];
-						else
-						{
-							for (int y = MinY; y <= MaxY; y++)
-								Points[y - MinY] = make_float2(y, InterpX[(z - MinZ) * ny + y - MinY]);
-
-							InterpXY[z - MinZ] = CubicInterpShort(Points, coords.y, ny);
-						}
-					}
-
-					{
-						float2 Points[4];
-						if (nz == 1)
-							result = InterpXY[0];
-						else
-						{
-							for (int z = MinZ; z <= MaxZ; z++)
-								Points[z - MinZ] = make_float2(z, InterpXY[z - MinZ]);
-
-							result = CubicInterpShort(Points, coords.z, nz);
-						}
-					}
-
-					output[(valueZ * valueGrid.y + valueY) * valueGrid.x + valueX] = result;
-				}
-			}
-}
+/*
 
-__declspec(dllexport) void __stdcall CubicInterpIrregular(int3 dimensions, float* values, float3* positions, int npositions, float3 spacing, float* output)
+Monotone piecewise cubic interpolation (Matlab's pchip) on a regular grid, evaluated separably along X, Y and Z.
+Along each axis, a sample only sees a window of up to 4 nodes around it. The window's shape (number of nodes,
+and which of its segments contains the sample) only depends on the node index, so there are just 5 of them:
+a single node, 2 nodes, 3 nodes at the start or the end of the axis, and 4 nodes in the interior.
+
+The X splines don't depend on the sample position, and their coefficients are tabulated once per grid for every
+row and node index. Y and Z splines interpolate values that were just computed for the sample, so they are built
+on the fly, but for a whole group of samples at once, with the window shape known at compile time.
+
+Results are identical to the per-sample evaluation done previously, given the same floating point model. Samples
+further than one node outside the grid, which used to read outside the window, are extrapolated from the outermost
+segment.
+
+*/
+
+namespace
 {
-#pragma omp parallel for
-    for (int position = 0; position < npositions; position++)
+    enum CubicWindow
+    {
+        CubicWindow1 = 0,
+        CubicWindow2,
+        CubicWindow3Start,
+        CubicWindow3End,
+        CubicWindow4,
+        CubicWindowCount
+    };
+
+    // Locates the window of nodes used for a sample at coord (in node units) along an axis of dim nodes
+    inline int GetCubicWindow(float coord, int dim, int &first, float &t)
     {
-        float3 coords = positions[position];
+        int index = tmin(tmax((int)floor(coord), -1), dim - 1);
+        first = tmax(0, index - 1);
+        int n = tmin(index + 2, dim - 1) - first + 1;
+        int segment = tmax(0, tmin(index - first, n - 2));
+        t = coord - (float)(first + segment);
+
+        if (n == 1)
+            return CubicWindow1;
+        if (n == 2)
+            return CubicWindow2;
+        if (n == 3)
+            return segment == 0 ? CubicWindow3Start : CubicWindow3End;
+        return CubicWindow4;
+    }
 
+    // Slope at node K of an N-node window with unit spacing, del holding the N - 1 secants
+    template<int N, int K> inline float CubicSlope(const float* del)
+    {
+        if (N == 2)
+            return del[0];
+
+        if (K == 0 || K == N - 1)
         {
-            coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);  // from [0, 1] to [0, dim - 1]
+            // One-sided three-point estimate, shape-preserving
+            const int a = K == 0 ? 0 : N - 2;
+            const int b = K == 0 ? 1 : N - 3;
+
+            float slope = (3.0f * del[a] - del[b]) / 2.0f;
+            if (sgn(slope) != sgn(del[a]))
+                return 0.0f;
+            if (sgn(del[a]) != sgn(del[b]) && abs(slope) > abs(3.0f * del[a]))
+                return 3.0f * del[a];
+            return slope;
+        }
+        else
+        {
+            // Weighted harmonic mean of the adjacent secants, 0 at local extrema
+            const int k = K - 1;
+            if (del[k] * del[k + 1] <= 0.0f)
+                return 0.0f;
+
+            float dmax = tmax(abs(del[k]), abs(del[k + 1]));
+            float dmin = tmin(abs(del[k]), abs(del[k + 1]));
+            return dmin / (0.5f * (del[k] / dmax) + 0.5f * (del[k + 1] / dmax));
+        }
+    }
 
-            float3 coord_grid = coords;
-            float3 index = make_float3(floor(coord_grid.x), floor(coord_grid.y), floor(coord_grid.z));
+    // Polynomial coefficients of segment SEG, highest order first; evaluate with t relative to the segment's start
+    template<int N, int SEG> inline float4 CubicCoefficients(const float* nodes)
+    {
+        if (N == 1)
+            return make_float4(0.0f, 0.0f, 0.0f, nodes[0]);
 
-            float result = 0.0f;
+        float del[N > 1 ? N - 1 : 1];
+        for (int i = 0; i < N - 1; i++)
+            del[i] = nodes[i + 1] - nodes[i];
 
-            int MinX = tmax(0, (int)index.x - 1), MaxX = tmin((int)index.x + 2, dimensions.x - 1);
-            int MinY = tmax(0, (int)index.y - 1), MaxY = tmin((int)index.y + 2, dimensions.y - 1);
-            int MinZ = tmax(0, (int)index.z - 1), MaxZ = tmin((int)index.z + 2, dimensions.z - 1);
+        float slope0 = CubicSlope<N, SEG>(del);
+        float slope1 = CubicSlope<N, SEG + 1>(del);
 
-            int nz = MaxZ - MinZ + 1;
-            int ny = MaxY - MinY + 1;
-            int nx = MaxX - MinX + 1;
+        float dzzdx = del[SEG] - slope0;
+        float dzdxdx = slope1 - del[SEG];
 
-            float InterpX[16];
-            for (int z = MinZ; z <= MaxZ; z++)
+        return make_float4(dzdxdx - dzzdx, 2.0f * dzzdx - dzdxdx, slope0, nodes[SEG]);
+    }
+
+    inline float CubicHorner(float4 c, float t)
+    {
+        float v = c.x;
+        v = t * v + c.y;
+        v = t * v + c.z;
+        v = t * v + c.w;
+
+        return v;
+    }
+
+    // Derivatives of CubicSlope<N, K> w.r.t. the N - 1 secants, taking the same branch
+    template<int N, int K> inline void CubicSlopeGradient(const float* del, float* gradient)
+    {
+        for (int i = 0; i < N - 1; i++)
+            gradient[i] = 0.0f;
+
+        if (N == 2)
+        {
+            gradient[0] = 1.0f;
+            return;
+        }
+
+        if (K == 0 || K == N - 1)
+        {
+            const int a = K == 0 ? 0 : N - 2;
+            const int b = K == 0 ? 1 : N - 3;
+
+            float slope = (3.0f * del[a] - del[b]) / 2.0f;
+            if (sgn(slope) != sgn(del[a]))
+                return;
+            if (sgn(del[a]) != sgn(del[b]) && abs(slope) > abs(3.0f * del[a]))
             {
-                for (int y = MinY; y <= MaxY; y++)
+                gradient[a] = 3.0f;
+                return;
+            }
+
+            gradient[a] = 1.5f;
+            gradient[b] = -0.5f;
+        }
+        else
+        {
+            // For secants of equal sign, the slope is 2 * d0 * d1 / (d0 + d1)
+            const int k = K - 1;
+            if (del[k] * del[k + 1] <= 0.0f)
+                return;
+
+            float sum = del[k] + del[k + 1];
+            float scale = 2.0f / (sum * sum);
+            gradient[k] = scale * del[k + 1] * del[k + 1];
+            gradient[k + 1] = scale * del[k] * del[k];
+        }
+    }
+
+    // Value of segment SEG at t, and its derivatives w.r.t. each of the N nodes
+    template<int N, int SEG> inline float CubicSegmentGradient(const float* nodes, float t, float* gradient)
+    {
+        if (N == 1)
+        {
+            gradient[0] = 1.0f;
+            return nodes[0];
+        }
+
+        float del[N > 1 ? N - 1 : 1];
+        for (int i = 0; i < N - 1; i++)
+            del[i] = nodes[i + 1] - nodes[i];
+
+        float dslope0[N > 1 ? N - 1 : 1], dslope1[N > 1 ? N - 1 : 1];
+        CubicSlopeGradient<N, SEG>(del, dslope0);
+        CubicSlopeGradient<N, SEG + 1>(del, dslope1);
+
+        // v = (s0 + s1 - 2d) t^3 + (3d - 2s0 - s1) t^2 + s0 t + node, with d being the segment's secant
+        float t2 = t * t, t3 = t2 * t;
+        float dvdd = 3.0f * t2 - 2.0f * t3;
+        float dvds0 = t3 - 2.0f * t2 + t;
+        float dvds1 = t3 - t2;
+
+        for (int i = 0; i < N; i++)
+            gradient[i] = i == SEG ? 1.0f : 0.0f;
+
+        for (int i = 0; i < N - 1; i++)
+        {
+            float dvddel = dvds0 * dslope0[i] + dvds1 * dslope1[i] + (i == SEG ? dvdd : 0.0f);
+            gradient[i] -= dvddel;
+            gradient[i + 1] += dvddel;
+        }
+
+        return CubicHorner(CubicCoefficients<N, SEG>(nodes), t);
+    }
+
+    inline int CubicWindowNodes(int window)
+    {
+        static const int NNodes[CubicWindowCount] = { 1, 2, 3, 3, 4 };
+        return NNodes[window];
+    }
+
+    inline float CubicWindowGradient(int window, const float* nodes, float t, float* gradient)
+    {
+        switch (window)
+        {
+        case CubicWindow1: return CubicSegmentGradient<1, 0>(nodes, t, gradient);
+        case CubicWindow2: return CubicSegmentGradient<2, 0>(nodes, t, gradient);
+        case CubicWindow3Start: return CubicSegmentGradient<3, 0>(nodes, t, gradient);
+        case CubicWindow3End: return CubicSegmentGradient<3, 1>(nodes, t, gradient);
+        default: return CubicSegmentGradient<4, 1>(nodes, t, gradient);
+        }
+    }
+
+    // Interpolates W samples in parallel, each with its own N nodes, nodes[i][lane]
+    template<int N, int SEG, int W> inline void CubicSegment(const float nodes[][W], const float* t, float* result)
+    {
+        for (int l = 0; l < W; l++)
+        {
+            float lanenodes[N];
+            for (int i = 0; i < N; i++)
+                lanenodes[i] = nodes[i][l];
+
+            result[l] = N == 1 ? lanenodes[0] : CubicHorner(CubicCoefficients<N, SEG>(lanenodes), t[l]);
+        }
+    }
+
+    struct CubicNode
+    {
+        float4 coefficients;
+        float start;
+    };
+
+    template<int W> struct CubicLanes
+    {
+        float x[W];
+        int indexx[W];
+
+        float ty[W], tz[W];
+        int firsty[W], firstz[W];
+        int windowy, windowz;
+    };
+
+    class CubicGridTable
+    {
+    public:
+        int3 Dims;
+        std::vector<CubicNode> Nodes;    // (dims.x + 1) entries per row, for node indices -1 ... dims.x - 1
+
+        CubicGridTable(int3 dims, const float* values) : Dims(dims), Nodes(Elements(dims) / dims.x * (dims.x + 1))
+        {
+            int nrows = dims.y * dims.z;
+
+            #pragma omp parallel for if (nrows * dims.x > 4096)
+            for (int r = 0; r < nrows; r++)
+            {
+                const float* row = values + (size_t)r * dims.x;
+                CubicNode* rownodes = Nodes.data() + (size_t)r * (dims.x + 1);
+
+                for (int i = -1; i < dims.x; i++)
                 {
-                    float2 Points[4];
-                    if (nx == 1)
-                        InterpX[(z - MinZ) * ny + y - MinY] = values[(z * dimensions.y + y) * 1];
-                    else
-                    {
-                        for (int x = MinX; x <= MaxX; x++)
-                            Points[x - MinX] = make_float2(x, values[(z * dimensions.y + y) * dimensions.x + x]);
+                    int first;
+                    float t;
+                    int window = GetCubicWindow((float)i, dims.x, first, t);
 
-                        InterpX[(z - MinZ) * ny + y - MinY] = CubicInterpShort(Points, coords.x, nx);
+                    CubicNode node;
+                    switch (window)
+                    {
+                    case CubicWindow1: node.coefficients = CubicCoefficients<1, 0>(row + first); node.start = (float)first; break;
+                    case CubicWindow2: node.coefficients = CubicCoefficients<2, 0>(row + first); node.start = (float)first; break;
+                    case CubicWindow3Start: node.coefficients = CubicCoefficients<3, 0>(row + first); node.start = (float)first; break;
+                    case CubicWindow3End: node.coefficients = CubicCoefficients<3, 1>(row + first); node.start = (float)(first + 1); break;
+                    default: node.coefficients = CubicCoefficients<4, 1>(row + first); node.start = (float)(first + 1); break;
                     }
+
+                    rownodes[i + 1] = node;
                 }
             }
+        }
+
+        template<int W> void SetLane(CubicLanes<W> &lanes, int l, float3 coords) const
+        {
+            lanes.x[l] = coords.x;
+            lanes.indexx[l] = tmin(tmax((int)floor(coords.x), -1), Dims.x - 1) + 1;
+
+            lanes.windowy = GetCubicWindow(coords.y, Dims.y, lanes.firsty[l], lanes.ty[l]);
+            lanes.windowz = GetCubicWindow(coords.z, Dims.z, lanes.firstz[l], lanes.tz[l]);
+        }
 
-            float InterpXY[4];
-            for (int z = MinZ; z <= MaxZ; z++)
+        template<int W, int NY, int SY, int NZ, int SZ> static void Evaluate(const CubicGridTable &grid, const CubicLanes<W> &lanes, float* result)
+        {
+            const CubicNode* nodes = grid.Nodes.data();
+            size_t rowlength = grid.Dims.x + 1;
+
+            float valuesxy[NZ][W];
+            for (int zj = 0; zj < NZ; zj++)
             {
-                float2 Points[4];
-                if (ny == 1)
-                    InterpXY[z - MinZ] = InterpX[(z - MinZ) * ny];
-                else
-                {
-                    for (int y = MinY; y <= MaxY; y++)
-                        Points[y - MinY] = make_float2(y, InterpX[(z - MinZ) * ny + y - MinY]);
+                float valuesx[NY][W];
+                for (int yj = 0; yj < NY; yj++)
+                    for (int l = 0; l < W; l++)
+                    {
+                        const CubicNode &node = nodes[((size_t)(lanes.firstz[l] + zj) * grid.Dims.y + lanes.firsty[l] + yj) * rowlength + lanes.indexx[l]];
+                        valuesx[yj][l] = CubicHorner(node.coefficients, lanes.x[l] - node.start);
+                    }
 
-                    InterpXY[z - MinZ] = CubicInterpShort(Points, coords.y, ny);
-                }
+                CubicSegment<NY, SY, W>(valuesx, lanes.ty, valuesxy[zj]);
             }
 
+            CubicSegment<NZ, SZ, W>(valuesxy, lanes.tz, result);
+        }
+
+        // All lanes must share the same Y and Z window shapes
+        template<int W> void Evaluate(const CubicLanes<W> &lanes, float* result) const
+        {
+            typedef void(*Kernel)(const CubicGridTable&, const CubicLanes<W>&, float*);
+
+#define CUBIC_KERNELS_Z(NY, SY) &Evaluate<W, NY, SY, 1, 0>, &Evaluate<W, NY, SY, 2, 0>, &Evaluate<W, NY, SY, 3, 0>, &Evaluate<W, NY, SY, 3, 1>, &Evaluate<W, NY, SY, 4, 1>
+            static const Kernel Kernels[CubicWindowCount * CubicWindowCount] =
             {
-                float2 Points[4];
-                if (nz == 1)
-                    result = InterpXY[0];
-                else
-                {
-                    for (int z = MinZ; z <= MaxZ; z++)
-                        Points[z - MinZ] = make_float2(z, InterpXY[z - MinZ]);
+                CUBIC_KERNELS_Z(1, 0),
+                CUBIC_KERNELS_Z(2, 0),
+                CUBIC_KERNELS_Z(3, 0),
+                CUBIC_KERNELS_Z(3, 1),
+                CUBIC_KERNELS_Z(4, 1)
+            };
+#undef CUBIC_KERNELS_Z
+
+            Kernels[lanes.windowy * CubicWindowCount + lanes.windowz](*this, lanes, result);
+        }
+    };
+}
 
-                    result = CubicInterpShort(Points, coords.z, nz);
-                }
-            }
+__declspec(dllexport) void __stdcall CubicInterpOnGrid(int3 dimensions, float* values, float3 spacing, int3 valueGrid, float3 step, float3 offset, float* output)
+{
+    const int W = CUBIC_LANES;
+
+    CubicGridTable grid(dimensions, values);
 
-            output[position] = result;
+    // Y and Z are constant along an output row, so every lane group spanning a part of a row has uniform windows
+    int groupsperrow = (valueGrid.x + W - 1) / W;
+    long long ngroups = (long long)valueGrid.y * valueGrid.z * groupsperrow;
+
+    #pragma omp parallel for if (ngroups > 1)
+    for (long long g = 0; g < ngroups; g++)
+    {
+        int row = (int)(g / groupsperrow);
+        int valueY = row % valueGrid.y;
+        int valueZ = row / valueGrid.y;
+        int firstX = (int)(g % groupsperrow) * W;
+        int nlanes = tmin(W, valueGrid.x - firstX);
+
+        CubicLanes<W> lanes;
+        for (int l = 0; l < W; l++)
+        {
+            int valueX = firstX + tmin(l, nlanes - 1);    // Pad the last group with copies of its last sample
+
+            float3 coords = make_float3(valueX * step.x + offset.x, valueY * step.y + offset.y, valueZ * step.z + offset.z);
+            coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);  // from [0, 1] to [0, dim - 1]
+
+            grid.SetLane(lanes, l, coords);
         }
+
+        float result[W];
+        grid.Evaluate(lanes, result);
+
+        float* rowoutput = output + ((size_t)valueZ * valueGrid.y + valueY) * valueGrid.x + firstX;
+        for (int l = 0; l < nlanes; l++)
+            rowoutput[l] = result[l];
     }
 }
 
-float CubicInterpShort(float2* data, float x, int n)
+__declspec(dllexport) void __stdcall CubicInterpIrregular(int3 dimensions, float* values, float3* positions, int npositions, float3 spacing, float* output)
 {
-	if (n == 4)
-		return CubicInterp<4>(data, x);
-	if (n == 3)
-		return CubicInterp<3>(data, x);
+    const int W = CUBIC_LANES;
+
+    CubicGridTable grid(dimensions, values);
 
-	return CubicInterp<2>(data, x);
+    int ngroups = (npositions + W - 1) / W;
+
+    #pragma omp parallel for if (ngroups > 1)
+    for (int g = 0; g < ngroups; g++)
+    {
+        int first = g * W;
+        int nlanes = tmin(W, npositions - first);
+
+        CubicLanes<W> lanes;
+        bool uniform = true;
+        int windowy = 0, windowz = 0;
+
+        for (int l = 0; l < W; l++)
+        {
+            float3 coords = positions[first + tmin(l, nlanes - 1)];
+            coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);  // from [0, 1] to [0, dim - 1]
+
+            grid.SetLane(lanes, l, coords);
+
+            if (l == 0)
+            {
+                windowy = lanes.windowy;
+                windowz = lanes.windowz;
+            }
+            uniform = uniform && lanes.windowy == windowy && lanes.windowz == windowz;
+        }
+
+        if (uniform)
+        {
+            float result[W];
+            grid.Evaluate(lanes, result);
+
+            for (int l = 0; l < nlanes; l++)
+                output[first + l] = result[l];
+        }
+        else
+        {
+            // Positions close to the grid's border mix window shapes, evaluate them one by one
+            for (int l = 0; l < nlanes; l++)
+            {
+                float3 coords = positions[first + l];
+                coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);
+
+                CubicLanes<1> lane;
+                grid.SetLane(lane, 0, coords);
+                grid.Evaluate(lane, output + first + l);
+            }
+        }
+    }
 }
 
-template<int N> float CubicInterp(float2* data, float x)
+/*
+
+Same as CubicInterpIrregular, but also returns the derivative of each interpolated value w.r.t. the grid's nodes,
+i.e. the Jacobian of the interpolation at the current node values. Each position depends on at most 4x4x4 nodes.
+The Jacobian is stored as CSR: row p spans h_rowoffsets[p] ... h_rowoffsets[p + 1] in h_columns (flat node index)
+and h_weights. h_columns and h_weights must hold npositions * 64 entries; the number actually used is returned.
+
+The monotone spline isn't linear in the node values, so unlike CubicGrid.GetWiggleWeights, the weights are only
+valid around the values they were computed for.
+
+*/
+
+__declspec(dllexport) int __stdcall CubicInterpIrregularWithWeights(int3 dimensions, float* values, float3* positions, int npositions, float3 spacing, float* output, int* h_rowoffsets, int* h_columns, float* h_weights)
 {
-	float2* Data;
-	float Breaks[N];
-	float4 Coefficients[N - 1];
-	
-	Data = data;
-	for (int i = 0; i < N; i++)
-		Breaks[i] = data[i].x;
-
-	float h[N - 1];
-	for (int i = 0; i < N - 1; i++)
-		h[i] = data[i + 1].x - data[i].x;
-
-	float del[N - 1];
-	for (int i = 0; i < N - 1; i++)
-		del[i] = (data[i + 1].y - data[i].y) / h[i];
-
-	float slopes[N] = { 0 };
-	{
-		if (N == 2)
-			slopes[0] = slopes[1] = del[0];   // Do only linear
-		else
-		{
-			for (int k = 0; k < N - 2; k++)
-			{
-				if (del[k] * del[k + 1] <= 0.0f)
-					continue;
-
-				float hs = h[k] + h[k + 1];
-				float w1 = (h[k] + hs) / (3.0f * hs);
-				float w2 = (hs + h[k + 1]) / (3.0f * hs);
-				float dmax = tmax(abs(del[k]), abs(del[k + 1]));
-				float dmin = tmin(abs(del[k]), abs(del[k + 1]));
-				slopes[k + 1] = dmin / (w1 * (del[k] / dmax) + w2 * (del[k + 1] / dmax));
-			}
-
-			slopes[0] = ((2.0f * h[0] + h[1]) * del[0] - h[0] * del[1]) / (h[0] + h[1]);
-			if (sgn(slopes[0]) != sgn(del[0]))
-				slopes[0] = 0;
-			else if (sgn(del[0]) != sgn(del[1]) && abs(slopes[0]) > abs(3.0f * del[0]))
-				slopes[0] = 3.0f * del[0];
-
-			int n = N - 1;
-			slopes[n] = ((2 * h[n - 1] + h[n - 2]) * del[n - 1] - h[n - 1] * del[n - 2]) / (h[n - 1] + h[n - 2]);
-			if (sgn(slopes[n]) != sgn(del[n - 1]))
-				slopes[n] = 0;
-			else if (sgn(del[n - 1]) != sgn(del[n - 2]) && abs(slopes[n]) > abs(3.0f * del[n - 1]))
-				slopes[n] = 3.0f * del[n - 1];
-		}
-	}
-
-	float dzzdx[N - 1];
-	for (int i = 0; i < N - 1; i++)
-		dzzdx[i] = (del[i] - slopes[i]) / h[i];
-
-	float dzdxdx[N - 1];
-	for (int i = 0; i < N - 1; i++)
-		dzdxdx[i] = (slopes[i + 1] - del[i]) / h[i];
-
-	for (int i = 0; i < N - 1; i++)
-		Coefficients[i] = make_float4((dzdxdx[i] - dzzdx[i]) / h[i],
-									  2.0f * dzzdx[i] - dzdxdx[i],
-									  slopes[i],
-									  data[i].y);
-
-	// Now interpolate
-	float* b = Breaks;
-	float4* c = Coefficients;
-
-	int index = 0;
-
-	if (x < b[1])
-		index = 0;
-	else if (x >= b[N - 2])
-		index = N - 2;
-	else
-		for (int j = 2; j < N - 1; j++)
-			if (x < b[j])
-			{
-				index = j - 1;
-				break;
-			}
-
-	float xs = x - b[index];
-
-	float v = c[index].x;
-	v = xs * v + c[index].y;
-	v = xs * v + c[index].z;
-	v = xs * v + c[index].w;
-
-	float y = v;
-
-	return y;
-}
\ No newline at end of file
+    // The number of nodes per position only depends on the window shapes, so CSR offsets can be laid out up front
+    h_rowoffsets[0] = 0;
+    for (int p = 0; p < npositions; p++)
+    {
+        float3 coords = positions[p];
+        coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);  // from [0, 1] to [0, dim - 1]
+
+        int first;
+        float t;
+        int nnodes = CubicWindowNodes(GetCubicWindow(coords.x, dimensions.x, first, t)) *
+                     CubicWindowNodes(GetCubicWindow(coords.y, dimensions.y, first, t)) *
+                     CubicWindowNodes(GetCubicWindow(coords.z, dimensions.z, first, t));
+
+        h_rowoffsets[p + 1] = h_rowoffsets[p] + nnodes;
+    }
+
+    #pragma omp parallel for if (npositions > 64)
+    for (int p = 0; p < npositions; p++)
+    {
+        float3 coords = positions[p];
+        coords = make_float3(coords.x / spacing.x, coords.y / spacing.y, coords.z / spacing.z);
+
+        int firstx, firsty, firstz;
+        float tx, ty, tz;
+        int windowx = GetCubicWindow(coords.x, dimensions.x, firstx, tx);
+        int windowy = GetCubicWindow(coords.y, dimensions.y, firsty, ty);
+        int windowz = GetCubicWindow(coords.z, dimensions.z, firstz, tz);
+        int nx = CubicWindowNodes(windowx), ny = CubicWindowNodes(windowy), nz = CubicWindowNodes(windowz);
+
+        float gradx[4][4][4], grady[4][4], gradz[4];
+        float valuesxy[4];
+
+        for (int zj = 0; zj < nz; zj++)
+        {
+            float valuesx[4];
+            for (int yj = 0; yj < ny; yj++)
+            {
+                const float* row = values + ((size_t)(firstz + zj) * dimensions.y + firsty + yj) * dimensions.x + firstx;
+                valuesx[yj] = CubicWindowGradient(windowx, row, tx, gradx[zj][yj]);
+            }
+
+            valuesxy[zj] = CubicWindowGradient(windowy, valuesx, ty, grady[zj]);
+        }
+
+        output[p] = CubicWindowGradient(windowz, valuesxy, tz, gradz);
+
+        // Chain rule across the three axes
+        int* columns = h_columns + h_rowoffsets[p];
+        float* weights = h_weights + h_rowoffsets[p];
+
+        for (int zj = 0; zj < nz; zj++)
+            for (int yj = 0; yj < ny; yj++)
+            {
+                float weightyz = gradz[zj] * grady[zj][yj];
+                int rowstart = ((firstz + zj) * dimensions.y + firsty + yj) * dimensions.x + firstx;
+
+                for (int xj = 0; xj < nx; xj++)
+                {
+                    *columns++ = rowstart + xj;
+                    *weights++ = weightyz * gradx[zj][yj][xj];
+                }
+            }
+    }
+
+    return h_rowoffsets[npositions];
+}
@@ -0,0 +1,399 @@
+#include "Functions.h"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <fftw3.h>
+using namespace gtom;
+
+/*
+
+Plans for every transform in the library come from here instead of being created and destroyed around
+each call. They are keyed by type, rank, dimensions, batch, precision and backend (the CUDA device, or
+the number of FFTW threads), and kept after release. Whenever the estimated memory of all cached plans
+exceeds the budget, idle plans are destroyed, least recently used first; plans in use are never evicted.
+
+The CUDA backend also gets FFTW plans for host transforms, by combining the type with FFTPLAN_HOST.
+FFTW plans are executed through the new-array interface, which is thread-safe, so one plan serves any
+number of threads at once. A cuFFT plan owns its work area and can only run one transform at a time,
+so concurrent requests for the same key get separate plans.
+
+Creation happens outside the cache lock. Two threads missing on the same key at the same time will
+both create a plan, and both plans stay in the cache.
+
+*/
+
+namespace
+{
+    const int PlanPrecisionSingle = 0;    // The only one anything in Warp asks for
+
+    struct PlanKey
+    {
+        int type;
+        int ndims;
+        int3 dims;
+        int batch;
+        int precision;
+        int backend;
+
+        bool operator==(const PlanKey &other) const
+        {
+            return type == other.type && ndims == other.ndims &&
+                   dims.x == other.dims.x && dims.y == other.dims.y && dims.z == other.dims.z &&
+                   batch == other.batch && precision == other.precision && backend == other.backend;
+        }
+    };
+
+    struct PlanEntry
+    {
+        PlanKey key;
+        size_t plan;
+        size_t bytes;
+        int inuse;
+        long long lastuse;
+    };
+
+    size_t ElementsComplex(int ndims, int3 dims)
+    {
+        return (size_t)(dims.x / 2 + 1) * (ndims > 1 ? dims.y : 1) * (ndims > 2 ? dims.z : 1);
+    }
+
+    bool IsHostPlan(int type)
+    {
+#ifdef WARP_CPU_BACKEND
+        return true;
+#else
+        return (type & FFTPLAN_HOST) != 0 || type == FFTPLAN_C2C_FORWARD || type == FFTPLAN_C2C_BACKWARD;
+#endif
+    }
+
+    std::mutex PlannerMutex;    // Everything in FFTW except fftwf_execute_* must be serialized
+    bool ThreadsInitialized = false;
+
+    size_t CreateHostPlan(const PlanKey &k, size_t &bytes)
+    {
+        int type = k.type & ~FFTPLAN_HOST;
+        size_t elementsreal = (size_t)k.dims.x * (k.ndims > 1 ? k.dims.y : 1) * (k.ndims > 2 ? k.dims.z : 1);
+        size_t elementscomplex = type == FFTPLAN_R2C || type == FFTPLAN_C2R ? ElementsComplex(k.ndims, k.dims) : (size_t)k.dims.x * k.batch;
+
+        int n[3];
+        if (k.ndims == 1)
+            n[0] = k.dims.x;
+        else if (k.ndims == 2)
+        {
+            n[0] = k.dims.y;
+            n[1] = k.dims.x;
+        }
+        else
+        {
+            n[0] = k.dims.z;
+            n[1] = k.dims.y;
+            n[2] = k.dims.x;
+        }
+
+        // Plans are made once for arbitrary arrays, FFTW_ESTIMATE doesn't touch these
+        float* h_real = (float*)fftwf_malloc(elementsreal * sizeof(float));
+        float2* h_complex = (float2*)fftwf_malloc(elementscomplex * sizeof(float2));
+
+        fftwf_plan plan;
+        {
+            std::lock_guard<std::mutex> lock(PlannerMutex);
+
+            if (!ThreadsInitialized)
+            {
+                fftwf_init_threads();
+                ThreadsInitialized = true;
+            }
+            fftwf_plan_with_nthreads(k.backend);
+
+            if (type == FFTPLAN_R2C)
+                plan = fftwf_plan_dft_r2c(k.ndims, n, h_real, (fftwf_complex*)h_complex, FFTW_ESTIMATE | FFTW_UNALIGNED);
+            else if (type == FFTPLAN_C2R)
+                plan = fftwf_plan_dft_c2r(k.ndims, n, (fftwf_complex*)h_complex, h_real, FFTW_ESTIMATE | FFTW_UNALIGNED | FFTW_DESTROY_INPUT);
+            else    // In place, batch contiguous lines
+                plan = fftwf_plan_many_dft(1, n, k.batch,
+                                           (fftwf_complex*)h_complex, NULL, 1, k.dims.x,
+                                           (fftwf_complex*)h_complex, NULL, 1, k.dims.x,
+                                           type == FFTPLAN_C2C_FORWARD ? FFTW_FORWARD : FFTW_BACKWARD, FFTW_ESTIMATE | FFTW_UNALIGNED);
+        }
+
+        fftwf_free(h_complex);
+        fftwf_free(h_real);
+
+        // FFTW doesn't say, twiddles and buffers are on the order of one transform
+        bytes = ElementsComplex(k.ndims, k.dims) * sizeof(float2);
+
+        return (size_t)plan;
+    }
+
+    void DestroyHostPlan(size_t plan)
+    {
+        std::lock_guard<std::mutex> lock(PlannerMutex);
+        fftwf_destroy_plan((fftwf_plan)plan);
+    }
+
+#ifndef WARP_CPU_BACKEND
+
+    size_t CreateDevicePlan(const PlanKey &key, size_t &bytes)
+    {
+        cufftHandle plan = key.type == FFTPLAN_R2C ? d_FFTR2CGetPlan(key.ndims, key.dims, key.batch) :
+                                                     d_IFFTC2RGetPlan(key.ndims, key.dims, key.batch);
+
+        bytes = 0;
+        cufftGetSize(plan, &bytes);
+
+        return (size_t)plan;
+    }
+
+    void DestroyDevicePlan(size_t plan, int device)
+    {
+        int currentdevice = 0;
+        cudaGetDevice(&currentdevice);
+        if (device != currentdevice)
+            cudaSetDevice(device);
+
+        cufftDestroy((cufftHandle)plan);
+
+        if (device != currentdevice)
+            cudaSetDevice(currentdevice);
+    }
+
+#endif
+
+    size_t CreateBackendPlan(const PlanKey &key, size_t &bytes)
+    {
+#ifndef WARP_CPU_BACKEND
+        if (!IsHostPlan(key.type))
+            return CreateDevicePlan(key, bytes);
+#endif
+        return CreateHostPlan(key, bytes);
+    }
+
+    void DestroyBackendPlan(size_t plan, bool host, int backend)
+    {
+#ifndef WARP_CPU_BACKEND
+        if (!host)
+        {
+            DestroyDevicePlan(plan, backend);
+            return;
+        }
+#endif
+        DestroyHostPlan(plan);
+    }
+
+    // FFTW thread count for host plans, CUDA device for the others
+    int PlanBackend(int type, int nthreads)
+    {
+        if (IsHostPlan(type))
+            return nthreads;
+
+        int device = 0;
+#ifndef WARP_CPU_BACKEND
+        cudaGetDevice(&device);
+#endif
+        return device;
+    }
+
+    // FFTW plans can run any number of transforms at once, a cuFFT plan only one
+    bool SharedPlan(int type)
+    {
+        return IsHostPlan(type);
+    }
+
+    class PlanCache
+    {
+    public:
+        std::mutex Mutex;
+        std::vector<PlanEntry> Entries;
+
+        std::atomic<long long> Budget;
+        long long BytesCached;
+        long long Tick;
+
+        long long NRequests, NHits, NCreated, NEvicted;
+        double CreationSeconds, MaxCreationSeconds;
+
+        PlanCache() : Budget(512LL << 20), BytesCached(0), Tick(0),
+                      NRequests(0), NHits(0), NCreated(0), NEvicted(0),
+                      CreationSeconds(0), MaxCreationSeconds(0) {}
+
+        // Destroys idle plans, least recently used first, until the cache fits into the limit
+        void Evict(long long limit)
+        {
+            std::vector<PlanEntry> evicted;
+            {
+                std::lock_guard<std::mutex> lock(Mutex);
+
+                while (BytesCached > limit)
+                {
+                    int oldest = -1;
+                    for (int i = 0; i < (int)Entries.size(); i++)
+                        if (Entries[i].inuse == 0 && (oldest < 0 || Entries[i].lastuse < Entries[oldest].lastuse))
+                            oldest = i;
+
+                    if (oldest < 0)
+                        break;
+
+                    BytesCached -= Entries[oldest].bytes;
+                    evicted.push_back(Entries[oldest]);
+                    Entries.erase(Entries.begin() + oldest);
+                }
+
+                NEvicted += evicted.size();
+            }
+
+            for (PlanEntry &entry : evicted)
+                DestroyBackendPlan(entry.plan, IsHostPlan(entry.key.type), entry.key.backend);
+        }
+    };
+
+    PlanCache &Cache()
+    {
+        static PlanCache* cache = new PlanCache();    // Never destroyed, plans may be released during static destruction
+        return *cache;
+    }
+}
+
+size_t AcquireFFTPlan(int type, int ndims, int3 dims, int batch, int nthreads)
+{
+    PlanCache &cache = Cache();
+
+    PlanKey key;
+    key.type = type;
+    key.ndims = ndims;
+    key.dims = make_int3(dims.x, ndims > 1 ? dims.y : 1, ndims > 2 ? dims.z : 1);
+    key.batch = batch;
+    key.precision = PlanPrecisionSingle;
+    key.backend = PlanBackend(type, nthreads);
+
+    {
+        std::lock_guard<std::mutex> lock(cache.Mutex);
+        cache.NRequests++;
+
+        for (PlanEntry &entry : cache.Entries)
+            if (entry.key == key && (SharedPlan(type) || entry.inuse == 0))
+            {
+                entry.inuse++;
+                entry.lastuse = ++cache.Tick;
+                cache.NHits++;
+
+                return entry.plan;
+            }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    PlanEntry entry;
+    entry.key = key;
+    entry.plan = CreateBackendPlan(key, entry.bytes);
+    entry.inuse = 1;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> lock(cache.Mutex);
+
+        entry.lastuse = ++cache.Tick;
+        cache.Entries.push_back(entry);
+        cache.BytesCached += entry.bytes;
+
+        cache.NCreated++;
+        cache.CreationSeconds += seconds;
+        cache.MaxCreationSeconds = tmax(cache.MaxCreationSeconds, seconds);
+    }
+
+    cache.Evict(cache.Budget.load());
+
+    return entry.plan;
+}
+
+void ReleaseFFTPlan(size_t plan)
+{
+    PlanCache &cache = Cache();
+    bool found = false;
+
+    {
+        std::lock_guard<std::mutex> lock(cache.Mutex);
+
+        for (PlanEntry &entry : cache.Entries)
+            if (entry.plan == plan && entry.inuse > 0)
+            {
+                entry.inuse--;
+                found = true;
+                break;
+            }
+    }
+
+    // Not one of ours, e.g. made by GTOM, nothing else will destroy it
+    if (!found)
+        DestroyBackendPlan(plan, IsHostPlan(FFTPLAN_R2C), PlanBackend(FFTPLAN_R2C, 1));
+    else
+        cache.Evict(cache.Budget.load());
+}
+
+#ifndef WARP_CPU_BACKEND
+
+void d_FFTR2CCached(float* d_input, float2* d_output, int ndims, int3 dims, int batch)
+{
+    cufftHandle plan = (cufftHandle)AcquireFFTPlan(FFTPLAN_R2C, ndims, dims, batch);
+    cufftExecR2C(plan, d_input, d_output);
+    ReleaseFFTPlan((size_t)plan);
+}
+
+void d_IFFTC2RCached(float2* d_input, float* d_output, int ndims, int3 dims, int batch)
+{
+    cufftHandle plan = (cufftHandle)AcquireFFTPlan(FFTPLAN_C2R, ndims, dims, batch);
+    cufftExecC2R(plan, d_input, d_output);
+    ReleaseFFTPlan((size_t)plan);
+
+    size_t elements = (size_t)dims.x * (ndims > 1 ? dims.y : 1) * (ndims > 2 ? dims.z : 1);
+    d_MultiplyByScalar(d_output, d_output, elements * batch, 1.0f / (float)elements);
+}
+
+#endif
+
+__declspec(dllexport) void __stdcall FFTPlanCacheSetBudget(long long bytes)
+{
+    PlanCache &cache = Cache();
+    cache.Budget = tmax(0LL, bytes);
+    cache.Evict(cache.Budget.load());
+}
+
+// Destroys all idle plans; plans in use are unaffected
+__declspec(dllexport) void __stdcall FFTPlanCacheTrim()
+{
+    Cache().Evict(0);
+}
+
+__declspec(dllexport) void __stdcall FFTPlanCacheGetStats(FFTPlanCacheStats* h_stats)
+{
+    PlanCache &cache = Cache();
+    std::lock_guard<std::mutex> lock(cache.Mutex);
+
+    h_stats->nrequests = cache.NRequests;
+    h_stats->nhits = cache.NHits;
+    h_stats->ncreated = cache.NCreated;
+    h_stats->nevicted = cache.NEvicted;
+    h_stats->nplans = (long long)cache.Entries.size();
+    h_stats->nplansinuse = 0;
+    for (PlanEntry &entry : cache.Entries)
+        h_stats->nplansinuse += entry.inuse > 0;
+    h_stats->bytescached = cache.BytesCached;
+    h_stats->budget = cache.Budget.load();
+    h_stats->creationseconds = cache.CreationSeconds;
+    h_stats->maxcreationseconds = cache.MaxCreationSeconds;
+}
+
+// Resets counters and timings, cached plans stay
+__declspec(dllexport) void __stdcall FFTPlanCacheResetStats()
+{
+    PlanCache &cache = Cache();
+    std::lock_guard<std::mutex> lock(cache.Mutex);
+
+    cache.NRequests = 0;
+    cache.NHits = 0;
+    cache.NCreated = 0;
+    cache.NEvicted = 0;
+    cache.CreationSeconds = 0;
+    cache.MaxCreationSeconds = 0;
+}
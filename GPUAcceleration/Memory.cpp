@@ -3,21 +3,21 @@
 __declspec(dllexport) float* __stdcall MallocDevice(long elements)
 {
 	float* d_memory;
-	cudaMalloc((void**)&d_memory, elements * sizeof(float));
+	PoolMalloc((void**)&d_memory, elements * sizeof(float));
 
 	return d_memory;
 }
 
 __declspec(dllexport) float* __stdcall MallocDeviceFromHost(float* h_data, long elements)
 {
-	float* d_memory = (float*)gtom::CudaMallocFromHostArray(h_data, elements * sizeof(float));
+	float* d_memory = (float*)PoolMallocFromHostArray(h_data, elements * sizeof(float));
 	return d_memory;
 }
 
 __declspec(dllexport) void* __stdcall MallocDeviceHalf(long elements)
 {
 	half* d_memory;
-	cudaMalloc((void**)&d_memory, elements * sizeof(half));
+	PoolMalloc((void**)&d_memory, elements * sizeof(half));
 
 	return d_memory;
 }
@@ -25,7 +25,7 @@ __declspec(dllexport) void* __stdcall MallocDeviceHalf(long elements)
 __declspec(dllexport) void* __stdcall MallocDeviceHalfFromHost(float* h_data, long elements)
 {
 	half* d_memory;
-	cudaMalloc((void**)&d_memory, elements * sizeof(half));
+	PoolMalloc((void**)&d_memory, elements * sizeof(half));
 
 	CopyHostToDeviceHalf(h_data, d_memory, elements);
 
@@ -34,7 +34,7 @@ __declspec(dllexport) void* __stdcall MallocDeviceHalfFromHost(float* h_data, lo
 
 __declspec(dllexport) void __stdcall FreeDevice(void* d_data)
 {
-	cudaFree(d_data);
+	PoolFree(d_data);
 }
 
 __declspec(dllexport) void __stdcall CopyDeviceToHost(float* d_source, float* h_dest, long elements)
@@ -70,11 +70,11 @@ __declspec(dllexport) void __stdcall CopyHostToDevice(float* h_source, float* d_
 
 __declspec(dllexport) void __stdcall CopyHostToDeviceHalf(float* h_source, half* d_dest, long elements)
 {
-	float* d_source = (float*)gtom::CudaMallocFromHostArray(h_source, elements * sizeof(float));
+	float* d_source = (float*)PoolMallocFromHostArray(h_source, elements * sizeof(float));
 
 	gtom::d_ConvertTFloatTo(d_source, d_dest, elements);
 
-	cudaFree(d_source);
+	PoolFree(d_source);
 }
 
 __declspec(dllexport) void __stdcall SingleToHalf(float* d_source, half* d_dest, long elements)
@@ -0,0 +1,492 @@
+#include "Functions.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+using namespace gtom;
+
+/*
+
+Size-class pool behind MallocDevice/FreeDevice and all temporaries allocated by the exports.
+
+Requests are rounded up to one of 8 classes per power of two (<= 12.5 % internal waste), and freed
+blocks are kept for reuse instead of being returned to cudaFree (GPU) or the aligned heap (CPU).
+Each thread keeps a few recently freed blocks in a cache that needs no locking; everything else goes
+through per-device free lists.
+
+Outside of a scope, the pool keeps at most RetainLimit bytes of freed blocks and returns the rest to
+the system right away. Inside a scope (MemoryPoolBeginScope/EndScope, nestable), nothing is returned,
+so an optimization loop ends up reusing the same scratch over and over. Leaving the outermost scope
+trims the cache back to the limit; MemoryPoolTrim releases all of it.
+
+Pointers the pool doesn't know about (e.g. from GTOM's CudaMallocFromHostArray) are passed through
+to the system on free.
+
+*/
+
+namespace
+{
+    const int PoolMaxDevices = 16;
+    const int PoolClassesPerOctave = 8;
+    const int PoolMinOctave = 8;    // 256 bytes
+    const int PoolNClasses = (64 - PoolMinOctave) * PoolClassesPerOctave + 1;
+    const int PoolThreadCacheSlots = 32;
+    const size_t PoolThreadCacheMaxBlock = (size_t)4 << 20;
+    const int PoolNShards = 64;
+
+    int PoolSizeClass(size_t bytes, size_t &classbytes)
+    {
+        if (bytes <= ((size_t)1 << PoolMinOctave))
+        {
+            classbytes = (size_t)1 << PoolMinOctave;
+            return 0;
+        }
+
+        int octave = 0;
+        for (size_t v = bytes - 1; v > 1; v >>= 1)
+            octave++;
+
+        size_t base = (size_t)1 << octave;
+        size_t step = base / PoolClassesPerOctave;
+        size_t sub = (bytes - base + step - 1) / step;
+
+        classbytes = base + sub * step;
+        return (octave - PoolMinOctave) * PoolClassesPerOctave + (int)sub;
+    }
+
+    size_t PoolClassBytes(int sizeclass)
+    {
+        if (sizeclass == 0)
+            return (size_t)1 << PoolMinOctave;
+
+        size_t base = (size_t)1 << (PoolMinOctave + (sizeclass - 1) / PoolClassesPerOctave);
+        return base + ((sizeclass - 1) % PoolClassesPerOctave + 1) * (base / PoolClassesPerOctave);
+    }
+
+    // On the CPU backend, the NUMA node the calling thread is bound to
+    int PoolCurrentDevice()
+    {
+#ifdef WARP_CPU_BACKEND
+        return GetDevice();
+#else
+        int device = 0;
+        cudaGetDevice(&device);
+        return device;
+#endif
+    }
+
+    void* SystemMalloc(size_t bytes)
+    {
+        void* d_memory = NULL;
+#ifdef WARP_CPU_BACKEND
+    #ifdef _MSC_VER
+        d_memory = _aligned_malloc(bytes, CPU_ALIGNMENT);
+    #else
+        if (posix_memalign(&d_memory, CPU_ALIGNMENT, bytes) != 0)
+            d_memory = NULL;
+    #endif
+#else
+        if (cudaMalloc(&d_memory, bytes) != cudaSuccess)
+        {
+            cudaGetLastError();    // Clear the error, the caller will retry after trimming
+            d_memory = NULL;
+        }
+#endif
+        return d_memory;
+    }
+
+    void SystemFree(void* d_memory, int device)
+    {
+#ifdef WARP_CPU_BACKEND
+    #ifdef _MSC_VER
+        _aligned_free(d_memory);
+    #else
+        free(d_memory);
+    #endif
+#else
+        int currentdevice = PoolCurrentDevice();
+        if (device >= 0 && device != currentdevice)
+            cudaSetDevice(device);
+
+        cudaFree(d_memory);
+
+        if (device >= 0 && device != currentdevice)
+            cudaSetDevice(currentdevice);
+#endif
+    }
+
+    struct PoolBlock
+    {
+        int device;
+        int sizeclass;
+        size_t classbytes;
+        size_t requested;
+    };
+
+    struct PoolShard
+    {
+        std::mutex mutex;
+        std::unordered_map<void*, PoolBlock> live;
+    };
+
+    void AtomicMax(std::atomic<long long> &target, long long value)
+    {
+        long long current = target.load();
+        while (value > current && !target.compare_exchange_weak(current, value));
+    }
+
+    class MemoryPool
+    {
+    public:
+        std::mutex Mutex;
+        std::vector<void*> Free[PoolMaxDevices][PoolNClasses];
+        PoolShard Shards[PoolNShards];
+
+        std::atomic<int> ScopeDepth;
+        std::atomic<long long> RetainLimit;
+        std::atomic<long long> Generation;    // Incremented by every trim, tells thread caches to empty themselves
+
+        std::atomic<long long> BytesRequested, BytesInUse, BytesCached, BytesReserved;
+        std::atomic<long long> PeakInUse, PeakReserved;
+        std::atomic<long long> NAllocations, NCacheHits, NSystemAllocations, NSystemFrees;
+
+        MemoryPool() : ScopeDepth(0), RetainLimit(512LL << 20), Generation(0),
+                       BytesRequested(0), BytesInUse(0), BytesCached(0), BytesReserved(0),
+                       PeakInUse(0), PeakReserved(0),
+                       NAllocations(0), NCacheHits(0), NSystemAllocations(0), NSystemFrees(0) {}
+
+        PoolShard &ShardOf(void* d_memory)
+        {
+            size_t h = (size_t)d_memory;
+            h ^= h >> 17;
+            h *= 0x9E3779B97F4A7C15ULL;
+            return Shards[(h >> 32) % PoolNShards];
+        }
+
+        void* Allocate(size_t bytes);
+        void Release(void* d_memory);
+
+        // Takes a cached block from the shared lists, or NULL if there is none
+        void* TakeShared(int device, int sizeclass)
+        {
+            std::lock_guard<std::mutex> lock(Mutex);
+            std::vector<void*> &list = Free[device][sizeclass];
+            if (list.empty())
+                return NULL;
+
+            void* d_memory = list.back();
+            list.pop_back();
+            return d_memory;
+        }
+
+        // Caches a freed block in the shared lists, or returns it to the system if that would exceed the limit
+        void PutShared(void* d_memory, int device, int sizeclass, size_t classbytes)
+        {
+            if (ScopeDepth.load() == 0 && BytesCached.load() + (long long)classbytes > RetainLimit.load())
+            {
+                ReleaseToSystem(d_memory, device, classbytes);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(Mutex);
+            Free[device][sizeclass].push_back(d_memory);
+            BytesCached += classbytes;
+        }
+
+        void ReleaseToSystem(void* d_memory, int device, size_t classbytes)
+        {
+            SystemFree(d_memory, device);
+            BytesReserved -= classbytes;
+            NSystemFrees++;
+        }
+
+        // Returns shared cached blocks to the system, largest first, until at most 'keep' bytes remain;
+        // trimming to 0 also makes every thread empty its cache on its next pool access
+        void Trim(long long keep)
+        {
+            if (keep == 0)
+                Generation++;
+
+            std::lock_guard<std::mutex> lock(Mutex);
+            for (int c = PoolNClasses - 1; c >= 0 && BytesCached.load() > keep; c--)
+            {
+                size_t classbytes = PoolClassBytes(c);
+
+                for (int d = 0; d < PoolMaxDevices; d++)
+                    while (!Free[d][c].empty() && BytesCached.load() > keep)
+                    {
+                        ReleaseToSystem(Free[d][c].back(), d, classbytes);
+                        BytesCached -= classbytes;
+                        Free[d][c].pop_back();
+                    }
+            }
+        }
+    };
+
+    // Never destroyed: thread caches may still flush into it while the process shuts down
+    MemoryPool &Pool()
+    {
+        static MemoryPool* pool = new MemoryPool();
+        return *pool;
+    }
+
+    struct ThreadCacheSlot
+    {
+        void* d_memory;
+        int device;
+        int sizeclass;
+        size_t classbytes;
+    };
+
+    // A handful of recently freed blocks, reused by the same thread without taking any lock
+    struct ThreadCache
+    {
+        ThreadCacheSlot Slots[PoolThreadCacheSlots];
+        int NSlots;
+        long long Generation;
+
+        ThreadCache() : NSlots(0), Generation(0) {}
+        ~ThreadCache() { Flush(false); }
+
+        void Flush(bool tosystem)
+        {
+            MemoryPool &pool = Pool();
+            for (int i = 0; i < NSlots; i++)
+            {
+                pool.BytesCached -= Slots[i].classbytes;
+                if (tosystem)
+                    pool.ReleaseToSystem(Slots[i].d_memory, Slots[i].device, Slots[i].classbytes);
+                else
+                    pool.PutShared(Slots[i].d_memory, Slots[i].device, Slots[i].sizeclass, Slots[i].classbytes);
+            }
+            NSlots = 0;
+        }
+
+        // Blocks cached before the last trim go back to the system
+        void CheckGeneration()
+        {
+            long long generation = Pool().Generation.load();
+            if (generation != Generation)
+            {
+                Flush(true);
+                Generation = generation;
+            }
+        }
+
+        void* Take(int device, int sizeclass)
+        {
+            CheckGeneration();
+
+            for (int i = NSlots - 1; i >= 0; i--)
+                if (Slots[i].device == device && Slots[i].sizeclass == sizeclass)
+                {
+                    void* d_memory = Slots[i].d_memory;
+                    Pool().BytesCached -= Slots[i].classbytes;
+                    for (int j = i; j < NSlots - 1; j++)
+                        Slots[j] = Slots[j + 1];
+                    NSlots--;
+
+                    return d_memory;
+                }
+
+            return NULL;
+        }
+
+        void Put(void* d_memory, int device, int sizeclass, size_t classbytes)
+        {
+            CheckGeneration();
+
+            MemoryPool &pool = Pool();
+            if (classbytes > PoolThreadCacheMaxBlock)
+            {
+                pool.PutShared(d_memory, device, sizeclass, classbytes);
+                return;
+            }
+
+            // Oldest entry makes room
+            if (NSlots == PoolThreadCacheSlots)
+            {
+                pool.BytesCached -= Slots[0].classbytes;
+                pool.PutShared(Slots[0].d_memory, Slots[0].device, Slots[0].sizeclass, Slots[0].classbytes);
+                for (int j = 0; j < NSlots - 1; j++)
+                    Slots[j] = Slots[j + 1];
+                NSlots--;
+            }
+
+            Slots[NSlots].d_memory = d_memory;
+            Slots[NSlots].device = device;
+            Slots[NSlots].sizeclass = sizeclass;
+            Slots[NSlots].classbytes = classbytes;
+            NSlots++;
+
+            pool.BytesCached += classbytes;
+        }
+    };
+
+    ThreadCache &LocalCache()
+    {
+        static thread_local ThreadCache cache;
+        return cache;
+    }
+
+    void* MemoryPool::Allocate(size_t bytes)
+    {
+        size_t classbytes;
+        int sizeclass = PoolSizeClass(bytes, classbytes);
+        int device = tmin(PoolMaxDevices - 1, tmax(0, PoolCurrentDevice()));
+
+        void* d_memory = LocalCache().Take(device, sizeclass);
+        if (!d_memory)
+        {
+            d_memory = TakeShared(device, sizeclass);
+            if (d_memory)
+                BytesCached -= classbytes;
+        }
+
+        if (d_memory)
+            NCacheHits++;
+        else
+        {
+            d_memory = SystemMalloc(classbytes);
+            if (!d_memory)
+            {
+                // Out of memory: give back everything cached and try again
+                LocalCache().Flush(true);
+                Trim(0);
+                d_memory = SystemMalloc(classbytes);
+                if (!d_memory)
+                    return NULL;
+            }
+
+            BytesReserved += classbytes;
+            NSystemAllocations++;
+            AtomicMax(PeakReserved, BytesReserved.load());
+        }
+
+        PoolBlock block = { device, sizeclass, classbytes, bytes };
+        {
+            PoolShard &shard = ShardOf(d_memory);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.live[d_memory] = block;
+        }
+
+        NAllocations++;
+        BytesRequested += bytes;
+        BytesInUse += classbytes;
+        AtomicMax(PeakInUse, BytesInUse.load());
+
+        return d_memory;
+    }
+
+    void MemoryPool::Release(void* d_memory)
+    {
+        if (d_memory == NULL)
+            return;
+
+        PoolBlock block;
+        {
+            PoolShard &shard = ShardOf(d_memory);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto found = shard.live.find(d_memory);
+            if (found == shard.live.end())
+            {
+                SystemFree(d_memory, -1);
+                return;
+            }
+
+            block = found->second;
+            shard.live.erase(found);
+        }
+
+        BytesRequested -= block.requested;
+        BytesInUse -= block.classbytes;
+
+        LocalCache().Put(d_memory, block.device, block.sizeclass, block.classbytes);
+    }
+}
+
+void PoolMalloc(void** d_memory, size_t bytes)
+{
+    *d_memory = Pool().Allocate(bytes);
+}
+
+void* PoolMallocFromHostArray(void* h_source, size_t bytes)
+{
+    void* d_memory = Pool().Allocate(bytes);
+    if (d_memory)
+    {
+#ifdef WARP_CPU_BACKEND
+        memcpy(d_memory, h_source, bytes);
+#else
+        cudaMemcpy(d_memory, h_source, bytes, cudaMemcpyHostToDevice);
+#endif
+    }
+
+    return d_memory;
+}
+
+void PoolFree(void* d_memory)
+{
+    ForgetPhaseRamps(d_memory);
+    ForgetShiftAverages(d_memory);
+    Pool().Release(d_memory);
+}
+
+__declspec(dllexport) void __stdcall MemoryPoolBeginScope()
+{
+    Pool().ScopeDepth++;
+}
+
+__declspec(dllexport) void __stdcall MemoryPoolEndScope()
+{
+    MemoryPool &pool = Pool();
+    if (--pool.ScopeDepth <= 0)
+    {
+        pool.ScopeDepth = 0;
+        pool.Trim(pool.RetainLimit.load());
+    }
+}
+
+__declspec(dllexport) void __stdcall MemoryPoolSetRetainLimit(long long bytes)
+{
+    MemoryPool &pool = Pool();
+    pool.RetainLimit = tmax(0LL, bytes);
+    if (pool.ScopeDepth.load() == 0)
+        pool.Trim(pool.RetainLimit.load());
+}
+
+// Returns all cached blocks to the system; blocks still in use are unaffected
+__declspec(dllexport) void __stdcall MemoryPoolTrim()
+{
+    LocalCache().Flush(true);
+    Pool().Trim(0);
+}
+
+__declspec(dllexport) void __stdcall MemoryPoolGetStats(MemoryPoolStats* h_stats)
+{
+    MemoryPool &pool = Pool();
+
+    h_stats->bytesrequested = pool.BytesRequested.load();
+    h_stats->bytesinuse = pool.BytesInUse.load();
+    h_stats->bytescached = pool.BytesCached.load();
+    h_stats->bytesreserved = pool.BytesReserved.load();
+    h_stats->peakinuse = pool.PeakInUse.load();
+    h_stats->peakreserved = pool.PeakReserved.load();
+    h_stats->nallocations = pool.NAllocations.load();
+    h_stats->ncachehits = pool.NCacheHits.load();
+    h_stats->nsystemallocations = pool.NSystemAllocations.load();
+    h_stats->nsystemfrees = pool.NSystemFrees.load();
+}
+
+// Resets counters, and peaks to the current values
+__declspec(dllexport) void __stdcall MemoryPoolResetStats()
+{
+    MemoryPool &pool = Pool();
+
+    pool.PeakInUse = pool.BytesInUse.load();
+    pool.PeakReserved = pool.BytesReserved.load();
+    pool.NAllocations = 0;
+    pool.NCacheHits = 0;
+    pool.NSystemAllocations = 0;
+    pool.NSystemFrees = 0;
+}
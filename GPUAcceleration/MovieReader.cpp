@@ -0,0 +1,881 @@
+#include "Functions.h"
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using namespace gtom;
+
+#ifdef _MSC_VER
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+/*
+
+Native movie ingestion: a reader thread decodes frames from MRC or TIFF files into a bounded ring of
+page-locked (GPU) or aligned (CPU) host buffers, while the caller consumes them in order. Decoding
+frame k + 1 thus overlaps with uploading and processing frame k.
+
+Supported formats:
+-MRC: modes 0 (unsigned 8 bit), 1 (int16), 2 (float), 6 (uint16), 101 (unsigned 4 bit, low nibble first)
+-TIFF: strips of 4/8/16/32 bit unsigned, signed or float samples, uncompressed or LZW, with or without
+ horizontal differencing; one frame per directory; both byte orders
+-EER: TIFF with one fraction of electron events per directory, run-length coded with 7 or 8 bit runs
+ (compression 65001 or 65000) and 2 + 2 bits of sub-pixel position per event
+
+Frames can be read in groups: each buffer in the ring holds the sum of a range of frames. Event movies render
+their fractions straight into the group's buffer, optionally at 2x or 4x super-resolution from the sub-pixel
+positions, so memory scales with the number of groups in flight rather than the thousands of fractions.
+
+*/
+
+namespace
+{
+    enum MovieSampleFormat
+    {
+        SampleUnsigned = 1,
+        SampleSigned = 2,
+        SampleFloat = 3
+    };
+
+    // TIFF compression tags of event-coded EER fractions
+    const int EventCompression8Bit = 65000;
+    const int EventCompression7Bit = 65001;
+
+    // Converts a row of packed samples to float
+    void ConvertSamples(const unsigned char* input, float* output, int n, int bits, int format, bool swap, bool lownibblefirst)
+    {
+        if (bits == 4)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                unsigned char b = input[i / 2];
+                bool low = (i % 2 == 0) == lownibblefirst;
+                output[i] = (float)(low ? (b & 0xF) : (b >> 4));
+            }
+        }
+        else if (bits == 8)
+        {
+            if (format == SampleSigned)
+                for (int i = 0; i < n; i++)
+                    output[i] = (float)(signed char)input[i];
+            else
+                for (int i = 0; i < n; i++)
+                    output[i] = (float)input[i];
+        }
+        else if (bits == 16)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                unsigned short v = swap ? (unsigned short)((input[i * 2] << 8) | input[i * 2 + 1]) : (unsigned short)(input[i * 2] | (input[i * 2 + 1] << 8));
+                output[i] = format == SampleSigned ? (float)(short)v : (float)v;
+            }
+        }
+        else if (bits == 32)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                const unsigned char* p = input + i * 4;
+                uint32_t v = swap ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3] :
+                                    ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+                if (format == SampleFloat)
+                {
+                    float f;
+                    memcpy(&f, &v, sizeof(float));
+                    output[i] = f;
+                }
+                else
+                    output[i] = format == SampleSigned ? (float)(int32_t)v : (float)v;
+            }
+        }
+    }
+
+    // TIFF flavor of LZW: MSB-first codes of 9 to 12 bits, code width grows one code early
+    bool DecodeLZW(const unsigned char* input, size_t inputlength, unsigned char* output, size_t outputlength)
+    {
+        const int ClearCode = 256, EndCode = 257;
+
+        std::vector<unsigned short> prefix(4096), length(4096);
+        std::vector<unsigned char> suffix(4096), first(4096);
+        for (int i = 0; i < 256; i++)
+        {
+            suffix[i] = first[i] = (unsigned char)i;
+            length[i] = 1;
+        }
+
+        size_t bitpos = 0, written = 0;
+        int width = 9, nextcode = 258, previous = -1;
+        unsigned char sequence[4096];
+
+        while (written < outputlength && bitpos + width <= inputlength * 8)
+        {
+            int code = 0;
+            for (int b = 0; b < width; b++, bitpos++)
+                code = (code << 1) | ((input[bitpos / 8] >> (7 - bitpos % 8)) & 1);
+
+            if (code == EndCode)
+                break;
+            if (code == ClearCode)
+            {
+                width = 9;
+                nextcode = 258;
+                previous = -1;
+                continue;
+            }
+
+            int n;
+            if (previous < 0)
+            {
+                if (code > 255)
+                    return false;
+                sequence[0] = (unsigned char)code;
+                n = 1;
+            }
+            else
+            {
+                int c;
+                if (code < nextcode)
+                    c = code;
+                else if (code == nextcode)
+                    c = previous;    // Code being defined right now: previous string plus its own first byte
+                else
+                    return false;
+
+                n = length[c];
+                for (int i = n - 1, cc = c; i >= 0; i--, cc = prefix[cc])
+                    sequence[i] = suffix[cc];
+                if (code == nextcode)
+                    sequence[n++] = first[previous];
+
+                if (nextcode < 4096)
+                {
+                    prefix[nextcode] = (unsigned short)previous;
+                    suffix[nextcode] = sequence[0];
+                    first[nextcode] = first[previous];
+                    length[nextcode] = (unsigned short)(length[previous] + 1);
+                    nextcode++;
+                }
+                if (nextcode + 1 >= (1 << width) && width < 12)
+                    width++;
+            }
+
+            size_t ncopy = tmin((size_t)n, outputlength - written);
+            memcpy(output + written, sequence, ncopy);
+            written += ncopy;
+            previous = code;
+        }
+
+        return written == outputlength;
+    }
+
+    class MovieFile
+    {
+    public:
+        int3 Dims;
+        FILE* File;
+
+        MovieFile() : File(NULL) {}
+        virtual ~MovieFile()
+        {
+            if (File)
+                fclose(File);
+        }
+
+        virtual bool ReadFrame(int z, float* h_output) = 0;
+
+        // Sum of frames first to first + n - 1, upsampled by the given factor; only event movies can be upsampled
+        virtual bool ReadGroup(int first, int n, int upsampling, float* h_output)
+        {
+            if (upsampling != 1 || !ReadFrame(first, h_output))
+                return false;
+
+            size_t elements = Elements2(Dims);
+            GroupBuffer.resize(elements);
+            for (int z = first + 1; z < first + n; z++)
+            {
+                if (!ReadFrame(z, GroupBuffer.data()))
+                    return false;
+                for (size_t i = 0; i < elements; i++)
+                    h_output[i] += GroupBuffer[i];
+            }
+
+            return true;
+        }
+
+        virtual bool CanUpsample(int upsampling)
+        {
+            return upsampling == 1;
+        }
+
+    protected:
+        std::vector<float> GroupBuffer;
+
+        bool ReadAt(long long offset, void* buffer, size_t bytes)
+        {
+            return fseek64(File, offset, SEEK_SET) == 0 && fread(buffer, 1, bytes, File) == bytes;
+        }
+    };
+
+    class MovieFileMRC : public MovieFile
+    {
+    public:
+        int Mode;
+        long long DataOffset;
+        std::vector<unsigned char> Buffer;
+
+        bool Open(FILE* file)
+        {
+            File = file;
+
+            int32_t header[256];
+            if (!ReadAt(0, header, sizeof(header)))
+                return false;
+
+            Dims = toInt3(header[0], header[1], header[2]);
+            Mode = header[3];
+            DataOffset = 1024 + (long long)header[23];
+
+            return Dims.x > 0 && Dims.y > 0 && Dims.z > 0 && BytesPerRow() > 0;
+        }
+
+        size_t BytesPerRow()
+        {
+            switch (Mode)
+            {
+            case 0: return Dims.x;
+            case 1: return Dims.x * 2;
+            case 2: return Dims.x * 4;
+            case 6: return Dims.x * 2;
+            case 101: return (Dims.x + 1) / 2;
+            default: return 0;
+            }
+        }
+
+        bool ReadFrame(int z, float* h_output)
+        {
+            size_t bytesperrow = BytesPerRow();
+            Buffer.resize(bytesperrow * Dims.y);
+            if (!ReadAt(DataOffset + (long long)Buffer.size() * z, Buffer.data(), Buffer.size()))
+                return false;
+
+            int bits = Mode == 0 ? 8 : (Mode == 101 ? 4 : (Mode == 2 ? 32 : 16));
+            int format = Mode == 2 ? SampleFloat : (Mode == 1 ? SampleSigned : SampleUnsigned);
+
+            for (int y = 0; y < Dims.y; y++)
+                ConvertSamples(Buffer.data() + bytesperrow * y, h_output + (size_t)Dims.x * y, Dims.x, bits, format, false, true);
+
+            return true;
+        }
+    };
+
+    class MovieFileTIFF : public MovieFile
+    {
+    public:
+        struct Directory
+        {
+            int width, height, bits, format, compression, predictor, rowsperstrip;
+            std::vector<long long> offsets, bytecounts;
+        };
+
+        bool Swap;
+        std::vector<Directory> Directories;
+        std::vector<unsigned char> Compressed, Decoded;
+
+        bool Open(FILE* file)
+        {
+            File = file;
+
+            unsigned char header[8];
+            if (!ReadAt(0, header, 8))
+                return false;
+            if (header[0] == 'I' && header[1] == 'I')
+                Swap = false;
+            else if (header[0] == 'M' && header[1] == 'M')
+                Swap = true;
+            else
+                return false;
+            if (Get16(header + 2) != 42)
+                return false;
+
+            long long offset = Get32(header + 4);
+            while (offset != 0)
+            {
+                unsigned char countbytes[2];
+                if (!ReadAt(offset, countbytes, 2))
+                    return false;
+                int nentries = Get16(countbytes);
+
+                std::vector<unsigned char> entries(nentries * 12 + 4);
+                if (!ReadAt(offset + 2, entries.data(), entries.size()))
+                    return false;
+
+                Directory d;
+                d.width = d.height = 0;
+                d.bits = 1;
+                d.format = SampleUnsigned;
+                d.compression = 1;
+                d.predictor = 1;
+                d.rowsperstrip = 0x7FFFFFFF;
+
+                for (int e = 0; e < nentries; e++)
+                {
+                    const unsigned char* entry = entries.data() + e * 12;
+                    int tag = Get16(entry);
+                    std::vector<long long> values;
+                    if (!GetValues(entry, values) || values.empty())
+                        continue;
+
+                    switch (tag)
+                    {
+                    case 256: d.width = (int)values[0]; break;
+                    case 257: d.height = (int)values[0]; break;
+                    case 258: d.bits = (int)values[0]; break;
+                    case 259: d.compression = (int)values[0]; break;
+                    case 273: d.offsets = values; break;
+                    case 278: d.rowsperstrip = (int)values[0]; break;
+                    case 279: d.bytecounts = values; break;
+                    case 317: d.predictor = (int)values[0]; break;
+                    case 339: d.format = (int)values[0]; break;
+                    }
+                }
+
+                bool events = d.compression == EventCompression8Bit || d.compression == EventCompression7Bit;
+                bool supported = (events ||
+                                  ((d.bits == 4 || d.bits == 8 || d.bits == 16 || d.bits == 32) &&
+                                   (d.compression == 1 || d.compression == 5) &&
+                                   (d.predictor == 1 || (d.predictor == 2 && d.bits >= 8 && d.format != SampleFloat)))) &&
+                                 d.offsets.size() > 0 && d.offsets.size() == d.bytecounts.size();
+                if (!supported)
+                    return false;
+
+                Directories.push_back(d);
+                offset = Get32(entries.data() + nentries * 12);
+            }
+
+            if (Directories.empty())
+                return false;
+
+            Dims = toInt3(Directories[0].width, Directories[0].height, (int)Directories.size());
+            for (const Directory &d : Directories)
+                if (d.width != Dims.x || d.height != Dims.y)
+                    return false;
+
+            return true;
+        }
+
+        bool ReadFrame(int z, float* h_output)
+        {
+            const Directory &d = Directories[z];
+            if (d.compression != 1 && d.compression != 5)
+                return false;
+
+            size_t bytesperrow = ((size_t)d.width * d.bits + 7) / 8;
+            Decoded.resize(bytesperrow * d.height);
+
+            size_t position = 0;
+            for (size_t s = 0; s < d.offsets.size() && position < Decoded.size(); s++)
+            {
+                size_t striplength = tmin(bytesperrow * (size_t)tmin(d.rowsperstrip, d.height), Decoded.size() - position);
+
+                if (d.compression == 1)
+                {
+                    if (!ReadAt(d.offsets[s], Decoded.data() + position, tmin(striplength, (size_t)d.bytecounts[s])))
+                        return false;
+                }
+                else
+                {
+                    Compressed.resize((size_t)d.bytecounts[s]);
+                    if (!ReadAt(d.offsets[s], Compressed.data(), Compressed.size()) ||
+                        !DecodeLZW(Compressed.data(), Compressed.size(), Decoded.data() + position, striplength))
+                        return false;
+                }
+
+                position += striplength;
+            }
+            if (position < Decoded.size())
+                return false;
+
+            for (int y = 0; y < d.height; y++)
+            {
+                unsigned char* row = Decoded.data() + bytesperrow * y;
+                if (d.predictor == 2)
+                    UndoDifferencing(row, d.width, d.bits);
+
+                ConvertSamples(row, h_output + (size_t)d.width * y, d.width, d.bits, d.format, Swap, false);
+            }
+
+            return true;
+        }
+
+    protected:
+        // All strips of a directory back to back, as stored
+        bool ReadStrips(const Directory &d, std::vector<unsigned char> &output)
+        {
+            size_t total = 0;
+            for (long long b : d.bytecounts)
+                total += (size_t)b;
+            output.resize(total);
+
+            size_t position = 0;
+            for (size_t s = 0; s < d.offsets.size(); s++)
+            {
+                if (!ReadAt(d.offsets[s], output.data() + position, (size_t)d.bytecounts[s]))
+                    return false;
+                position += (size_t)d.bytecounts[s];
+            }
+
+            return true;
+        }
+
+    private:
+        int Get16(const unsigned char* p)
+        {
+            return Swap ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+        }
+
+        long long Get32(const unsigned char* p)
+        {
+            return Swap ? ((long long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3] :
+                          ((long long)p[3] << 24) | (p[2] << 16) | (p[1] << 8) | p[0];
+        }
+
+        // SHORT or LONG values of an IFD entry, stored inline if they fit into 4 bytes
+        bool GetValues(const unsigned char* entry, std::vector<long long> &values)
+        {
+            int type = Get16(entry + 2);
+            long long count = Get32(entry + 4);
+            int size = type == 3 ? 2 : (type == 4 ? 4 : 0);
+            if (size == 0 || count <= 0 || count > (1 << 24))
+                return false;
+
+            std::vector<unsigned char> data((size_t)(count * size));
+            if (count * size <= 4)
+                memcpy(data.data(), entry + 8, data.size());
+            else
+            {
+                long pos = ftell(File);
+                bool success = ReadAt(Get32(entry + 8), data.data(), data.size());
+                fseek(File, pos, SEEK_SET);
+                if (!success)
+                    return false;
+            }
+
+            values.resize((size_t)count);
+            for (long long i = 0; i < count; i++)
+                values[i] = size == 2 ? Get16(data.data() + i * 2) : Get32(data.data() + i * 4);
+
+            return true;
+        }
+
+        void UndoDifferencing(unsigned char* row, int width, int bits)
+        {
+            if (bits == 8)
+            {
+                for (int x = 1; x < width; x++)
+                    row[x] = (unsigned char)(row[x] + row[x - 1]);
+            }
+            else
+            {
+                int bytes = bits / 8;
+                uint32_t previous = 0;
+                for (int x = 0; x < width; x++)
+                {
+                    unsigned char* p = row + x * bytes;
+                    uint32_t v = 0;
+                    for (int b = 0; b < bytes; b++)
+                        v |= (uint32_t)p[Swap ? bytes - 1 - b : b] << (8 * b);
+
+                    v = (uint32_t)(v + previous);
+                    if (bytes < 4)
+                        v &= (1u << (8 * bytes)) - 1;
+                    previous = v;
+
+                    for (int b = 0; b < bytes; b++)
+                        p[Swap ? bytes - 1 - b : b] = (unsigned char)(v >> (8 * b));
+                }
+            }
+        }
+    };
+
+    class MovieFileEER : public MovieFileTIFF
+    {
+    public:
+        bool Open(FILE* file)
+        {
+            if (!MovieFileTIFF::Open(file))
+                return false;
+
+            for (const Directory &d : Directories)
+                if (d.compression != EventCompression8Bit && d.compression != EventCompression7Bit)
+                    return false;
+
+            return true;
+        }
+
+        bool ReadFrame(int z, float* h_output)
+        {
+            return ReadGroup(z, 1, 1, h_output);
+        }
+
+        bool ReadGroup(int first, int n, int upsampling, float* h_output)
+        {
+            if (!CanUpsample(upsampling))
+                return false;
+
+            memset(h_output, 0, Elements2(Dims) * upsampling * upsampling * sizeof(float));
+
+            for (int z = first; z < first + n; z++)
+                if (!ReadStrips(Directories[z], Compressed) || !RenderEvents(Directories[z].compression, upsampling, h_output))
+                    return false;
+
+            return true;
+        }
+
+        bool CanUpsample(int upsampling)
+        {
+            return upsampling == 1 || upsampling == 2 || upsampling == 4;
+        }
+
+    private:
+        // Adds one count per event at its position, refined by the sub-pixel bits as far as the upsampling asks.
+        // 7 bit streams only have a sub-pixel nibble after runs that end in an event. Legacy 8 bit streams are
+        // fixed 12 bit symbols, two per 3 bytes, of an 8 bit run and a nibble that is there even after a
+        // maximum run, where it's ignored.
+        bool RenderEvents(int compression, int upsampling, float* h_output)
+        {
+            bool fixedsymbols = compression == EventCompression8Bit;
+            int runbits = fixedsymbols ? 8 : 7;
+            uint maxrun = (1u << runbits) - 1;
+            int subshift = upsampling == 4 ? 0 : (upsampling == 2 ? 1 : 2);
+            size_t widthout = (size_t)Dims.x * upsampling;
+
+            size_t npixels = Elements2(Dims);
+            size_t nbits = Compressed.size() * 8;
+            Compressed.resize(Compressed.size() + 8, 0);    // Lets the bit reader load whole words at the end
+            const unsigned char* stream = Compressed.data();
+
+            // Bits come LSB first
+            auto read = [&](size_t bitpos, int bits)
+            {
+                unsigned long long word;
+                memcpy(&word, stream + bitpos / 8, sizeof(word));
+                return (uint)((word >> (bitpos % 8)) & ((1ull << bits) - 1));
+            };
+
+            size_t bitpos = 0, position = 0;
+            while (bitpos + runbits <= nbits)
+            {
+                uint run = read(bitpos, runbits);
+                bitpos += runbits;
+                position += run;
+                if (position >= npixels)
+                    return true;
+                if (run == maxrun)
+                {
+                    if (fixedsymbols)
+                        bitpos += 4;
+                    continue;
+                }
+
+                if (bitpos + 4 > nbits)
+                    break;
+                uint subpixel = read(bitpos, 4) ^ 0xA;
+                bitpos += 4;
+
+                size_t x = ((position % Dims.x) * 4 + (subpixel & 3)) >> subshift;
+                size_t y = ((position / Dims.x) * 4 + (subpixel >> 2)) >> subshift;
+                h_output[y * widthout + x] += 1.0f;
+
+                position++;
+            }
+
+            // Streams end with the run that reaches the last pixel
+            return false;
+        }
+    };
+
+    MovieFile* OpenMovieFile(const char* path)
+    {
+        FILE* file = fopen(path, "rb");
+        if (!file)
+            return NULL;
+
+        std::string extension(path);
+        extension = extension.substr(tmin(extension.size(), extension.find_last_of('.') + 1));
+        std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+        if (extension == "tif" || extension == "tiff")
+        {
+            MovieFileTIFF* movie = new MovieFileTIFF();
+            if (movie->Open(file))
+                return movie;
+            delete movie;
+        }
+        else if (extension == "eer")
+        {
+            MovieFileEER* movie = new MovieFileEER();
+            if (movie->Open(file))
+                return movie;
+            delete movie;
+        }
+        else if (extension == "mrc" || extension == "mrcs")
+        {
+            MovieFileMRC* movie = new MovieFileMRC();
+            if (movie->Open(file))
+                return movie;
+            delete movie;
+        }
+        else
+            fclose(file);
+
+        return NULL;
+    }
+
+    float* MallocFrameBuffer(size_t elements)
+    {
+#ifdef WARP_CPU_BACKEND
+        return (float*)MallocAligned(elements * sizeof(float));
+#else
+        float* h_buffer;
+        cudaMallocHost((void**)&h_buffer, elements * sizeof(float));
+        return h_buffer;
+#endif
+    }
+
+    void FreeFrameBuffer(float* h_buffer)
+    {
+#ifdef WARP_CPU_BACKEND
+        FreeAligned(h_buffer);
+#else
+        cudaFreeHost(h_buffer);
+#endif
+    }
+}
+
+struct MovieReader
+{
+    MovieFile* file;
+    std::vector<int> groupfirst, grouplength;
+    int upsampling;
+    std::vector<float*> ring;
+
+    std::mutex mutex;
+    std::condition_variable changed;
+    int decoded, acquired, released;
+    bool failed, closing;
+
+    std::thread thread;
+
+    void Decode()
+    {
+        for (int z = 0; z < (int)groupfirst.size(); z++)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&]() { return closing || z - released < (int)ring.size(); });
+                if (closing)
+                    return;
+            }
+
+            bool success = file->ReadGroup(groupfirst[z], grouplength[z], upsampling, ring[z % ring.size()]);
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (success)
+                    decoded = z + 1;
+                else
+                    failed = true;
+            }
+            changed.notify_all();
+
+            if (!success)
+                return;
+        }
+    }
+};
+
+__declspec(dllexport) void* __stdcall MovieReaderOpen(char* c_path, int ringsize, int3* h_dims)
+{
+    return MovieReaderOpenGroups(c_path, ringsize, NULL, NULL, 0, 1, h_dims);
+}
+
+// Dimensions of the movie as stored, i.e. the number of frames or fractions, without starting to decode it
+__declspec(dllexport) bool __stdcall MovieGetDims(char* c_path, int3* h_dims)
+{
+    MovieFile* file = OpenMovieFile(c_path);
+    if (!file)
+        return false;
+
+    *h_dims = file->Dims;
+    delete file;
+
+    return true;
+}
+
+/*
+
+Like MovieReaderOpen, but every buffer handed out is the sum of frames h_groupfirst[g] to
+h_groupfirst[g] + h_grouplength[g] - 1, upsampled by the given factor (1, or 2 and 4 for event movies).
+With ngroups = 0, every frame is its own group. h_dims returns the dimensions of the grouped movie.
+
+*/
+
+__declspec(dllexport) void* __stdcall MovieReaderOpenGroups(char* c_path, int ringsize, int* h_groupfirst, int* h_grouplength, int ngroups, int upsampling, int3* h_dims)
+{
+    MovieFile* file = OpenMovieFile(c_path);
+    if (!file)
+        return NULL;
+
+    bool valid = file->CanUpsample(upsampling);
+    for (int g = 0; g < ngroups; g++)
+        valid = valid && h_grouplength[g] > 0 && h_groupfirst[g] >= 0 && h_groupfirst[g] + h_grouplength[g] <= file->Dims.z;
+    if (!valid)
+    {
+        delete file;
+        return NULL;
+    }
+
+    MovieReader* reader = new MovieReader();
+    reader->file = file;
+    reader->upsampling = upsampling;
+    for (int g = 0; g < (ngroups > 0 ? ngroups : file->Dims.z); g++)
+    {
+        reader->groupfirst.push_back(ngroups > 0 ? h_groupfirst[g] : g);
+        reader->grouplength.push_back(ngroups > 0 ? h_grouplength[g] : 1);
+    }
+    reader->decoded = reader->acquired = reader->released = 0;
+    reader->failed = reader->closing = false;
+
+    int3 dims = toInt3(file->Dims.x * upsampling, file->Dims.y * upsampling, (int)reader->groupfirst.size());
+
+    for (int i = 0; i < tmax(2, tmin(ringsize, dims.z)); i++)
+        reader->ring.push_back(MallocFrameBuffer(Elements2(dims)));
+
+    reader->thread = std::thread(&MovieReader::Decode, reader);
+
+    *h_dims = dims;
+    return reader;
+}
+
+// Blocks until the next frame is decoded, returns its index, or -1 if there are no more frames or decoding failed
+__declspec(dllexport) int __stdcall MovieReaderAcquire(void* reader, float** h_frame)
+{
+    MovieReader* r = (MovieReader*)reader;
+
+    std::unique_lock<std::mutex> lock(r->mutex);
+    r->changed.wait(lock, [&]() { return r->decoded > r->acquired || r->failed || r->acquired >= (int)r->groupfirst.size(); });
+
+    if (r->decoded <= r->acquired)
+        return -1;
+
+    *h_frame = r->ring[r->acquired % r->ring.size()];
+    return r->acquired++;
+}
+
+// Hands the oldest acquired frame's buffer back to the reader thread
+__declspec(dllexport) void __stdcall MovieReaderRelease(void* reader)
+{
+    MovieReader* r = (MovieReader*)reader;
+
+    {
+        std::lock_guard<std::mutex> lock(r->mutex);
+        r->released = tmin(r->released + 1, r->acquired);
+    }
+    r->changed.notify_all();
+}
+
+__declspec(dllexport) void __stdcall MovieReaderClose(void* reader)
+{
+    MovieReader* r = (MovieReader*)reader;
+
+    {
+        std::lock_guard<std::mutex> lock(r->mutex);
+        r->closing = true;
+    }
+    r->changed.notify_all();
+    r->thread.join();
+
+    for (float* h_buffer : r->ring)
+        FreeFrameBuffer(h_buffer);
+    delete r->file;
+    delete r;
+}
+
+/*
+
+Reads a movie frame by frame, or in groups of frames as in MovieReaderOpenGroups, and feeds every frame to the
+processing stages as soon as it is decoded:
+-d_stack (optional): receives the entire movie, for stages that need all frames later
+-d_shiftoutput (optional): CreateShift output for all frames, with the given origins and mask
+-spectrumaccumulator (optional): SpectrumAccumulator created for this movie's frame count
+
+Returns false if the file can't be opened or a frame fails to decode.
+
+*/
+
+__declspec(dllexport) bool __stdcall MovieIngest(char* c_path,
+                                                int ringsize,
+                                                int* h_groupfirst,
+                                                int* h_grouplength,
+                                                int ngroups,
+                                                int upsampling,
+                                                float* d_stack,
+                                                int3* h_shiftorigins,
+                                                int nshiftorigins,
+                                                int2 dimsshiftregion,
+                                                size_t* h_shiftmask,
+                                                uint shiftmasklength,
+                                                float2* d_shiftoutput,
+                                                void* spectrumaccumulator)
+{
+    int3 dims;
+    void* reader = MovieReaderOpenGroups(c_path, ringsize, h_groupfirst, h_grouplength, ngroups, upsampling, &dims);
+    if (!reader)
+        return false;
+
+    size_t elementsframe = Elements2(dims);
+
+#ifndef WARP_CPU_BACKEND
+    float* d_frame = NULL;
+    if (!d_stack)
+        PoolMalloc((void**)&d_frame, elementsframe * sizeof(float));
+#endif
+
+    int z;
+    float* h_frame;
+    while ((z = MovieReaderAcquire(reader, &h_frame)) >= 0)
+    {
+#ifdef WARP_CPU_BACKEND
+        // Host memory is device memory here, process the ring buffer in place
+        if (d_stack)
+            memcpy(d_stack + elementsframe * z, h_frame, elementsframe * sizeof(float));
+        float* d_current = d_stack ? d_stack + elementsframe * z : h_frame;
+#else
+        float* d_current = d_stack ? d_stack + elementsframe * z : d_frame;
+        cudaMemcpy(d_current, h_frame, elementsframe * sizeof(float), cudaMemcpyHostToDevice);
+        MovieReaderRelease(reader);
+#endif
+
+        if (d_shiftoutput)
+            CreateShift(d_current, toInt2(dims.x, dims.y), 1, h_shiftorigins, nshiftorigins, dimsshiftregion, h_shiftmask, shiftmasklength, d_shiftoutput + (size_t)shiftmasklength * nshiftorigins * z, STORAGE_FP32);
+        if (spectrumaccumulator)
+            SpectrumAccumulatorAdd(spectrumaccumulator, d_current, toInt2(dims.x, dims.y), 1);
+
+#ifdef WARP_CPU_BACKEND
+        MovieReaderRelease(reader);
+#endif
+    }
+
+#ifndef WARP_CPU_BACKEND
+    if (d_frame)
+        PoolFree(d_frame);
+#endif
+
+    bool complete = ((MovieReader*)reader)->decoded == dims.z;
+    MovieReaderClose(reader);
+
+    return complete;
+}
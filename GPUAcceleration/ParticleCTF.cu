@@ -27,13 +27,11 @@ __declspec(dllexport) void CreateParticleSpectra(float* d_frame,
 												float majorangle,
 												float2* d_outputall)
 {
-	int3* d_origins = (int3*)CudaMallocFromHostArray(h_origins, norigins * nframes * sizeof(int3));
+	int3* d_origins = (int3*)PoolMallocFromHostArray(h_origins, norigins * nframes * sizeof(int3));
 	tcomplex* d_tempspectra;
-	cudaMalloc((void**)&d_tempspectra, norigins * ElementsFFT2(dimsregion) * sizeof(tcomplex));
+	PoolMalloc((void**)&d_tempspectra, norigins * ElementsFFT2(dimsregion) * sizeof(tcomplex));
 	tfloat* d_tempextracts;
-	cudaMalloc((void**)&d_tempextracts, norigins * Elements2(dimsregion) * sizeof(tfloat));
-
-	tfloat* d_tempsum = CudaMallocValueFilled(Elements2(dimsregion) * norigins, 0.0f);
+	PoolMalloc((void**)&d_tempextracts, norigins * Elements2(dimsregion) * sizeof(tfloat));
 
 	int nspectra = norigins * (ctftime ? nframes : 1);
 
@@ -49,19 +47,19 @@ __declspec(dllexport) void CreateParticleSpectra(float* d_frame,
 
 	for (int z = 0; z < nframes; z++)
 	{
-		d_ExtractMany(d_frame + Elements2(dimsframe) * z, d_tempextracts, toInt3(dimsframe), toInt3(dimsregion), d_origins + norigins * z, norigins);
 		if (abs(majorpixel - minorpixel) > 0)
 		{
+			d_ExtractMany(d_frame + Elements2(dimsframe) * z, d_tempextracts, toInt3(dimsframe), toInt3(dimsregion), d_origins + norigins * z, norigins);
 			d_MultiplyByScalar(d_tempextracts, d_tempextracts, Elements2(dimsregion) * norigins, -1.0f);
 			d_MagAnisotropyCorrect(d_tempextracts, dimsregion, (float*)d_tempspectra, dimsregion, majorpixel, minorpixel, majorangle, 4, norigins);
+			d_RemapFull2FullFFT((float*)d_tempspectra, d_tempextracts, toInt3(dimsregion), norigins);
 		}
 		else
 		{
-			d_MultiplyByScalar(d_tempextracts, (float*)d_tempspectra, Elements2(dimsregion) * norigins, -1.0f);
+			// Extraction, sign flip and the shift to the FFT origin in one pass
+			d_PatchExtract(d_frame, dimsframe, d_origins, norigins, true, norigins * z, norigins, dimsregion, false, NULL, -1.0f, true, d_tempextracts);
 		}
 
-		d_AddVector(d_tempsum, (float*)d_tempspectra, d_tempsum, norigins * Elements2(dimsregion));
-		d_RemapFull2FullFFT((float*)d_tempspectra, d_tempextracts, toInt3(dimsregion), norigins);
 		//d_MultiplyByVector(d_tempextracts, d_masks, d_tempextracts, norigins * Elements2(dimsregion));
 
 		//d_WriteMRC(d_tempextracts, toInt3(dimsregion.x, dimsregion.y, norigins), "d_tempextracts.mrc");
@@ -69,7 +67,7 @@ __declspec(dllexport) void CreateParticleSpectra(float* d_frame,
 		// Full precision, just write everything to output which is big enough
 		if (ctftime)
 		{
-			d_FFTR2C(d_tempextracts, d_tempspectra, 2, toInt3(dimsregion), norigins);		
+			d_FFTR2CCached(d_tempextracts, d_tempspectra, 2, toInt3(dimsregion), norigins);		
 			d_AddVector((float*)d_tempspectra, 
 						(float*)(d_outputall + (z / framegroupsize) * norigins * ElementsFFT2(dimsregion)), 
 						(float*)(d_outputall + (z / framegroupsize) * norigins * ElementsFFT2(dimsregion)), 
@@ -77,22 +75,19 @@ __declspec(dllexport) void CreateParticleSpectra(float* d_frame,
 		}
 		else // Spatial precision
 		{
-			d_FFTR2C(d_tempextracts, d_tempspectra, 2, toInt3(dimsregion), norigins);
+			d_FFTR2CCached(d_tempextracts, d_tempspectra, 2, toInt3(dimsregion), norigins);
 			d_AddVector((float*)d_tempspectra, (float*)d_outputall, (float*)d_outputall, norigins * ElementsFFT2(dimsregion) * 2);
 		}
 	}
 
-	d_WriteMRC(d_tempsum, toInt3(dimsregion.x, dimsregion.y, norigins), "d_tempsum.mrc");
-
 	if (!ctftime)
 		d_ComplexMultiplyByScalar(d_outputall, d_outputall, norigins * ElementsFFT2(dimsregion), 1.0f / nframes);
 	else
 		d_ComplexMultiplyByScalar(d_outputall, d_outputall, norigins * (nframes / framegroupsize) * ElementsFFT2(dimsregion), 1.0f / framegroupsize);
 
-	cudaFree(d_tempsum);
-	cudaFree(d_origins);
-	cudaFree(d_tempspectra);
-	cudaFree(d_tempextracts);
+	PoolFree(d_origins);
+	PoolFree(d_tempspectra);
+	PoolFree(d_tempextracts);
 }
 
 __declspec(dllexport) void ParticleCTFMakeAverage(float2* d_ps, float2* d_pscoords, uint length, uint sidelength, CTFParams* h_sourceparams, CTFParams targetparams, uint minbin, uint maxbin, uint batch, float* d_output)
@@ -104,14 +99,14 @@ __declspec(dllexport) void ParticleCTFMakeAverage(float2* d_ps, float2* d_pscoor
 __declspec(dllexport) void ParticleCTFCompareToSim(float2* d_ps, float2* d_pscoords, float2* d_ref, float* d_invsigma, uint length, CTFParams* h_sourceparams, float* h_scores, uint nframes, uint batch)
 {
 	float* d_scores;
-	cudaMalloc((void**)&d_scores, batch * nframes * sizeof(float));
+	PoolMalloc((void**)&d_scores, batch * nframes * sizeof(float));
 
 	CTFParamsLean* h_lean;
 	cudaMallocHost((void**)&h_lean, batch * nframes * sizeof(CTFParamsLean));
 	#pragma omp parallel for
 	for (int i = 0; i < batch * nframes; i++)
 		h_lean[i] = CTFParamsLean(h_sourceparams[i], toInt3(1, 1, 1));	// Sidelength and pixelsize are already included in d_addresses
-	CTFParamsLean* d_lean = (CTFParamsLean*)CudaMallocFromHostArray(h_lean, batch * nframes * sizeof(CTFParamsLean));
+	CTFParamsLean* d_lean = (CTFParamsLean*)PoolMallocFromHostArray(h_lean, batch * nframes * sizeof(CTFParamsLean));
 	cudaFreeHost(h_lean);
 
 	//float* d_debugref, *d_debugps;
@@ -131,8 +126,8 @@ __declspec(dllexport) void ParticleCTFCompareToSim(float2* d_ps, float2* d_pscoo
 	//cudaFree(d_debugps);
 
 	cudaMemcpy(h_scores, d_scores, batch * nframes * sizeof(float), cudaMemcpyDeviceToHost);
-	cudaFree(d_lean);
-	cudaFree(d_scores);
+	PoolFree(d_lean);
+	PoolFree(d_scores);
 }
 
 __global__ void SpectrumCompareKernel(float2* d_ps, float2* d_pscoords, float2* d_ref, float* d_invsigma, CTFParamsLean* d_params, float* d_scores, uint length)//, float* d_debugref, float* d_debugps)
@@ -4,13 +4,16 @@ using namespace gtom;
 
 #define SHIFT_THREADS 128
 
-__global__ void ParticleShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float* d_diff, float* d_debugdiff);
-__global__ void ParticleShiftGetGradKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float2* d_grad);
+__global__ void ParticleShiftGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float* d_diff, float* d_debugdiff);
+__global__ void ParticleShiftGetGradKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float2* d_grad);
+__global__ void ParticleShiftGetDiffAndGradKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float* d_diff, float2* d_grad);
 
 /*
 
 Supplied with a stack of frames, extraction positions for sub-regions, and a mask of relevant pixels in Fspace, 
-this method extracts portions of each frame, computes the FT, and returns the relevant pixels.
+this method extracts portions of each frame, computes the FT, and returns the relevant pixels. The particles are
+stored with the given STORAGE_* precision, which the ParticleShiftGet* methods take for d_phase; projections and
+inverse sigma stay fp32.
 
 */
 
@@ -31,27 +34,24 @@ __declspec(dllexport) void CreateParticleShift(float* d_frame,
 												float pixelmajor,
 												float pixelminor,
 												float pixelangle,
-												float2* d_outputparticles,
+												void* d_outputparticles,
 												float2* d_outputprojections,
-												float* d_outputinvsigma)
+												float* d_outputinvsigma,
+												int precision)
 {
 	int2 dimspadded = toInt2(dimsregion.x + 64, dimsregion.y + 64);
 
-	size_t* d_indices = (size_t*)CudaMallocFromHostArray(h_indices, indiceslength * sizeof(size_t));
+	size_t* d_indices = (size_t*)PoolMallocFromHostArray(h_indices, indiceslength * sizeof(size_t));
+	std::vector<size_t> gather = PatchSpectrumGatherIndices(h_indices, indiceslength, dimsregion);
+	size_t* d_gather = (size_t*)PoolMallocFromHostArray(gather.data(), indiceslength * sizeof(size_t));
 	tfloat* d_temp;
-	cudaMalloc((void**)&d_temp, npositions * ElementsFFT2(dimsregion) * sizeof(tcomplex));
+	PoolMalloc((void**)&d_temp, npositions * ElementsFFT2(dimsregion) * sizeof(tcomplex));
 	tcomplex* d_tempft;
-	cudaMalloc((void**)&d_tempft, npositions * ElementsFFT2(dimsregion) * sizeof(tcomplex));
+	PoolMalloc((void**)&d_tempft, npositions * ElementsFFT2(dimsregion) * sizeof(tcomplex));
 	tfloat* d_extracts;
-	cudaMalloc((void**)&d_extracts, npositions * Elements2(dimspadded) * sizeof(float));
+	PoolMalloc((void**)&d_extracts, npositions * Elements2(dimspadded) * sizeof(float));
 	int3* d_origins;
-	cudaMalloc((void**)&d_origins, npositions * sizeof(int3));
-
-	tcomplex* d_dense;
-	cudaMalloc((void**)&d_dense, npositions * indiceslength * sizeof(tcomplex));
-
-	tfloat* d_sums = CudaMallocValueFilled(npositions * Elements2(dimsregion), (tfloat)0);
-	tfloat* d_sumamps = CudaMallocValueFilled(npositions * indiceslength, (tfloat)0);
+	PoolMalloc((void**)&d_origins, npositions * sizeof(int3));
 
 	for (uint z = 0; z < nframes; z++)
 	{
@@ -89,47 +89,37 @@ __declspec(dllexport) void CreateParticleShift(float* d_frame,
 		//d_MultiplyByVector(d_temp, d_masks, d_temp, Elements2(dimsregion) * npositions);
 		//if (z == 1)
 			//d_WriteMRC(d_temp, toInt3(dimsregion.x, dimsregion.y, npositions), "d_extractsmasked.mrc");
-		d_AddVector(d_sums, d_temp, d_sums, npositions * Elements2(dimsregion));
-
-		d_FFTR2C(d_temp, d_tempft, 2, toInt3(dimsregion), npositions);
-		d_RemapHalfFFT2Half(d_tempft, d_tempft, toInt3(dimsregion), npositions);
-		d_Remap(d_tempft, d_indices, d_outputparticles + indiceslength * npositions * z, indiceslength, ElementsFFT2(dimsregion), make_cuComplex(0, 0), npositions);
 
-		d_Abs(d_outputparticles + indiceslength * npositions * z, d_temp, indiceslength * npositions);
-		d_AddVector(d_sumamps, d_temp, d_sumamps, indiceslength * npositions);
+		// The indices are gathered from the raw transform, straight into the output's precision
+		d_FFTR2CCached(d_temp, d_tempft, 2, toInt3(dimsregion), npositions);
+		d_PatchGather(d_tempft, d_gather, indiceslength, dimsregion, npositions, d_outputparticles, precision, (size_t)indiceslength * npositions * z);
 
 		free(h_overallshifts);
 	}
-	//d_WriteMRC(d_sums, toInt3(dimsregion.x, dimsregion.y, npositions), "d_extracts.mrc");
-	//d_WriteMRC(d_sumamps, toInt3(indiceslength, npositions, 1), "d_extractsamps.mrc");
 
 	d_CTFSimulate(h_ctfparams, d_ctfcoords, d_temp, ElementsFFT2(dimsregion), false, npositions);
 	//d_WriteMRC(d_temp, toInt3(dimsregion.x / 2 + 1, dimsregion.y, npositions), "d_ctf.mrc");
 	d_ComplexMultiplyByVector(d_projections, d_temp, d_projections, ElementsFFT2(dimsregion) * npositions);
 
-	d_IFFTC2R(d_projections, d_temp, 2, toInt3(dimsregion), npositions);
+	d_IFFTC2RCached(d_projections, d_temp, 2, toInt3(dimsregion), npositions);
 	d_RemapFullFFT2Full(d_temp, d_temp, toInt3(dimsregion), npositions);
 	d_NormBackground(d_temp, d_temp, toInt3(dimsregion), (uint)(100.0f / 1.057f), false, npositions);
 	//d_WriteMRC(d_temp, toInt3(dimsregion.x, dimsregion.y, npositions), "d_projections.mrc");
-	d_FFTR2C(d_temp, d_projections, 2, toInt3(dimsregion), npositions);
-	d_RemapHalfFFT2Half(d_projections, d_projections, toInt3(dimsregion), npositions);
-	d_Remap(d_projections, d_indices, d_outputprojections, indiceslength, ElementsFFT2(dimsregion), make_cuComplex(0, 0), npositions);
+	d_FFTR2CCached(d_temp, d_projections, 2, toInt3(dimsregion), npositions);
+	d_PatchGather(d_projections, d_gather, indiceslength, dimsregion, npositions, d_outputprojections, STORAGE_FP32, 0);
 
 	d_RemapHalfFFT2Half(d_invsigma, d_invsigma, toInt3(dimsregion));
 	d_Remap(d_invsigma, d_indices, d_outputinvsigma, indiceslength, ElementsFFT2(dimsregion), (float)0, 1);
 
-	cudaFree(d_sums);
-	cudaFree(d_sumamps);
-
-	cudaFree(d_dense);
-	cudaFree(d_tempft);
-	cudaFree(d_temp);
-	cudaFree(d_indices);
-	cudaFree(d_extracts);
-	cudaFree(d_origins);
+	PoolFree(d_tempft);
+	PoolFree(d_temp);
+	PoolFree(d_gather);
+	PoolFree(d_indices);
+	PoolFree(d_extracts);
+	PoolFree(d_origins);
 }
 
-__declspec(dllexport) void ParticleShiftGetDiff(float2* d_phase, 
+__declspec(dllexport) void ParticleShiftGetDiff(void* d_phase, 
 											float2* d_average, 
 											float2* d_shiftfactors, 
 											float* d_invsigma,
@@ -138,20 +128,24 @@ __declspec(dllexport) void ParticleShiftGetDiff(float2* d_phase,
 											float2* d_shifts,
 											float* h_diff, 
 											uint npositions, 
-											uint nframes)
+											uint nframes,
+											int precision)
 {
 	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
 	dim3 grid = dim3(tmin(128, (probelength + TpB - 1) / TpB), npositions, nframes);
 
 	float* d_diff;
-	cudaMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
+	PoolMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
 	float* d_diffreduced;
-	cudaMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
+	PoolMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
 
 	float* d_debugdiff = NULL;
 	//cudaMalloc((void**)&d_debugdiff, npositions * nframes * length * sizeof(float));
 
-	ParticleShiftGetDiffKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, d_invsigma, length, probelength, d_shifts, d_diff, d_debugdiff);
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+	ParticleShiftGetDiffKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, d_invsigma, length, probelength, d_shifts, d_diff, d_debugdiff);
 
 	//d_WriteMRC(d_debugdiff, toInt3(129, 256, npositions), "d_debugdiff.mrc");
 
@@ -159,17 +153,19 @@ __declspec(dllexport) void ParticleShiftGetDiff(float2* d_phase,
 	d_DivideByScalar(d_diffreduced, d_diffreduced, npositions * nframes, (float)grid.x);
 	cudaMemcpy(h_diff, d_diffreduced, npositions * nframes * sizeof(float), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_diffreduced);
-	cudaFree(d_diff);
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_diffreduced);
+	PoolFree(d_diff);
 }
 
-__global__ void ParticleShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float* d_diff, float* d_debugdiff)
+__global__ void ParticleShiftGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, float* d_invsigma, uint length, uint probelength, float2* d_shifts, float* d_diff, float* d_debugdiff)
 {
 	__shared__ float s_diff[SHIFT_THREADS];
 	s_diff[threadIdx.x] = 0.0f;
 
 	uint specid = blockIdx.z * gridDim.y + blockIdx.y;
-	d_phase += specid * length;
+	size_t phaseoffset = (size_t)specid * length;
 	d_average += blockIdx.y * length;
 	//d_debugdiff += specid * length;
 
@@ -180,14 +176,13 @@ __global__ void ParticleShiftGetDiffKernel(float2* d_phase, float2* d_average, f
 		 id < probelength; 
 		 id += gridDim.x * blockDim.x)
 	{
-		float2 value = d_phase[id];
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
 		float2 average = d_average[id];
 
 		float2 shiftfactors = d_shiftfactors[id];
 
-		float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-		float2 change = make_float2(__cosf(phase), __sinf(phase));
-		value = cuCmulf(value, change);
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
+		value = cmul(value, change);
 
 		float2 diff = value - average;
 
@@ -207,7 +202,7 @@ __global__ void ParticleShiftGetDiffKernel(float2* d_phase, float2* d_average, f
 	}
 }
 
-__declspec(dllexport) void ParticleShiftGetGrad(float2* d_phase, 
+__declspec(dllexport) void ParticleShiftGetGrad(void* d_phase, 
 										float2* d_average, 
 										float2* d_shiftfactors, 
 										float* d_invsigma,
@@ -216,17 +211,18 @@ __declspec(dllexport) void ParticleShiftGetGrad(float2* d_phase,
 										float2* d_shifts,
 										float2* h_grad, 
 										uint npositions, 
-										uint nframes)
+										uint nframes,
+										int precision)
 {
 	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
 	dim3 grid = dim3(tmin(128, (probelength + TpB - 1) / TpB), npositions, nframes);
 
 	float2* d_grad;
-	cudaMalloc((void**)&d_grad, npositions * nframes * grid.x * sizeof(float2));
+	PoolMalloc((void**)&d_grad, npositions * nframes * grid.x * sizeof(float2));
 	float2* d_gradreduced;
-	cudaMalloc((void**)&d_gradreduced, npositions * nframes * sizeof(float2));
+	PoolMalloc((void**)&d_gradreduced, npositions * nframes * sizeof(float2));
 
-	ParticleShiftGetGradKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, d_invsigma, length, probelength, d_shifts, d_grad);
+	ParticleShiftGetGradKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, d_invsigma, length, probelength, d_shifts, d_grad);
 
 	float2* h_grad2 = (float2*)MallocFromDeviceArray(d_grad, npositions * nframes * grid.x * sizeof(float2));
 	free(h_grad2);
@@ -235,11 +231,11 @@ __declspec(dllexport) void ParticleShiftGetGrad(float2* d_phase,
 	d_DivideByScalar((float*)d_gradreduced, (float*)d_gradreduced, npositions * nframes * 2, (float)grid.x);
 	cudaMemcpy(h_grad, d_gradreduced, npositions * nframes * sizeof(float2), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_gradreduced);
-	cudaFree(d_grad);
+	PoolFree(d_gradreduced);
+	PoolFree(d_grad);
 }
 
-__global__ void ParticleShiftGetGradKernel(float2* d_phase, 
+__global__ void ParticleShiftGetGradKernel(const void* d_phase, int precision, 
 									float2* d_average, 
 									float2* d_shiftfactors, 
 									float* d_invsigma,
@@ -252,7 +248,7 @@ __global__ void ParticleShiftGetGradKernel(float2* d_phase,
 	s_grad[threadIdx.x] = make_float2(0.0f, 0.0f);
 
 	uint specid = blockIdx.z * gridDim.y + blockIdx.y;
-	d_phase += specid * length;
+	size_t phaseoffset = (size_t)specid * length;
 	d_average += blockIdx.y * length;
 
 	float2 shift = d_shifts[specid];
@@ -262,7 +258,7 @@ __global__ void ParticleShiftGetGradKernel(float2* d_phase,
 		 id < probelength; 
 		 id += gridDim.x * blockDim.x)
 	{
-		float2 value = d_phase[id];
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
 		float2 average = d_average[id];
 
 		float2 shiftfactors = d_shiftfactors[id];
@@ -310,4 +306,115 @@ __global__ void ParticleShiftGetGradKernel(float2* d_phase,
 
 		d_grad[specid * gridDim.x + blockIdx.x] = gradsum / (float)probelength;
 	}
+}
+
+/*
+
+ParticleShiftGetDiff and ParticleShiftGetGrad in one pass over d_phase. The gradient is analytic,
+d|v - a|^2 / ds = 2 * f * Im(conj(a) * v), i.e. the limit of the central difference used above.
+
+*/
+
+__declspec(dllexport) void ParticleShiftGetDiffAndGrad(void* d_phase, 
+														float2* d_average, 
+														float2* d_shiftfactors, 
+														float* d_invsigma,
+														uint length, 
+														uint probelength,
+														float2* d_shifts,
+														float* h_diff, 
+														float2* h_grad, 
+														uint npositions, 
+														uint nframes,
+														int precision)
+{
+	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
+	dim3 grid = dim3(tmin(128, (probelength + TpB - 1) / TpB), npositions, nframes);
+
+	float* d_diff;
+	PoolMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
+	float* d_diffreduced;
+	PoolMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
+	float2* d_grad;
+	PoolMalloc((void**)&d_grad, npositions * nframes * grid.x * sizeof(float2));
+	float2* d_gradreduced;
+	PoolMalloc((void**)&d_gradreduced, npositions * nframes * sizeof(float2));
+
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+	ParticleShiftGetDiffAndGradKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, d_invsigma, length, probelength, d_shifts, d_diff, d_grad);
+
+	// Same scaling as ParticleShiftGetDiff and ParticleShiftGetGrad
+	d_SumMonolithic(d_diff, d_diffreduced, grid.x, npositions * nframes);
+	d_DivideByScalar(d_diffreduced, d_diffreduced, npositions * nframes, (float)grid.x);
+	d_SumMonolithic(d_grad, d_gradreduced, grid.x, npositions * nframes);
+	d_DivideByScalar((float*)d_gradreduced, (float*)d_gradreduced, npositions * nframes * 2, (float)grid.x);
+	cudaMemcpy(h_diff, d_diffreduced, npositions * nframes * sizeof(float), cudaMemcpyDeviceToHost);
+	cudaMemcpy(h_grad, d_gradreduced, npositions * nframes * sizeof(float2), cudaMemcpyDeviceToHost);
+	
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_gradreduced);
+	PoolFree(d_grad);
+	PoolFree(d_diffreduced);
+	PoolFree(d_diff);
+}
+
+__global__ void ParticleShiftGetDiffAndGradKernel(const void* d_phase, int precision, 
+													float2* d_average, 
+													float2* d_shiftfactors, 
+													PhaseRampView ramps,
+													float* d_invsigma,
+													uint length, 
+													uint probelength, 
+													float2* d_shifts, 
+													float* d_diff,
+													float2* d_grad)
+{
+	__shared__ float s_diff[SHIFT_THREADS];
+	__shared__ float2 s_grad[SHIFT_THREADS];
+
+	uint specid = blockIdx.z * gridDim.y + blockIdx.y;
+	size_t phaseoffset = (size_t)specid * length;
+	d_average += blockIdx.y * length;
+
+	float2 shift = d_shifts[specid];
+	float diffsum = 0.0f;
+	float2 gradsum = make_float2(0.0f, 0.0f);
+
+	for (uint id = blockIdx.x * blockDim.x + threadIdx.x; 
+		 id < probelength; 
+		 id += gridDim.x * blockDim.x)
+	{
+		float2 average = d_average[id];
+		float2 shiftfactors = d_shiftfactors[id];
+		float invsigma = d_invsigma[id];
+
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
+		float2 value = cmul(d_LoadComplex(d_phase, precision, phaseoffset + id), change);
+
+		float2 diff = value - average;
+		diffsum += (diff.x * diff.x + diff.y * diff.y) * invsigma;
+
+		float common = 2.0f * (average.x * value.y - average.y * value.x) * invsigma;
+		gradsum.x += common * shiftfactors.x;
+		gradsum.y += common * shiftfactors.y;
+	}
+
+	s_diff[threadIdx.x] = diffsum;
+	s_grad[threadIdx.x] = gradsum;
+	__syncthreads();
+
+	if (threadIdx.x == 0)
+	{
+		for (uint id = 1; id < blockDim.x; id++)
+		{
+			diffsum += s_diff[id];
+			gradsum = gradsum + s_grad[id];
+		}
+
+		d_diff[specid * gridDim.x + blockIdx.x] = diffsum / (float)probelength;
+		d_grad[specid * gridDim.x + blockIdx.x] = gradsum / (float)probelength;
+	}
 }
\ No newline at end of file
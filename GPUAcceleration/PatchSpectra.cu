@@ -0,0 +1,159 @@
+#include "Functions.h"
+using namespace gtom;
+
+#define PATCH_THREADS 128
+
+__global__ void PatchExtractKernel(float* d_frames, int2 dimsframe, int3* d_origins, int norigins, bool originsperframe, uint firstitem, int2 dimsregion, bool normalize, float* d_window, float scale, bool fftshift, float* d_patches);
+__global__ void PatchGatherKernel(float2* d_spectra, size_t* d_gather, uint n, size_t elements, void* d_output, int precision, size_t first, uint npatches);
+
+/*
+
+Patch spectra for CreateShift, CreateParticleShift and CreateParticleSpectra. One kernel extracts a batch of
+patches from any number of frames and normalizes, windows, scales and FFT-shifts them as the caller asks, the batch
+is transformed with a cached plan, and another kernel gathers the relevant components straight into the output,
+in its storage precision. Callers go through their items a batch at a time, so the scratch memory is bounded by
+the batch size rather than the number of regions.
+
+Items are numbered frame by frame: item i is origin i % norigins in frame i / norigins.
+
+*/
+
+// Inverse of RemapHalfFFT2Half, which is its own inverse; out of range indices stay out of range
+std::vector<size_t> PatchSpectrumGatherIndices(const size_t* h_indices, uint n, int2 dimsregion)
+{
+	int xhalf = dimsregion.x / 2;
+	size_t elements = ElementsFFT2(dimsregion);
+
+	std::vector<size_t> gather(n);
+	for (uint i = 0; i < n; i++)
+	{
+		size_t index = h_indices[i];
+		if (index >= elements)
+		{
+			gather[i] = index;
+			continue;
+		}
+
+		int rx = (int)(index % (xhalf + 1));
+		int ry = (int)(index / (xhalf + 1));
+		int x = xhalf - rx;
+		int y = (dimsregion.y + dimsregion.y / 2 - ry) % dimsregion.y;
+
+		gather[i] = (size_t)y * (xhalf + 1) + x;
+	}
+
+	return gather;
+}
+
+void d_PatchExtract(float* d_frames, int2 dimsframe, int3* d_origins, int norigins, bool originsperframe, uint firstitem, uint nitems, int2 dimsregion, bool normalize, float* d_window, float scale, bool fftshift, float* d_patches)
+{
+	PatchExtractKernel <<<nitems, PATCH_THREADS>>> (d_frames, dimsframe, d_origins, norigins, originsperframe, firstitem, dimsregion, normalize, d_window, scale, fftshift, d_patches);
+}
+
+void d_PatchGather(float2* d_spectra, size_t* d_gather, uint n, int2 dimsregion, uint npatches, void* d_output, int precision, size_t first)
+{
+	int TpB = 256;
+	dim3 grid = dim3(tmin(8192, ((int)(n * npatches) + TpB - 1) / TpB), 1, 1);
+	PatchGatherKernel <<<grid, TpB>>> (d_spectra, d_gather, n, ElementsFFT2(dimsregion), d_output, precision, first, npatches);
+}
+
+__global__ void PatchExtractKernel(float* d_frames, int2 dimsframe, int3* d_origins, int norigins, bool originsperframe, uint firstitem, int2 dimsregion, bool normalize, float* d_window, float scale, bool fftshift, float* d_patches)
+{
+	__shared__ float s_sums1[PATCH_THREADS];
+	__shared__ float s_sums2[PATCH_THREADS];
+	__shared__ float s_mean, s_scale;
+
+	uint item = firstitem + blockIdx.x;
+	uint elements = dimsregion.x * dimsregion.y;
+	float* d_frame = d_frames + (size_t)dimsframe.x * dimsframe.y * (item / norigins);
+	int3 origin = d_origins[originsperframe ? item : item % norigins];
+	float* d_patch = d_patches + (size_t)elements * blockIdx.x;
+
+	float sum1 = 0.0f, sum2 = 0.0f;
+	for (uint i = threadIdx.x; i < elements; i += blockDim.x)
+	{
+		int x = i % dimsregion.x, y = i / dimsregion.x;
+		int xx = ((x + origin.x) % dimsframe.x + dimsframe.x) % dimsframe.x;
+		int yy = ((y + origin.y) % dimsframe.y + dimsframe.y) % dimsframe.y;
+
+		float value = d_frame[(size_t)yy * dimsframe.x + xx];
+		d_patch[i] = value;
+		sum1 += value;
+		sum2 += value * value;
+	}
+
+	if (normalize)
+	{
+		s_sums1[threadIdx.x] = sum1;
+		s_sums2[threadIdx.x] = sum2;
+		__syncthreads();
+
+		if (threadIdx.x == 0)
+		{
+			for (int i = 1; i < PATCH_THREADS; i++)
+			{
+				sum1 += s_sums1[i];
+				sum2 += s_sums2[i];
+			}
+
+			float mean = sum1 / (float)elements;
+			float stddev = sqrt(tmax(0.0f, sum2 / (float)elements - mean * mean));
+			s_mean = mean;
+			s_scale = stddev > 0.0f ? 1.0f / stddev : 0.0f;
+		}
+		__syncthreads();
+	}
+
+	float mean = normalize ? s_mean : 0.0f;
+	float factor = normalize ? s_scale * scale : scale;
+
+	// Every thread goes back over its own elements, no need to sync; shifting needs a copy though
+	if (!fftshift)
+	{
+		for (uint i = threadIdx.x; i < elements; i += blockDim.x)
+			d_patch[i] = (d_patch[i] - mean) * factor * (d_window != NULL ? d_window[i] : 1.0f);
+	}
+	else
+	{
+		__syncthreads();
+
+		// Swap quadrants pairwise, each pair is handled by the thread that owns the first element
+		for (uint i = threadIdx.x; i < elements; i += blockDim.x)
+		{
+			int x = i % dimsregion.x, y = i / dimsregion.x;
+			int sx = (x + dimsregion.x / 2) % dimsregion.x, sy = (y + dimsregion.y / 2) % dimsregion.y;
+			uint source = sy * dimsregion.x + sx;
+			if (source < i)
+				continue;
+
+			float a = (d_patch[i] - mean) * factor * (d_window != NULL ? d_window[i] : 1.0f);
+			float b = (d_patch[source] - mean) * factor * (d_window != NULL ? d_window[source] : 1.0f);
+			d_patch[i] = b;
+			d_patch[source] = a;
+		}
+	}
+}
+
+__global__ void PatchGatherKernel(float2* d_spectra, size_t* d_gather, uint n, size_t elements, void* d_output, int precision, size_t first, uint npatches)
+{
+	for (uint id = blockIdx.x * blockDim.x + threadIdx.x; id < n * npatches; id += gridDim.x * blockDim.x)
+	{
+		uint patch = id / n;
+		size_t index = d_gather[id % n];
+		float2 value = index < elements ? d_spectra[elements * patch + index] : make_float2(0.0f, 0.0f);
+
+		size_t o = first + id;
+		if (precision == STORAGE_FP16)
+			((half2*)d_output)[o] = __floats2half2_rn(value.x, value.y);
+		else if (precision == STORAGE_BF16)
+		{
+			uint bits[2] = { __float_as_uint(value.x), __float_as_uint(value.y) };
+			for (int c = 0; c < 2; c++)
+				bits[c] = (bits[c] & 0x7fffffff) > 0x7f800000 ? bits[c] | 0x400000 : bits[c] + 0x7fff + ((bits[c] >> 16) & 1);
+
+			((uint*)d_output)[o] = (bits[0] >> 16) | (bits[1] & 0xffff0000);
+		}
+		else
+			((float2*)d_output)[o] = value;
+	}
+}
@@ -0,0 +1,413 @@
+#include "Functions.h"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+using namespace gtom;
+
+/*
+
+Phase ramps exp(i * factors . shift) for the Fourier-space shifts in frame alignment, particle alignment,
+polishing and tilt series refinement.
+
+All of these build their shift factors as (kx, ky) * step on an integer lattice, so every ramp is the product
+of one entry from a row table exp(i * kx * step * shift.x) and one from a column table exp(i * ky * step * shift.y).
+Tables are built in double precision by complex rotation, a few hundred entries per shift instead of one
+sincos per Fourier component.
+
+CreatePhaseRamps registers a set of factors (i.e. a mask in a box of given dimensions) under the address of
+its device copy. Exports that get passed that address look the set up and use tables for the requested shifts,
+which are cached: an optimizer's line search asks for the same shifts many times. The memory pool can hand the
+same address to a different buffer once the registered one is freed, so freeing an address (PoolFree, or
+FreeDevice on the CPU) takes its set out of the registry. Factors that were never
+registered (or aren't on a lattice) are evaluated with sincos per element, as before. The CPU backend can
+read the factors directly, so there unregistered factors still get tables, just without the cache.
+
+*/
+
+PhaseRampLattice GetPhaseRampLattice(float2* h_shiftfactors, uint n)
+{
+    PhaseRampLattice lattice;
+    lattice.separable = false;
+    lattice.step = 0;
+    lattice.kxmin = lattice.kymin = 0;
+    lattice.nx = lattice.ny = 1;
+
+    // The smallest non-zero factor is the lattice step
+    double step = 1e30;
+    for (uint i = 0; i < n; i++)
+    {
+        if (h_shiftfactors[i].x != 0)
+            step = tmin(step, (double)abs(h_shiftfactors[i].x));
+        if (h_shiftfactors[i].y != 0)
+            step = tmin(step, (double)abs(h_shiftfactors[i].y));
+    }
+    if (n == 0 || step == 1e30)
+        return lattice;
+
+    lattice.indices.resize(n);
+    std::vector<int> ix(n), iy(n);
+
+    int kxmax = 0, kymax = 0;
+    for (uint i = 0; i < n; i++)
+    {
+        double fx = h_shiftfactors[i].x / step, fy = h_shiftfactors[i].y / step;
+        int kx = (int)floor(fx + 0.5), ky = (int)floor(fy + 0.5);
+        if (abs(fx - kx) > 1e-3 || abs(fy - ky) > 1e-3 || abs(kx) > 1 << 14 || abs(ky) > 1 << 14)
+            return lattice;
+
+        ix[i] = kx;
+        iy[i] = ky;
+        lattice.kxmin = tmin(lattice.kxmin, kx);
+        lattice.kymin = tmin(lattice.kymin, ky);
+        kxmax = tmax(kxmax, kx);
+        kymax = tmax(kymax, ky);
+    }
+
+    // Column index in the upper 16 bits, row index in the lower
+    for (uint i = 0; i < n; i++)
+        lattice.indices[i] = ((uint)(iy[i] - lattice.kymin) << 16) | (uint)(ix[i] - lattice.kxmin);
+
+    lattice.separable = true;
+    lattice.step = step;
+    lattice.nx = kxmax - lattice.kxmin + 1;
+    lattice.ny = kymax - lattice.kymin + 1;
+
+    return lattice;
+}
+
+// table[k] = exp(i * (kmin + k) * angle), by repeated rotation in double precision, re-anchored every 64 steps
+static void PhaseRampTable(double angle, int kmin, int n, float2* h_table)
+{
+    double rotx = cos(angle), roty = sin(angle);
+    double x = 0, y = 0;
+
+    for (int k = 0; k < n; k++)
+    {
+        if (k % 64 == 0)
+        {
+            x = cos((kmin + k) * angle);
+            y = sin((kmin + k) * angle);
+        }
+        else
+        {
+            double nx = x * rotx - y * roty;
+            y = x * roty + y * rotx;
+            x = nx;
+        }
+
+        h_table[k] = make_float2((float)x, (float)y);
+    }
+}
+
+void GetPhaseRampTables(const PhaseRampLattice &lattice, float2 shift, float2* h_tables)
+{
+    if (!lattice.separable)
+        return;
+
+    PhaseRampTable(lattice.step * shift.x, lattice.kxmin, lattice.nx, h_tables);
+    PhaseRampTable(lattice.step * shift.y, lattice.kymin, lattice.ny, h_tables + lattice.nx);
+}
+
+void GetPhaseRamps(const PhaseRampView &view, uint shiftid, float2* h_shiftfactors, float2 shift, uint first, uint n, float2* h_output)
+{
+    if (view.nx > 0)
+    {
+        const uint* indices = view.d_lattice + first;
+        const float2* tablex = view.d_tables + view.d_offsets[shiftid];
+        const float2* tabley = tablex + view.nx;
+
+        for (uint i = 0; i < n; i++)
+        {
+            float2 a = tablex[indices[i] & 0xffff], b = tabley[indices[i] >> 16];
+            h_output[i] = make_float2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+        }
+    }
+    else
+    {
+        for (uint i = 0; i < n; i++)
+        {
+            float2 factors = h_shiftfactors[first + i];
+            float phase = factors.x * shift.x + factors.y * shift.y;
+            h_output[i] = make_float2(cos(phase), sin(phase));
+        }
+    }
+}
+
+namespace
+{
+    const int DefaultCachedShifts = 4096;
+
+    struct PhaseRampSet
+    {
+        std::mutex mutex;
+
+        float2* d_shiftfactors;
+        uint length;
+        PhaseRampLattice lattice;
+
+        uint* d_lattice;
+        int capacity;
+        float2* h_tables;           // capacity * (nx + ny), mirrored on the device
+        float2* d_tables;
+        std::vector<uint> h_offsets;
+        uint* d_offsets;
+
+        // Shift (as raw bits) -> slot, most recently used first
+        std::list<std::pair<unsigned long long, int>> recent;
+        std::unordered_map<unsigned long long, std::list<std::pair<unsigned long long, int>>::iterator> slots;
+        int nslotsused;
+
+        long long nhits, nmisses;
+        bool transient;
+    };
+
+    std::mutex RegistryMutex;
+    std::unordered_map<float2*, PhaseRampSet*> Registry;
+    std::atomic<int> RegistrySize(0);    // Lets ForgetPhaseRamps skip the lock on every free while nothing is registered
+
+    size_t TableLength(const PhaseRampSet* set)
+    {
+        return (size_t)set->lattice.nx + set->lattice.ny;
+    }
+
+    void AllocateTables(PhaseRampSet* set, int capacity)
+    {
+        size_t bytes = (size_t)capacity * TableLength(set) * sizeof(float2);
+
+        set->capacity = capacity;
+        set->h_tables = (float2*)MallocAligned(bytes);
+        set->h_offsets.resize(capacity);
+#ifdef WARP_CPU_BACKEND
+        set->d_tables = set->h_tables;
+        set->d_offsets = set->h_offsets.data();
+#else
+        PoolMalloc((void**)&set->d_tables, bytes);
+        PoolMalloc((void**)&set->d_offsets, capacity * sizeof(uint));
+#endif
+
+        set->recent.clear();
+        set->slots.clear();
+        set->nslotsused = 0;
+    }
+
+    void FreeTables(PhaseRampSet* set)
+    {
+#ifndef WARP_CPU_BACKEND
+        PoolFree(set->d_offsets);
+        PoolFree(set->d_tables);
+#endif
+        FreeAligned(set->h_tables);
+    }
+
+    unsigned long long ShiftKey(float2 shift)
+    {
+        unsigned int x, y;
+        memcpy(&x, &shift.x, sizeof(x));
+        memcpy(&y, &shift.y, sizeof(y));
+
+        return ((unsigned long long)x << 32) | y;
+    }
+}
+
+__declspec(dllexport) void* __stdcall CreatePhaseRamps(float2* h_shiftfactors, float2* d_shiftfactors, uint length, int maxshifts)
+{
+    PhaseRampLattice lattice = GetPhaseRampLattice(h_shiftfactors, length);
+    if (!lattice.separable)
+        return NULL;
+
+    PhaseRampSet* set = new PhaseRampSet();
+    set->d_shiftfactors = d_shiftfactors;
+    set->length = length;
+    set->lattice = lattice;
+    set->nhits = set->nmisses = 0;
+    set->transient = false;
+
+#ifdef WARP_CPU_BACKEND
+    set->d_lattice = set->lattice.indices.data();
+#else
+    set->d_lattice = (uint*)PoolMallocFromHostArray(set->lattice.indices.data(), length * sizeof(uint));
+#endif
+
+    AllocateTables(set, maxshifts > 0 ? maxshifts : DefaultCachedShifts);
+
+    std::lock_guard<std::mutex> lock(RegistryMutex);
+    Registry[d_shiftfactors] = set;
+    RegistrySize = (int)Registry.size();
+
+    return set;
+}
+
+__declspec(dllexport) void __stdcall DestroyPhaseRamps(void* ramps)
+{
+    if (ramps == NULL)
+        return;
+
+    PhaseRampSet* set = (PhaseRampSet*)ramps;
+    {
+        std::lock_guard<std::mutex> lock(RegistryMutex);
+        auto found = Registry.find(set->d_shiftfactors);
+        if (found != Registry.end() && found->second == set)
+            Registry.erase(found);
+        RegistrySize = (int)Registry.size();
+    }
+
+    FreeTables(set);
+#ifndef WARP_CPU_BACKEND
+    PoolFree(set->d_lattice);
+#endif
+    delete set;
+}
+
+__declspec(dllexport) void __stdcall PhaseRampsGetStats(void* ramps, long long* h_hits, long long* h_misses)
+{
+    PhaseRampSet* set = (PhaseRampSet*)ramps;
+    std::lock_guard<std::mutex> lock(set->mutex);
+
+    *h_hits = set->nhits;
+    *h_misses = set->nmisses;
+}
+
+// The buffer at d_memory is being freed: its address can come back for other data, so it no longer identifies a set.
+// The set itself stays valid until DestroyPhaseRamps, but lookups by that address take the unregistered path.
+void ForgetPhaseRamps(void* d_memory)
+{
+    if (RegistrySize.load() == 0 || d_memory == NULL)
+        return;
+
+    std::lock_guard<std::mutex> lock(RegistryMutex);
+    Registry.erase((float2*)d_memory);
+    RegistrySize = (int)Registry.size();
+}
+
+bool AcquirePhaseRamps(float2* d_shiftfactors, uint length, float2* d_shifts, uint nshifts, PhaseRampView* view)
+{
+    view->nx = 0;
+    view->d_lattice = NULL;
+    view->d_tables = NULL;
+    view->d_offsets = NULL;
+    view->set = NULL;
+
+    if (nshifts == 0)
+        return false;
+
+    PhaseRampSet* set = NULL;
+    {
+        std::lock_guard<std::mutex> lock(RegistryMutex);
+        auto found = Registry.find(d_shiftfactors);
+        // Callers may use only the first length factors of a set, e.g. ParticleShift's probelength
+        if (found != Registry.end() && length <= found->second->length)
+            set = found->second;
+    }
+
+#ifdef WARP_CPU_BACKEND
+    if (set == NULL)
+    {
+        PhaseRampLattice lattice = GetPhaseRampLattice(d_shiftfactors, length);
+        if (!lattice.separable)
+            return false;
+
+        set = new PhaseRampSet();
+        set->d_shiftfactors = d_shiftfactors;
+        set->length = length;
+        set->lattice = lattice;
+        set->d_lattice = set->lattice.indices.data();
+        set->nhits = set->nmisses = 0;
+        set->transient = true;
+        AllocateTables(set, (int)nshifts);
+    }
+#endif
+    if (set == NULL)
+        return false;
+
+    // Held until ReleasePhaseRamps, so the slots handed out stay valid while kernels use them
+    set->mutex.lock();
+
+    if ((int)nshifts > set->capacity)
+    {
+        FreeTables(set);
+        AllocateTables(set, (int)nshifts);
+    }
+
+#ifdef WARP_CPU_BACKEND
+    float2* h_shifts = d_shifts;
+#else
+    std::vector<float2> shifts(nshifts);
+    cudaMemcpy(shifts.data(), d_shifts, nshifts * sizeof(float2), cudaMemcpyDeviceToHost);
+    float2* h_shifts = shifts.data();
+#endif
+
+    size_t tablelength = TableLength(set);
+    int firstdirty = set->capacity, lastdirty = -1;
+
+    for (uint i = 0; i < nshifts; i++)
+    {
+        unsigned long long key = ShiftKey(h_shifts[i]);
+        auto found = set->slots.find(key);
+
+        int slot;
+        if (found != set->slots.end())
+        {
+            // Move to the front, so it won't be evicted while this request is served
+            set->recent.splice(set->recent.begin(), set->recent, found->second);
+            slot = found->second->second;
+            set->nhits++;
+        }
+        else
+        {
+            if (set->nslotsused < set->capacity)
+                slot = set->nslotsused++;
+            else
+            {
+                slot = set->recent.back().second;
+                set->slots.erase(set->recent.back().first);
+                set->recent.pop_back();
+            }
+
+            set->recent.push_front(std::make_pair(key, slot));
+            set->slots[key] = set->recent.begin();
+
+            GetPhaseRampTables(set->lattice, h_shifts[i], set->h_tables + slot * tablelength);
+            firstdirty = tmin(firstdirty, slot);
+            lastdirty = tmax(lastdirty, slot);
+            set->nmisses++;
+        }
+
+        set->h_offsets[i] = (uint)(slot * tablelength);
+    }
+
+#ifndef WARP_CPU_BACKEND
+    if (lastdirty >= firstdirty)
+        cudaMemcpy(set->d_tables + firstdirty * tablelength,
+                   set->h_tables + firstdirty * tablelength,
+                   (lastdirty - firstdirty + 1) * tablelength * sizeof(float2),
+                   cudaMemcpyHostToDevice);
+    cudaMemcpy(set->d_offsets, set->h_offsets.data(), nshifts * sizeof(uint), cudaMemcpyHostToDevice);
+#endif
+
+    view->nx = set->lattice.nx;
+    view->d_lattice = set->d_lattice;
+    view->d_tables = set->d_tables;
+    view->d_offsets = set->d_offsets;
+    view->set = set;
+
+    return true;
+}
+
+void ReleasePhaseRamps(PhaseRampView* view)
+{
+    PhaseRampSet* set = (PhaseRampSet*)view->set;
+    if (set != NULL)
+    {
+        set->mutex.unlock();
+        if (set->transient)
+        {
+            FreeTables(set);
+            delete set;
+        }
+    }
+
+    view->set = NULL;
+    view->nx = 0;
+}
@@ -4,33 +4,107 @@ using namespace gtom;
 
 #define SHIFT_THREADS 128
 
-__global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float2* d_ctfcoords, CTFParamsLean* d_ctfparams, float* d_invsigma, uint length, float2* d_shifts, float* d_diff, float* d_debugdiff);
+__global__ void PolishingGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, float2* d_ctfcoords, CTFParamsLean* d_ctfparams, float* d_invsigma, uint length, float2* d_shifts, float* d_diff, float* d_debugdiff);
+__global__ void PolishingSumFramesKernel(float* d_particles, size_t framestride, size_t elements, int firstframe, int nframes, float* d_frameweights, float* d_sum);
+
+
+/*
+
+Polishing works on sums of frame groups. A group is a range of consecutive frames, and ranges can have any
+length and may overlap, e.g. shorter groups for the first, least damaged frames, or a sliding window. Each
+frame can additionally be weighted, e.g. by its dose. Every group sum is masked with a soft sphere, transformed
+and cropped to dimscropped.
+
+Particles go through this in batches of up to batchsize (POLISHING_BATCH if 0), so the scratch memory
+depends on the batch, not on the number of particles.
+
+Layouts: d_particles holds nparticles particles per frame, frame after frame; d_particlesft holds nparticles
+transforms per group, group after group, stored with the given STORAGE_* precision, which PolishingGetDiff
+takes for d_phase.
+
+*/
+
+__declspec(dllexport) void CreatePolishingGroups(float* d_particles,
+												void* d_particlesft,
+												int2 dims,
+												int2 dimscropped,
+												int nparticles,
+												int nframes,
+												int* h_groupfirst,
+												int* h_grouplength,
+												int ngroups,
+												float* h_frameweights,
+												float maskradius,
+												float maskfalloff,
+												int batchsize,
+												int precision)
+{
+	batchsize = batchsize > 0 ? tmin(batchsize, nparticles) : tmin(POLISHING_BATCH, nparticles);
 
+	float* d_frameweights = NULL;
+	if (h_frameweights != NULL)
+		d_frameweights = (float*)PoolMallocFromHostArray(h_frameweights, nframes * sizeof(float));
 
-__declspec(dllexport) void CreatePolishing(float* d_particles, float2* d_particlesft, float* d_masks, int2 dims, int2 dimscropped, int nparticles, int nframes)
-{
 	float* d_temp;
-	cudaMalloc((void**)&d_temp, ElementsFFT2(dims) * nparticles * sizeof(float2));
+	PoolMalloc((void**)&d_temp, ElementsFFT2(dims) * batchsize * sizeof(float2));
+	float2* d_tempcropped = NULL;
+	if (precision != STORAGE_FP32)
+		PoolMalloc((void**)&d_tempcropped, ElementsFFT2(dimscropped) * batchsize * sizeof(float2));
 
-	for(int z = 0; z < nframes / 3; z++)
+	for (int first = 0; first < nparticles; first += batchsize)
 	{
-		cudaMemcpy(d_temp, d_particles + Elements2(dims) * nparticles * (z * 3 + 0), Elements2(dims) * nparticles * sizeof(float), cudaMemcpyDeviceToDevice);
-		d_AddVector(d_temp, d_particles + Elements2(dims) * nparticles * (z * 3 + 1), d_temp, Elements2(dims) * nparticles);
-		d_AddVector(d_temp, d_particles + Elements2(dims) * nparticles * (z * 3 + 2), d_temp, Elements2(dims) * nparticles);
-
-		//d_NormMonolithic(d_temp, d_temp, Elements2(dims), d_masks, T_NORM_MEAN01STD, nparticles);
-	    //d_MultiplyByVector(d_temp, d_masks, d_temp, Elements2(dims) * nparticles);
-		float radius = 90.0f / (1.0605f / 1.25f);
-		d_SphereMask(d_temp, d_temp, toInt3(dims), &radius, 24, NULL, nparticles);
-		d_RemapFull2FullFFT(d_temp, d_temp, toInt3(dims), nparticles);
-		d_FFTR2C(d_temp, (float2*)d_temp, 2, toInt3(dims), nparticles);
-		d_FFTCrop((float2*)d_temp, d_particlesft + ElementsFFT2(dimscropped) * nparticles * z, toInt3(dims), toInt3(dimscropped), nparticles);
+		int n = tmin(batchsize, nparticles - first);
+
+		for (int g = 0; g < ngroups; g++)
+		{
+			int TpB = 256;
+			dim3 grid = dim3(tmin(8192, (int)((Elements2(dims) * n + TpB - 1) / TpB)), 1, 1);
+			PolishingSumFramesKernel <<<grid, TpB>>> (d_particles + Elements2(dims) * first,
+													   Elements2(dims) * nparticles,
+													   Elements2(dims) * n,
+													   h_groupfirst[g],
+													   h_grouplength[g],
+													   d_frameweights,
+													   d_temp);
+
+			if (maskradius > 0)
+				d_SphereMask(d_temp, d_temp, toInt3(dims), &maskradius, maskfalloff, NULL, n);
+			d_RemapFull2FullFFT(d_temp, d_temp, toInt3(dims), n);
+			d_FFTR2CCached(d_temp, (float2*)d_temp, 2, toInt3(dims), n);
+
+			size_t offset = ElementsFFT2(dimscropped) * ((size_t)nparticles * g + first);
+			if (precision == STORAGE_FP32)
+			{
+				d_FFTCrop((float2*)d_temp, (float2*)d_particlesft + offset, toInt3(dims), toInt3(dimscropped), n);
+			}
+			else
+			{
+				d_FFTCrop((float2*)d_temp, d_tempcropped, toInt3(dims), toInt3(dimscropped), n);
+				SingleToStorage((float*)d_tempcropped, (char*)d_particlesft + offset * 2 * StorageBytes(precision), ElementsFFT2(dimscropped) * n * 2, precision);
+			}
+		}
 	}
 
-	cudaFree(d_temp);
+	if (d_tempcropped != NULL)
+		PoolFree(d_tempcropped);
+	PoolFree(d_temp);
+	if (d_frameweights != NULL)
+		PoolFree(d_frameweights);
 }
 
-__declspec(dllexport) void PolishingGetDiff(float2* d_phase, 
+// Groups of 3 frames, remaining frames are left out
+__declspec(dllexport) void CreatePolishing(float* d_particles, float2* d_particlesft, float* d_masks, int2 dims, int2 dimscropped, int nparticles, int nframes)
+{
+	std::vector<int> groupfirst(nframes / 3), grouplength(nframes / 3, 3);
+	for (int g = 0; g < nframes / 3; g++)
+		groupfirst[g] = g * 3;
+
+	CreatePolishingGroups(d_particles, d_particlesft, dims, dimscropped, nparticles, nframes,
+						  groupfirst.data(), grouplength.data(), nframes / 3, NULL,
+						  90.0f / (1.0605f / 1.25f), 24, 0, STORAGE_FP32);
+}
+
+__declspec(dllexport) void PolishingGetDiff(void* d_phase, 
 												float2* d_average, 
 												float2* d_shiftfactors, 
 												float2* d_ctfcoords,
@@ -41,26 +115,30 @@ __declspec(dllexport) void PolishingGetDiff(float2* d_phase,
 												float* h_diff, 
 												float* h_diffall,
 												uint npositions, 
-												uint nframes)
+												uint nframes,
+												int precision)
 {
 	int TpB = SHIFT_THREADS;
 	dim3 grid = dim3(1, npositions, nframes);
 
 	float* d_diff;
-	cudaMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
+	PoolMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
 	float* d_diffreduced;
-	cudaMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
+	PoolMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
 
 	CTFParamsLean* h_lean = (CTFParamsLean*)malloc(npositions * nframes * sizeof(CTFParamsLean));
 	for (int i = 0; i < npositions * nframes; i++)
 		h_lean[i] = CTFParamsLean(h_ctfparams[i], toInt3(dims));
-	CTFParamsLean* d_lean = (CTFParamsLean*)CudaMallocFromHostArray(h_lean, npositions * nframes * sizeof(CTFParamsLean));
+	CTFParamsLean* d_lean = (CTFParamsLean*)PoolMallocFromHostArray(h_lean, npositions * nframes * sizeof(CTFParamsLean));
 	free(h_lean);
 
 	float* d_debugdiff = NULL;
 	//cudaMalloc((void**)&d_debugdiff, npositions * nframes * ElementsFFT2(dims) * sizeof(float));
 
-	PolishingGetDiffKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, d_ctfcoords, d_lean, d_invsigma, ElementsFFT2(dims), d_shifts, d_diff, d_debugdiff);
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, ElementsFFT2(dims), d_shifts, npositions * nframes, &ramps);
+
+	PolishingGetDiffKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, d_ctfcoords, d_lean, d_invsigma, ElementsFFT2(dims), d_shifts, d_diff, d_debugdiff);
 
 	//d_WriteMRC(d_debugdiff, toInt3(dims.x / 2 + 1, dims.y, npositions * nframes), "d_debugdiff.mrc");
 
@@ -70,9 +148,11 @@ __declspec(dllexport) void PolishingGetDiff(float2* d_phase,
 
 	cudaMemcpy(h_diffall, d_diff, npositions * nframes * sizeof(float), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_lean);
-	cudaFree(d_diffreduced);
-	cudaFree(d_diff);
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_lean);
+	PoolFree(d_diffreduced);
+	PoolFree(d_diff);
 }
 
 /*__global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float2* d_ctfcoords, CTFParamsLean* d_ctfparams, float* d_invsigma, uint length, float2* d_shifts, float* d_diff, float* d_debugdiff)
@@ -132,7 +212,7 @@ __declspec(dllexport) void PolishingGetDiff(float2* d_phase,
 	}
 }*/
 
-__global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float2* d_ctfcoords, CTFParamsLean* d_ctfparams, float* d_invsigma, uint length, float2* d_shifts, float* d_diff, float* d_debugdiff)
+__global__ void PolishingGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, float2* d_ctfcoords, CTFParamsLean* d_ctfparams, float* d_invsigma, uint length, float2* d_shifts, float* d_diff, float* d_debugdiff)
 {
 	__shared__ float s_num[SHIFT_THREADS];
 	s_num[threadIdx.x] = 0.0f;
@@ -142,7 +222,7 @@ __global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float
 	s_denom2[threadIdx.x] = 0.0f;
 
 	uint specid = blockIdx.z * gridDim.y + blockIdx.y;
-	d_phase += specid * length;
+	size_t phaseoffset = (size_t)specid * length;
 	d_average += specid * length;
 	d_debugdiff += specid * length;
 
@@ -155,15 +235,14 @@ __global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float
 		 id < length; 
 		 id += SHIFT_THREADS)
 	{
-		float2 value = d_phase[id];
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
 		float2 average = d_average[id];
 		float ctf = d_GetCTF<false, false>(d_ctfcoords[id].x, d_ctfcoords[id].y, ctfparams);	// Already corrected for mag anisotropy.
 		average *= ctf;
 
 		float2 shiftfactors = d_shiftfactors[id];
 
-		float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-		float2 change = make_float2(__cosf(phase), __sinf(phase));
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
 		value = cuCmulf(value, change);
 
 		float invsigma = d_invsigma[id];
@@ -204,4 +283,16 @@ __global__ void PolishingGetDiffKernel(float2* d_phase, float2* d_average, float
 
 		d_diff[specid * gridDim.x] = numsum / tmax(1e-6f, sqrt(denomsum1 * denomsum2));
 	}
+}
+
+__global__ void PolishingSumFramesKernel(float* d_particles, size_t framestride, size_t elements, int firstframe, int nframes, float* d_frameweights, float* d_sum)
+{
+	for (size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < elements; id += gridDim.x * blockDim.x)
+	{
+		float sum = 0.0f;
+		for (int z = firstframe; z < firstframe + nframes; z++)
+			sum += d_particles[framestride * z + id] * (d_frameweights != NULL ? d_frameweights[z] : 1.0f);
+
+		d_sum[id] = sum;
+	}
 }
\ No newline at end of file
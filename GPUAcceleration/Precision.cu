@@ -0,0 +1,83 @@
+#include "Functions.h"
+using namespace gtom;
+
+/*
+
+fp16 and bf16 storage for spectrum and phase buffers. Kernels read them through d_LoadComplex and do all
+arithmetic in fp32. There is no bf16 type in this CUDA version, the conversions work on the float bits with
+the same rounding as the CPU backend.
+
+*/
+
+__global__ void SingleToStorageKernel(float* d_source, void* d_dest, size_t elements, int precision);
+__global__ void StorageToSingleKernel(void* d_source, float* d_dest, size_t elements, int precision);
+
+__declspec(dllexport) void* __stdcall MallocDeviceStorage(long elements, int precision)
+{
+	void* d_memory;
+	PoolMalloc(&d_memory, (size_t)elements * StorageBytes(precision));
+
+	return d_memory;
+}
+
+__declspec(dllexport) void __stdcall SingleToStorage(float* d_source, void* d_dest, long elements, int precision)
+{
+	if (precision == STORAGE_FP32)
+	{
+		if ((void*)d_source != d_dest)
+			cudaMemcpy(d_dest, d_source, (size_t)elements * sizeof(float), cudaMemcpyDeviceToDevice);
+		return;
+	}
+
+	int TpB = 256;
+	dim3 grid = dim3((uint)tmin((size_t)8192, ((size_t)elements + TpB - 1) / TpB), 1, 1);
+	SingleToStorageKernel <<<grid, TpB>>> (d_source, d_dest, elements, precision);
+}
+
+__declspec(dllexport) void __stdcall StorageToSingle(void* d_source, float* d_dest, long elements, int precision)
+{
+	if (precision == STORAGE_FP32)
+	{
+		if (d_source != (void*)d_dest)
+			cudaMemcpy(d_dest, d_source, (size_t)elements * sizeof(float), cudaMemcpyDeviceToDevice);
+		return;
+	}
+
+	int TpB = 256;
+	dim3 grid = dim3((uint)tmin((size_t)8192, ((size_t)elements + TpB - 1) / TpB), 1, 1);
+	StorageToSingleKernel <<<grid, TpB>>> (d_source, d_dest, elements, precision);
+}
+
+// Grid-stride loops: the grid is capped, so buffers beyond 2^31 elements are covered too
+__global__ void SingleToStorageKernel(float* d_source, void* d_dest, size_t elements, int precision)
+{
+	for (size_t id = (size_t)blockIdx.x * blockDim.x + threadIdx.x; id < elements; id += (size_t)gridDim.x * blockDim.x)
+	{
+		float value = d_source[id];
+
+		if (precision == STORAGE_FP16)
+			((half*)d_dest)[id] = __float2half(value);
+		else
+		{
+			// Round to nearest even, NaN stays NaN
+			uint bits = __float_as_uint(value);
+			if ((bits & 0x7fffffff) > 0x7f800000)
+				bits |= 0x400000;
+			else
+				bits += 0x7fff + ((bits >> 16) & 1);
+
+			((unsigned short*)d_dest)[id] = (unsigned short)(bits >> 16);
+		}
+	}
+}
+
+__global__ void StorageToSingleKernel(void* d_source, float* d_dest, size_t elements, int precision)
+{
+	for (size_t id = (size_t)blockIdx.x * blockDim.x + threadIdx.x; id < elements; id += (size_t)gridDim.x * blockDim.x)
+	{
+		if (precision == STORAGE_FP16)
+			d_dest[id] = __half2float(((half*)d_source)[id]);
+		else
+			d_dest[id] = __uint_as_float((uint)((unsigned short*)d_source)[id] << 16);
+	}
+}
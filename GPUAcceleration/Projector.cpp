@@ -1,30 +1,374 @@
 #include "Functions.h"
 #include "liblion.h"
+#include <fftw3.h>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <atomic>
 using namespace gtom;
 
+namespace
+{
+    int ReconstructionThreads = 0;              // 0 = all processors
+    long long ReconstructionMemoryBudget = 0;   // 0 = keep the padded grid in memory
+    std::string ReconstructionScratchDir;
+
+    int GetReconstructionThreads()
+    {
+        return ReconstructionThreads > 0 ? ReconstructionThreads : tmax(1, (int)std::thread::hardware_concurrency());
+    }
+}
+
+__declspec(dllexport) void __stdcall SetReconstructionOptions(int nthreads, long long memorybudget, char* c_scratchdir)
+{
+    ReconstructionThreads = tmax(0, nthreads);
+    ReconstructionMemoryBudget = tmax(0LL, memorybudget);
+    ReconstructionScratchDir = c_scratchdir != NULL ? std::string(c_scratchdir) : std::string();
+}
+
+/*
+
+Prepared projector maps can be kept in a directory, named after a hash of the volume's contents, its size
+and the oversampling. Repeated runs on the same reference then read the map instead of computing it.
+Files are written under a temporary name and renamed, so concurrent processes never see half a map.
+Both backends compute the map the same way (see ComputeFourierMap). The key also has the format version,
+which must be bumped whenever the map's computation or the file layout changes.
+
+*/
+
+namespace
+{
+    std::string ProjectorCacheDir;              // Empty = no caching
+    const int ProjectorCacheFormat = 3;
+
+    struct ProjectorCacheHeader
+    {
+        char magic[8];
+        int format;
+        int3 dims;
+        int oversampling;
+        unsigned long long hash;
+        unsigned long long elements;
+    };
+
+    const char ProjectorCacheMagic[8] = { 'W', 'P', 'R', 'J', 'M', 'A', 'P', '3' };
+
+    inline unsigned long long HashMix(unsigned long long hash, unsigned long long value)
+    {
+        hash = (hash ^ value) * 0x9E3779B97F4A7C15ULL;
+        return hash ^ (hash >> 29);
+    }
+
+    // Chunks are hashed in parallel, their hashes combined in order, so the result doesn't depend on threads
+    unsigned long long HashVolume(const float* h_data, size_t elements, int nthreads)
+    {
+        const size_t ChunkElements = (size_t)1 << 20;
+        size_t nchunks = (elements + ChunkElements - 1) / ChunkElements;
+        std::vector<unsigned long long> chunkhashes(nchunks);
+
+        #pragma omp parallel for num_threads(nthreads)
+        for (long long c = 0; c < (long long)nchunks; c++)
+        {
+            const unsigned int* h_chunk = (const unsigned int*)(h_data + c * ChunkElements);
+            size_t n = tmin(ChunkElements, elements - (size_t)c * ChunkElements);
+
+            unsigned long long hash = 0xCBF29CE484222325ULL;
+            for (size_t i = 0; i < n; i++)
+                hash = HashMix(hash, h_chunk[i]);
+
+            chunkhashes[c] = hash;
+        }
+
+        unsigned long long hash = HashMix(0xCBF29CE484222325ULL, elements);
+        for (size_t c = 0; c < nchunks; c++)
+            hash = HashMix(hash, chunkhashes[c]);
+
+        return hash;
+    }
+
+    std::string ProjectorCachePath(unsigned long long hash, int3 dims, int oversampling)
+    {
+        char name[128];
+        sprintf(name, "projector_%016llx_%dx%dx%d_os%d_v%d.bin", hash, dims.x, dims.y, dims.z, oversampling, ProjectorCacheFormat);
+
+        std::string path = ProjectorCacheDir;
+        if (path.back() != '/' && path.back() != '\\')
+            path += "/";
+
+        return path + name;
+    }
+
+    bool ReadCachedProjector(const std::string &path, unsigned long long hash, int3 dims, int oversampling, float2* h_output, size_t elements)
+    {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == NULL)
+            return false;
+
+        ProjectorCacheHeader header;
+        bool success = fread(&header, sizeof(header), 1, file) == 1 &&
+                       memcmp(header.magic, ProjectorCacheMagic, sizeof(header.magic)) == 0 &&
+                       header.format == ProjectorCacheFormat &&
+                       header.hash == hash &&
+                       header.dims.x == dims.x && header.dims.y == dims.y && header.dims.z == dims.z &&
+                       header.oversampling == oversampling &&
+                       header.elements == elements &&
+                       fread(h_output, sizeof(float2), elements, file) == elements;
+
+        fclose(file);
+        return success;
+    }
+
+    void WriteCachedProjector(const std::string &path, unsigned long long hash, int3 dims, int oversampling, const float2* h_data, size_t elements)
+    {
+        static std::atomic<int> counter(0);
+
+        char suffix[64];
+        sprintf(suffix, ".%p.%d.tmp", (void*)&suffix, counter++);
+        std::string temppath = path + suffix;
+
+        FILE* file = fopen(temppath.c_str(), "wb");
+        if (file == NULL)
+            return;
+
+        ProjectorCacheHeader header;
+        memcpy(header.magic, ProjectorCacheMagic, sizeof(header.magic));
+        header.format = ProjectorCacheFormat;
+        header.dims = dims;
+        header.oversampling = oversampling;
+        header.hash = hash;
+        header.elements = elements;
+
+        bool success = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                       fwrite(h_data, sizeof(float2), elements, file) == elements;
+        success = fclose(file) == 0 && success;
+
+        // Someone else may have been faster, their map is just as good
+        if (!success || rename(temppath.c_str(), path.c_str()) != 0)
+            remove(temppath.c_str());
+    }
+}
+
+__declspec(dllexport) void __stdcall SetProjectorCacheDirectory(char* c_directory)
+{
+    ProjectorCacheDir = c_directory != NULL ? std::string(c_directory) : std::string();
+}
+
+/*
+
+RELION's Projector::computeFourierTransformMap without the intermediate copies: the caller's volume is
+gridding-corrected and padded one plane at a time, and the planes' 2D transforms are parked in the output
+buffer, each at the row and x position its frequencies end up at. The transforms along z then only touch
+their own column's positions, so they can overwrite the parked values in place and write the final layout
+directly. Apart from one plane per thread, no memory is needed beyond the caller's two buffers.
+Both backends use it, with FFTW plans from the plan cache.
+
+*/
+
+namespace
+{
+    void ComputeFourierMap(float* h_volume, int3 dims, int oversampling, float2* h_projectordata, int nthreads)
+    {
+        int ori = dims.x;
+        int rmax = oversampling * (ori / 2);
+        int maxr2 = rmax * rmax;
+        int h = rmax + 1, n = 2 * h + 1, xh = h + 1;
+        int P = oversampling * ori, Pxh = P / 2 + 1;
+
+        // Forward transforms are unnormalized, RELION's are normalized by P^3 and then scaled by oversampling^3
+        float scale = 1.0f / ((float)ori * ori * ori);
+
+        auto Output = [&](int z, int y, int x) -> float2&
+        {
+            return h_projectordata[((size_t)z * n + y) * xh + x];
+        };
+
+        // Rows in the output for every row of a P x P transform, -1 for ky = -P / 2, which RELION doesn't keep
+        std::vector<int> outputrows(P);
+        for (int y = 0; y < P; y++)
+        {
+            int ky = y < P / 2 + 1 ? y : y - P;
+            outputrows[y] = ky > -P / 2 ? ky + h : -1;
+        }
+
+        fftwf_plan planforwplane = (fftwf_plan)AcquireFFTPlan(FFTPLAN_HOST | FFTPLAN_R2C, 2, toInt3(P, P, 1));
+        fftwf_plan planforwline = (fftwf_plan)AcquireFFTPlan(FFTPLAN_C2C_FORWARD, 1, toInt3(P, 1, 1));
+
+        // Gridding pre-correction, padding and 2D transform of every plane, parked at output plane z
+        #pragma omp parallel num_threads(nthreads)
+        {
+            std::vector<float> plane((size_t)P * P);
+            std::vector<float2> planeft((size_t)P * Pxh);
+
+            #pragma omp for schedule(dynamic)
+            for (int z = 0; z < ori; z++)
+            {
+                int cz = z - ori / 2;
+                memset(plane.data(), 0, plane.size() * sizeof(float));
+
+                for (int y = 0; y < ori; y++)
+                {
+                    int cy = y - ori / 2;
+                    float* h_row = h_volume + ((size_t)z * ori + y) * ori;
+                    float* h_planerow = plane.data() + (size_t)((cy + P) % P) * P;
+
+                    for (int x = 0; x < ori; x++)
+                    {
+                        int cx = x - ori / 2;
+                        float val = h_row[x];
+
+                        float r = sqrt((float)(cx * cx + cy * cy + cz * cz));
+                        if (r > 0)
+                        {
+                            float rval = r / (ori * oversampling);
+                            float sinc = sin(PI * rval) / (PI * rval);
+                            val /= sinc * sinc;
+                        }
+
+                        h_planerow[(cx + P) % P] = val;
+                    }
+                }
+
+                fftwf_execute_dft_r2c(planforwplane, plane.data(), (fftwf_complex*)planeft.data());
+
+                for (int y = 0; y < P; y++)
+                    if (outputrows[y] >= 0)
+                        memcpy(&Output(z, outputrows[y], 0), planeft.data() + (size_t)y * Pxh, Pxh * sizeof(float2));
+            }
+        }
+
+        // Transforms along z, written over the parked planes; everything outside the sphere is zeroed
+        #pragma omp parallel num_threads(nthreads)
+        {
+            std::vector<float2> column(P);
+
+            #pragma omp for schedule(dynamic)
+            for (int y = 0; y < n; y++)
+            {
+                int ky = y - h;
+                bool haveky = ky > -P / 2 && ky <= P / 2;
+
+                for (int x = 0; x < xh; x++)
+                {
+                    if (!haveky || x >= Pxh)
+                    {
+                        for (int z = 0; z < n; z++)
+                            Output(z, y, x) = make_float2(0, 0);
+                        continue;
+                    }
+
+                    for (int zp = 0; zp < P; zp++)
+                        column[zp] = make_float2(0, 0);
+                    for (int z = 0; z < ori; z++)
+                        column[(z - ori / 2 + P) % P] = Output(z, y, x);
+
+                    fftwf_execute_dft(planforwline, (fftwf_complex*)column.data(), (fftwf_complex*)column.data());
+
+                    for (int z = 0; z < n; z++)
+                    {
+                        int kz = z - h;
+                        bool inside = kz > -P / 2 && kz <= P / 2 && x * x + ky * ky + kz * kz <= maxr2;
+
+                        Output(z, y, x) = inside ? column[(kz + P) % P] * scale : make_float2(0, 0);
+                    }
+                }
+            }
+        }
+
+        ReleaseFFTPlan((size_t)planforwline);
+        ReleaseFFTPlan((size_t)planforwplane);
+    }
+}
+
 __declspec(dllexport) void __stdcall InitProjector(int3 dims, int oversampling, float* h_data, float* h_initialized)
 {
-    relion::MultidimArray<float> dummy;
-    relion::MultidimArray<float> vol;
-    vol.initZeros(dims.z, dims.y, dims.x);
+    int nthreads = GetReconstructionThreads();
+
+    int n = 2 * (oversampling * (dims.x / 2) + 1) + 1;
+    size_t elements = (size_t)(n / 2 + 1) * n * n;
+
+    unsigned long long hash = 0;
+    std::string cachepath;
+    if (!ProjectorCacheDir.empty())
+    {
+        hash = HashVolume(h_data, Elements(dims), nthreads);
+        cachepath = ProjectorCachePath(hash, dims, oversampling);
+
+        if (ReadCachedProjector(cachepath, hash, dims, oversampling, (float2*)h_initialized, elements))
+            return;
+    }
+
+    ComputeFourierMap(h_data, dims, oversampling, (float2*)h_initialized, nthreads);
+
+    if (!cachepath.empty())
+        WriteCachedProjector(cachepath, hash, dims, oversampling, (float2*)h_initialized, elements);
+}
+
+#ifdef WARP_CPU_BACKEND
+
+/*
+
+Native gridding reconstruction (Reconstruction.cpp) with RELION's symmetry operators. Threads, and the
+memory budget above which the padded grid moves to a scratch file, come from SetReconstructionOptions.
+The thread count also applies to InitProjector.
+
+*/
+
+__declspec(dllexport) void __stdcall BackprojectorReconstruct(int3 dimsori, int oversampling, float* h_data, float* h_weights, char* c_symmetry, bool do_reconstruct_ctf, float* h_reconstruction)
+{
+    relion::FileName fn_symmetry(c_symmetry);
+    relion::SymList symmetrylist;
+    symmetrylist.read_sym_file(fn_symmetry);
+
+    // Identity first, then every operator as a row-major 3x3 rotation
+    std::vector<float> h_symmetry(9, 0.0f);
+    h_symmetry[0] = h_symmetry[4] = h_symmetry[8] = 1.0f;
+
+    relion::Matrix2D<DOUBLE> L(4, 4), R(4, 4);
+    for (int s = 0; s < symmetrylist.SymsNo(); s++)
+    {
+        symmetrylist.get_matrices(s, L, R);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                h_symmetry.push_back((float)R(i, j));
+    }
+    int nsymmetry = (int)h_symmetry.size() / 9;
+
+    int nthreads = GetReconstructionThreads();
+    std::vector<float> vol(Elements(dimsori));
 
-    for (uint i = 0; i < Elements(dims); i++)
-        vol.data[i] = h_data[i];
+    bool success = h_ReconstructGridding((float2*)h_data, h_weights, dimsori, oversampling, h_symmetry.data(), nsymmetry, 10, vol.data(),
+                                         nthreads, ReconstructionMemoryBudget, ReconstructionScratchDir.c_str());
 
-    relion::Projector projector(dims.x, TRILINEAR, oversampling, 10, 3);
-    projector.computeFourierTransformMap(vol, dummy, 2 * dims.x, 16, true, false, false);
+    // The scratch file couldn't be written, try again in memory
+    if (!success)
+        h_ReconstructGridding((float2*)h_data, h_weights, dimsori, oversampling, h_symmetry.data(), nsymmetry, 10, vol.data(),
+                              nthreads, 0, NULL);
 
-    int3 projectordims = toInt3(XSIZE(projector.data), YSIZE(projector.data), ZSIZE(projector.data));
-    for (uint i = 0; i < Elements(projectordims); i++)
-        ((float2*)h_initialized)[i] = make_float2(projector.data.data[i].real, projector.data.data[i].imag);
+    if (do_reconstruct_ctf)
+    {
+        std::vector<float2> volft(ElementsFFT(dimsori));
+        h_FFTR2C(vol.data(), volft.data(), 3, dimsori);
+
+        // Same scaling as RELION's normalized forward transform times the box size
+        float scale = (float)dimsori.x / (float)Elements(dimsori);
+        h_Abs(volft.data(), h_reconstruction, ElementsFFT(dimsori));
+        h_MultiplyByScalar(h_reconstruction, h_reconstruction, ElementsFFT(dimsori), scale);
+    }
+    else
+    {
+        memcpy(h_reconstruction, vol.data(), Elements(dimsori) * sizeof(float));
+    }
 }
 
+#else
+
 __declspec(dllexport) void __stdcall BackprojectorReconstruct(int3 dimsori, int oversampling, float* h_data, float* h_weights, char* c_symmetry, bool do_reconstruct_ctf, float* h_reconstruction)
 {
     relion::FileName fn_symmetry(c_symmetry);
+    int nthreads = GetReconstructionThreads();
 
     relion::FourierTransformer transformer;
-    transformer.setThreadsNumber(16);
+    transformer.setThreadsNumber(nthreads);
 
     relion::BackProjector backprojector(dimsori.x, 3, fn_symmetry, TRILINEAR, oversampling, 10, 0, 1.9, 15, 2);
     backprojector.initZeros(dimsori.x);
@@ -38,7 +382,7 @@ __declspec(dllexport) void __stdcall BackprojectorReconstruct(int3 dimsori, int
     relion::MultidimArray<float> fsc;
     fsc.resize(dimsori.x / 2 + 1);
 
-    backprojector.reconstruct(vol, 10, false, 1., dummy, dummy, dummy, fsc, 1., false, true, 1, -1);
+    backprojector.reconstruct(vol, 10, false, 1., dummy, dummy, dummy, fsc, 1., false, true, nthreads, -1);
 
     if (do_reconstruct_ctf)
     {
@@ -56,10 +400,22 @@ __declspec(dllexport) void __stdcall BackprojectorReconstruct(int3 dimsori, int
     }
 }
 
+#endif
+
+#ifdef WARP_CPU_BACKEND
+
+__declspec(dllexport) void __stdcall BackprojectorReconstructGPU(int3 dimsori, int3 dimspadded, int oversampling, float2* d_dataft, float* d_weights, bool do_reconstruct_ctf, float* d_result, cufftHandle pre_planforw, cufftHandle pre_planback, cufftHandle pre_planforwctf)
+{
+    // "Device" buffers are host memory on the CPU backend, the native gridding reconstruction does the job
+    BackprojectorReconstruct(dimsori, oversampling, (float*)d_dataft, d_weights, (char*)"C1", do_reconstruct_ctf, d_result);
+}
+
+#else
+
 __declspec(dllexport) void __stdcall BackprojectorReconstructGPU(int3 dimsori, int3 dimspadded, int oversampling, float2* d_dataft, float* d_weights, bool do_reconstruct_ctf, float* d_result, cufftHandle pre_planforw, cufftHandle pre_planback, cufftHandle pre_planforwctf)
 {
     float* d_reconstructed;
-    cudaMalloc((void**)&d_reconstructed, ElementsFFT(dimsori) * sizeof(float2));
+    PoolMalloc((void**)&d_reconstructed, ElementsFFT(dimsori) * sizeof(float2));
 
     d_ReconstructGridding(d_dataft, d_weights, d_reconstructed, dimsori, dimspadded, oversampling, pre_planforw, pre_planback);
 
@@ -68,7 +424,7 @@ __declspec(dllexport) void __stdcall BackprojectorReconstructGPU(int3 dimsori, i
         if (pre_planforwctf > NULL)
             d_FFTR2C(d_reconstructed, (float2*)d_reconstructed, &pre_planforwctf);
         else
-            d_FFTR2C(d_reconstructed, (float2*)d_reconstructed, 3, dimsori);
+            d_FFTR2CCached(d_reconstructed, (float2*)d_reconstructed, 3, dimsori);
         d_Abs((float2*)d_reconstructed, d_result, ElementsFFT(dimsori));
     }
     else
@@ -76,5 +432,7 @@ __declspec(dllexport) void __stdcall BackprojectorReconstructGPU(int3 dimsori, i
         cudaMemcpy(d_result, d_reconstructed, Elements(dimsori) * sizeof(float), cudaMemcpyDeviceToHost);
     }
 
-    cudaFree(d_reconstructed);
-}
\ No newline at end of file
+    PoolFree(d_reconstructed);
+}
+
+#endif
\ No newline at end of file
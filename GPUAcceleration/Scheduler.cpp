@@ -0,0 +1,283 @@
+#include "Functions.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+using namespace gtom;
+
+/*
+
+Batch scheduler for per-movie processing (motion -> CTF -> export, or whatever stages the caller defines).
+
+Tasks are opaque integers (e.g. indices into the caller's list of movies). Each device (a GPU, or a NUMA
+node on the CPU backend) gets its own queue and its own pool of workers; a worker calls SetDevice once
+and then runs all stages of a task back to back through the caller's callback, so a movie's data never
+leaves the device it was loaded on. Workers take tasks from the front of their device's queue, and once
+it runs dry, steal from the back of another device's queue, so devices that finish early keep busy
+instead of waiting on a hand-made partition.
+
+Tasks take seconds to minutes, so all queues share one lock; contention is not a concern at that scale.
+
+A stage returning non-zero marks the task as failed and skips its remaining stages. The callback must
+not throw across the C boundary.
+
+*/
+
+namespace
+{
+    typedef std::chrono::high_resolution_clock SchedulerClock;
+
+    struct Scheduler
+    {
+        SchedulerStageCallback callback;
+        int ndevices;
+        int nworkers;
+        int nstages;
+
+        std::mutex mutex;
+        std::condition_variable wakeup;    // Workers: new tasks, or shutdown
+        std::condition_variable idle;      // SchedulerWait: queues empty and nothing running
+        bool shutdown;
+
+        std::vector<std::deque<int>> queues;
+        std::vector<std::thread> workers;
+        int nextdevice;
+
+        SchedulerProgress progress;
+        std::vector<double> stageseconds;
+        std::vector<int> stagecounts;
+        std::vector<double> devicebusy;
+        std::vector<int> devicetasks;
+        std::unordered_map<int, std::vector<float>> tasktimings;
+    };
+
+    // Blocks until there is a task to run, or returns false once the scheduler shuts down with empty queues
+    bool SchedulerTake(Scheduler* s, int device, int &task)
+    {
+        std::unique_lock<std::mutex> lock(s->mutex);
+
+        while (true)
+        {
+            if (!s->queues[device].empty())
+            {
+                task = s->queues[device].front();
+                s->queues[device].pop_front();
+                break;
+            }
+
+            // Steal the task its owner would get to last
+            int victim = -1;
+            for (int d = 1; d < s->ndevices && victim < 0; d++)
+                if (!s->queues[(device + d) % s->ndevices].empty())
+                    victim = (device + d) % s->ndevices;
+
+            if (victim >= 0)
+            {
+                task = s->queues[victim].back();
+                s->queues[victim].pop_back();
+                s->progress.nstolen++;
+                break;
+            }
+
+            if (s->shutdown)
+                return false;
+
+            s->wakeup.wait(lock);
+        }
+
+        s->progress.nqueued--;
+        s->progress.nrunning++;
+
+        return true;
+    }
+
+    void SchedulerWorker(Scheduler* s, int device)
+    {
+        SetDevice(device);
+#ifdef WARP_CPU_BACKEND
+        // Split the node's processors between the tasks running on it at once
+        omp_set_num_threads(tmax(1, GetDeviceProcessorCount(device) / s->nworkers));
+#endif
+
+        int task;
+        while (SchedulerTake(s, device, task))
+        {
+            std::vector<float> timings(s->nstages, 0.0f);
+            bool failed = false;
+            int nexecuted = 0;
+
+            for (; nexecuted < s->nstages && !failed; nexecuted++)
+            {
+                auto start = SchedulerClock::now();
+                failed = s->callback(task, nexecuted, device) != 0;
+                timings[nexecuted] = (float)std::chrono::duration<double>(SchedulerClock::now() - start).count();
+            }
+
+            std::lock_guard<std::mutex> lock(s->mutex);
+
+            double busy = 0;
+            for (int stage = 0; stage < nexecuted; stage++)
+            {
+                s->stageseconds[stage] += timings[stage];
+                s->stagecounts[stage]++;
+                busy += timings[stage];
+            }
+            s->devicebusy[device] += busy;
+            s->devicetasks[device]++;
+            s->tasktimings[task] = timings;
+
+            s->progress.nrunning--;
+            if (failed)
+                s->progress.nfailed++;
+            else
+                s->progress.ncompleted++;
+
+            if (s->progress.nqueued == 0 && s->progress.nrunning == 0)
+                s->idle.notify_all();
+        }
+    }
+}
+
+__declspec(dllexport) void* __stdcall CreateScheduler(int ndevices, int workersperdevice, int nstages, SchedulerStageCallback callback)
+{
+    Scheduler* s = new Scheduler();
+    s->callback = callback;
+    s->ndevices = ndevices > 0 ? ndevices : tmax(1, GetDeviceCount());
+    s->nworkers = tmax(1, workersperdevice);
+    s->nstages = tmax(1, nstages);
+    s->shutdown = false;
+    s->nextdevice = 0;
+
+    memset(&s->progress, 0, sizeof(SchedulerProgress));
+    s->queues.resize(s->ndevices);
+    s->stageseconds.resize(s->nstages, 0);
+    s->stagecounts.resize(s->nstages, 0);
+    s->devicebusy.resize(s->ndevices, 0);
+    s->devicetasks.resize(s->ndevices, 0);
+
+    for (int d = 0; d < s->ndevices; d++)
+        for (int w = 0; w < s->nworkers; w++)
+            s->workers.push_back(std::thread(SchedulerWorker, s, d));
+
+    return s;
+}
+
+// Drops queued tasks, waits for the running ones to finish
+__declspec(dllexport) void __stdcall DestroyScheduler(void* scheduler)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+
+    SchedulerCancel(s);
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        s->shutdown = true;
+    }
+    s->wakeup.notify_all();
+
+    for (std::thread &worker : s->workers)
+        worker.join();
+
+    delete s;
+}
+
+// device < 0 distributes tasks round-robin; the task may still be stolen by another device
+__declspec(dllexport) void __stdcall SchedulerSubmit(void* scheduler, int task, int device)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    {
+        std::lock_guard<std::mutex> lock(s->mutex);
+        if (device < 0)
+            device = s->nextdevice++ % s->ndevices;
+
+        s->queues[device % s->ndevices].push_back(task);
+        s->progress.nsubmitted++;
+        s->progress.nqueued++;
+    }
+    s->wakeup.notify_all();
+}
+
+// Returns true once all submitted tasks have finished or were cancelled; timeoutms < 0 waits indefinitely
+__declspec(dllexport) bool __stdcall SchedulerWait(void* scheduler, int timeoutms)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::unique_lock<std::mutex> lock(s->mutex);
+
+    auto done = [s]() { return s->progress.nqueued == 0 && s->progress.nrunning == 0; };
+    if (timeoutms < 0)
+    {
+        s->idle.wait(lock, done);
+        return true;
+    }
+
+    return s->idle.wait_for(lock, std::chrono::milliseconds(timeoutms), done);
+}
+
+// Drops all queued tasks; running tasks finish all of their stages
+__declspec(dllexport) void __stdcall SchedulerCancel(void* scheduler)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::lock_guard<std::mutex> lock(s->mutex);
+
+    for (std::deque<int> &queue : s->queues)
+    {
+        s->progress.ncancelled += (int)queue.size();
+        s->progress.nqueued -= (int)queue.size();
+        queue.clear();
+    }
+
+    if (s->progress.nrunning == 0)
+        s->idle.notify_all();
+}
+
+__declspec(dllexport) void __stdcall SchedulerGetProgress(void* scheduler, SchedulerProgress* h_progress)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::lock_guard<std::mutex> lock(s->mutex);
+
+    *h_progress = s->progress;
+}
+
+// Summed over all finished tasks: h_seconds and h_counts have nstages elements each
+__declspec(dllexport) void __stdcall SchedulerGetStageTimings(void* scheduler, double* h_seconds, int* h_counts)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::lock_guard<std::mutex> lock(s->mutex);
+
+    for (int stage = 0; stage < s->nstages; stage++)
+    {
+        h_seconds[stage] = s->stageseconds[stage];
+        h_counts[stage] = s->stagecounts[stage];
+    }
+}
+
+// Busy time and number of tasks per device: h_busyseconds and h_tasks have ndevices elements each
+__declspec(dllexport) void __stdcall SchedulerGetDeviceTimings(void* scheduler, double* h_busyseconds, int* h_tasks)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::lock_guard<std::mutex> lock(s->mutex);
+
+    for (int d = 0; d < s->ndevices; d++)
+    {
+        h_busyseconds[d] = s->devicebusy[d];
+        h_tasks[d] = s->devicetasks[d];
+    }
+}
+
+// Per-stage seconds of a finished task, 0 for stages skipped after a failure; false if the task hasn't finished
+__declspec(dllexport) bool __stdcall SchedulerGetTaskTimings(void* scheduler, int task, float* h_seconds)
+{
+    Scheduler* s = (Scheduler*)scheduler;
+    std::lock_guard<std::mutex> lock(s->mutex);
+
+    auto found = s->tasktimings.find(task);
+    if (found == s->tasktimings.end())
+        return false;
+
+    for (int stage = 0; stage < s->nstages; stage++)
+        h_seconds[stage] = found->second[stage];
+
+    return true;
+}
@@ -1,17 +1,23 @@
 #include "Functions.h"
 #include <device_functions.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
 using namespace gtom;
 
 #define SHIFT_THREADS 128
 
-__global__ void ShiftGetAverageKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float2* d_shifts, uint length, uint probelength, uint nspectra, uint nframes);
-__global__ void ShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, uint length, uint probelength, float2* d_shifts, float* d_diff);
-__global__ void ShiftGetGradKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, uint length, uint probelength, float2* d_shifts, float2* d_grad);
+__global__ void ShiftGetAverageKernel(const void* d_phase, int precision, float2* d_average, double2* d_sums, float2* d_shiftfactors, PhaseRampView ramps, float2* d_shifts, uint length, uint probelength, uint nspectra, uint nframes);
+__global__ void ShiftUpdateAverageKernel(const void* d_phase, int precision, float2* d_average, double2* d_sums, float2* d_shiftfactors, PhaseRampView ramps, float2* d_pairshifts, uint* d_offsets, uint* d_frames, uint nchanged, uint length, uint probelength, uint npositions, uint nframes);
+__global__ void ShiftGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, uint length, uint probelength, float2* d_shifts, float* d_diff);
+__global__ void ShiftGetGradKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, uint length, uint probelength, float2* d_shifts, float2* d_grad);
+__global__ void ShiftGetDiffAndGradKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, uint length, uint probelength, float2* d_shifts, float* d_diff, float2* d_grad);
 
 /*
 
 Supplied with a stack of frames, extraction positions for sub-regions, and a mask of relevant pixels in Fspace, 
-this method extracts portions of each frame, computes the FT, and returns the relevant pixels.
+this method extracts portions of each frame, computes the FT, and returns the relevant pixels, stored with the
+given STORAGE_* precision. The ShiftGet* methods take the same precision for d_phase.
 
 */
 
@@ -23,111 +29,326 @@ __declspec(dllexport) void CreateShift(float* d_frame,
 										int2 dimsregion,
 										size_t* h_mask,
 										uint masklength,
-										float2* d_outputall)
+										void* d_outputall,
+										int precision)
 {
-	int2 dimsunpadded = toInt2(dimsregion.x / 1, dimsregion.y / 1);
-
-	int3* d_origins = (int3*)CudaMallocFromHostArray(h_origins, norigins * sizeof(int3));
-	size_t* d_mask = (size_t*)CudaMallocFromHostArray(h_mask, masklength * sizeof(size_t));
-	tfloat* d_temp;
-	cudaMalloc((void**)&d_temp, norigins * ElementsFFT2(dimsregion) * sizeof(tcomplex));
-	tcomplex* d_tempft;
-	cudaMalloc((void**)&d_tempft, norigins * ElementsFFT2(dimsregion) * sizeof(tcomplex));
-	tcomplex* d_dense;
-	cudaMalloc((void**)&d_dense, norigins * masklength * sizeof(tcomplex));
-
-	for (uint z = 0; z < nframes; z++)
+	int3* d_origins = (int3*)PoolMallocFromHostArray(h_origins, norigins * sizeof(int3));
+
+	// Extraction, normalization and windowing happen in one pass, the mask is gathered from the raw transform
+	std::vector<size_t> gather = PatchSpectrumGatherIndices(h_mask, masklength, dimsregion);
+	size_t* d_gather = (size_t*)PoolMallocFromHostArray(gather.data(), masklength * sizeof(size_t));
+
+	float* d_window;
+	PoolMalloc((void**)&d_window, Elements2(dimsregion) * sizeof(float));
+	d_ValueFill(d_window, Elements2(dimsregion), 1.0f);
+	d_HammingMask(d_window, d_window, toInt3(dimsregion), NULL, NULL);
+
+	uint nitems = nframes * norigins;
+	uint batch = tmin(nitems, (uint)PATCH_BATCH);
+	float* d_patches;
+	PoolMalloc((void**)&d_patches, batch * Elements2(dimsregion) * sizeof(float));
+	float2* d_spectra;
+	PoolMalloc((void**)&d_spectra, batch * ElementsFFT2(dimsregion) * sizeof(float2));
+
+	for (uint first = 0; first < nitems; first += batch)
 	{
-		d_ExtractMany(d_frame + Elements2(dimsframe) * z, d_temp, toInt3(dimsframe), toInt3(dimsregion), d_origins, norigins);
-		d_NormMonolithic(d_temp, d_temp, Elements2(dimsregion), T_NORM_MEAN01STD, norigins);
-		d_HammingMask(d_temp, d_temp, toInt3(dimsregion), NULL, NULL, norigins);
-		//d_WriteMRC(d_temp, toInt3(dimsregion.x, dimsregion.y, norigins), "d_shifttemp.mrc");
-		d_FFTR2C(d_temp, d_tempft, 2, toInt3(dimsregion), norigins);
-		d_RemapHalfFFT2Half(d_tempft, (tcomplex*)d_temp, toInt3(dimsregion), norigins);
-		d_Remap((tcomplex*)d_temp, d_mask, d_outputall + masklength * norigins * z, masklength, ElementsFFT2(dimsregion), make_cuComplex(0.0f, 0.0f), norigins);
-		//d_ComplexNormalize(d_dense, d_dense, masklength * norigins);
+		uint n = tmin(batch, nitems - first);
+
+		d_PatchExtract(d_frame, dimsframe, d_origins, norigins, false, first, n, dimsregion, true, d_window, 1.0f, false, d_patches);
+		d_FFTR2CCached(d_patches, d_spectra, 2, toInt3(dimsregion), n);
+		d_PatchGather(d_spectra, d_gather, masklength, dimsregion, n, d_outputall, precision, (size_t)masklength * first);
 	}
 
-	cudaFree(d_dense);
-	cudaFree(d_tempft);
-	cudaFree(d_temp);
-	cudaFree(d_mask);
-	cudaFree(d_origins);
+	PoolFree(d_spectra);
+	PoolFree(d_patches);
+	PoolFree(d_window);
+	PoolFree(d_gather);
+	PoolFree(d_origins);
 }
 
-__declspec(dllexport) void ShiftGetAverage(float2* d_phase, 
-											float2* d_average, 
+__declspec(dllexport) void ShiftGetAverage(void* d_phase,
+											float2* d_average,
 											float2* d_shiftfactors,
-											uint length,  
+											uint length,
 											uint probelength,
-											float2* d_shifts, 
-											uint npositions, 
-											uint nframes)
+											float2* d_shifts,
+											uint npositions,
+											uint nframes,
+											int precision)
 {
-	float2* d_shiftshalf;
-	cudaMalloc((void**)&d_shiftshalf, npositions * nframes * sizeof(float2));
-	d_ConvertTFloatTo((float*)d_shifts, (float*)d_shiftshalf, npositions * nframes * 2);
-	
 	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(length, 32));
 	dim3 grid = dim3((length + TpB - 1) / TpB, npositions, 1);
-	ShiftGetAverageKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, d_shiftshalf, length, probelength, npositions, nframes);
 
-	/*float2* d_averagef;
-	cudaMalloc((void**)&d_averagef, length * npositions * sizeof(float2));
-	d_ConvertToTFloat((half*)d_average, (float*)d_averagef, npositions * length * 2);
-	float2* h_averagef = (float2*)MallocFromDeviceArray(d_averagef, length * npositions * sizeof(float2));
-	cudaFree(d_averagef);
-	
-	float2* d_phasef;
-	cudaMalloc((void**)&d_phasef, length * npositions * nframes * sizeof(float2));
-	d_ConvertToTFloat((half*)d_phase, (float*)d_phasef, npositions * nframes * length * 2);
-	float2* h_phasef = (float2*)MallocFromDeviceArray(d_phasef, length * npositions * nframes * sizeof(float2));
-	cudaFree(d_phasef);
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
 
-	free(h_averagef);
-	free(h_phasef);*/
+	ShiftGetAverageKernel <<<grid, TpB>>> (d_phase, precision, d_average, NULL, d_shiftfactors, ramps, d_shifts, length, probelength, npositions, nframes);
 
-	cudaFree(d_shiftshalf);
+	ReleasePhaseRamps(&ramps);
 }
 
-__global__ void ShiftGetAverageKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, float2* d_shifts, uint length, uint probelength, uint npositions, uint nframes)
+/*
+
+Running average for optimizations that move only some of the shifts between evaluations. The state keeps every
+position's sum over all frames in double precision, along with the shifts it was computed for; each call compares
+the new shifts to those, and takes the old contribution of each changed frame out of the sum before adding the new
+one, so the cost scales with the number of changed frames instead of all of them. If most shifts changed, or the
+phases, mask or precision aren't the ones the sums are for, it's cheaper to start over with a full pass.
+Freeing the phases or shift factors invalidates every state that refers to them, since the pool can hand the same
+address out again for different data.
+
+*/
+
+struct ShiftAverageState
 {
-	d_phase += blockIdx.y * length;
-	d_average += blockIdx.y * probelength;
-	d_shifts += blockIdx.y;
+	uint length, npositions, nframes;
 
-	__shared__ float2 s_shifts[256];	// 256 frames should be enough for everyone
-	for (uint i = threadIdx.x; i < nframes; i += blockDim.x)
-		s_shifts[i] = d_shifts[npositions * i];
-	__syncthreads();
+	// What the sums are for, anything else starts over
+	void* d_phase;
+	float2* d_shiftfactors;
+	uint probelength;
+	int precision;
+	bool valid;
+
+	double2* d_sums;					// npositions * probelength
+	std::vector<float2> h_lastshifts;	// Frame-major like d_shifts
 
+	long long nupdated, nrecomputed;
+};
+
+namespace
+{
+	std::mutex ShiftAveragesMutex;
+	std::unordered_set<ShiftAverageState*> ShiftAverages;
+	std::atomic<int> ShiftAveragesSize(0);	// Lets ForgetShiftAverages skip the lock on every free while no state exists
+}
+
+void ForgetShiftAverages(void* d_memory)
+{
+	if (ShiftAveragesSize.load() == 0 || d_memory == NULL)
+		return;
+
+	std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+	for (ShiftAverageState* state : ShiftAverages)
+		if (state->d_phase == d_memory || state->d_shiftfactors == d_memory)
+			state->valid = false;
+}
+
+__declspec(dllexport) void* CreateShiftAverage(uint length, uint npositions, uint nframes)
+{
+	ShiftAverageState* state = new ShiftAverageState();
+	state->length = length;
+	state->npositions = npositions;
+	state->nframes = nframes;
+	state->d_phase = NULL;
+	state->d_shiftfactors = NULL;
+	state->probelength = 0;
+	state->precision = STORAGE_FP32;
+	state->valid = false;
+	state->nupdated = state->nrecomputed = 0;
+
+	PoolMalloc((void**)&state->d_sums, (size_t)length * npositions * sizeof(double2));
+	state->h_lastshifts.resize((size_t)npositions * nframes);
+
+	std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+	ShiftAverages.insert(state);
+	ShiftAveragesSize = (int)ShiftAverages.size();
+
+	return state;
+}
+
+__declspec(dllexport) void DestroyShiftAverage(void* average)
+{
+	if (average == NULL)
+		return;
+
+	ShiftAverageState* state = (ShiftAverageState*)average;
+	{
+		std::lock_guard<std::mutex> lock(ShiftAveragesMutex);
+		ShiftAverages.erase(state);
+		ShiftAveragesSize = (int)ShiftAverages.size();
+	}
+
+	PoolFree(state->d_sums);
+	delete state;
+}
+
+__declspec(dllexport) void ShiftAverageGetStats(void* average, long long* h_updated, long long* h_recomputed)
+{
+	ShiftAverageState* state = (ShiftAverageState*)average;
+
+	*h_updated = state->nupdated;
+	*h_recomputed = state->nrecomputed;
+}
+
+__declspec(dllexport) void ShiftGetAverageIncremental(void* average,
+														void* d_phase,
+														float2* d_average,
+														float2* d_shiftfactors,
+														uint length,
+														uint probelength,
+														float2* d_shifts,
+														uint npositions,
+														uint nframes,
+														int precision)
+{
+	ShiftAverageState* state = (ShiftAverageState*)average;
+	uint nshifts = npositions * nframes;
 
-	for (uint id = blockIdx.x * blockDim.x + threadIdx.x; 
-		 id < probelength; 
+	if (length > state->length || npositions != state->npositions || nframes != state->nframes)
+	{
+		state->valid = false;
+		ShiftGetAverage(d_phase, d_average, d_shiftfactors, length, probelength, d_shifts, npositions, nframes, precision);
+		return;
+	}
+
+	std::vector<float2> h_shifts(nshifts);
+	cudaMemcpy(h_shifts.data(), d_shifts, nshifts * sizeof(float2), cudaMemcpyDeviceToHost);
+
+	// Changed frames grouped by position
+	std::vector<uint> h_offsets(npositions + 1);
+	std::vector<uint> h_frames;
+	for (uint p = 0; p < npositions; p++)
+	{
+		h_offsets[p] = (uint)h_frames.size();
+		for (uint frame = 0; frame < nframes; frame++)
+		{
+			float2 a = h_shifts[npositions * frame + p], b = state->h_lastshifts[npositions * frame + p];
+			if (a.x != b.x || a.y != b.y)
+				h_frames.push_back(frame);
+		}
+	}
+	h_offsets[npositions] = (uint)h_frames.size();
+	uint nchanged = (uint)h_frames.size();
+
+	bool compatible = state->valid &&
+					  state->d_phase == d_phase &&
+					  state->d_shiftfactors == d_shiftfactors &&
+					  state->probelength == probelength &&
+					  state->precision == precision;
+
+	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(length, 32));
+	dim3 grid = dim3((length + TpB - 1) / TpB, npositions, 1);
+
+	if (!compatible || nchanged * 2 > nshifts)
+	{
+		PhaseRampView ramps;
+		AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, nshifts, &ramps);
+
+		ShiftGetAverageKernel <<<grid, TpB>>> (d_phase, precision, d_average, state->d_sums, d_shiftfactors, ramps, d_shifts, length, probelength, npositions, nframes);
+
+		ReleasePhaseRamps(&ramps);
+
+		state->d_phase = d_phase;
+		state->d_shiftfactors = d_shiftfactors;
+		state->probelength = probelength;
+		state->precision = precision;
+		state->valid = true;
+		state->nrecomputed++;
+	}
+	else
+	{
+		// New shifts of the changed frames, followed by their old ones
+		std::vector<float2> h_pairshifts(nchanged * 2);
+		for (uint p = 0, k = 0; p < npositions; p++)
+			for (; k < h_offsets[p + 1]; k++)
+			{
+				h_pairshifts[k] = h_shifts[npositions * h_frames[k] + p];
+				h_pairshifts[nchanged + k] = state->h_lastshifts[npositions * h_frames[k] + p];
+			}
+
+		uint* d_offsets = (uint*)PoolMallocFromHostArray(h_offsets.data(), (npositions + 1) * sizeof(uint));
+		uint* d_frames = NULL;
+		float2* d_pairshifts = NULL;
+		if (nchanged > 0)
+		{
+			d_frames = (uint*)PoolMallocFromHostArray(h_frames.data(), nchanged * sizeof(uint));
+			d_pairshifts = (float2*)PoolMallocFromHostArray(h_pairshifts.data(), nchanged * 2 * sizeof(float2));
+		}
+
+		PhaseRampView ramps;
+		AcquirePhaseRamps(d_shiftfactors, probelength, d_pairshifts, nchanged * 2, &ramps);
+
+		ShiftUpdateAverageKernel <<<grid, TpB>>> (d_phase, precision, d_average, state->d_sums, d_shiftfactors, ramps, d_pairshifts, d_offsets, d_frames, nchanged, length, probelength, npositions, nframes);
+
+		ReleasePhaseRamps(&ramps);
+
+		if (nchanged > 0)
+		{
+			PoolFree(d_pairshifts);
+			PoolFree(d_frames);
+		}
+		PoolFree(d_offsets);
+
+		state->nupdated += nchanged;
+	}
+
+	state->h_lastshifts = h_shifts;
+}
+
+__global__ void ShiftGetAverageKernel(const void* d_phase, int precision, float2* d_average, double2* d_sums, float2* d_shiftfactors, PhaseRampView ramps, float2* d_shifts, uint length, uint probelength, uint npositions, uint nframes)
+{
+	size_t phaseoffset = (size_t)blockIdx.y * length;
+	d_average += blockIdx.y * probelength;
+	d_shifts += blockIdx.y;
+
+	for (uint id = blockIdx.x * blockDim.x + threadIdx.x;
+		 id < probelength;
 		 id += gridDim.x * blockDim.x)
 	{
 		float2 shiftfactors = d_shiftfactors[id];
-		float2 sum = make_float2(0.0f, 0.0f);
+		double2 sum = make_double2(0.0, 0.0);
 
+		// All threads read the same shift, no need to stage them in shared memory, which limited the frame count
 		for (uint frame = 0; frame < nframes; frame++)
 		{
-			float2 shift = s_shifts[frame];
-			float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-			float2 change = make_float2(__cosf(phase), __sinf(phase));
+			float2 shift = d_shifts[npositions * frame];
+			float2 change = d_PhaseRamp(ramps, npositions * frame + blockIdx.y, id, shiftfactors, shift);
 
-			float2 value = d_phase[length * npositions * frame + id];
-			value = cuCmulf(value, change);
+			float2 value = d_LoadComplex(d_phase, precision, phaseoffset + (size_t)length * npositions * frame + id);
+			value = cmul(value, change);
 
-			sum += value;
+			sum.x += (double)value.x;
+			sum.y += (double)value.y;
 		}
-		
-		sum /= nframes;
 
-		d_average[id] = sum;
+		if (d_sums != NULL)
+			d_sums[(size_t)blockIdx.y * probelength + id] = sum;
+
+		d_average[id] = make_float2((float)(sum.x / nframes), (float)(sum.y / nframes));
+	}
+}
+
+__global__ void ShiftUpdateAverageKernel(const void* d_phase, int precision, float2* d_average, double2* d_sums, float2* d_shiftfactors, PhaseRampView ramps, float2* d_pairshifts, uint* d_offsets, uint* d_frames, uint nchanged, uint length, uint probelength, uint npositions, uint nframes)
+{
+	size_t phaseoffset = (size_t)blockIdx.y * length;
+	d_average += blockIdx.y * probelength;
+	d_sums += (size_t)blockIdx.y * probelength;
+	uint first = d_offsets[blockIdx.y], last = d_offsets[blockIdx.y + 1];
+
+	for (uint id = blockIdx.x * blockDim.x + threadIdx.x;
+		 id < probelength;
+		 id += gridDim.x * blockDim.x)
+	{
+		float2 shiftfactors = d_shiftfactors[id];
+		double2 sum = d_sums[id];
+
+		for (uint k = first; k < last; k++)
+		{
+			float2 value = d_LoadComplex(d_phase, precision, phaseoffset + (size_t)length * npositions * d_frames[k] + id);
+			float2 added = cmul(value, d_PhaseRamp(ramps, k, id, shiftfactors, d_pairshifts[k]));
+			float2 removed = cmul(value, d_PhaseRamp(ramps, nchanged + k, id, shiftfactors, d_pairshifts[nchanged + k]));
+
+			sum.x += (double)added.x - (double)removed.x;
+			sum.y += (double)added.y - (double)removed.y;
+		}
+
+		d_sums[id] = sum;
+		d_average[id] = make_float2((float)(sum.x / nframes), (float)(sum.y / nframes));
 	}
 }
 
-__declspec(dllexport) void ShiftGetDiff(float2* d_phase, 
+__declspec(dllexport) void ShiftGetDiff(void* d_phase, 
 											float2* d_average, 
 											float2* d_shiftfactors, 
 											uint length, 
@@ -135,26 +356,32 @@ __declspec(dllexport) void ShiftGetDiff(float2* d_phase,
 											float2* d_shifts,
 											float* h_diff, 
 											uint npositions, 
-											uint nframes)
+											uint nframes,
+											int precision)
 {
 	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
 	dim3 grid = dim3(npositions, nframes, 1);
 
 	float* d_diff;
-	cudaMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
+	PoolMalloc((void**)&d_diff, npositions * nframes * grid.x * sizeof(float));
 	float* d_diffreduced;
-	cudaMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
+	PoolMalloc((void**)&d_diffreduced, npositions * nframes * sizeof(float));
 
-	ShiftGetDiffKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, length, probelength, d_shifts, d_diff);
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+	ShiftGetDiffKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, length, probelength, d_shifts, d_diff);
 
 	//d_SumMonolithic(d_diff, d_diffreduced, grid.x, npositions * nframes);
 	cudaMemcpy(h_diff, d_diff, npositions * nframes * sizeof(float), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_diffreduced);
-	cudaFree(d_diff);
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_diffreduced);
+	PoolFree(d_diff);
 }
 
-__global__ void ShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d_shiftfactors, uint length, uint probelength, float2* d_shifts, float* d_diff)
+__global__ void ShiftGetDiffKernel(const void* d_phase, int precision, float2* d_average, float2* d_shiftfactors, PhaseRampView ramps, uint length, uint probelength, float2* d_shifts, float* d_diff)
 {
 	__shared__ float s_diff[SHIFT_THREADS];
 	s_diff[threadIdx.x] = 0.0f;
@@ -162,7 +389,7 @@ __global__ void ShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d
 	s_ampsum[threadIdx.x] = 0.0f;
 
 	uint specid = blockIdx.y * gridDim.x + blockIdx.x;
-	d_phase += specid * length;
+	size_t phaseoffset = (size_t)specid * length;
 	d_average += blockIdx.x * probelength;
 
 	float2 shift = d_shifts[specid];
@@ -171,15 +398,14 @@ __global__ void ShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d
 
 	for (uint id = threadIdx.x; id < probelength; id += blockDim.x)
 	{
-		float2 value = d_phase[id];
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
 		float2 average = d_average[id];
 
 		float2 shiftfactors = d_shiftfactors[id];
 
-		float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-		float2 change = make_float2(__cosf(phase), __sinf(phase));
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
 
-		value = cuCmulf(value, change);
+		value = cmul(value, change);
 
 		float2 valuenorm = value / tmax(1e-10f, sqrt(value.x * value.x + value.y * value.y));
 		float avgamp = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));
@@ -207,7 +433,7 @@ __global__ void ShiftGetDiffKernel(float2* d_phase, float2* d_average, float2* d
 	}
 }
 
-__declspec(dllexport) void ShiftGetGrad(float2* d_phase, 
+__declspec(dllexport) void ShiftGetGrad(void* d_phase, 
 										float2* d_average, 
 										float2* d_shiftfactors, 
 										uint length, 
@@ -215,17 +441,21 @@ __declspec(dllexport) void ShiftGetGrad(float2* d_phase,
 										float2* d_shifts,
 										float2* h_grad, 
 										uint npositions, 
-										uint nframes)
+										uint nframes,
+										int precision)
 {
 	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
 	dim3 grid = dim3(npositions, nframes, 1);
 
 	float2* d_grad;
-	cudaMalloc((void**)&d_grad, npositions * nframes * grid.x * sizeof(float2));
+	PoolMalloc((void**)&d_grad, npositions * nframes * grid.x * sizeof(float2));
 	float2* d_gradreduced;
-	cudaMalloc((void**)&d_gradreduced, npositions * nframes * sizeof(float2));
+	PoolMalloc((void**)&d_gradreduced, npositions * nframes * sizeof(float2));
+
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
 
-	ShiftGetGradKernel <<<grid, TpB>>> (d_phase, d_average, d_shiftfactors, length, probelength, d_shifts, d_grad);
+	ShiftGetGradKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, length, probelength, d_shifts, d_grad);
 
 	float2* h_grad2 = (float2*)MallocFromDeviceArray(d_grad, npositions * nframes * grid.x * sizeof(float2));
 	free(h_grad2);
@@ -233,13 +463,16 @@ __declspec(dllexport) void ShiftGetGrad(float2* d_phase,
 	//d_SumMonolithic(d_grad, d_gradreduced, grid.x, npositions * nframes);
 	cudaMemcpy(h_grad, d_grad, npositions * nframes * sizeof(float2), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_gradreduced);
-	cudaFree(d_grad);
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_gradreduced);
+	PoolFree(d_grad);
 }
 
-__global__ void ShiftGetGradKernel(float2* d_phase, 
+__global__ void ShiftGetGradKernel(const void* d_phase, int precision, 
 									float2* d_average, 
 									float2* d_shiftfactors, 
+									PhaseRampView ramps,
 									uint length, 
 									uint probelength, 
 									float2* d_shifts, 
@@ -251,7 +484,7 @@ __global__ void ShiftGetGradKernel(float2* d_phase,
 	s_ampsum[threadIdx.x] = 0.0f;
 
 	uint specid = blockIdx.y * gridDim.x + blockIdx.x;
-	d_phase += specid * length;
+	size_t phaseoffset = (size_t)specid * length;
 	d_average += blockIdx.x * probelength;
 
 	float2 shift = d_shifts[specid];
@@ -260,14 +493,13 @@ __global__ void ShiftGetGradKernel(float2* d_phase,
 
 	for (uint id = threadIdx.x; id < probelength; id += blockDim.x)
 	{
-		float2 value = d_phase[id];
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
 		float2 average = d_average[id];
 
 		float2 shiftfactors = d_shiftfactors[id];
 		float weight = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));// __half2float(d_weights[id]);
 
-		float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-		float2 change = make_float2(__cosf(phase), __sinf(phase));
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
 		float2 altvalue = cmul(value, change);
 		
 		gradsum.x += -sgn(altvalue.x * average.y - altvalue.y * average.x) * shiftfactors.x * weight;
@@ -291,6 +523,111 @@ __global__ void ShiftGetGradKernel(float2* d_phase,
 	}
 }
 
+/*
+
+ShiftGetDiff and ShiftGetGrad in one pass over d_phase, with one phase ramp evaluation per element.
+
+*/
+
+__declspec(dllexport) void ShiftGetDiffAndGrad(void* d_phase, 
+												float2* d_average, 
+												float2* d_shiftfactors, 
+												uint length, 
+												uint probelength,
+												float2* d_shifts,
+												float* h_diff, 
+												float2* h_grad, 
+												uint npositions, 
+												uint nframes,
+												int precision)
+{
+	int TpB = tmin(SHIFT_THREADS, NextMultipleOf(probelength, 32));
+	dim3 grid = dim3(npositions, nframes, 1);
+
+	float* d_diff;
+	PoolMalloc((void**)&d_diff, npositions * nframes * sizeof(float));
+	float2* d_grad;
+	PoolMalloc((void**)&d_grad, npositions * nframes * sizeof(float2));
+
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, probelength, d_shifts, npositions * nframes, &ramps);
+
+	ShiftGetDiffAndGradKernel <<<grid, TpB>>> (d_phase, precision, d_average, d_shiftfactors, ramps, length, probelength, d_shifts, d_diff, d_grad);
+
+	cudaMemcpy(h_diff, d_diff, npositions * nframes * sizeof(float), cudaMemcpyDeviceToHost);
+	cudaMemcpy(h_grad, d_grad, npositions * nframes * sizeof(float2), cudaMemcpyDeviceToHost);
+	
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_grad);
+	PoolFree(d_diff);
+}
+
+__global__ void ShiftGetDiffAndGradKernel(const void* d_phase, int precision, 
+											float2* d_average, 
+											float2* d_shiftfactors, 
+											PhaseRampView ramps,
+											uint length, 
+											uint probelength, 
+											float2* d_shifts, 
+											float* d_diff, 
+											float2* d_grad)
+{
+	__shared__ float s_diff[SHIFT_THREADS];
+	__shared__ float2 s_grad[SHIFT_THREADS];
+	__shared__ float s_ampsum[SHIFT_THREADS];
+
+	uint specid = blockIdx.y * gridDim.x + blockIdx.x;
+	size_t phaseoffset = (size_t)specid * length;
+	d_average += blockIdx.x * probelength;
+
+	float2 shift = d_shifts[specid];
+	float diffsum = 0.0f;
+	float2 gradsum = make_float2(0.0f, 0.0f);
+	float ampsum = 0.0f;
+
+	for (uint id = threadIdx.x; id < probelength; id += blockDim.x)
+	{
+		float2 value = d_LoadComplex(d_phase, precision, phaseoffset + id);
+		float2 average = d_average[id];
+		float2 shiftfactors = d_shiftfactors[id];
+
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
+		value = cmul(value, change);
+
+		float avgamp = tmax(1e-10f, sqrt(average.x * average.x + average.y * average.y));
+		average /= avgamp;
+		float valueamp = tmax(1e-10f, sqrt(value.x * value.x + value.y * value.y));
+
+		float cosine = (value.x * average.x + value.y * average.y) / valueamp;
+		diffsum += acos(tmax(-1.0f, tmin(cosine, 1.0f))) * avgamp;
+
+		float direction = -sgn(value.x * average.y - value.y * average.x) * avgamp;
+		gradsum.x += direction * shiftfactors.x;
+		gradsum.y += direction * shiftfactors.y;
+
+		ampsum += avgamp;
+	}
+
+	s_diff[threadIdx.x] = diffsum;
+	s_grad[threadIdx.x] = gradsum;
+	s_ampsum[threadIdx.x] = ampsum;
+	__syncthreads();
+
+	if (threadIdx.x == 0)
+	{
+		for (uint id = 1; id < blockDim.x; id++)
+		{
+			diffsum += s_diff[id];
+			gradsum = gradsum + s_grad[id];
+			ampsum += s_ampsum[id];
+		}
+
+		d_diff[specid] = diffsum / ampsum;
+		d_grad[specid] = gradsum / ampsum;
+	}
+}
+
 __declspec(dllexport) void CreateMotionBlur(float* d_output, int3 dims, float* h_shifts, uint nshifts, uint batch)
 {
     d_MotionBlur(d_output, dims, (float3*)h_shifts, nshifts, false, batch);
@@ -1,11 +1,15 @@
 #include "Functions.h"
+#include <algorithm>
 using namespace gtom;
 
 #define TOMO_THREADS 128
+#define TOMO_SCORER_BYTES (256 << 20)
 
-__global__ void TomoRefineGetDiffKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, float* d_ctf, uint length, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff);
-__global__ void TomoRealspaceCorrelateKernel(float* d_projections, float* d_experimental, float* d_mask, uint elements, uint ntilts, float* d_weights, float* d_result);
-__global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, float* d_ctf, uint length, uint ntilts, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff);
+__global__ void TomoRefineGetDiffKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, PhaseRampView ramps, float* d_ctf, uint length, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff);
+__global__ void TomoRealspaceCorrelateKernel(float* d_projections, float* d_experimental, float* d_mask, float masknorm, uint elements, uint ntilts, float* d_weights, float* d_result);
+__global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, PhaseRampView ramps, float* d_ctf, uint length, uint ntilts, float2* d_shifts, float* d_diff, float* d_weights, int3* d_pairs, float* d_debugdiff);
+template<class T> __global__ void TomoGatherKernel(T* d_input, size_t inputstride, uint* d_indices, uint n, T* d_output, uint batch);
+__global__ void TomoTopKKernel(float* d_scores, uint nparticles, uint nangles, uint nshifts, int firstangle, int topk, float* d_topscores, int* d_topangles, int* d_topshifts, int* d_topcount);
 
 
 __declspec(dllexport) void TomoRefineGetDiff(float2* d_experimental, 
@@ -22,22 +26,27 @@ __declspec(dllexport) void TomoRefineGetDiff(float2* d_experimental,
 	dim3 grid = dim3(nparticles);
 
 	float* d_diff;
-	cudaMalloc((void**)&d_diff, nparticles * sizeof(float));
+	PoolMalloc((void**)&d_diff, nparticles * sizeof(float));
 
-	float2* d_shifts = (float2*)CudaMallocFromHostArray(h_shifts, nparticles * sizeof(float2));
+	float2* d_shifts = (float2*)PoolMallocFromHostArray(h_shifts, nparticles * sizeof(float2));
 	
 	float* d_debugdiff = NULL;
 	//cudaMalloc((void**)&d_debugdiff, npositions * nframes * ElementsFFT2(dims) * sizeof(float));
 
-	TomoRefineGetDiffKernel <<<grid, TpB>>> (d_experimental, d_reference, d_shiftfactors, d_ctf, ElementsFFT2(dims), d_shifts, d_diff, d_weights, d_debugdiff);
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, ElementsFFT2(dims), d_shifts, nparticles, &ramps);
+
+	TomoRefineGetDiffKernel <<<grid, TpB>>> (d_experimental, d_reference, d_shiftfactors, ramps, d_ctf, ElementsFFT2(dims), d_shifts, d_diff, d_weights, d_debugdiff);
 	
 	cudaMemcpy(h_diff, d_diff, nparticles * sizeof(float), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_shifts);
-	cudaFree(d_diff);
+	ReleasePhaseRamps(&ramps);
+
+	PoolFree(d_shifts);
+	PoolFree(d_diff);
 }
 
-__global__ void TomoRefineGetDiffKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, float* d_ctf, uint length, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff)
+__global__ void TomoRefineGetDiffKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, PhaseRampView ramps, float* d_ctf, uint length, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff)
 {
 	__shared__ float s_num[TOMO_THREADS];
 	s_num[threadIdx.x] = 0.0f;
@@ -65,8 +74,7 @@ __global__ void TomoRefineGetDiffKernel(float2* d_experimental, float2* d_refere
 
 		float2 shiftfactors = d_shiftfactors[id];
 
-		float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-		float2 change = make_float2(__cosf(phase), __sinf(phase));
+		float2 change = d_PhaseRamp(ramps, specid, id, shiftfactors, shift);
 		experimental = cuCmulf(experimental, change);
 
 		float weight = abs(d_ctf[id]);
@@ -114,10 +122,10 @@ __declspec(dllexport) void TomoRealspaceCorrelate(float* d_projections, int2 dim
 	uint batchsize = 1024;
 
 	float* d_result;
-	cudaMalloc((void**)&d_result, nprojections * sizeof(float));
+	PoolMalloc((void**)&d_result, nprojections * sizeof(float));
 
     float* d_experimentalshifted;
-	cudaMalloc((void**)&d_experimentalshifted, Elements2(dims) * ntilts * sizeof(float));
+	PoolMalloc((void**)&d_experimentalshifted, Elements2(dims) * ntilts * sizeof(float));
 
 	// Shift experimental data
 	d_Shift(d_experimental, d_experimentalshifted, toInt3(dims), (tfloat3*)h_shifts, NULL, NULL, NULL, ntilts);
@@ -126,60 +134,54 @@ __declspec(dllexport) void TomoRealspaceCorrelate(float* d_projections, int2 dim
 	//d_MultiplyByVector(d_experimentalshifted, d_mask, d_experimentalshifted, Elements2(dims), ntilts);
 	//d_WriteMRC(d_experimentalshifted, toInt3(dims.x, dims.y, ntilts), "d_experimental.mrc");
 
+	// The mask is the same for every tilt and projection, sum it once
+	float* h_mask = (float*)MallocFromDeviceArray(d_mask, Elements2(dims) * sizeof(float));
+	double samples = 0;
+	for (size_t i = 0; i < Elements2(dims); i++)
+		samples += h_mask[i];
+	free(h_mask);
+
 	//for (uint b = 0; b < nprojections; b += batchsize)
 	{
 	    //uint curbatch = tmin(batchsize, nprojections - b);
 
 		uint TpB = 128;
 		dim3 grid = dim3(nprojections, 1, 1);
-		TomoRealspaceCorrelateKernel <<<grid, TpB>>> (d_projections, d_experimentalshifted, d_mask, Elements2(dims), ntilts, d_weights, d_result);
+		TomoRealspaceCorrelateKernel <<<grid, TpB>>> (d_projections, d_experimentalshifted, d_mask, (float)(1.0 / samples), Elements2(dims), ntilts, d_weights, d_result);
 	}
 
 	cudaMemcpy(h_result, d_result, nprojections * sizeof(float), cudaMemcpyDeviceToHost);
 	
-	cudaFree(d_experimentalshifted);
-	cudaFree(d_result);
+	PoolFree(d_experimentalshifted);
+	PoolFree(d_result);
 }
 
-__global__ void TomoRealspaceCorrelateKernel(float* d_projections, float* d_experimental, float* d_mask, uint elements, uint ntilts, float* d_weights, float* d_result)
+__global__ void TomoRealspaceCorrelateKernel(float* d_projections, float* d_experimental, float* d_mask, float masknorm, uint elements, uint ntilts, float* d_weights, float* d_result)
 {
     d_projections += elements * ntilts * blockIdx.x;
 
 	__shared__ float s_sums1[128];
-	__shared__ float s_samples[128];
-	__shared__ float s_corrsum;
 
-	if (threadIdx.x == 0)
-		s_corrsum = 0;
-	
+	float corrsum = 0;
+
 	for (uint t = 0; t < ntilts; t++)
 	{
 		float tiltcorr = 0;
-		float samples = 0;
 
 		for (int i = threadIdx.x; i < elements; i += blockDim.x)
-		{
-			float mask = d_mask[i];
-			float projection = d_projections[i];
-			float experimental = d_experimental[i];
+			tiltcorr += d_projections[i] * d_experimental[i] * d_mask[i];
 
-			tiltcorr += projection * experimental * mask;
-			samples += mask;
-		}
 		s_sums1[threadIdx.x] = tiltcorr;
-		s_samples[threadIdx.x] = samples;
 		__syncthreads();
 
-		if (threadIdx.x == 0)
+		for (uint stride = 64; stride > 0; stride >>= 1)
 		{
-			for (int i = 1; i < 128; i++)
-			{
-				tiltcorr += s_sums1[i];
-				samples += s_samples[i];
-			}
-
-			s_corrsum += tiltcorr / samples * d_weights[t];
+			if (threadIdx.x < stride)
+				s_sums1[threadIdx.x] += s_sums1[threadIdx.x + stride];
+			__syncthreads();
 		}
+
+		corrsum += s_sums1[0] * masknorm * d_weights[t];
 		__syncthreads();
 
 		d_experimental += elements;
@@ -187,11 +189,267 @@ __global__ void TomoRealspaceCorrelateKernel(float* d_projections, float* d_expe
 	}
 
 	if (threadIdx.x == 0)
+		d_result[blockIdx.x] = corrsum;
+}
+
+/*
+
+Real-space scoring of one particle's tilt images against many projections and many candidate shifts at once.
+TomoRealspaceCorrelate normalizes the shifted images under the mask and takes one masked dot product per shift;
+here the same score is expressed through correlations that cover all circular shifts at once:
+
+score_t(a, d) = (X(d) - mean(d) * Q) / (stddev(d) * M), with
+X(d) = sum_i projection_a(i) * mask(i) * image_t(i - d), Q = sum_i projection_a(i) * mask(i), M = sum_i mask(i),
+and mean(d), stddev(d) the statistics of image_t(i - d) under the mask.
+
+The statistics only depend on the tilt images, so they're computed once when the scorer is created, along with
+the images' transforms. Each projection then costs one transform and one inverse per tilt, and every candidate
+shift a lookup per tilt. Integer shifts reproduce TomoRealspaceCorrelate, fractional ones are interpolated from
+the maps with Catmull-Rom splines.
+
+*/
+
+__global__ void TomoScorerMultiplyConjKernel(float2* d_a, uint abatch, float2* d_b, uint bbatch, float2* d_output, float* d_dc, uint elements, uint batch);
+__global__ void TomoScorerStatsKernel(float* d_sums1, float* d_sums2, float masknorm, uint n);
+__global__ void TomoScorerNormalizeKernel(float* d_maps, float* d_means, float* d_scales, float* d_dc, float masknorm, uint elements, uint ntilts, uint batch);
+__global__ void TomoScorerScoreKernel(float* d_maps, int2 dims, uint ntilts, float* d_weights, float2* d_shifts, uint nshifts, float* d_scores);
+
+struct TomoRealspaceScorer
+{
+	int2 dims;
+	uint ntilts;
+	float masknorm;		// 1 / sum of the mask
+
+	float* d_mask;
+	float2* d_imagesft;
+	float* d_means;		// Per tilt and shift, mean of the shifted image under the mask
+	float* d_scales;	// ... and its inverse standard deviation
+};
+
+__declspec(dllexport) void* CreateTomoRealspaceScorer(float* d_experimental, float* d_mask, int2 dims, uint ntilts)
+{
+	TomoRealspaceScorer* scorer = new TomoRealspaceScorer();
+	scorer->dims = dims;
+	scorer->ntilts = ntilts;
+
+	size_t elements = Elements2(dims), elementsft = ElementsFFT2(dims);
+
+	float* h_mask = (float*)MallocFromDeviceArray(d_mask, elements * sizeof(float));
+	double samples = 0;
+	for (size_t i = 0; i < elements; i++)
+		samples += h_mask[i];
+	free(h_mask);
+	scorer->masknorm = (float)(1.0 / tmax(samples, 1e-6));
+
+	PoolMalloc((void**)&scorer->d_mask, elements * sizeof(float));
+	cudaMemcpy(scorer->d_mask, d_mask, elements * sizeof(float), cudaMemcpyDeviceToDevice);
+	PoolMalloc((void**)&scorer->d_imagesft, elementsft * ntilts * sizeof(float2));
+	PoolMalloc((void**)&scorer->d_means, elements * ntilts * sizeof(float));
+	PoolMalloc((void**)&scorer->d_scales, elements * ntilts * sizeof(float));
+
+	float2* d_maskft;
+	PoolMalloc((void**)&d_maskft, elementsft * sizeof(float2));
+	d_FFTR2CCached(scorer->d_mask, d_maskft, 2, toInt3(dims));
+
+	float* d_squares;
+	PoolMalloc((void**)&d_squares, elements * ntilts * sizeof(float));
+	float2* d_squaresft;
+	PoolMalloc((void**)&d_squaresft, elementsft * ntilts * sizeof(float2));
+
+	d_MultiplyByVector(d_experimental, d_experimental, d_squares, elements * ntilts);
+	d_FFTR2CCached(d_experimental, scorer->d_imagesft, 2, toInt3(dims), ntilts);
+
+	// Masked sums of the image and its square for every shift, turned into mean and inverse standard deviation
+	int TpB = 128;
+	dim3 grid = dim3(tmin(8192, (int)((elementsft * ntilts + TpB - 1) / TpB)), 1, 1);
+
+	TomoScorerMultiplyConjKernel <<<grid, TpB>>> (d_maskft, 1, scorer->d_imagesft, ntilts, d_squaresft, NULL, elementsft, ntilts);
+	d_IFFTC2RCached(d_squaresft, scorer->d_means, 2, toInt3(dims), ntilts);
+
+	d_FFTR2CCached(d_squares, d_squaresft, 2, toInt3(dims), ntilts);
+	TomoScorerMultiplyConjKernel <<<grid, TpB>>> (d_maskft, 1, d_squaresft, ntilts, d_squaresft, NULL, elementsft, ntilts);
+	d_IFFTC2RCached(d_squaresft, scorer->d_scales, 2, toInt3(dims), ntilts);
+
+	dim3 gridstats = dim3(tmin(8192, (int)((elements * ntilts + TpB - 1) / TpB)), 1, 1);
+	TomoScorerStatsKernel <<<gridstats, TpB>>> (scorer->d_means, scorer->d_scales, scorer->masknorm, elements * ntilts);
+
+	PoolFree(d_squaresft);
+	PoolFree(d_squares);
+	PoolFree(d_maskft);
+
+	return scorer;
+}
+
+__declspec(dllexport) void DestroyTomoRealspaceScorer(void* tomoscorer)
+{
+	if (tomoscorer == NULL)
+		return;
+
+	TomoRealspaceScorer* scorer = (TomoRealspaceScorer*)tomoscorer;
+	PoolFree(scorer->d_scales);
+	PoolFree(scorer->d_means);
+	PoolFree(scorer->d_imagesft);
+	PoolFree(scorer->d_mask);
+	delete scorer;
+}
+
+/*
+
+Scores every projection (ntilts images each, normalized like for TomoRealspaceCorrelate) at every candidate shift,
+given as ntilts 3D shifts per candidate like h_shifts there, and returns each projection's topk best candidates
+in descending order of score; slots beyond nshifts get index -1.
+
+*/
+
+__declspec(dllexport) void TomoRealspaceScorerCorrelate(void* tomoscorer, float* d_projections, uint nprojections, float* d_weights, float* h_shifts, uint nshifts, int topk, int* h_bestshifts, float* h_bestscores)
+{
+	TomoRealspaceScorer* scorer = (TomoRealspaceScorer*)tomoscorer;
+	int2 dims = scorer->dims;
+	uint ntilts = scorer->ntilts;
+	size_t elements = Elements2(dims), elementsft = ElementsFFT2(dims);
+
+	std::vector<float2> shifts((size_t)nshifts * ntilts);
+	for (size_t i = 0; i < shifts.size(); i++)
+		shifts[i] = make_float2(h_shifts[i * 3], h_shifts[i * 3 + 1]);
+	float2* d_shifts = (float2*)PoolMallocFromHostArray(shifts.data(), shifts.size() * sizeof(float2));
+
+	// Maps and transforms for a batch of projections at a time
+	uint batch = (uint)tmax((size_t)1, tmin((size_t)nprojections, (size_t)TOMO_SCORER_BYTES / (ntilts * (elements * sizeof(float) + elementsft * sizeof(float2)))));
+
+	float* d_maps;
+	PoolMalloc((void**)&d_maps, elements * ntilts * batch * sizeof(float));
+	float2* d_mapsft;
+	PoolMalloc((void**)&d_mapsft, elementsft * ntilts * batch * sizeof(float2));
+	float* d_dc;
+	PoolMalloc((void**)&d_dc, ntilts * batch * sizeof(float));
+	float* d_scores;
+	PoolMalloc((void**)&d_scores, (size_t)nshifts * batch * sizeof(float));
+
+	std::vector<float> h_scores((size_t)nshifts * batch);
+	std::vector<int> order(nshifts);
+
+	for (uint first = 0; first < nprojections; first += batch)
+	{
+		uint n = tmin(batch, nprojections - first);
+		uint nimages = n * ntilts;
+
+		d_MultiplyByVector(d_projections + elements * ntilts * first, scorer->d_mask, d_maps, elements, nimages);
+		d_FFTR2CCached(d_maps, d_mapsft, 2, toInt3(dims), nimages);
+
+		int TpB = 128;
+		dim3 grid = dim3(tmin(8192, (int)((elementsft * nimages + TpB - 1) / TpB)), 1, 1);
+		TomoScorerMultiplyConjKernel <<<grid, TpB>>> (d_mapsft, nimages, scorer->d_imagesft, ntilts, d_mapsft, d_dc, elementsft, nimages);
+		d_IFFTC2RCached(d_mapsft, d_maps, 2, toInt3(dims), nimages);
+
+		dim3 gridnorm = dim3(tmin(8192, (int)((elements * nimages + TpB - 1) / TpB)), 1, 1);
+		TomoScorerNormalizeKernel <<<gridnorm, TpB>>> (d_maps, scorer->d_means, scorer->d_scales, d_dc, scorer->masknorm, elements, ntilts, n);
+
+		dim3 gridscore = dim3((nshifts + TpB - 1) / TpB, n, 1);
+		TomoScorerScoreKernel <<<gridscore, TpB>>> (d_maps, dims, ntilts, d_weights, d_shifts, nshifts, d_scores);
+
+		cudaMemcpy(h_scores.data(), d_scores, (size_t)nshifts * n * sizeof(float), cudaMemcpyDeviceToHost);
+
+		for (uint p = 0; p < n; p++)
+		{
+			const float* scores = h_scores.data() + (size_t)nshifts * p;
+			for (uint s = 0; s < nshifts; s++)
+				order[s] = s;
+
+			int nbest = tmin(topk, (int)nshifts);
+			std::partial_sort(order.begin(), order.begin() + nbest, order.end(), [&](int a, int b) { return scores[a] > scores[b] || (scores[a] == scores[b] && a < b); });
+
+			for (int k = 0; k < topk; k++)
+			{
+				h_bestshifts[(size_t)(first + p) * topk + k] = k < nbest ? order[k] : -1;
+				h_bestscores[(size_t)(first + p) * topk + k] = k < nbest ? scores[order[k]] : -1e30f;
+			}
+		}
+	}
+
+	PoolFree(d_scores);
+	PoolFree(d_dc);
+	PoolFree(d_mapsft);
+	PoolFree(d_maps);
+	PoolFree(d_shifts);
+}
+
+// d_output = d_a * conj(d_b), with either broadcast over the batch by index modulo its own batch size; d_dc gets
+// each product's real DC component from d_a before it's overwritten, i.e. the sum of d_a's real-space input
+__global__ void TomoScorerMultiplyConjKernel(float2* d_a, uint abatch, float2* d_b, uint bbatch, float2* d_output, float* d_dc, uint elements, uint batch)
+{
+	for (size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < (size_t)elements * batch; id += gridDim.x * blockDim.x)
 	{
-		d_result[blockIdx.x] = s_corrsum;
+		uint b = id / elements, i = id % elements;
+		float2 a = d_a[(size_t)(b % abatch) * elements + i];
+		float2 v = d_b[(size_t)(b % bbatch) * elements + i];
+
+		if (d_dc != NULL && i == 0)
+			d_dc[b] = a.x;
+
+		d_output[id] = make_float2(a.x * v.x + a.y * v.y, a.y * v.x - a.x * v.y);
 	}
 }
 
+__global__ void TomoScorerStatsKernel(float* d_sums1, float* d_sums2, float masknorm, uint n)
+{
+	for (uint id = blockIdx.x * blockDim.x + threadIdx.x; id < n; id += gridDim.x * blockDim.x)
+	{
+		float mean = d_sums1[id] * masknorm;
+		float stddev = sqrt(tmax(0.0f, d_sums2[id] * masknorm - mean * mean));
+
+		d_sums1[id] = mean;
+		d_sums2[id] = stddev > 0.0f ? 1.0f / stddev : 0.0f;
+	}
+}
+
+__global__ void TomoScorerNormalizeKernel(float* d_maps, float* d_means, float* d_scales, float* d_dc, float masknorm, uint elements, uint ntilts, uint batch)
+{
+	for (size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < (size_t)elements * ntilts * batch; id += gridDim.x * blockDim.x)
+	{
+		uint image = id / elements;
+		size_t statsid = (size_t)(image % ntilts) * elements + id % elements;
+
+		d_maps[id] = (d_maps[id] - d_means[statsid] * d_dc[image]) * d_scales[statsid] * masknorm;
+	}
+}
+
+__device__ float TomoScorerCatmullRom(const float* d_map, int2 dims, float2 shift)
+{
+	float fx = floor(shift.x), fy = floor(shift.y);
+	float tx = shift.x - fx, ty = shift.y - fy;
+
+	float wx[4] = { ((-tx + 2.0f) * tx - 1.0f) * tx * 0.5f, ((3.0f * tx - 5.0f) * tx * tx + 2.0f) * 0.5f, ((-3.0f * tx + 4.0f) * tx + 1.0f) * tx * 0.5f, (tx - 1.0f) * tx * tx * 0.5f };
+	float wy[4] = { ((-ty + 2.0f) * ty - 1.0f) * ty * 0.5f, ((3.0f * ty - 5.0f) * ty * ty + 2.0f) * 0.5f, ((-3.0f * ty + 4.0f) * ty + 1.0f) * ty * 0.5f, (ty - 1.0f) * ty * ty * 0.5f };
+
+	int x0 = (int)fx - 1, y0 = (int)fy - 1;
+	float sum = 0.0f;
+	for (int j = 0; j < 4; j++)
+	{
+		int y = ((y0 + j) % dims.y + dims.y) % dims.y;
+		float row = 0.0f;
+		for (int i = 0; i < 4; i++)
+			row += d_map[y * dims.x + ((x0 + i) % dims.x + dims.x) % dims.x] * wx[i];
+		sum += row * wy[j];
+	}
+
+	return sum;
+}
+
+__global__ void TomoScorerScoreKernel(float* d_maps, int2 dims, uint ntilts, float* d_weights, float2* d_shifts, uint nshifts, float* d_scores)
+{
+	uint s = blockIdx.x * blockDim.x + threadIdx.x;
+	if (s >= nshifts)
+		return;
+
+	d_maps += (size_t)dims.x * dims.y * ntilts * blockIdx.y;
+
+	float score = 0.0f;
+	for (uint t = 0; t < ntilts; t++)
+		score += TomoScorerCatmullRom(d_maps + (size_t)dims.x * dims.y * t, dims, d_shifts[s * ntilts + t]) * d_weights[t];
+
+	d_scores[(size_t)blockIdx.y * nshifts + s] = score;
+}
+
 __declspec(dllexport) void TomoGlobalAlign(float2* d_experimental, 
 												float2* d_shiftfactors, 
 												float* d_ctf,
@@ -213,12 +471,15 @@ __declspec(dllexport) void TomoGlobalAlign(float2* d_experimental,
 	uint batchangles = 128;
 
 	float2* d_proj;
-	cudaMalloc((void**)&d_proj, ElementsFFT2(dims) * batchangles * ntilts * sizeof(float2));
+	PoolMalloc((void**)&d_proj, ElementsFFT2(dims) * batchangles * ntilts * sizeof(float2));
 
 	float* d_scores;
-	cudaMalloc((void**)&d_scores, nparticles * batchangles * nshifts * sizeof(float));
+	PoolMalloc((void**)&d_scores, nparticles * batchangles * nshifts * sizeof(float));
 
-	float2* d_shifts = (float2*)CudaMallocFromHostArray(h_shifts, nshifts * ntilts * sizeof(float2));
+	float2* d_shifts = (float2*)PoolMallocFromHostArray(h_shifts, nshifts * ntilts * sizeof(float2));
+
+	PhaseRampView ramps;
+	AcquirePhaseRamps(d_shiftfactors, ElementsFFT2(dims), d_shifts, nshifts * ntilts, &ramps);
 
 	for (uint b = 0; b < nangles; b += batchangles)
 	{
@@ -232,7 +493,7 @@ __declspec(dllexport) void TomoGlobalAlign(float2* d_experimental,
 		float* d_debugdiff = NULL;
 		//cudaMalloc((void**)&d_debugdiff, npositions * nframes * ElementsFFT2(dims) * sizeof(float));
 
-		TomoGlobalAlignKernel <<<grid, TpB>>> (d_experimental, d_proj, d_shiftfactors, d_ctf, ElementsFFT2(dims), ntilts, d_shifts, d_scores, d_weights, d_debugdiff);
+		TomoGlobalAlignKernel <<<grid, TpB>>> (d_experimental, d_proj, d_shiftfactors, ramps, d_ctf, ElementsFFT2(dims), ntilts, d_shifts, d_scores, d_weights, NULL, d_debugdiff);
 	
 		float* h_scores = (float*)MallocFromDeviceArray(d_scores, nparticles * curbatch * nshifts * sizeof(float));
 
@@ -249,13 +510,360 @@ __declspec(dllexport) void TomoGlobalAlign(float2* d_experimental,
 					}
 				}
 	}
+
+	ReleasePhaseRamps(&ramps);
 	
-	cudaFree(d_shifts);
-	cudaFree(d_scores);
-	cudaFree(d_proj);
+	PoolFree(d_shifts);
+	PoolFree(d_scores);
+	PoolFree(d_proj);
+}
+
+/*
+
+Coarse-to-fine variant of TomoGlobalAlign, see the CPU version for the details. The coarse pass gathers the
+components below the cutoff on the device, scores them with TomoGlobalAlignKernel, and keeps every particle's
+topk candidates in TomoTopKKernel, so no score tensor ever leaves the device. The neighborhoods are built on
+the host from the few candidates; the fine pass then scores each batch's (particle, angle, shift) pairs in
+one launch.
+
+*/
+
+namespace
+{
+	struct AlignCandidate
+	{
+		float score;
+		int angle, shift;
+	};
+
+	// ZYZ rotation in radians, same convention as the projector
+	void AlignRotation(float3 angles, float* m)
+	{
+		float ca = cos(angles.x), sa = sin(angles.x);
+		float cb = cos(angles.y), sb = sin(angles.y);
+		float cg = cos(angles.z), sg = sin(angles.z);
+		float cc = cb * ca, cs = cb * sa, sc = sb * ca, ss = sb * sa;
+
+		m[0] = cg * cc - sg * sa;   m[1] = cg * cs + sg * ca;   m[2] = -cg * sb;
+		m[3] = -sg * cc - cg * sa;  m[4] = -sg * cs + cg * ca;  m[5] = sg * sb;
+		m[6] = sc;                  m[7] = ss;                  m[8] = cb;
+	}
+
+	// Members of a grid within radius of the point, given the point's distances to every member.
+	// radius <= 0 picks 1.75x the distance to the nearest other member.
+	void GridNeighbors(const std::vector<float> &distances, float radius, std::vector<int> &neighbors)
+	{
+		if (radius <= 0)
+		{
+			float nearest = 1e30f;
+			for (float d : distances)
+				if (d > 1e-5f)
+					nearest = tmin(nearest, d);
+
+			radius = nearest < 1e30f ? 1.75f * nearest : 0.0f;
+		}
+
+		neighbors.clear();
+		for (int i = 0; i < (int)distances.size(); i++)
+			if (distances[i] <= radius + 1e-5f)
+				neighbors.push_back(i);
+	}
+}
+
+__declspec(dllexport) void TomoGlobalAlignHierarchical(float2* d_experimental,
+														float2* d_shiftfactors,
+														float* d_ctf,
+														float* d_weights,
+														int2 dims,
+														float2* d_ref,
+														int3 dimsref,
+														int refsupersample,
+														float3* h_angles,
+														uint nangles,
+														float2* h_shifts,
+														uint nshifts,
+														uint nparticles,
+														uint ntilts,
+														float coarsecutoff,
+														int topk,
+														float angleradius,
+														float shiftradius,
+														int* h_bestangles,
+														int* h_bestshifts,
+														float* h_bestscores)
+{
+	uint batchangles = 128;
+	uint length = (uint)ElementsFFT2(dims);
+	topk = tmax(1, topk);
+
+	int TpB = TOMO_THREADS;
+	float2* d_shifts = (float2*)PoolMallocFromHostArray(h_shifts, nshifts * ntilts * sizeof(float2));
+
+	// Coarse pass
+
+	// Components within the cutoff radius, by their position in the small box and in the full one
+	int rcoarse = tmax(1, tmin(dims.x / 2, (int)ceil(coarsecutoff * dims.x / 2)));
+	int2 dimscoarse = toInt2(2 * rcoarse, 2 * rcoarse);
+	uint lengthcoarseproj = (uint)ElementsFFT2(dimscoarse);
+
+	std::vector<uint> coarseprojindices, coarsefullindices;
+	for (int y = 0; y < dimscoarse.y; y++)
+	{
+		int ky = y < (dimscoarse.y + 1) / 2 ? y : y - dimscoarse.y;		// Same convention as the projector
+		for (int x = 0; x <= rcoarse; x++)
+		{
+			if (x * x + ky * ky > rcoarse * rcoarse)
+				continue;
+
+			coarseprojindices.push_back(y * (rcoarse + 1) + x);
+			coarsefullindices.push_back((ky >= 0 ? ky : ky + dims.y) * (dims.x / 2 + 1) + x);
+		}
+	}
+	uint lengthcoarse = (uint)coarseprojindices.size();
+
+	uint* d_coarseprojindices = (uint*)PoolMallocFromHostArray(coarseprojindices.data(), lengthcoarse * sizeof(uint));
+	uint* d_coarsefullindices = (uint*)PoolMallocFromHostArray(coarsefullindices.data(), lengthcoarse * sizeof(uint));
+
+	float2* d_coarseexperimental;
+	PoolMalloc((void**)&d_coarseexperimental, (size_t)nparticles * ntilts * lengthcoarse * sizeof(float2));
+	float* d_coarsectf;
+	PoolMalloc((void**)&d_coarsectf, (size_t)nparticles * ntilts * lengthcoarse * sizeof(float));
+	float2* d_coarsefactors;
+	PoolMalloc((void**)&d_coarsefactors, lengthcoarse * sizeof(float2));
+
+	{
+		dim3 grid = dim3(tmin(8192, (int)(((size_t)nparticles * ntilts * lengthcoarse + TpB - 1) / TpB)), 1, 1);
+		TomoGatherKernel<float2> <<<grid, TpB>>> (d_experimental, length, d_coarsefullindices, lengthcoarse, d_coarseexperimental, nparticles * ntilts);
+		TomoGatherKernel<float> <<<grid, TpB>>> (d_ctf, length, d_coarsefullindices, lengthcoarse, d_coarsectf, nparticles * ntilts);
+		TomoGatherKernel<float2> <<<dim3((lengthcoarse + TpB - 1) / TpB), TpB>>> (d_shiftfactors, 0, d_coarsefullindices, lengthcoarse, d_coarsefactors, 1);
+	}
+
+	float* d_topscores;
+	PoolMalloc((void**)&d_topscores, nparticles * topk * sizeof(float));
+	int* d_topangles;
+	PoolMalloc((void**)&d_topangles, nparticles * topk * sizeof(int));
+	int* d_topshifts;
+	PoolMalloc((void**)&d_topshifts, nparticles * topk * sizeof(int));
+	int* d_topcount;
+	PoolMalloc((void**)&d_topcount, nparticles * sizeof(int));
+	cudaMemset(d_topcount, 0, nparticles * sizeof(int));
+
+	{
+		float2* d_proj;
+		PoolMalloc((void**)&d_proj, (size_t)lengthcoarseproj * batchangles * ntilts * sizeof(float2));
+		float2* d_reference;
+		PoolMalloc((void**)&d_reference, (size_t)lengthcoarse * batchangles * ntilts * sizeof(float2));
+		float* d_scores;
+		PoolMalloc((void**)&d_scores, (size_t)nparticles * batchangles * nshifts * sizeof(float));
+
+		PhaseRampView ramps;
+		AcquirePhaseRamps(d_coarsefactors, lengthcoarse, d_shifts, nshifts * ntilts, &ramps);
+
+		for (uint b = 0; b < nangles; b += batchangles)
+		{
+			uint curbatch = tmin(batchangles, nangles - b);
+
+			d_rlnProject(d_ref, dimsref, d_proj, toInt3(dimscoarse), (tfloat3*)h_angles + b * ntilts, refsupersample, curbatch * ntilts);
+
+			dim3 gridgather = dim3(tmin(8192, (int)(((size_t)curbatch * ntilts * lengthcoarse + TpB - 1) / TpB)), 1, 1);
+			TomoGatherKernel<float2> <<<gridgather, TpB>>> (d_proj, lengthcoarseproj, d_coarseprojindices, lengthcoarse, d_reference, curbatch * ntilts);
+
+			dim3 grid = dim3(nshifts, curbatch, nparticles);
+			TomoGlobalAlignKernel <<<grid, TpB>>> (d_coarseexperimental, d_reference, d_coarsefactors, ramps, d_coarsectf, lengthcoarse, ntilts, d_shifts, d_scores, d_weights, NULL, NULL);
+
+			TomoTopKKernel <<<dim3((nparticles + TpB - 1) / TpB), TpB>>> (d_scores, nparticles, curbatch, nshifts, b, topk, d_topscores, d_topangles, d_topshifts, d_topcount);
+		}
+
+		ReleasePhaseRamps(&ramps);
+
+		PoolFree(d_scores);
+		PoolFree(d_reference);
+		PoolFree(d_proj);
+	}
+
+	std::vector<std::vector<AlignCandidate>> candidates(nparticles);
+	{
+		std::vector<float> topscores((size_t)nparticles * topk);
+		std::vector<int> topangles((size_t)nparticles * topk), topshifts((size_t)nparticles * topk), topcount(nparticles);
+		cudaMemcpy(topscores.data(), d_topscores, topscores.size() * sizeof(float), cudaMemcpyDeviceToHost);
+		cudaMemcpy(topangles.data(), d_topangles, topangles.size() * sizeof(int), cudaMemcpyDeviceToHost);
+		cudaMemcpy(topshifts.data(), d_topshifts, topshifts.size() * sizeof(int), cudaMemcpyDeviceToHost);
+		cudaMemcpy(topcount.data(), d_topcount, topcount.size() * sizeof(int), cudaMemcpyDeviceToHost);
+
+		for (uint p = 0; p < nparticles; p++)
+			for (int k = 0; k < topcount[p]; k++)
+				candidates[p].push_back({ topscores[(size_t)p * topk + k], topangles[(size_t)p * topk + k], topshifts[(size_t)p * topk + k] });
+	}
+
+	PoolFree(d_topcount);
+	PoolFree(d_topshifts);
+	PoolFree(d_topangles);
+	PoolFree(d_topscores);
+	PoolFree(d_coarsefactors);
+	PoolFree(d_coarsectf);
+	PoolFree(d_coarseexperimental);
+	PoolFree(d_coarsefullindices);
+	PoolFree(d_coarseprojindices);
+
+	// Neighborhoods in the angle and shift grids
+
+	std::vector<int> uniqueangles, uniqueshifts;
+	for (uint p = 0; p < nparticles; p++)
+		for (const AlignCandidate &c : candidates[p])
+		{
+			uniqueangles.push_back(c.angle);
+			uniqueshifts.push_back(c.shift);
+		}
+	std::sort(uniqueangles.begin(), uniqueangles.end());
+	uniqueangles.erase(std::unique(uniqueangles.begin(), uniqueangles.end()), uniqueangles.end());
+	std::sort(uniqueshifts.begin(), uniqueshifts.end());
+	uniqueshifts.erase(std::unique(uniqueshifts.begin(), uniqueshifts.end()), uniqueshifts.end());
+
+	std::vector<float> rotations((size_t)nangles * 9);
+	for (uint a = 0; a < nangles; a++)
+		AlignRotation(h_angles[(size_t)a * ntilts], rotations.data() + (size_t)a * 9);
+
+	std::vector<std::vector<int>> angleneighbors(uniqueangles.size()), shiftneighbors(uniqueshifts.size());
+
+	for (size_t u = 0; u < uniqueangles.size(); u++)
+	{
+		const float* A = rotations.data() + (size_t)uniqueangles[u] * 9;
+		std::vector<float> distances(nangles);
+		for (uint a = 0; a < nangles; a++)
+		{
+			// Rotation angle of A^T * B from its trace
+			const float* B = rotations.data() + (size_t)a * 9;
+			float trace = 0;
+			for (int i = 0; i < 9; i++)
+				trace += A[i] * B[i];
+
+			distances[a] = acos(tmax(-1.0f, tmin(1.0f, (trace - 1.0f) * 0.5f)));
+		}
+
+		GridNeighbors(distances, angleradius, angleneighbors[u]);
+	}
+
+	for (size_t u = 0; u < uniqueshifts.size(); u++)
+	{
+		std::vector<float> distances(nshifts);
+		for (uint s = 0; s < nshifts; s++)
+		{
+			float maxdist2 = 0;
+			for (uint n = 0; n < ntilts; n++)
+			{
+				float2 diff = h_shifts[(size_t)s * ntilts + n] - h_shifts[(size_t)uniqueshifts[u] * ntilts + n];
+				maxdist2 = tmax(maxdist2, dotp2(diff, diff));
+			}
+
+			distances[s] = sqrt(maxdist2);
+		}
+
+		GridNeighbors(distances, shiftradius, shiftneighbors[u]);
+	}
+
+	// Fine pass
+
+	// Per particle, all (angle, shift) pairs in its candidates' neighborhoods, sorted by angle
+	std::vector<std::vector<int2>> pairs(nparticles);
+	for (uint p = 0; p < nparticles; p++)
+	{
+		for (const AlignCandidate &c : candidates[p])
+		{
+			const std::vector<int> &angles = angleneighbors[std::lower_bound(uniqueangles.begin(), uniqueangles.end(), c.angle) - uniqueangles.begin()];
+			const std::vector<int> &shifts = shiftneighbors[std::lower_bound(uniqueshifts.begin(), uniqueshifts.end(), c.shift) - uniqueshifts.begin()];
+
+			for (int a : angles)
+				for (int s : shifts)
+					pairs[p].push_back(toInt2(a, s));
+		}
+
+		std::sort(pairs[p].begin(), pairs[p].end(), [](int2 a, int2 b) { return a.x < b.x || (a.x == b.x && a.y < b.y); });
+		pairs[p].erase(std::unique(pairs[p].begin(), pairs[p].end(), [](int2 a, int2 b) { return a.x == b.x && a.y == b.y; }), pairs[p].end());
+	}
+
+	std::vector<int> fineangles;
+	for (uint p = 0; p < nparticles; p++)
+		for (int2 pair : pairs[p])
+			fineangles.push_back(pair.x);
+	std::sort(fineangles.begin(), fineangles.end());
+	fineangles.erase(std::unique(fineangles.begin(), fineangles.end()), fineangles.end());
+
+	std::vector<AlignCandidate> finebest(nparticles, { -1e30f, 0, 0 });
+	{
+		PhaseRampView ramps;
+		AcquirePhaseRamps(d_shiftfactors, length, d_shifts, nshifts * ntilts, &ramps);
+
+		float2* d_proj;
+		PoolMalloc((void**)&d_proj, (size_t)length * batchangles * ntilts * sizeof(float2));
+		std::vector<float3> batchanglesdata((size_t)batchangles * ntilts);
+
+		for (size_t b = 0; b < fineangles.size(); b += batchangles)
+		{
+			uint curbatch = (uint)tmin((size_t)batchangles, fineangles.size() - b);
+			for (uint a = 0; a < curbatch; a++)
+				for (uint n = 0; n < ntilts; n++)
+					batchanglesdata[(size_t)a * ntilts + n] = h_angles[(size_t)fineangles[b + a] * ntilts + n];
+
+			d_rlnProject(d_ref, dimsref, d_proj, toInt3(dims), (tfloat3*)batchanglesdata.data(), refsupersample, curbatch * ntilts);
+
+			// (particle, slot in this batch's projections, shift) for every pair whose angle is in the batch
+			int firstangle = fineangles[b], lastangle = fineangles[b + curbatch - 1];
+			std::vector<int3> batchpairs;
+			std::vector<int2> batchorigin;
+			for (uint p = 0; p < nparticles; p++)
+			{
+				auto first = std::lower_bound(pairs[p].begin(), pairs[p].end(), toInt2(firstangle, 0), [](int2 a, int2 b) { return a.x < b.x; });
+				auto last = std::upper_bound(pairs[p].begin(), pairs[p].end(), toInt2(lastangle, 0), [](int2 a, int2 b) { return a.x < b.x; });
+
+				for (auto pair = first; pair != last; pair++)
+				{
+					int slot = (int)(std::lower_bound(fineangles.begin() + b, fineangles.begin() + b + curbatch, pair->x) - (fineangles.begin() + b));
+					batchpairs.push_back(make_int3(p, slot, pair->y));
+					batchorigin.push_back(*pair);
+				}
+			}
+			if (batchpairs.empty())
+				continue;
+
+			int3* d_pairs = (int3*)PoolMallocFromHostArray(batchpairs.data(), batchpairs.size() * sizeof(int3));
+			float* d_scores;
+			PoolMalloc((void**)&d_scores, batchpairs.size() * sizeof(float));
+
+			TomoGlobalAlignKernel <<<dim3((uint)batchpairs.size()), TpB>>> (d_experimental, d_proj, d_shiftfactors, ramps, d_ctf, length, ntilts, d_shifts, d_scores, d_weights, d_pairs, NULL);
+
+			std::vector<float> scores(batchpairs.size());
+			cudaMemcpy(scores.data(), d_scores, scores.size() * sizeof(float), cudaMemcpyDeviceToHost);
+
+			PoolFree(d_scores);
+			PoolFree(d_pairs);
+
+			// Same tie-breaking as the exhaustive search: lowest angle, then lowest shift
+			for (size_t i = 0; i < batchpairs.size(); i++)
+			{
+				AlignCandidate &best = finebest[batchpairs[i].x];
+				int2 pair = batchorigin[i];
+				if (scores[i] > best.score || (scores[i] == best.score && (pair.x < best.angle || (pair.x == best.angle && pair.y < best.shift))))
+					best = { scores[i], pair.x, pair.y };
+			}
+		}
+
+		PoolFree(d_proj);
+		ReleasePhaseRamps(&ramps);
+	}
+
+	for (uint p = 0; p < nparticles; p++)
+		if (h_bestscores[p] < finebest[p].score)
+		{
+			h_bestscores[p] = finebest[p].score;
+			h_bestangles[p] = finebest[p].angle;
+			h_bestshifts[p] = finebest[p].shift;
+		}
+
+	PoolFree(d_shifts);
 }
 
-__global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, float* d_ctf, uint length, uint ntilts, float2* d_shifts, float* d_diff, float* d_weights, float* d_debugdiff)
+// Scores every (particle, angle, shift) of the grid, or, if d_pairs is given, one (particle, angle, shift) per block along x
+__global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_reference, float2* d_shiftfactors, PhaseRampView ramps, float* d_ctf, uint length, uint ntilts, float2* d_shifts, float* d_diff, float* d_weights, int3* d_pairs, float* d_debugdiff)
 {
 	__shared__ float s_num[TOMO_THREADS];
 	s_num[threadIdx.x] = 0.0f;
@@ -267,6 +875,13 @@ __global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_referenc
 	uint shiftid = blockIdx.x;
 	uint angleid = blockIdx.y;
 	uint partid = blockIdx.z;
+	if (d_pairs != NULL)
+	{
+		int3 pair = d_pairs[blockIdx.x];
+		partid = pair.x;
+		angleid = pair.y;
+		shiftid = pair.z;
+	}
 
 	d_experimental += partid * length * ntilts;
 	d_reference += angleid * length * ntilts;
@@ -292,8 +907,7 @@ __global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_referenc
 
 			float2 shiftfactors = d_shiftfactors[id];
 
-			float phase = shiftfactors.x * shift.x + shiftfactors.y * shift.y;
-			float2 change = make_float2(__cosf(phase), __sinf(phase));
+			float2 change = d_PhaseRamp(ramps, shiftid * ntilts + n, id, shiftfactors, shift);
 			experimental = cuCmulf(experimental, change);
 
 			float weight = abs(d_ctf[id]);
@@ -343,5 +957,49 @@ __global__ void TomoGlobalAlignKernel(float2* d_experimental, float2* d_referenc
 	__syncthreads();
 
 	if (threadIdx.x == 0)
-		d_diff[(partid * gridDim.y + angleid) * gridDim.x + shiftid] = partsum;
+		d_diff[d_pairs != NULL ? blockIdx.x : (partid * gridDim.y + angleid) * gridDim.x + shiftid] = partsum;
+}
+
+template<class T> __global__ void TomoGatherKernel(T* d_input, size_t inputstride, uint* d_indices, uint n, T* d_output, uint batch)
+{
+	for (size_t id = blockIdx.x * blockDim.x + threadIdx.x; id < (size_t)n * batch; id += gridDim.x * blockDim.x)
+		d_output[id] = d_input[(id / n) * inputstride + d_indices[id % n]];
+}
+
+// One thread per particle merges a batch of scores into the particle's list of the topk best, sorted best first.
+// Same order as InsertCandidate on the CPU: equal scores go behind the ones already in the list.
+__global__ void TomoTopKKernel(float* d_scores, uint nparticles, uint nangles, uint nshifts, int firstangle, int topk, float* d_topscores, int* d_topangles, int* d_topshifts, int* d_topcount)
+{
+	uint p = blockIdx.x * blockDim.x + threadIdx.x;
+	if (p >= nparticles)
+		return;
+
+	d_scores += (size_t)p * nangles * nshifts;
+	d_topscores += p * topk;
+	d_topangles += p * topk;
+	d_topshifts += p * topk;
+	int count = d_topcount[p];
+
+	for (uint i = 0; i < nangles * nshifts; i++)
+	{
+		float score = d_scores[i];
+		if (count == topk && d_topscores[count - 1] >= score)
+			continue;
+
+		// If the list is full, the last entry drops out
+		int slot = count < topk ? count : topk - 1;
+		for (; slot > 0 && d_topscores[slot - 1] < score; slot--)
+		{
+			d_topscores[slot] = d_topscores[slot - 1];
+			d_topangles[slot] = d_topangles[slot - 1];
+			d_topshifts[slot] = d_topshifts[slot - 1];
+		}
+
+		d_topscores[slot] = score;
+		d_topangles[slot] = firstangle + i / nshifts;
+		d_topshifts[slot] = i % nshifts;
+		count = tmin(count + 1, topk);
+	}
+
+	d_topcount[p] = count;
 }
\ No newline at end of file
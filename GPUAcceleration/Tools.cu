@@ -4,12 +4,12 @@ using namespace gtom;
 
 __declspec(dllexport) void FFT(float* d_input, float2* d_output, int3 dims, uint batch)
 {
-    d_FFTR2C(d_input, d_output, DimensionCount(dims), dims, batch);
+    d_FFTR2CCached(d_input, d_output, DimensionCount(dims), dims, batch);
 }
 
 __declspec(dllexport) void IFFT(float2* d_input, float* d_output, int3 dims, uint batch)
 {
-    d_IFFTC2R(d_input, d_output, DimensionCount(dims), dims, batch);
+    d_IFFTC2RCached(d_input, d_output, DimensionCount(dims), dims, batch);
 }
 
 __declspec(dllexport) void Pad(float* d_input, float* d_output, int3 olddims, int3 newdims, uint batch)
@@ -59,20 +59,20 @@ __declspec(dllexport) void RemapFullFromFTFloat(float* d_input, float* d_output,
 
 __declspec(dllexport) void Extract(float* d_input, float* d_output, int3 dims, int3 dimsregion, int3* h_origins, uint batch)
 {
-	int3* d_origins = (int3*)CudaMallocFromHostArray(h_origins, batch * sizeof(int3));
+	int3* d_origins = (int3*)PoolMallocFromHostArray(h_origins, batch * sizeof(int3));
 
 	d_ExtractMany(d_input, d_output, dims, dimsregion, d_origins, batch);
 
-	cudaFree(d_origins);
+	PoolFree(d_origins);
 }
 
 __declspec(dllexport) void ExtractHalf(half* d_input, half* d_output, int3 dims, int3 dimsregion, int3* h_origins, uint batch)
 {
-	int3* d_origins = (int3*)CudaMallocFromHostArray(h_origins, batch * sizeof(int3));
+	int3* d_origins = (int3*)PoolMallocFromHostArray(h_origins, batch * sizeof(int3));
 
 	d_ExtractMany(d_input, d_output, dims, dimsregion, d_origins, batch);
 
-	cudaFree(d_origins);
+	PoolFree(d_origins);
 }
 
 __declspec(dllexport) void ReduceMean(float* d_input, float* d_output, uint vectorlength, uint nvectors, uint batch)
@@ -117,17 +117,17 @@ __declspec(dllexport) void ShiftStack(float* d_input, float* d_output, int3 dims
 
 __declspec(dllexport) void ShiftStackMassive(float* d_input, float* d_output, int3 dims, float* h_shifts, uint batch)
 {
-	cufftHandle planforw = d_FFTR2CGetPlan(DimensionCount(dims), dims);
-	cufftHandle planback = d_IFFTC2RGetPlan(DimensionCount(dims), dims);
+	cufftHandle planforw = (cufftHandle)AcquireFFTPlan(FFTPLAN_R2C, DimensionCount(dims), dims);
+	cufftHandle planback = (cufftHandle)AcquireFFTPlan(FFTPLAN_C2R, DimensionCount(dims), dims);
 	float2* d_intermediate;
-	cudaMalloc((void**)&d_intermediate, ElementsFFT(dims) * sizeof(float2));
+	PoolMalloc((void**)&d_intermediate, ElementsFFT(dims) * sizeof(float2));
 
 	for (int b = 0; b < batch; b++)
 		d_Shift(d_input + Elements(dims) * b, d_output + Elements(dims) * b, dims, (tfloat3*)h_shifts + b, &planforw, &planback, d_intermediate);
 
-	cufftDestroy(planforw);
-	cufftDestroy(planback);
-	cudaFree(d_intermediate);
+	ReleaseFFTPlan((size_t)planforw);
+	ReleaseFFTPlan((size_t)planback);
+	PoolFree(d_intermediate);
 }
 
 __declspec(dllexport) void Cart2Polar(float* d_input, float* d_output, int2 dims, uint innerradius, uint exclusiveouterradius, uint batch)
@@ -253,7 +253,7 @@ __declspec(dllexport) void Rotate2D(float* d_input, float* d_output, int2 dims,
 	{
 		int2 dimspadded = dims * oversample;
 	    float* d_temp;
-		cudaMalloc((void**)&d_temp, Elements2(dimspadded) * sizeof(float));
+		PoolMalloc((void**)&d_temp, Elements2(dimspadded) * sizeof(float));
 
 		for (int b = 0; b < batch; b++)
 		{
@@ -262,7 +262,7 @@ __declspec(dllexport) void Rotate2D(float* d_input, float* d_output, int2 dims,
 			d_Scale(d_temp, d_output + Elements2(dims) * b, toInt3(dimspadded), toInt3(dims), T_INTERP_FOURIER);
 		}
 
-		cudaFree(d_temp);
+		PoolFree(d_temp);
 	}
 }
 
@@ -313,7 +313,7 @@ __declspec(dllexport) void ShiftAndRotate2D(float* d_input, float* d_output, int
 	glm::mat3* h_transforms = (glm::mat3*)malloc(batch * sizeof(glm::mat3));
 	for (uint b = 0; b < batch; b++)
 		h_transforms[b] = Matrix3RotationZ(-h_angles[b]) * Matrix3Translation(tfloat2(-h_shifts[b].x, -h_shifts[b].y));
-	glm::mat3* d_transforms = (glm::mat3*)CudaMallocFromHostArray(h_transforms, batch * sizeof(glm::mat3));
+	glm::mat3* d_transforms = (glm::mat3*)PoolMallocFromHostArray(h_transforms, batch * sizeof(glm::mat3));
 	free(h_transforms);
 
 	dim3 TpB = dim3(16, 16);
@@ -321,20 +321,21 @@ __declspec(dllexport) void ShiftAndRotate2D(float* d_input, float* d_output, int
 
 	ShiftAndRotate2DKernel << <grid, TpB >> > (d_input, d_output, dims, dims * 1, d_transforms);
 
-	cudaFree(d_transforms);
+	PoolFree(d_transforms);
 }
 
+// Plans come from the cache and stay reserved for the caller until DestroyFFTPlan gives them back
 __declspec(dllexport) int CreateFFTPlan(int3 dims, uint batch)
 {
-    return d_FFTR2CGetPlan(DimensionCount(dims), dims, batch);
+    return (cufftHandle)AcquireFFTPlan(FFTPLAN_R2C, DimensionCount(dims), dims, batch);
 }
 
 __declspec(dllexport) int CreateIFFTPlan(int3 dims, uint batch)
 {
-    return d_IFFTC2RGetPlan(DimensionCount(dims), dims, batch);
+    return (cufftHandle)AcquireFFTPlan(FFTPLAN_C2R, DimensionCount(dims), dims, batch);
 }
 
 __declspec(dllexport) void DestroyFFTPlan(cufftHandle plan)
 {
-    cufftDestroy(plan);
+    ReleaseFFTPlan((size_t)plan);
 }
\ No newline at end of file
@@ -1,37 +1,338 @@
 #include "Functions.h"
-#include "liblion.h"
+#include <algorithm>
+#include <vector>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace gtom;
 
-__declspec(dllexport) void __stdcall OptimizeWeights(int nrecs, float* h_recft, float* h_recweights, float* h_r2, int elements, int* h_subsets, float* h_bfacs, float* h_weightfactors, float* h_recsum1, float* h_recsum2, float* h_weightsum1, float* h_weightsum2)
+#define WEIGHT_TILE 4096    // Elements per tile: the tile's sums for both subsets take 96 kB
+
+/*
+
+Weighted averaging of many reconstructions for the weight optimization. Every reconstruction n adds
+rec_n * w_n to the sums of its half-set, and w_n to the weight sums, where
+w_n = weightfactor_n * exp(bfac_n * r^2) * weights_n.
+
+The Fourier volume is processed in tiles of WEIGHT_TILE elements, and each tile takes the contributions
+of all reconstructions before the next one is touched, so the sums are read and written once per call
+instead of once per reconstruction.
+
+CreateWeightOptimizer keeps its inputs across calls, since an optimizer evaluates the same reconstructions
+with many different parameters. r^2 only takes as many values as there are distinct shells, so it also
+sorts them once, and then evaluates exp(bfac_n * r^2) once per shell and reconstruction in every call,
+looking it up per element. A single OptimizeWeights call wouldn't make up for the sorting, so it
+evaluates exp per element, in the tiles.
+
+Inputs are either copied, or mapped from files that hold nrecs complex transforms followed by nrecs
+weight volumes, all of 'elements' values in float, i.e. the layout OptimizeWeights takes in h_recft and
+h_recweights; the OS then pages them in tile by tile, so their number isn't limited by memory. Results
+don't depend on the tiling: every element sums its reconstructions in the same order as before.
+
+*/
+
+namespace
 {
-    for (int n = 0; n < nrecs; n++)
+    struct WeightInputs
+    {
+        int nrecs;
+        const float2* recft;
+        const float* weights;
+
+        void* owned;        // Copied inputs, freed with the optimizer
+        void* mapped;       // Mapped file view, unmapped with the optimizer
+        size_t mappedbytes;
+#ifdef _MSC_VER
+        HANDLE file, mapping;
+#endif
+    };
+
+    struct WeightOptimizer
+    {
+        int elements;
+        const float* r2;                    // Only without shells
+        std::vector<float> shells;          // Distinct values of r^2, ascending
+        std::vector<uint> shellindices;     // Per element, index into shells
+        std::vector<WeightInputs> inputs;
+        int nrecs;
+    };
+
+    WeightOptimizer* CreateOptimizer(const float* h_r2, int elements, bool withshells)
     {
-        float Weight = h_weightfactors[n];
-        float Bfac = h_bfacs[n];
+        WeightOptimizer* optimizer = new WeightOptimizer();
+        optimizer->elements = elements;
+        optimizer->r2 = withshells ? NULL : h_r2;
+        optimizer->nrecs = 0;
 
-        float2* recsum;
-        float* weightsum;
+        if (!withshells)
+            return optimizer;
 
-        if (h_subsets[n] % 2 == 0)
+        optimizer->shells.assign(h_r2, h_r2 + elements);
+        std::sort(optimizer->shells.begin(), optimizer->shells.end());
+        optimizer->shells.erase(std::unique(optimizer->shells.begin(), optimizer->shells.end()), optimizer->shells.end());
+
+        optimizer->shellindices.resize(elements);
+        const std::vector<float> &shells = optimizer->shells;
+        uint* shellindices = optimizer->shellindices.data();
+
+#pragma omp parallel for
+        for (int i = 0; i < elements; i++)
+            shellindices[i] = (uint)(std::lower_bound(shells.begin(), shells.end(), h_r2[i]) - shells.begin());
+
+        return optimizer;
+    }
+
+    void ReleaseInputs(WeightInputs &inputs)
+    {
+        if (inputs.owned != NULL)
+            FreeAligned(inputs.owned);
+
+        if (inputs.mapped != NULL)
         {
-            recsum = (float2*)h_recsum1;
-            weightsum = h_weightsum1;
+#ifdef _MSC_VER
+            UnmapViewOfFile(inputs.mapped);
+            CloseHandle(inputs.mapping);
+            CloseHandle(inputs.file);
+#else
+            munmap(inputs.mapped, inputs.mappedbytes);
+#endif
         }
-        else
+    }
+
+    // Maps a whole file read-only, returns false if it doesn't exist or can't be mapped
+    bool MapFile(const char* path, WeightInputs &inputs)
+    {
+#ifdef _MSC_VER
+        inputs.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (inputs.file == INVALID_HANDLE_VALUE)
+            return false;
+
+        LARGE_INTEGER size;
+        GetFileSizeEx(inputs.file, &size);
+        inputs.mappedbytes = (size_t)size.QuadPart;
+
+        inputs.mapping = CreateFileMappingA(inputs.file, NULL, PAGE_READONLY, 0, 0, NULL);
+        inputs.mapped = inputs.mapping != NULL ? MapViewOfFile(inputs.mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        if (inputs.mapped == NULL)
         {
-            recsum = (float2*)h_recsum2;
-            weightsum = h_weightsum2;
+            if (inputs.mapping != NULL)
+                CloseHandle(inputs.mapping);
+            CloseHandle(inputs.file);
+            return false;
         }
+#else
+        int file = open(path, O_RDONLY);
+        if (file < 0)
+            return false;
+
+        struct stat info;
+        fstat(file, &info);
+        inputs.mappedbytes = (size_t)info.st_size;
+
+        void* mapped = inputs.mappedbytes > 0 ? mmap(NULL, inputs.mappedbytes, PROT_READ, MAP_SHARED, file, 0) : MAP_FAILED;
+        close(file);    // The mapping keeps the file
+        if (mapped == MAP_FAILED)
+            return false;
+
+        madvise(mapped, inputs.mappedbytes, MADV_SEQUENTIAL);
+        inputs.mapped = mapped;
+#endif
+
+        return true;
+    }
 
-        float2* rec = (float2*)h_recft + elements * n;
-        float* weights = h_recweights + elements * n;
+    int AddInputs(WeightOptimizer* optimizer, WeightInputs inputs)
+    {
+        int first = optimizer->nrecs;
+        optimizer->inputs.push_back(inputs);
+        optimizer->nrecs += inputs.nrecs;
+
+        return first;
+    }
+
+    // factors = shelltable[shellindices] per element
+    void GatherShellFactors(float* factors, const uint* shellindices, const float* shelltable, int n)
+    {
+        int i = 0;
+
+#ifdef __AVX2__
+        for (; i + 8 <= n; i += 8)
+            _mm256_storeu_ps(factors + i, _mm256_i32gather_ps(shelltable, _mm256_loadu_si256((const __m256i*)(shellindices + i)), 4));
+#endif
+
+        for (; i < n; i++)
+            factors[i] = shelltable[shellindices[i]];
+    }
+
+    // weight = factors * recweights per element; sums += rec * weight, weights += weight
+    void AccumulateTile(float2* recsum, float* weightsum, const float2* rec, const float* recweights, const float* factors, int n)
+    {
+        int i = 0;
 
+#ifdef __AVX2__
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 weight = _mm256_mul_ps(_mm256_loadu_ps(factors + i), _mm256_loadu_ps(recweights + i));
+            _mm256_storeu_ps(weightsum + i, _mm256_add_ps(_mm256_loadu_ps(weightsum + i), weight));
+
+            // Each weight twice, for the real and imaginary parts
+            __m256 low = _mm256_unpacklo_ps(weight, weight), high = _mm256_unpackhi_ps(weight, weight);
+            __m256 weights0 = _mm256_permute2f128_ps(low, high, 0x20), weights1 = _mm256_permute2f128_ps(low, high, 0x31);
+
+            float* sums = (float*)(recsum + i);
+            const float* values = (const float*)(rec + i);
+            _mm256_storeu_ps(sums, _mm256_add_ps(_mm256_loadu_ps(sums), _mm256_mul_ps(_mm256_loadu_ps(values), weights0)));
+            _mm256_storeu_ps(sums + 8, _mm256_add_ps(_mm256_loadu_ps(sums + 8), _mm256_mul_ps(_mm256_loadu_ps(values + 8), weights1)));
+        }
+#endif
+
+        for (; i < n; i++)
+        {
+            float weight = factors[i] * recweights[i];
+            recsum[i].x += rec[i].x * weight;
+            recsum[i].y += rec[i].y * weight;
+            weightsum[i] += weight;
+        }
+    }
+
+    void Accumulate(WeightOptimizer* optimizer, const int* h_subsets, const float* h_bfacs, const float* h_weightfactors, float* h_recsum1, float* h_recsum2, float* h_weightsum1, float* h_weightsum2)
+    {
+        int elements = optimizer->elements;
+        int nshells = (int)optimizer->shells.size();
+        int nrecs = optimizer->nrecs;
+
+        // Weight factor times the B-factor term, per reconstruction and shell
+        std::vector<float> shelltables((size_t)nrecs * nshells);
+        const float* r2 = optimizer->r2;
 #pragma omp parallel for
-        for (int i = 0; i < elements; i++)
+        for (int n = 0; n < nrecs; n++)
+            for (int s = 0; s < nshells; s++)
+                shelltables[(size_t)n * nshells + s] = h_weightfactors[n] * (float)exp(optimizer->shells[s] * h_bfacs[n]);
+
+        // Flat view of all reconstructions, in the order they were added
+        std::vector<const float2*> recs(nrecs);
+        std::vector<const float*> weights(nrecs);
+        for (int b = 0, n = 0; b < (int)optimizer->inputs.size(); b++)
+            for (int r = 0; r < optimizer->inputs[b].nrecs; r++, n++)
+            {
+                recs[n] = optimizer->inputs[b].recft + (size_t)elements * r;
+                weights[n] = optimizer->inputs[b].weights + (size_t)elements * r;
+            }
+
+        int ntiles = (elements + WEIGHT_TILE - 1) / WEIGHT_TILE;
+
+#pragma omp parallel for schedule(dynamic, 1)
+        for (int t = 0; t < ntiles; t++)
         {
-            float OverallWeight = Weight * (float)exp(h_r2[i] * Bfac) * weights[i];
-            recsum[i] += rec[i] * OverallWeight;
-            weightsum[i] += OverallWeight;
+            size_t first = (size_t)t * WEIGHT_TILE;
+            int n = tmin(WEIGHT_TILE, elements - (int)first);
+            float factors[WEIGHT_TILE];
+
+            for (int r = 0; r < nrecs; r++)
+            {
+                if (r2 == NULL)
+                {
+                    GatherShellFactors(factors, optimizer->shellindices.data() + first, shelltables.data() + (size_t)r * nshells, n);
+                }
+                else
+                {
+                    for (int i = 0; i < n; i++)
+                        factors[i] = h_weightfactors[r] * (float)exp(r2[first + i] * h_bfacs[r]);
+                }
+
+                bool even = h_subsets[r] % 2 == 0;
+                AccumulateTile((float2*)(even ? h_recsum1 : h_recsum2) + first,
+                               (even ? h_weightsum1 : h_weightsum2) + first,
+                               recs[r] + first,
+                               weights[r] + first,
+                               factors,
+                               n);
+            }
         }
     }
-}
\ No newline at end of file
+}
+
+__declspec(dllexport) void __stdcall OptimizeWeights(int nrecs, float* h_recft, float* h_recweights, float* h_r2, int elements, int* h_subsets, float* h_bfacs, float* h_weightfactors, float* h_recsum1, float* h_recsum2, float* h_weightsum1, float* h_weightsum2)
+{
+    WeightOptimizer* optimizer = CreateOptimizer(h_r2, elements, false);
+
+    WeightInputs inputs = {};
+    inputs.nrecs = nrecs;
+    inputs.recft = (float2*)h_recft;
+    inputs.weights = h_recweights;
+    AddInputs(optimizer, inputs);
+
+    Accumulate(optimizer, h_subsets, h_bfacs, h_weightfactors, h_recsum1, h_recsum2, h_weightsum1, h_weightsum2);
+
+    delete optimizer;
+}
+
+__declspec(dllexport) void* __stdcall CreateWeightOptimizer(float* h_r2, int elements)
+{
+    return CreateOptimizer(h_r2, elements, true);
+}
+
+__declspec(dllexport) void __stdcall DestroyWeightOptimizer(void* optimizer)
+{
+    WeightOptimizer* o = (WeightOptimizer*)optimizer;
+    for (WeightInputs &inputs : o->inputs)
+        ReleaseInputs(inputs);
+
+    delete o;
+}
+
+// Copies nrecs reconstructions, returns the index of the first one among all the optimizer's
+__declspec(dllexport) int __stdcall WeightOptimizerAddInputs(void* optimizer, int nrecs, float* h_recft, float* h_recweights)
+{
+    WeightOptimizer* o = (WeightOptimizer*)optimizer;
+    size_t elements = (size_t)o->elements * nrecs;
+
+    WeightInputs inputs = {};
+    inputs.nrecs = nrecs;
+    inputs.owned = MallocAligned(elements * (sizeof(float2) + sizeof(float)));
+    memcpy(inputs.owned, h_recft, elements * sizeof(float2));
+    memcpy((float2*)inputs.owned + elements, h_recweights, elements * sizeof(float));
+    inputs.recft = (float2*)inputs.owned;
+    inputs.weights = (float*)((float2*)inputs.owned + elements);
+
+    return AddInputs(o, inputs);
+}
+
+// Maps nrecs reconstructions from a file, returns the index of the first one, or -1 if the file can't be mapped or is too small
+__declspec(dllexport) int __stdcall WeightOptimizerMapInputs(void* optimizer, int nrecs, char* c_path)
+{
+    WeightOptimizer* o = (WeightOptimizer*)optimizer;
+    size_t elements = (size_t)o->elements * nrecs;
+
+    WeightInputs inputs = {};
+    inputs.nrecs = nrecs;
+    if (!MapFile(c_path, inputs))
+        return -1;
+
+    if (inputs.mappedbytes < elements * (sizeof(float2) + sizeof(float)))
+    {
+        ReleaseInputs(inputs);
+        return -1;
+    }
+
+    inputs.recft = (const float2*)inputs.mapped;
+    inputs.weights = (const float*)((const float2*)inputs.mapped + elements);
+
+    return AddInputs(o, inputs);
+}
+
+// Adds all of the optimizer's reconstructions to the sums in one pass; the parameter arrays have one entry per reconstruction
+__declspec(dllexport) void __stdcall WeightOptimizerAccumulate(void* optimizer, int* h_subsets, float* h_bfacs, float* h_weightfactors, float* h_recsum1, float* h_recsum2, float* h_weightsum1, float* h_weightsum2)
+{
+    Accumulate((WeightOptimizer*)optimizer, h_subsets, h_bfacs, h_weightfactors, h_recsum1, h_recsum2, h_weightsum1, h_weightsum2);
+}
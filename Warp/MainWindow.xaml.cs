@@ -5,6 +5,7 @@ using System.Diagnostics;
 using System.Globalization;
 using System.IO;
 using System.Linq;
+using System.Runtime.InteropServices;
 using System.Text;
 using System.Threading;
 using System.Threading.Tasks;
@@ -438,6 +439,16 @@ namespace Warp
                 CTFDisplay.Width = CTFDisplay.Height = Math.Min(1024, Options.CTFWindow);
             else if (e.PropertyName == "CTFPixelAngle")
                 TransformPixelAngle.Angle = -(double) Options.CTFPixelAngle;
+            else if (e.PropertyName == "ProjectorCacheDirectory")
+                CPU.SetProjectorCacheDirectory(Options.ProjectorCacheDirectory);
+            else if (e.PropertyName == "ReconstructionThreads" ||
+                     e.PropertyName == "ReconstructionMemoryBudget" ||
+                     e.PropertyName == "ReconstructionScratchDirectory")
+                CPU.SetReconstructionOptions(Options.ReconstructionThreads, Options.ReconstructionMemoryBudget, Options.ReconstructionScratchDirectory);
+            else if (e.PropertyName == "InputEERGroupFrames")
+                HeaderEER.DefaultGroupFrames = Options.InputEERGroupFrames;
+            else if (e.PropertyName == "InputEERUpsampling")
+                HeaderEER.DefaultUpsampling = Options.InputEERUpsampling;
         }
 
         #region Button events
@@ -630,108 +641,98 @@ namespace Warp
                     if (File.Exists(Options.DataStarPath))
                         ParticlesStar = new Star(Options.DataStarPath);
 
-                    Queue<DeviceToken> Devices = new Queue<DeviceToken>();
-                    for (int d = 0; d < UsedDevices; d++)
-                        Devices.Enqueue(new DeviceToken(d));
-                    //for (int d = 0; d < UsedDevices; d++)
-                    //    Devices.Enqueue(new DeviceToken(d));
-                    int NTokens = Devices.Count;
-
                     DeviceToken[] IOSync = new DeviceToken[UsedDevices];
                     for (int d = 0; d < UsedDevices; d++)
                         IOSync[d] = new DeviceToken(d);
 
-                    foreach (var Movie in Options.Movies)
+                    Movie[] Tasks = Options.Movies.Where(m => m.Status != ProcessingStatus.Skip && m.Status != ProcessingStatus.Processed).ToArray();
+                    MapHeader[] TaskHeaders = new MapHeader[Tasks.Length];
+                    Image[] TaskStacks = new Image[Tasks.Length];
+                    decimal ScaleFactor = 1M / (decimal)Math.Pow(2, (double)Options.PostBinTimes);
+
+                    // Stages: 0 = load and motion, 1 = CTF, 2 = export. The scheduler runs all of a movie's stages
+                    // on the same device, and lets devices that run out of movies take them from the others.
+                    GPU.SchedulerStageCallback ProcessStage = (task, stage, device) =>
                     {
-                        if (!IsProcessing)
-                            break;
+                        Movie Movie = Tasks[task];
 
-                        if (Movie.Status != ProcessingStatus.Skip && Movie.Status != ProcessingStatus.Processed)
+                        try
                         {
-                            while (Devices.Count <= 0)
-                                Thread.Sleep(20);
-
-                            if (!IsProcessing)
-                                break;
-
-                            DeviceToken CurrentDevice;
-                            lock (Devices)
-                                CurrentDevice = Devices.Dequeue();
-
-                            Thread DeviceThread = new Thread(() =>
+                            if (stage == 0)
                             {
-                                GPU.SetDevice(CurrentDevice.ID);
+                                lock (IOSync[device])
+                                    PrepareHeaderAndMap(Movie.Path, ImageGain[device], ScaleFactor, out TaskHeaders[task], out TaskStacks[task]);
 
-                                MapHeader OriginalHeader = null;
-                                Image OriginalStack = null;
-                                decimal ScaleFactor = 1M / (decimal)Math.Pow(2, (double)Options.PostBinTimes);
-
-                                lock (IOSync[CurrentDevice.ID])
-                                    PrepareHeaderAndMap(Movie.Path, ImageGain[CurrentDevice.ID], ScaleFactor, out OriginalHeader, out OriginalStack);
-                                /*OriginalHeader = MapHeader.ReadFromFile(Movie.Path,
-                                                                    new int2(Options.InputDatWidth, Options.InputDatHeight),
-                                                                    Options.InputDatOffset,
-                                                                    ImageFormatsHelper.StringToType(Options.InputDatType));*/
-
-                                //try
+                                if (Options.ProcessMovement)
                                 {
-                                    if (Options.ProcessMovement)
-                                    {
-                                        if (!Options.ProcessParticleShift)
-                                            Movie.ProcessShift(OriginalHeader, OriginalStack, ScaleFactor);
-                                        else
-                                            Movie.ProcessParticleShift(OriginalHeader,
-                                                                       OriginalStack,
-                                                                       ParticlesStar,
-                                                                       VolRefFT[CurrentDevice.ID],
-                                                                       VolMaskFT[CurrentDevice.ID],
-                                                                       VolRefFT[CurrentDevice.ID].Dims.X / Options.ProjectionOversample,
-                                                                       ScaleFactor);
-                                    }
-                                    if (Options.ProcessCTF)
-                                    {
-                                        if (!Options.ProcessParticleCTF)
-                                            Movie.ProcessCTF(OriginalHeader, OriginalStack, true, ScaleFactor);
-                                        else
-                                            Movie.ProcessParticleCTF(OriginalHeader,
-                                                                     OriginalStack,
-                                                                     ParticlesStar,
-                                                                     VolRefFT[CurrentDevice.ID],
-                                                                     VolMaskFT[CurrentDevice.ID],
-                                                                     VolRefFT[CurrentDevice.ID].Dims.X / Options.ProjectionOversample,
-                                                                     ScaleFactor);
-                                    }
+                                    if (!Options.ProcessParticleShift)
+                                        Movie.ProcessShift(TaskHeaders[task], TaskStacks[task], ScaleFactor);
+                                    else
+                                        Movie.ProcessParticleShift(TaskHeaders[task],
+                                                                   TaskStacks[task],
+                                                                   ParticlesStar,
+                                                                   VolRefFT[device],
+                                                                   VolMaskFT[device],
+                                                                   VolRefFT[device].Dims.X / Options.ProjectionOversample,
+                                                                   ScaleFactor);
+                                }
+                            }
+                            else if (stage == 1)
+                            {
+                                if (Options.ProcessCTF)
+                                {
+                                    if (!Options.ProcessParticleCTF)
+                                        Movie.ProcessCTF(TaskHeaders[task], TaskStacks[task], true, ScaleFactor);
+                                    else
+                                        Movie.ProcessParticleCTF(TaskHeaders[task],
+                                                                 TaskStacks[task],
+                                                                 ParticlesStar,
+                                                                 VolRefFT[device],
+                                                                 VolMaskFT[device],
+                                                                 VolRefFT[device].Dims.X / Options.ProjectionOversample,
+                                                                 ScaleFactor);
+                                }
+                            }
+                            else
+                            {
+                                if (Options.PostAverage || Options.PostStack)
+                                    Movie.CreateCorrected(TaskHeaders[task], TaskStacks[task]);
 
-                                    if (Options.PostAverage || Options.PostStack)
-                                        Movie.CreateCorrected(OriginalHeader, OriginalStack);
+                                //Movie.PerformComparison(OriginalHeader, ParticlesStar, VolRefFT, VolMaskFT, ScaleFactor);
 
-                                    //Movie.PerformComparison(OriginalHeader, ParticlesStar, VolRefFT, VolMaskFT, ScaleFactor);
-                                    
-                                    //((TiltSeries)Movie).Reconstruct(OriginalStack, 128, 3.42f * 4 * 2, new int3(3712, 3712, 1400));
+                                Movie.Status = ProcessingStatus.Processed;
 
-                                    //Image Reference = StageDataLoad.LoadMap("F:\\badaben\\ref.mrc", new int2(1, 1), 0, typeof(float));
-                                    //((TiltSeries)Movie).Correlate(OriginalStack, Reference, 128, 80, 400, new int3(3712, 3712, 1400), 2, "C1");
-                                    //Reference.Dispose();
+                                TaskStacks[task]?.Dispose();
+                                TaskStacks[task] = null;
+                            }
 
-                                    Movie.Status = ProcessingStatus.Processed;
-                                }
-                                /*catch
-                                {
-                                    Movie.Status = ProcessingStatus.Unprocessed;
-                                }*/
+                            return 0;
+                        }
+                        catch (Exception exc)
+                        {
+                            // Exceptions can't cross into the native scheduler; a non-zero result skips the remaining stages.
+                            // Like the sequential loop, a failed movie goes back to unprocessed so the next run retries it.
+                            Debug.WriteLine($"Failed: {Movie.RootName}, stage {stage} on device {device}: {exc}");
+                            Movie.Status = ProcessingStatus.Unprocessed;
 
-                                OriginalStack?.Dispose();
+                            TaskStacks[task]?.Dispose();
+                            TaskStacks[task] = null;
 
-                                lock (Devices)
-                                    Devices.Enqueue(CurrentDevice);
-                            });
-
-                            DeviceThread.Start();
+                            return 1;
                         }
-                    }
+                    };
+
+                    IntPtr Scheduler = GPU.CreateScheduler(UsedDevices, 1, 3, ProcessStage);
+                    for (int t = 0; t < Tasks.Length; t++)
+                        GPU.SchedulerSubmit(Scheduler, t, -1);
+
+                    // Stopping drops the movies that haven't started yet, the running ones are finished
+                    while (!GPU.SchedulerWait(Scheduler, 20))
+                        if (!IsProcessing)
+                            GPU.SchedulerCancel(Scheduler);
 
-                    while (Devices.Count != NTokens)
-                        Thread.Sleep(20);
+                    GPU.DestroyScheduler(Scheduler);
+                    GC.KeepAlive(ProcessStage);
 
                     //ParticlesStar.Save("F:\\rado27\\20S_defocused_dataset_part1\\warpmaps2\\run1_it017_data_everything.star");
                     //MoviesStar.Save("D:\\rado27\\Refine3D\\run1_ct5_data_movies.star");
@@ -762,12 +763,43 @@ namespace Warp
                                             MainWindow.Options.InputDatOffset,
                                             ImageFormatsHelper.StringToType(MainWindow.Options.InputDatType));
 
+            // The native reader handles MRC and TIFF movies, and decodes the next frame while the current one is uploaded.
+            // Anything it can't open, or reads with different dimensions than the header, goes through StageDataLoad.
+            // Only the stack is requested from MovieIngest: motion and CTF need gain-corrected frames with hot pixels
+            // removed, which happens on the whole stack below, so their per-frame consumers can't run during decoding.
+
+            // EER fractions are summed into the frames given by the header's grouping while decoding.
+            int[] GroupFirst = null, GroupLength = null;
+            int Upsampling = 1;
+            if (header.GetType() == typeof(HeaderEER))
+            {
+                ((HeaderEER)header).GetGroups(out GroupFirst, out GroupLength);
+                Upsampling = ((HeaderEER)header).Upsampling;
+            }
+            int NGroups = GroupFirst?.Length ?? 0;
+
+            int3 NativeDims = new int3(0, 0, 0);
+            bool IsNative = GPU.MovieGetDims(path, ref NativeDims) &&
+                            new int3(NativeDims.X * Upsampling, NativeDims.Y * Upsampling, NGroups > 0 ? NGroups : NativeDims.Z) == header.Dimensions;
+
             if (scaleFactor == 1M)
             {
-                stack = StageDataLoad.LoadMap(path,
-                                              new int2(MainWindow.Options.InputDatWidth, MainWindow.Options.InputDatHeight),
-                                              MainWindow.Options.InputDatOffset,
-                                              ImageFormatsHelper.StringToType(MainWindow.Options.InputDatType));
+                stack = null;
+                if (IsNative)
+                {
+                    stack = new Image(IntPtr.Zero, header.Dimensions);
+                    if (!GPU.MovieIngest(path, 4, GroupFirst, GroupLength, NGroups, Upsampling, stack.GetDevice(Intent.Write), null, 0, new int2(0, 0), null, 0, IntPtr.Zero, IntPtr.Zero))
+                    {
+                        stack.Dispose();
+                        stack = null;
+                    }
+                }
+
+                if (stack == null)
+                    stack = StageDataLoad.LoadMap(path,
+                                                  new int2(MainWindow.Options.InputDatWidth, MainWindow.Options.InputDatHeight),
+                                                  MainWindow.Options.InputDatOffset,
+                                                  ImageFormatsHelper.StringToType(MainWindow.Options.InputDatType));
 
                 if (imageGain != null)
                     stack.MultiplySlices(imageGain);
@@ -783,14 +815,37 @@ namespace Warp
                 stack = new Image(ScaledDims);
                 float[][] OriginalStackData = stack.GetHost(Intent.Write);
 
+                // Frames come one at a time from the reader's ring buffer, so the next one is decoded during scaling
+                IntPtr Reader = IsNative ? GPU.MovieReaderOpenGroups(path, 2, GroupFirst, GroupLength, NGroups, Upsampling, ref NativeDims) : IntPtr.Zero;
+                float[] FrameData = new float[NativeDims.ElementsSlice()];
+
                 //Parallel.For(0, ScaledDims.Z, new ParallelOptions {MaxDegreeOfParallelism = 4}, z =>
                 for (int z = 0; z < ScaledDims.Z; z++)
                 {
-                    Image Layer = StageDataLoad.LoadMap(path,
-                                                        new int2(MainWindow.Options.InputDatWidth, MainWindow.Options.InputDatHeight),
-                                                        MainWindow.Options.InputDatOffset,
-                                                        ImageFormatsHelper.StringToType(MainWindow.Options.InputDatType),
-                                                        z);
+                    Image Layer = null;
+                    if (Reader != IntPtr.Zero)
+                    {
+                        IntPtr h_frame = IntPtr.Zero;
+                        if (GPU.MovieReaderAcquire(Reader, ref h_frame) == z)
+                        {
+                            Marshal.Copy(h_frame, FrameData, 0, FrameData.Length);
+                            GPU.MovieReaderRelease(Reader);
+                            Layer = new Image(FrameData, new int3(NativeDims.X, NativeDims.Y, 1));
+                        }
+                        else
+                        {
+                            // Decoding failed, read the remaining frames the old way
+                            GPU.MovieReaderClose(Reader);
+                            Reader = IntPtr.Zero;
+                        }
+                    }
+
+                    if (Layer == null)
+                        Layer = StageDataLoad.LoadMap(path,
+                                                      new int2(MainWindow.Options.InputDatWidth, MainWindow.Options.InputDatHeight),
+                                                      MainWindow.Options.InputDatOffset,
+                                                      ImageFormatsHelper.StringToType(MainWindow.Options.InputDatType),
+                                                      z);
                     //lock (OriginalStackData)
                     {
                         if (imageGain != null)
@@ -805,6 +860,9 @@ namespace Warp
                     }
                 }//);
 
+                if (Reader != IntPtr.Zero)
+                    GPU.MovieReaderClose(Reader);
+
                 //stack.WriteMRC("d_stack.mrc");
             }
         }
@@ -1261,6 +1319,34 @@ namespace Warp
             OptimizePerTomoWeights();
         }
 
+        // Writes one series' reconstructions in the layout WeightOptimizerMapInputs expects, all transforms followed by
+        // all weights, and drops their managed copies, so only one series is ever held in memory
+        private static void WriteWeightOptimizerInputs(string path, WeightOptContainer[] reconstructions)
+        {
+            using (BinaryWriter Writer = new BinaryWriter(File.Create(path)))
+            {
+                byte[] Bytes = new byte[reconstructions[0].DataFT.Length * sizeof(float)];
+                foreach (var reconstruction in reconstructions)
+                {
+                    Buffer.BlockCopy(reconstruction.DataFT, 0, Bytes, 0, Bytes.Length);
+                    Writer.Write(Bytes);
+                }
+
+                Bytes = new byte[reconstructions[0].DataWeights.Length * sizeof(float)];
+                foreach (var reconstruction in reconstructions)
+                {
+                    Buffer.BlockCopy(reconstruction.DataWeights, 0, Bytes, 0, Bytes.Length);
+                    Writer.Write(Bytes);
+                }
+            }
+
+            foreach (var reconstruction in reconstructions)
+            {
+                reconstruction.DataFT = null;
+                reconstruction.DataWeights = null;
+            }
+        }
+
         private void OptimizePerTomoWeights()
         {
             if (!Options.Movies.Any(m => m.GetType() == typeof (TiltSeries)))
@@ -1274,6 +1360,7 @@ namespace Warp
             int3 Dims = Mask1.Dims;
             List<WeightOptContainer> Reconstructions = new List<WeightOptContainer>();
             Dictionary<TiltSeries, int> SeriesIndices = new Dictionary<TiltSeries, int>();
+            List<string> InputPaths = new List<string>();
 
             foreach (Movie movie in Options.Movies)
             {
@@ -1314,22 +1401,10 @@ namespace Warp
                     Reconstructions.Add(new WeightOptContainer(SeriesIndices[Series], MapSubsets[i], MapData, WeightsData, 0, 0));
                 }
 
-                //break;
-            }
+                InputPaths.Add(Series.WeightOptimizationDir + Series.RootName + "_pertomo.weightopt");
+                WriteWeightOptimizerInputs(InputPaths[SeriesIndices[Series]], Reconstructions.Where(r => r.SeriesID == SeriesIndices[Series]).ToArray());
 
-            float[][] PackedRecFT = new float[SeriesIndices.Count][];
-            float[][] PackedRecWeights = new float[SeriesIndices.Count][];
-            foreach (var s in SeriesIndices)
-            {
-                WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
-                PackedRecFT[s.Value] = new float[SeriesRecs.Length * SeriesRecs[0].DataFT.Length];
-                PackedRecWeights[s.Value] = new float[SeriesRecs.Length * SeriesRecs[0].DataWeights.Length];
-                
-                for (int n = 0; n < SeriesRecs.Length; n++)
-                {
-                    Array.Copy(SeriesRecs[n].DataFT, 0, PackedRecFT[s.Value], n * SeriesRecs[0].DataFT.Length, SeriesRecs[0].DataFT.Length);
-                    Array.Copy(SeriesRecs[n].DataWeights, 0, PackedRecWeights[s.Value], n * SeriesRecs[0].DataWeights.Length, SeriesRecs[0].DataWeights.Length);
-                }
+                //break;
             }
 
             float PixelSize = (float)Options.Movies[0].CTF.PixelSize;
@@ -1367,161 +1442,173 @@ namespace Warp
             float[] SeriesWeights = new float[SeriesIndices.Count];
             float[] SeriesBfacs = new float[SeriesIndices.Count];
 
-            Func<double[], float[]> WeightedFSC = input =>
+            // Reconstructions are mapped from their files for the whole optimization, each evaluation sums all of them in one pass
+            IntPtr WeightOptimizer = CPU.CreateWeightOptimizer(R2, R2.Length);
+            try
             {
-                // Set parameters from input vector
-                //{
-                    int Skip = 0;
-                    SeriesWeights = input.Take(SeriesWeights.Length).Select(v => (float)v / 100f).ToArray();
-                    Skip += SeriesWeights.Length;
-                    SeriesBfacs = input.Skip(Skip).Take(SeriesBfacs.Length).Select(v => (float)v * 10f).ToArray();
-                //}
+                foreach (var s in SeriesIndices)
+                    if (CPU.WeightOptimizerMapInputs(WeightOptimizer, Reconstructions.Count(r => r.SeriesID == s.Value), InputPaths[s.Value]) < 0)
+                        throw new Exception($"Could not map {InputPaths[s.Value]}.");
 
-                // Initialize sum vectors
-                float[] FSC = new float[Dims.X / 2];
+                Func<double[], float[]> WeightedFSC = input =>
+                {
+                    // Set parameters from input vector
+                    //{
+                        int Skip = 0;
+                        SeriesWeights = input.Take(SeriesWeights.Length).Select(v => (float)v / 100f).ToArray();
+                        Skip += SeriesWeights.Length;
+                        SeriesBfacs = input.Skip(Skip).Take(SeriesBfacs.Length).Select(v => (float)v * 10f).ToArray();
+                    //}
 
-                float[] MapSum1 = new float[Dims.ElementsFFT() * 2], MapSum2 = new float[Dims.ElementsFFT() * 2];
-                float[] WeightSum1 = new float[Dims.ElementsFFT()], WeightSum2 = new float[Dims.ElementsFFT()];
+                    // Initialize sum vectors
+                    float[] FSC = new float[Dims.X / 2];
 
-                int ElementsFT = (int)Dims.ElementsFFT();
+                    float[] MapSum1 = new float[Dims.ElementsFFT() * 2], MapSum2 = new float[Dims.ElementsFFT() * 2];
+                    float[] WeightSum1 = new float[Dims.ElementsFFT()], WeightSum2 = new float[Dims.ElementsFFT()];
 
-                foreach (var s in SeriesIndices)
-                {
-                    WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
+                    int ElementsFT = (int)Dims.ElementsFFT();
 
-                    float[] PrecalcWeights = new float[SeriesRecs.Length];
-                    float[] PrecalcBfacs = new float[SeriesRecs.Length];
-                    int[] PrecalcSubsets = new int[SeriesRecs.Length];
+                    // Parameters of all reconstructions, in the order they were added to the optimizer
+                    List<float> PrecalcWeights = new List<float>();
+                    List<float> PrecalcBfacs = new List<float>();
+                    List<int> PrecalcSubsets = new List<int>();
 
-                    for (int n = 0; n < SeriesRecs.Length; n++)
+                    foreach (var s in SeriesIndices)
                     {
-                        WeightOptContainer reconstruction = SeriesRecs[n];
-                        // Weight is Weight(Series) * exp(Bfac(Series) / 4 * r^2)
+                        WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
+
+                        for (int n = 0; n < SeriesRecs.Length; n++)
+                        {
+                            WeightOptContainer reconstruction = SeriesRecs[n];
+                            // Weight is Weight(Series) * exp(Bfac(Series) / 4 * r^2)
 
-                        float SeriesWeight = (float)Math.Exp(SeriesWeights[reconstruction.SeriesID]);
-                        float SeriesBfac = SeriesBfacs[reconstruction.SeriesID];
+                            float SeriesWeight = (float)Math.Exp(SeriesWeights[reconstruction.SeriesID]);
+                            float SeriesBfac = SeriesBfacs[reconstruction.SeriesID];
 
-                        PrecalcWeights[n] = SeriesWeight;
-                        PrecalcBfacs[n] = SeriesBfac * 0.25f;
-                        PrecalcSubsets[n] = reconstruction.Subset;
+                            PrecalcWeights.Add(SeriesWeight);
+                            PrecalcBfacs.Add(SeriesBfac * 0.25f);
+                            PrecalcSubsets.Add(reconstruction.Subset);
+                        }
                     }
 
-                    CPU.OptimizeWeights(SeriesRecs.Length,
-                                        PackedRecFT[s.Value],
-                                        PackedRecWeights[s.Value],
-                                        R2,
-                                        ElementsFT,
-                                        PrecalcSubsets,
-                                        PrecalcBfacs,
-                                        PrecalcWeights,
-                                        MapSum1,
-                                        MapSum2,
-                                        WeightSum1,
-                                        WeightSum2);
-                }
+                    CPU.WeightOptimizerAccumulate(WeightOptimizer,
+                                                  PrecalcSubsets.ToArray(),
+                                                  PrecalcBfacs.ToArray(),
+                                                  PrecalcWeights.ToArray(),
+                                                  MapSum1,
+                                                  MapSum2,
+                                                  WeightSum1,
+                                                  WeightSum2);
 
-                for (int i = 0; i < ElementsFT; i++)
-                {
-                    float Weight = Math.Max(1e-3f, WeightSum1[i]);
-                    MapSum1[i * 2] /= Weight;
-                    MapSum1[i * 2 + 1] /= Weight;
+                    for (int i = 0; i < ElementsFT; i++)
+                    {
+                        float Weight = Math.Max(1e-3f, WeightSum1[i]);
+                        MapSum1[i * 2] /= Weight;
+                        MapSum1[i * 2 + 1] /= Weight;
 
-                    Weight = Math.Max(1e-3f, WeightSum2[i]);
-                    MapSum2[i * 2] /= Weight;
-                    MapSum2[i * 2 + 1] /= Weight;
-                }
+                        Weight = Math.Max(1e-3f, WeightSum2[i]);
+                        MapSum2[i * 2] /= Weight;
+                        MapSum2[i * 2 + 1] /= Weight;
+                    }
                 
-                Image Map1FT = new Image(MapSum1, Dims, true, true);
-                Image Map1 = Map1FT.AsIFFT(true);
-                Map1.Multiply(SubsetMasks[0]);
-                Image MaskedFT1 = Map1.AsFFT(true);
-                float[] MaskedFT1Data = MaskedFT1.GetHostContinuousCopy();
-
-                Map1FT.Dispose();
-                Map1.Dispose();
-                MaskedFT1.Dispose();
-
-                Image Map2FT = new Image(MapSum2, Dims, true, true);
-                Image Map2 = Map2FT.AsIFFT(true);
-                Map2.Multiply(SubsetMasks[1]);
-                Image MaskedFT2 = Map2.AsFFT(true);
-                float[] MaskedFT2Data = MaskedFT2.GetHostContinuousCopy();
-
-                Map2FT.Dispose();
-                Map2.Dispose();
-                MaskedFT2.Dispose();
-
-                float[] Nums = new float[Dims.X / 2];
-                float[] Denoms1 = new float[Dims.X / 2];
-                float[] Denoms2 = new float[Dims.X / 2];
-                for (int i = 0; i < ElementsFT; i++)
-                {
-                    int Shell = ShellIndices[i];
-                    if (Shell < 0)
-                        continue;
+                    Image Map1FT = new Image(MapSum1, Dims, true, true);
+                    Image Map1 = Map1FT.AsIFFT(true);
+                    Map1.Multiply(SubsetMasks[0]);
+                    Image MaskedFT1 = Map1.AsFFT(true);
+                    float[] MaskedFT1Data = MaskedFT1.GetHostContinuousCopy();
 
-                    Nums[Shell] += MaskedFT1Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
-                    Denoms1[Shell] += MaskedFT1Data[i * 2] * MaskedFT1Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT1Data[i * 2 + 1];
-                    Denoms2[Shell] += MaskedFT2Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT2Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
-                }
+                    Map1FT.Dispose();
+                    Map1.Dispose();
+                    MaskedFT1.Dispose();
 
-                for (int i = 0; i < Dims.X / 2; i++)
-                    FSC[i] = Nums[i] / (float)Math.Sqrt(Denoms1[i] * Denoms2[i]);
+                    Image Map2FT = new Image(MapSum2, Dims, true, true);
+                    Image Map2 = Map2FT.AsIFFT(true);
+                    Map2.Multiply(SubsetMasks[1]);
+                    Image MaskedFT2 = Map2.AsFFT(true);
+                    float[] MaskedFT2Data = MaskedFT2.GetHostContinuousCopy();
 
-                return FSC;
-            };
+                    Map2FT.Dispose();
+                    Map2.Dispose();
+                    MaskedFT2.Dispose();
 
-            Func<double[], double> EvalForGrad = input =>
-            {
-                return WeightedFSC(input).Skip(ShellMin).Take(NShells).Sum() * Reconstructions.Count;
-            };
+                    float[] Nums = new float[Dims.X / 2];
+                    float[] Denoms1 = new float[Dims.X / 2];
+                    float[] Denoms2 = new float[Dims.X / 2];
+                    for (int i = 0; i < ElementsFT; i++)
+                    {
+                        int Shell = ShellIndices[i];
+                        if (Shell < 0)
+                            continue;
 
-            Func<double[], double> Eval = input =>
-            {
-                double Score = EvalForGrad(input);
-                Debug.WriteLine(Score);
+                        Nums[Shell] += MaskedFT1Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
+                        Denoms1[Shell] += MaskedFT1Data[i * 2] * MaskedFT1Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT1Data[i * 2 + 1];
+                        Denoms2[Shell] += MaskedFT2Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT2Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
+                    }
 
-                return Score;
-            };
+                    for (int i = 0; i < Dims.X / 2; i++)
+                        FSC[i] = Nums[i] / (float)Math.Sqrt(Denoms1[i] * Denoms2[i]);
 
-            int Iterations = 0;
+                    return FSC;
+                };
 
-            Func<double[], double[]> Grad = input =>
-            {
-                double[] Result = new double[input.Length];
-                double Step = 4;
+                Func<double[], double> EvalForGrad = input =>
+                {
+                    return WeightedFSC(input).Skip(ShellMin).Take(NShells).Sum() * Reconstructions.Count;
+                };
 
-                if (Iterations++ > 15)
-                    return Result;
+                Func<double[], double> Eval = input =>
+                {
+                    double Score = EvalForGrad(input);
+                    Debug.WriteLine(Score);
+
+                    return Score;
+                };
 
-                //Parallel.For(0, input.Length, new ParallelOptions { MaxDegreeOfParallelism = 4 }, i =>
-                for (int i = 0; i < input.Length; i++)
+                int Iterations = 0;
+
+                Func<double[], double[]> Grad = input =>
                 {
-                    double[] InputCopy = input.ToList().ToArray();
-                    double Original = InputCopy[i];
-                    InputCopy[i] = Original + Step;
-                    double ResultPlus = EvalForGrad(InputCopy);
-                    InputCopy[i] = Original - Step;
-                    double ResultMinus = EvalForGrad(InputCopy);
-                    InputCopy[i] = Original;
-
-                    Result[i] = (ResultPlus - ResultMinus) / (Step * 2);
-                }//);
+                    double[] Result = new double[input.Length];
+                    double Step = 4;
 
-                return Result;
-            };
+                    if (Iterations++ > 15)
+                        return Result;
 
-            List<double> StartParamsList = new List<double>();
-            StartParamsList.AddRange(SeriesWeights.Select(v => (double)v));
-            StartParamsList.AddRange(SeriesBfacs.Select(v => (double)v));
+                    //Parallel.For(0, input.Length, new ParallelOptions { MaxDegreeOfParallelism = 4 }, i =>
+                    for (int i = 0; i < input.Length; i++)
+                    {
+                        double[] InputCopy = input.ToList().ToArray();
+                        double Original = InputCopy[i];
+                        InputCopy[i] = Original + Step;
+                        double ResultPlus = EvalForGrad(InputCopy);
+                        InputCopy[i] = Original - Step;
+                        double ResultMinus = EvalForGrad(InputCopy);
+                        InputCopy[i] = Original;
+
+                        Result[i] = (ResultPlus - ResultMinus) / (Step * 2);
+                    }//);
 
-            double[] StartParams = StartParamsList.ToArray();
+                    return Result;
+                };
 
-            BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
-            Optimizer.Epsilon = 3e-7;
-            Optimizer.Maximize(StartParams);
+                List<double> StartParamsList = new List<double>();
+                StartParamsList.AddRange(SeriesWeights.Select(v => (double)v));
+                StartParamsList.AddRange(SeriesBfacs.Select(v => (double)v));
+
+                double[] StartParams = StartParamsList.ToArray();
+
+                BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
+                Optimizer.Epsilon = 3e-7;
+                Optimizer.Maximize(StartParams);
             
-            EvalForGrad(StartParams);
+                EvalForGrad(StartParams);
+            }
+            finally
+            {
+                CPU.DestroyWeightOptimizer(WeightOptimizer);
+                foreach (var path in InputPaths)
+                    File.Delete(path);
+            }
             
             foreach (var s in SeriesIndices)
             {
@@ -1545,6 +1632,7 @@ namespace Warp
             float DoseMax = float.MinValue;
             List<WeightOptContainer> Reconstructions = new List<WeightOptContainer>();
             Dictionary<TiltSeries, int> SeriesIndices = new Dictionary<TiltSeries, int>();
+            List<string> InputPaths = new List<string>();
 
             int NTilts = 0;
             
@@ -1589,6 +1677,9 @@ namespace Warp
                     Reconstructions.Add(new WeightOptContainer(SeriesIndices[Series], MapSubsets[i], MapData, WeightsData, MapAngles[i], MapDoses[i]));
                 }
 
+                InputPaths.Add(Series.WeightOptimizationDir + Series.RootName + "_pertilt.weightopt");
+                WriteWeightOptimizerInputs(InputPaths[SeriesIndices[Series]], Reconstructions.Where(r => r.SeriesID == SeriesIndices[Series]).ToArray());
+
                 AngleMin = Math.Min(MathHelper.Min(MapAngles), AngleMin);
                 AngleMax = Math.Max(MathHelper.Max(MapAngles), AngleMax);
                 DoseMax = Math.Max(MathHelper.Max(MapDoses), DoseMax);
@@ -1598,21 +1689,6 @@ namespace Warp
                 //break;
             }
 
-            float[][] PackedRecFT = new float[SeriesIndices.Count][];
-            float[][] PackedRecWeights = new float[SeriesIndices.Count][];
-            foreach (var s in SeriesIndices)
-            {
-                WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
-                PackedRecFT[s.Value] = new float[SeriesRecs.Length * SeriesRecs[0].DataFT.Length];
-                PackedRecWeights[s.Value] = new float[SeriesRecs.Length * SeriesRecs[0].DataWeights.Length];
-
-                for (int n = 0; n < SeriesRecs.Length; n++)
-                {
-                    Array.Copy(SeriesRecs[n].DataFT, 0, PackedRecFT[s.Value], n * SeriesRecs[0].DataFT.Length, SeriesRecs[0].DataFT.Length);
-                    Array.Copy(SeriesRecs[n].DataWeights, 0, PackedRecWeights[s.Value], n * SeriesRecs[0].DataWeights.Length, SeriesRecs[0].DataWeights.Length);
-                }
-            }
-
             float PixelSize = (float)Options.Movies[0].CTF.PixelSize;
             float FreqMin = 1f / (10f / PixelSize), FreqMin2 = FreqMin * FreqMin;
             float FreqMax = 1f / (8.5f / PixelSize), FreqMax2 = FreqMax * FreqMax;
@@ -1656,164 +1732,176 @@ namespace Warp
             CubicGrid GridAngle = new CubicGrid(new int3(NTilts, 1, 1), InitGridAngle);
             CubicGrid GridDose = new CubicGrid(new int3(NTilts, 1, 1), InitGridDose);
 
-            Func<double[], float[]> WeightedFSC = input =>
+            // Reconstructions are mapped from their files for the whole optimization, each evaluation sums all of them in one pass
+            IntPtr WeightOptimizer = CPU.CreateWeightOptimizer(R2, R2.Length);
+            try
             {
-                // Set parameters from input vector
-                {
-                    int Skip = 0;
-                    GridAngle = new CubicGrid(GridAngle.Dimensions, input.Skip(Skip).Take((int)GridAngle.Dimensions.Elements()).Select(v => (float)v / 100f).ToArray());
-                    Skip += (int)GridAngle.Dimensions.Elements();
-                    GridDose = new CubicGrid(GridDose.Dimensions, input.Skip(Skip).Take((int)GridDose.Dimensions.Elements()).Select(v => (float)v * 10f).ToArray());
-                }
-
-                // Initialize sum vectors
-                float[] FSC = new float[Dims.X / 2];
-
-                float[] MapSum1 = new float[Dims.ElementsFFT() * 2], MapSum2 = new float[Dims.ElementsFFT() * 2];
-                float[] WeightSum1 = new float[Dims.ElementsFFT()], WeightSum2 = new float[Dims.ElementsFFT()];
-
-                int ElementsFT = (int)Dims.ElementsFFT();
-
                 foreach (var s in SeriesIndices)
-                {
-                    WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
-
-                    float[] PrecalcWeights = new float[SeriesRecs.Length];
-                    float[] PrecalcBfacs = new float[SeriesRecs.Length];
-                    int[] PrecalcSubsets = new int[SeriesRecs.Length];
+                    if (CPU.WeightOptimizerMapInputs(WeightOptimizer, Reconstructions.Count(r => r.SeriesID == s.Value), InputPaths[s.Value]) < 0)
+                        throw new Exception($"Could not map {InputPaths[s.Value]}.");
 
-                    for (int n = 0; n < SeriesRecs.Length; n++)
+                Func<double[], float[]> WeightedFSC = input =>
+                {
+                    // Set parameters from input vector
                     {
-                        WeightOptContainer reconstruction = SeriesRecs[n];
-                        // Weight is Weight(Series) * Weight(Angle) * exp((Bfac(Series) + Bfac(Dose)) / 4 * r^2)                        
-                        
-                        float AngleWeight = GridAngle.GetInterpolated(new float3((reconstruction.Angle - AngleMin) / (AngleMax - AngleMin), 0.5f, 0.5f));
-                        float DoseBfac = GridDose.GetInterpolated(new float3(reconstruction.Dose / DoseMax, 0.5f, 0.5f));
-
-                        PrecalcWeights[n] = AngleWeight;
-                        PrecalcBfacs[n] = DoseBfac * 0.25f;
-                        PrecalcSubsets[n] = reconstruction.Subset;
+                        int Skip = 0;
+                        GridAngle = new CubicGrid(GridAngle.Dimensions, input.Skip(Skip).Take((int)GridAngle.Dimensions.Elements()).Select(v => (float)v / 100f).ToArray());
+                        Skip += (int)GridAngle.Dimensions.Elements();
+                        GridDose = new CubicGrid(GridDose.Dimensions, input.Skip(Skip).Take((int)GridDose.Dimensions.Elements()).Select(v => (float)v * 10f).ToArray());
                     }
 
-                    CPU.OptimizeWeights(SeriesRecs.Length,
-                                        PackedRecFT[s.Value],
-                                        PackedRecWeights[s.Value],
-                                        R2,
-                                        ElementsFT,
-                                        PrecalcSubsets,
-                                        PrecalcBfacs,
-                                        PrecalcWeights,
-                                        MapSum1,
-                                        MapSum2,
-                                        WeightSum1,
-                                        WeightSum2);
-                }
+                    // Initialize sum vectors
+                    float[] FSC = new float[Dims.X / 2];
 
-                for (int i = 0; i < ElementsFT; i++)
-                {
-                    float Weight = Math.Max(1e-3f, WeightSum1[i]);
-                    MapSum1[i * 2] /= Weight;
-                    MapSum1[i * 2 + 1] /= Weight;
+                    float[] MapSum1 = new float[Dims.ElementsFFT() * 2], MapSum2 = new float[Dims.ElementsFFT() * 2];
+                    float[] WeightSum1 = new float[Dims.ElementsFFT()], WeightSum2 = new float[Dims.ElementsFFT()];
 
-                    Weight = Math.Max(1e-3f, WeightSum2[i]);
-                    MapSum2[i * 2] /= Weight;
-                    MapSum2[i * 2 + 1] /= Weight;
-                }
+                    int ElementsFT = (int)Dims.ElementsFFT();
 
-                lock (GridAngle)
-                {
-                    Image Map1FT = new Image(MapSum1, Dims, true, true);
-                    Image Map1 = Map1FT.AsIFFT(true);
-                    Map1.Multiply(SubsetMasks[0]);
-                    Image MaskedFT1 = Map1.AsFFT(true);
-                    float[] MaskedFT1Data = MaskedFT1.GetHostContinuousCopy();
+                    // Parameters of all reconstructions, in the order they were added to the optimizer
+                    List<float> PrecalcWeights = new List<float>();
+                    List<float> PrecalcBfacs = new List<float>();
+                    List<int> PrecalcSubsets = new List<int>();
 
-                    Map1FT.Dispose();
-                    Map1.Dispose();
-                    MaskedFT1.Dispose();
+                    foreach (var s in SeriesIndices)
+                    {
+                        WeightOptContainer[] SeriesRecs = Reconstructions.Where(r => r.SeriesID == s.Value).ToArray();
 
-                    Image Map2FT = new Image(MapSum2, Dims, true, true);
-                    Image Map2 = Map2FT.AsIFFT(true);
-                    Map2.Multiply(SubsetMasks[1]);
-                    Image MaskedFT2 = Map2.AsFFT(true);
-                    float[] MaskedFT2Data = MaskedFT2.GetHostContinuousCopy();
+                        for (int n = 0; n < SeriesRecs.Length; n++)
+                        {
+                            WeightOptContainer reconstruction = SeriesRecs[n];
+                            // Weight is Weight(Series) * Weight(Angle) * exp((Bfac(Series) + Bfac(Dose)) / 4 * r^2)                        
+                        
+                            float AngleWeight = GridAngle.GetInterpolated(new float3((reconstruction.Angle - AngleMin) / (AngleMax - AngleMin), 0.5f, 0.5f));
+                            float DoseBfac = GridDose.GetInterpolated(new float3(reconstruction.Dose / DoseMax, 0.5f, 0.5f));
 
-                    Map2FT.Dispose();
-                    Map2.Dispose();
-                    MaskedFT2.Dispose();
+                            PrecalcWeights.Add(AngleWeight);
+                            PrecalcBfacs.Add(DoseBfac * 0.25f);
+                            PrecalcSubsets.Add(reconstruction.Subset);
+                        }
+                    }
+
+                    CPU.WeightOptimizerAccumulate(WeightOptimizer,
+                                                  PrecalcSubsets.ToArray(),
+                                                  PrecalcBfacs.ToArray(),
+                                                  PrecalcWeights.ToArray(),
+                                                  MapSum1,
+                                                  MapSum2,
+                                                  WeightSum1,
+                                                  WeightSum2);
 
-                    float[] Nums = new float[Dims.X / 2];
-                    float[] Denoms1 = new float[Dims.X / 2];
-                    float[] Denoms2 = new float[Dims.X / 2];
                     for (int i = 0; i < ElementsFT; i++)
                     {
-                        int Shell = ShellIndices[i];
-                        if (Shell < 0)
-                            continue;
+                        float Weight = Math.Max(1e-3f, WeightSum1[i]);
+                        MapSum1[i * 2] /= Weight;
+                        MapSum1[i * 2 + 1] /= Weight;
 
-                        Nums[Shell] += MaskedFT1Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
-                        Denoms1[Shell] += MaskedFT1Data[i * 2] * MaskedFT1Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT1Data[i * 2 + 1];
-                        Denoms2[Shell] += MaskedFT2Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT2Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
+                        Weight = Math.Max(1e-3f, WeightSum2[i]);
+                        MapSum2[i * 2] /= Weight;
+                        MapSum2[i * 2 + 1] /= Weight;
                     }
 
-                    for (int i = 0; i < Dims.X / 2; i++)
-                        FSC[i] = Nums[i] / (float)Math.Sqrt(Denoms1[i] * Denoms2[i]);
-                }
+                    lock (GridAngle)
+                    {
+                        Image Map1FT = new Image(MapSum1, Dims, true, true);
+                        Image Map1 = Map1FT.AsIFFT(true);
+                        Map1.Multiply(SubsetMasks[0]);
+                        Image MaskedFT1 = Map1.AsFFT(true);
+                        float[] MaskedFT1Data = MaskedFT1.GetHostContinuousCopy();
+
+                        Map1FT.Dispose();
+                        Map1.Dispose();
+                        MaskedFT1.Dispose();
+
+                        Image Map2FT = new Image(MapSum2, Dims, true, true);
+                        Image Map2 = Map2FT.AsIFFT(true);
+                        Map2.Multiply(SubsetMasks[1]);
+                        Image MaskedFT2 = Map2.AsFFT(true);
+                        float[] MaskedFT2Data = MaskedFT2.GetHostContinuousCopy();
+
+                        Map2FT.Dispose();
+                        Map2.Dispose();
+                        MaskedFT2.Dispose();
+
+                        float[] Nums = new float[Dims.X / 2];
+                        float[] Denoms1 = new float[Dims.X / 2];
+                        float[] Denoms2 = new float[Dims.X / 2];
+                        for (int i = 0; i < ElementsFT; i++)
+                        {
+                            int Shell = ShellIndices[i];
+                            if (Shell < 0)
+                                continue;
 
-                return FSC;
-            };
+                            Nums[Shell] += MaskedFT1Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
+                            Denoms1[Shell] += MaskedFT1Data[i * 2] * MaskedFT1Data[i * 2] + MaskedFT1Data[i * 2 + 1] * MaskedFT1Data[i * 2 + 1];
+                            Denoms2[Shell] += MaskedFT2Data[i * 2] * MaskedFT2Data[i * 2] + MaskedFT2Data[i * 2 + 1] * MaskedFT2Data[i * 2 + 1];
+                        }
 
-            Func<double[], double> EvalForGrad = input =>
-            {
-                return WeightedFSC(input).Skip(ShellMin).Take(NShells).Sum() * Reconstructions.Count;
-            };
+                        for (int i = 0; i < Dims.X / 2; i++)
+                            FSC[i] = Nums[i] / (float)Math.Sqrt(Denoms1[i] * Denoms2[i]);
+                    }
 
-            Func<double[], double> Eval = input =>
-            {
-                double Score = EvalForGrad(input);
-                Debug.WriteLine(Score);
+                    return FSC;
+                };
 
-                return Score;
-            };
+                Func<double[], double> EvalForGrad = input =>
+                {
+                    return WeightedFSC(input).Skip(ShellMin).Take(NShells).Sum() * Reconstructions.Count;
+                };
 
-            int Iterations = 0;
+                Func<double[], double> Eval = input =>
+                {
+                    double Score = EvalForGrad(input);
+                    Debug.WriteLine(Score);
 
-            Func<double[], double[]> Grad = input =>
-            {
-                double[] Result = new double[input.Length];
-                double Step = 1;
+                    return Score;
+                };
 
-                if (Iterations++ > 15)
-                    return Result;
+                int Iterations = 0;
 
-                //Parallel.For(0, input.Length, new ParallelOptions { MaxDegreeOfParallelism = 4 }, i =>
-                for (int i = 0; i < input.Length; i++)
+                Func<double[], double[]> Grad = input =>
                 {
-                    double[] InputCopy = input.ToList().ToArray();
-                    double Original = InputCopy[i];
-                    InputCopy[i] = Original + Step;
-                    double ResultPlus = EvalForGrad(InputCopy);
-                    InputCopy[i] = Original - Step;
-                    double ResultMinus = EvalForGrad(InputCopy);
-                    InputCopy[i] = Original;
-
-                    Result[i] = (ResultPlus - ResultMinus) / (Step * 2);
-                }//);
+                    double[] Result = new double[input.Length];
+                    double Step = 1;
 
-                return Result;
-            };
+                    if (Iterations++ > 15)
+                        return Result;
+
+                    //Parallel.For(0, input.Length, new ParallelOptions { MaxDegreeOfParallelism = 4 }, i =>
+                    for (int i = 0; i < input.Length; i++)
+                    {
+                        double[] InputCopy = input.ToList().ToArray();
+                        double Original = InputCopy[i];
+                        InputCopy[i] = Original + Step;
+                        double ResultPlus = EvalForGrad(InputCopy);
+                        InputCopy[i] = Original - Step;
+                        double ResultMinus = EvalForGrad(InputCopy);
+                        InputCopy[i] = Original;
 
-            List<double> StartParamsList = new List<double>();
-            StartParamsList.AddRange(GridAngle.FlatValues.Select(v => (double)v));
-            StartParamsList.AddRange(GridDose.FlatValues.Select(v => (double)v));
+                        Result[i] = (ResultPlus - ResultMinus) / (Step * 2);
+                    }//);
 
-            double[] StartParams = StartParamsList.ToArray();
+                    return Result;
+                };
+
+                List<double> StartParamsList = new List<double>();
+                StartParamsList.AddRange(GridAngle.FlatValues.Select(v => (double)v));
+                StartParamsList.AddRange(GridDose.FlatValues.Select(v => (double)v));
+
+                double[] StartParams = StartParamsList.ToArray();
 
-            BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
-            Optimizer.Epsilon = 3e-7;
-            Optimizer.Maximize(StartParams);
+                BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
+                Optimizer.Epsilon = 3e-7;
+                Optimizer.Maximize(StartParams);
 
-            EvalForGrad(StartParams);
+                EvalForGrad(StartParams);
+            }
+            finally
+            {
+                CPU.DestroyWeightOptimizer(WeightOptimizer);
+                foreach (var path in InputPaths)
+                    File.Delete(path);
+            }
 
             float MaxAngleWeight = MathHelper.Max(GridAngle.FlatValues);
             GridAngle = new CubicGrid(GridAngle.Dimensions, GridAngle.FlatValues.Select(v => v / MaxAngleWeight).ToArray());
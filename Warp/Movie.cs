@@ -884,6 +884,10 @@ namespace Warp
 
             #region Create spectra
 
+            // Spectra in a reduced precision are created next to the movie, and only expanded to fp32 once it's gone
+            StoragePrecision SpectraPrecision = MainWindow.Options.SpectrumPrecision;
+            IntPtr SpectraStorage = SpectraPrecision == StoragePrecision.FP32 ? CTFSpectra.GetDevice(Intent.Write) : GPU.MallocDeviceStorage(CTFSpectra.ElementsReal, SpectraPrecision);
+
             GPU.CreateSpectra(originalStack.GetDevice(Intent.Read),
                               DimsImage,
                               NFrames,
@@ -891,10 +895,17 @@ namespace Warp
                               NPositions,
                               DimsRegion,
                               CTFSpectraGrid,
-                              CTFSpectra.GetDevice(Intent.Write),
-                              CTFMean.GetDevice(Intent.Write));
+                              SpectraStorage,
+                              CTFMean.GetDevice(Intent.Write),
+                              SpectraPrecision);
             originalStack.FreeDevice(); // Won't need it in this method anymore.
 
+            if (SpectraPrecision != StoragePrecision.FP32)
+            {
+                GPU.StorageToSingle(SpectraStorage, CTFSpectra.GetDevice(Intent.Write), CTFSpectra.ElementsReal, SpectraPrecision);
+                GPU.FreeDevice(SpectraStorage);
+            }
+
             #endregion
 
             // Populate address arrays for later.
@@ -1235,13 +1246,6 @@ namespace Warp
 
                 #endregion
 
-                // Wiggle weights show how the defocus on the spectra grid is altered 
-                // by changes in individual anchor points of the spline grid.
-                // They are used later to compute the dScore/dDefocus values for each spectrum 
-                // only once, and derive the values for each anchor point from them.
-                float[][] WiggleWeights = GridCTF.GetWiggleWeights(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 1f / (CTFGridZ + 1)));
-                float[][] WiggleWeightsPhase = GridCTFPhase.GetWiggleWeights(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 1f / (CTFGridZ + 1)));
-
                 // Helper method for getting CTFStructs for the entire spectra grid.
                 Func<double[], CTF, float[], float[], CTFStruct[]> EvalGetCTF = (input, ctf, defocusValues, phaseValues) =>
                 {
@@ -1264,161 +1268,8 @@ namespace Warp
                     return LocalParams;
                 };
 
-                // Simulate with adjusted CTF, compare to originals
-
-                #region Eval and Gradient methods
-
                 float BorderZ = 0.5f / CTFGridZ;
 
-                Func<double[], double> Eval = input =>
-                {
-                    CubicGrid Altered = new CubicGrid(GridCTF.Dimensions, input.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v).ToArray());
-                    float[] DefocusValues = Altered.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-                    CubicGrid AlteredPhase = new CubicGrid(GridCTFPhase.Dimensions, input.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v).ToArray());
-                    float[] PhaseValues = AlteredPhase.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-
-                    CTFStruct[] LocalParams = EvalGetCTF(input, CTF, DefocusValues, PhaseValues);
-
-                    float[] Result = new float[LocalParams.Length];
-
-                    GPU.CTFCompareToSim(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
-                                        CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
-                                        CTFSpectraScaleHalf.GetDevice(Intent.Read),
-                                        (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
-                                        LocalParams,
-                                        Result,
-                                        (uint)LocalParams.Length);
-
-                    float Score = 0;
-                    for (int i = 0; i < Result.Length; i++)
-                        if (CTFSpectraConsider[i])
-                            Score += Result[i];
-
-                    Score /= NCTFSpectraConsider;
-
-                    if (float.IsNaN(Score) || float.IsInfinity(Score))
-                        throw new Exception("Bad score.");
-
-                    return (1.0 - Score) * 1000.0;
-                };
-
-                Func<double[], double[]> Gradient = input =>
-                {
-                    const float Step = 0.005f;
-                    double[] Result = new double[input.Length];
-
-                    // In 0D grid case, just get gradient for all 4 parameters.
-                    // In 1+D grid case, do simple gradient for astigmatism and phase...
-                    int StartComponent = input.Length - 2;
-                    //int StartComponent = 0;
-                    for (int i = StartComponent; i < input.Length; i++)
-                    {
-                        double[] UpperInput = new double[input.Length];
-                        input.CopyTo(UpperInput, 0);
-                        UpperInput[i] += Step;
-                        double UpperValue = Eval(UpperInput);
-
-                        double[] LowerInput = new double[input.Length];
-                        input.CopyTo(LowerInput, 0);
-                        LowerInput[i] -= Step;
-                        double LowerValue = Eval(LowerInput);
-
-                        Result[i] = (UpperValue - LowerValue) / (2f * Step);
-                    }
-
-                    float[] ResultPlus = new float[CTFSpectraGrid.Elements()];
-                    float[] ResultMinus = new float[CTFSpectraGrid.Elements()];
-
-                    // ..., take shortcut for defoci...
-                    {
-                        CubicGrid AlteredPhase = new CubicGrid(GridCTFPhase.Dimensions, input.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v).ToArray());
-                        float[] PhaseValues = AlteredPhase.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-
-                        {
-                            CubicGrid AlteredPlus = new CubicGrid(GridCTF.Dimensions, input.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v + Step).ToArray());
-                            float[] DefocusValues = AlteredPlus.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-
-                            CTFStruct[] LocalParams = EvalGetCTF(input, CTF, DefocusValues, PhaseValues);
-
-                            GPU.CTFCompareToSim(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFSpectraScaleHalf.GetDevice(Intent.Read),
-                                                (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
-                                                LocalParams,
-                                                ResultPlus,
-                                                (uint)LocalParams.Length);
-                        }
-                        {
-                            CubicGrid AlteredMinus = new CubicGrid(GridCTF.Dimensions, input.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v - Step).ToArray());
-                            float[] DefocusValues = AlteredMinus.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-
-                            CTFStruct[] LocalParams = EvalGetCTF(input, CTF, DefocusValues, PhaseValues);
-
-                            GPU.CTFCompareToSim(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFSpectraScaleHalf.GetDevice(Intent.Read),
-                                                (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
-                                                LocalParams,
-                                                ResultMinus,
-                                                (uint)LocalParams.Length);
-                        }
-                        float[] LocalGradients = new float[ResultPlus.Length];
-                        for (int i = 0; i < LocalGradients.Length; i++)
-                            LocalGradients[i] = ResultMinus[i] - ResultPlus[i];
-
-                        // Now compute gradients per grid anchor point using the precomputed individual gradients and wiggle factors.
-                        Parallel.For(0, GridCTF.Dimensions.Elements(), i => Result[i] = MathHelper.ReduceWeighted(LocalGradients, WiggleWeights[i]) / LocalGradients.Length / (2f * Step) * 1000f);
-                    }
-
-                    // ..., and take shortcut for phases.
-                    if (MainWindow.Options.CTFDoPhase)
-                    {
-                        CubicGrid AlteredPlus = new CubicGrid(GridCTF.Dimensions, input.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v).ToArray());
-                        float[] DefocusValues = AlteredPlus.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-
-                        {
-                            CubicGrid AlteredPhasePlus = new CubicGrid(GridCTFPhase.Dimensions, input.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v + Step).ToArray());
-                            float[] PhaseValues = AlteredPhasePlus.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-                            CTFStruct[] LocalParams = EvalGetCTF(input, CTF, DefocusValues, PhaseValues);
-
-                            GPU.CTFCompareToSim(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFSpectraScaleHalf.GetDevice(Intent.Read),
-                                                (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
-                                                LocalParams,
-                                                ResultPlus,
-                                                (uint)LocalParams.Length);
-                        }
-                        {
-                            CubicGrid AlteredPhaseMinus = new CubicGrid(GridCTFPhase.Dimensions, input.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v - Step).ToArray());
-                            float[] PhaseValues = AlteredPhaseMinus.GetInterpolatedNative(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ));
-                            CTFStruct[] LocalParams = EvalGetCTF(input, CTF, DefocusValues, PhaseValues);
-
-                            GPU.CTFCompareToSim(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
-                                                CTFSpectraScaleHalf.GetDevice(Intent.Read),
-                                                (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
-                                                LocalParams,
-                                                ResultMinus,
-                                                (uint)LocalParams.Length);
-                        }
-                        float[] LocalGradients = new float[ResultPlus.Length];
-                        for (int i = 0; i < LocalGradients.Length; i++)
-                            LocalGradients[i] = ResultMinus[i] - ResultPlus[i];
-
-                        // Now compute gradients per grid anchor point using the precomputed individual gradients and wiggle factors.
-                        Parallel.For(0, GridCTFPhase.Dimensions.Elements(), i => Result[i + GridCTF.Dimensions.Elements()] = MathHelper.ReduceWeighted(LocalGradients, WiggleWeightsPhase[i]) / LocalGradients.Length / (2f * Step) * 1000f);
-                    }
-
-                    foreach (var i in Result)
-                        if (double.IsNaN(i) || double.IsInfinity(i))
-                            throw new Exception("Bad score.");
-
-                    return Result;
-                };
-
-                #endregion
-
                 #region Minimize first time with potential outpiers
 
                 double[] StartParams = new double[GridCTF.Dimensions.Elements() + GridCTFPhase.Dimensions.Elements() + 2];
@@ -1472,23 +1323,50 @@ namespace Warp
 
                 #endregion
 
-                BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Gradient)
-                {
-                    Past = 1,
-                    Delta = 1e-6,
-                    MaxLineSearch = 15,
-                    Corrections = 20
-                };
-                Optimizer.Minimize(StartParams);
+                // Simulate with adjusted CTF, compare to originals: scores and their analytic gradients come
+                // from one pass over the spectra, and the whole optimization runs natively.
+                // Wiggle weights show how the defocus on the spectra grid is altered
+                // by changes in individual anchor points of the spline grid.
+                float[] WiggleWeights = GridCTF.GetWiggleWeights(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ)).SelectMany(v => v).ToArray();
+                float[] WiggleWeightsPhase = GridCTFPhase.GetWiggleWeights(CTFSpectraGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, BorderZ)).SelectMany(v => v).ToArray();
+
+                // Anchors, then defocus delta, astigmatism angle in radians, and B-factor
+                float[] Solution = new float[StartParams.Length + 1];
+                for (int i = 0; i < StartParams.Length - 2; i++)
+                    Solution[i] = (float)StartParams[i];
+                Solution[StartParams.Length - 2] = (float)CTF.DefocusDelta;
+                Solution[StartParams.Length - 1] = (float)((double)CTF.DefocusAngle * (Math.PI / 180));
+                Solution[StartParams.Length] = (float)CTF.Bfactor;
+
+                float FitScore = 0;
+                GPU.CTFFitGrid(CTFSpectraPolarTrimmedHalf.GetDevice(Intent.Read),
+                               CTFCoordsPolarTrimmedHalf.GetDevice(Intent.Read),
+                               CTFSpectraScaleHalf.GetDevice(Intent.Read),
+                               (uint)CTFSpectraPolarTrimmedHalf.ElementsSliceReal,
+                               (uint)CTFSpectraGrid.Elements(),
+                               CTF.ToStruct(),
+                               WiggleWeights,
+                               (int)GridCTF.Dimensions.Elements(),
+                               WiggleWeightsPhase,
+                               (int)GridCTFPhase.Dimensions.Elements(),
+                               MainWindow.Options.CTFDoPhase,
+                               true,
+                               false,
+                               100,
+                               Solution,
+                               ref FitScore);
+
+                if (float.IsNaN(FitScore) || float.IsInfinity(FitScore))
+                    throw new Exception("Bad score.");
 
                 #endregion
 
                 #region Retrieve parameters
 
-                CTF.Defocus = (decimal)MathHelper.Mean(Optimizer.Solution.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v));
-                CTF.DefocusDelta = (decimal)Optimizer.Solution[StartParams.Length - 2];
-                CTF.DefocusAngle = (decimal)(Optimizer.Solution[StartParams.Length - 1] * 20 / (Math.PI / 180));
-                CTF.PhaseShift = (decimal)MathHelper.Mean(Optimizer.Solution.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v));
+                CTF.Defocus = (decimal)MathHelper.Mean(Solution.Take((int)GridCTF.Dimensions.Elements()));
+                CTF.DefocusDelta = (decimal)Solution[StartParams.Length - 2];
+                CTF.DefocusAngle = (decimal)(Solution[StartParams.Length - 1] / (Math.PI / 180));
+                CTF.PhaseShift = (decimal)MathHelper.Mean(Solution.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()));
 
                 if (CTF.DefocusDelta < 0)
                 {
@@ -1497,8 +1375,8 @@ namespace Warp
                 }
                 CTF.DefocusAngle = ((int)CTF.DefocusAngle + 180 * 99) % 180;
 
-                GridCTF = new CubicGrid(GridCTF.Dimensions, Optimizer.Solution.Take((int)GridCTF.Dimensions.Elements()).Select(v => (float)v).ToArray());
-                GridCTFPhase = new CubicGrid(GridCTFPhase.Dimensions, Optimizer.Solution.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).Select(v => (float)v).ToArray());
+                GridCTF = new CubicGrid(GridCTF.Dimensions, Solution.Take((int)GridCTF.Dimensions.Elements()).ToArray());
+                GridCTFPhase = new CubicGrid(GridCTFPhase.Dimensions, Solution.Skip((int)GridCTF.Dimensions.Elements()).Take((int)GridCTFPhase.Dimensions.Elements()).ToArray());
 
                 #endregion
 
@@ -2115,6 +1993,20 @@ namespace Warp
         }
 
         public void ProcessShift(MapHeader originalHeader, Image originalStack, decimal scaleFactor)
+        {
+            // The phase ramps are created part way through the alignment, so they're destroyed here even if it throws
+            IntPtr ShiftRamps = IntPtr.Zero;
+            try
+            {
+                ProcessShift(originalHeader, originalStack, scaleFactor, ref ShiftRamps);
+            }
+            finally
+            {
+                GPU.DestroyPhaseRamps(ShiftRamps);
+            }
+        }
+
+        private void ProcessShift(MapHeader originalHeader, Image originalStack, decimal scaleFactor, ref IntPtr shiftRamps)
         {
             // Deal with dimensions and grids.
 
@@ -2155,7 +2047,8 @@ namespace Warp
             // Allocate memory and create all prerequisites:
             int MaskLength;
             Image ShiftFactors;
-            Image Phases;
+            IntPtr Phases;
+            StoragePrecision PhasesPrecision = MainWindow.Options.PhasePrecision;
             Image PhasesAverage;
             Image Shifts;
             {
@@ -2203,6 +2096,7 @@ namespace Warp
 
                 long[] RelevantMask = Positions.ToArray();
                 ShiftFactors = new Image(Helper.ToInterleaved(Factors.ToArray()));
+                shiftRamps = GPU.CreatePhaseRamps(Helper.ToInterleaved(Factors.ToArray()), ShiftFactors.GetDevice(Intent.Read), (uint)Factors.Count, 0);
                 MaskLength = RelevantMask.Length;
 
                 // Get mask sizes for different expansion steps.
@@ -2212,7 +2106,7 @@ namespace Warp
                     MaskSizes[i] = Freq.Count(v => v.X * v.X < CurrentMaxFreq * CurrentMaxFreq);
                 }
 
-                Phases = new Image(IntPtr.Zero, new int3(MaskLength * 2, DimsPositionGrid.X * DimsPositionGrid.Y, NFrames), false, false, false);
+                Image PhasesSingle = new Image(IntPtr.Zero, new int3(MaskLength * 2, DimsPositionGrid.X * DimsPositionGrid.Y, NFrames), false, false, false);
 
                 GPU.CreateShift(originalStack.GetDevice(Intent.Read),
                                 new int2(originalHeader.Dimensions),
@@ -2222,12 +2116,19 @@ namespace Warp
                                 DimsRegion,
                                 RelevantMask,
                                 (uint)MaskLength,
-                                Phases.GetDevice(Intent.Write));
+                                PhasesSingle.GetDevice(Intent.Write),
+                                StoragePrecision.FP32);
 
-                Phases.MultiplyLines(BfacWeights);
+                PhasesSingle.MultiplyLines(BfacWeights);
                 BfacWeights.Dispose();
 
                 originalStack.FreeDevice();
+
+                // The B-factor weighting is done in fp32, the alignment then reads the phases in the storage precision
+                Phases = GPU.MallocDeviceStorage(PhasesSingle.ElementsReal, PhasesPrecision);
+                GPU.SingleToStorage(PhasesSingle.GetDevice(Intent.Read), Phases, PhasesSingle.ElementsReal, PhasesPrecision);
+                PhasesSingle.Dispose();
+
                 PhasesAverage = new Image(IntPtr.Zero, new int3(MaskLength, NPositions, 1), false, true, false);
                 Shifts = new Image(new float[NPositions * NFrames * 2]);
             }
@@ -2238,22 +2139,40 @@ namespace Warp
                 int MinXSteps = 1, MinYSteps = 1;
                 int MinZSteps = Math.Min(NFrames, 3);
                 int3 ExpansionGridSize = new int3(MinXSteps, MinYSteps, MinZSteps);
-                float[][] WiggleWeights = new CubicGrid(ExpansionGridSize).GetWiggleWeights(ShiftGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 0f));
                 double[] StartParams = new double[ExpansionGridSize.Elements() * 2];
 
+                // Positions of the shift grid's values within the spline grids, spaced like GetInterpolatedNative(ShiftGrid, border)
+                float3[] ShiftPositions = new float3[ShiftGrid.Elements()];
+                {
+                    float3 Border = new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 0f);
+                    float StepX = (1f - Border.X * 2) / Math.Max(1, ShiftGrid.X - 1);
+                    float StepY = (1f - Border.Y * 2) / Math.Max(1, ShiftGrid.Y - 1);
+                    float StepZ = (1f - Border.Z * 2) / Math.Max(ShiftGrid.Z - 1, 1);
+                    float OffsetZ = ShiftGrid.Z == 1 ? 0.5f : Border.Z;
+
+                    for (int z = 0, i = 0; z < ShiftGrid.Z; z++)
+                        for (int y = 0; y < ShiftGrid.Y; y++)
+                            for (int x = 0; x < ShiftGrid.X; x++, i++)
+                                ShiftPositions[i] = new float3(x * StepX + Border.X, y * StepY + Border.Y, z * StepZ + OffsetZ);
+                }
+
                 for (int m = 0; m < MaskExpansions; m++)
                 {
                     double[] LastAverage = null;
 
+                    // Derivatives of the current shifts w.r.t. the grid nodes, as a sparse matrix in CSR layout.
+                    // The spline is monotone rather than linear, so they are taken again whenever the nodes change.
+                    CubicGrid AlteredGridX = null, AlteredGridY = null;
+                    int[] RowOffsetsX = null, ColumnsX = null, RowOffsetsY = null, ColumnsY = null;
+                    float[] WeightsX = null, WeightsY = null;
+
                     Action<double[]> SetPositions = input =>
                     {
                         // Construct CubicGrids and get interpolated shift values.
-                        CubicGrid AlteredGridX = new CubicGrid(ExpansionGridSize, input.Where((v, i) => i % 2 == 0).Select(v => (float)v).ToArray());
-                        float[] AlteredX = AlteredGridX.GetInterpolatedNative(new int3(DimsPositionGrid.X, DimsPositionGrid.Y, NFrames),
-                                                                              new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 0f));
-                        CubicGrid AlteredGridY = new CubicGrid(ExpansionGridSize, input.Where((v, i) => i % 2 == 1).Select(v => (float)v).ToArray());
-                        float[] AlteredY = AlteredGridY.GetInterpolatedNative(new int3(DimsPositionGrid.X, DimsPositionGrid.Y, NFrames),
-                                                                              new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 0f));
+                        AlteredGridX = new CubicGrid(ExpansionGridSize, input.Where((v, i) => i % 2 == 0).Select(v => (float)v).ToArray());
+                        float[] AlteredX = AlteredGridX.GetInterpolatedNativeWithWeights(ShiftPositions, out RowOffsetsX, out ColumnsX, out WeightsX);
+                        AlteredGridY = new CubicGrid(ExpansionGridSize, input.Where((v, i) => i % 2 == 1).Select(v => (float)v).ToArray());
+                        float[] AlteredY = AlteredGridY.GetInterpolatedNativeWithWeights(ShiftPositions, out RowOffsetsY, out ColumnsY, out WeightsY);
 
                         // Let movement start at 0 in the central frame.
                         /*float2[] CenterFrameOffsets = new float2[NPositions];
@@ -2274,14 +2193,15 @@ namespace Warp
                         if (LastAverage == null || input.Where((t, i) => t != LastAverage[i]).Any())
                         {
                             SetPositions(input);
-                            GPU.ShiftGetAverage(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetAverage(Phases,
                                                 PhasesAverage.GetDevice(Intent.Write),
                                                 ShiftFactors.GetDevice(Intent.Read),
                                                 (uint)MaskLength,
                                                 (uint)MaskSizes[m],
                                                 Shifts.GetDevice(Intent.Read),
                                                 (uint)NPositions,
-                                                (uint)NFrames);
+                                                (uint)NFrames,
+                                                PhasesPrecision);
 
                             if (LastAverage == null)
                                 LastAverage = new double[input.Length];
@@ -2289,20 +2209,37 @@ namespace Warp
                         }
                     };
 
-                    Func<double[], double> Eval = input =>
+                    double[] LastEvaluated = null;
+                    float[] LastDiff = new float[NPositions * NFrames], LastGrad = new float[NPositions * NFrames * 2];
+
+                    // Objective and gradient come from one pass over the phases, the optimizer usually asks for both at the same point
+                    Action<double[]> DoDiffAndGrad = input =>
                     {
-                        DoAverage(input);
+                        if (LastEvaluated == null || input.Where((t, i) => t != LastEvaluated[i]).Any())
+                        {
+                            DoAverage(input);
+                            GPU.ShiftGetDiffAndGrad(Phases,
+                                                    PhasesAverage.GetDevice(Intent.Read),
+                                                    ShiftFactors.GetDevice(Intent.Read),
+                                                    (uint)MaskLength,
+                                                    (uint)MaskSizes[m],
+                                                    Shifts.GetDevice(Intent.Read),
+                                                    LastDiff,
+                                                    LastGrad,
+                                                    (uint)NPositions,
+                                                    (uint)NFrames,
+                                                    PhasesPrecision);
+
+                            if (LastEvaluated == null)
+                                LastEvaluated = new double[input.Length];
+                            Array.Copy(input, LastEvaluated, input.Length);
+                        }
+                    };
 
-                        float[] Diff = new float[NPositions * NFrames];
-                        GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
-                                         PhasesAverage.GetDevice(Intent.Read),
-                                         ShiftFactors.GetDevice(Intent.Read),
-                                         (uint)MaskLength,
-                                         (uint)MaskSizes[m],
-                                         Shifts.GetDevice(Intent.Read),
-                                         Diff,
-                                         (uint)NPositions,
-                                         (uint)NFrames);
+                    Func<double[], double> Eval = input =>
+                    {
+                        DoDiffAndGrad(input);
+                        float[] Diff = (float[])LastDiff.Clone();
 
                         for (int i = 0; i < Diff.Length; i++)
                             Diff[i] = Diff[i];// * 100f;
@@ -2312,20 +2249,11 @@ namespace Warp
 
                     Func<double[], double[]> Grad = input =>
                     {
-                        DoAverage(input);
+                        DoDiffAndGrad(input);
 
                         float[] GradX = new float[NPositions * NFrames], GradY = new float[NPositions * NFrames];
 
-                        float[] Diff = new float[NPositions * NFrames * 2];
-                        GPU.ShiftGetGrad(Phases.GetDevice(Intent.Read),
-                                         PhasesAverage.GetDevice(Intent.Read),
-                                         ShiftFactors.GetDevice(Intent.Read),
-                                         (uint)MaskLength,
-                                         (uint)MaskSizes[m],
-                                         Shifts.GetDevice(Intent.Read),
-                                         Diff,
-                                         (uint)NPositions,
-                                         (uint)NFrames);
+                        float[] Diff = (float[])LastGrad.Clone();
 
                         //for (int i = 0; i < Diff.Length; i++)
                             //Diff[i] = Diff[i] * 100f;
@@ -2336,12 +2264,16 @@ namespace Warp
                             GradY[i] = Diff[i * 2 + 1];
                         }
 
+                        // One sparse transposed product per axis gives the gradient for all nodes
+                        float[] NodeGradX = AlteredGridX.GetNodeGradient(GradX, RowOffsetsX, ColumnsX, WeightsX);
+                        float[] NodeGradY = AlteredGridY.GetNodeGradient(GradY, RowOffsetsY, ColumnsY, WeightsY);
+
                         double[] Result = new double[input.Length];
-                        Parallel.For(0, input.Length / 2, i =>
+                        for (int i = 0; i < input.Length / 2; i++)
                         {
-                            Result[i * 2] = MathHelper.ReduceWeighted(GradX, WiggleWeights[i]);
-                            Result[i * 2 + 1] = MathHelper.ReduceWeighted(GradY, WiggleWeights[i]);
-                        });
+                            Result[i * 2] = NodeGradX[i];
+                            Result[i * 2 + 1] = NodeGradY[i];
+                        }
                         return Result;
                     };
 
@@ -2362,7 +2294,7 @@ namespace Warp
                             SetPositions(InputXP);
 
                             float[] DiffXP = new float[NPositions * NFrames];
-                            GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetDiff(Phases,
                                              PhasesAverage.GetDevice(Intent.Read),
                                              ShiftFactors.GetDevice(Intent.Read),
                                              (uint)MaskLength,
@@ -2370,7 +2302,8 @@ namespace Warp
                                              Shifts.GetDevice(Intent.Read),
                                              DiffXP,
                                              (uint)NPositions,
-                                             (uint)NFrames);
+                                             (uint)NFrames,
+                                             PhasesPrecision);
 
 
                             double[] InputXM = new double[input.Length];
@@ -2382,7 +2315,7 @@ namespace Warp
                             SetPositions(InputXM);
 
                             float[] DiffXM = new float[NPositions * NFrames];
-                            GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetDiff(Phases,
                                              PhasesAverage.GetDevice(Intent.Read),
                                              ShiftFactors.GetDevice(Intent.Read),
                                              (uint)MaskLength,
@@ -2390,7 +2323,8 @@ namespace Warp
                                              Shifts.GetDevice(Intent.Read),
                                              DiffXM,
                                              (uint)NPositions,
-                                             (uint)NFrames);
+                                             (uint)NFrames,
+                                             PhasesPrecision);
 
                             for (int i = 0; i < GradX.Length; i++)
                                 GradX[i] = (DiffXP[i] - DiffXM[i]) / (Step * 2);
@@ -2406,7 +2340,7 @@ namespace Warp
                             SetPositions(InputYP);
 
                             float[] DiffYP = new float[NPositions * NFrames];
-                            GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetDiff(Phases,
                                              PhasesAverage.GetDevice(Intent.Read),
                                              ShiftFactors.GetDevice(Intent.Read),
                                              (uint)MaskLength,
@@ -2414,7 +2348,8 @@ namespace Warp
                                              Shifts.GetDevice(Intent.Read),
                                              DiffYP,
                                              (uint)NPositions,
-                                             (uint)NFrames);
+                                             (uint)NFrames,
+                                             PhasesPrecision);
 
 
                             double[] InputYM = new double[input.Length];
@@ -2426,7 +2361,7 @@ namespace Warp
                             SetPositions(InputYM);
 
                             float[] DiffYM = new float[NPositions * NFrames];
-                            GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetDiff(Phases,
                                              PhasesAverage.GetDevice(Intent.Read),
                                              ShiftFactors.GetDevice(Intent.Read),
                                              (uint)MaskLength,
@@ -2434,7 +2369,8 @@ namespace Warp
                                              Shifts.GetDevice(Intent.Read),
                                              DiffYM,
                                              (uint)NPositions,
-                                             (uint)NFrames);
+                                             (uint)NFrames,
+                                             PhasesPrecision);
 
                             for (int i = 0; i < GradY.Length; i++)
                                 GradY[i] = (DiffYP[i] - DiffYM[i]) / (Step * 2);
@@ -2451,7 +2387,15 @@ namespace Warp
 
                     BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
                     Optimizer.Corrections = 20;
-                    Optimizer.Minimize(StartParams);
+                    GPU.MemoryPoolBeginScope();
+                    try
+                    {
+                        Optimizer.Minimize(StartParams);
+                    }
+                    finally
+                    {
+                        GPU.MemoryPoolEndScope();
+                    }
 
                     float MeanX = MathHelper.Mean(Optimizer.Solution.Where((v, i) => i % 2 == 0).Select(v => (float)v));
                     float MeanY = MathHelper.Mean(Optimizer.Solution.Where((v, i) => i % 2 == 1).Select(v => (float)v));
@@ -2471,7 +2415,6 @@ namespace Warp
                         ExpansionGridSize = new int3((int)Math.Round((float)(ShiftGridX - MinXSteps) / (MaskExpansions - 1) * (m + 1) + MinXSteps),
                                                      (int)Math.Round((float)(ShiftGridY - MinYSteps) / (MaskExpansions - 1) * (m + 1) + MinYSteps),
                                                      (int)Math.Round((float)(ShiftGridZ - MinZSteps) / (MaskExpansions - 1) * (m + 1) + MinZSteps));
-                        WiggleWeights = new CubicGrid(ExpansionGridSize).GetWiggleWeights(ShiftGrid, new float3(DimsRegion.X / 2f / DimsImage.X, DimsRegion.Y / 2f / DimsImage.Y, 0f));
 
                         // Resize the grids to account for finer sampling.
                         GridMovementX = GridMovementX.Resize(ExpansionGridSize);
@@ -2551,14 +2494,15 @@ namespace Warp
                         if (LastAverage == null || input.Where((t, i) => t != LastAverage[i]).Any())
                         {
                             SetPositions(input);
-                            GPU.ShiftGetAverage(Phases.GetDevice(Intent.Read),
+                            GPU.ShiftGetAverage(Phases,
                                                 PhasesAverage.GetDevice(Intent.Write),
                                                 ShiftFactors.GetDevice(Intent.Read),
                                                 (uint)MaskLength,
                                                 (uint)MaskSizes[m],
                                                 Shifts.GetDevice(Intent.Read),
                                                 (uint)NPositions,
-                                                (uint)NFrames);
+                                                (uint)NFrames,
+                                                PhasesPrecision);
 
                             if (LastAverage == null)
                                 LastAverage = new double[input.Length];
@@ -2566,20 +2510,37 @@ namespace Warp
                         }
                     };
 
-                    Func<double[], double> Eval = input =>
+                    double[] LastEvaluated = null;
+                    float[] LastDiff = new float[NPositions * NFrames], LastGrad = new float[NPositions * NFrames * 2];
+
+                    // Objective and gradient come from one pass over the phases, the optimizer usually asks for both at the same point
+                    Action<double[]> DoDiffAndGrad = input =>
                     {
-                        DoAverage(input);
+                        if (LastEvaluated == null || input.Where((t, i) => t != LastEvaluated[i]).Any())
+                        {
+                            DoAverage(input);
+                            GPU.ShiftGetDiffAndGrad(Phases,
+                                                    PhasesAverage.GetDevice(Intent.Read),
+                                                    ShiftFactors.GetDevice(Intent.Read),
+                                                    (uint)MaskLength,
+                                                    (uint)MaskSizes[m],
+                                                    Shifts.GetDevice(Intent.Read),
+                                                    LastDiff,
+                                                    LastGrad,
+                                                    (uint)NPositions,
+                                                    (uint)NFrames,
+                                                    PhasesPrecision);
+
+                            if (LastEvaluated == null)
+                                LastEvaluated = new double[input.Length];
+                            Array.Copy(input, LastEvaluated, input.Length);
+                        }
+                    };
 
-                        float[] Diff = new float[NPositions * NFrames];
-                        GPU.ShiftGetDiff(Phases.GetDevice(Intent.Read),
-                                         PhasesAverage.GetDevice(Intent.Read),
-                                         ShiftFactors.GetDevice(Intent.Read),
-                                         (uint)MaskLength,
-                                         (uint)MaskSizes[m],
-                                         Shifts.GetDevice(Intent.Read),
-                                         Diff,
-                                         (uint)NPositions,
-                                         (uint)NFrames);
+                    Func<double[], double> Eval = input =>
+                    {
+                        DoDiffAndGrad(input);
+                        float[] Diff = (float[])LastDiff.Clone();
 
                         for (int i = 0; i < Diff.Length; i++)
                             Diff[i] = Diff[i] * 100f;
@@ -2589,18 +2550,9 @@ namespace Warp
 
                     Func<double[], double[]> Grad = input =>
                     {
-                        DoAverage(input);
+                        DoDiffAndGrad(input);
 
-                        float[] Diff = new float[NPositions * NFrames * 2];
-                        GPU.ShiftGetGrad(Phases.GetDevice(Intent.Read),
-                                         PhasesAverage.GetDevice(Intent.Read),
-                                         ShiftFactors.GetDevice(Intent.Read),
-                                         (uint)MaskLength,
-                                         (uint)MaskSizes[m],
-                                         Shifts.GetDevice(Intent.Read),
-                                         Diff,
-                                         (uint)NPositions,
-                                         (uint)NFrames);
+                        float[] Diff = (float[])LastGrad.Clone();
 
                         for (int i = 0; i < Diff.Length; i++)
                             Diff[i] = Diff[i] * 100f;
@@ -2623,7 +2575,15 @@ namespace Warp
 
                     BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
                     Optimizer.Corrections = 20;
-                    Optimizer.Minimize(StartParams);
+                    GPU.MemoryPoolBeginScope();
+                    try
+                    {
+                        Optimizer.Minimize(StartParams);
+                    }
+                    finally
+                    {
+                        GPU.MemoryPoolEndScope();
+                    }
 
                     float MeanX = MathHelper.Mean(Optimizer.Solution.Where((v, i) => i % 2 == 0).Select(v => (float)v));
                     float MeanY = MathHelper.Mean(Optimizer.Solution.Where((v, i) => i % 2 == 1).Select(v => (float)v));
@@ -2662,8 +2622,10 @@ namespace Warp
 
             #endregion
 
+            GPU.DestroyPhaseRamps(shiftRamps);
+            shiftRamps = IntPtr.Zero;
             ShiftFactors.Dispose();
-            Phases.Dispose();
+            GPU.FreeDevice(Phases);
             PhasesAverage.Dispose();
             Shifts.Dispose();
 
@@ -2683,6 +2645,20 @@ namespace Warp
         }
 
         public void ProcessParticleShift(MapHeader originalHeader, Image originalStack, Star stardata, Image refft, Image maskft, int dimbox, decimal scaleFactor)
+        {
+            // The phase ramps are created part way through the alignment, so they're destroyed here even if it throws
+            IntPtr ShiftRamps = IntPtr.Zero;
+            try
+            {
+                ProcessParticleShift(originalHeader, originalStack, stardata, refft, maskft, dimbox, scaleFactor, ref ShiftRamps);
+            }
+            finally
+            {
+                GPU.DestroyPhaseRamps(ShiftRamps);
+            }
+        }
+
+        private void ProcessParticleShift(MapHeader originalHeader, Image originalStack, Star stardata, Image refft, Image maskft, int dimbox, decimal scaleFactor, ref IntPtr shiftRamps)
         {
             // Deal with dimensions and grids.
 
@@ -2773,7 +2749,8 @@ namespace Warp
             // Allocate memory and create all prerequisites:
             int MaskLength;
             Image ShiftFactors;
-            Image Phases;
+            IntPtr Phases;
+            StoragePrecision PhasesPrecision = MainWindow.Options.PhasePrecision;
             Image Projections;
             Image Shifts;
             Image InvSigma;
@@ -2834,6 +2811,7 @@ namespace Warp
 
                 long[] RelevantMask = Positions.ToArray();
                 ShiftFactors = new Image(Helper.ToInterleaved(Factors.ToArray()));
+                shiftRamps = GPU.CreatePhaseRamps(Helper.ToInterleaved(Factors.ToArray()), ShiftFactors.GetDevice(Intent.Read), (uint)Factors.Count, 0);
                 MaskLength = RelevantMask.Length;
 
                 // Get mask sizes for different expansion steps.
@@ -2843,7 +2821,7 @@ namespace Warp
                     MaskSizes[i] = Freq.Count(v => v.X * v.X < CurrentMaxFreq * CurrentMaxFreq);
                 }
 
-                Phases = new Image(IntPtr.Zero, new int3(MaskLength, NPositions, NFrames), false, true, false);
+                Phases = GPU.MallocDeviceStorage((long)MaskLength * NPositions * NFrames * 2, PhasesPrecision);
                 Projections = new Image(IntPtr.Zero, new int3(MaskLength, NPositions, NFrames), false, true, false);
                 InvSigma = new Image(IntPtr.Zero, new int3(MaskLength, 1, 1));
 
@@ -2908,9 +2886,10 @@ namespace Warp
                                         PixelSize + PixelDelta / 2,
                                         PixelSize - PixelDelta / 2,
                                         PixelAngle,
-                                        Phases.GetDevice(Intent.Write),
+                                        Phases,
                                         Projections.GetDevice(Intent.Write),
-                                        InvSigma.GetDevice(Intent.Write));
+                                        InvSigma.GetDevice(Intent.Write),
+                                        PhasesPrecision);
 
                 InvSigmaSparse.Dispose();
                 ParticleMasks.Dispose();
@@ -2968,21 +2947,38 @@ namespace Warp
                             }
                         };
 
+                        double[] LastEvaluated = null;
+                        float[] LastDiff = new float[NPositions * NFrames], LastGrad = new float[NPositions * NFrames * 2];
+
+                        Action<double[]> DoDiffAndGrad = input =>
+                        {
+                            if (LastEvaluated == null || input.Where((t, i) => t != LastEvaluated[i]).Any())
+                            {
+                                SetPositions(input);
+                                GPU.ParticleShiftGetDiffAndGrad(Phases,
+                                                                Projections.GetDevice(Intent.Read),
+                                                                ShiftFactors.GetDevice(Intent.Read),
+                                                                InvSigma.GetDevice(Intent.Read),
+                                                                (uint)MaskLength,
+                                                                (uint)MaskSizes[m],
+                                                                Shifts.GetDevice(Intent.Read),
+                                                                LastDiff,
+                                                                LastGrad,
+                                                                (uint)NPositions,
+                                                                (uint)NFrames,
+                                                                PhasesPrecision);
+
+                                if (LastEvaluated == null)
+                                    LastEvaluated = new double[input.Length];
+                                Array.Copy(input, LastEvaluated, input.Length);
+                            }
+                        };
+
                         Func<double[], double> Eval = input =>
                         {
-                            SetPositions(input);
+                            DoDiffAndGrad(input);
 
-                            float[] Diff = new float[NPositions * NFrames];
-                            GPU.ParticleShiftGetDiff(Phases.GetDevice(Intent.Read),
-                                                     Projections.GetDevice(Intent.Read),
-                                                     ShiftFactors.GetDevice(Intent.Read),
-                                                     InvSigma.GetDevice(Intent.Read),
-                                                     (uint)MaskLength,
-                                                     (uint)MaskSizes[m],
-                                                     Shifts.GetDevice(Intent.Read),
-                                                     Diff,
-                                                     (uint)NPositions,
-                                                     (uint)NFrames);
+                            float[] Diff = LastDiff;
 
                             //for (int i = 0; i < Diff.Length; i++)
                             //Diff[i] = Diff[i] * 100f;
@@ -2994,19 +2990,9 @@ namespace Warp
 
                         Func<double[], double[]> Grad = input =>
                         {
-                            SetPositions(input);
+                            DoDiffAndGrad(input);
 
-                            float[] Diff = new float[NPositions * NFrames * 2];
-                            GPU.ParticleShiftGetGrad(Phases.GetDevice(Intent.Read),
-                                                     Projections.GetDevice(Intent.Read),
-                                                     ShiftFactors.GetDevice(Intent.Read),
-                                                     InvSigma.GetDevice(Intent.Read),
-                                                     (uint)MaskLength,
-                                                     (uint)MaskSizes[m],
-                                                     Shifts.GetDevice(Intent.Read),
-                                                     Diff,
-                                                     (uint)NPositions,
-                                                     (uint)NFrames);
+                            float[] Diff = LastGrad;
 
                             //for (int i = 0; i < Diff.Length; i++)
                                 //Diff[i] = Diff[i] * 100f;
@@ -3036,7 +3022,15 @@ namespace Warp
 
                         BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
                         //Optimizer.Corrections = 20;
-                        Optimizer.Minimize(StartParams);
+                        GPU.MemoryPoolBeginScope();
+                        try
+                        {
+                            Optimizer.Minimize(StartParams);
+                        }
+                        finally
+                        {
+                            GPU.MemoryPoolEndScope();
+                        }
                     }
 
                     {
@@ -3060,8 +3054,10 @@ namespace Warp
 
             #endregion
 
+            GPU.DestroyPhaseRamps(shiftRamps);
+            shiftRamps = IntPtr.Zero;
             ShiftFactors.Dispose();
-            Phases.Dispose();
+            GPU.FreeDevice(Phases);
             Projections.Dispose();
             Shifts.Dispose();
             InvSigma.Dispose();
@@ -3627,6 +3623,20 @@ namespace Warp
         }
 
         public void ExportParticlesMovie(Star tableIn, Star tableOut, MapHeader originalHeader, Image originalStack, int size, float particleradius, decimal scaleFactor)
+        {
+            // The phase ramps are created part way through the polishing, so they're destroyed here even if it throws
+            IntPtr ShiftRamps = IntPtr.Zero;
+            try
+            {
+                ExportParticlesMovie(tableIn, tableOut, originalHeader, originalStack, size, particleradius, scaleFactor, ref ShiftRamps);
+            }
+            finally
+            {
+                GPU.DestroyPhaseRamps(ShiftRamps);
+            }
+        }
+
+        private void ExportParticlesMovie(Star tableIn, Star tableOut, MapHeader originalHeader, Image originalStack, int size, float particleradius, decimal scaleFactor, ref IntPtr shiftRamps)
         {
             int CurrentDevice = GPU.GetDevice();
 
@@ -4055,6 +4065,7 @@ namespace Warp
 
                     CTFCoords = new Image(CTFCoordsData, new int3(DimsCropped), true);
                     ShiftFactors = new Image(ShiftFactorsData, new int3(DimsCropped), true);
+                    shiftRamps = GPU.CreatePhaseRamps(Helper.ToInterleaved(ShiftFactorsData), ShiftFactors.GetDevice(Intent.Read), (uint)ShiftFactorsData.Length, 0);
                 }
                 #endregion
 
@@ -4193,55 +4204,34 @@ namespace Warp
 
                 #region Prepare particles: group and resize to DimsCropped
 
-                Image ParticleStackFT1 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles1 * Dims.Z / 3), true, true);
-                {
-                    GPU.CreatePolishing(ParticleStack1.GetDevice(Intent.Read),
-                                        ParticleStackFT1.GetDevice(Intent.Write),
-                                        Masks1.GetDevice(Intent.Read),
-                                        new int2(DimsRegion),
-                                        DimsCropped,
-                                        NParticles1,
-                                        Dims.Z);
-
-                    ParticleStack1.FreeDevice();
-                    Masks1.Dispose();
-
-                    /*Image Amps = ParticleStackFT1.AsIFFT();
-                    Amps.RemapFromFT();
-                    Amps.WriteMRC("d_particlestackft1.mrc");
-                    Amps.Dispose();*/
-                }
+                // Groups of PolishingGroupSize frames that cover all frames, the last one can be shorter; masked with a soft sphere
+                int GroupSize = Math.Max(1, Math.Min(Dims.Z, MainWindow.Options.PolishingGroupSize));
+                int NGroups = (Dims.Z + GroupSize - 1) / GroupSize;
+                int[] GroupFirst = Enumerable.Range(0, NGroups).Select(g => g * GroupSize).ToArray();
+                int[] GroupLength = GroupFirst.Select(g => Math.Min(GroupSize, Dims.Z - g)).ToArray();
+                float MaskRadius = 90.0f / (1.0605f / 1.25f);
+                float MaskFalloff = 24;
 
-                Image ParticleStackFT2 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles2 * Dims.Z / 3), true, true);
-                {
-                    GPU.CreatePolishing(ParticleStack2.GetDevice(Intent.Read),
-                                        ParticleStackFT2.GetDevice(Intent.Write),
-                                        Masks2.GetDevice(Intent.Read),
-                                        new int2(DimsRegion),
-                                        DimsCropped,
-                                        NParticles2,
-                                        Dims.Z);
-
-                    ParticleStack1.FreeDevice();
-                    Masks2.Dispose();
-
-                    /*Image Amps = ParticleStackFT2.AsIFFT();
-                    Amps.RemapFromFT();
-                    Amps.WriteMRC("d_particlestackft2.mrc");
-                    Amps.Dispose();*/
-                }
+                // The grouped particles are only read by PolishingGetDiff, so they can be stored at lower precision
+                StoragePrecision StackPrecision = MainWindow.Options.PolishingPrecision;
+
+                IntPtr ParticleStackFT1 = CreatePolishingStack(ParticleStack1, NParticles1, Dims.Z, new int2(DimsRegion), DimsCropped, GroupFirst, GroupLength, MaskRadius, MaskFalloff, StackPrecision);
+                Masks1.Dispose();
+
+                IntPtr ParticleStackFT2 = CreatePolishingStack(ParticleStack2, NParticles2, Dims.Z, new int2(DimsRegion), DimsCropped, GroupFirst, GroupLength, MaskRadius, MaskFalloff, StackPrecision);
+                Masks2.Dispose();
                 #endregion
 
-                Image Projections1 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles1 * Dims.Z / 3), true, true);
-                Image Projections2 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles2 * Dims.Z / 3), true, true);
+                Image Projections1 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles1 * NGroups), true, true);
+                Image Projections2 = new Image(IntPtr.Zero, new int3(DimsCropped.X, DimsCropped.Y, NParticles2 * NGroups), true, true);
 
-                Image Shifts1 = new Image(new int3(NParticles1, Dims.Z / 3, 1), false, true);
-                float3[] Angles1 = new float3[NParticles1 * Dims.Z / 3];
-                CTFStruct[] CTFParams1 = new CTFStruct[NParticles1 * Dims.Z / 3];
+                Image Shifts1 = new Image(new int3(NParticles1, NGroups, 1), false, true);
+                float3[] Angles1 = new float3[NParticles1 * NGroups];
+                CTFStruct[] CTFParams1 = new CTFStruct[NParticles1 * NGroups];
 
-                Image Shifts2 = new Image(new int3(NParticles2, Dims.Z / 3, 1), false, true);
-                float3[] Angles2 = new float3[NParticles2 * Dims.Z / 3];
-                CTFStruct[] CTFParams2 = new CTFStruct[NParticles2 * Dims.Z / 3];
+                Image Shifts2 = new Image(new int3(NParticles2, NGroups, 1), false, true);
+                float3[] Angles2 = new float3[NParticles2 * NGroups];
+                CTFStruct[] CTFParams2 = new CTFStruct[NParticles2 * NGroups];
 
                 float[] BFacs =
                 {
@@ -4256,20 +4246,20 @@ namespace Warp
                 };
 
                 #region Initialize defocus and phase shift values
-                float[] InitialDefoci1 = new float[NParticles1 * (Dims.Z / 3)];
-                float[] InitialPhaseShifts1 = new float[NParticles1 * (Dims.Z / 3)];
-                float[] InitialDefoci2 = new float[NParticles2 * (Dims.Z / 3)];
-                float[] InitialPhaseShifts2 = new float[NParticles2 * (Dims.Z / 3)];
-                for (int z = 0, i = 0; z < Dims.Z / 3; z++)
+                float[] InitialDefoci1 = new float[NParticles1 * NGroups];
+                float[] InitialPhaseShifts1 = new float[NParticles1 * NGroups];
+                float[] InitialDefoci2 = new float[NParticles2 * NGroups];
+                float[] InitialPhaseShifts2 = new float[NParticles2 * NGroups];
+                for (int z = 0, i = 0; z < NGroups; z++)
                 {
                     for (int p = 0; p < NParticles1; p++, i++)
                     {
                         InitialDefoci1[i] = GridCTF.GetInterpolated(new float3((float)Origins1[p].X / Dims.X,
                                                                                (float)Origins1[p].Y / Dims.Y,
-                                                                               (float)(z * 3 + 1) / (Dims.Z - 1)));
+                                                                               (GroupFirst[z] + (GroupLength[z] - 1) / 2f) / (Dims.Z - 1)));
                         InitialPhaseShifts1[i] = GridCTFPhase.GetInterpolated(new float3((float)Origins1[p].X / Dims.X,
                                                                                          (float)Origins1[p].Y / Dims.Y,
-                                                                                         (float)(z * 3 + 1) / (Dims.Z - 1)));
+                                                                                         (GroupFirst[z] + (GroupLength[z] - 1) / 2f) / (Dims.Z - 1)));
 
                         CTF Alt = CTF.GetCopy();
                         Alt.PixelSize = (decimal)PixelSize;
@@ -4281,16 +4271,16 @@ namespace Warp
                         CTFParams1[i] = Alt.ToStruct();
                     }
                 }
-                for (int z = 0, i = 0; z < Dims.Z / 3; z++)
+                for (int z = 0, i = 0; z < NGroups; z++)
                 {
                     for (int p = 0; p < NParticles2; p++, i++)
                     {
                         InitialDefoci2[i] = GridCTF.GetInterpolated(new float3((float)Origins2[p].X / Dims.X,
                                                                                (float)Origins2[p].Y / Dims.Y,
-                                                                               (float)(z * 3 + 1) / (Dims.Z - 1)));
+                                                                               (GroupFirst[z] + (GroupLength[z] - 1) / 2f) / (Dims.Z - 1)));
                         InitialPhaseShifts2[i] = GridCTFPhase.GetInterpolated(new float3((float)Origins2[p].X / Dims.X,
                                                                                          (float)Origins2[p].Y / Dims.Y,
-                                                                                         (float)(z * 3 + 1) / (Dims.Z - 1)));
+                                                                                         (GroupFirst[z] + (GroupLength[z] - 1) / 2f) / (Dims.Z - 1)));
 
                         CTF Alt = CTF.GetCopy();
                         Alt.PixelSize = (decimal)PixelSize;
@@ -4307,26 +4297,26 @@ namespace Warp
                 #region SetPositions lambda
                 Action<double[]> SetPositions = input =>
                 {
-                    float BorderZ = 0.5f / (Dims.Z / 3);
+                    float BorderZ = 0.5f / NGroups;
 
                     GridX = new CubicGrid(new int3(NParticles, 1, 2), input.Take(NParticles * 2).Select(v => (float)v).ToArray());
                     GridY = new CubicGrid(new int3(NParticles, 1, 2), input.Skip(NParticles * 2 * 1).Take(NParticles * 2).Select(v => (float)v).ToArray());
 
-                    float[] AlteredX = GridX.GetInterpolatedNative(new int3(NParticles, 1, Dims.Z / 3), new float3(0, 0, BorderZ));
-                    float[] AlteredY = GridY.GetInterpolatedNative(new int3(NParticles, 1, Dims.Z / 3), new float3(0, 0, BorderZ));
+                    float[] AlteredX = GridX.GetInterpolatedNative(new int3(NParticles, 1, NGroups), new float3(0, 0, BorderZ));
+                    float[] AlteredY = GridY.GetInterpolatedNative(new int3(NParticles, 1, NGroups), new float3(0, 0, BorderZ));
 
                     GridRot = new CubicGrid(new int3(NParticles, 1, 2), input.Skip(NParticles * 2 * 2).Take(NParticles * 2).Select(v => (float)v).ToArray());
                     GridTilt = new CubicGrid(new int3(NParticles, 1, 2), input.Skip(NParticles * 2 * 3).Take(NParticles * 2).Select(v => (float)v).ToArray());
                     GridPsi = new CubicGrid(new int3(NParticles, 1, 2), input.Skip(NParticles * 2 * 4).Take(NParticles * 2).Select(v => (float)v).ToArray());
 
-                    float[] AlteredRot = GridRot.GetInterpolatedNative(new int3(NParticles, 1, Dims.Z / 3), new float3(0, 0, BorderZ));
-                    float[] AlteredTilt = GridTilt.GetInterpolatedNative(new int3(NParticles, 1, Dims.Z / 3), new float3(0, 0, BorderZ));
-                    float[] AlteredPsi = GridPsi.GetInterpolatedNative(new int3(NParticles, 1, Dims.Z / 3), new float3(0, 0, BorderZ));
+                    float[] AlteredRot = GridRot.GetInterpolatedNative(new int3(NParticles, 1, NGroups), new float3(0, 0, BorderZ));
+                    float[] AlteredTilt = GridTilt.GetInterpolatedNative(new int3(NParticles, 1, NGroups), new float3(0, 0, BorderZ));
+                    float[] AlteredPsi = GridPsi.GetInterpolatedNative(new int3(NParticles, 1, NGroups), new float3(0, 0, BorderZ));
 
                     float[] ShiftData1 = Shifts1.GetHost(Intent.Write)[0];
                     float[] ShiftData2 = Shifts2.GetHost(Intent.Write)[0];
 
-                    for (int z = 0; z < Dims.Z / 3; z++)
+                    for (int z = 0; z < NGroups; z++)
                     {
                         // Half 1
                         for (int p = 0; p < NParticles1; p++)
@@ -4366,7 +4356,7 @@ namespace Warp
                                            DimsCropped,
                                            Helper.ToInterleaved(Angles1),
                                            MainWindow.Options.ProjectionOversample,
-                                           (uint)(NParticles1 * Dims.Z / 3));
+                                           (uint)(NParticles1 * NGroups));
 
                         GPU.ProjectForward(VolRefFT2.GetDevice(Intent.Read),
                                            Projections2.GetDevice(Intent.Write),
@@ -4374,7 +4364,7 @@ namespace Warp
                                            DimsCropped,
                                            Helper.ToInterleaved(Angles2),
                                            MainWindow.Options.ProjectionOversample,
-                                           (uint)(NParticles2 * Dims.Z / 3));
+                                           (uint)(NParticles2 * NGroups));
                     }
 
                     /*{
@@ -4391,8 +4381,8 @@ namespace Warp
                     }*/
 
                     float[] Diff1 = new float[NParticles1];
-                    float[] DiffAll1 = new float[NParticles1 * (Dims.Z / 3)];
-                    GPU.PolishingGetDiff(ParticleStackFT1.GetDevice(Intent.Read),
+                    float[] DiffAll1 = new float[NParticles1 * NGroups];
+                    GPU.PolishingGetDiff(ParticleStackFT1,
                                          Projections1.GetDevice(Intent.Read),
                                          ShiftFactors.GetDevice(Intent.Read),
                                          CTFCoords.GetDevice(Intent.Read),
@@ -4403,11 +4393,12 @@ namespace Warp
                                          Diff1,
                                          DiffAll1,
                                          (uint)NParticles1,
-                                         (uint)Dims.Z / 3);
+                                         (uint)NGroups,
+                                         StackPrecision);
 
                     float[] Diff2 = new float[NParticles2];
-                    float[] DiffAll2 = new float[NParticles2 * (Dims.Z / 3)];
-                    GPU.PolishingGetDiff(ParticleStackFT2.GetDevice(Intent.Read),
+                    float[] DiffAll2 = new float[NParticles2 * NGroups];
+                    GPU.PolishingGetDiff(ParticleStackFT2,
                                          Projections2.GetDevice(Intent.Read),
                                          ShiftFactors.GetDevice(Intent.Read),
                                          CTFCoords.GetDevice(Intent.Read),
@@ -4418,7 +4409,8 @@ namespace Warp
                                          Diff2,
                                          DiffAll2,
                                          (uint)NParticles2,
-                                         (uint)Dims.Z / 3);
+                                         (uint)NGroups,
+                                         StackPrecision);
 
                     double[] DiffBoth = new double[NParticles];
                     for (int p = 0; p < NParticles1; p++)
@@ -4447,7 +4439,7 @@ namespace Warp
                                        DimsCropped,
                                        Helper.ToInterleaved(Angles1),
                                        MainWindow.Options.ProjectionOversample,
-                                       (uint)(NParticles1 * Dims.Z / 3));
+                                       (uint)(NParticles1 * NGroups));
 
                     GPU.ProjectForward(VolRefFT2.GetDevice(Intent.Read),
                                        Projections2.GetDevice(Intent.Write),
@@ -4455,7 +4447,7 @@ namespace Warp
                                        DimsCropped,
                                        Helper.ToInterleaved(Angles2),
                                        MainWindow.Options.ProjectionOversample,
-                                       (uint)(NParticles2 * Dims.Z / 3));
+                                       (uint)(NParticles2 * NGroups));
 
                     double[] Result = new double[input.Length];
 
@@ -4520,10 +4512,18 @@ namespace Warp
                 BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Grad);
                 Optimizer.Epsilon = 3e-7;
                 
-                Optimizer.Maximize(StartParams);
+                GPU.MemoryPoolBeginScope();
+                try
+                {
+                    Optimizer.Maximize(StartParams);
+                }
+                finally
+                {
+                    GPU.MemoryPoolEndScope();
+                }
 
                 #region Calculate particle quality for high frequencies
-                float[] ParticleQuality = new float[NParticles * (Dims.Z / 3)];
+                float[] ParticleQuality = new float[NParticles * NGroups];
                 {
                     Sigma2Noise.Dispose();
                     Sigma2Noise = new Image(new int3(DimsCropped), true);
@@ -4561,7 +4561,7 @@ namespace Warp
                                        DimsCropped,
                                        Helper.ToInterleaved(Angles1),
                                        MainWindow.Options.ProjectionOversample,
-                                       (uint)(NParticles1 * Dims.Z / 3));
+                                       (uint)(NParticles1 * NGroups));
 
                     GPU.ProjectForward(VolRefFT2.GetDevice(Intent.Read),
                                        Projections2.GetDevice(Intent.Write),
@@ -4569,11 +4569,11 @@ namespace Warp
                                        DimsCropped,
                                        Helper.ToInterleaved(Angles2),
                                        MainWindow.Options.ProjectionOversample,
-                                       (uint)(NParticles2 * Dims.Z / 3));
+                                       (uint)(NParticles2 * NGroups));
 
                     float[] Diff1 = new float[NParticles1];
-                    float[] ParticleQuality1 = new float[NParticles1 * (Dims.Z / 3)];
-                    GPU.PolishingGetDiff(ParticleStackFT1.GetDevice(Intent.Read),
+                    float[] ParticleQuality1 = new float[NParticles1 * NGroups];
+                    GPU.PolishingGetDiff(ParticleStackFT1,
                                          Projections1.GetDevice(Intent.Read),
                                          ShiftFactors.GetDevice(Intent.Read),
                                          CTFCoords.GetDevice(Intent.Read),
@@ -4584,11 +4584,12 @@ namespace Warp
                                          Diff1,
                                          ParticleQuality1,
                                          (uint)NParticles1,
-                                         (uint)Dims.Z / 3);
+                                         (uint)NGroups,
+                                         StackPrecision);
 
                     float[] Diff2 = new float[NParticles2];
-                    float[] ParticleQuality2 = new float[NParticles2 * (Dims.Z / 3)];
-                    GPU.PolishingGetDiff(ParticleStackFT2.GetDevice(Intent.Read),
+                    float[] ParticleQuality2 = new float[NParticles2 * NGroups];
+                    GPU.PolishingGetDiff(ParticleStackFT2,
                                          Projections2.GetDevice(Intent.Read),
                                          ShiftFactors.GetDevice(Intent.Read),
                                          CTFCoords.GetDevice(Intent.Read),
@@ -4599,9 +4600,10 @@ namespace Warp
                                          Diff2,
                                          ParticleQuality2,
                                          (uint)NParticles2,
-                                         (uint)Dims.Z / 3);
+                                         (uint)NGroups,
+                                         StackPrecision);
 
-                    for (int z = 0; z < Dims.Z / 3; z++)
+                    for (int z = 0; z < NGroups; z++)
                     {
                         for (int p = 0; p < NParticles1; p++)
                             ParticleQuality[z * NParticles + p] = ParticleQuality1[z * NParticles1 + p];
@@ -4660,7 +4662,7 @@ namespace Warp
                         tableOut.SetRowValue(TableOutIndices[i], "rlnDefocusU", ((Defocus + (float)CTF.DefocusDelta / 2f) * 1e4f).ToString(CultureInfo.InvariantCulture));
                         tableOut.SetRowValue(TableOutIndices[i], "rlnDefocusV", ((Defocus - (float)CTF.DefocusDelta / 2f) * 1e4f).ToString(CultureInfo.InvariantCulture));
                         tableOut.SetRowValue(TableOutIndices[i], "rlnPhaseShift", (PhaseShift * 180f).ToString(CultureInfo.InvariantCulture));
-                        tableOut.SetRowValue(TableOutIndices[i], "rlnCtfFigureOfMerit", (ParticleQuality[(z / 3) * NParticles + (i % NParticles)]).ToString(CultureInfo.InvariantCulture));
+                        tableOut.SetRowValue(TableOutIndices[i], "rlnCtfFigureOfMerit", (ParticleQuality[(z / GroupSize) * NParticles + (i % NParticles)]).ToString(CultureInfo.InvariantCulture));
 
                         tableOut.SetRowValue(TableOutIndices[i], "rlnMagnification", ((float)MainWindow.Options.CTFDetectorPixel * 10000f / PixelSize).ToString());
                     }
@@ -4671,11 +4673,13 @@ namespace Warp
                 Projections1.Dispose();
                 Projections2.Dispose();
                 Sigma2Noise.Dispose();
-                ParticleStackFT1.Dispose();
-                ParticleStackFT2.Dispose();
+                GPU.FreeDevice(ParticleStackFT1);
+                GPU.FreeDevice(ParticleStackFT2);
                 Shifts1.Dispose();
                 Shifts2.Dispose();
                 CTFCoords.Dispose();
+                GPU.DestroyPhaseRamps(shiftRamps);
+                shiftRamps = IntPtr.Zero;
                 ShiftFactors.Dispose();
 
                 ParticleStack1.Dispose();
@@ -4700,6 +4704,60 @@ namespace Warp
             SaveThread.Start();
         }
 
+        // Groups the frames of every particle and transforms them for polishing, a batch of particles at a time, so
+        // only one batch of raw particle frames is on the device at any time. particles holds nparticles particles per
+        // frame, frame after frame; the returned device buffer holds nparticles transforms per group, group after group,
+        // stored with the given precision. Free it with GPU.FreeDevice.
+        private static IntPtr CreatePolishingStack(Image particles, int nparticles, int nframes, int2 dimsregion, int2 dimscropped, int[] groupfirst, int[] grouplength, float maskradius, float maskfalloff, StoragePrecision precision)
+        {
+            int NGroups = groupfirst.Length;
+            int BatchSize = Math.Max(1, MainWindow.Options.PolishingBatchSize);
+            float[][] ParticlesData = particles.GetHost(Intent.Read);
+
+            long ElementsSlice = dimscropped.ElementsFFT() * 2;
+            long BytesPerElement = precision == StoragePrecision.FP32 ? sizeof(float) : sizeof(ushort);
+            IntPtr ParticlesFT = GPU.MallocDeviceStorage(ElementsSlice * nparticles * NGroups, precision);
+
+            for (int first = 0; first < nparticles; first += BatchSize)
+            {
+                int n = Math.Min(BatchSize, nparticles - first);
+
+                float[][] BatchData = new float[nframes * n][];
+                for (int z = 0; z < nframes; z++)
+                    for (int p = 0; p < n; p++)
+                        BatchData[z * n + p] = ParticlesData[z * nparticles + first + p];
+
+                Image Batch = new Image(BatchData, new int3(dimsregion.X, dimsregion.Y, nframes * n));
+                IntPtr BatchFT = GPU.MallocDeviceStorage(ElementsSlice * n * NGroups, precision);
+
+                GPU.CreatePolishingGroups(Batch.GetDevice(Intent.Read),
+                                          BatchFT,
+                                          dimsregion,
+                                          dimscropped,
+                                          n,
+                                          nframes,
+                                          groupfirst,
+                                          grouplength,
+                                          NGroups,
+                                          null,
+                                          maskradius,
+                                          maskfalloff,
+                                          n,
+                                          precision);
+
+                // CopyDeviceToDevice counts floats, while the buffers hold BytesPerElement per element
+                for (int g = 0; g < NGroups; g++)
+                    GPU.CopyDeviceToDevice(new IntPtr((long)BatchFT + ElementsSlice * n * g * BytesPerElement),
+                                           new IntPtr((long)ParticlesFT + ElementsSlice * ((long)nparticles * g + first) * BytesPerElement),
+                                           ElementsSlice * n * BytesPerElement / sizeof(float));
+
+                Batch.Dispose();
+                GPU.FreeDevice(BatchFT);
+            }
+
+            return ParticlesFT;
+        }
+
         public void ExportParticlesMovieOld(Star table, int size)
         {
             List<int> RowIndices = new List<int>();
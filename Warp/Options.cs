@@ -43,6 +43,7 @@ namespace Warp
                     InputExtensionMRCS = value == "*.mrcs";
                     InputExtensionEM = value == "*.em";
                     InputExtensionTIFF = value == "*.tif";
+                    InputExtensionEER = value == "*.eer";
                     InputExtensionDAT = value == "*.dat";
                 }
             }
@@ -108,6 +109,21 @@ namespace Warp
             }
         }
 
+        private bool _InputExtensionEER = false;
+        public bool InputExtensionEER
+        {
+            get { return _InputExtensionEER; }
+            set
+            {
+                if (value != _InputExtensionEER)
+                {
+                    _InputExtensionEER = value; OnPropertyChanged();
+                    if (value)
+                        InputExtension = "*.eer";
+                }
+            }
+        }
+
         private bool _InputExtensionALI = false;
         public bool InputExtensionALI
         {
@@ -166,6 +182,20 @@ namespace Warp
             set { if (value != _InputDatOffset) { _InputDatOffset = value; OnPropertyChanged(); } }
         }
 
+        private int _InputEERGroupFrames = 32;
+        public int InputEERGroupFrames
+        {
+            get { return _InputEERGroupFrames; }
+            set { if (value != _InputEERGroupFrames) { _InputEERGroupFrames = value; OnPropertyChanged(); } }
+        }
+
+        private int _InputEERUpsampling = 1;
+        public int InputEERUpsampling
+        {
+            get { return _InputEERUpsampling; }
+            set { if (value != _InputEERUpsampling) { _InputEERUpsampling = value; OnPropertyChanged(); } }
+        }
+
         public ObservableCollection<string> _InputDatTypes = new ObservableCollection<string>
         {
             "int8", "int16", "int32", "int64", "float32", "float64"
@@ -398,6 +428,69 @@ namespace Warp
             set { if (value != _ProjectionOversample) { _ProjectionOversample = value; OnPropertyChanged(); } }
         }
 
+        private int _PolishingGroupSize = 3;
+        public int PolishingGroupSize
+        {
+            get { return _PolishingGroupSize; }
+            set { if (value != _PolishingGroupSize) { _PolishingGroupSize = value; OnPropertyChanged(); } }
+        }
+
+        private int _PolishingBatchSize = 256;
+        public int PolishingBatchSize
+        {
+            get { return _PolishingBatchSize; }
+            set { if (value != _PolishingBatchSize) { _PolishingBatchSize = value; OnPropertyChanged(); } }
+        }
+
+        private StoragePrecision _PolishingPrecision = StoragePrecision.FP32;
+        public StoragePrecision PolishingPrecision
+        {
+            get { return _PolishingPrecision; }
+            set { if (value != _PolishingPrecision) { _PolishingPrecision = value; OnPropertyChanged(); } }
+        }
+
+        private StoragePrecision _PhasePrecision = StoragePrecision.FP32;
+        public StoragePrecision PhasePrecision
+        {
+            get { return _PhasePrecision; }
+            set { if (value != _PhasePrecision) { _PhasePrecision = value; OnPropertyChanged(); } }
+        }
+
+        private StoragePrecision _SpectrumPrecision = StoragePrecision.FP32;
+        public StoragePrecision SpectrumPrecision
+        {
+            get { return _SpectrumPrecision; }
+            set { if (value != _SpectrumPrecision) { _SpectrumPrecision = value; OnPropertyChanged(); } }
+        }
+
+        private string _ProjectorCacheDirectory = "";
+        public string ProjectorCacheDirectory
+        {
+            get { return _ProjectorCacheDirectory; }
+            set { if (value != _ProjectorCacheDirectory) { _ProjectorCacheDirectory = value; OnPropertyChanged(); } }
+        }
+
+        private int _ReconstructionThreads = 0;
+        public int ReconstructionThreads
+        {
+            get { return _ReconstructionThreads; }
+            set { if (value != _ReconstructionThreads) { _ReconstructionThreads = value; OnPropertyChanged(); } }
+        }
+
+        private long _ReconstructionMemoryBudget = 0;
+        public long ReconstructionMemoryBudget
+        {
+            get { return _ReconstructionMemoryBudget; }
+            set { if (value != _ReconstructionMemoryBudget) { _ReconstructionMemoryBudget = value; OnPropertyChanged(); } }
+        }
+
+        private string _ReconstructionScratchDirectory = "";
+        public string ReconstructionScratchDirectory
+        {
+            get { return _ReconstructionScratchDirectory; }
+            set { if (value != _ReconstructionScratchDirectory) { _ReconstructionScratchDirectory = value; OnPropertyChanged(); } }
+        }
+
         private int _ExportParticleSize = 256;
         public int ExportParticleSize
         {
@@ -950,6 +1043,8 @@ namespace Warp
             XMLHelper.WriteParamNode(Writer, "InputDatHeight", InputDatHeight);
             XMLHelper.WriteParamNode(Writer, "InputDatType", InputDatType);
             XMLHelper.WriteParamNode(Writer, "InputDatOffset", InputDatOffset);
+            XMLHelper.WriteParamNode(Writer, "InputEERGroupFrames", InputEERGroupFrames);
+            XMLHelper.WriteParamNode(Writer, "InputEERUpsampling", InputEERUpsampling);
             XMLHelper.WriteParamNode(Writer, "OutputFolder", OutputFolder);
             XMLHelper.WriteParamNode(Writer, "OutputExtension", OutputExtension);
             XMLHelper.WriteParamNode(Writer, "ArchiveOperation", ArchiveOperation);
@@ -965,6 +1060,15 @@ namespace Warp
             XMLHelper.WriteParamNode(Writer, "ReferencePath", ReferencePath);
             XMLHelper.WriteParamNode(Writer, "MaskPath", MaskPath);
             XMLHelper.WriteParamNode(Writer, "ProjectionOversample", ProjectionOversample);
+            XMLHelper.WriteParamNode(Writer, "PolishingGroupSize", PolishingGroupSize);
+            XMLHelper.WriteParamNode(Writer, "PolishingBatchSize", PolishingBatchSize);
+            XMLHelper.WriteParamNode(Writer, "PolishingPrecision", (int)PolishingPrecision);
+            XMLHelper.WriteParamNode(Writer, "PhasePrecision", (int)PhasePrecision);
+            XMLHelper.WriteParamNode(Writer, "SpectrumPrecision", (int)SpectrumPrecision);
+            XMLHelper.WriteParamNode(Writer, "ProjectorCacheDirectory", ProjectorCacheDirectory);
+            XMLHelper.WriteParamNode(Writer, "ReconstructionThreads", ReconstructionThreads);
+            XMLHelper.WriteParamNode(Writer, "ReconstructionMemoryBudget", ReconstructionMemoryBudget);
+            XMLHelper.WriteParamNode(Writer, "ReconstructionScratchDirectory", ReconstructionScratchDirectory);
             XMLHelper.WriteParamNode(Writer, "ExportParticleSize", ExportParticleSize);
             XMLHelper.WriteParamNode(Writer, "ExportParticleRadius", ExportParticleRadius);
 
@@ -1025,6 +1129,8 @@ namespace Warp
                 InputDatHeight = XMLHelper.LoadParamNode(Reader, "InputDatHeight", 7420);
                 InputDatType = XMLHelper.LoadParamNode(Reader, "InputDatType", "int8");
                 InputDatOffset = XMLHelper.LoadParamNode(Reader, "InputDatOffset", 0);
+                InputEERGroupFrames = XMLHelper.LoadParamNode(Reader, "InputEERGroupFrames", 32);
+                InputEERUpsampling = XMLHelper.LoadParamNode(Reader, "InputEERUpsampling", 1);
                 OutputFolder = XMLHelper.LoadParamNode(Reader, "OutputFolder", "");
                 OutputExtension = XMLHelper.LoadParamNode(Reader, "OutputExtension", "*.mrc");
                 ArchiveOperation = XMLHelper.LoadParamNode(Reader, "ArchiveOperation", "Compress");
@@ -1040,6 +1146,15 @@ namespace Warp
                 ReferencePath = XMLHelper.LoadParamNode(Reader, "ReferencePath", "");
                 MaskPath = XMLHelper.LoadParamNode(Reader, "MaskPath", "");
                 ProjectionOversample = XMLHelper.LoadParamNode(Reader, "ProjectionOversample", ProjectionOversample);
+                PolishingGroupSize = XMLHelper.LoadParamNode(Reader, "PolishingGroupSize", PolishingGroupSize);
+                PolishingBatchSize = XMLHelper.LoadParamNode(Reader, "PolishingBatchSize", PolishingBatchSize);
+                PolishingPrecision = (StoragePrecision)XMLHelper.LoadParamNode(Reader, "PolishingPrecision", (int)PolishingPrecision);
+                PhasePrecision = (StoragePrecision)XMLHelper.LoadParamNode(Reader, "PhasePrecision", (int)PhasePrecision);
+                SpectrumPrecision = (StoragePrecision)XMLHelper.LoadParamNode(Reader, "SpectrumPrecision", (int)SpectrumPrecision);
+                ProjectorCacheDirectory = XMLHelper.LoadParamNode(Reader, "ProjectorCacheDirectory", "");
+                ReconstructionThreads = XMLHelper.LoadParamNode(Reader, "ReconstructionThreads", ReconstructionThreads);
+                ReconstructionMemoryBudget = XMLHelper.LoadParamNode(Reader, "ReconstructionMemoryBudget", ReconstructionMemoryBudget);
+                ReconstructionScratchDirectory = XMLHelper.LoadParamNode(Reader, "ReconstructionScratchDirectory", "");
                 ExportParticleSize = XMLHelper.LoadParamNode(Reader, "ExportParticleSize", ExportParticleSize);
                 ExportParticleRadius = XMLHelper.LoadParamNode(Reader, "ExportParticleRadius", ExportParticleRadius);
 
@@ -540,6 +540,10 @@ namespace Warp
 
             #region Create spectra
 
+            // Spectra in a reduced precision are created next to the tilt image, and only expanded to fp32 once it's freed
+            StoragePrecision SpectraPrecision = MainWindow.Options.SpectrumPrecision;
+            IntPtr SpectraStorage = SpectraPrecision == StoragePrecision.FP32 ? CTFSpectra.GetDevice(Intent.Write) : GPU.MallocDeviceStorage(CTFSpectra.ElementsReal, SpectraPrecision);
+
             GPU.CreateSpectra(angleImage.GetDevice(Intent.Read),
                               DimsImage,
                               NFrames,
@@ -547,10 +551,17 @@ namespace Warp
                               NPositions,
                               DimsRegion,
                               CTFSpectraGrid,
-                              CTFSpectra.GetDevice(Intent.Write),
-                              CTFMean.GetDevice(Intent.Write));
+                              SpectraStorage,
+                              CTFMean.GetDevice(Intent.Write),
+                              SpectraPrecision);
             angleImage.FreeDevice(); // Won't need it in this method anymore.
 
+            if (SpectraPrecision != StoragePrecision.FP32)
+            {
+                GPU.StorageToSingle(SpectraStorage, CTFSpectra.GetDevice(Intent.Write), CTFSpectra.ElementsReal, SpectraPrecision);
+                GPU.FreeDevice(SpectraStorage);
+            }
+
             #endregion
 
             // Populate address arrays for later.
@@ -2503,6 +2514,7 @@ namespace Warp
             Image ParticleCTFs = new Image(new int3(CoarseSize, CoarseSize, NParticles * NTilts), true);
             Image ParticleWeights = null;
             Image ShiftFactors = null;
+            IntPtr ShiftRamps = IntPtr.Zero;
 
             #region Preflight
             float KeepBFac = GlobalBfactor;
@@ -2524,6 +2536,7 @@ namespace Warp
                         }
 
                     ShiftFactors = new Image(ShiftFactorsData, new int3(CoarseSize, CoarseSize, 1), true);
+                    ShiftRamps = GPU.CreatePhaseRamps(Helper.ToInterleaved(ShiftFactorsData), ShiftFactors.GetDevice(Intent.Read), (uint)ShiftFactorsData.Length, 0);
                 }
                 #endregion
 
@@ -3300,7 +3313,15 @@ namespace Warp
             BroydenFletcherGoldfarbShanno Optimizer = new BroydenFletcherGoldfarbShanno(StartParams.Length, Eval, Gradient);
             Optimizer.Epsilon = 3e-7;
 
-            Optimizer.Maximize(StartParams);
+            GPU.MemoryPoolBeginScope();
+            try
+            {
+                Optimizer.Maximize(StartParams);
+            }
+            finally
+            {
+                GPU.MemoryPoolEndScope();
+            }
 
             float3[] OptimizedOrigins, OptimizedOrigins2, OptimizedAngles, OptimizedAngles2;
             GetParametersFromVector(StartParams, NParticles, size, out OptimizedOrigins, out OptimizedOrigins2, out OptimizedAngles, out OptimizedAngles2);
@@ -3356,6 +3377,7 @@ namespace Warp
             ParticleImages?.Dispose();
             ParticleCTFs?.Dispose();
             ParticleWeights?.Dispose();
+            GPU.DestroyPhaseRamps(ShiftRamps);
             ShiftFactors?.Dispose();
 
             #region Extract particles at full resolution and back-project them into the reconstruction volumes
@@ -3700,6 +3722,7 @@ namespace Warp
             Image ParticleCTFs = new Image(new int3(CoarseSize, CoarseSize, NParticles * NTilts), true);
             Image ParticleWeights = null;
             Image ShiftFactors = null;
+            IntPtr ShiftRamps = IntPtr.Zero;
 
             #region Preflight
 
@@ -3723,6 +3746,7 @@ namespace Warp
                         }
 
                     ShiftFactors = new Image(ShiftFactorsData, new int3(CoarseSize, CoarseSize, 1), true);
+                    ShiftRamps = GPU.CreatePhaseRamps(Helper.ToInterleaved(ShiftFactorsData), ShiftFactors.GetDevice(Intent.Read), (uint)ShiftFactorsData.Length, 0);
                 }
 
                 #endregion
@@ -4021,8 +4045,11 @@ namespace Warp
                 RelativeOffsets = RelativeOffsetList.ToArray();
             }
 
-            float3[] HealpixAngles = Helper.GetHealpixAngles(healpixOrder, symmetry).Select(a => a * Helper.ToRad).ToArray();
-            float3[] ProjectionAngles = GetImageAngles(HealpixAngles);
+            // Orientations are generated chunk by chunk, memory doesn't grow with the HEALPix order
+            IntPtr AngleSampling = CPU.CreateAngleSampling(healpixOrder, symmetry);
+            long NAngles = CPU.AngleSamplingCount(AngleSampling);
+            int ChunkAngles = 4096;
+            float[] ChunkData = new float[ChunkAngles * 3];
 
             float3[] OptimizedOrigins = new float3[NParticles];
             float3[] OptimizedAngles = new float3[NParticles];
@@ -4050,32 +4077,61 @@ namespace Warp
                 int[] AngleIDs = new int[NSubset];
                 float[] SubsetScores = new float[NSubset];
 
-                GPU.TomoGlobalAlign(ParticleImages.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
-                                    ShiftFactors.GetDevice(Intent.Read),
-                                    ParticleCTFs.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
-                                    ParticleWeights.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
-                                    new int2(CoarseDims),
-                                    references[subset.Key].Data.GetDevice(Intent.Read),
-                                    references[subset.Key].Data.Dims,
-                                    references[subset.Key].Oversampling,
-                                    Helper.ToInterleaved(ProjectionAngles),
-                                    (uint)HealpixAngles.Length,
-                                    ImageOffsets,
-                                    (uint)RelativeOffsets.Length,
-                                    (uint)NSubset,
-                                    (uint)NTilts,
-                                    AngleIDs,
-                                    ShiftIDs,
-                                    SubsetScores);
-                
+                for (long FirstAngle = 0; FirstAngle < NAngles; FirstAngle += ChunkAngles)
+                {
+                    int NChunk = CPU.AngleSamplingGetChunk(AngleSampling, FirstAngle, ChunkAngles, ChunkData);
+                    float3[] HealpixAngles = Helper.FromInterleaved3(ChunkData).Take(NChunk).Select(a => a * Helper.ToRad).ToArray();
+                    float3[] ProjectionAngles = GetImageAngles(HealpixAngles);
+
+                    // Each chunk gets its own results, with angle IDs relative to the chunk
+                    int[] ChunkShiftIDs = new int[NSubset];
+                    int[] ChunkAngleIDs = new int[NSubset];
+                    float[] ChunkScores = new float[NSubset].Select(v => -float.MaxValue).ToArray();
+
+                    // Coarse pass at half Nyquist, then the neighborhoods of each particle's 8 best candidates
+                    GPU.TomoGlobalAlignHierarchical(ParticleImages.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
+                                                    ShiftFactors.GetDevice(Intent.Read),
+                                                    ParticleCTFs.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
+                                                    ParticleWeights.GetDeviceSlice(subset.Value.Item1 * NTilts, Intent.Read),
+                                                    new int2(CoarseDims),
+                                                    references[subset.Key].Data.GetDevice(Intent.Read),
+                                                    references[subset.Key].Data.Dims,
+                                                    references[subset.Key].Oversampling,
+                                                    Helper.ToInterleaved(ProjectionAngles),
+                                                    (uint)NChunk,
+                                                    ImageOffsets,
+                                                    (uint)RelativeOffsets.Length,
+                                                    (uint)NSubset,
+                                                    (uint)NTilts,
+                                                    0.5f,
+                                                    8,
+                                                    0,
+                                                    0,
+                                                    ChunkAngleIDs,
+                                                    ChunkShiftIDs,
+                                                    ChunkScores);
+
+                    for (int i = 0; i < NSubset; i++)
+                        if (ChunkScores[i] > SubsetScores[i])
+                        {
+                            AngleIDs[i] = (int)FirstAngle + ChunkAngleIDs[i];
+                            ShiftIDs[i] = ChunkShiftIDs[i];
+                            SubsetScores[i] = ChunkScores[i];
+                        }
+                }
+
+                float[] BestAngle = new float[3];
                 for (int i = 0; i < NSubset; i++)
                 {
+                    CPU.AngleSamplingGetChunk(AngleSampling, AngleIDs[i], 1, BestAngle);
+
                     OptimizedOrigins[subset.Value.Item1 + i] = ParticleOrigins[subset.Value.Item1 + i] + RelativeOffsets[ShiftIDs[i]];
-                    OptimizedAngles[subset.Value.Item1 + i] = HealpixAngles[AngleIDs[i]];
+                    OptimizedAngles[subset.Value.Item1 + i] = new float3(BestAngle[0], BestAngle[1], BestAngle[2]) * Helper.ToRad;
                     BestScores[subset.Value.Item1 + i] = SubsetScores[i];
                 }
             }
 
+            CPU.DestroyAngleSampling(AngleSampling);
             Projections.Dispose();
 
             #endregion
@@ -4083,6 +4139,7 @@ namespace Warp
             ParticleImages?.Dispose();
             ParticleCTFs?.Dispose();
             ParticleWeights?.Dispose();
+            GPU.DestroyPhaseRamps(ShiftRamps);
             ShiftFactors?.Dispose();
 
             #region Extract particles at full resolution and back-project them into the reconstruction volumes
@@ -5250,33 +5307,33 @@ namespace Warp
 
                     #region For each particle offset, correlate each tilt image with all reference projection
 
-                    float[][] AllResults = new float[Shifts.Count][];
-                    //for (int s = 0; s < Shifts.Count; s++)
-                    Parallel.For(0, Shifts.Count, new ParallelOptions { MaxDegreeOfParallelism = 2 }, s =>
+                    // All offsets at once: the masked statistics of every shifted tilt image are computed only once
+                    float3[] PositionDiffs = new float3[Shifts.Count * NTilts];
+                    for (int s = 0; s < Shifts.Count; s++)
                     {
-                        AllResults[s] = new float[AnglesOri.Length];
-
                         float3 ParticleCoordsAlt = ParticleOrigins[p] - Shifts[s];
                         float3[] PositionsAlt = GetPositionInImages(ParticleCoordsAlt);
-                        float3[] PositionDiff = new float3[NTilts];
                         for (int t = 0; t < NTilts; t++)
-                            PositionDiff[t] = (ExtractedAt[t] - PositionsAlt[t]) / size * CoarseSize;
-
-                        float[] ShiftResults = new float[AnglesOri.Length];
-
-                        GPU.TomoRealspaceCorrelate(ProjectionsReal.GetDevice(Intent.Read),
-                                                   new int2(CoarseSize, CoarseSize),
-                                                   (uint)AnglesOri.Length,
-                                                   (uint)NTilts,
-                                                   ParticleImages.GetDevice(Intent.Read),
-                                                   ParticleCTFs.GetDevice(Intent.Read),
-                                                   Mask.GetDevice(Intent.Read),
-                                                   ParticleWeights.GetDevice(Intent.Read),
-                                                   Helper.ToInterleaved(PositionDiff),
-                                                   ShiftResults);
+                            PositionDiffs[s * NTilts + t] = (ExtractedAt[t] - PositionsAlt[t]) / size * CoarseSize;
+                    }
 
-                        AllResults[s] = ShiftResults;
-                    });
+                    int[] BestShiftIDs = new int[AnglesOri.Length];
+                    float[] BestShiftScores = new float[AnglesOri.Length];
+
+                    IntPtr Scorer = GPU.CreateTomoRealspaceScorer(ParticleImages.GetDevice(Intent.Read),
+                                                                  Mask.GetDevice(Intent.Read),
+                                                                  new int2(CoarseSize, CoarseSize),
+                                                                  (uint)NTilts);
+                    GPU.TomoRealspaceScorerCorrelate(Scorer,
+                                                     ProjectionsReal.GetDevice(Intent.Read),
+                                                     (uint)AnglesOri.Length,
+                                                     ParticleWeights.GetDevice(Intent.Read),
+                                                     Helper.ToInterleaved(PositionDiffs),
+                                                     (uint)Shifts.Count,
+                                                     1,
+                                                     BestShiftIDs,
+                                                     BestShiftScores);
+                    GPU.DestroyTomoRealspaceScorer(Scorer);
 
                     #endregion
 
@@ -5291,14 +5348,13 @@ namespace Warp
                     float3 BestAngle = new float3(0, 0, 0);
                     float BestScore = -1e30f;
 
-                    for (int s = 0; s < Shifts.Count; s++)
-                        for (int a = 0; a < AnglesOri.Length; a++)
-                            if (AllResults[s][a] > BestScore)
-                            {
-                                BestScore = AllResults[s][a];
-                                BestAngle = AnglesOri[a];
-                                BestShift = Shifts[s];
-                            }
+                    for (int a = 0; a < AnglesOri.Length; a++)
+                        if (BestShiftIDs[a] >= 0 && BestShiftScores[a] > BestScore)
+                        {
+                            BestScore = BestShiftScores[a];
+                            BestAngle = AnglesOri[a];
+                            BestShift = Shifts[BestShiftIDs[a]];
+                        }
 
                     tableIn.SetRowValue(RowIndices[SubsetContinuousIDs[p]], "rlnOriginX", BestShift.X.ToString(CultureInfo.InvariantCulture));
                     tableIn.SetRowValue(RowIndices[SubsetContinuousIDs[p]], "rlnOriginY", BestShift.Y.ToString(CultureInfo.InvariantCulture));
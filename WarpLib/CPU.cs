@@ -12,18 +12,42 @@ namespace Warp
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CubicInterpIrregular")]
         public static extern void CubicInterpIrregular(int3 dimensions, float[] values, float[] positions, int npositions, float3 spacing, float[] output);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CubicInterpIrregularWithWeights")]
+        public static extern int CubicInterpIrregularWithWeights(int3 dimensions, float[] values, float[] positions, int npositions, float3 spacing, float[] output, int[] h_rowoffsets, int[] h_columns, float[] h_weights);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "InitProjector")]
         public static extern void InitProjector(int3 dims, int oversampling, float[] data, float[] initialized);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "BackprojectorReconstruct")]
         public static extern void BackprojectorReconstruct(int3 dimsori, int oversampling, float[] h_data, float[] h_weights, [MarshalAs(UnmanagedType.AnsiBStr)] string c_symmetry, bool do_reconstruct_ctf, float[] h_reconstruction);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SetReconstructionOptions")]
+        public static extern void SetReconstructionOptions(int nthreads, long memorybudget, [MarshalAs(UnmanagedType.AnsiBStr)] string c_scratchdir);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SetProjectorCacheDirectory")]
+        public static extern void SetProjectorCacheDirectory([MarshalAs(UnmanagedType.AnsiBStr)] string c_directory);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "GetAnglesCount")]
         public static extern int GetAnglesCount(int healpixorder, [MarshalAs(UnmanagedType.AnsiBStr)] string c_symmetry = "C1", float limittilt = -91);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "GetAngles")]
         public static extern void GetAngles(float[] h_angles, int healpixorder, [MarshalAs(UnmanagedType.AnsiBStr)] string c_symmetry = "C1", float limittilt = -91);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateAngleSampling")]
+        public static extern IntPtr CreateAngleSampling(int healpixorder, [MarshalAs(UnmanagedType.AnsiBStr)] string c_symmetry = "C1", float limittilt = -91);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyAngleSampling")]
+        public static extern void DestroyAngleSampling(IntPtr sampling);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "AngleSamplingSetNeighborhood")]
+        public static extern void AngleSamplingSetNeighborhood(IntPtr sampling, float3 prior, float maxangle);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "AngleSamplingCount")]
+        public static extern long AngleSamplingCount(IntPtr sampling);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "AngleSamplingGetChunk")]
+        public static extern int AngleSamplingGetChunk(IntPtr sampling, long first, int n, float[] h_angles);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "OptimizeWeights")]
         public static extern void OptimizeWeights(int nrecs,
                                                   float[] h_recft,
@@ -37,5 +61,27 @@ namespace Warp
                                                   float[] h_recsum2,
                                                   float[] h_weightsum1,
                                                   float[] h_weightsum2);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateWeightOptimizer")]
+        public static extern IntPtr CreateWeightOptimizer(float[] h_r2, int elements);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyWeightOptimizer")]
+        public static extern void DestroyWeightOptimizer(IntPtr optimizer);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "WeightOptimizerAddInputs")]
+        public static extern int WeightOptimizerAddInputs(IntPtr optimizer, int nrecs, float[] h_recft, float[] h_recweights);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "WeightOptimizerMapInputs")]
+        public static extern int WeightOptimizerMapInputs(IntPtr optimizer, int nrecs, [MarshalAs(UnmanagedType.AnsiBStr)] string c_path);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "WeightOptimizerAccumulate")]
+        public static extern void WeightOptimizerAccumulate(IntPtr optimizer,
+                                                            int[] h_subsets,
+                                                            float[] h_bfacs,
+                                                            float[] h_weightfactors,
+                                                            float[] h_recsum1,
+                                                            float[] h_recsum2,
+                                                            float[] h_weightsum1,
+                                                            float[] h_weightsum2);
     }
 }
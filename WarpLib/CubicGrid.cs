@@ -198,6 +198,42 @@ namespace Warp
             return Result;
         }
 
+        /// <summary>
+        /// Interpolates at the given positions, and returns the derivatives of each value w.r.t. the grid nodes
+        /// as a sparse matrix in CSR layout: row p spans rowOffsets[p] to rowOffsets[p + 1] in columns and weights.
+        /// The weights are only valid for the current node values.
+        /// </summary>
+        public float[] GetInterpolatedNativeWithWeights(float3[] positions, out int[] rowOffsets, out int[] columns, out float[] weights)
+        {
+            float[] Result = new float[positions.Length];
+            rowOffsets = new int[positions.Length + 1];
+            int[] AllColumns = new int[positions.Length * 64];
+            float[] AllWeights = new float[positions.Length * 64];
+
+            int NEntries = CPU.CubicInterpIrregularWithWeights(Dimensions, FlatValues, Helper.ToInterleaved(positions), positions.Length, Spacing, Result, rowOffsets, AllColumns, AllWeights);
+
+            columns = new int[NEntries];
+            weights = new float[NEntries];
+            Array.Copy(AllColumns, columns, NEntries);
+            Array.Copy(AllWeights, weights, NEntries);
+
+            return Result;
+        }
+
+        /// <summary>
+        /// Gradient w.r.t. the grid nodes (flat, X fastest) of a function whose gradient w.r.t. the interpolated values is known.
+        /// </summary>
+        public float[] GetNodeGradient(float[] valueGradient, int[] rowOffsets, int[] columns, float[] weights)
+        {
+            float[] Result = new float[Dimensions.Elements()];
+
+            for (int p = 0; p < valueGradient.Length; p++)
+                for (int i = rowOffsets[p]; i < rowOffsets[p + 1]; i++)
+                    Result[columns[i]] += valueGradient[p] * weights[i];
+
+            return Result;
+        }
+
         public CubicGrid Resize(int3 newSize)
         {
             float[] Result = new float[newSize.Elements()];
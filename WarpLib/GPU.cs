@@ -71,6 +71,96 @@ namespace Warp
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "HalfToSingle")]
         public static extern void HalfToSingle(IntPtr d_source, IntPtr d_dest, long elements);
 
+        // Precision.cu:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MallocDeviceStorage")]
+        public static extern IntPtr MallocDeviceStorage(long elements, StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SingleToStorage")]
+        public static extern void SingleToStorage(IntPtr d_source, IntPtr d_dest, long elements, StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "StorageToSingle")]
+        public static extern void StorageToSingle(IntPtr d_source, IntPtr d_dest, long elements, StoragePrecision precision);
+
+        // FFTPlanCache.cpp:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "FFTPlanCacheSetBudget")]
+        public static extern void FFTPlanCacheSetBudget(long bytes);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "FFTPlanCacheTrim")]
+        public static extern void FFTPlanCacheTrim();
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "FFTPlanCacheGetStats")]
+        public static extern void FFTPlanCacheGetStats(ref FFTPlanCacheStruct h_stats);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "FFTPlanCacheResetStats")]
+        public static extern void FFTPlanCacheResetStats();
+
+        // MemoryPool.cpp:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolBeginScope")]
+        public static extern void MemoryPoolBeginScope();
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolEndScope")]
+        public static extern void MemoryPoolEndScope();
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolSetRetainLimit")]
+        public static extern void MemoryPoolSetRetainLimit(long bytes);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolTrim")]
+        public static extern void MemoryPoolTrim();
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolGetStats")]
+        public static extern void MemoryPoolGetStats(ref MemoryPoolStruct h_stats);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MemoryPoolResetStats")]
+        public static extern void MemoryPoolResetStats();
+
+        // PhaseRamps.cpp:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreatePhaseRamps")]
+        public static extern IntPtr CreatePhaseRamps(float[] h_shiftfactors, IntPtr d_shiftfactors, uint length, int maxshifts);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyPhaseRamps")]
+        public static extern void DestroyPhaseRamps(IntPtr ramps);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "PhaseRampsGetStats")]
+        public static extern void PhaseRampsGetStats(IntPtr ramps, ref long h_hits, ref long h_misses);
+
+        // Scheduler.cpp:
+
+        [UnmanagedFunctionPointer(CallingConvention.StdCall)]
+        public delegate int SchedulerStageCallback(int task, int stage, int device);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateScheduler")]
+        public static extern IntPtr CreateScheduler(int ndevices, int workersperdevice, int nstages, SchedulerStageCallback callback);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyScheduler")]
+        public static extern void DestroyScheduler(IntPtr scheduler);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerSubmit")]
+        public static extern void SchedulerSubmit(IntPtr scheduler, int task, int device);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerWait")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool SchedulerWait(IntPtr scheduler, int timeoutms);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerCancel")]
+        public static extern void SchedulerCancel(IntPtr scheduler);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerGetProgress")]
+        public static extern void SchedulerGetProgress(IntPtr scheduler, ref SchedulerProgressStruct h_progress);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerGetStageTimings")]
+        public static extern void SchedulerGetStageTimings(IntPtr scheduler, double[] h_seconds, int[] h_counts);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerGetDeviceTimings")]
+        public static extern void SchedulerGetDeviceTimings(IntPtr scheduler, double[] h_busyseconds, int[] h_tasks);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SchedulerGetTaskTimings")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool SchedulerGetTaskTimings(IntPtr scheduler, int task, float[] h_seconds);
+
         // Comparison.cu:
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CompareParticles")]
         public static extern void CompareParticles(IntPtr d_particles,
@@ -112,7 +202,25 @@ namespace Warp
                                                 int2 dimsregion, 
                                                 int3 ctfgrid,
                                                 IntPtr d_outputall, 
-                                                IntPtr d_outputmean);
+                                                IntPtr d_outputmean,
+                                                StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateSpectrumAccumulator")]
+        public static extern IntPtr CreateSpectrumAccumulator(int2 dimsregion,
+                                                              int3[] h_origins,
+                                                              int norigins,
+                                                              int nframes,
+                                                              int3 ctfgrid,
+                                                              long memorybudget);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SpectrumAccumulatorAdd")]
+        public static extern void SpectrumAccumulatorAdd(IntPtr accumulator, IntPtr d_frames, int2 dimsframe, int nframes);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "SpectrumAccumulatorFinish")]
+        public static extern void SpectrumAccumulatorFinish(IntPtr accumulator, IntPtr d_outputall, IntPtr d_outputmean, StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroySpectrumAccumulator")]
+        public static extern void DestroySpectrumAccumulator(IntPtr accumulator);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CTFFitMean")]
         public static extern CTFStruct CTFFitMean(IntPtr d_ps, 
@@ -144,6 +252,29 @@ namespace Warp
                                                   float[] h_scores,
                                                   uint batch);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CTFCompareToSimGradients")]
+        public static extern void CTFCompareToSimGradients(IntPtr d_ps,
+                                                           IntPtr d_pscoords,
+                                                           IntPtr d_scale,
+                                                           uint length,
+                                                           CTFStruct[] h_sourceparams,
+                                                           float[] h_scores,
+                                                           float[] h_gradients,
+                                                           uint batch);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateCTFGrid")]
+        public static extern IntPtr CreateCTFGrid(IntPtr d_coords, uint length);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyCTFGrid")]
+        public static extern void DestroyCTFGrid(IntPtr grid);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CTFScoreCandidates")]
+        public static extern void CTFScoreCandidates(IntPtr grid,
+                                                     IntPtr d_ps,
+                                                     CTFStruct[] h_params,
+                                                     uint ncandidates,
+                                                     float[] h_scores);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CTFSubtractBackground")]
         public static extern void CTFSubtractBackground(IntPtr d_ps, 
                                                         IntPtr d_background, 
@@ -151,6 +282,26 @@ namespace Warp
                                                         IntPtr d_output, 
                                                         uint batch);
 
+        // CTFFitting.cpp:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CTFFitGrid")]
+        public static extern int CTFFitGrid(IntPtr d_ps,
+                                            IntPtr d_pscoords,
+                                            IntPtr d_scale,
+                                            uint length,
+                                            uint nspectra,
+                                            CTFStruct baseparams,
+                                            float[] h_defocusweights,
+                                            int ndefocus,
+                                            float[] h_phaseweights,
+                                            int nphase,
+                                            bool fitphase,
+                                            bool fitastigmatism,
+                                            bool fitbfactor,
+                                            int maxiterations,
+                                            float[] h_values,
+                                            ref float h_score);
+
         // ParticleCTF.cu:
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateParticleSpectra")]
         public static extern void CreateParticleSpectra(IntPtr d_frame,
@@ -221,7 +372,8 @@ namespace Warp
                                               int2 dimsregion,
                                               long[] h_mask,
                                               uint masklength,
-                                              IntPtr d_outputall);
+                                              IntPtr d_outputall,
+                                              StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftGetAverage")]
         public static extern void ShiftGetAverage(IntPtr d_phase,
@@ -231,7 +383,29 @@ namespace Warp
                                                   uint probelength,
                                                   IntPtr d_shifts,
                                                   uint nspectra,
-                                                  uint nframes);
+                                                  uint nframes,
+                                                  StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateShiftAverage")]
+        public static extern IntPtr CreateShiftAverage(uint length, uint npositions, uint nframes);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyShiftAverage")]
+        public static extern void DestroyShiftAverage(IntPtr average);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftAverageGetStats")]
+        public static extern void ShiftAverageGetStats(IntPtr average, ref long h_updated, ref long h_recomputed);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftGetAverageIncremental")]
+        public static extern void ShiftGetAverageIncremental(IntPtr average,
+                                                             IntPtr d_phase,
+                                                             IntPtr d_average,
+                                                             IntPtr d_shiftfactors,
+                                                             uint length,
+                                                             uint probelength,
+                                                             IntPtr d_shifts,
+                                                             uint npositions,
+                                                             uint nframes,
+                                                             StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftGetDiff")]
         public static extern void ShiftGetDiff(IntPtr d_phase,
@@ -242,7 +416,8 @@ namespace Warp
                                                IntPtr d_shifts,
                                                float[] h_diff,
                                                uint npositions,
-                                               uint nframes);
+                                               uint nframes,
+                                               StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftGetGrad")]
         public static extern void ShiftGetGrad(IntPtr d_phase,
@@ -253,11 +428,63 @@ namespace Warp
                                                IntPtr d_shifts,
                                                float[] h_grad,
                                                uint npositions,
-                                               uint nframes);
+                                               uint nframes,
+                                               StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ShiftGetDiffAndGrad")]
+        public static extern void ShiftGetDiffAndGrad(IntPtr d_phase,
+                                                      IntPtr d_average,
+                                                      IntPtr d_shiftfactors,
+                                                      uint length,
+                                                      uint probelength,
+                                                      IntPtr d_shifts,
+                                                      float[] h_diff,
+                                                      float[] h_grad,
+                                                      uint npositions,
+                                                      uint nframes,
+                                                      StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateMotionBlur")]
         public static extern void CreateMotionBlur(IntPtr d_output, int3 dims, float[] h_shifts, uint nshifts, uint batch);
 
+        // MovieReader.cpp:
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieReaderOpen")]
+        public static extern IntPtr MovieReaderOpen([MarshalAs(UnmanagedType.AnsiBStr)] string c_path, int ringsize, ref int3 h_dims);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieReaderOpenGroups")]
+        public static extern IntPtr MovieReaderOpenGroups([MarshalAs(UnmanagedType.AnsiBStr)] string c_path, int ringsize, int[] h_groupfirst, int[] h_grouplength, int ngroups, int upsampling, ref int3 h_dims);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieGetDims")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool MovieGetDims([MarshalAs(UnmanagedType.AnsiBStr)] string c_path, ref int3 h_dims);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieReaderAcquire")]
+        public static extern int MovieReaderAcquire(IntPtr reader, ref IntPtr h_frame);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieReaderRelease")]
+        public static extern void MovieReaderRelease(IntPtr reader);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieReaderClose")]
+        public static extern void MovieReaderClose(IntPtr reader);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "MovieIngest")]
+        [return: MarshalAs(UnmanagedType.I1)]
+        public static extern bool MovieIngest([MarshalAs(UnmanagedType.AnsiBStr)] string c_path,
+                                              int ringsize,
+                                              int[] h_groupfirst,
+                                              int[] h_grouplength,
+                                              int ngroups,
+                                              int upsampling,
+                                              IntPtr d_stack,
+                                              int3[] h_shiftorigins,
+                                              int nshiftorigins,
+                                              int2 dimsshiftregion,
+                                              long[] h_shiftmask,
+                                              uint shiftmasklength,
+                                              IntPtr d_shiftoutput,
+                                              IntPtr spectrumaccumulator);
+
         // ParticleShift.cu:
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateParticleShift")]
         public static extern void CreateParticleShift(IntPtr d_frame,
@@ -279,7 +506,8 @@ namespace Warp
                                                       float pixelangle,
                                                       IntPtr d_outputparticles,
                                                       IntPtr d_outputprojections,
-                                                      IntPtr d_outputinvsigma);
+                                                      IntPtr d_outputinvsigma,
+                                                      StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ParticleShiftGetDiff")]
         public static extern void ParticleShiftGetDiff(IntPtr d_phase,
@@ -291,7 +519,8 @@ namespace Warp
                                                        IntPtr d_shifts,
                                                        float[] h_diff,
                                                        uint npositions,
-                                                       uint nframes);
+                                                       uint nframes,
+                                                       StoragePrecision precision);
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ParticleShiftGetGrad")]
         public static extern void ParticleShiftGetGrad(IntPtr d_phase,
@@ -303,12 +532,43 @@ namespace Warp
                                                        IntPtr d_shifts,
                                                        float[] h_grad,
                                                        uint npositions,
-                                                       uint nframes);
+                                                       uint nframes,
+                                                       StoragePrecision precision);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "ParticleShiftGetDiffAndGrad")]
+        public static extern void ParticleShiftGetDiffAndGrad(IntPtr d_phase,
+                                                              IntPtr d_average,
+                                                              IntPtr d_shiftfactors,
+                                                              IntPtr d_invsigma,
+                                                              uint length,
+                                                              uint probelength,
+                                                              IntPtr d_shifts,
+                                                              float[] h_diff,
+                                                              float[] h_grad,
+                                                              uint npositions,
+                                                              uint nframes,
+                                                              StoragePrecision precision);
 
         // Polishing.cu:
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreatePolishing")]
         public static extern void CreatePolishing(IntPtr d_particles, IntPtr d_particlesft, IntPtr d_masks, int2 dims, int2 dimscropped, int nparticles, int nframes);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreatePolishingGroups")]
+        public static extern void CreatePolishingGroups(IntPtr d_particles,
+                                                        IntPtr d_particlesft,
+                                                        int2 dims,
+                                                        int2 dimscropped,
+                                                        int nparticles,
+                                                        int nframes,
+                                                        int[] h_groupfirst,
+                                                        int[] h_grouplength,
+                                                        int ngroups,
+                                                        float[] h_frameweights,
+                                                        float maskradius,
+                                                        float maskfalloff,
+                                                        int batchsize,
+                                                        StoragePrecision precision);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "PolishingGetDiff")]
         public static extern void PolishingGetDiff(IntPtr d_phase,
                                                    IntPtr d_average,
@@ -321,7 +581,8 @@ namespace Warp
                                                    float[] h_diff,
                                                    float[] h_diffall,
                                                    uint npositions,
-                                                   uint nframes);
+                                                   uint nframes,
+                                                   StoragePrecision precision);
 
         // TomoRefine.cu:
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "TomoRefineGetDiff")]
@@ -347,6 +608,23 @@ namespace Warp
                                                          float[] h_shifts,
                                                          float[] h_result);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "CreateTomoRealspaceScorer")]
+        public static extern IntPtr CreateTomoRealspaceScorer(IntPtr d_experimental, IntPtr d_mask, int2 dims, uint ntilts);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "DestroyTomoRealspaceScorer")]
+        public static extern void DestroyTomoRealspaceScorer(IntPtr scorer);
+
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "TomoRealspaceScorerCorrelate")]
+        public static extern void TomoRealspaceScorerCorrelate(IntPtr scorer,
+                                                               IntPtr d_projections,
+                                                               uint nprojections,
+                                                               IntPtr d_weights,
+                                                               float[] h_shifts,
+                                                               uint nshifts,
+                                                               int topk,
+                                                               int[] h_bestshifts,
+                                                               float[] h_bestscores);
+
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "TomoGlobalAlign")]
         public static extern void TomoGlobalAlign(IntPtr d_experimental,
                                                   IntPtr d_shiftfactors,
@@ -366,6 +644,29 @@ namespace Warp
                                                   int[] h_bestshifts,
                                                   float[] h_bestscores);
 
+        [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "TomoGlobalAlignHierarchical")]
+        public static extern void TomoGlobalAlignHierarchical(IntPtr d_experimental,
+                                                              IntPtr d_shiftfactors,
+                                                              IntPtr d_ctf,
+                                                              IntPtr d_weights,
+                                                              int2 dims,
+                                                              IntPtr d_ref,
+                                                              int3 dimsref,
+                                                              int refsupersample,
+                                                              float[] h_angles,
+                                                              uint nangles,
+                                                              float[] h_shifts,
+                                                              uint nshifts,
+                                                              uint nparticles,
+                                                              uint ntilts,
+                                                              float coarsecutoff,
+                                                              int topk,
+                                                              float angleradius,
+                                                              float shiftradius,
+                                                              int[] h_bestangles,
+                                                              int[] h_bestshifts,
+                                                              float[] h_bestscores);
+
         // Tools.cu:
 
         [DllImport("GPUAcceleration.dll", CharSet = CharSet.Ansi, SetLastError = true, CallingConvention = CallingConvention.StdCall, EntryPoint = "FFT")]
@@ -556,4 +857,71 @@ namespace Warp
             ID = id;
         }
     }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct MemoryPoolStruct
+    {
+        public long BytesRequested;
+        public long BytesInUse;
+        public long BytesCached;
+        public long BytesReserved;
+        public long PeakInUse;
+        public long PeakReserved;
+        public long NAllocations;
+        public long NCacheHits;
+        public long NSystemAllocations;
+        public long NSystemFrees;
+
+        /// <summary>
+        /// Share of the live memory lost to rounding up to size classes
+        /// </summary>
+        public double InternalFragmentation => BytesInUse > 0 ? 1.0 - (double)BytesRequested / BytesInUse : 0;
+
+        /// <summary>
+        /// Share of the reserved memory sitting in the cache
+        /// </summary>
+        public double CachedFraction => BytesReserved > 0 ? (double)BytesCached / BytesReserved : 0;
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct FFTPlanCacheStruct
+    {
+        public long NRequests;
+        public long NHits;
+        public long NCreated;
+        public long NEvicted;
+        public long NPlans;
+        public long NPlansInUse;
+        public long BytesCached;
+        public long Budget;
+        public double CreationSeconds;
+        public double MaxCreationSeconds;
+
+        /// <summary>
+        /// Share of plan requests served without creating a plan
+        /// </summary>
+        public double HitRate => NRequests > 0 ? (double)NHits / NRequests : 0;
+    }
+
+    /// <summary>
+    /// Storage format of spectrum and phase buffers, anything computed from them is fp32
+    /// </summary>
+    public enum StoragePrecision
+    {
+        FP32 = 0,
+        FP16 = 1,
+        BF16 = 2
+    }
+
+    [StructLayout(LayoutKind.Sequential)]
+    public struct SchedulerProgressStruct
+    {
+        public int NSubmitted;
+        public int NQueued;
+        public int NRunning;
+        public int NCompleted;
+        public int NFailed;
+        public int NCancelled;
+        public int NStolen;
+    }
 }
@@ -0,0 +1,106 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Runtime.InteropServices;
+using System.Text;
+using System.Threading.Tasks;
+using Warp.Tools;
+
+namespace Warp.Headers
+{
+    public class HeaderEER : MapHeader
+    {
+        // Grouping for EER movies opened through MapHeader.ReadFromFile, set from the processing options
+        public static int DefaultGroupFrames = 32;
+        public static int DefaultUpsampling = 1;
+
+        private string Path;
+        public int NFractions;
+        public int GroupFrames;
+        public int Upsampling;
+
+        public HeaderEER(string path) : this(path, DefaultGroupFrames, DefaultUpsampling)
+        {
+        }
+
+        public HeaderEER(string path, int groupFrames, int upsampling)
+        {
+            Path = path;
+
+            int3 FractionDims = new int3(0, 0, 0);
+            if (!GPU.MovieGetDims(path, ref FractionDims))
+                throw new Exception("Not a valid EER file.");
+
+            NFractions = FractionDims.Z;
+            GroupFrames = Math.Max(1, Math.Min(groupFrames, NFractions));
+            Upsampling = upsampling;
+
+            Dimensions = new int3(FractionDims.X * upsampling, FractionDims.Y * upsampling, NFractions / GroupFrames);
+        }
+
+        // Each frame is the sum of GroupFrames consecutive fractions, the ones left over at the end are dropped
+        public void GetGroups(out int[] first, out int[] length)
+        {
+            first = new int[Dimensions.Z];
+            length = new int[Dimensions.Z];
+            for (int z = 0; z < Dimensions.Z; z++)
+            {
+                first[z] = z * GroupFrames;
+                length[z] = GroupFrames;
+            }
+        }
+
+        public override void Write(BinaryWriter writer)
+        {
+            throw new NotImplementedException();
+        }
+
+        public float[][] ReadData(int layer = -1)
+        {
+            int[] GroupFirst, GroupLength;
+            GetGroups(out GroupFirst, out GroupLength);
+            if (layer >= 0)
+            {
+                GroupFirst = new[] { GroupFirst[layer] };
+                GroupLength = new[] { GroupLength[layer] };
+            }
+
+            int3 Dims = new int3(0, 0, 0);
+            IntPtr Reader = GPU.MovieReaderOpenGroups(Path, 2, GroupFirst, GroupLength, GroupFirst.Length, Upsampling, ref Dims);
+            if (Reader == IntPtr.Zero)
+                throw new Exception("Could not open EER file.");
+
+            float[][] Slices = new float[Dims.Z][];
+            try
+            {
+                for (int z = 0; z < Dims.Z; z++)
+                {
+                    IntPtr h_frame = IntPtr.Zero;
+                    if (GPU.MovieReaderAcquire(Reader, ref h_frame) != z)
+                        throw new Exception("Could not decode EER fractions.");
+
+                    Slices[z] = new float[Dims.ElementsSlice()];
+                    Marshal.Copy(h_frame, Slices[z], 0, Slices[z].Length);
+                    GPU.MovieReaderRelease(Reader);
+                }
+            }
+            finally
+            {
+                GPU.MovieReaderClose(Reader);
+            }
+
+            return Slices;
+        }
+
+        public override Type GetValueType()
+        {
+            return typeof(float);
+        }
+
+        public override void SetValueType(Type t)
+        {
+            throw new NotImplementedException();
+        }
+    }
+}
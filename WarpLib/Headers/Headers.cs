@@ -26,6 +26,8 @@ namespace Warp.Headers
                 Header = new HeaderEM(reader);
             else if (info.Extension.ToLower() == ".tif" || info.Extension.ToLower() == ".tiff")
                 Header = new HeaderTiff(info.FullName);
+            else if (info.Extension.ToLower() == ".eer")
+                Header = new HeaderEER(info.FullName);
             else if (info.Extension.ToLower() == ".dat")
             {
                 long SliceElements = headerlessSliceDims.Elements() * ImageFormatsHelper.SizeOf(headerlessType);
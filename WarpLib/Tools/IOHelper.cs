@@ -58,7 +58,7 @@ namespace Warp.Tools
                 ValueType = Header.GetValueType();
                 Data = new float[layer < 0 ? Header.Dimensions.Z : 1][];
 
-                if (Header.GetType() != typeof(HeaderTiff))
+                if (Header.GetType() != typeof(HeaderTiff) && Header.GetType() != typeof(HeaderEER))
                     for (int z = 0; z < Data.Length; z++)
                     {
                         if (layer >= 0)
@@ -115,10 +115,14 @@ namespace Warp.Tools
                             }
                         }
                     }
-                else
+                else if (Header.GetType() == typeof(HeaderTiff))
                 {
                     Data = ((HeaderTiff)Header).ReadData(layer);
                 }
+                else
+                {
+                    Data = ((HeaderEER)Header).ReadData(layer);
+                }
             }
 
             return Data;